@@ -44,10 +44,8 @@
 #define AT45DB_CHIP_ERASE_ADDR 0x94809A /* Magic address. See usage. */
 #define AT45DB_BUFFER1_WRITE 0x84
 #define AT45DB_BUFFER1_PAGE_PROGRAM 0x88
-/* Buffer 2 is unused yet.
 #define AT45DB_BUFFER2_WRITE 0x87
 #define AT45DB_BUFFER2_PAGE_PROGRAM 0x89
-*/
 
 static uint8_t at45db_read_status_register(struct flashctx *flash, uint8_t *status)
 {
@@ -239,23 +237,30 @@ int spi_read_at45db(struct flashctx *flash, uint8_t *buf, unsigned int addr, uns
 		return 1;
 	}
 
-	/* We have to split this up into chunks to fit within the programmer's read size limit, but those
-	 * chunks can cross page boundaries. */
+	/* With power-of-two pages the addresses are linear, so the master's own (possibly much faster) read
+	 * can be used as is. */
+	if ((page_size & (page_size - 1)) == 0)
+		return flash->mst->spi.read(flash, buf, addr, len);
+
+	/* Otherwise we have to split this up into chunks to fit within the programmer's read size limit, but
+	 * those chunks can cross page boundaries. They are queued, so masters that can do several reads in one
+	 * round trip get them all at once. */
 	const unsigned int max_data_read = flash->mst->spi.max_data_read;
 	const unsigned int max_chunk = (max_data_read > 0) ? max_data_read : page_size;
-	while (len > 0) {
+	int ret = 0;
+	while (len > 0 && !ret) {
 		unsigned int chunk = min(max_chunk, len);
-		int ret = spi_nbyte_read(flash, at45db_convert_addr(addr, page_size), buf, chunk);
-		if (ret) {
-			msg_cerr("%s: error sending read command!\n", __func__);
-			return ret;
-		}
+		ret = spi_queue_nbyte_read(flash, at45db_convert_addr(addr, page_size), buf, chunk);
 		addr += chunk;
 		buf += chunk;
 		len -= chunk;
 	}
+	if (spi_queue_flush(flash))
+		ret = 1;
+	if (ret)
+		msg_cerr("%s: error sending read command!\n", __func__);
 
-	return 0;
+	return ret;
 }
 
 /* Legacy continuous read, used where spi_read_at45db() is not available.
@@ -453,7 +458,16 @@ int spi_erase_at45cs_sector(struct flashctx *flash, unsigned int addr, unsigned
 	return at45db_erase(flash, opcode, at45db_convert_addr(addr, page_size), 200000, 100);
 }
 
-static int at45db_fill_buffer1(struct flashctx *flash, const uint8_t *bytes, unsigned int off, unsigned int len)
+/* The smallest parts have a single SRAM buffer, all others have two. */
+static unsigned int at45db_buffer_count(struct flashctx *flash)
+{
+	const unsigned int pages = flash->chip->total_size * 1024 / flash->chip->page_size;
+	return (pages <= 512) ? 1 : 2;
+}
+
+/* Queue writing to SRAM buffer @buffer (0 or 1), see spi_queue_flush(). */
+static int at45db_fill_buffer(struct flashctx *flash, unsigned int buffer, const uint8_t *bytes,
+			      unsigned int off, unsigned int len)
 {
 	const unsigned int page_size = flash->chip->page_size;
 	if ((off + len) > page_size) {
@@ -462,20 +476,20 @@ static int at45db_fill_buffer1(struct flashctx *flash, const uint8_t *bytes, uns
 		return 1;
 	}
 
-	/* Create a suitable buffer to store opcode, address and data chunks for buffer1. */
+	/* Create a suitable buffer to store opcode, address and data chunks for the SRAM buffer. */
 	const unsigned int max_data_write = flash->mst->spi.max_data_write;
 	const unsigned int max_chunk = (max_data_write > 0 && max_data_write <= page_size) ?
 				       max_data_write : page_size;
 	uint8_t buf[4 + max_chunk];
 
-	buf[0] = AT45DB_BUFFER1_WRITE;
+	buf[0] = buffer ? AT45DB_BUFFER2_WRITE : AT45DB_BUFFER1_WRITE;
 	while (off < page_size) {
 		unsigned int cur_chunk = min(max_chunk, page_size - off);
 		buf[1] = (off >> 16) & 0xff;
 		buf[2] = (off >> 8) & 0xff;
 		buf[3] = (off >> 0) & 0xff;
 		memcpy(&buf[4], bytes + off, cur_chunk);
-		int ret = spi_send_command(flash, 4 + cur_chunk, 0, buf, NULL);
+		int ret = spi_queue_command(flash, 4 + cur_chunk, 0, buf, NULL);
 		if (ret != 0) {
 			msg_cerr("%s: error sending buffer write!\n", __func__);
 			return ret;
@@ -485,53 +499,42 @@ static int at45db_fill_buffer1(struct flashctx *flash, const uint8_t *bytes, uns
 	return 0;
 }
 
-static int at45db_commit_buffer1(struct flashctx *flash, unsigned int at45db_addr)
+/* Queue programming SRAM buffer @buffer into the page at @at45db_addr. The chip is busy afterwards. */
+static int at45db_commit_buffer(struct flashctx *flash, unsigned int buffer, unsigned int at45db_addr)
 {
 	const uint8_t cmd[] = {
-		AT45DB_BUFFER1_PAGE_PROGRAM,
+		buffer ? AT45DB_BUFFER2_PAGE_PROGRAM : AT45DB_BUFFER1_PAGE_PROGRAM,
 		(at45db_addr >> 16) & 0xff,
 		(at45db_addr >> 8) & 0xff,
 		(at45db_addr >> 0) & 0xff
 	};
 
 	/* Send buffer to device. */
-	int ret = spi_send_command(flash, sizeof(cmd), 0, cmd, NULL);
-	if (ret != 0) {
+	int ret = spi_queue_command(flash, sizeof(cmd), 0, cmd, NULL);
+	if (ret != 0)
 		msg_cerr("%s: error sending buffer to main memory command!\n", __func__);
-		return ret;
-	}
-
-	/* Wait for completion (typically a few ms). */
-	ret = at45db_wait_ready(flash, 250, 200); // 50 ms
-	if (ret != 0) {
-		msg_cerr("%s: chip did not became ready again!\n", __func__);
-		return ret;
-	}
-
-	return 0;
+	return ret;
 }
 
-static int at45db_program_page(struct flashctx *flash, const uint8_t *buf, unsigned int at45db_addr)
+/* Wait for the previous page program to complete (typically a few ms). Sends anything queued first. */
+static int at45db_wait_program(struct flashctx *flash)
 {
-	int ret = at45db_fill_buffer1(flash, buf, 0, flash->chip->page_size);
-	if (ret != 0) {
-		msg_cerr("%s: filling the buffer failed!\n", __func__);
-		return ret;
-	}
-
-	ret = at45db_commit_buffer1(flash, at45db_addr);
-	if (ret != 0) {
-		msg_cerr("%s: committing page failed!\n", __func__);
-		return ret;
-	}
-
-	return 0;
+	int ret = at45db_wait_ready(flash, 250, 200); // 50 ms
+	if (ret != 0)
+		msg_cerr("%s: chip did not became ready again!\n", __func__);
+	return ret;
 }
 
+/*
+ * Pages are written through the SRAM buffers in turn: while one of them is being programmed into the array
+ * the next page goes into the other one, so the transfer hides most of the program time. Chips with a
+ * single buffer have to wait until it is free again.
+ */
 int spi_write_at45db(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
 {
 	const unsigned int page_size = flash->chip->page_size;
 	const unsigned int total_size = flash->chip->total_size;
+	const unsigned int buffers = at45db_buffer_count(flash);
 	
 	if ((start % page_size) != 0 || (len % page_size) != 0) {
 		msg_cerr("%s: cannot write partial pages: start=%u, len=%u\n", __func__, start, len);
@@ -544,12 +547,22 @@ int spi_write_at45db(struct flashctx *flash, const uint8_t *buf, unsigned int st
 		return 1;
 	}
 
-	unsigned int i;
+	unsigned int i, buffer = 0;
 	for (i = 0; i < len; i += page_size) {
-		if (at45db_program_page(flash, buf + i, at45db_convert_addr(start + i, page_size)) != 0) {
+		if (buffers == 1 && at45db_wait_program(flash) != 0)
+			return 1;
+		if (at45db_fill_buffer(flash, buffer, buf + i, 0, page_size) != 0) {
+			msg_cerr("%s: filling the buffer failed!\n", __func__);
+			return 1;
+		}
+		/* The other buffer may still be busy being programmed. */
+		if (buffers == 2 && at45db_wait_program(flash) != 0)
+			return 1;
+		if (at45db_commit_buffer(flash, buffer, at45db_convert_addr(start + i, page_size)) != 0) {
 			msg_cerr("Writing page %u failed!\n", i);
 			return 1;
 		}
+		buffer = (buffer + 1) % buffers;
 	}
-	return 0;
+	return at45db_wait_program(flash);
 }
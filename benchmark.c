@@ -0,0 +1,419 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * --benchmark: measure how fast the programmer reads the chip with every read command and chunk size it can
+ * use, how long a status register read, the erase of a block of every eraser and programming take. The
+ * results are kept as a timing profile below $XDG_CACHE_HOME, named after the programmer, its parameters and
+ * the chip IDs.
+ * Once the chip was found, later runs load it (timing_profile_load()): the erase planner then estimates with
+ * the measured times instead of data sheet numbers, WIP polling starts from the measured command times and
+ * spispeed=auto doesn't raise the clock beyond the rate where reads stop getting faster.
+ *
+ * Erases and programs only happen in a scratch area, the regions included with -i or the whole chip with
+ * --force. Without either, only reads and status register reads are measured.
+ *
+ * The profile has one value per line, unknown lines are ignored:
+ *
+ *	flashrom profile 1
+ *	chip <vendor> <name>
+ *	setup <programmer parameters>
+ *	rdsr_ns <round trip of a status register read>
+ *	read_bps <bytes per second read with the normal read function>
+ *	read <opcode> <chunk size> <bytes per second>	(informational, chunk size 0 is the normal function)
+ *	clock <kHz> <bytes per second>
+ *	erase <eraser> <block size> <us>
+ *	program_ns <ns per byte programmed>
+ *	wip <opcode> <us until the status register said done>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/time.h>
+#include "flash.h"
+#include "chipdrivers.h"
+#include "programmer.h"
+#include "spi.h"
+
+#define PROFILE_MAGIC		"flashrom profile 1"
+/* Reads get 4 times longer until one takes at least this long (or reads the whole chip). */
+#define BENCH_MIN_US		(200 * 1000)
+#define BENCH_MAX_READ		(16 * 1024 * 1024)
+#define BENCH_CLOCK_READ	(64 * 1024)
+#define BENCH_RDSR_READS	256
+/* Blocks up to this size are erased several times, the fastest erase counts. */
+#define BENCH_ERASE_REPEAT_MAX	(256 * 1024)
+#define BENCH_ERASE_REPEATS	3
+#define BENCH_PROGRAM_MAX	(64 * 1024)
+
+static struct timing_profile loaded_profile;
+
+static uint64_t now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* A different device, port or clock is a different setup, the parameters are hashed into the name. */
+static void profile_name(const struct flashctx *flash, char *name, size_t len)
+{
+	const char *params = programmer_params();
+
+	snprintf(name, len, "flashrom-profile-%s-%08x-%04x-%04x", programmer_name(),
+		 crc32_update(0, (const uint8_t *)params, strlen(params)), flash->chip->manufacture_id,
+		 flash->chip->model_id);
+}
+
+/* The lines identifying the chip and the setup, after the magic. */
+static void profile_chip_line(const struct flashctx *flash, char *line, size_t len)
+{
+	snprintf(line, len, "chip %s %s\nsetup %s\n", flash->chip->vendor, flash->chip->name,
+		 programmer_params());
+}
+
+/*
+ * Load the timing profile measured earlier for this programmer and chip and seed the WIP polling with it.
+ * Returns NULL if there is none.
+ */
+const struct timing_profile *timing_profile_load(struct flashctx *flash)
+{
+	struct timing_profile *p = &loaded_profile;
+	char name[96], chip[512], line[512];
+	unsigned int a, b, c;
+	size_t n;
+	FILE *f;
+
+	profile_name(flash, name, sizeof(name));
+	f = open_cache_file(name, "r");
+	if (!f)
+		return NULL;
+	profile_chip_line(flash, chip, sizeof(chip));
+	/* The chip and setup lines have to match as a whole, the name is only a hash. */
+	n = strlen(chip);
+	if (!fgets(line, sizeof(line), f) || strcmp(line, PROFILE_MAGIC "\n") ||
+	    fread(line, 1, n, f) != n || memcmp(line, chip, n)) {
+		fclose(f);
+		return NULL;
+	}
+	memset(p, 0, sizeof(*p));
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "rdsr_ns %u", &a) == 1) {
+			p->rdsr_ns = a;
+		} else if (sscanf(line, "read_bps %u", &a) == 1) {
+			p->read_bps = a;
+		} else if (sscanf(line, "clock %u %u", &a, &b) == 2) {
+			if (p->clocks < PROFILE_MAX_CLOCKS) {
+				p->clock[p->clocks].khz = a;
+				p->clock[p->clocks].read_bps = b;
+				p->clocks++;
+			}
+		} else if (sscanf(line, "erase %u %u %u", &a, &b, &c) == 3) {
+			if (a < NUM_ERASEFUNCTIONS && b) {
+				p->erase_len[a] = b;
+				p->erase_us[a] = c;
+			}
+		} else if (sscanf(line, "program_ns %u", &a) == 1) {
+			p->program_ns = a;
+		} else if (sscanf(line, "wip %u %u", &a, &b) == 2) {
+			if (a < 256 && flash->chip->bustype == BUS_SPI)
+				spi_seed_wip_estimate(flash, a, b);
+		}
+	}
+	fclose(f);
+	msg_cdbg("Using the timing profile measured with --benchmark.\n");
+	return p;
+}
+
+static int bench_read(struct flashctx *flash, uint8_t *buf, unsigned int len, unsigned int chunk)
+{
+	if (chunk)
+		return spi_read_chunked(flash, buf, 0, len, chunk);
+	return flash->chip->read(flash, buf, 0, len);
+}
+
+/*
+ * Bytes per second reading from the start of the chip with the normal read function (@chunk 0) or SPI
+ * reads of @chunk bytes. Returns 0 if the read failed.
+ */
+static unsigned int measure_read(struct flashctx *flash, uint8_t *buf, unsigned int maxlen, unsigned int chunk)
+{
+	unsigned int len = min(4096, maxlen);
+	uint64_t start, us, bps;
+
+	for (;;) {
+		start = now_us();
+		if (bench_read(flash, buf, len, chunk))
+			return 0;
+		us = now_us() - start;
+		if (us >= BENCH_MIN_US || len == maxlen)
+			break;
+		len = min(len * 4, maxlen);
+	}
+	bps = (uint64_t)len * 1000000 / (us ? us : 1);
+	return bps > UINT_MAX ? UINT_MAX : bps;
+}
+
+static void bench_reads(struct flashctx *flash, FILE *f, struct timing_profile *p)
+{
+	static const unsigned int chunks[] = { 256, 4096, 64 * 1024 };
+	const unsigned int maxlen = min(flash->chip->total_size * 1024, BENCH_MAX_READ);
+	unsigned int i, bps;
+	uint8_t *buf = malloc(maxlen);
+	int n, opcode;
+
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		return;
+	}
+	p->read_bps = measure_read(flash, buf, maxlen, 0);
+	msg_ginfo("Reading:                         %8u kB/s\n", p->read_bps / 1024);
+	fprintf(f, "read_bps %u\n", p->read_bps);
+
+	if (flash->chip->bustype != BUS_SPI || !(flash->mst->buses_supported & BUS_SPI)) {
+		free(buf);
+		return;
+	}
+	for (n = 0; (opcode = spi_force_read_op(flash, n)) != SPI_READ_OP_END; n++) {
+		if (opcode < 0)
+			continue;
+		bps = measure_read(flash, buf, maxlen, 0);
+		msg_ginfo("  opcode 0x%02x:                   %8u kB/s\n", opcode, bps / 1024);
+		fprintf(f, "read %u 0 %u\n", opcode, bps);
+		for (i = 0; i < ARRAY_SIZE(chunks); i++) {
+			if (flash->mst->spi.max_data_read == MAX_DATA_UNSPECIFIED ||
+			    chunks[i] > flash->mst->spi.max_data_read)
+				break;
+			bps = measure_read(flash, buf, maxlen, chunks[i]);
+			msg_ginfo("  opcode 0x%02x, %5u byte chunks: %8u kB/s\n", opcode, chunks[i], bps / 1024);
+			fprintf(f, "read %u %u %u\n", opcode, chunks[i], bps);
+		}
+	}
+	spi_force_read_op(flash, -1);
+	free(buf);
+}
+
+/* Read rates at all SPI clocks for spispeed=auto, up to the first one that reads something different. */
+static void bench_clocks(struct flashctx *flash, FILE *f, struct timing_profile *p)
+{
+	const struct spi_master *mst = &flash->mst->spi;
+	const unsigned int len = min(flash->chip->total_size * 1024, BENCH_CLOCK_READ);
+	const unsigned int current = spi_autospeed_khz();
+	uint8_t *ref = malloc(len), *buf = malloc(len);
+	unsigned int i, bps;
+
+	if (!ref || !buf) {
+		msg_gerr("Out of memory!\n");
+		goto out;
+	}
+	if (flash->chip->read(flash, ref, 0, len))
+		goto out;
+	for (i = 0; mst->speeds_khz[i] && p->clocks < PROFILE_MAX_CLOCKS; i++) {
+		if (mst->set_speed(mst->speeds_khz[i]))
+			break;
+		bps = measure_read(flash, buf, len, 0);
+		if (!bps || memcmp(buf, ref, len))
+			break;
+		msg_ginfo("  at %6u kHz:                  %8u kB/s\n", mst->speeds_khz[i], bps / 1024);
+		fprintf(f, "clock %u %u\n", mst->speeds_khz[i], bps);
+		p->clock[p->clocks].khz = mst->speeds_khz[i];
+		p->clock[p->clocks].read_bps = bps;
+		p->clocks++;
+	}
+	if (mst->set_speed(current))
+		msg_gerr("Can't set the SPI clock back to %u kHz!\n", current);
+out:
+	free(ref);
+	free(buf);
+}
+
+static void bench_rdsr(struct flashctx *flash, FILE *f, struct timing_profile *p)
+{
+	uint64_t start = now_us();
+	unsigned int i;
+
+	for (i = 0; i < BENCH_RDSR_READS; i++)
+		spi_read_status_register(flash);
+	p->rdsr_ns = (now_us() - start) * 1000 / BENCH_RDSR_READS;
+	msg_ginfo("Status register read: %.1f us\n", p->rdsr_ns / 1000.0);
+	fprintf(f, "rdsr_ns %u\n", p->rdsr_ns);
+}
+
+/* The first block of eraser @k within @scratch, returns its size or 0 if there is none. */
+static unsigned int scratch_block(const struct flashctx *flash, int k, const struct range_list *scratch,
+				  unsigned int *start)
+{
+	const struct block_eraser *eraser = &flash->chip->block_erasers[k];
+	unsigned int i, j, addr = 0;
+
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		for (j = 0; j < eraser->eraseblocks[i].count; j++, addr += eraser->eraseblocks[i].size) {
+			if (range_list_contains(scratch, addr, eraser->eraseblocks[i].size)) {
+				*start = addr;
+				return eraser->eraseblocks[i].size;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Erase and program in @scratch. Returns 0 on success. */
+static int bench_erase_program(struct flashctx *flash, FILE *f, struct timing_profile *p,
+			       const struct range_list *scratch)
+{
+	unsigned int start, len, best_start = 0, best_len = 0, i, us;
+	uint64_t t;
+	uint8_t *pattern;
+	int k;
+
+	for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
+		erasefunc_t *fn = flash->chip->block_erasers[k].block_erase;
+		if (check_block_eraser(flash, k, 0) || !(len = scratch_block(flash, k, scratch, &start)))
+			continue;
+		for (i = 0; i < (len <= BENCH_ERASE_REPEAT_MAX ? BENCH_ERASE_REPEATS : 1); i++) {
+			t = now_us();
+			if (fn(flash, start, len)) {
+				msg_gerr("Erasing the block at 0x%06x failed!\n", start);
+				return 1;
+			}
+			t = now_us() - t;
+			if (!i || t < p->erase_us[k])
+				p->erase_us[k] = t;
+		}
+		p->erase_len[k] = len;
+		msg_ginfo("Erasing %u bytes with eraser %d: %u ms\n", len, k, p->erase_us[k] / 1000);
+		fprintf(f, "erase %d %u %u\n", k, len, p->erase_us[k]);
+		if (!best_len || len < best_len) {
+			best_start = start;
+			best_len = len;
+		}
+	}
+	if (!best_len) {
+		msg_ginfo("No erase block fits into the scratch area, erases and programs can't be measured.\n");
+		return 0;
+	}
+
+	/* Program a test pattern into the smallest block, erased once more. */
+	for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
+		if (p->erase_len[k] == best_len)
+			break;
+	}
+	if (flash->chip->block_erasers[k].block_erase(flash, best_start, best_len))
+		return 1;
+	len = min(best_len, BENCH_PROGRAM_MAX);
+	pattern = malloc(len);
+	if (!pattern) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	generate_testpattern(pattern, len, 8);
+	t = now_us();
+	if (flash->chip->write(flash, pattern, best_start, len)) {
+		msg_gerr("Programming at 0x%06x failed!\n", best_start);
+		free(pattern);
+		return 1;
+	}
+	us = now_us() - t;
+	free(pattern);
+	p->program_ns = (uint64_t)us * 1000 / len;
+	msg_ginfo("Programming %u bytes: %u ms (%u ns per byte)\n", len, us / 1000, p->program_ns);
+	fprintf(f, "program_ns %u\n", p->program_ns);
+	return 0;
+}
+
+/*
+ * Run the benchmark and write the profile. Erases and programs happen in the included layout regions, with
+ * @force on the whole chip if none were included.
+ */
+int benchmark_flash(struct flashctx *flash, int force)
+{
+	const unsigned int size = flash->chip->total_size * 1024;
+	struct range_list scratch = { 0 };
+	struct timing_profile p = { 0 };
+	bool destructive = layout_has_included_regions() || force;
+	char name[96], chip[512];
+	unsigned int us;
+	int opcode, ret = 0;
+	FILE *f;
+
+	if (prepare_operation(flash, force, 1, destructive, destructive, 0))
+		return 1;
+	if (layout_has_included_regions()) {
+		if (get_included_ranges(&scratch))
+			return 1;
+	} else if (force) {
+		if (range_list_add(&scratch, 0, size))
+			return 1;
+	}
+	if (!flash->chip->read) {
+		msg_cerr("This chip can't be read, there is nothing to measure.\n");
+		range_list_free(&scratch);
+		return 1;
+	}
+
+	profile_name(flash, name, sizeof(name));
+	f = create_cache_file(name);
+	if (!f) {
+		msg_gerr("Can't write the timing profile %s.\n", name);
+		range_list_free(&scratch);
+		return 1;
+	}
+	profile_chip_line(flash, chip, sizeof(chip));
+	fputs(PROFILE_MAGIC "\n", f);
+	fputs(chip, f);
+
+	msg_ginfo("Benchmarking the %s programmer with %s %s.\n", programmer_name(),
+		  flash->chip->vendor, flash->chip->name);
+	if (flash->chip->bustype == BUS_SPI && (flash->mst->buses_supported & BUS_SPI))
+		bench_rdsr(flash, f, &p);
+	bench_reads(flash, f, &p);
+	if (flash->chip->bustype == BUS_SPI && (flash->mst->buses_supported & BUS_SPI) &&
+	    spi_autospeed_khz())
+		bench_clocks(flash, f, &p);
+
+	if (!destructive) {
+		msg_ginfo("Erases and programs are only measured in the regions included with -i or on the "
+			  "whole chip with --force.\n");
+	} else if (!flash->chip->write) {
+		msg_ginfo("This chip can't be written, erases and programs are not measured.\n");
+	} else {
+		/* Contents cached by earlier runs with --content-cache won't match the chip anymore. */
+		content_cache_invalidate(flash);
+		ret = bench_erase_program(flash, f, &p, &scratch);
+	}
+	if (!ret && flash->chip->bustype == BUS_SPI) {
+		for (opcode = 0; opcode < 256; opcode++) {
+			if (spi_get_wip_estimate(flash, opcode, &us))
+				fprintf(f, "wip %d %u\n", opcode, us);
+		}
+	}
+
+	/* A failed run leaves the previous profile (if any) alone. */
+	if (commit_cache_file(f, name, !ret)) {
+		if (!ret)
+			msg_gerr("Can't write the timing profile %s.\n", name);
+		ret = 1;
+	} else {
+		msg_ginfo("The timing profile was saved as %s.\n", name);
+	}
+	range_list_free(&scratch);
+	return ret;
+}
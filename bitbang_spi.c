@@ -58,6 +58,12 @@ static void bitbang_spi_release_bus(const struct bitbang_spi_master * const mast
 		master->release_bus();
 }
 
+static void bitbang_spi_delay(const struct bitbang_spi_master * const master)
+{
+	if (master->half_period)
+		programmer_delay(master->half_period);
+}
+
 static int bitbang_spi_send_command(struct flashctx *flash,
 				    unsigned int writecnt, unsigned int readcnt,
 				    const unsigned char *writearr,
@@ -121,11 +127,11 @@ static uint8_t bitbang_spi_rw_byte(const struct bitbang_spi_master *master,
 
 	for (i = 7; i >= 0; i--) {
 		bitbang_spi_set_mosi(master, (val >> i) & 1);
-		programmer_delay(master->half_period);
+		bitbang_spi_delay(master);
 		bitbang_spi_set_sck(master, 1);
 		ret <<= 1;
 		ret |= bitbang_spi_get_miso(master);
-		programmer_delay(master->half_period);
+		bitbang_spi_delay(master);
 		bitbang_spi_set_sck(master, 0);
 	}
 	return ret;
@@ -145,14 +151,19 @@ static int bitbang_spi_send_command(struct flashctx *flash,
 	 */
 	bitbang_spi_request_bus(master);
 	bitbang_spi_set_cs(master, 0);
-	for (i = 0; i < writecnt; i++)
-		bitbang_spi_rw_byte(master, writearr[i]);
-	for (i = 0; i < readcnt; i++)
-		readarr[i] = bitbang_spi_rw_byte(master, 0);
+	if (master->transfer && !master->half_period) {
+		master->transfer(writearr, NULL, writecnt);
+		master->transfer(NULL, readarr, readcnt);
+	} else {
+		for (i = 0; i < writecnt; i++)
+			bitbang_spi_rw_byte(master, writearr[i]);
+		for (i = 0; i < readcnt; i++)
+			readarr[i] = bitbang_spi_rw_byte(master, 0);
+	}
 
-	programmer_delay(master->half_period);
+	bitbang_spi_delay(master);
 	bitbang_spi_set_cs(master, 1);
-	programmer_delay(master->half_period);
+	bitbang_spi_delay(master);
 	/* FIXME: Run bitbang_spi_release_bus here or in programmer init? */
 	bitbang_spi_release_bus(master);
 
@@ -0,0 +1,399 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Buffer comparison kernels used by the erase/write/verify logic.
+ *
+ * All kernels return the offset of the first byte for which the condition
+ * holds, or len if there is none. The variants are selected once on first
+ * use: a portable word-wide implementation and, if the compiler and CPU
+ * support it, SSE2/AVX2 on x86 and NEON on AArch64.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "flash.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define BUFCMP_SSE2 1
+#include <emmintrin.h>
+#if defined(__clang__) || __GNUC__ >= 5
+#define BUFCMP_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define BUFCMP_NEON 1
+#include <arm_neon.h>
+#endif
+
+struct bufcmp_kernels {
+	const char *name;
+	unsigned int (*find_nonblank)(const uint8_t *buf, unsigned int len);
+	unsigned int (*find_difference)(const uint8_t *a, const uint8_t *b, unsigned int len);
+	unsigned int (*find_unprogrammable_bits)(const uint8_t *have, const uint8_t *want, unsigned int len);
+	unsigned int (*find_unprogrammable_bytes)(const uint8_t *have, const uint8_t *want, unsigned int len);
+};
+
+/* Byte-wise versions, also used for the tails of the wider versions. */
+static unsigned int nonblank_bytes(const uint8_t *buf, unsigned int i, unsigned int len)
+{
+	for (; i < len; i++)
+		if (buf[i] != 0xff)
+			break;
+	return i;
+}
+
+static unsigned int difference_bytes(const uint8_t *a, const uint8_t *b, unsigned int i, unsigned int len)
+{
+	for (; i < len; i++)
+		if (a[i] != b[i])
+			break;
+	return i;
+}
+
+static unsigned int unprogrammable_bits_bytes(const uint8_t *have, const uint8_t *want, unsigned int i,
+					      unsigned int len)
+{
+	for (; i < len; i++)
+		if ((have[i] & want[i]) != want[i])
+			break;
+	return i;
+}
+
+static unsigned int unprogrammable_bytes_bytes(const uint8_t *have, const uint8_t *want, unsigned int i,
+					       unsigned int len)
+{
+	for (; i < len; i++)
+		if (have[i] != want[i] && have[i] != 0xff)
+			break;
+	return i;
+}
+
+/* Portable word-wide versions. memcpy() keeps the loads alignment-safe and
+ * is turned into a plain load by any half-decent compiler.
+ */
+static inline uint64_t load64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned int word_find_nonblank(const uint8_t *buf, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i + 8 <= len; i += 8)
+		if (load64(buf + i) != UINT64_MAX)
+			break;
+	return nonblank_bytes(buf, i, len);
+}
+
+static unsigned int word_find_difference(const uint8_t *a, const uint8_t *b, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i + 8 <= len; i += 8)
+		if (load64(a + i) != load64(b + i))
+			break;
+	return difference_bytes(a, b, i, len);
+}
+
+static unsigned int word_find_unprogrammable_bits(const uint8_t *have, const uint8_t *want, unsigned int len)
+{
+	unsigned int i;
+	uint64_t w;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		w = load64(want + i);
+		if ((load64(have + i) & w) != w)
+			break;
+	}
+	return unprogrammable_bits_bytes(have, want, i, len);
+}
+
+static unsigned int word_find_unprogrammable_bytes(const uint8_t *have, const uint8_t *want, unsigned int len)
+{
+	unsigned int i, j;
+	uint64_t h;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		h = load64(have + i);
+		if (h == UINT64_MAX || h == load64(want + i))
+			continue;
+		j = unprogrammable_bytes_bytes(have, want, i, i + 8);
+		if (j < i + 8)
+			return j;
+	}
+	return unprogrammable_bytes_bytes(have, want, i, len);
+}
+
+static const struct bufcmp_kernels word_kernels = {
+	.name				= "word",
+	.find_nonblank			= word_find_nonblank,
+	.find_difference		= word_find_difference,
+	.find_unprogrammable_bits	= word_find_unprogrammable_bits,
+	.find_unprogrammable_bytes	= word_find_unprogrammable_bytes,
+};
+
+#if BUFCMP_SSE2 == 1
+/* A vector of all-ones in the compare result means "condition not met". */
+static unsigned int sse2_find_nonblank(const uint8_t *buf, unsigned int len)
+{
+	const __m128i ff = _mm_set1_epi8((char)0xff);
+	unsigned int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ff)) != 0xffff)
+			break;
+	}
+	return nonblank_bytes(buf, i, len);
+}
+
+static unsigned int sse2_find_difference(const uint8_t *a, const uint8_t *b, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff)
+			break;
+	}
+	return difference_bytes(a, b, i, len);
+}
+
+static unsigned int sse2_find_unprogrammable_bits(const uint8_t *have, const uint8_t *want, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i h = _mm_loadu_si128((const __m128i *)(have + i));
+		__m128i w = _mm_loadu_si128((const __m128i *)(want + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(h, w), w)) != 0xffff)
+			break;
+	}
+	return unprogrammable_bits_bytes(have, want, i, len);
+}
+
+static unsigned int sse2_find_unprogrammable_bytes(const uint8_t *have, const uint8_t *want, unsigned int len)
+{
+	const __m128i ff = _mm_set1_epi8((char)0xff);
+	unsigned int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i h = _mm_loadu_si128((const __m128i *)(have + i));
+		__m128i w = _mm_loadu_si128((const __m128i *)(want + i));
+		__m128i ok = _mm_or_si128(_mm_cmpeq_epi8(h, w), _mm_cmpeq_epi8(h, ff));
+		if (_mm_movemask_epi8(ok) != 0xffff)
+			break;
+	}
+	return unprogrammable_bytes_bytes(have, want, i, len);
+}
+
+static const struct bufcmp_kernels sse2_kernels = {
+	.name				= "SSE2",
+	.find_nonblank			= sse2_find_nonblank,
+	.find_difference		= sse2_find_difference,
+	.find_unprogrammable_bits	= sse2_find_unprogrammable_bits,
+	.find_unprogrammable_bytes	= sse2_find_unprogrammable_bytes,
+};
+#endif
+
+#if BUFCMP_AVX2 == 1
+#define AVX2_FN __attribute__((target("avx2")))
+
+static AVX2_FN unsigned int avx2_find_nonblank(const uint8_t *buf, unsigned int len)
+{
+	const __m256i ff = _mm256_set1_epi8((char)0xff);
+	unsigned int i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ff)) != -1)
+			break;
+	}
+	return nonblank_bytes(buf, i, len);
+}
+
+static AVX2_FN unsigned int avx2_find_difference(const uint8_t *a, const uint8_t *b, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != -1)
+			break;
+	}
+	return difference_bytes(a, b, i, len);
+}
+
+static AVX2_FN unsigned int avx2_find_unprogrammable_bits(const uint8_t *have, const uint8_t *want,
+							  unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i h = _mm256_loadu_si256((const __m256i *)(have + i));
+		__m256i w = _mm256_loadu_si256((const __m256i *)(want + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(h, w), w)) != -1)
+			break;
+	}
+	return unprogrammable_bits_bytes(have, want, i, len);
+}
+
+static AVX2_FN unsigned int avx2_find_unprogrammable_bytes(const uint8_t *have, const uint8_t *want,
+							   unsigned int len)
+{
+	const __m256i ff = _mm256_set1_epi8((char)0xff);
+	unsigned int i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i h = _mm256_loadu_si256((const __m256i *)(have + i));
+		__m256i w = _mm256_loadu_si256((const __m256i *)(want + i));
+		__m256i ok = _mm256_or_si256(_mm256_cmpeq_epi8(h, w), _mm256_cmpeq_epi8(h, ff));
+		if (_mm256_movemask_epi8(ok) != -1)
+			break;
+	}
+	return unprogrammable_bytes_bytes(have, want, i, len);
+}
+
+static const struct bufcmp_kernels avx2_kernels = {
+	.name				= "AVX2",
+	.find_nonblank			= avx2_find_nonblank,
+	.find_difference		= avx2_find_difference,
+	.find_unprogrammable_bits	= avx2_find_unprogrammable_bits,
+	.find_unprogrammable_bytes	= avx2_find_unprogrammable_bytes,
+};
+#endif
+
+#if BUFCMP_NEON == 1
+/* True if all lanes of the compare result are set. */
+static inline int neon_all_set(uint8x16_t v)
+{
+	return vminvq_u8(v) == 0xff;
+}
+
+static unsigned int neon_find_nonblank(const uint8_t *buf, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		if (!neon_all_set(vceqq_u8(vld1q_u8(buf + i), vdupq_n_u8(0xff))))
+			break;
+	return nonblank_bytes(buf, i, len);
+}
+
+static unsigned int neon_find_difference(const uint8_t *a, const uint8_t *b, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		if (!neon_all_set(vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i))))
+			break;
+	return difference_bytes(a, b, i, len);
+}
+
+static unsigned int neon_find_unprogrammable_bits(const uint8_t *have, const uint8_t *want, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		uint8x16_t w = vld1q_u8(want + i);
+		if (!neon_all_set(vceqq_u8(vandq_u8(vld1q_u8(have + i), w), w)))
+			break;
+	}
+	return unprogrammable_bits_bytes(have, want, i, len);
+}
+
+static unsigned int neon_find_unprogrammable_bytes(const uint8_t *have, const uint8_t *want, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		uint8x16_t h = vld1q_u8(have + i);
+		uint8x16_t ok = vorrq_u8(vceqq_u8(h, vld1q_u8(want + i)), vceqq_u8(h, vdupq_n_u8(0xff)));
+		if (!neon_all_set(ok))
+			break;
+	}
+	return unprogrammable_bytes_bytes(have, want, i, len);
+}
+
+static const struct bufcmp_kernels neon_kernels = {
+	.name				= "NEON",
+	.find_nonblank			= neon_find_nonblank,
+	.find_difference		= neon_find_difference,
+	.find_unprogrammable_bits	= neon_find_unprogrammable_bits,
+	.find_unprogrammable_bytes	= neon_find_unprogrammable_bytes,
+};
+#endif
+
+static const struct bufcmp_kernels *kernels = NULL;
+
+static const struct bufcmp_kernels *select_kernels(void)
+{
+	if (kernels)
+		return kernels;
+
+	kernels = &word_kernels;
+#if BUFCMP_SSE2 == 1
+	kernels = &sse2_kernels;
+#endif
+#if BUFCMP_AVX2 == 1
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		kernels = &avx2_kernels;
+#endif
+#if BUFCMP_NEON == 1
+	kernels = &neon_kernels;
+#endif
+	msg_gspew("Using %s buffer comparison kernels.\n", kernels->name);
+	return kernels;
+}
+
+/* Returns the offset of the first byte in buf which is not 0xff. */
+unsigned int buf_find_nonblank(const uint8_t *buf, unsigned int len)
+{
+	return select_kernels()->find_nonblank(buf, len);
+}
+
+/* Returns the offset of the first byte where a and b differ. */
+unsigned int buf_find_difference(const uint8_t *a, const uint8_t *b, unsigned int len)
+{
+	return select_kernels()->find_difference(a, b, len);
+}
+
+/* Returns the offset of the first byte in have which can't be turned into the
+ * corresponding byte in want by clearing bits, i.e. (have & want) != want.
+ */
+unsigned int buf_find_unprogrammable_bits(const uint8_t *have, const uint8_t *want, unsigned int len)
+{
+	return select_kernels()->find_unprogrammable_bits(have, want, len);
+}
+
+/* Returns the offset of the first byte which differs between have and want
+ * and is not erased in have.
+ */
+unsigned int buf_find_unprogrammable_bytes(const uint8_t *have, const uint8_t *want, unsigned int len)
+{
+	return select_kernels()->find_unprogrammable_bytes(have, want, len);
+}
@@ -30,7 +30,7 @@
 /* Change this to #define if you want to test without a serial implementation */
 #undef FAKE_COMMUNICATION
 
-struct buspirate_spispeeds {
+struct buspirate_speeds {
 	const char *name;
 	const int speed;
 };
@@ -50,6 +50,9 @@ static int buspirate_serialport_setup(char *dev)
 #define serialport_write(...) 0
 #define serialport_read(...) 0
 #define sp_flush_incoming(...) 0
+#define serialport_read_nonblock(...) 0
+#define serialport_config(...) 0
+#define serialport_baud_supported(...) true
 #endif
 
 static unsigned char *bp_commbuf = NULL;
@@ -78,7 +81,7 @@ static int buspirate_commbuf_grow(int bufsize)
 static int buspirate_sendrecv(unsigned char *buf, unsigned int writecnt,
 			      unsigned int readcnt)
 {
-	int i, ret = 0;
+	int ret = 0;
 
 	msg_pspew("%s: write %i, read %i ", __func__, writecnt, readcnt);
 	if (!writecnt && !readcnt) {
@@ -87,8 +90,7 @@ static int buspirate_sendrecv(unsigned char *buf, unsigned int writecnt,
 	}
 	if (writecnt)
 		msg_pspew("Sending");
-	for (i = 0; i < writecnt; i++)
-		msg_pspew(" 0x%02x", buf[i]);
+	msg_hexdump(MSG_SPEW, buf, writecnt);
 #ifdef FAKE_COMMUNICATION
 	/* Placate the caller for now. */
 	if (readcnt) {
@@ -108,8 +110,7 @@ static int buspirate_sendrecv(unsigned char *buf, unsigned int writecnt,
 #endif
 	if (readcnt)
 		msg_pspew(", receiving");
-	for (i = 0; i < readcnt; i++)
-		msg_pspew(" 0x%02x", buf[i]);
+	msg_hexdump(MSG_SPEW, buf, readcnt);
 	msg_pspew("\n");
 	return 0;
 }
@@ -129,6 +130,24 @@ static int buspirate_wait_for_string(unsigned char *buf, char *key)
 	return ret;
 }
 
+/* Like buspirate_wait_for_string(), but give up after @timeout ms of silence. */
+static int buspirate_wait_for_string_timeout(unsigned char *buf, const char *key, unsigned int timeout)
+{
+	unsigned int keylen = strlen(key);
+	unsigned int have = 0;
+
+	while (1) {
+		if (serialport_read_nonblock(buf + have, 1, timeout, NULL) != 0)
+			return 1;
+		if (++have < keylen)
+			continue;
+		if (!memcmp(buf, key, keylen))
+			return 0;
+		memmove(buf, buf + 1, keylen - 1);
+		have--;
+	}
+}
+
 static int buspirate_spi_send_command_v1(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 					 const unsigned char *writearr, unsigned char *readarr);
 static int buspirate_spi_send_command_v2(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
@@ -145,7 +164,7 @@ static struct spi_master spi_master_buspirate = {
 	.write_aai	= default_spi_write_aai,
 };
 
-static const struct buspirate_spispeeds spispeeds[] = {
+static const struct buspirate_speeds spispeeds[] = {
 	{"30k",		0x0},
 	{"125k",	0x1},
 	{"250k",	0x2},
@@ -157,6 +176,38 @@ static const struct buspirate_spispeeds spispeeds[] = {
 	{NULL,		0x0},
 };
 
+/* The same rates in kHz for spispeed=auto. Old firmware can't do more than 2 MHz, see buspirate_spi_init(). */
+static unsigned int buspirate_speeds_khz[] = { 30, 125, 250, 1000, 2000, 2600, 4000, 8000, 0 };
+
+static int buspirate_set_spi_speed(unsigned int khz)
+{
+	int i, ret;
+
+	for (i = 0; buspirate_speeds_khz[i] && buspirate_speeds_khz[i] != khz; i++)
+		;
+	if (!buspirate_speeds_khz[i])
+		return 1;
+	bp_commbuf[0] = 0x60 | spispeeds[i].speed;
+	ret = buspirate_sendrecv(bp_commbuf, 1, 1);
+	if (ret)
+		return 1;
+	if (bp_commbuf[0] != 0x01) {
+		msg_perr("Protocol error while setting SPI speed!\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* UART speeds of the Bus Pirate v3 we know to work. The serial speed menu only goes up to 115200 bps, faster
+ * ones are set as raw baud rate generator values: speed = 4 MHz / (BRG + 1). */
+#define BP_DEFAULT_SERIALSPEED	115200
+static const struct buspirate_speeds serialspeeds[] = {
+	{"115200",	115200},
+	{"1M",		1000000},
+	{"2M",		2000000},
+	{NULL,		0},
+};
+
 static int buspirate_spi_shutdown(void *data)
 {
 	int ret = 0, ret2 = 0;
@@ -199,6 +250,49 @@ out_shutdown:
 
 #define BP_FWVERSION(a,b)	((a) << 8 | (b))
 
+/* Switch the Bus Pirate (in the user terminal) and our end of the line to @speed and check that it still
+ * answers. The Bus Pirate goes back to its default speed when it is reset at shutdown. */
+static int buspirate_set_serialspeed(unsigned int speed)
+{
+	int ret;
+
+	msg_pdbg("Switching to %u bps.\n", speed);
+	/* Pick the raw BRG value in the serial speed menu. */
+	strcpy((char *)bp_commbuf, "b\n");
+	if ((ret = buspirate_sendrecv(bp_commbuf, strlen((char *)bp_commbuf), 0)))
+		return ret;
+	if ((ret = buspirate_wait_for_string(bp_commbuf, ">")))
+		return ret;
+	strcpy((char *)bp_commbuf, "10\n");
+	if ((ret = buspirate_sendrecv(bp_commbuf, strlen((char *)bp_commbuf), 0)))
+		return ret;
+	if ((ret = buspirate_wait_for_string(bp_commbuf, ">")))
+		return ret;
+	snprintf((char *)bp_commbuf, bp_commbufsize, "%u\n", 4000000 / speed - 1);
+	if ((ret = buspirate_sendrecv(bp_commbuf, strlen((char *)bp_commbuf), 0)))
+		return ret;
+	/* "Adjust your terminal. Space to continue" */
+	if ((ret = buspirate_wait_for_string(bp_commbuf, "Space")))
+		return ret;
+	if ((ret = buspirate_wait_for_string(bp_commbuf, "\n")))
+		return ret;
+	if (serialport_config(sp_fd, speed))
+		return 1;
+	/* Give the converter a moment to settle before talking at the new speed. */
+	internal_delay(10000);
+	sp_flush_incoming();
+	bp_commbuf[0] = ' ';
+	if ((ret = buspirate_sendrecv(bp_commbuf, 1, 0)))
+		return ret;
+	if (buspirate_wait_for_string_timeout(bp_commbuf, "HiZ>", 1000)) {
+		msg_perr("Bus Pirate does not answer at %u bps, it may have to be power cycled.\n"
+			 "Use serialspeed=115200 to keep the default speed.\n", speed);
+		serialport_config(sp_fd, BP_DEFAULT_SERIALSPEED);
+		return 1;
+	}
+	return 0;
+}
+
 int buspirate_spi_init(void)
 {
 	char *tmp;
@@ -206,6 +300,8 @@ int buspirate_spi_init(void)
 	int i;
 	unsigned int fw_version_major = 0;
 	unsigned int fw_version_minor = 0;
+	unsigned int hw_version_major = 0;
+	unsigned int serialspeed = 0;
 	int spispeed = 0x7;
 	int ret = 0;
 	int pullup = 0;
@@ -221,7 +317,17 @@ int buspirate_spi_init(void)
 	}
 
 	tmp = extract_programmer_param("spispeed");
-	if (tmp) {
+	if (tmp && !strcasecmp(tmp, "auto")) {
+		char instance[256];
+		snprintf(instance, sizeof(instance), "buspirate_spi:%s", dev);
+		if (spi_request_autospeed(instance)) {
+			free(tmp);
+			free(dev);
+			return 1;
+		}
+		spi_master_buspirate.speeds_khz = buspirate_speeds_khz;
+		spi_master_buspirate.set_speed = buspirate_set_spi_speed;
+	} else if (tmp) {
 		for (i = 0; spispeeds[i].name; i++) {
 			if (!strncasecmp(spispeeds[i].name, tmp, strlen(spispeeds[i].name))) {
 				spispeed = spispeeds[i].speed;
@@ -233,6 +339,20 @@ int buspirate_spi_init(void)
 	}
 	free(tmp);
 
+	/* By default we go as fast as the hardware allows. */
+	tmp = extract_programmer_param("serialspeed");
+	if (tmp) {
+		for (i = 0; serialspeeds[i].name; i++) {
+			if (!strcasecmp(serialspeeds[i].name, tmp)) {
+				serialspeed = serialspeeds[i].speed;
+				break;
+			}
+		}
+		if (!serialspeeds[i].name)
+			msg_perr("Invalid serial speed, using default.\n");
+	}
+	free(tmp);
+
 	tmp = extract_programmer_param("pullups");
 	if (tmp) {
 		if (strcasecmp("on", tmp) == 0)
@@ -313,6 +433,8 @@ int buspirate_spi_init(void)
 	}
 	bp_commbuf[i] = '\0';
 	msg_pdbg("Detected Bus Pirate hardware %s\n", bp_commbuf);
+	if (bp_commbuf[0] == 'v')
+		hw_version_major = strtoul((char *)bp_commbuf + 1, NULL, 10);
 
 	if ((ret = buspirate_wait_for_string(bp_commbuf, "irmware ")))
 		return ret;
@@ -370,6 +492,26 @@ int buspirate_spi_init(void)
 		spi_master_buspirate.command = buspirate_spi_send_command_v1;
 	}
 
+	/* The Bus Pirate v4 talks USB CDC, the UART speed doesn't matter there. The v3 has an FT232RL which
+	 * can go much faster than the default, but we can only use speeds the host side can set exactly. */
+	if (hw_version_major != 3) {
+		if (serialspeed)
+			msg_pinfo("Bus Pirate hardware other than v3 ignores the serial speed.\n");
+		serialspeed = 0;
+	} else if (serialspeed && !serialport_baud_supported(serialspeed)) {
+		msg_perr("This host can't use %u bps, using default.\n", serialspeed);
+		serialspeed = 0;
+	} else if (!serialspeed && BP_FWVERSION(fw_version_major, fw_version_minor) >= BP_FWVERSION(5, 5)) {
+		for (i = ARRAY_SIZE(serialspeeds) - 2; i > 0; i--)
+			if (serialport_baud_supported(serialspeeds[i].speed))
+				break;
+		serialspeed = serialspeeds[i].speed;
+	}
+	if (serialspeed && serialspeed != BP_DEFAULT_SERIALSPEED) {
+		if ((ret = buspirate_set_serialspeed(serialspeed)))
+			return ret;
+	}
+
 	/* Workaround for broken speed settings in firmware 6.1 and older. */
 	if (BP_FWVERSION(fw_version_major, fw_version_minor) < BP_FWVERSION(6, 2))
 		if (spispeed > 0x4) {
@@ -377,6 +519,7 @@ int buspirate_spi_init(void)
 				 "Limiting speed to 2 MHz.\n");
 			msg_pinfo("It is recommended to upgrade to firmware 6.2 or newer.\n");
 			spispeed = 0x4;
+			buspirate_speeds_khz[0x5] = 0;
 		}
 		
 	/* This works because speeds numbering starts at 0 and is contiguous. */
@@ -0,0 +1,256 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Indices over the flashchips array, so looking up a chip by name or finding the entries that can match
+ * an identification response doesn't have to walk the whole array.
+ *
+ * The indices are sorted copies of the array positions, built on first use. If that fails (out of
+ * memory) everything falls back to scanning the array.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flash.h"
+#include "flashchips.h"
+#include "chipdrivers.h"
+
+/* Probe functions whose verdict depends on nothing but the manufacturer and model ID they read. */
+static int (*const id_probes[])(struct flashctx *flash) = {
+	probe_spi_rdid,
+	probe_spi_rdid4,
+	probe_spi_rems,
+	probe_spi_at25f,
+};
+
+struct id_entry {
+	unsigned int probe;	/* Index into id_probes. */
+	uint32_t manufacture_id;
+	uint32_t model_id;
+	unsigned int pos;	/* Position in flashchips. */
+};
+
+static bool index_built;
+static unsigned int num_chips;
+static unsigned int *by_name;
+static struct id_entry *by_id;
+static unsigned int num_ids;
+
+/* Master the IDs were reported on, see probe_report_ids(). Each thread probes one master at a time. */
+static THREAD_LOCAL const struct registered_master *ids_mst;
+/* Which chips probed with id_probes[i] can match the IDs reported by it, NULL if it reported none. */
+static THREAD_LOCAL bool *ids_candidate[ARRAY_SIZE(id_probes)];
+
+static int id_probe_index(int (*probe)(struct flashctx *flash))
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(id_probes); i++)
+		if (probe == id_probes[i])
+			return i;
+	return -1;
+}
+
+static int compare_name(const void *a, const void *b)
+{
+	return strcmp(flashchips[*(const unsigned int *)a].name, flashchips[*(const unsigned int *)b].name);
+}
+
+static int compare_id(const void *a, const void *b)
+{
+	const struct id_entry *x = a, *y = b;
+
+	if (x->probe != y->probe)
+		return x->probe < y->probe ? -1 : 1;
+	if (x->manufacture_id != y->manufacture_id)
+		return x->manufacture_id < y->manufacture_id ? -1 : 1;
+	if (x->model_id != y->model_id)
+		return x->model_id < y->model_id ? -1 : 1;
+	if (x->pos != y->pos)
+		return x->pos < y->pos ? -1 : 1;
+	return 0;
+}
+
+static bool build_index(void)
+{
+	unsigned int i;
+	int probe;
+
+	if (index_built)
+		return by_name != NULL;
+	index_built = true;
+
+	/* The array is terminated by an entry without a name. */
+	num_chips = flashchips_size - 1;
+	by_name = malloc(num_chips * sizeof(*by_name));
+	by_id = malloc(num_chips * sizeof(*by_id));
+	if (!by_name || !by_id) {
+		msg_gdbg("Out of memory, not indexing the chip database.\n");
+		free(by_name);
+		free(by_id);
+		by_name = NULL;
+		by_id = NULL;
+		return false;
+	}
+
+	for (i = 0; i < num_chips; i++) {
+		by_name[i] = i;
+		probe = id_probe_index(flashchips[i].probe);
+		if (probe < 0)
+			continue;
+		by_id[num_ids].probe = probe;
+		by_id[num_ids].manufacture_id = flashchips[i].manufacture_id;
+		by_id[num_ids].model_id = flashchips[i].model_id;
+		by_id[num_ids].pos = i;
+		num_ids++;
+	}
+	qsort(by_name, num_chips, sizeof(*by_name), compare_name);
+	qsort(by_id, num_ids, sizeof(*by_id), compare_id);
+	return true;
+}
+
+/* Build the indices before probing masters concurrently, which would race on it otherwise. */
+void probe_prepare(void)
+{
+	build_index();
+}
+
+/* Return the chip called @name at position @from or later in flashchips, NULL if there is none. */
+const struct flashchip *find_chip_by_name(const char *name, unsigned int from)
+{
+	const struct flashchip *chip;
+	unsigned int lo, hi, mid;
+	int cmp;
+
+	if (!build_index()) {
+		for (chip = flashchips + from; chip->name; chip++)
+			if (!strcmp(chip->name, name))
+				return chip;
+		return NULL;
+	}
+
+	/* Find the first entry with that name, then the first one at or after @from. */
+	lo = 0;
+	hi = num_chips;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = strcmp(flashchips[by_name[mid]].name, name);
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < num_chips && !strcmp(flashchips[by_name[lo]].name, name); lo++)
+		if (by_name[lo] >= from)
+			return &flashchips[by_name[lo]];
+	return NULL;
+}
+
+/* Index of the first entry of by_id that doesn't sort before (@probe, @manufacture_id, @model_id). */
+static unsigned int lower_bound_id(unsigned int probe, uint32_t manufacture_id, uint32_t model_id)
+{
+	const struct id_entry key = { probe, manufacture_id, model_id, 0 };
+	unsigned int lo = 0, hi = num_ids, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (compare_id(&by_id[mid], &key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Mark all chips probed with id_probes[@probe] that have the given IDs as candidates.
+ * A @model_id of ~0 matches any model.
+ */
+static void mark_candidates(unsigned int probe, uint32_t manufacture_id, uint32_t model_id)
+{
+	unsigned int i;
+
+	for (i = lower_bound_id(probe, manufacture_id, model_id == ~0U ? 0 : model_id); i < num_ids; i++) {
+		if (by_id[i].probe != probe || by_id[i].manufacture_id != manufacture_id)
+			break;
+		if (model_id != ~0U && by_id[i].model_id != model_id)
+			break;
+		ids_candidate[probe][by_id[i].pos] = true;
+	}
+}
+
+/* Forget the IDs reported during the previous probe run. */
+void probe_forget_ids(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(id_probes); i++) {
+		free(ids_candidate[i]);
+		ids_candidate[i] = NULL;
+	}
+	ids_mst = NULL;
+}
+
+/* IDs read from a chip that doesn't answer, e.g. because it is in deep power-down until a RES. */
+static bool ids_blank(uint32_t id1, uint32_t id2)
+{
+	return (id1 == 0x00 || id1 == 0xff) &&
+	       (id2 == 0x00 || id2 == 0xff || id2 == 0xffff || id2 == 0xffffff || id2 == 0xffffffff);
+}
+
+/*
+ * Called by ID probe functions with the IDs they read. Until the next probe_forget_ids(), chips on the
+ * same master that use the same probe function but can't match these IDs are skipped by probe_flash().
+ * The rules must be the ones the probe functions use: exact match, vendor match of an entry with a
+ * generic model ID or any sane vendor ID for an entry with a generic manufacturer ID.
+ * Blank IDs rule nothing out, a later probe may still wake the chip up.
+ */
+void probe_report_ids(const struct flashctx *flash, uint32_t id1, uint32_t id2)
+{
+	int probe = id_probe_index(flash->chip->probe);
+
+	if (probe < 0 || ids_blank(id1, id2) || !build_index())
+		return;
+	/* Only one master is probed at a time by this thread. */
+	if (ids_mst != flash->mst) {
+		probe_forget_ids();
+		ids_mst = flash->mst;
+	}
+	if (ids_candidate[probe])
+		return;
+	ids_candidate[probe] = calloc(num_chips, sizeof(*ids_candidate[probe]));
+	if (!ids_candidate[probe])
+		return;
+	mark_candidates(probe, id1, id2);
+	mark_candidates(probe, id1, GENERIC_DEVICE_ID);
+	if (id1 != 0xff && id1 != 0x00)
+		mark_candidates(probe, GENERIC_MANUF_ID, ~0U);
+}
+
+/* Can @chip be skipped on @mst because the IDs reported earlier already rule it out? */
+bool probe_ruled_out(const struct registered_master *mst, const struct flashchip *chip)
+{
+	int probe;
+
+	if (mst != ids_mst)
+		return false;
+	probe = id_probe_index(chip->probe);
+	if (probe < 0 || !ids_candidate[probe])
+		return false;
+	return !ids_candidate[probe][chip - flashchips];
+}
@@ -27,10 +27,40 @@
 #include <string.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <errno.h>
+#include <time.h>
 #include "flash.h"
 #include "flashchips.h"
 #include "programmer.h"
 
+#if !IS_WINDOWS && !defined(__DJGPP__)
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define HAVE_FORK 1
+#endif
+
+/* Maximum number of programmers (-p) which can be used at the same time. */
+#define MAX_TARGETS	16
+
+/* Long options without a short equivalent. */
+enum {
+	OPTION_VERIFY_MODE = 0x0100,
+	OPTION_STATS,
+	OPTION_HISTOGRAMS,
+	OPTION_TRACE,
+	OPTION_REPLAY,
+	OPTION_IFD,
+	OPTION_DAEMON,
+	OPTION_CONNECT,
+	OPTION_SHUTDOWN,
+	OPTION_PROGRESS,
+	OPTION_JOURNAL,
+	OPTION_SKIP_BLANK,
+	OPTION_CONTENT_CACHE,
+	OPTION_BENCHMARK,
+};
+
 static void cli_classic_usage(const char *name)
 {
 	printf("Please note that the command line interface for flashrom has changed between\n"
@@ -41,7 +71,9 @@ static void cli_classic_usage(const char *name)
 	       "-z|"
 #endif
 	       "-p <programmername>[:<parameters>] [-c <chipname>]\n"
-	       "[-E|(-r|-w|-v) <file>] [-l <layoutfile> [-i <imagename>]...] [-n] [-f]]\n"
+	       "[-E|(-r|-w|-v|--replay) <file>|--daemon <socket>|--benchmark]\n"
+	       "[(-l <layoutfile>|--ifd) [-i <imagename>]...]\n"
+	       "[-n] [-f]] [--connect <socket> [--shutdown]]\n"
 	       "[-V[V[V]]] [-o <logfile>]\n\n", name);
 
 	printf(" -h | --help                        print this help text\n"
@@ -54,7 +86,28 @@ static void cli_classic_usage(const char *name)
 	       " -c | --chip <chipname>             probe only for specified flash chip\n"
 	       " -f | --force                       force specific operations (see man page)\n"
 	       " -n | --noverify                    don't auto-verify\n"
+	       "      --verify-mode <mode>          what to verify after writing: full (default),\n"
+	       "                                    written[:<guard>], sample[:<pages>] or inline\n"
+	       "      --stats[=<format>]            print performance counters at exit, <format> is\n"
+	       "                                    human (default), json or json:<file>\n"
+	       "      --histograms                  with --stats, add latency histograms per opcode\n"
+	       "      --progress[=<format>]         show the progress of operations, <format> is\n"
+	       "                                    bar (default), json or json:<file>\n"
+	       "      --journal <file>              record the progress of a write in <file> to be\n"
+	       "                                    able to resume it\n"
+	       "      --skip-blank                  with -E, erase only the blocks which are not blank\n"
+	       "      --content-cache               keep written images to skip reading the same chip\n"
+	       "                                    before the next write\n"
+	       "      --trace <file>                record all SPI commands to <file>\n"
+	       "      --replay <file>               send the SPI commands recorded in <file>\n"
+	       "      --daemon <socket>             keep the programmer and chip ready and run jobs\n"
+	       "                                    sent to <socket>\n"
+	       "      --connect <socket>            run the operation in the daemon at <socket>\n"
+	       "      --shutdown                    with --connect: stop the daemon\n"
+	       "      --benchmark                   measure the programmer and chip for later runs,\n"
+	       "                                    erasing the images given with -i (or with -f all)\n"
 	       " -l | --layout <layoutfile>         read ROM layout from <layoutfile>\n"
+	       "      --ifd                         read layout from the Intel flash descriptor of the image\n"
 	       " -i | --image <name>                only flash image <name> from flash layout\n"
 	       " -o | --output <logfile>            log output to <logfile>\n"
 	       " -L | --list-supported              print supported devices\n"
@@ -67,7 +120,7 @@ static void cli_classic_usage(const char *name)
 #if CONFIG_PRINT_WIKI == 1
 	         "-z, "
 #endif
-	         "-E, -r, -w, -v or no operation.\n"
+	         "-E, -r, -w, -v, --replay, --daemon, --benchmark or no operation.\n"
 	       "If no operation is specified, flashrom will only probe for flash chips.\n");
 }
 
@@ -77,6 +130,79 @@ static void cli_classic_abort_usage(void)
 	exit(1);
 }
 
+/* Parse the argument of --verify-mode. Returns 0 on success. */
+static int parse_verify_mode(const char *arg)
+{
+	char *endptr;
+
+	if (!strcmp(arg, "full")) {
+		verify_mode = VERIFY_FULL;
+		return 0;
+	}
+	if (!strcmp(arg, "inline")) {
+		verify_mode = VERIFY_INLINE;
+		return 0;
+	}
+	if (!strncmp(arg, "written", strlen("written"))) {
+		arg += strlen("written");
+		verify_mode = VERIFY_WRITTEN;
+		verify_guard = 0;
+		if (*arg == '\0')
+			return 0;
+		if (*arg++ != ':' || *arg == '\0')
+			return 1;
+		errno = 0;
+		verify_guard = strtoul(arg, &endptr, 0);
+		if (errno || *endptr != '\0')
+			return 1;
+		return 0;
+	}
+	if (!strncmp(arg, "sample", strlen("sample"))) {
+		arg += strlen("sample");
+		verify_mode = VERIFY_SAMPLE;
+		verify_samples = 1;
+		srand(time(NULL) ^ getpid());
+		if (*arg == '\0')
+			return 0;
+		if (*arg++ != ':' || *arg == '\0')
+			return 1;
+		errno = 0;
+		verify_samples = strtoul(arg, &endptr, 0);
+		if (errno || *endptr != '\0' || !verify_samples)
+			return 1;
+		return 0;
+	}
+	return 1;
+}
+
+/* Print the performance counters. @format is NULL, "human", "json" (to @screen) or "json:<file>". */
+static int print_stats(const char *format, FILE *screen)
+{
+	FILE *f;
+
+	if (!format || !strcmp(format, "human")) {
+		stats_print();
+		return 0;
+	}
+	if (!strcmp(format, "json")) {
+		stats_print_json(screen);
+		return 0;
+	}
+	f = fopen(format + strlen("json:"), "w");
+	if (!f) {
+		msg_gerr("Error: opening stats file \"%s\" failed: %s\n", format + strlen("json:"),
+			 strerror(errno));
+		return 1;
+	}
+	stats_print_json(f);
+	if (fclose(f)) {
+		msg_gerr("Error: writing stats file \"%s\" failed: %s\n", format + strlen("json:"),
+			 strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
 static int check_filename(char *filename, char *type)
 {
 	if (!filename || (filename[0] == '\0')) {
@@ -84,26 +210,293 @@ static int check_filename(char *filename, char *type)
 		return 1;
 	}
 	/* Not an error, but maybe the user intended to specify a CLI option instead of a file name. */
-	if (filename[0] == '-')
+	if (filename[0] == '-' && filename[1] != '\0')
 		fprintf(stderr, "Warning: Supplied %s file name starts with -\n", type);
 	return 0;
 }
 
-int main(int argc, char *argv[])
+/* What to do with each target, as given on the command line. */
+struct cli_job {
+	const char *filename;
+	const char *stats_format;
+	const char *trace_file;		/* --trace <file> (if any) */
+	const char *replay_file;	/* --replay <file> (if any) */
+	const char *daemon_socket;	/* --daemon <socket> (if any) */
+	bool benchmark;
+	const struct flashchip *chip;	/* Chip given with -c (if any), for forced reads */
+	int force;
+	int read_it;
+	int write_it;
+	int erase_it;
+	int verify_it;
+};
+
+/* Whether the @count chips in @flashes were all found by the same master. */
+static bool same_master(const struct flashctx *flashes, int count)
+{
+	int i;
+
+	for (i = 1; i < count; i++)
+		if (flashes[i].mst != flashes[0].mst)
+			return false;
+	return true;
+}
+
+/* Initialize the programmer, probe for the chip and run the requested operation on it. */
+/* Run the job with programmer @prog, the @index-th target (counting from 0). */
+static int flash_target(enum programmer prog, const char *pparam, int index, const struct cli_job *job)
 {
-	const struct flashchip *chip = NULL;
 	/* Probe for up to eight flash chips. */
 	struct flashctx flashes[8] = {{0}};
 	struct flashctx *fill_flash;
+	int startchip = -1, chipcount = 0, ret = 0;
+	int i, j;
+	char *tempstr;
+	const bool operation = job->read_it || job->write_it || job->verify_it || job->erase_it ||
+			       job->replay_file || job->daemon_socket || job->benchmark;
+
+	stats_reset();
+	/* Start the clock for the performance counters. */
+	stats_set_phase(STATS_PHASE_OTHER);
+
+	if (job->trace_file && spi_trace_start(job->trace_file))
+		return 1;
+
+	if (programmer_init(prog, pparam)) {
+		msg_perr("Error: Programmer initialization failed.\n");
+		ret = 1;
+		goto out_shutdown;
+	}
+	tempstr = flashbuses_to_text(get_buses_supported());
+	msg_pdbg("The following protocols are supported: %s.\n", tempstr);
+	free(tempstr);
+
+	stats_set_phase(STATS_PHASE_PROBE);
+	chipcount = probe_masters(flashes, ARRAY_SIZE(flashes));
+	stats_set_phase(STATS_PHASE_OTHER);
+
+	if (chipcount > 1 && !same_master(flashes, chipcount)) {
+		/* E.g. ft2232_spi:port=AB, the operations work on one chip only. */
+		if (!operation) {
+			msg_ginfo("No operations were specified.\n");
+			goto out_shutdown;
+		}
+		msg_cerr("The chips were found on different controllers, but only one chip can be used at a time.\n"
+			 "Please give each controller its own -p option, e.g. -p ft2232_spi:port=A.\n");
+		ret = 1;
+		goto out_shutdown;
+	} else if (chipcount > 1) {
+		msg_cinfo("Multiple flash chip definitions match the detected chip(s): \"%s\"",
+			  flashes[0].chip->name);
+		for (i = 1; i < chipcount; i++)
+			msg_cinfo(", \"%s\"", flashes[i].chip->name);
+		msg_cinfo("\nPlease specify which chip definition to use with the -c <chipname> option.\n");
+		ret = 1;
+		goto out_shutdown;
+	} else if (!chipcount) {
+		msg_cinfo("No EEPROM/flash device found.\n");
+		if (!job->force || !chip_to_probe) {
+			msg_cinfo("Note: flashrom can never write if the flash chip isn't found "
+				  "automatically.\n");
+		}
+		if (job->force && job->read_it && chip_to_probe) {
+			struct registered_master *mst;
+			int compatible_masters = 0;
+			msg_cinfo("Force read (-f -r -c) requested, pretending the chip is there:\n");
+			/* This loop just counts compatible controllers. */
+			for (j = 0; j < registered_master_count; j++) {
+				mst = &registered_masters[j];
+				/* job->chip was looked up from chip_to_probe in main(). */
+				if (mst->buses_supported & job->chip->bustype)
+					compatible_masters++;
+			}
+			if (!compatible_masters) {
+				msg_cinfo("No compatible controller found for the requested flash chip.\n");
+				ret = 1;
+				goto out_shutdown;
+			}
+			if (compatible_masters > 1)
+				msg_cinfo("More than one compatible controller found for the requested flash "
+					  "chip, using the first one.\n");
+			for (j = 0; j < registered_master_count; j++) {
+				mst = &registered_masters[j];
+				startchip = probe_flash(mst, 0, &flashes[0], 1);
+				if (startchip != -1)
+					break;
+			}
+			if (startchip == -1) {
+				// FIXME: This should never happen! Ask for a bug report?
+				msg_cinfo("Probing for flash chip '%s' failed.\n", chip_to_probe);
+				ret = 1;
+				goto out_shutdown;
+			}
+			if (map_flash(&flashes[0]) != 0) {
+				free(flashes[0].chip);
+				ret = 1;
+				goto out_shutdown;
+			}
+			msg_cinfo("Please note that forced reads most likely contain garbage.\n");
+			ret = read_flash_to_file(&flashes[0], job->filename);
+			unmap_flash(&flashes[0]);
+			free(flashes[0].chip);
+			goto out_shutdown;
+		}
+		ret = 1;
+		goto out_shutdown;
+	} else if (!chip_to_probe) {
+		/* repeat for convenience when looking at foreign logs */
+		tempstr = flashbuses_to_text(flashes[0].chip->bustype);
+		msg_gdbg("Found %s flash chip \"%s\" (%d kB, %s).\n",
+			 flashes[0].chip->vendor, flashes[0].chip->name, flashes[0].chip->total_size, tempstr);
+		free(tempstr);
+	}
+
+	fill_flash = &flashes[0];
+
+	print_chip_support_status(fill_flash->chip);
+
+	unsigned int limitexceeded = count_max_decode_exceedings(fill_flash);
+	if (limitexceeded > 0 && !job->force) {
+		enum chipbustype commonbuses = fill_flash->mst->buses_supported & fill_flash->chip->bustype;
+
+		/* Sometimes chip and programmer have more than one bus in common,
+		 * and the limit is not exceeded on all buses. Tell the user. */
+		if ((bitcount(commonbuses) > limitexceeded)) {
+			msg_pdbg("There is at least one interface available which could support the size of\n"
+				 "the selected flash chip.\n");
+		}
+		msg_cerr("This flash chip is too big for this programmer (--verbose/-V gives details).\n"
+			 "Use --force/-f to override at your own risk.\n");
+		ret = 1;
+		goto out_shutdown;
+	}
+
+	if (!operation) {
+		msg_ginfo("No operations were specified.\n");
+		goto out_shutdown;
+	}
+
+	/* Map the selected flash chip again. */
+	if (map_flash(fill_flash) != 0) {
+		ret = 1;
+		goto out_shutdown;
+	}
+	progress_attach(fill_flash, index + 1);
+
+	/* FIXME: We should issue an unconditional chip reset here. This can be
+	 * done once we have a .reset function in struct flashchip.
+	 * Give the chip time to settle.
+	 */
+	programmer_delay(100000);
+	fill_flash->profile = timing_profile_load(fill_flash);
+	if (spi_autospeed(fill_flash))
+		ret = 1;
+	else if (job->replay_file)
+		ret |= spi_trace_replay(fill_flash, job->replay_file);
+	else if (job->daemon_socket)
+		ret |= daemon_serve(fill_flash, job->daemon_socket);
+	else if (job->benchmark)
+		ret |= benchmark_flash(fill_flash, job->force);
+	else
+		ret |= doit(fill_flash, job->force, job->filename, job->read_it, job->write_it, job->erase_it,
+			    job->verify_it);
+
+	unmap_flash(fill_flash);
+out_shutdown:
+	programmer_shutdown();
+	ret |= spi_trace_stop();
+	if (stats_enabled)
+		ret |= print_stats(job->stats_format, job->read_it && !strcmp(job->filename, "-") ? stderr : stdout);
+	for (i = 0; i < chipcount; i++)
+		free(flashes[i].chip);
+	return ret;
+}
+
+static void print_target(int index, enum programmer prog, const char *pparam)
+{
+	msg_ginfo("Target %d: %s%s%s\n", index + 1, programmer_table[prog].name, pparam ? ":" : "",
+		  pparam ? pparam : "");
+}
+
+/*
+ * Run the job on several targets. Every target gets its own process (if possible), so they are
+ * handled at the same time and don't share any programmer state. Their messages are prefixed with
+ * the number of the target.
+ */
+static int flash_targets(int count, const enum programmer *progs, char *const *pparams,
+			 const struct cli_job *job)
+{
+	int results[MAX_TARGETS];
+	char prefix[16];
+	int i, ret = 0;
+#if HAVE_FORK == 1
+	pid_t pids[MAX_TARGETS];
+	int status;
+#endif
+
+	for (i = 0; i < count; i++)
+		print_target(i, progs[i], pparams[i]);
+
+#if HAVE_FORK == 1
+	for (i = 0; i < count; i++) {
+		fflush(NULL);
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			snprintf(prefix, sizeof(prefix), "[%d] ", i + 1);
+			set_output_prefix(prefix);
+			ret = flash_target(progs[i], pparams[i], i, job);
+			set_output_prefix(NULL);
+			fflush(NULL);
+			_exit(ret ? 1 : 0);
+		}
+		if (pids[i] < 0)
+			msg_gerr("Error: Could not start a process for target %d: %s\n", i + 1, strerror(errno));
+	}
+	for (i = 0; i < count; i++) {
+		if (pids[i] < 0) {
+			results[i] = 1;
+			continue;
+		}
+		if (waitpid(pids[i], &status, 0) < 0)
+			results[i] = 1;
+		else
+			results[i] = !WIFEXITED(status) || WEXITSTATUS(status);
+	}
+#else
+	/* One after the other. */
+	for (i = 0; i < count; i++) {
+		snprintf(prefix, sizeof(prefix), "[%d] ", i + 1);
+		set_output_prefix(prefix);
+		results[i] = flash_target(progs[i], pparams[i], i, job);
+		set_output_prefix(NULL);
+	}
+#endif
+
+	msg_ginfo("\nResults:\n");
+	for (i = 0; i < count; i++) {
+		msg_ginfo("%s ", results[i] ? "FAILED" : "OK    ");
+		print_target(i, progs[i], pparams[i]);
+		ret |= results[i];
+	}
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct flashchip *chip = NULL;
 	const char *name;
-	int namelen, opt, i, j;
-	int startchip = -1, chipcount = 0, option_index = 0, force = 0;
+	int namelen, opt, i;
+	int option_index = 0, force = 0;
 #if CONFIG_PRINT_WIKI == 1
 	int list_supported_wiki = 0;
 #endif
 	int read_it = 0, write_it = 0, erase_it = 0, verify_it = 0;
 	int dont_verify_it = 0, list_supported = 0, operation_specified = 0;
+	int ifd = 0;
 	enum programmer prog = PROGRAMMER_INVALID;
+	enum programmer progs[MAX_TARGETS];
+	char *pparams[MAX_TARGETS];
+	int target_count = 0;
 	int ret = 0;
 
 	static const char optstring[] = "r:Rw:v:nVEfc:l:i:p:Lzho:";
@@ -124,6 +517,20 @@ int main(int argc, char *argv[])
 		{"help",		0, NULL, 'h'},
 		{"version",		0, NULL, 'R'},
 		{"output",		1, NULL, 'o'},
+		{"verify-mode",		1, NULL, OPTION_VERIFY_MODE},
+		{"stats",		2, NULL, OPTION_STATS},
+		{"histograms",		0, NULL, OPTION_HISTOGRAMS},
+		{"trace",		1, NULL, OPTION_TRACE},
+		{"replay",		1, NULL, OPTION_REPLAY},
+		{"ifd",			0, NULL, OPTION_IFD},
+		{"daemon",		1, NULL, OPTION_DAEMON},
+		{"connect",		1, NULL, OPTION_CONNECT},
+		{"shutdown",		0, NULL, OPTION_SHUTDOWN},
+		{"progress",		2, NULL, OPTION_PROGRESS},
+		{"journal",		1, NULL, OPTION_JOURNAL},
+		{"skip-blank",		0, NULL, OPTION_SKIP_BLANK},
+		{"content-cache",	0, NULL, OPTION_CONTENT_CACHE},
+		{"benchmark",		0, NULL, OPTION_BENCHMARK},
 		{NULL,			0, NULL, 0},
 	};
 
@@ -134,9 +541,18 @@ int main(int argc, char *argv[])
 #endif /* !STANDALONE */
 	char *tempstr = NULL;
 	char *pparam = NULL;
-
-	print_version();
-	print_banner();
+	char *stats_format = NULL;
+	char *progress_format = NULL;
+	char *trace_file = NULL;
+	char *journal_file = NULL;
+	char *replay_file = NULL;
+	char *daemon_socket = NULL;
+	char *connect_socket = NULL;
+	bool shutdown_daemon = false;
+	bool benchmark = false;
+	/* The -i arguments (owned by layout.c), to pass them on to a daemon. */
+	char **images = NULL;
+	unsigned int num_images = 0;
 
 	if (selfcheck())
 		exit(1);
@@ -194,6 +610,7 @@ int main(int argc, char *argv[])
 			verbose_screen++;
 			if (verbose_screen > MSG_DEBUG2)
 				verbose_logfile = verbose_screen;
+			update_print_level();
 			break;
 		case 'E':
 			if (++operation_specified > 1) {
@@ -212,6 +629,10 @@ int main(int argc, char *argv[])
 					"more than once. Aborting.\n");
 				cli_classic_abort_usage();
 			}
+			if (ifd) {
+				fprintf(stderr, "Error: --layout and --ifd both specified. Aborting.\n");
+				cli_classic_abort_usage();
+			}
 			layoutfile = strdup(optarg);
 			break;
 		case 'i':
@@ -220,6 +641,15 @@ int main(int argc, char *argv[])
 				free(tempstr);
 				cli_classic_abort_usage();
 			}
+			{
+				char **tmp = realloc(images, (num_images + 1) * sizeof(*images));
+				if (!tmp) {
+					fprintf(stderr, "Out of memory!\n");
+					exit(1);
+				}
+				images = tmp;
+				images[num_images++] = tempstr;
+			}
 			break;
 		case 'L':
 			if (++operation_specified > 1) {
@@ -244,14 +674,12 @@ int main(int argc, char *argv[])
 #endif
 			break;
 		case 'p':
-			if (prog != PROGRAMMER_INVALID) {
+			if (target_count == MAX_TARGETS) {
 				fprintf(stderr, "Error: --programmer specified "
-					"more than once. You can separate "
-					"multiple\nparameters for a programmer "
-					"with \",\". Please see the man page "
-					"for details.\n");
+					"more than %d times.\n", MAX_TARGETS);
 				cli_classic_abort_usage();
 			}
+			pparam = NULL;
 			for (prog = 0; prog < PROGRAMMER_INVALID; prog++) {
 				name = programmer_table[prog].name;
 				namelen = strlen(name);
@@ -284,14 +712,16 @@ int main(int argc, char *argv[])
 				msg_ginfo(".\n");
 				cli_classic_abort_usage();
 			}
+			progs[target_count] = prog;
+			pparams[target_count++] = pparam;
 			break;
 		case 'R':
-			/* print_version() is always called during startup. */
 			if (++operation_specified > 1) {
 				fprintf(stderr, "More than one operation "
 					"specified. Aborting.\n");
 				cli_classic_abort_usage();
 			}
+			print_version();
 			exit(0);
 			break;
 		case 'h':
@@ -300,6 +730,8 @@ int main(int argc, char *argv[])
 					"specified. Aborting.\n");
 				cli_classic_abort_usage();
 			}
+			print_version();
+			print_banner();
 			cli_classic_usage(argv[0]);
 			exit(0);
 			break;
@@ -315,6 +747,88 @@ int main(int argc, char *argv[])
 			}
 #endif /* STANDALONE */
 			break;
+		case OPTION_STATS:
+			if (optarg && strcmp(optarg, "human") && strcmp(optarg, "json") &&
+			    (strncmp(optarg, "json:", strlen("json:")) || !optarg[strlen("json:")])) {
+				fprintf(stderr, "Error: Invalid stats format \"%s\".\n", optarg);
+				cli_classic_abort_usage();
+			}
+			free(stats_format);
+			stats_format = optarg ? strdup(optarg) : NULL;
+			stats_enabled = true;
+			break;
+		case OPTION_HISTOGRAMS:
+			stats_histograms = true;
+			break;
+		case OPTION_TRACE:
+			free(trace_file);
+			trace_file = strdup(optarg);
+			break;
+		case OPTION_JOURNAL:
+			free(journal_file);
+			journal_file = strdup(optarg);
+			break;
+		case OPTION_SKIP_BLANK:
+			erase_skip_blank = true;
+			break;
+		case OPTION_CONTENT_CACHE:
+			content_cache = true;
+			/* The spot checks pick random blocks. */
+			srand(time(NULL) ^ getpid());
+			break;
+		case OPTION_IFD:
+			if (layoutfile) {
+				fprintf(stderr, "Error: --layout and --ifd both specified. Aborting.\n");
+				cli_classic_abort_usage();
+			}
+			ifd = 1;
+			break;
+		case OPTION_DAEMON:
+			if (++operation_specified > 1) {
+				fprintf(stderr, "More than one operation "
+					"specified. Aborting.\n");
+				cli_classic_abort_usage();
+			}
+			daemon_socket = strdup(optarg);
+			break;
+		case OPTION_BENCHMARK:
+			if (++operation_specified > 1) {
+				fprintf(stderr, "More than one operation "
+					"specified. Aborting.\n");
+				cli_classic_abort_usage();
+			}
+			benchmark = true;
+			break;
+		case OPTION_CONNECT:
+			free(connect_socket);
+			connect_socket = strdup(optarg);
+			break;
+		case OPTION_SHUTDOWN:
+			shutdown_daemon = true;
+			break;
+		case OPTION_PROGRESS:
+			if (optarg && strcmp(optarg, "bar") && strcmp(optarg, "json") &&
+			    (strncmp(optarg, "json:", strlen("json:")) || !optarg[strlen("json:")])) {
+				fprintf(stderr, "Error: Invalid progress format \"%s\".\n", optarg);
+				cli_classic_abort_usage();
+			}
+			free(progress_format);
+			progress_format = strdup(optarg ? optarg : "bar");
+			break;
+		case OPTION_REPLAY:
+			if (++operation_specified > 1) {
+				fprintf(stderr, "More than one operation "
+					"specified. Aborting.\n");
+				cli_classic_abort_usage();
+			}
+			replay_file = strdup(optarg);
+			break;
+		case OPTION_VERIFY_MODE:
+			if (parse_verify_mode(optarg)) {
+				fprintf(stderr, "Error: Invalid verify mode \"%s\".\n", optarg);
+				cli_classic_abort_usage();
+			}
+			break;
 		default:
 			cli_classic_abort_usage();
 			break;
@@ -329,9 +843,37 @@ int main(int argc, char *argv[])
 	if ((read_it | write_it | verify_it) && check_filename(filename, "image")) {
 		cli_classic_abort_usage();
 	}
+	/* "-r -" writes the image to stdout, everything else has to go elsewhere. */
+	if (read_it && !strcmp(filename, "-"))
+		reserve_stdout_for_data();
+
+	print_version();
+	print_banner();
 	if (layoutfile && check_filename(layoutfile, "layout")) {
 		cli_classic_abort_usage();
 	}
+	if (trace_file && check_filename(trace_file, "trace"))
+		cli_classic_abort_usage();
+	if (journal_file && check_filename(journal_file, "journal"))
+		cli_classic_abort_usage();
+	if (journal_file && !write_it) {
+		fprintf(stderr, "Error: --journal can only be used with -w.\n");
+		cli_classic_abort_usage();
+	}
+	if (erase_skip_blank && !erase_it) {
+		fprintf(stderr, "Error: --skip-blank can only be used with -E.\n");
+		cli_classic_abort_usage();
+	}
+	if (stats_histograms && !stats_enabled) {
+		fprintf(stderr, "Error: --histograms can only be used with --stats.\n");
+		cli_classic_abort_usage();
+	}
+	if (content_cache && !write_it && !daemon_socket) {
+		fprintf(stderr, "Error: --content-cache can only be used with -w or --daemon.\n");
+		cli_classic_abort_usage();
+	}
+	if (replay_file && check_filename(replay_file, "trace"))
+		cli_classic_abort_usage();
 
 #ifndef STANDALONE
 	if (logfile && check_filename(logfile, "log"))
@@ -368,8 +910,17 @@ int main(int argc, char *argv[])
 		ret = 1;
 		goto out;
 	}
-	if (layoutfile != NULL && !write_it) {
-		msg_gerr("Layout files are currently supported for write operations only.\n");
+	if (layoutfile != NULL && !write_it && !benchmark) {
+		msg_gerr("Layout files are currently supported for write operations and --benchmark only.\n");
+		ret = 1;
+		goto out;
+	}
+	if (ifd && !write_it) {
+		msg_gerr("--ifd is currently supported for write operations only.\n");
+		ret = 1;
+		goto out;
+	}
+	if (ifd && read_romlayout_ifd(filename)) {
 		ret = 1;
 		goto out;
 	}
@@ -378,12 +929,39 @@ int main(int argc, char *argv[])
 		ret = 1;
 		goto out;
 	}
+
+	if (shutdown_daemon && (!connect_socket || operation_specified)) {
+		msg_gerr("Error: --shutdown can only be used with --connect and no operation.\n");
+		ret = 1;
+		goto out;
+	}
+	if (connect_socket) {
+		if (target_count || daemon_socket || replay_file || trace_file || journal_file || chip_to_probe ||
+		    content_cache || benchmark) {
+			msg_gerr("Error: The programmer, chip and tracing are set up by the daemon, -p, -c, "
+				 "--daemon, --trace, --journal, --content-cache, --benchmark and --replay can't be "
+				 "used with --connect.\n");
+			ret = 1;
+			goto out;
+		}
+		struct daemon_request req = {
+			.op		= shutdown_daemon ? "shutdown" : read_it ? "read" : write_it ? "write" :
+					  verify_it ? "verify" : erase_it ? "erase" : "probe",
+			.filename	= filename,
+			.layoutfile	= layoutfile,
+			.ifd		= ifd,
+			.force		= force,
+			.noverify	= dont_verify_it,
+			.images		= images,
+			.num_images	= num_images,
+		};
+		ret = daemon_submit(connect_socket, &req);
+		goto out;
+	}
 	/* Does a chip with the requested name exist in the flashchips array? */
 	if (chip_to_probe) {
-		for (chip = flashchips; chip && chip->name; chip++)
-			if (!strcmp(chip->name, chip_to_probe))
-				break;
-		if (!chip || !chip->name) {
+		chip = find_chip_by_name(chip_to_probe, 0);
+		if (!chip) {
 			msg_cerr("Error: Unknown chip '%s' specified.\n", chip_to_probe);
 			msg_gerr("Run flashrom -L to view the hardware supported in this flashrom version.\n");
 			ret = 1;
@@ -392,13 +970,14 @@ int main(int argc, char *argv[])
 		/* Keep chip around for later usage in case a forced read is requested. */
 	}
 
-	if (prog == PROGRAMMER_INVALID) {
+	if (target_count == 0) {
 		if (CONFIG_DEFAULT_PROGRAMMER != PROGRAMMER_INVALID) {
-			prog = CONFIG_DEFAULT_PROGRAMMER;
-			/* We need to strdup here because we free(pparam) unconditionally later. */
-			pparam = strdup(CONFIG_DEFAULT_PROGRAMMER_ARGS);
+			progs[0] = CONFIG_DEFAULT_PROGRAMMER;
+			/* We need to strdup here because we free(pparams[]) unconditionally later. */
+			pparams[0] = strdup(CONFIG_DEFAULT_PROGRAMMER_ARGS);
+			target_count = 1;
 			msg_pinfo("Using default programmer \"%s\" with arguments \"%s\".\n",
-				  programmer_table[CONFIG_DEFAULT_PROGRAMMER].name, pparam);
+				  programmer_table[CONFIG_DEFAULT_PROGRAMMER].name, pparams[0]);
 		} else {
 			msg_perr("Please select a programmer with the --programmer parameter.\n"
 				 "Previously this was not necessary because there was a default set.\n"
@@ -412,149 +991,86 @@ int main(int argc, char *argv[])
 			goto out;
 		}
 	}
-
-	/* FIXME: Delay calibration should happen in programmer code. */
-	myusec_calibrate_delay();
-
-	if (programmer_init(prog, pparam)) {
-		msg_perr("Error: Programmer initialization failed.\n");
+	if (target_count > 1 && read_it) {
+		msg_gerr("Error: Reading is not supported with more than one programmer.\n");
 		ret = 1;
-		goto out_shutdown;
+		goto out;
 	}
-	tempstr = flashbuses_to_text(get_buses_supported());
-	msg_pdbg("The following protocols are supported: %s.\n", tempstr);
-	free(tempstr);
-
-	for (j = 0; j < registered_master_count; j++) {
-		startchip = 0;
-		while (chipcount < ARRAY_SIZE(flashes)) {
-			startchip = probe_flash(&registered_masters[j], startchip, &flashes[chipcount], 0);
-			if (startchip == -1)
-				break;
-			chipcount++;
-			startchip++;
-		}
+	if (target_count > 1 && stats_format && !strncmp(stats_format, "json:", strlen("json:"))) {
+		msg_gerr("Error: --stats=json:<file> is not supported with more than one programmer.\n");
+		ret = 1;
+		goto out;
 	}
-
-	if (chipcount > 1) {
-		msg_cinfo("Multiple flash chip definitions match the detected chip(s): \"%s\"",
-			  flashes[0].chip->name);
-		for (i = 1; i < chipcount; i++)
-			msg_cinfo(", \"%s\"", flashes[i].chip->name);
-		msg_cinfo("\nPlease specify which chip definition to use with the -c <chipname> option.\n");
+	if (target_count > 1 && progress_format && !strcmp(progress_format, "bar")) {
+		msg_gerr("Error: The progress bar is not supported with more than one programmer, "
+			 "use --progress=json.\n");
 		ret = 1;
-		goto out_shutdown;
-	} else if (!chipcount) {
-		msg_cinfo("No EEPROM/flash device found.\n");
-		if (!force || !chip_to_probe) {
-			msg_cinfo("Note: flashrom can never write if the flash chip isn't found "
-				  "automatically.\n");
-		}
-		if (force && read_it && chip_to_probe) {
-			struct registered_master *mst;
-			int compatible_masters = 0;
-			msg_cinfo("Force read (-f -r -c) requested, pretending the chip is there:\n");
-			/* This loop just counts compatible controllers. */
-			for (j = 0; j < registered_master_count; j++) {
-				mst = &registered_masters[j];
-				/* chip is still set from the chip_to_probe earlier in this function. */
-				if (mst->buses_supported & chip->bustype)
-					compatible_masters++;
-			}
-			if (!compatible_masters) {
-				msg_cinfo("No compatible controller found for the requested flash chip.\n");
-				ret = 1;
-				goto out_shutdown;
-			}
-			if (compatible_masters > 1)
-				msg_cinfo("More than one compatible controller found for the requested flash "
-					  "chip, using the first one.\n");
-			for (j = 0; j < registered_master_count; j++) {
-				mst = &registered_masters[j];
-				startchip = probe_flash(mst, 0, &flashes[0], 1);
-				if (startchip != -1)
-					break;
-			}
-			if (startchip == -1) {
-				// FIXME: This should never happen! Ask for a bug report?
-				msg_cinfo("Probing for flash chip '%s' failed.\n", chip_to_probe);
-				ret = 1;
-				goto out_shutdown;
-			}
-			if (map_flash(&flashes[0]) != 0) {
-				free(flashes[0].chip);
-				ret = 1;
-				goto out_shutdown;
-			}
-			msg_cinfo("Please note that forced reads most likely contain garbage.\n");
-			ret = read_flash_to_file(&flashes[0], filename);
-			unmap_flash(&flashes[0]);
-			free(flashes[0].chip);
-			goto out_shutdown;
-		}
+		goto out;
+	}
+	if (progress_format && progress_setup(progress_format)) {
 		ret = 1;
-		goto out_shutdown;
-	} else if (!chip_to_probe) {
-		/* repeat for convenience when looking at foreign logs */
-		tempstr = flashbuses_to_text(flashes[0].chip->bustype);
-		msg_gdbg("Found %s flash chip \"%s\" (%d kB, %s).\n",
-			 flashes[0].chip->vendor, flashes[0].chip->name, flashes[0].chip->total_size, tempstr);
-		free(tempstr);
+		goto out;
 	}
-
-	fill_flash = &flashes[0];
-
-	print_chip_support_status(fill_flash->chip);
-
-	unsigned int limitexceeded = count_max_decode_exceedings(fill_flash);
-	if (limitexceeded > 0 && !force) {
-		enum chipbustype commonbuses = fill_flash->mst->buses_supported & fill_flash->chip->bustype;
-
-		/* Sometimes chip and programmer have more than one bus in common,
-		 * and the limit is not exceeded on all buses. Tell the user. */
-		if ((bitcount(commonbuses) > limitexceeded)) {
-			msg_pdbg("There is at least one interface available which could support the size of\n"
-				 "the selected flash chip.\n");
-		}
-		msg_cerr("This flash chip is too big for this programmer (--verbose/-V gives details).\n"
-			 "Use --force/-f to override at your own risk.\n");
+	if (target_count > 1 && daemon_socket) {
+		msg_gerr("Error: --daemon is not supported with more than one programmer.\n");
 		ret = 1;
-		goto out_shutdown;
+		goto out;
 	}
-
-	if (!(read_it | write_it | verify_it | erase_it)) {
-		msg_ginfo("No operations were specified.\n");
-		goto out_shutdown;
+	if (target_count > 1 && trace_file) {
+		msg_gerr("Error: --trace is not supported with more than one programmer.\n");
+		ret = 1;
+		goto out;
 	}
+	if (target_count > 1 && journal_file) {
+		msg_gerr("Error: --journal is not supported with more than one programmer.\n");
+		ret = 1;
+		goto out;
+	}
+	journal_path = journal_file;
 
 	/* Always verify write operations unless -n is used. */
 	if (write_it && !dont_verify_it)
 		verify_it = 1;
 
-	/* Map the selected flash chip again. */
-	if (map_flash(fill_flash) != 0) {
-		ret = 1;
-		goto out_shutdown;
-	}
+	struct cli_job job = {
+		.filename	= filename,
+		.stats_format	= stats_format,
+		.trace_file	= trace_file,
+		.replay_file	= replay_file,
+		.daemon_socket	= daemon_socket,
+		.benchmark	= benchmark,
+		.chip		= chip,
+		.force		= force,
+		.read_it	= read_it,
+		.write_it	= write_it,
+		.erase_it	= erase_it,
+		.verify_it	= verify_it,
+	};
 
-	/* FIXME: We should issue an unconditional chip reset here. This can be
-	 * done once we have a .reset function in struct flashchip.
-	 * Give the chip time to settle.
-	 */
-	programmer_delay(100000);
-	ret |= doit(fill_flash, force, filename, read_it, write_it, erase_it, verify_it);
+	/* FIXME: Delay calibration should happen in programmer code. */
+	myusec_calibrate_delay();
 
-	unmap_flash(fill_flash);
-out_shutdown:
-	programmer_shutdown();
-out:
-	for (i = 0; i < chipcount; i++)
-		free(flashes[i].chip);
+	if (target_count == 1)
+		ret = flash_target(progs[0], pparams[0], 0, &job);
+	else
+		ret = flash_targets(target_count, progs, pparams, &job);
 
+out:
 	layout_cleanup();
 	free(filename);
 	free(layoutfile);
-	free(pparam);
+	for (i = 0; i < target_count; i++)
+		free(pparams[i]);
+	free(stats_format);
+	free(progress_format);
+	progress_finish();
+	free(trace_file);
+	journal_path = NULL;
+	free(journal_file);
+	free(replay_file);
+	free(daemon_socket);
+	free(connect_socket);
+	free(images);
 	/* clean up global variables */
 	free((char *)chip_to_probe); /* Silence! Freeing is not modifying contents. */
 	chip_to_probe = NULL;
@@ -0,0 +1,491 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Daemon mode: keep the programmer initialized and the chip probed, and run jobs sent by clients over a
+ * Unix domain socket one after the other.
+ *
+ * A job is a list of "<key> <value>" lines ending with "end". While it runs, all messages go to the client.
+ * They are followed by a NUL byte and the result ('0' or '1'), then the connection is closed.
+ */
+
+/* For struct ucred. */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "flash.h"
+
+#if !IS_WINDOWS && !defined(__DJGPP__) && !defined(__LIBPAYLOAD__)
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#define HAVE_UNIX_SOCKETS 1
+#endif
+
+#if HAVE_UNIX_SOCKETS == 1
+
+#define DAEMON_MAX_LINE	4096
+/* How long a client may take to send each part of its job before it is dropped. */
+#define DAEMON_RECV_TIMEOUT_S	10
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void daemon_signal(int sig)
+{
+	daemon_stop = 1;
+}
+
+static int socket_address(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		msg_gerr("Error: Socket path \"%s\" is too long.\n", path);
+		return 1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+struct daemon_job {
+	char *op;
+	char *filename;
+	char *layoutfile;
+	bool ifd;
+	bool force;
+	bool noverify;
+	int verbose;
+	char **images;
+	unsigned int num_images;
+};
+
+static void free_job(struct daemon_job *job)
+{
+	unsigned int i;
+
+	free(job->op);
+	free(job->filename);
+	free(job->layoutfile);
+	for (i = 0; i < job->num_images; i++)
+		free(job->images[i]);
+	free(job->images);
+	memset(job, 0, sizeof(*job));
+}
+
+/* Parse the job sent over @in. Returns 0 on success. */
+static int parse_job(FILE *in, struct daemon_job *job)
+{
+	char line[DAEMON_MAX_LINE];
+	char *value;
+	size_t len;
+
+	job->verbose = MSG_INFO;
+	while (fgets(line, sizeof(line), in)) {
+		len = strlen(line);
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!strcmp(line, "end"))
+			return !job->op;
+		value = strchr(line, ' ');
+		if (value)
+			*value++ = '\0';
+		else
+			value = line + len;
+
+		if (!strcmp(line, "op")) {
+			free(job->op);
+			job->op = strdup(value);
+		} else if (!strcmp(line, "file")) {
+			free(job->filename);
+			job->filename = strdup(value);
+		} else if (!strcmp(line, "layout")) {
+			free(job->layoutfile);
+			job->layoutfile = strdup(value);
+		} else if (!strcmp(line, "image")) {
+			char **tmp = realloc(job->images, (job->num_images + 1) * sizeof(*tmp));
+			if (!tmp)
+				return 1;
+			job->images = tmp;
+			job->images[job->num_images] = strdup(value);
+			if (!job->images[job->num_images])
+				return 1;
+			job->num_images++;
+		} else if (!strcmp(line, "ifd")) {
+			job->ifd = true;
+		} else if (!strcmp(line, "force")) {
+			job->force = true;
+		} else if (!strcmp(line, "noverify")) {
+			job->noverify = true;
+		} else if (!strcmp(line, "verbose")) {
+			job->verbose = atoi(value);
+		} else {
+			/* Newer clients may send more, ignore it. */
+			msg_gdbg("Ignoring unknown job line \"%s\".\n", line);
+		}
+	}
+	return 1;
+}
+
+/* Run @job on @flash, just like a command line with the same options would. */
+static int run_job(struct flashctx *flash, const struct daemon_job *job)
+{
+	int read_it = 0, write_it = 0, erase_it = 0, verify_it = 0;
+	unsigned int i;
+	int ret = 1;
+
+	if (!strcmp(job->op, "read"))
+		read_it = 1;
+	else if (!strcmp(job->op, "write"))
+		write_it = 1;
+	else if (!strcmp(job->op, "verify"))
+		verify_it = 1;
+	else if (!strcmp(job->op, "erase"))
+		erase_it = 1;
+	else if (strcmp(job->op, "probe")) {
+		msg_gerr("Error: Unknown operation \"%s\".\n", job->op);
+		return 1;
+	}
+	if ((read_it || write_it || verify_it) && !job->filename) {
+		msg_gerr("Error: No image file specified.\n");
+		return 1;
+	}
+	if ((job->layoutfile || job->ifd) && !write_it) {
+		msg_gerr("Layout files are currently supported for write operations only.\n");
+		return 1;
+	}
+
+	if (job->layoutfile && read_romlayout(job->layoutfile))
+		goto out;
+	for (i = 0; i < job->num_images; i++) {
+		char *name = strdup(job->images[i]);
+		if (!name || register_include_arg(name)) {
+			free(name);
+			goto out;
+		}
+	}
+	if (job->ifd && read_romlayout_ifd(job->filename))
+		goto out;
+	if (process_include_args())
+		goto out;
+
+	if (write_it && !job->noverify)
+		verify_it = 1;
+	if (!(read_it | write_it | erase_it | verify_it)) {
+		msg_ginfo("Found %s flash chip \"%s\" (%d kB).\n", flash->chip->vendor, flash->chip->name,
+			  flash->chip->total_size);
+		ret = 0;
+		goto out;
+	}
+	ret = doit(flash, job->force, job->filename, read_it, write_it, erase_it, verify_it);
+out:
+	layout_cleanup();
+	return ret;
+}
+
+/*
+ * Whether the client connected to @fd runs as the same user as the daemon. Jobs read and write any file
+ * the daemon has access to, and it usually runs as root.
+ */
+static bool client_trusted(int fd)
+{
+	uid_t uid;
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return false;
+	uid = cred.uid;
+#else
+	gid_t gid;
+
+	if (getpeereid(fd, &uid, &gid))
+		return false;
+#endif
+	return uid == geteuid();
+}
+
+/* Handle the client connected to @fd. Returns 1 if the daemon should stop afterwards. */
+static int serve_client(struct flashctx *flash, int fd, unsigned int jobnum)
+{
+	struct daemon_job job = { 0 };
+	struct timeval start, end;
+	int saved_stdout, saved_stderr, saved_verbose = verbose_screen;
+	int ret = 1, stop = 0;
+	char result[2];
+	FILE *in;
+	const struct timeval timeout = { DAEMON_RECV_TIMEOUT_S, 0 };
+
+	if (!client_trusted(fd)) {
+		msg_gerr("Job %u: rejected, the client runs as another user.\n", jobnum);
+		return 0;
+	}
+	/* An idle client must not keep the others waiting. */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))) {
+		msg_gerr("Job %u: can't set a receive timeout: %s\n", jobnum, strerror(errno));
+		return 0;
+	}
+	in = fdopen(dup(fd), "r");
+	if (!in)
+		return 0;
+	if (parse_job(in, &job)) {
+		fclose(in);
+		free_job(&job);
+		msg_gerr("Job %u: invalid request.\n", jobnum);
+		return 0;
+	}
+	fclose(in);
+
+	msg_ginfo("Job %u: %s%s%s\n", jobnum, job.op, job.filename ? " " : "", job.filename ? job.filename : "");
+	gettimeofday(&start, NULL);
+
+	/* All messages of the job go to the client. */
+	fflush(stdout);
+	fflush(stderr);
+	saved_stdout = dup(STDOUT_FILENO);
+	saved_stderr = dup(STDERR_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+	verbose_screen = job.verbose;
+	update_print_level();
+
+	if (!strcmp(job.op, "shutdown")) {
+		msg_ginfo("Shutting down the daemon.\n");
+		ret = 0;
+		stop = 1;
+	} else {
+		ret = run_job(flash, &job) ? 1 : 0;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	verbose_screen = saved_verbose;
+	update_print_level();
+	dup2(saved_stdout, STDOUT_FILENO);
+	dup2(saved_stderr, STDERR_FILENO);
+	close(saved_stdout);
+	close(saved_stderr);
+
+	result[0] = '\0';
+	result[1] = ret ? '1' : '0';
+	if (write_all(fd, result, sizeof(result)))
+		msg_gwarn("Job %u: client went away.\n", jobnum);
+
+	gettimeofday(&end, NULL);
+	msg_ginfo("Job %u: %s (%.2f s)\n", jobnum, ret ? "FAILED" : "done",
+		  (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+	free_job(&job);
+	return stop;
+}
+
+/*
+ * Listen on the Unix domain socket at @path and run the jobs sent by clients on @flash, until a client asks
+ * for a shutdown or a termination signal arrives. Returns 0 on success.
+ */
+int daemon_serve(struct flashctx *flash, const char *path)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct stat st;
+	unsigned int jobnum = 0;
+	int listen_fd, fd, ret;
+	mode_t old_umask;
+
+	if (socket_address(&addr, path))
+		return 1;
+	/* Replace a stale socket, but nothing else. */
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		msg_gerr("Error: Could not create a socket: %s\n", strerror(errno));
+		return 1;
+	}
+	/* Only the user running the daemon may connect, from the moment the socket exists. */
+	old_umask = umask(077);
+	ret = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(old_umask);
+	if (ret || chmod(path, 0600) || listen(listen_fd, 8)) {
+		msg_gerr("Error: Could not listen on \"%s\": %s\n", path, strerror(errno));
+		close(listen_fd);
+		if (!ret)
+			unlink(path);
+		return 1;
+	}
+
+	/* No SA_RESTART: a signal has to interrupt accept(). */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	msg_ginfo("Waiting for jobs on %s.\n", path);
+	while (!daemon_stop) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			msg_gerr("Error: accept() failed: %s\n", strerror(errno));
+			break;
+		}
+		if (serve_client(flash, fd, ++jobnum))
+			daemon_stop = 1;
+		close(fd);
+	}
+
+	close(listen_fd);
+	unlink(path);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	return 0;
+}
+
+/* Send a "<key> <value>" line, making relative file names absolute as the daemon has another cwd. */
+static int send_line(int fd, const char *key, const char *value, bool is_path)
+{
+	char cwd[DAEMON_MAX_LINE];
+	char line[2 * DAEMON_MAX_LINE];
+
+	if (is_path && value[0] != '/') {
+		if (!getcwd(cwd, sizeof(cwd))) {
+			msg_gerr("Error: getcwd() failed: %s\n", strerror(errno));
+			return 1;
+		}
+		snprintf(line, sizeof(line), "%s %s/%s\n", key, cwd, value);
+	} else {
+		snprintf(line, sizeof(line), "%s%s%s\n", key, value ? " " : "", value ? value : "");
+	}
+	if (strchr(line, '\n') != line + strlen(line) - 1) {
+		msg_gerr("Error: Line breaks in arguments are not supported.\n");
+		return 1;
+	}
+	return write_all(fd, line, strlen(line));
+}
+
+/*
+ * Send a job to the daemon listening at @path and pass its messages through. @op is one of "probe", "read",
+ * "write", "verify", "erase" and "shutdown". Returns the result of the job.
+ */
+int daemon_submit(const char *path, const struct daemon_request *req)
+{
+	struct sockaddr_un addr;
+	char buf[4096], verbose[16];
+	bool got_result = false;
+	int fd, ret = 1;
+	unsigned int i;
+	ssize_t n;
+
+	if (req->filename && !strcmp(req->filename, "-")) {
+		msg_gerr("Error: Standard input/output can't be used with the flashrom daemon.\n");
+		return 1;
+	}
+	if (socket_address(&addr, path))
+		return 1;
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		msg_gerr("Error: Could not connect to the flashrom daemon at \"%s\": %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+
+	snprintf(verbose, sizeof(verbose), "%d", verbose_screen);
+	if (send_line(fd, "op", req->op, false) ||
+	    (req->filename && send_line(fd, "file", req->filename, true)) ||
+	    (req->layoutfile && send_line(fd, "layout", req->layoutfile, true)) ||
+	    (req->ifd && send_line(fd, "ifd", NULL, false)) ||
+	    (req->force && send_line(fd, "force", NULL, false)) ||
+	    (req->noverify && send_line(fd, "noverify", NULL, false)) ||
+	    send_line(fd, "verbose", verbose, false))
+		goto out;
+	for (i = 0; i < req->num_images; i++) {
+		if (send_line(fd, "image", req->images[i], false))
+			goto out;
+	}
+	if (send_line(fd, "end", NULL, false))
+		goto out;
+
+	/* Everything up to the NUL byte are messages, the byte after it is the result. */
+	fflush(stdout);
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		char *nul;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		nul = memchr(buf, '\0', n);
+		if (write_all(STDOUT_FILENO, buf, nul ? nul - buf : n))
+			break;
+		if (nul) {
+			char result;
+			if (nul + 1 < buf + n)
+				result = nul[1];
+			else if (read(fd, &result, 1) != 1)
+				break;
+			ret = result != '0';
+			got_result = true;
+			break;
+		}
+	}
+	if (!got_result)
+		msg_gerr("Error: The flashrom daemon closed the connection unexpectedly.\n");
+out:
+	close(fd);
+	return ret;
+}
+
+#else
+
+int daemon_serve(struct flashctx *flash, const char *path)
+{
+	msg_gerr("Error: Daemon mode is not supported on this platform.\n");
+	return 1;
+}
+
+int daemon_submit(const char *path, const struct daemon_request *req)
+{
+	msg_gerr("Error: Daemon mode is not supported on this platform.\n");
+	return 1;
+}
+
+#endif
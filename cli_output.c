@@ -21,15 +21,39 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <sys/time.h>
 #include "flash.h"
 
 int verbose_screen = MSG_INFO;
 int verbose_logfile = MSG_DEBUG2;
+int print_level_max = MSG_INFO;
+/* Set if stdout carries data (e.g. the image read with "-r -"), so messages have to go to stderr. */
+static bool stdout_is_data = false;
+
+void reserve_stdout_for_data(void)
+{
+	stdout_is_data = true;
+}
 
 #ifndef STANDALONE
 static FILE *logfile = NULL;
+#endif
+
+/* Call after changing verbose_screen or verbose_logfile. */
+void update_print_level(void)
+{
+	print_level_max = verbose_screen;
+#ifndef STANDALONE
+	if (logfile && verbose_logfile > print_level_max)
+		print_level_max = verbose_logfile;
+#endif
+}
+
+#ifndef STANDALONE
 
 int close_logfile(void)
 {
@@ -39,10 +63,12 @@ int close_logfile(void)
 	if (fclose(logfile)) {
 		/* fclose returned an error. Stop writing to be safe. */
 		logfile = NULL;
+		update_print_level();
 		msg_gerr("Closing the log file returned error %s\n", strerror(errno));
 		return 1;
 	}
 	logfile = NULL;
+	update_print_level();
 	return 0;
 }
 
@@ -56,6 +82,7 @@ int open_logfile(const char * const filename)
 		msg_gerr("Error: opening log file \"%s\" failed: %s\n", filename, strerror(errno));
 		return 1;
 	}
+	update_print_level();
 	return 0;
 }
 
@@ -70,6 +97,99 @@ void start_logging(void)
 }
 #endif /* !STANDALONE */
 
+/* If set, every line is prefixed with this and only complete lines are written (see set_output_prefix()). */
+static const char *output_prefix = NULL;
+
+struct line_buffer {
+	FILE *f;
+	char *buf;
+	size_t len;
+	size_t capacity;
+};
+static struct line_buffer line_buffers[3];
+
+static struct line_buffer *get_line_buffer(FILE *f)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(line_buffers); i++) {
+		if (line_buffers[i].f == f || !line_buffers[i].f) {
+			line_buffers[i].f = f;
+			return &line_buffers[i];
+		}
+	}
+	return NULL;
+}
+
+static void append_to_line(struct line_buffer *lb, const char *text, size_t len)
+{
+	if (lb->len + len > lb->capacity) {
+		size_t capacity = (lb->len + len) * 2;
+		char *tmp = realloc(lb->buf, capacity);
+		if (!tmp)
+			return;
+		lb->buf = tmp;
+		lb->capacity = capacity;
+	}
+	memcpy(lb->buf + lb->len, text, len);
+	lb->len += len;
+}
+
+/* Write @text to @f, prefixing every line and collecting partial lines until they are complete. */
+static int print_prefixed(FILE *f, const char *fmt, va_list ap)
+{
+	struct line_buffer *lb = get_line_buffer(f);
+	char *text, *pos, *eol;
+	va_list aq;
+	int len;
+
+	va_copy(aq, ap);
+	len = vsnprintf(NULL, 0, fmt, aq);
+	va_end(aq);
+	if (len < 0 || !lb)
+		return vfprintf(f, fmt, ap);
+	text = malloc(len + 1);
+	if (!text)
+		return vfprintf(f, fmt, ap);
+	vsnprintf(text, len + 1, fmt, ap);
+
+	for (pos = text; *pos; pos = eol) {
+		eol = strchr(pos, '\n');
+		eol = eol ? eol + 1 : pos + strlen(pos);
+		if (!lb->len)
+			append_to_line(lb, output_prefix, strlen(output_prefix));
+		append_to_line(lb, pos, eol - pos);
+		if (eol[-1] == '\n') {
+			/* One write per line, so lines of concurrent processes don't get mixed up. */
+			fwrite(lb->buf, 1, lb->len, f);
+			lb->len = 0;
+		}
+	}
+	free(text);
+	return len;
+}
+
+/*
+ * Prefix all messages with @prefix, e.g. to tell apart several targets flashed at the same time.
+ * NULL writes out any pending partial lines and turns prefixing off again.
+ */
+void set_output_prefix(const char *prefix)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(line_buffers); i++) {
+		struct line_buffer *lb = &line_buffers[i];
+		if (lb->len) {
+			fwrite(lb->buf, 1, lb->len, lb->f);
+			fputc('\n', lb->f);
+			fflush(lb->f);
+		}
+		free(lb->buf);
+		memset(lb, 0, sizeof(*lb));
+	}
+	output_prefix = prefix;
+}
+
 /* Please note that level is the verbosity, not the importance of the message. */
 int print(enum msglevel level, const char *fmt, ...)
 {
@@ -77,12 +197,21 @@ int print(enum msglevel level, const char *fmt, ...)
 	int ret = 0;
 	FILE *output_type = stdout;
 
-	if (level < MSG_INFO)
+	va_start(ap, fmt);
+	ret = print_captured(level, fmt, ap);
+	va_end(ap);
+	if (ret >= 0)
+		return ret;
+	ret = 0;
+	if (level < MSG_INFO || stdout_is_data)
 		output_type = stderr;
 
 	if (level <= verbose_screen) {
 		va_start(ap, fmt);
-		ret = vfprintf(output_type, fmt, ap);
+		if (output_prefix)
+			ret = print_prefixed(output_type, fmt, ap);
+		else
+			ret = vfprintf(output_type, fmt, ap);
 		va_end(ap);
 		/* msg_*spew often happens inside chip accessors in possibly
 		 * time-critical operations. Don't slow them down by flushing. */
@@ -92,7 +221,10 @@ int print(enum msglevel level, const char *fmt, ...)
 #ifndef STANDALONE
 	if ((level <= verbose_logfile) && logfile) {
 		va_start(ap, fmt);
-		ret = vfprintf(logfile, fmt, ap);
+		if (output_prefix)
+			ret = print_prefixed(logfile, fmt, ap);
+		else
+			ret = vfprintf(logfile, fmt, ap);
 		va_end(ap);
 		if (level != MSG_SPEW)
 			fflush(logfile);
@@ -100,3 +232,161 @@ int print(enum msglevel level, const char *fmt, ...)
 #endif /* !STANDALONE */
 	return ret;
 }
+
+/*
+ * Progress display (--progress). The core reports every erase block and read chunk, but the terminal or
+ * the consumer of the events only gets an update every PROGRESS_INTERVAL_US and at the end of a pass, so
+ * following an operation costs next to nothing even with small eraseblocks and slow outputs.
+ */
+#define PROGRESS_INTERVAL_US	100000
+#define PROGRESS_BAR_WIDTH	30
+
+static enum {
+	PROGRESS_OFF,
+	PROGRESS_BAR,
+	PROGRESS_JSON,
+} progress_format = PROGRESS_OFF;
+static FILE *progress_file;
+static int progress_target;
+
+static struct {
+	enum progress_stage stage;
+	uint64_t stage_start;	/* Time the current pass started. */
+	uint64_t last_shown;
+	unsigned int last_shown_pos;
+	unsigned int last_pos;
+	bool active;		/* A pass is in progress. */
+} progress;
+
+static const char *const progress_stage_names[] = {
+	[PROGRESS_READ]		= "read",
+	[PROGRESS_WRITE]	= "write",
+	[PROGRESS_VERIFY]	= "verify",
+};
+
+static uint64_t progress_now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* @format is "bar", "json" or "json:<file>". Returns 0 on success. */
+int progress_setup(const char *format)
+{
+	if (!format || !strcmp(format, "bar")) {
+		progress_format = PROGRESS_BAR;
+		progress_file = stderr;
+		return 0;
+	}
+	if (!strcmp(format, "json")) {
+		progress_format = PROGRESS_JSON;
+		progress_file = stderr;
+		return 0;
+	}
+	if (strncmp(format, "json:", strlen("json:")) || !format[strlen("json:")]) {
+		msg_gerr("Error: Invalid progress format \"%s\".\n", format);
+		return 1;
+	}
+	progress_file = fopen(format + strlen("json:"), "w");
+	if (!progress_file) {
+		msg_gerr("Error: opening progress file \"%s\" failed: %s\n", format + strlen("json:"),
+			 strerror(errno));
+		return 1;
+	}
+	progress_format = PROGRESS_JSON;
+	return 0;
+}
+
+int progress_finish(void)
+{
+	int ret = 0;
+
+	if (progress_file && progress_file != stderr && fclose(progress_file)) {
+		msg_gerr("Error: writing the progress file failed: %s\n", strerror(errno));
+		ret = 1;
+	}
+	progress_file = NULL;
+	progress_format = PROGRESS_OFF;
+	return ret;
+}
+
+static void show_progress_bar(unsigned int current, unsigned int total, double eta)
+{
+	char bar[PROGRESS_BAR_WIDTH + 1];
+	unsigned int filled = (uint64_t)current * PROGRESS_BAR_WIDTH / total;
+
+	if (current == total) {
+		/* Make room for the messages following the pass. */
+		fprintf(progress_file, "\r%*s\r", PROGRESS_BAR_WIDTH + 50, "");
+		fflush(progress_file);
+		return;
+	}
+	memset(bar, '=', filled);
+	memset(bar + filled, ' ', PROGRESS_BAR_WIDTH - filled);
+	bar[PROGRESS_BAR_WIDTH] = '\0';
+	fprintf(progress_file, "\r%-6s [%s] %3u%% 0x%08x/0x%08x", progress_stage_names[progress.stage], bar,
+		(unsigned int)((uint64_t)current * 100 / total), current, total);
+	if (eta >= 0)
+		fprintf(progress_file, " ETA %u:%02u", (unsigned int)eta / 60, (unsigned int)eta % 60);
+	fflush(progress_file);
+}
+
+static void show_progress_json(unsigned int current, unsigned int total, double elapsed, double eta)
+{
+	char line[256];
+	int len;
+
+	len = snprintf(line, sizeof(line), "{\"target\":%d,\"stage\":\"%s\",\"from\":%u,\"to\":%u,"
+		       "\"total\":%u,\"elapsed\":%.3f,\"rate\":%.0f,\"eta\":%.1f}\n", progress_target,
+		       progress_stage_names[progress.stage], progress.last_shown_pos, current, total, elapsed,
+		       elapsed > 0 ? current / elapsed : 0, eta);
+	/* One write per event, so events of several targets don't get mixed up. */
+	if (len > 0 && len < sizeof(line)) {
+		fwrite(line, 1, len, progress_file);
+		fflush(progress_file);
+	}
+}
+
+static void cli_progress(struct flashctx *flash, enum progress_stage stage, unsigned int current,
+			 unsigned int total)
+{
+	uint64_t now = progress_now_us();
+	double elapsed, eta = -1;
+
+	/* A new pass starts with another stage or when the offset goes backwards, e.g. after a retry. */
+	if (!progress.active || stage != progress.stage || current < progress.last_pos) {
+		progress.stage = stage;
+		progress.stage_start = now;
+		progress.last_shown = now;
+		progress.last_shown_pos = 0;
+		progress.active = true;
+		if (progress_format == PROGRESS_BAR)
+			fputc('\n', progress_file);
+	}
+	progress.last_pos = current;
+	if (current < total && now - progress.last_shown < PROGRESS_INTERVAL_US)
+		return;
+
+	elapsed = (now - progress.stage_start) / 1e6;
+	if (current && elapsed > 0)
+		eta = elapsed * (total - current) / current;
+	if (progress_format == PROGRESS_BAR)
+		show_progress_bar(current, total, eta);
+	else
+		show_progress_json(current, total, elapsed, eta >= 0 ? eta : 0);
+	progress.last_shown = now;
+	progress.last_shown_pos = current;
+	if (current >= total)
+		progress.active = false;
+}
+
+/* Show the progress of operations on @flash as selected with progress_setup(). @target counts from 1. */
+void progress_attach(struct flashctx *flash, int target)
+{
+	if (progress_format == PROGRESS_OFF)
+		return;
+	progress_target = target;
+	flash->progress_callback = cli_progress;
+}
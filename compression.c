@@ -0,0 +1,470 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Transparent zstd, lz4 and xz compression of image files. Compressed input is recognized by its magic
+ * number and decoded straight into the image buffer, compressed output is selected by the file name
+ * extension and encoded while the chip is read. No uncompressed copy is ever staged on disk.
+ */
+
+#ifndef __LIBPAYLOAD__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flash.h"
+
+#ifndef HAVE_ZSTD
+#define HAVE_ZSTD 0
+#endif
+#ifndef HAVE_LZ4
+#define HAVE_LZ4 0
+#endif
+#ifndef HAVE_LZMA
+#define HAVE_LZMA 0
+#endif
+
+#if HAVE_ZSTD == 1
+#include <zstd.h>
+#endif
+#if HAVE_LZ4 == 1
+#include <lz4frame.h>
+#endif
+#if HAVE_LZMA == 1
+#include <lzma.h>
+#endif
+
+#define COMPRESSION_CHUNK	(64 * 1024)
+
+static const struct {
+	const char *name;
+	const char *extension;
+	const uint8_t magic[6];
+	unsigned int magic_len;
+	bool supported;
+} formats[] = {
+	[IMAGE_RAW]	= { "raw", NULL, { 0 }, 0, true },
+	[IMAGE_ZSTD]	= { "zstd", ".zst", { 0x28, 0xb5, 0x2f, 0xfd }, 4, HAVE_ZSTD == 1 },
+	[IMAGE_LZ4]	= { "lz4", ".lz4", { 0x04, 0x22, 0x4d, 0x18 }, 4, HAVE_LZ4 == 1 },
+	[IMAGE_XZ]	= { "xz", ".xz", { 0xfd, '7', 'z', 'X', 'Z', 0x00 }, 6, HAVE_LZMA == 1 },
+};
+
+enum image_compression image_compression_from_magic(const uint8_t *buf, size_t len)
+{
+	unsigned int i;
+
+	for (i = IMAGE_RAW + 1; i < ARRAY_SIZE(formats); i++) {
+		if (len >= formats[i].magic_len && !memcmp(buf, formats[i].magic, formats[i].magic_len))
+			return i;
+	}
+	return IMAGE_RAW;
+}
+
+enum image_compression image_compression_from_name(const char *filename)
+{
+	size_t len = strlen(filename), extlen;
+	unsigned int i;
+
+	for (i = IMAGE_RAW + 1; i < ARRAY_SIZE(formats); i++) {
+		extlen = strlen(formats[i].extension);
+		if (len > extlen && !strcmp(filename + len - extlen, formats[i].extension))
+			return i;
+	}
+	return IMAGE_RAW;
+}
+
+static int check_supported(enum image_compression type, const char *filename)
+{
+	if (formats[type].supported)
+		return 0;
+	msg_gerr("Error: \"%s\" is %s compressed, but this flashrom was built without %s support.\n",
+		 filename, formats[type].name, formats[type].name);
+	return 1;
+}
+
+struct image_codec {
+	enum image_compression type;
+	FILE *file;
+	const char *filename;
+	uint8_t *buf;
+	size_t buf_size;
+	/* Decoding: the input so far ended at a frame/stream boundary. */
+	bool complete;
+#if HAVE_ZSTD == 1
+	ZSTD_CStream *zcs;
+	ZSTD_DStream *zds;
+#endif
+#if HAVE_LZ4 == 1
+	LZ4F_cctx *lz4c;
+	LZ4F_dctx *lz4d;
+#endif
+#if HAVE_LZMA == 1
+	lzma_stream xz;
+	bool xz_active;
+#endif
+};
+
+static void codec_free(struct image_codec *c)
+{
+#if HAVE_ZSTD == 1
+	ZSTD_freeCStream(c->zcs);
+	ZSTD_freeDStream(c->zds);
+#endif
+#if HAVE_LZ4 == 1
+	if (c->lz4c)
+		LZ4F_freeCompressionContext(c->lz4c);
+	if (c->lz4d)
+		LZ4F_freeDecompressionContext(c->lz4d);
+#endif
+#if HAVE_LZMA == 1
+	if (c->xz_active)
+		lzma_end(&c->xz);
+#endif
+	free(c->buf);
+	free(c);
+}
+
+static int codec_error(const struct image_codec *c, const char *what)
+{
+	msg_gerr("Error: %s %s data of \"%s\" failed.\n", what, formats[c->type].name, c->filename);
+	return 1;
+}
+
+/*
+ * Decode some of @in into @out. On return *inlen is the number of bytes consumed, *outlen the number of bytes
+ * produced. @finish tells that there is no more input. Sets c->complete if the input so far ends exactly at
+ * the end of a frame. Returns 0 on success, 1 on corrupt input.
+ */
+static int decode_step(struct image_codec *c, const uint8_t *in, size_t *inlen, uint8_t *out, size_t *outlen,
+		       bool finish)
+{
+	switch (c->type) {
+#if HAVE_ZSTD == 1
+	case IMAGE_ZSTD: {
+		ZSTD_inBuffer zin = { in, *inlen, 0 };
+		ZSTD_outBuffer zout = { out, *outlen, 0 };
+		size_t r = ZSTD_decompressStream(c->zds, &zout, &zin);
+		if (ZSTD_isError(r)) {
+			msg_gdbg("zstd: %s\n", ZSTD_getErrorName(r));
+			return 1;
+		}
+		*inlen = zin.pos;
+		*outlen = zout.pos;
+		/* Without any progress, r is just the input size hint for the next frame. */
+		if (zin.pos || zout.pos)
+			c->complete = !r;
+		return 0;
+	}
+#endif
+#if HAVE_LZ4 == 1
+	case IMAGE_LZ4: {
+		size_t r = LZ4F_decompress(c->lz4d, out, outlen, in, inlen, NULL);
+		if (LZ4F_isError(r)) {
+			msg_gdbg("lz4: %s\n", LZ4F_getErrorName(r));
+			return 1;
+		}
+		if (*inlen || *outlen)
+			c->complete = !r;
+		return 0;
+	}
+#endif
+#if HAVE_LZMA == 1
+	case IMAGE_XZ: {
+		lzma_ret r;
+		c->xz.next_in = in;
+		c->xz.avail_in = *inlen;
+		c->xz.next_out = out;
+		c->xz.avail_out = *outlen;
+		r = lzma_code(&c->xz, finish ? LZMA_FINISH : LZMA_RUN);
+		*inlen -= c->xz.avail_in;
+		*outlen -= c->xz.avail_out;
+		if (r == LZMA_STREAM_END)
+			c->complete = true;
+		else if (r != LZMA_OK && r != LZMA_BUF_ERROR) {
+			msg_gdbg("xz: error %d\n", r);
+			return 1;
+		}
+		return 0;
+	}
+#endif
+	default:
+		return 1;
+	}
+}
+
+static struct image_codec *codec_new(enum image_compression type, FILE *file, const char *filename,
+				     size_t buf_size)
+{
+	struct image_codec *c = calloc(1, sizeof(*c));
+
+	if (c)
+		c->buf = malloc(buf_size);
+	if (!c || !c->buf) {
+		free(c);
+		msg_gerr("Out of memory!\n");
+		return NULL;
+	}
+	c->type = type;
+	c->file = file;
+	c->filename = filename;
+	c->buf_size = buf_size;
+	return c;
+}
+
+static int decoder_init(struct image_codec *c)
+{
+	switch (c->type) {
+#if HAVE_ZSTD == 1
+	case IMAGE_ZSTD:
+		c->zds = ZSTD_createDStream();
+		return !c->zds || ZSTD_isError(ZSTD_initDStream(c->zds));
+#endif
+#if HAVE_LZ4 == 1
+	case IMAGE_LZ4:
+		return LZ4F_isError(LZ4F_createDecompressionContext(&c->lz4d, LZ4F_VERSION));
+#endif
+#if HAVE_LZMA == 1
+	case IMAGE_XZ:
+		c->xz = (lzma_stream)LZMA_STREAM_INIT;
+		if (lzma_stream_decoder(&c->xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+			return 1;
+		c->xz_active = true;
+		return 0;
+#endif
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Decompress the rest of @in (of which the first @headlen bytes have already been read to @head) into @buf,
+ * which has to end up filled exactly. If @partial, @buf only takes the start of a possibly larger image.
+ * Returns 0 on success, 1 on error.
+ */
+int decompress_image(FILE *in, const char *filename, enum image_compression type, const uint8_t *head,
+		     size_t headlen, uint8_t *buf, unsigned long size, bool partial)
+{
+	struct image_codec *c;
+	uint8_t scratch[256];
+	unsigned long pos = 0;
+	bool eof = false;
+	int ret = 1;
+
+	if (check_supported(type, filename))
+		return 1;
+	c = codec_new(type, in, filename, COMPRESSION_CHUNK);
+	if (!c)
+		return 1;
+	if (decoder_init(c)) {
+		msg_gerr("Error: Could not initialize the %s decoder.\n", formats[type].name);
+		goto out;
+	}
+	msg_gdbg("Decompressing %s image \"%s\".\n", formats[type].name, filename);
+
+	memcpy(c->buf, head, headlen);
+	size_t avail = headlen, off = 0;
+	while (1) {
+		if (off == avail && !eof) {
+			avail = fread(c->buf, 1, c->buf_size, in);
+			off = 0;
+			if (ferror(in)) {
+				msg_gerr("Error: Reading \"%s\" failed.\n", filename);
+				goto out;
+			}
+			eof = !avail;
+		}
+		/* Anything beyond the chip size goes to the scratch buffer, just to detect it. */
+		uint8_t *dst = pos < size ? buf + pos : scratch;
+		size_t room = pos < size ? size - pos : sizeof(scratch);
+		size_t inlen = avail - off, outlen = room;
+		if (decode_step(c, c->buf + off, &inlen, dst, &outlen, eof)) {
+			codec_error(c, "Decompressing");
+			goto out;
+		}
+		off += inlen;
+		if (pos >= size && outlen) {
+			msg_gerr("Error: Decompressed image is larger than the flash chip (%lu B)!\n", size);
+			goto out;
+		}
+		pos += outlen;
+		/* Only the start of the image is wanted, the rest needn't be decoded. */
+		if (partial && pos == size) {
+			ret = 0;
+			goto out;
+		}
+		/* Stop once all input is consumed and the decoder has nothing left to give. */
+		if (eof && off == avail && outlen < room)
+			break;
+	}
+	if (!c->complete) {
+		msg_gerr("Error: \"%s\" is truncated.\n", filename);
+		goto out;
+	}
+	if (pos != size) {
+		msg_gerr("Error: Decompressed image size (%lu B) doesn't match the flash chip's size (%lu B)!\n",
+			 pos, size);
+		goto out;
+	}
+	ret = 0;
+out:
+	codec_free(c);
+	return ret;
+}
+
+static int compressor_output(struct image_codec *c, size_t len)
+{
+	if (len && fwrite(c->buf, 1, len, c->file) != len) {
+		msg_gerr("Error: file %s could not be written completely.\n", c->filename);
+		return 1;
+	}
+	return 0;
+}
+
+/* Start writing @type compressed data to @out. Returns NULL on error. */
+struct image_codec *image_compressor_start(enum image_compression type, FILE *out, const char *filename)
+{
+	struct image_codec *c;
+	size_t buf_size = COMPRESSION_CHUNK;
+
+	if (check_supported(type, filename))
+		return NULL;
+#if HAVE_LZ4 == 1
+	/* LZ4F wants room for the whole compressed chunk (plus frame header and footer). */
+	if (type == IMAGE_LZ4)
+		buf_size = LZ4F_compressBound(COMPRESSION_CHUNK, NULL) + 64;
+#endif
+	c = codec_new(type, out, filename, buf_size);
+	if (!c)
+		return NULL;
+
+	switch (type) {
+#if HAVE_ZSTD == 1
+	case IMAGE_ZSTD:
+		c->zcs = ZSTD_createCStream();
+		if (!c->zcs || ZSTD_isError(ZSTD_initCStream(c->zcs, 0)))
+			goto fail;
+		break;
+#endif
+#if HAVE_LZ4 == 1
+	case IMAGE_LZ4: {
+		size_t r;
+		if (LZ4F_isError(LZ4F_createCompressionContext(&c->lz4c, LZ4F_VERSION)))
+			goto fail;
+		r = LZ4F_compressBegin(c->lz4c, c->buf, c->buf_size, NULL);
+		if (LZ4F_isError(r) || compressor_output(c, r))
+			goto fail;
+		break;
+	}
+#endif
+#if HAVE_LZMA == 1
+	case IMAGE_XZ:
+		c->xz = (lzma_stream)LZMA_STREAM_INIT;
+		if (lzma_easy_encoder(&c->xz, LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC64) != LZMA_OK)
+			goto fail;
+		c->xz_active = true;
+		break;
+#endif
+	default:
+		goto fail;
+	}
+	msg_gdbg("Writing %s compressed image \"%s\".\n", formats[type].name, filename);
+	return c;
+fail:
+	msg_gerr("Error: Could not initialize the %s encoder.\n", formats[type].name);
+	codec_free(c);
+	return NULL;
+}
+
+/* Compress @len bytes at @buf (@finish with len 0 flushes the end of the stream). Returns 0 on success. */
+static int compress_step(struct image_codec *c, const uint8_t *buf, size_t len, bool finish)
+{
+	switch (c->type) {
+#if HAVE_ZSTD == 1
+	case IMAGE_ZSTD: {
+		ZSTD_inBuffer zin = { buf, len, 0 };
+		size_t r;
+		do {
+			ZSTD_outBuffer zout = { c->buf, c->buf_size, 0 };
+			r = finish ? ZSTD_endStream(c->zcs, &zout) : ZSTD_compressStream(c->zcs, &zout, &zin);
+			if (ZSTD_isError(r))
+				return codec_error(c, "Compressing");
+			if (compressor_output(c, zout.pos))
+				return 1;
+		} while (finish ? r != 0 : zin.pos < zin.size);
+		return 0;
+	}
+#endif
+#if HAVE_LZ4 == 1
+	case IMAGE_LZ4: {
+		size_t r;
+		if (finish) {
+			r = LZ4F_compressEnd(c->lz4c, c->buf, c->buf_size, NULL);
+			if (LZ4F_isError(r))
+				return codec_error(c, "Compressing");
+			return compressor_output(c, r);
+		}
+		while (len) {
+			size_t n = min(len, COMPRESSION_CHUNK);
+			r = LZ4F_compressUpdate(c->lz4c, c->buf, c->buf_size, buf, n, NULL);
+			if (LZ4F_isError(r))
+				return codec_error(c, "Compressing");
+			if (compressor_output(c, r))
+				return 1;
+			buf += n;
+			len -= n;
+		}
+		return 0;
+	}
+#endif
+#if HAVE_LZMA == 1
+	case IMAGE_XZ: {
+		lzma_ret r;
+		c->xz.next_in = buf;
+		c->xz.avail_in = len;
+		do {
+			c->xz.next_out = c->buf;
+			c->xz.avail_out = c->buf_size;
+			r = lzma_code(&c->xz, finish ? LZMA_FINISH : LZMA_RUN);
+			if (r != LZMA_OK && r != LZMA_STREAM_END)
+				return codec_error(c, "Compressing");
+			if (compressor_output(c, c->buf_size - c->xz.avail_out))
+				return 1;
+		} while (finish ? r != LZMA_STREAM_END : c->xz.avail_in > 0);
+		return 0;
+	}
+#endif
+	default:
+		return 1;
+	}
+}
+
+int image_compressor_write(struct image_codec *c, const uint8_t *buf, size_t len)
+{
+	return compress_step(c, buf, len, false);
+}
+
+/* Finish the compressed stream (unless @ret signals an earlier error) and free @c. Returns 0 on success. */
+int image_compressor_finish(struct image_codec *c, int ret)
+{
+	if (!ret)
+		ret = compress_step(c, NULL, 0, true);
+	codec_free(c);
+	return ret;
+}
+
+#endif /* !__LIBPAYLOAD__ */
@@ -0,0 +1,158 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Content cache (--content-cache): after a verified write, the image is kept below $XDG_CACHE_HOME in a file
+ * named after the JEDEC and unique ID of the chip. The next write to the same chip compares the image with
+ * the cached contents instead of reading the whole chip, once a few random blocks and the status register
+ * were checked to still match it. The file starts with two lines identifying the chip:
+ *
+ *	flashrom contents 1
+ *	chip <vendor> <name> <size> <status register>
+ *
+ * followed by the contents. Chips without a unique ID are never cached, they can't be told apart from other
+ * chips of the same kind.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flash.h"
+#include "chipdrivers.h"
+#include "programmer.h"
+#include "spi.h"
+
+#define CONTENT_CACHE_MAGIC		"flashrom contents 1"
+/* Blocks of the chip compared with the cache, one in every slice of the chip. */
+#define CONTENT_CACHE_SPOT_CHECKS	8
+#define CONTENT_CACHE_CHECK_LEN		4096
+
+bool content_cache = false;
+
+/* Name of the cache file for @flash. Returns false if the chip has no unique ID. */
+static bool content_cache_name(struct flashctx *flash, char *name, size_t len)
+{
+	uint8_t uid[JEDEC_RDUID_INSIZE];
+
+	if (!(flash->mst->buses_supported & BUS_SPI) || spi_read_unique_id(flash, uid))
+		return false;
+	/* A chip that doesn't answer reads all 0x00 or 0xff. */
+	if (buf_find_nonblank(uid, sizeof(uid)) == sizeof(uid) ||
+	    (uid[0] == 0x00 && !memcmp(uid, uid + 1, sizeof(uid) - 1)))
+		return false;
+	snprintf(name, len, "flashrom-contents-%04x-%04x-%02x%02x%02x%02x%02x%02x%02x%02x",
+		 flash->chip->manufacture_id, flash->chip->model_id,
+		 uid[0], uid[1], uid[2], uid[3], uid[4], uid[5], uid[6], uid[7]);
+	return true;
+}
+
+static void content_cache_header(struct flashctx *flash, char *header, size_t len)
+{
+	snprintf(header, len, "chip %s %s %u %02x\n", flash->chip->vendor, flash->chip->name,
+		 flash->chip->total_size * 1024, spi_read_status_register(flash));
+}
+
+/* Compare @len bytes at @start of the chip with @contents. */
+static bool content_cache_matches(struct flashctx *flash, const uint8_t *contents, unsigned int start,
+				  unsigned int len)
+{
+	uint8_t *buf = malloc(len);
+	bool ok;
+
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		return false;
+	}
+	ok = !flash->chip->read(flash, buf, start, len) && !memcmp(buf, contents + start, len);
+	free(buf);
+	return ok;
+}
+
+/*
+ * Fill @contents (as big as the chip) with the cached contents of the chip, if there are any and a spot check
+ * agrees with them. Returns 0 if @contents can be used instead of reading the chip.
+ */
+int content_cache_load(struct flashctx *flash, uint8_t *contents)
+{
+	const unsigned int size = flash->chip->total_size * 1024;
+	const unsigned int len = min(size, CONTENT_CACHE_CHECK_LEN);
+	const unsigned int blocks = size / len, slices = min(blocks, CONTENT_CACHE_SPOT_CHECKS);
+	char name[64], header[256], line[256];
+	unsigned int i;
+	bool ok;
+	FILE *f;
+
+	if (!content_cache_name(flash, name, sizeof(name))) {
+		msg_cdbg("The chip has no unique ID, the content cache can't be used.\n");
+		return 1;
+	}
+	f = open_cache_file(name, "rb");
+	if (!f)
+		return 1;
+	if (!cache_file_trusted(f)) {
+		msg_cwarn("Ignoring the content cache, it is not owned by this user or writable by others.\n");
+		fclose(f);
+		return 1;
+	}
+	content_cache_header(flash, header, sizeof(header));
+	ok = fgets(line, sizeof(line), f) && !strcmp(line, CONTENT_CACHE_MAGIC "\n") &&
+	     fgets(line, sizeof(line), f) && !strcmp(line, header) && fread(contents, 1, size, f) == size;
+	fclose(f);
+	if (!ok) {
+		msg_cdbg("The content cache doesn't hold this chip with its current status register.\n");
+		return 1;
+	}
+
+	for (i = 0; i < slices; i++) {
+		unsigned int first = i * blocks / slices, count = (i + 1) * blocks / slices - first;
+		if (!content_cache_matches(flash, contents, (first + rand() % count) * len, len)) {
+			msg_cinfo("The chip doesn't match the content cache anymore, reading it.\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Remember @contents (as big as the chip) as what the chip holds now. */
+void content_cache_store(struct flashctx *flash, const uint8_t *contents)
+{
+	const unsigned int size = flash->chip->total_size * 1024;
+	char name[64], header[256];
+	bool ok;
+	FILE *f;
+
+	if (!content_cache_name(flash, name, sizeof(name)))
+		return;
+	f = create_cache_file(name);
+	if (!f)
+		return;
+	content_cache_header(flash, header, sizeof(header));
+	ok = fputs(CONTENT_CACHE_MAGIC "\n", f) != EOF && fputs(header, f) != EOF &&
+	     fwrite(contents, 1, size, f) == size;
+	if (commit_cache_file(f, name, ok))
+		msg_cdbg("Can't write the content cache.\n");
+}
+
+/* Forget the cached contents of the chip, it is about to be changed. */
+void content_cache_invalidate(struct flashctx *flash)
+{
+	char name[64];
+
+	if (content_cache_name(flash, name, sizeof(name)))
+		remove_cache_file(name);
+}
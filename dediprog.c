@@ -24,28 +24,36 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <limits.h>
 #include <errno.h>
 
-#if IS_WINDOWS
-#include <lusb0_usb.h>
-#else
-#include <usb.h>
-#endif
+#include <libusb.h>
 
 #include "flash.h"
 #include "chipdrivers.h"
 #include "programmer.h"
 #include "spi.h"
+#include "probes.h"
 
 #define FIRMWARE_VERSION(x,y,z) ((x << 16) | (y << 8) | z)
 #define DEFAULT_TIMEOUT 3000
-#define REQTYPE_OTHER_OUT (USB_ENDPOINT_IN | USB_TYPE_VENDOR | USB_RECIP_OTHER)		/* 0x43 */
-#define REQTYPE_OTHER_IN (USB_ENDPOINT_IN | USB_TYPE_VENDOR | USB_RECIP_OTHER)		/* 0xC3 */
-#define REQTYPE_EP_OUT (USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_ENDPOINT)	/* 0x42 */
-#define REQTYPE_EP_IN (USB_ENDPOINT_IN | USB_TYPE_VENDOR | USB_RECIP_ENDPOINT)		/* 0xC2 */
-static usb_dev_handle *dediprog_handle;
+/* Size of the USB packets on the bulk endpoints, other sizes will NOT work at all. */
+#define BULK_PACKET_SIZE 512
+/* Default and maximum number of bulk transfers in flight, and the number of packets in each of them. */
+#define DEFAULT_BULK_TRANSFERS 8
+#define MAX_BULK_TRANSFERS 64
+#define BULK_TRANSFER_PACKETS 32
+/* Longest time the device may take to program one page of a bulk write. */
+#define BULK_PAGE_PROGRAM_MAX_MS 5
+#define REQTYPE_OTHER_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_OTHER)	/* 0x43 */
+#define REQTYPE_OTHER_IN (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_OTHER)	/* 0xC3 */
+#define REQTYPE_EP_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_ENDPOINT)	/* 0x42 */
+#define REQTYPE_EP_IN (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_ENDPOINT)	/* 0xC2 */
+static libusb_context *usb_ctx;
+static libusb_device_handle *dediprog_handle;
 static int dediprog_endpoint;
+static unsigned int dediprog_bulk_transfers = DEFAULT_BULK_TRANSFERS;
 
 enum dediprog_leds {
 	LED_INVALID		= -1,
@@ -142,22 +150,43 @@ static void print_hex(void *buf, size_t len)
 #endif
 
 /* Might be useful for other USB devices as well. static for now. */
-/* device parameter allows user to specify one device of multiple installed */
-static struct usb_device *get_device_by_vid_pid(uint16_t vid, uint16_t pid, unsigned int device)
+/* num parameter allows user to specify one device of multiple installed */
+static libusb_device_handle *get_device_by_vid_pid_number(uint16_t vid, uint16_t pid, unsigned int num)
 {
-	struct usb_bus *bus;
-	struct usb_device *dev;
-
-	for (bus = usb_get_busses(); bus; bus = bus->next)
-		for (dev = bus->devices; dev; dev = dev->next)
-			if ((dev->descriptor.idVendor == vid) &&
-			    (dev->descriptor.idProduct == pid)) {
-				if (device == 0)
-					return dev;
-				device--;
-			}
+	libusb_device **list;
+	libusb_device_handle *handle = NULL;
+	struct libusb_device_descriptor desc;
+	ssize_t count, i;
+	int ret;
+
+	count = libusb_get_device_list(usb_ctx, &list);
+	if (count < 0) {
+		msg_perr("Getting the USB device list failed (%s)!\n", libusb_error_name(count));
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		ret = libusb_get_device_descriptor(list[i], &desc);
+		if (ret) {
+			msg_perr("Reading the USB device descriptor failed (%s)!\n", libusb_error_name(ret));
+			break;
+		}
+		if (desc.idVendor != vid || desc.idProduct != pid)
+			continue;
+		if (num--)
+			continue;
+		msg_pdbg("Found USB device %04x:%04x at address %d-%d.\n", desc.idVendor, desc.idProduct,
+			 libusb_get_bus_number(list[i]), libusb_get_device_address(list[i]));
+		ret = libusb_open(list[i], &handle);
+		if (ret) {
+			msg_perr("Could not open USB device: %s\n", libusb_error_name(ret));
+			handle = NULL;
+		}
+		break;
+	}
 
-	return NULL;
+	libusb_free_device_list(list, 1);
+	return handle;
 }
 
 /* This function sets the GPIOs connected to the LEDs as well as IO1-IO4. */
@@ -182,10 +211,10 @@ static int dediprog_set_leds(int leds)
 	}
 
 	target_leds ^= 7;
-	int ret = usb_control_msg(dediprog_handle, REQTYPE_EP_OUT, CMD_SET_IO_LED, 0x09, target_leds,
-				  NULL, 0x0, DEFAULT_TIMEOUT);
+	int ret = libusb_control_transfer(dediprog_handle, REQTYPE_EP_OUT, CMD_SET_IO_LED, 0x09, target_leds,
+					  NULL, 0x0, DEFAULT_TIMEOUT);
 	if (ret != 0x0) {
-		msg_perr("Command Set LED 0x%x failed (%s)!\n", leds, usb_strerror());
+		msg_perr("Command Set LED 0x%x failed (%s)!\n", leds, libusb_error_name(ret));
 		return 1;
 	}
 
@@ -222,8 +251,8 @@ static int dediprog_set_spi_voltage(int millivolt)
 		/* Wait some time as the original driver does. */
 		programmer_delay(200 * 1000);
 	}
-	ret = usb_control_msg(dediprog_handle, REQTYPE_EP_OUT, CMD_SET_VCC, voltage_selector, 0,
-			      NULL, 0x0, DEFAULT_TIMEOUT);
+	ret = libusb_control_transfer(dediprog_handle, REQTYPE_EP_OUT, CMD_SET_VCC, voltage_selector, 0,
+				      NULL, 0x0, DEFAULT_TIMEOUT);
 	if (ret != 0x0) {
 		msg_perr("Command Set SPI Voltage 0x%x failed!\n",
 			 voltage_selector);
@@ -253,6 +282,11 @@ static const struct dediprog_spispeeds spispeeds[] = {
 	{ NULL,		0x0 },
 };
 
+/* The rates of spispeeds[] in kHz for spispeed=auto, in reverse order. */
+static const unsigned int dediprog_speeds_khz[] = { 375, 750, 1500, 2180, 3000, 8000, 12000, 24000, 0 };
+/* The SPI clock in kHz, for the bulk transfer timeouts. The slowest one until it is set. */
+static unsigned int dediprog_khz = 375;
+
 static int dediprog_set_spi_speed(unsigned int spispeed_idx)
 {
 	if (dediprog_firmwareversion < FIRMWARE_VERSION(5, 0, 0)) {
@@ -263,15 +297,163 @@ static int dediprog_set_spi_speed(unsigned int spispeed_idx)
 	const struct dediprog_spispeeds *spispeed = &spispeeds[spispeed_idx];
 	msg_pdbg("SPI speed is %sHz\n", spispeed->name);
 
-	int ret = usb_control_msg(dediprog_handle, REQTYPE_EP_OUT, CMD_SET_SPI_CLK, spispeed->speed, 0xff,
-				  NULL, 0x0, DEFAULT_TIMEOUT);
+	int ret = libusb_control_transfer(dediprog_handle, REQTYPE_EP_OUT, CMD_SET_SPI_CLK, spispeed->speed, 0xff,
+					  NULL, 0x0, DEFAULT_TIMEOUT);
 	if (ret != 0x0) {
 		msg_perr("Command Set SPI Speed 0x%x failed!\n", spispeed->speed);
 		return 1;
 	}
+	dediprog_khz = dediprog_speeds_khz[ARRAY_SIZE(spispeeds) - 2 - spispeed_idx];
 	return 0;
 }
 
+
+static int dediprog_set_autospeed(unsigned int khz)
+{
+	int i;
+
+	for (i = 0; dediprog_speeds_khz[i]; i++)
+		if (dediprog_speeds_khz[i] == khz)
+			return dediprog_set_spi_speed(ARRAY_SIZE(spispeeds) - 2 - i);
+	return 1;
+}
+
+struct dediprog_bulk_slot {
+	struct libusb_transfer *transfer;
+	bool busy;
+	unsigned int *in_flight;
+	int *error;
+};
+
+static void LIBUSB_CALL dediprog_bulk_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct dediprog_bulk_slot *slot = transfer->user_data;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+			msg_perr("SPI bulk transfer failed, status %i!\n", transfer->status);
+		*slot->error = 1;
+	} else if (transfer->actual_length != transfer->length) {
+		msg_perr("SPI bulk transfer failed, expected %i, got %i!\n", transfer->length,
+			 transfer->actual_length);
+		*slot->error = 1;
+	}
+	slot->busy = false;
+	(*slot->in_flight)--;
+}
+
+/* Returns the buffer for the @packets USB packets starting at packet @first, @staging may be used for that. */
+typedef unsigned char *(*dediprog_bulk_buffer_fn)(void *data, unsigned char *staging, unsigned int first,
+						  unsigned int packets);
+
+/*
+ * Timeout of a bulk transfer submitted with @queued transfers of @size bytes ahead of it. They are all done
+ * one after another at the SPI clock, writes additionally wait for the page in every packet to be programmed.
+ */
+static unsigned int dediprog_bulk_timeout(unsigned int queued, unsigned int size, bool write)
+{
+	unsigned int ms = size * 8 / dediprog_khz + 1;
+
+	if (write)
+		ms += size / BULK_PACKET_SIZE * BULK_PAGE_PROGRAM_MAX_MS;
+	return DEFAULT_TIMEOUT + (queued + 1) * ms;
+}
+
+/*
+ * Transfer @count USB packets on bulk @endpoint, keeping up to dediprog_bulk_transfers transfers of
+ * BULK_TRANSFER_PACKETS packets each in flight so the device never waits for the host. @buffer tells where
+ * the data of each transfer lives, with @staging set each transfer gets a buffer of its own for that.
+ * @return	0 on success, 1 on failure
+ */
+static int dediprog_bulk_transfer(unsigned char endpoint, unsigned int count, bool staging,
+				  dediprog_bulk_buffer_fn buffer, void *data)
+{
+	const unsigned int size = BULK_TRANSFER_PACKETS * BULK_PACKET_SIZE;
+	const unsigned int num = min(dediprog_bulk_transfers, (count + BULK_TRANSFER_PACKETS - 1) /
+				     BULK_TRANSFER_PACKETS);
+	struct dediprog_bulk_slot slots[MAX_BULK_TRANSFERS];
+	unsigned char *stagebuf = NULL;
+	unsigned int next = 0, in_flight = 0, packets, i;
+	int error = 0, ret;
+
+	FLASHROM_PROBE2(usb_bulk_start, endpoint, count * BULK_PACKET_SIZE);
+	if (staging) {
+		stagebuf = malloc(num * size);
+		if (!stagebuf) {
+			msg_perr("Out of memory!\n");
+			FLASHROM_PROBE3(usb_bulk_done, endpoint, count * BULK_PACKET_SIZE, 1);
+			return 1;
+		}
+	}
+	for (i = 0; i < num; i++) {
+		slots[i].transfer = libusb_alloc_transfer(0);
+		slots[i].busy = false;
+		slots[i].in_flight = &in_flight;
+		slots[i].error = &error;
+		if (!slots[i].transfer) {
+			msg_perr("Out of memory!\n");
+			error = 1;
+		}
+	}
+
+	while (!error && (next < count || in_flight)) {
+		for (i = 0; i < num && next < count; i++) {
+			if (slots[i].busy)
+				continue;
+			packets = min(BULK_TRANSFER_PACKETS, count - next);
+			libusb_fill_bulk_transfer(slots[i].transfer, dediprog_handle, endpoint,
+						  buffer(data, stagebuf ? stagebuf + i * size : NULL, next, packets),
+						  packets * BULK_PACKET_SIZE, dediprog_bulk_transfer_cb, &slots[i],
+						  dediprog_bulk_timeout(in_flight, size, staging));
+			ret = libusb_submit_transfer(slots[i].transfer);
+			if (ret) {
+				msg_perr("Submitting SPI bulk transfer failed (%s)!\n", libusb_error_name(ret));
+				error = 1;
+				break;
+			}
+			slots[i].busy = true;
+			in_flight++;
+			next += packets;
+		}
+		if (error || !in_flight)
+			break;
+		ret = libusb_handle_events(usb_ctx);
+		if (ret) {
+			msg_perr("Handling USB events failed (%s)!\n", libusb_error_name(ret));
+			error = 1;
+		}
+	}
+
+	/* Wait for the transfers still in flight, their memory must not go away before they are done. */
+	if (in_flight) {
+		for (i = 0; i < num; i++)
+			if (slots[i].busy)
+				libusb_cancel_transfer(slots[i].transfer);
+		while (in_flight) {
+			ret = libusb_handle_events(usb_ctx);
+			if (ret) {
+				msg_perr("Handling USB events failed (%s), leaking transfers!\n",
+					 libusb_error_name(ret));
+				FLASHROM_PROBE3(usb_bulk_done, endpoint, count * BULK_PACKET_SIZE, 1);
+				return 1;
+			}
+		}
+	}
+
+	for (i = 0; i < num; i++)
+		libusb_free_transfer(slots[i].transfer);
+	free(stagebuf);
+	FLASHROM_PROBE3(usb_bulk_done, endpoint, count * BULK_PACKET_SIZE, error);
+	return error;
+}
+
+/* Reads complete straight into the destination buffer. */
+static unsigned char *dediprog_bulk_read_buffer(void *data, unsigned char *staging, unsigned int first,
+						unsigned int packets)
+{
+	return (unsigned char *)data + first * BULK_PACKET_SIZE;
+}
+
 /* Bulk read interface, will read multiple 512 byte chunks aligned to 512 bytes.
  * @start	start address
  * @len		length
@@ -281,14 +463,13 @@ static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf,
 				  unsigned int start, unsigned int len)
 {
 	int ret;
-	unsigned int i;
 	/* chunksize must be 512, other sizes will NOT work at all. */
-	const unsigned int chunksize = 0x200;
+	const unsigned int chunksize = BULK_PACKET_SIZE;
 	const unsigned int count = len / chunksize;
-	const char count_and_chunk[] = {count & 0xff,
-					(count >> 8) & 0xff,
-					chunksize & 0xff,
-					(chunksize >> 8) & 0xff};
+	unsigned char count_and_chunk[] = {count & 0xff,
+					   (count >> 8) & 0xff,
+					   chunksize & 0xff,
+					   (chunksize >> 8) & 0xff};
 
 	if ((start % chunksize) || (len % chunksize)) {
 		msg_perr("%s: Unaligned start=%i, len=%i! Please report a bug "
@@ -302,27 +483,16 @@ static int dediprog_spi_bulk_read(struct flashctx *flash, uint8_t *buf,
 	/* Command Read SPI Bulk. No idea which read command is used on the
 	 * SPI side.
 	 */
-	ret = usb_control_msg(dediprog_handle, REQTYPE_EP_OUT, CMD_READ, start % 0x10000,
-			      start / 0x10000, (char *)count_and_chunk,
-			      sizeof(count_and_chunk), DEFAULT_TIMEOUT);
+	ret = libusb_control_transfer(dediprog_handle, REQTYPE_EP_OUT, CMD_READ, start % 0x10000,
+				      start / 0x10000, count_and_chunk,
+				      sizeof(count_and_chunk), DEFAULT_TIMEOUT);
 	if (ret != sizeof(count_and_chunk)) {
 		msg_perr("Command Read SPI Bulk failed, %i %s!\n", ret,
-			 usb_strerror());
+			 libusb_error_name(ret));
 		return 1;
 	}
 
-	for (i = 0; i < count; i++) {
-		ret = usb_bulk_read(dediprog_handle, 0x80 | dediprog_endpoint,
-				    (char *)buf + i * chunksize, chunksize,
-				    DEFAULT_TIMEOUT);
-		if (ret != chunksize) {
-			msg_perr("SPI bulk read %i failed, expected %i, got %i "
-				 "%s!\n", i, chunksize, ret, usb_strerror());
-			return 1;
-		}
-	}
-
-	return 0;
+	return dediprog_bulk_transfer(0x80 | dediprog_endpoint, count, false, dediprog_bulk_read_buffer, buf);
 }
 
 static int dediprog_spi_read(struct flashctx *flash, uint8_t *buf,
@@ -368,6 +538,24 @@ err:
 	return ret;
 }
 
+struct dediprog_bulk_write_data {
+	const uint8_t *buf;
+	unsigned int chunksize;
+};
+
+/* Every USB packet carries one chunk of data, padded with 0xff. */
+static unsigned char *dediprog_bulk_write_buffer(void *data, unsigned char *staging, unsigned int first,
+						 unsigned int packets)
+{
+	const struct dediprog_bulk_write_data *w = data;
+	unsigned int i;
+
+	memset(staging, 0xff, packets * BULK_PACKET_SIZE);
+	for (i = 0; i < packets; i++)
+		memcpy(staging + i * BULK_PACKET_SIZE, w->buf + (first + i) * w->chunksize, w->chunksize);
+	return staging;
+}
+
 /* Bulk write interface, will write multiple chunksize byte chunks aligned to chunksize bytes.
  * @chunksize       length of data chunks, only 256 supported by now
  * @start           start address
@@ -379,14 +567,13 @@ static int dediprog_spi_bulk_write(struct flashctx *flash, const uint8_t *buf, u
 				   unsigned int start, unsigned int len, uint8_t dedi_spi_cmd)
 {
 	int ret;
-	unsigned int i;
 	/* USB transfer size must be 512, other sizes will NOT work at all.
 	 * chunksize is the real data size per USB bulk transfer. The remaining
 	 * space in a USB bulk transfer must be filled with 0xff padding.
 	 */
 	const unsigned int count = len / chunksize;
-	const char count_and_cmd[] = {count & 0xff, (count >> 8) & 0xff, 0x00, dedi_spi_cmd};
-	char usbbuf[512];
+	unsigned char count_and_cmd[] = {count & 0xff, (count >> 8) & 0xff, 0x00, dedi_spi_cmd};
+	struct dediprog_bulk_write_data data = { buf, chunksize };
 
 	/*
 	 * We should change this check to
@@ -411,28 +598,15 @@ static int dediprog_spi_bulk_write(struct flashctx *flash, const uint8_t *buf, u
 	/* Command Write SPI Bulk. No idea which write command is used on the
 	 * SPI side.
 	 */
-	ret = usb_control_msg(dediprog_handle, REQTYPE_EP_OUT, CMD_WRITE, start % 0x10000, start / 0x10000,
-			      (char *)count_and_cmd, sizeof(count_and_cmd), DEFAULT_TIMEOUT);
+	ret = libusb_control_transfer(dediprog_handle, REQTYPE_EP_OUT, CMD_WRITE, start % 0x10000, start / 0x10000,
+				      count_and_cmd, sizeof(count_and_cmd), DEFAULT_TIMEOUT);
 	if (ret != sizeof(count_and_cmd)) {
 		msg_perr("Command Write SPI Bulk failed, %i %s!\n", ret,
-			 usb_strerror());
+			 libusb_error_name(ret));
 		return 1;
 	}
 
-	for (i = 0; i < count; i++) {
-		memset(usbbuf, 0xff, sizeof(usbbuf));
-		memcpy(usbbuf, buf + i * chunksize, chunksize);
-		ret = usb_bulk_write(dediprog_handle, dediprog_endpoint,
-				    usbbuf, 512,
-				    DEFAULT_TIMEOUT);
-		if (ret != 512) {
-			msg_perr("SPI bulk write failed, expected %i, got %i "
-				 "%s!\n", 512, ret, usb_strerror());
-			return 1;
-		}
-	}
-
-	return 0;
+	return dediprog_bulk_transfer(dediprog_endpoint, count, true, dediprog_bulk_write_buffer, &data);
 }
 
 static int dediprog_spi_write(struct flashctx *flash, const uint8_t *buf,
@@ -515,21 +689,21 @@ static int dediprog_spi_send_command(struct flashctx *flash,
 		return 1;
 	}
 	
-	ret = usb_control_msg(dediprog_handle, REQTYPE_EP_OUT, CMD_TRANSCEIVE, 0, readcnt ? 0x1 : 0x0,
-			      (char *)writearr, writecnt, DEFAULT_TIMEOUT);
+	ret = libusb_control_transfer(dediprog_handle, REQTYPE_EP_OUT, CMD_TRANSCEIVE, 0, readcnt ? 0x1 : 0x0,
+				      (unsigned char *)writearr, writecnt, DEFAULT_TIMEOUT);
 	if (ret != writecnt) {
 		msg_perr("Send SPI failed, expected %i, got %i %s!\n",
-			 writecnt, ret, usb_strerror());
+			 writecnt, ret, libusb_error_name(ret));
 		return 1;
 	}
 	if (readcnt == 0)
 		return 0;
 
-	ret = usb_control_msg(dediprog_handle, REQTYPE_EP_IN, CMD_TRANSCEIVE, 0, 0,
-			     (char *)readarr, readcnt, DEFAULT_TIMEOUT);
+	ret = libusb_control_transfer(dediprog_handle, REQTYPE_EP_IN, CMD_TRANSCEIVE, 0, 0,
+				      readarr, readcnt, DEFAULT_TIMEOUT);
 	if (ret != readcnt) {
 		msg_perr("Receive SPI failed, expected %i, got %i %s!\n",
-			 readcnt, ret, usb_strerror());
+			 readcnt, ret, libusb_error_name(ret));
 		return 1;
 	}
 	return 0;
@@ -543,8 +717,8 @@ static int dediprog_check_devicestring(void)
 
 #if 0
 	/* Command Prepare Receive Device String. */
-	ret = usb_control_msg(dediprog_handle, REQTYPE_OTHER_IN, 0x7, 0x0, 0xef03,
-			      buf, 0x1, DEFAULT_TIMEOUT);
+	ret = libusb_control_transfer(dediprog_handle, REQTYPE_OTHER_IN, 0x7, 0x0, 0xef03,
+				      (unsigned char *)buf, 0x1, DEFAULT_TIMEOUT);
 	/* The char casting is needed to stop gcc complaining about an always true comparison. */
 	if ((ret != 0x1) || (buf[0] != (char)0xff)) {
 		msg_perr("Unexpected response to Command Prepare Receive Device"
@@ -553,8 +727,8 @@ static int dediprog_check_devicestring(void)
 	}
 #endif
 	/* Command Receive Device String. */
-	ret = usb_control_msg(dediprog_handle, REQTYPE_EP_IN, CMD_READ_PROG_INFO, 0, 0,
-			      buf, 0x10, DEFAULT_TIMEOUT);
+	ret = libusb_control_transfer(dediprog_handle, REQTYPE_EP_IN, CMD_READ_PROG_INFO, 0, 0,
+				      (unsigned char *)buf, 0x10, DEFAULT_TIMEOUT);
 	if (ret != 0x10) {
 		msg_perr("Incomplete/failed Command Receive Device String!\n");
 		return 1;
@@ -582,13 +756,13 @@ static int dediprog_check_devicestring(void)
 static int dediprog_device_init(void)
 {
 	int ret;
-	char buf[0x1];
+	unsigned char buf[0x1];
 
 	memset(buf, 0, sizeof(buf));
-	ret = usb_control_msg(dediprog_handle, REQTYPE_OTHER_IN, 0x0B, 0x0, 0x0,
-			      buf, 0x1, DEFAULT_TIMEOUT);
+	ret = libusb_control_transfer(dediprog_handle, REQTYPE_OTHER_IN, 0x0B, 0x0, 0x0,
+				      buf, 0x1, DEFAULT_TIMEOUT);
 	if (ret < 0) {
-		msg_perr("Command A failed (%s)!\n", usb_strerror());
+		msg_perr("Command A failed (%s)!\n", libusb_error_name(ret));
 		return 1;
 	}
 	if ((ret != 0x1) || (buf[0] != 0x6f)) {
@@ -606,12 +780,12 @@ static int dediprog_device_init(void)
 static int dediprog_command_b(void)
 {
 	int ret;
-	char buf[0x3];
+	unsigned char buf[0x3];
 
-	ret = usb_control_msg(dediprog_handle, REQTYPE_OTHER_IN, 0x7, 0x0, 0xef00,
-			      buf, 0x3, DEFAULT_TIMEOUT);
+	ret = libusb_control_transfer(dediprog_handle, REQTYPE_OTHER_IN, 0x7, 0x0, 0xef00,
+				      buf, 0x3, DEFAULT_TIMEOUT);
 	if (ret < 0) {
-		msg_perr("Command B failed (%s)!\n", usb_strerror());
+		msg_perr("Command B failed (%s)!\n", libusb_error_name(ret));
 		return 1;
 	}
 	if ((ret != 0x3) || (buf[0] != 0xff) || (buf[1] != 0xff) ||
@@ -626,10 +800,10 @@ static int dediprog_command_b(void)
 
 static int set_target_flash(enum dediprog_target target)
 {
-	int ret = usb_control_msg(dediprog_handle, REQTYPE_EP_OUT, CMD_SET_TARGET, target, 0,
-			          NULL, 0, DEFAULT_TIMEOUT);
+	int ret = libusb_control_transfer(dediprog_handle, REQTYPE_EP_OUT, CMD_SET_TARGET, target, 0,
+				          NULL, 0, DEFAULT_TIMEOUT);
 	if (ret != 0) {
-		msg_perr("set_target_flash failed (%s)!\n", usb_strerror());
+		msg_perr("set_target_flash failed (%s)!\n", libusb_error_name(ret));
 		return 1;
 	}
 	return 0;
@@ -639,11 +813,11 @@ static int set_target_flash(enum dediprog_target target)
 /* Returns true if the button is currently pressed. */
 static bool dediprog_get_button(void)
 {
-	char buf[1];
-	int ret = usb_control_msg(dediprog_handle, REQTYPE_EP_IN, CMD_GET_BUTTON, 0, 0,
-			      buf, 0x1, DEFAULT_TIMEOUT);
+	unsigned char buf[1];
+	int ret = libusb_control_transfer(dediprog_handle, REQTYPE_EP_IN, CMD_GET_BUTTON, 0, 0,
+					  buf, 0x1, DEFAULT_TIMEOUT);
 	if (ret != 0) {
-		msg_perr("Could not get button state (%s)!\n", usb_strerror());
+		msg_perr("Could not get button state (%s)!\n", libusb_error_name(ret));
 		return 1;
 	}
 	return buf[0] != 1;
@@ -707,6 +881,10 @@ static const struct spi_master spi_master_dediprog = {
 	.read		= dediprog_spi_read,
 	.write_256	= dediprog_spi_write_256,
 	.write_aai	= dediprog_spi_write_aai,
+	/* The page count of a bulk write is 16 bit. */
+	.max_bulk_write	= 0xffff * 256,
+	.speeds_khz	= dediprog_speeds_khz,
+	.set_speed	= dediprog_set_autospeed,
 };
 
 static int dediprog_shutdown(void *data)
@@ -719,23 +897,21 @@ static int dediprog_shutdown(void *data)
 	if (dediprog_set_spi_voltage(0x0))
 		return 1;
 
-	if (usb_release_interface(dediprog_handle, 0)) {
+	if (libusb_release_interface(dediprog_handle, 0)) {
 		msg_perr("Could not release USB interface!\n");
 		return 1;
 	}
-	if (usb_close(dediprog_handle)) {
-		msg_perr("Could not close USB device!\n");
-		return 1;
-	}
+	libusb_close(dediprog_handle);
+	libusb_exit(usb_ctx);
 	return 0;
 }
 
 /* URB numbers refer to the first log ever captured. */
 int dediprog_init(void)
 {
-	struct usb_device *dev;
-	char *voltage, *device, *spispeed, *target_str;
+	char *voltage, *device, *spispeed, *target_str, *transfers;
 	int spispeed_idx = 1;
+	bool autospeed = false;
 	int millivolt = 3500;
 	long usedevice = 0;
 	long target = 1;
@@ -744,7 +920,10 @@ int dediprog_init(void)
 	msg_pspew("%s\n", __func__);
 
 	spispeed = extract_programmer_param("spispeed");
-	if (spispeed) {
+	if (spispeed && !strcasecmp(spispeed, "auto")) {
+		autospeed = true;
+		free(spispeed);
+	} else if (spispeed) {
 		for (i = 0; spispeeds[i].name; ++i) {
 			if (!strcasecmp(spispeeds[i].name, spispeed)) {
 				spispeed_idx = i;
@@ -816,36 +995,53 @@ int dediprog_init(void)
 	}
 	free(target_str);
 
+	transfers = extract_programmer_param("transfers");
+	if (transfers) {
+		char *transfers_suffix;
+		long num;
+		errno = 0;
+		num = strtol(transfers, &transfers_suffix, 10);
+		if (errno != 0 || transfers == transfers_suffix || strlen(transfers_suffix) > 0) {
+			msg_perr("Error: Could not convert 'transfers'.\n");
+			free(transfers);
+			return 1;
+		}
+		if (num < 1 || num > MAX_BULK_TRANSFERS) {
+			msg_perr("Error: Value for 'transfers' is out of range (1-%i).\n", MAX_BULK_TRANSFERS);
+			free(transfers);
+			return 1;
+		}
+		dediprog_bulk_transfers = num;
+		msg_pinfo("Using %u bulk transfers in flight.\n", dediprog_bulk_transfers);
+	}
+	free(transfers);
+
 	/* Here comes the USB stuff. */
-	usb_init();
-	usb_find_busses();
-	usb_find_devices();
-	dev = get_device_by_vid_pid(0x0483, 0xdada, (unsigned int) usedevice);
-	if (!dev) {
-		msg_perr("Could not find a Dediprog SF100 on USB!\n");
+	ret = libusb_init(&usb_ctx);
+	if (ret) {
+		msg_perr("Could not initialize libusb (%s)!\n", libusb_error_name(ret));
 		return 1;
 	}
-	msg_pdbg("Found USB device (%04x:%04x).\n",
-		 dev->descriptor.idVendor, dev->descriptor.idProduct);
-	dediprog_handle = usb_open(dev);
+	dediprog_handle = get_device_by_vid_pid_number(0x0483, 0xdada, (unsigned int) usedevice);
 	if (!dediprog_handle) {
-		msg_perr("Could not open USB device: %s\n", usb_strerror());
+		msg_perr("Could not find a Dediprog SF100 on USB!\n");
+		libusb_exit(usb_ctx);
 		return 1;
 	}
-	ret = usb_set_configuration(dediprog_handle, 1);
+	ret = libusb_set_configuration(dediprog_handle, 1);
 	if (ret < 0) {
 		msg_perr("Could not set USB device configuration: %i %s\n",
-			 ret, usb_strerror());
-		if (usb_close(dediprog_handle))
-			msg_perr("Could not close USB device!\n");
+			 ret, libusb_error_name(ret));
+		libusb_close(dediprog_handle);
+		libusb_exit(usb_ctx);
 		return 1;
 	}
-	ret = usb_claim_interface(dediprog_handle, 0);
+	ret = libusb_claim_interface(dediprog_handle, 0);
 	if (ret < 0) {
 		msg_perr("Could not claim USB device interface %i: %i %s\n",
-			 0, ret, usb_strerror());
-		if (usb_close(dediprog_handle))
-			msg_perr("Could not close USB device!\n");
+			 0, ret, libusb_error_name(ret));
+		libusb_close(dediprog_handle);
+		libusb_exit(usb_ctx);
 		return 1;
 	}
 	dediprog_endpoint = 2;
@@ -859,6 +1055,15 @@ int dediprog_init(void)
 	if (dediprog_check_devicestring())
 		return 1;
 
+	if (autospeed && dediprog_firmwareversion < FIRMWARE_VERSION(5, 0, 0)) {
+		msg_pwarn("Firmware is too old to set the SPI speed, ignoring spispeed=auto.\n");
+	} else if (autospeed) {
+		char instance[32];
+		snprintf(instance, sizeof(instance), "dediprog:%ld", usedevice);
+		if (spi_request_autospeed(instance))
+			return 1;
+	}
+
 	/* Set all possible LEDs as soon as possible to indicate activity.
 	 * Because knowing the firmware version is required to set the LEDs correctly we need to this after
 	 * dediprog_setup() has queried the device and set dediprog_firmwareversion. */
@@ -39,9 +39,6 @@
 
 #if defined(__i386__) || defined(__x86_64__)
 
-/* Enable SMBIOS decoding. Currently legacy DMI decoding is enough. */
-#define SM_SUPPORT 0
-
 /* Strings longer than 4096 in DMI are just insane. */
 #define DMI_MAX_ANSWER_LEN 4096
 
@@ -163,25 +160,21 @@ static void dmi_chassis_type(uint8_t code)
 	}
 }
 
-static void dmi_table(uint32_t base, uint16_t len, uint16_t num)
+/* Decode the @len bytes long structure table at @table, which holds @num structures (0 if unknown). */
+static void dmi_decode_table(const uint8_t *table, size_t len, unsigned int num)
 {
-	int i = 0, j = 0;
-
-	uint8_t *dmi_table_mem = physmap_ro("DMI Table", base, len);
-	if (dmi_table_mem == NULL) {
-		msg_perr("Unable to access DMI Table\n");
-		return;
-	}
+	int j = 0;
+	unsigned int i = 0;
 
-	uint8_t *data = dmi_table_mem;
-	uint8_t *limit = dmi_table_mem + len;
+	const uint8_t *data = table;
+	const uint8_t *limit = table + len;
 
 	/* SMBIOS structure header is always 4 B long and contains:
 	 *  - uint8_t type;	// see dmi_chassis_types's type
 	 *  - uint8_t length;	// data section w/ header w/o strings
 	 *  - uint16_t handle;
 	 */
-	while (i < num && data + 4 < limit) {
+	while ((!num || i < num) && data + 4 < limit) {
 		/* - If a short entry is found (less than 4 bytes), not only it
 		 *   is invalid, but we cannot reliably locate the next entry.
 		 * - If the length value indicates that this structure spreads
@@ -194,6 +187,10 @@ static void dmi_table(uint32_t base, uint16_t len, uint16_t num)
 			break;
 		}
 
+		/* End-of-table structure, the only way to know the end of SMBIOS 3 tables. */
+		if (data[0] == 127)
+			break;
+
 		if(data[0] == 3) {
 			if (data + 5 < limit)
 				dmi_chassis_type(data[5]);
@@ -209,9 +206,12 @@ static void dmi_table(uint32_t base, uint16_t len, uint16_t num)
 
 				if (data[1] <= offset || data + offset >= limit) {
 					msg_perr("DMI table is broken (offset out of bounds)!\n");
-					goto out;
+					return;
 				}
 
+				/* Only the first structure of a type counts. */
+				if (dmi_strings[j].value)
+					continue;
 				dmi_strings[j].value = dmi_string((const char *)(data + data[1]), data[offset],
 								  (const char *)limit);
 			}
@@ -225,42 +225,150 @@ static void dmi_table(uint32_t base, uint16_t len, uint16_t num)
 		data += 2;
 		i++;
 	}
-out:
+}
+
+static void dmi_table(uint64_t base, uint32_t len, unsigned int num)
+{
+	uint8_t *dmi_table_mem;
+
+	if (base > UINTPTR_MAX) {
+		msg_perr("DMI table at 0x%llx is out of reach.\n", (unsigned long long)base);
+		return;
+	}
+	dmi_table_mem = physmap_ro("DMI Table", (uintptr_t)base, len);
+	if (dmi_table_mem == NULL || dmi_table_mem == ERROR_PTR) {
+		msg_perr("Unable to access DMI Table\n");
+		return;
+	}
+	dmi_decode_table(dmi_table_mem, len, num);
 	physunmap(dmi_table_mem, len);
 }
 
-#if SM_SUPPORT
-static int smbios_decode(uint8_t *buf)
+static uint16_t dmi_read16(const uint8_t *buf)
 {
-	/* TODO: other checks mentioned in the conformance guidelines? */
-	if (!dmi_checksum(buf, buf[0x05]) ||
-	    (memcmp(buf + 0x10, "_DMI_", 5) != 0) ||
-	    !dmi_checksum(buf + 0x10, 0x0F))
-			return 0;
+	return buf[0] | buf[1] << 8;
+}
 
-	dmi_table(mmio_readl(buf + 0x18), mmio_readw(buf + 0x16), mmio_readw(buf + 0x1C));
+static uint32_t dmi_read32(const uint8_t *buf)
+{
+	return dmi_read16(buf) | (uint32_t)dmi_read16(buf + 2) << 16;
+}
 
-	return 1;
+static uint64_t dmi_read64(const uint8_t *buf)
+{
+	return dmi_read32(buf) | (uint64_t)dmi_read32(buf + 4) << 32;
 }
-#endif
 
-static int legacy_decode(uint8_t *buf)
+/*
+ * Where the structure table is according to an entry point: one of the SMBIOS 3 ("_SM3_"), SMBIOS 2.1+
+ * ("_SM_") or legacy DMI ("_DMI_") anchors, with @avail bytes available at @buf.
+ * Returns 0 if the entry point is valid.
+ */
+static int dmi_entry_point(const uint8_t *buf, size_t avail, uint64_t *base, uint32_t *len, unsigned int *num)
 {
+	if (avail >= 0x18 && !memcmp(buf, "_SM3_", 5)) {
+		if (buf[0x06] < 0x18 || buf[0x06] > avail || !dmi_checksum(buf, buf[0x06]))
+			return 1;
+		msg_pdbg("SMBIOS %u.%u present.\n", buf[0x07], buf[0x08]);
+		*len = dmi_read32(buf + 0x0C);
+		*base = dmi_read64(buf + 0x10);
+		*num = 0;
+		return 0;
+	}
+	if (avail >= 0x1F && !memcmp(buf, "_SM_", 4)) {
+		/* TODO: other checks mentioned in the conformance guidelines? */
+		if (buf[0x05] < 0x1F || buf[0x05] > avail || !dmi_checksum(buf, buf[0x05]) ||
+		    memcmp(buf + 0x10, "_DMI_", 5))
+			return 1;
+		msg_pdbg("SMBIOS %u.%u present.\n", buf[0x06], buf[0x07]);
+		buf += 0x10;
+	} else if (avail < 0x0F || memcmp(buf, "_DMI_", 5)) {
+		return 1;
+	}
 	if (!dmi_checksum(buf, 0x0F))
 		return 1;
+	*len = dmi_read16(buf + 0x06);
+	*base = dmi_read32(buf + 0x08);
+	*num = dmi_read16(buf + 0x0C);
+	return 0;
+}
 
-	dmi_table(mmio_readl(buf + 0x08), mmio_readw(buf + 0x06), mmio_readw(buf + 0x0C));
+#if defined(__linux__)
+/* Read a whole file from sysfs, which doesn't tell the size up front. */
+static uint8_t *dmi_read_file(const char *path, size_t *size)
+{
+	uint8_t *buf = NULL, *tmp;
+	size_t capacity = 0, n;
+	FILE *f;
 
-	return 0;
+	*size = 0;
+	f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+	do {
+		if (*size == capacity) {
+			capacity = capacity ? capacity * 2 : 4096;
+			tmp = realloc(buf, capacity);
+			if (!tmp) {
+				msg_perr("Out of memory!\n");
+				free(buf);
+				fclose(f);
+				return NULL;
+			}
+			buf = tmp;
+		}
+		n = fread(buf + *size, 1, capacity - *size, f);
+		*size += n;
+	} while (n);
+	fclose(f);
+	return buf;
 }
 
+/* Decode the tables exported by Linux. This works without physical memory access and also finds SMBIOS
+ * tables outside of the legacy BIOS area, as on EFI systems. */
+static int dmi_fill_sysfs(void)
+{
+	uint8_t *entry, *table;
+	size_t entry_len, table_len;
+	uint64_t base;
+	uint32_t len;
+	unsigned int num;
+	int ret = 1;
+
+	entry = dmi_read_file("/sys/firmware/dmi/tables/smbios_entry_point", &entry_len);
+	if (!entry)
+		return 1;
+	if (dmi_entry_point(entry, entry_len, &base, &len, &num)) {
+		msg_pdbg("Invalid SMBIOS entry point in sysfs.\n");
+		goto out;
+	}
+	table = dmi_read_file("/sys/firmware/dmi/tables/DMI", &table_len);
+	if (!table)
+		goto out;
+	msg_pdbg("Using the DMI table from sysfs.\n");
+	dmi_decode_table(table, min(len, table_len), num);
+	free(table);
+	ret = 0;
+out:
+	free(entry);
+	return ret;
+}
+#endif
+
 int dmi_fill(void)
 {
 	size_t fp;
 	uint8_t *dmi_mem;
+	uint64_t base;
+	uint32_t len;
+	unsigned int num;
 	int ret = 1;
 
 	msg_pdbg("Using Internal DMI decoder.\n");
+#if defined(__linux__)
+	if (!dmi_fill_sysfs())
+		return 0;
+#endif
 	/* There are two ways specified to gain access to the SMBIOS table:
 	 * - EFI's configuration table contains a pointer to the SMBIOS table. On linux it can be obtained from
 	 *   sysfs. EFI's SMBIOS GUID is: {0xeb9d2d31,0x2d88,0x11d3,0x9a,0x16,0x0,0x90,0x27,0x3f,0xc1,0x4d}
@@ -269,20 +377,22 @@ int dmi_fill(void)
 	if (dmi_mem == ERROR_PTR)
 		return ret;
 
+	/* Anchors are paragraph aligned. Prefer the newest kind of entry point. */
 	for (fp = 0; fp <= 0xFFF0; fp += 16) {
-#if SM_SUPPORT
-		if (memcmp(dmi_mem + fp, "_SM_", 4) == 0 && fp <= 0xFFE0) {
-			if (smbios_decode(dmi_mem + fp)) // FIXME: length check
-				goto out;
-		} else
-#endif
-		if (memcmp(dmi_mem + fp, "_DMI_", 5) == 0)
-			if (legacy_decode(dmi_mem + fp) == 0) {
-				ret = 0;
-				goto out;
-			}
+		if (!memcmp(dmi_mem + fp, "_SM3_", 5) &&
+		    !dmi_entry_point(dmi_mem + fp, 0x10000 - fp, &base, &len, &num))
+			goto found;
+	}
+	for (fp = 0; fp <= 0xFFF0; fp += 16) {
+		/* A valid "_SM_" entry point contains the "_DMI_" one. */
+		if (!dmi_entry_point(dmi_mem + fp, 0x10000 - fp, &base, &len, &num))
+			goto found;
 	}
 	msg_pinfo("No DMI table found.\n");
+	goto out;
+found:
+	dmi_table(base, len, num);
+	ret = 0;
 out:
 	physunmap(dmi_mem, 0x10000);
 	return ret;
@@ -45,11 +45,12 @@ static void drkaiser_chip_writeb(const struct flashctx *flash, uint8_t val,
 				 chipaddr addr);
 static uint8_t drkaiser_chip_readb(const struct flashctx *flash,
 				   const chipaddr addr);
+static void drkaiser_chip_readn(const struct flashctx *flash, uint8_t *buf, const chipaddr addr, size_t len);
 static const struct par_master par_master_drkaiser = {
 		.chip_readb		= drkaiser_chip_readb,
 		.chip_readw		= fallback_chip_readw,
 		.chip_readl		= fallback_chip_readl,
-		.chip_readn		= fallback_chip_readn,
+		.chip_readn		= drkaiser_chip_readn,
 		.chip_writeb		= drkaiser_chip_writeb,
 		.chip_writew		= fallback_chip_writew,
 		.chip_writel		= fallback_chip_writel,
@@ -97,3 +98,15 @@ static uint8_t drkaiser_chip_readb(const struct flashctx *flash,
 {
 	return pci_mmio_readb(drkaiser_bar + (addr & DRKAISER_MEMMAP_MASK));
 }
+
+/* The flash is mapped into the BAR, so read it with wide loads. The window repeats every 128 kB. */
+static void drkaiser_chip_readn(const struct flashctx *flash, uint8_t *buf, const chipaddr addr, size_t len)
+{
+	chipaddr a = addr;
+	size_t n;
+
+	for (; len; len -= n, buf += n, a += n) {
+		n = min(len, DRKAISER_MEMMAP_MASK + 1 - (a & DRKAISER_MEMMAP_MASK));
+		mmio_readn(drkaiser_bar + (a & DRKAISER_MEMMAP_MASK), buf, n);
+	}
+}
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include "flash.h"
 #include "chipdrivers.h"
 #include "programmer.h"
@@ -37,6 +38,12 @@
 #if EMULATE_CHIP
 #include <sys/types.h>
 #include <sys/stat.h>
+#if !IS_WINDOWS && !defined(__DJGPP__) && !defined(__LIBPAYLOAD__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#define HAVE_MMAP_IMAGE 1
+#endif
 #endif
 
 #if EMULATE_CHIP
@@ -47,9 +54,13 @@ enum emu_chip {
 	EMULATE_SST_SST25VF040_REMS,
 	EMULATE_SST_SST25VF032B,
 	EMULATE_MACRONIX_MX25L6436,
+	EMULATE_WINBOND_W25Q128FV,
+	EMULATE_WINBOND_W25Q256FV,
 };
 static enum emu_chip emu_chip = EMULATE_NONE;
 static char *emu_persistent_image = NULL;
+/* flashchip_contents is a shared mapping of emu_persistent_image, changes end up in the file by themselves. */
+static bool emu_image_mapped = false;
 static unsigned int emu_chip_size = 0;
 #if EMULATE_SPI_CHIP
 static unsigned int emu_max_byteprogram_size = 0;
@@ -64,6 +75,59 @@ unsigned char spi_ignorelist[256];
 int spi_blacklist_size = 0;
 int spi_ignorelist_size = 0;
 static uint8_t emu_status = 0;
+/* The emulated chip has 4-byte address commands and mode. */
+static bool emu_4ba = false;
+static bool emu_in_4ba_mode = false;
+
+/*
+ * Optional timing model. Every command costs the round trip latency of its class (unless it is pipelined
+ * behind the previous one in a queue) plus its bytes at the given bandwidth, and with chip timing the chip
+ * stays busy for the typical program/erase time. Time is simulated: delays just advance the clock, so a
+ * run is fast and its simulated duration the same every time.
+ */
+enum emu_cmd_class {
+	EMU_CLASS_PROBE,
+	EMU_CLASS_READ,
+	EMU_CLASS_PROGRAM,
+	EMU_CLASS_ERASE,
+	EMU_CLASS_STATUS,
+	EMU_CLASS_OTHER,
+	EMU_NUM_CLASSES
+};
+static const char *const emu_class_names[EMU_NUM_CLASSES] = {
+	[EMU_CLASS_PROBE]	= "probe",
+	[EMU_CLASS_READ]	= "read",
+	[EMU_CLASS_PROGRAM]	= "program",
+	[EMU_CLASS_ERASE]	= "erase",
+	[EMU_CLASS_STATUS]	= "status",
+	[EMU_CLASS_OTHER]	= "other",
+};
+static const struct {
+	const char *name;
+	unsigned int latency_us;
+	unsigned int bandwidth;		/* Bytes per second. */
+} emu_timing_presets[] = {
+	{ "ft2232",	1000,	1000000 },	/* FT2232D on USB full speed */
+	{ "serprog",	500,	200000 },	/* USB serial adapter at 2 Mbaud */
+	{ "ich",	5,	10000000 },	/* ICH hardware sequencing */
+};
+/* Typical chip times (Winbond W25Q family, SST25 for byte and AAI programs). */
+#define EMU_PAGE_PROGRAM_US	700
+#define EMU_BYTE_PROGRAM_US	20
+#define EMU_AAI_WORD_US		10
+#define EMU_WRSR_US		10000
+#define EMU_SE_US		45000
+#define EMU_BE_52_US		120000
+#define EMU_BE_D8_US		150000
+static bool emu_timing = false;
+static bool emu_chip_timing = false;
+static unsigned int emu_latency_us[EMU_NUM_CLASSES];
+static unsigned int emu_bandwidth = 0;
+static uint64_t emu_clock_us = 0;
+/* WIP is set until the clock reaches this, 0 if the chip isn't busy. */
+static uint64_t emu_busy_until = 0;
+/* The next command follows the previous one in the same batch, without a round trip. */
+static bool emu_pipelined = false;
 
 /* A legit complete SFDP table based on the MX25L6436E (rev. 1.8) datasheet. */
 static const uint8_t sfdp_table[] = {
@@ -91,6 +155,36 @@ static const uint8_t sfdp_table[] = {
 	0xFF, 0xFF, 0xFF, 0xFF, // @0x54: Macronix parameter table end
 };
 
+/* A JESD216B SFDP table modeled after the W25Q256FV, with a 4-Byte Address Instruction Table. */
+static const uint8_t w25q256fv_sfdp_table[] = {
+	0x53, 0x46, 0x44, 0x50, // @0x00: SFDP signature
+	0x06, 0x01, 0x01, 0xFF, // @0x04: revision 1.6, 2 headers
+	0x00, 0x06, 0x01, 0x10, // @0x08: JEDEC SFDP header rev. 1.6, 16 DW long
+	0x20, 0x00, 0x00, 0xFF, // @0x0C: PTP0 = 0x20
+	0x84, 0x00, 0x01, 0x02, // @0x10: 4-Byte Address Instruction Table header rev. 1.0, 2 DW long
+	0x60, 0x00, 0x00, 0xFF, // @0x14: PTP1 = 0x60
+	0xFF, 0xFF, 0xFF, 0xFF, // @0x18: hole.
+	0xFF, 0xFF, 0xFF, 0xFF, // @0x1C: hole.
+	0xE5, 0x20, 0xF3, 0xFF, // @0x20: SFDP parameter table start
+	0xFF, 0xFF, 0xFF, 0x0F, // @0x24
+	0x44, 0xEB, 0x08, 0x6B, // @0x28
+	0x08, 0x3B, 0x80, 0xBB, // @0x2C
+	0xEE, 0xFF, 0xFF, 0xFF, // @0x30
+	0xFF, 0xFF, 0x00, 0xFF, // @0x34
+	0xFF, 0xFF, 0x00, 0xFF, // @0x38
+	0x0C, 0x20, 0x0F, 0x52, // @0x3C
+	0x10, 0xD8, 0x00, 0xFF, // @0x40
+	0x22, 0x3A, 0xA5, 0x00, // @0x44: typical erase times 48 ms/128 ms/160 ms
+	0x82, 0x2A, 0x00, 0x53, // @0x48: typical page program 704 us, chip erase 80 s
+	0x00, 0x00, 0x00, 0x00, // @0x4C
+	0x00, 0x00, 0x00, 0x00, // @0x50
+	0x00, 0x00, 0x00, 0x00, // @0x54
+	0x00, 0x00, 0x40, 0x00, // @0x58: quad enable is bit 1 of status register 2
+	0x00, 0x40, 0x00, 0x01, // @0x5C: SFDP parameter table end
+	0x7F, 0x0E, 0x00, 0x00, // @0x60: 4-Byte Address Instruction Table start
+	0x21, 0x5C, 0xDC, 0xFF, // @0x64: 4-Byte Address Instruction Table end
+};
+
 #endif
 #endif
 
@@ -100,6 +194,7 @@ static int dummy_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 				  const unsigned char *writearr, unsigned char *readarr);
 static int dummy_spi_write_256(struct flashctx *flash, const uint8_t *buf,
 			       unsigned int start, unsigned int len);
+static int dummy_spi_queue(struct flashctx *flash, const struct spi_queued_op *ops, unsigned int count);
 static void dummy_chip_writeb(const struct flashctx *flash, uint8_t val, chipaddr addr);
 static void dummy_chip_writew(const struct flashctx *flash, uint16_t val, chipaddr addr);
 static void dummy_chip_writel(const struct flashctx *flash, uint32_t val, chipaddr addr);
@@ -109,7 +204,14 @@ static uint16_t dummy_chip_readw(const struct flashctx *flash, const chipaddr ad
 static uint32_t dummy_chip_readl(const struct flashctx *flash, const chipaddr addr);
 static void dummy_chip_readn(const struct flashctx *flash, uint8_t *buf, const chipaddr addr, size_t len);
 
-static const struct spi_master spi_master_dummyflasher = {
+#if EMULATE_SPI_CHIP
+static int dummy_spi_checksum(struct flashctx *flash, unsigned int start, unsigned int len, uint32_t *crc);
+static int dummy_init_timing(void);
+#endif
+static int dummy_spi_multi_io_read(struct flashctx *flash, enum spi_io_mode mode, unsigned int writecnt,
+				   unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr);
+
+static struct spi_master spi_master_dummyflasher = {
 	.type		= SPI_CONTROLLER_DUMMY,
 	.max_data_read	= MAX_DATA_READ_UNLIMITED,
 	.max_data_write	= MAX_DATA_UNSPECIFIED,
@@ -118,6 +220,8 @@ static const struct spi_master spi_master_dummyflasher = {
 	.read		= default_spi_read,
 	.write_256	= dummy_spi_write_256,
 	.write_aai	= default_spi_write_aai,
+	.multi_io_read	= dummy_spi_multi_io_read,
+	.queue		= dummy_spi_queue,
 };
 
 static const struct par_master par_master_dummy = {
@@ -133,18 +237,95 @@ static const struct par_master par_master_dummy = {
 
 enum chipbustype dummy_buses_supported = BUS_NONE;
 
+#if EMULATE_CHIP
+static void dummy_free_contents(void)
+{
+#if HAVE_MMAP_IMAGE
+	if (emu_image_mapped) {
+		munmap(flashchip_contents, emu_chip_size);
+		emu_image_mapped = false;
+		flashchip_contents = NULL;
+		return;
+	}
+#endif
+	free(flashchip_contents);
+	flashchip_contents = NULL;
+}
+
+#if HAVE_MMAP_IMAGE
+/*
+ * Use a shared mapping of the persistent image at @path as the chip contents instead of reading it now and
+ * writing all of it back at shutdown: only the pages changed are written (by the kernel, whenever it likes).
+ * An image that doesn't exist yet or doesn't match the emulated chip is replaced by an erased one right away.
+ * Returns 0 on success, 1 if the image has to be handled the old way.
+ */
+static int dummy_map_image(const char *path)
+{
+	struct stat image_stat;
+	bool erase;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &image_stat) || !S_ISREG(image_stat.st_mode))
+		goto fail;
+	erase = image_stat.st_size != emu_chip_size;
+	msg_pdbg("Mapping persistent image %s, size %li %s.\n", path, (long)image_stat.st_size,
+		 erase ? "doesn't match, erasing it" : "matches");
+	if (erase && (ftruncate(fd, 0) || ftruncate(fd, emu_chip_size)))
+		goto fail;
+	map = mmap(NULL, emu_chip_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	close(fd);
+
+	if (erase)
+		memset(map, 0xff, emu_chip_size);
+	free(flashchip_contents);
+	flashchip_contents = map;
+	emu_image_mapped = true;
+	return 0;
+
+fail:
+	msg_pdbg("Can't map %s: %s\n", path, strerror(errno));
+	close(fd);
+	return 1;
+}
+#endif
+#endif
+
+void dummy_delay(unsigned int usecs)
+{
+#if EMULATE_SPI_CHIP
+	if (emu_timing) {
+		emu_clock_us += usecs;
+		return;
+	}
+#endif
+	internal_delay(usecs);
+}
+
 static int dummy_shutdown(void *data)
 {
 	msg_pspew("%s\n", __func__);
 #if EMULATE_CHIP
 	if (emu_chip != EMULATE_NONE) {
+#if EMULATE_SPI_CHIP
+		if (emu_timing)
+			msg_pinfo("Simulated time: %llu.%06llu s\n", (unsigned long long)emu_clock_us / 1000000,
+				  (unsigned long long)emu_clock_us % 1000000);
+#endif
 		if (emu_persistent_image) {
-			msg_pdbg("Writing %s\n", emu_persistent_image);
-			write_buf_to_file(flashchip_contents, emu_chip_size, emu_persistent_image);
+			if (!emu_image_mapped) {
+				msg_pdbg("Writing %s\n", emu_persistent_image);
+				write_buf_to_file(flashchip_contents, emu_chip_size, emu_persistent_image);
+			}
 			free(emu_persistent_image);
 			emu_persistent_image = NULL;
 		}
-		free(flashchip_contents);
+		dummy_free_contents();
 	}
 #endif
 	return 0;
@@ -155,6 +336,7 @@ int dummy_init(void)
 	char *bustext = NULL;
 	char *tmp = NULL;
 	int i;
+	bool concurrent = true;
 #if EMULATE_SPI_CHIP
 	char *status = NULL;
 #endif
@@ -202,6 +384,22 @@ int dummy_init(void)
 		}
 	}
 
+	/* Pretend to be a master with dual or quad reads. */
+	tmp = extract_programmer_param("io");
+	if (tmp) {
+		if (!strcmp(tmp, "dual")) {
+			spi_master_dummyflasher.io_modes = SPI_IO_MODE(SPI_IO_1_1_2) | SPI_IO_MODE(SPI_IO_1_2_2);
+		} else if (!strcmp(tmp, "quad")) {
+			spi_master_dummyflasher.io_modes = SPI_IO_MODE(SPI_IO_1_1_2) | SPI_IO_MODE(SPI_IO_1_2_2) |
+							   SPI_IO_MODE(SPI_IO_1_1_4) | SPI_IO_MODE(SPI_IO_1_4_4);
+		} else if (strcmp(tmp, "single")) {
+			msg_perr("invalid io mode: %s (use single, dual or quad)\n", tmp);
+			free(tmp);
+			return 1;
+		}
+		free(tmp);
+	}
+
 	tmp = extract_programmer_param("spi_blacklist");
 	if (tmp) {
 		i = strlen(tmp);
@@ -334,6 +532,31 @@ int dummy_init(void)
 		msg_pdbg("Emulating Macronix MX25L6436 SPI flash chip (RDID, "
 			 "SFDP)\n");
 	}
+	if (!strcmp(tmp, "W25Q128FV")) {
+		emu_chip = EMULATE_WINBOND_W25Q128FV;
+		emu_chip_size = 16 * 1024 * 1024;
+		emu_max_byteprogram_size = 256;
+		emu_max_aai_size = 0;
+		emu_jedec_se_size = 4 * 1024;
+		emu_jedec_be_52_size = 32 * 1024;
+		emu_jedec_be_d8_size = 64 * 1024;
+		emu_jedec_ce_60_size = emu_chip_size;
+		emu_jedec_ce_c7_size = emu_chip_size;
+		msg_pdbg("Emulating Winbond W25Q128FV SPI flash chip (RDID)\n");
+	}
+	if (!strcmp(tmp, "W25Q256FV")) {
+		emu_chip = EMULATE_WINBOND_W25Q256FV;
+		emu_chip_size = 32 * 1024 * 1024;
+		emu_max_byteprogram_size = 256;
+		emu_max_aai_size = 0;
+		emu_jedec_se_size = 4 * 1024;
+		emu_jedec_be_52_size = 32 * 1024;
+		emu_jedec_be_d8_size = 64 * 1024;
+		emu_jedec_ce_60_size = emu_chip_size;
+		emu_jedec_ce_c7_size = emu_chip_size;
+		emu_4ba = true;
+		msg_pdbg("Emulating Winbond W25Q256FV SPI flash chip (RDID, SFDP, 4-byte addresses)\n");
+	}
 #endif
 	if (emu_chip == EMULATE_NONE) {
 		msg_perr("Invalid chip specified for emulation: %s\n", tmp);
@@ -362,13 +585,36 @@ int dummy_init(void)
 		msg_pdbg("Initial status register is set to 0x%02x.\n",
 			 emu_status);
 	}
+
+	tmp = extract_programmer_param("checksum");
+	if (tmp) {
+		if (!strcmp(tmp, "yes")) {
+			spi_master_dummyflasher.checksum = dummy_spi_checksum;
+			msg_pdbg("Emulating programmer-side checksums.\n");
+		} else if (strcmp(tmp, "no")) {
+			msg_perr("Error: checksum must be \"yes\" or \"no\".\n");
+			free(tmp);
+			return 1;
+		}
+		free(tmp);
+	}
+
+	if (dummy_init_timing())
+		return 1;
+#endif
+
+	/* Will be freed by shutdown function if necessary. */
+	emu_persistent_image = extract_programmer_param("image");
+#if HAVE_MMAP_IMAGE
+	/* Compressed images are read and written as a whole. */
+	if (emu_persistent_image && image_compression_from_name(emu_persistent_image) == IMAGE_RAW &&
+	    !dummy_map_image(emu_persistent_image))
+		goto dummy_init_out;
 #endif
 
 	msg_pdbg("Filling fake flash chip with 0xff, size %i\n", emu_chip_size);
 	memset(flashchip_contents, 0xff, emu_chip_size);
 
-	/* Will be freed by shutdown function if necessary. */
-	emu_persistent_image = extract_programmer_param("image");
 	if (!emu_persistent_image) {
 		/* Nothing else to do. */
 		goto dummy_init_out;
@@ -378,7 +624,8 @@ int dummy_init(void)
 	if (!stat(emu_persistent_image, &image_stat)) {
 		msg_pdbg("Found persistent image %s, size %li ",
 			 emu_persistent_image, (long)image_stat.st_size);
-		if (image_stat.st_size == emu_chip_size) {
+		if (image_stat.st_size == emu_chip_size ||
+		    image_compression_from_name(emu_persistent_image) != IMAGE_RAW) {
 			msg_pdbg("matches.\n");
 			msg_pdbg("Reading %s\n", emu_persistent_image);
 			read_buf_from_file(flashchip_contents, emu_chip_size,
@@ -391,14 +638,28 @@ int dummy_init(void)
 
 dummy_init_out:
 	if (register_shutdown(dummy_shutdown, NULL)) {
-		free(flashchip_contents);
+#if EMULATE_CHIP
+		dummy_free_contents();
+#endif
 		return 1;
 	}
-	if (dummy_buses_supported & (BUS_PARALLEL | BUS_LPC | BUS_FWH))
+	/* The parallel master keeps no state and the SPI master keeps all of the emulation state, so they can
+	 * be probed at the same time. Except with the timing model: the delays of both advance the same
+	 * simulated clock. */
+#if EMULATE_SPI_CHIP
+	concurrent = !emu_timing;
+#endif
+	if (dummy_buses_supported & (BUS_PARALLEL | BUS_LPC | BUS_FWH)) {
 		register_par_master(&par_master_dummy,
 				    dummy_buses_supported & (BUS_PARALLEL | BUS_LPC | BUS_FWH));
-	if (dummy_buses_supported & BUS_SPI)
+		if (concurrent)
+			declare_master_independent();
+	}
+	if (dummy_buses_supported & BUS_SPI) {
 		register_spi_master(&spi_master_dummyflasher);
+		if (concurrent)
+			declare_master_independent();
+	}
 
 	return 0;
 }
@@ -467,16 +728,212 @@ static void dummy_chip_readn(const struct flashctx *flash, uint8_t *buf, const c
 }
 
 #if EMULATE_SPI_CHIP
+/* Map the 4-byte address variants of commands to the plain opcode and return it, @alen is set to the
+ * number of address bytes the command takes.
+ */
+static uint8_t emu_normalize_opcode(uint8_t opcode, unsigned int *alen)
+{
+	static const uint8_t native_4ba[][2] = {
+		{ JEDEC_READ_4BA, JEDEC_READ },
+		{ JEDEC_DOR_4BA, JEDEC_DOR },
+		{ JEDEC_DIOR_4BA, JEDEC_DIOR },
+		{ JEDEC_QOR_4BA, JEDEC_QOR },
+		{ JEDEC_QIOR_4BA, JEDEC_QIOR },
+		{ JEDEC_BYTE_PROGRAM_4BA, JEDEC_BYTE_PROGRAM },
+		{ JEDEC_SE_4BA, JEDEC_SE },
+		{ JEDEC_BE_52_4BA, JEDEC_BE_52 },
+		{ JEDEC_BE_D8_4BA, JEDEC_BE_D8 },
+	};
+	unsigned int i;
+
+	*alen = 3;
+	if (!emu_4ba)
+		return opcode;
+	for (i = 0; i < ARRAY_SIZE(native_4ba); i++) {
+		if (opcode == native_4ba[i][0]) {
+			*alen = 4;
+			return native_4ba[i][1];
+		}
+	}
+	if (emu_in_4ba_mode)
+		*alen = 4;
+	return opcode;
+}
+
+static unsigned int emu_address(const unsigned char *writearr, unsigned int alen)
+{
+	unsigned int i, addr = 0;
+
+	for (i = 1; i <= alen; i++)
+		addr = addr << 8 | writearr[i];
+	return addr;
+}
+
+/* Parse the unsigned programmer parameter @name into @value. Returns 1 if it was given, 0 if not, -1 on errors. */
+static int emu_timing_param(const char *name, unsigned int *value)
+{
+	char *tmp = extract_programmer_param(name);
+	char *endptr;
+	unsigned long val;
+
+	if (!tmp)
+		return 0;
+	errno = 0;
+	val = strtoul(tmp, &endptr, 0);
+	if (errno || endptr == tmp || *endptr || val > UINT_MAX) {
+		msg_perr("Error: %s must be a number, got \"%s\".\n", name, tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	*value = val;
+	return 1;
+}
+
+/* Set up the timing model from the timing, latency, latency_<class>, bandwidth and chip_timing parameters. */
+static int dummy_init_timing(void)
+{
+	unsigned int latency = 0, i;
+	char name[32];
+	char *tmp;
+	int ret;
+
+	tmp = extract_programmer_param("timing");
+	if (tmp) {
+		for (i = 0; i < ARRAY_SIZE(emu_timing_presets); i++)
+			if (!strcmp(tmp, emu_timing_presets[i].name))
+				break;
+		if (i == ARRAY_SIZE(emu_timing_presets)) {
+			msg_perr("Error: unknown timing preset \"%s\".\n", tmp);
+			free(tmp);
+			return 1;
+		}
+		free(tmp);
+		latency = emu_timing_presets[i].latency_us;
+		emu_bandwidth = emu_timing_presets[i].bandwidth;
+		emu_timing = true;
+	}
+	ret = emu_timing_param("latency", &latency);
+	if (ret < 0)
+		return 1;
+	emu_timing |= ret;
+	for (i = 0; i < EMU_NUM_CLASSES; i++) {
+		emu_latency_us[i] = latency;
+		snprintf(name, sizeof(name), "latency_%s", emu_class_names[i]);
+		ret = emu_timing_param(name, &emu_latency_us[i]);
+		if (ret < 0)
+			return 1;
+		emu_timing |= ret;
+	}
+	ret = emu_timing_param("bandwidth", &emu_bandwidth);
+	if (ret < 0)
+		return 1;
+	emu_timing |= ret;
+
+	/* Chip timing comes with any other timing parameter, unless disabled. */
+	emu_chip_timing = emu_timing;
+	tmp = extract_programmer_param("chip_timing");
+	if (tmp) {
+		if (!strcmp(tmp, "yes")) {
+			emu_chip_timing = true;
+			emu_timing = true;
+		} else if (!strcmp(tmp, "no")) {
+			emu_chip_timing = false;
+		} else {
+			msg_perr("Error: chip_timing must be \"yes\" or \"no\".\n");
+			free(tmp);
+			return 1;
+		}
+		free(tmp);
+	}
+	if (!emu_timing)
+		return 0;
+
+	msg_pdbg("Simulating timing, latency (us):");
+	for (i = 0; i < EMU_NUM_CLASSES; i++)
+		msg_pdbg(" %s %u", emu_class_names[i], emu_latency_us[i]);
+	msg_pdbg(", bandwidth %u B/s%s, chip timing %s.\n", emu_bandwidth, emu_bandwidth ? "" : " (unlimited)",
+		 emu_chip_timing ? "on" : "off");
+	return 0;
+}
+
+static enum emu_cmd_class emu_cmd_class(uint8_t opcode)
+{
+	unsigned int alen;
+
+	switch (emu_normalize_opcode(opcode, &alen)) {
+	case JEDEC_RES:
+	case JEDEC_REMS:
+	case JEDEC_RDID:
+	case JEDEC_SFDP:
+	case JEDEC_RDUID:
+		return EMU_CLASS_PROBE;
+	case JEDEC_READ:
+	case JEDEC_DOR:
+	case JEDEC_DIOR:
+	case JEDEC_QOR:
+	case JEDEC_QIOR:
+		return EMU_CLASS_READ;
+	case JEDEC_BYTE_PROGRAM:
+	case JEDEC_AAI_WORD_PROGRAM:
+		return EMU_CLASS_PROGRAM;
+	case JEDEC_SE:
+	case JEDEC_BE_52:
+	case JEDEC_BE_D8:
+	case JEDEC_CE_60:
+	case JEDEC_CE_C7:
+		return EMU_CLASS_ERASE;
+	case JEDEC_RDSR:
+	case JEDEC_WRSR:
+	case JEDEC_EWSR:
+	case JEDEC_WREN:
+	case JEDEC_WRDI:
+		return EMU_CLASS_STATUS;
+	default:
+		return EMU_CLASS_OTHER;
+	}
+}
+
+/* Advance the clock for a command with @opcode transferring @bytes in total. */
+static void emu_charge(uint8_t opcode, unsigned int bytes)
+{
+	/* Microseconds times bandwidth not accounted for yet, so short commands add up correctly. */
+	static uint64_t remainder = 0;
+
+	if (!emu_timing)
+		return;
+	if (!emu_pipelined)
+		emu_clock_us += emu_latency_us[emu_cmd_class(opcode)];
+	if (emu_bandwidth) {
+		remainder += (uint64_t)bytes * 1000000;
+		emu_clock_us += remainder / emu_bandwidth;
+		remainder %= emu_bandwidth;
+	}
+}
+
+/* Keep WIP set for @usecs from now, if chip timing is enabled. */
+static void emu_set_busy(unsigned int usecs)
+{
+	if (!emu_chip_timing)
+		return;
+	emu_status |= SPI_SR_WIP;
+	emu_busy_until = emu_clock_us + usecs;
+}
+
 static int emulate_spi_chip_response(unsigned int writecnt,
 				     unsigned int readcnt,
 				     const unsigned char *writearr,
 				     unsigned char *readarr)
 {
-	unsigned int offs, i, toread;
+	unsigned int offs, i, toread, alen;
 	static int unsigned aai_offs;
 	const unsigned char sst25vf040_rems_response[2] = {0xbf, 0x44};
 	const unsigned char sst25vf032b_rems_response[2] = {0xbf, 0x4a};
 	const unsigned char mx25l6436_rems_response[2] = {0xc2, 0x16};
+	const unsigned char w25q128fv_rems_response[2] = {0xef, 0x17};
+	const unsigned char w25q256fv_rems_response[2] = {0xef, 0x18};
+	const uint8_t *sfdp;
+	unsigned int sfdp_size;
 
 	if (writecnt == 0) {
 		msg_perr("No command sent to the chip!\n");
@@ -501,6 +958,16 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 		}
 	}
 
+	if (emu_busy_until && emu_clock_us >= emu_busy_until) {
+		emu_busy_until = 0;
+		emu_status &= ~SPI_SR_WIP;
+	}
+	/* Like real chips, ignore everything but RDSR while busy. */
+	if (emu_busy_until && writearr[0] != JEDEC_RDSR) {
+		msg_pwarn("Ignoring SPI command 0x%02x, the chip is busy.\n", writearr[0]);
+		return 0;
+	}
+
 	if (emu_max_aai_size && (emu_status & SPI_SR_AAI)) {
 		if (writearr[0] != JEDEC_AAI_WORD_PROGRAM &&
 		    writearr[0] != JEDEC_WRDI &&
@@ -511,7 +978,7 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 		}
 	}
 
-	switch (writearr[0]) {
+	switch (emu_normalize_opcode(writearr[0], &alen)) {
 	case JEDEC_RES:
 		if (writecnt < JEDEC_RES_OUTSIZE)
 			break;
@@ -535,6 +1002,14 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			if (readcnt > 0)
 				memset(readarr, 0x16, readcnt);
 			break;
+		case EMULATE_WINBOND_W25Q128FV:
+			if (readcnt > 0)
+				memset(readarr, 0x17, readcnt);
+			break;
+		case EMULATE_WINBOND_W25Q256FV:
+			if (readcnt > 0)
+				memset(readarr, 0x18, readcnt);
+			break;
 		default: /* ignore */
 			break;
 		}
@@ -558,6 +1033,14 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			for (i = 0; i < readcnt; i++)
 				readarr[i] = mx25l6436_rems_response[(offs + i) % 2];
 			break;
+		case EMULATE_WINBOND_W25Q128FV:
+			for (i = 0; i < readcnt; i++)
+				readarr[i] = w25q128fv_rems_response[(offs + i) % 2];
+			break;
+		case EMULATE_WINBOND_W25Q256FV:
+			for (i = 0; i < readcnt; i++)
+				readarr[i] = w25q256fv_rems_response[(offs + i) % 2];
+			break;
 		default: /* ignore */
 			break;
 		}
@@ -580,10 +1063,33 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			if (readcnt > 2)
 				readarr[2] = 0x17;
 			break;
+		case EMULATE_WINBOND_W25Q128FV:
+			if (readcnt > 0)
+				readarr[0] = 0xef;
+			if (readcnt > 1)
+				readarr[1] = 0x40;
+			if (readcnt > 2)
+				readarr[2] = 0x18;
+			break;
+		case EMULATE_WINBOND_W25Q256FV:
+			if (readcnt > 0)
+				readarr[0] = 0xef;
+			if (readcnt > 1)
+				readarr[1] = 0x40;
+			if (readcnt > 2)
+				readarr[2] = 0x19;
+			break;
 		default: /* ignore */
 			break;
 		}
 		break;
+	case JEDEC_RDUID:
+		/* All emulated chips of a kind report the same ID. */
+		if (emu_chip == EMULATE_WINBOND_W25Q128FV || emu_chip == EMULATE_WINBOND_W25Q256FV) {
+			static const uint8_t uid[JEDEC_RDUID_INSIZE] = { 0xd2, 0x64, 0x1c, 0x5b, 0x13, 0x2e, 0x25, 0x31 };
+			memcpy(readarr, uid, min(readcnt, sizeof(uid)));
+		}
+		break;
 	case JEDEC_RDSR:
 		memset(readarr, emu_status, readcnt);
 		break;
@@ -597,30 +1103,40 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			msg_perr("WRSR attempted, but WEL is 0!\n");
 			break;
 		}
-		/* FIXME: add some reasonable simulation of the busy flag */
 		emu_status = writearr[1] & ~SPI_SR_WIP;
 		msg_pdbg2("WRSR wrote 0x%02x.\n", emu_status);
+		emu_set_busy(EMU_WRSR_US);
 		break;
+	case JEDEC_DOR:
+	case JEDEC_DIOR:
+	case JEDEC_QOR:
+	case JEDEC_QIOR:
+		/* Only these emulated chips have multi-I/O reads. */
+		if (emu_chip != EMULATE_MACRONIX_MX25L6436 && emu_chip != EMULATE_WINBOND_W25Q128FV &&
+		    emu_chip != EMULATE_WINBOND_W25Q256FV)
+			break;
+		/* fall through */
 	case JEDEC_READ:
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
+		offs = emu_address(writearr, alen);
 		/* Truncate to emu_chip_size. */
 		offs %= emu_chip_size;
 		if (readcnt > 0)
 			memcpy(readarr, flashchip_contents + offs, readcnt);
 		break;
 	case JEDEC_BYTE_PROGRAM:
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
+		offs = emu_address(writearr, alen);
 		/* Truncate to emu_chip_size. */
 		offs %= emu_chip_size;
-		if (writecnt < 5) {
+		if (writecnt < 2 + alen) {
 			msg_perr("BYTE PROGRAM size too short!\n");
 			return 1;
 		}
-		if (writecnt - 4 > emu_max_byteprogram_size) {
+		if (writecnt - 1 - alen > emu_max_byteprogram_size) {
 			msg_perr("Max BYTE PROGRAM size exceeded!\n");
 			return 1;
 		}
-		memcpy(flashchip_contents + offs, writearr + 4, writecnt - 4);
+		memcpy(flashchip_contents + offs, writearr + 1 + alen, writecnt - 1 - alen);
+		emu_set_busy(writecnt - 1 - alen > 1 ? EMU_PAGE_PROGRAM_US : EMU_BYTE_PROGRAM_US);
 		break;
 	case JEDEC_AAI_WORD_PROGRAM:
 		if (!emu_max_aai_size)
@@ -657,6 +1173,7 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			memcpy(flashchip_contents + aai_offs, writearr + 1, 2);
 			aai_offs += 2;
 		}
+		emu_set_busy(EMU_AAI_WORD_US);
 		break;
 	case JEDEC_WRDI:
 		if (emu_max_aai_size)
@@ -665,7 +1182,7 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 	case JEDEC_SE:
 		if (!emu_jedec_se_size)
 			break;
-		if (writecnt != JEDEC_SE_OUTSIZE) {
+		if (writecnt != JEDEC_SE_OUTSIZE - 3 + alen) {
 			msg_perr("SECTOR ERASE 0x20 outsize invalid!\n");
 			return 1;
 		}
@@ -673,16 +1190,17 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			msg_perr("SECTOR ERASE 0x20 insize invalid!\n");
 			return 1;
 		}
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
+		offs = emu_address(writearr, alen);
 		if (offs & (emu_jedec_se_size - 1))
 			msg_pdbg("Unaligned SECTOR ERASE 0x20: 0x%x\n", offs);
 		offs &= ~(emu_jedec_se_size - 1);
 		memset(flashchip_contents + offs, 0xff, emu_jedec_se_size);
+		emu_set_busy(EMU_SE_US);
 		break;
 	case JEDEC_BE_52:
 		if (!emu_jedec_be_52_size)
 			break;
-		if (writecnt != JEDEC_BE_52_OUTSIZE) {
+		if (writecnt != JEDEC_BE_52_OUTSIZE - 3 + alen) {
 			msg_perr("BLOCK ERASE 0x52 outsize invalid!\n");
 			return 1;
 		}
@@ -690,16 +1208,17 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			msg_perr("BLOCK ERASE 0x52 insize invalid!\n");
 			return 1;
 		}
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
+		offs = emu_address(writearr, alen);
 		if (offs & (emu_jedec_be_52_size - 1))
 			msg_pdbg("Unaligned BLOCK ERASE 0x52: 0x%x\n", offs);
 		offs &= ~(emu_jedec_be_52_size - 1);
 		memset(flashchip_contents + offs, 0xff, emu_jedec_be_52_size);
+		emu_set_busy(EMU_BE_52_US);
 		break;
 	case JEDEC_BE_D8:
 		if (!emu_jedec_be_d8_size)
 			break;
-		if (writecnt != JEDEC_BE_D8_OUTSIZE) {
+		if (writecnt != JEDEC_BE_D8_OUTSIZE - 3 + alen) {
 			msg_perr("BLOCK ERASE 0xd8 outsize invalid!\n");
 			return 1;
 		}
@@ -707,11 +1226,12 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 			msg_perr("BLOCK ERASE 0xd8 insize invalid!\n");
 			return 1;
 		}
-		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
+		offs = emu_address(writearr, alen);
 		if (offs & (emu_jedec_be_d8_size - 1))
 			msg_pdbg("Unaligned BLOCK ERASE 0xd8: 0x%x\n", offs);
 		offs &= ~(emu_jedec_be_d8_size - 1);
 		memset(flashchip_contents + offs, 0xff, emu_jedec_be_d8_size);
+		emu_set_busy(EMU_BE_D8_US);
 		break;
 	case JEDEC_CE_60:
 		if (!emu_jedec_ce_60_size)
@@ -727,6 +1247,7 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 		/* JEDEC_CE_60_OUTSIZE is 1 (no address) -> no offset. */
 		/* emu_jedec_ce_60_size is emu_chip_size. */
 		memset(flashchip_contents, 0xff, emu_jedec_ce_60_size);
+		emu_set_busy(emu_chip_size / 65536 * EMU_BE_D8_US);
 		break;
 	case JEDEC_CE_C7:
 		if (!emu_jedec_ce_c7_size)
@@ -742,10 +1263,26 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 		/* JEDEC_CE_C7_OUTSIZE is 1 (no address) -> no offset. */
 		/* emu_jedec_ce_c7_size is emu_chip_size. */
 		memset(flashchip_contents, 0xff, emu_jedec_ce_c7_size);
+		emu_set_busy(emu_chip_size / 65536 * EMU_BE_D8_US);
+		break;
+	case JEDEC_ENTER_4_BYTE_ADDR_MODE:
+		if (emu_4ba)
+			emu_in_4ba_mode = true;
+		break;
+	case JEDEC_EXIT_4_BYTE_ADDR_MODE:
+		if (emu_4ba)
+			emu_in_4ba_mode = false;
 		break;
 	case JEDEC_SFDP:
-		if (emu_chip != EMULATE_MACRONIX_MX25L6436)
+		if (emu_chip == EMULATE_MACRONIX_MX25L6436) {
+			sfdp = sfdp_table;
+			sfdp_size = sizeof(sfdp_table);
+		} else if (emu_chip == EMULATE_WINBOND_W25Q256FV) {
+			sfdp = w25q256fv_sfdp_table;
+			sfdp_size = sizeof(w25q256fv_sfdp_table);
+		} else {
 			break;
+		}
 		if (writecnt < 4)
 			break;
 		offs = writearr[1] << 16 | writearr[2] << 8 | writearr[3];
@@ -766,13 +1303,13 @@ static int emulate_spi_chip_response(unsigned int writecnt,
 		/* The SFDP spec implies that the start address of an SFDP read may be truncated to fit in the
 		 * SFDP table address space, i.e. the start address may be wrapped around at SFDP table size.
 		 * This is a reasonable implementation choice in hardware because it saves a few gates. */
-		if (offs >= sizeof(sfdp_table)) {
+		if (offs >= sfdp_size) {
 			msg_pdbg("Wrapping the start address around the SFDP table boundary (using 0x%x "
-				 "instead of 0x%x).\n", (unsigned int)(offs % sizeof(sfdp_table)), offs);
-			offs %= sizeof(sfdp_table);
+				 "instead of 0x%x).\n", (unsigned int)(offs % sfdp_size), offs);
+			offs %= sfdp_size;
 		}
-		toread = min(sizeof(sfdp_table) - offs, readcnt);
-		memcpy(readarr, sfdp_table + offs, toread);
+		toread = min(sfdp_size - offs, readcnt);
+		memcpy(readarr, sfdp + offs, toread);
 		if (toread < readcnt)
 			msg_pdbg("Crossing the SFDP table boundary in a single "
 				 "continuous chunk produces undefined results "
@@ -793,22 +1330,22 @@ static int dummy_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 				  const unsigned char *writearr,
 				  unsigned char *readarr)
 {
-	int i;
-
 	msg_pspew("%s:", __func__);
 
 	msg_pspew(" writing %u bytes:", writecnt);
-	for (i = 0; i < writecnt; i++)
-		msg_pspew(" 0x%02x", writearr[i]);
+	msg_hexdump(MSG_SPEW, writearr, writecnt);
 
 	/* Response for unknown commands and missing chip is 0xff. */
 	memset(readarr, 0xff, readcnt);
 #if EMULATE_SPI_CHIP
+	emu_charge(writecnt ? writearr[0] : 0, writecnt + readcnt);
 	switch (emu_chip) {
 	case EMULATE_ST_M25P10_RES:
 	case EMULATE_SST_SST25VF040_REMS:
 	case EMULATE_SST_SST25VF032B:
 	case EMULATE_MACRONIX_MX25L6436:
+	case EMULATE_WINBOND_W25Q128FV:
+	case EMULATE_WINBOND_W25Q256FV:
 		if (emulate_spi_chip_response(writecnt, readcnt, writearr,
 					      readarr)) {
 			msg_pdbg("Invalid command sent to flash chip!\n");
@@ -820,14 +1357,78 @@ static int dummy_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 	}
 #endif
 	msg_pspew(" reading %u bytes:", readcnt);
-	for (i = 0; i < readcnt; i++)
-		msg_pspew(" 0x%02x", readarr[i]);
+	msg_hexdump(MSG_SPEW, readarr, readcnt);
 	msg_pspew("\n");
 	return 0;
 }
 
+/*
+ * Without chip timing the emulated chips are never busy, so a single status register read is enough for every
+ * poll and delays can be skipped. With the timing model the queue is run like a programmer doing the polls on
+ * its own would: commands follow each other without round trips, a poll ends when the chip is ready and the
+ * host only learns about that afterwards.
+ */
+static int dummy_spi_queue(struct flashctx *flash, const struct spi_queued_op *ops, unsigned int count)
+{
+	const unsigned char rdsr = JEDEC_RDSR;
+	unsigned int i;
+	unsigned char status;
+	int ret = 0;
+
+	for (i = 0; i < count && !ret; i++) {
+		if (!ops[i].poll) {
+			ret = dummy_spi_send_command(flash, ops[i].cmd.writecnt, ops[i].cmd.readcnt,
+						     ops[i].cmd.writearr, ops[i].cmd.readarr);
+#if EMULATE_SPI_CHIP
+			emu_pipelined = emu_timing;
+#endif
+			continue;
+		}
+#if EMULATE_SPI_CHIP
+		if (emu_timing) {
+			emu_clock_us += ops[i].expected_us;
+			if (ops[i].mask && emu_busy_until > emu_clock_us)
+				emu_clock_us = emu_busy_until;
+		}
+#endif
+		if (!ops[i].mask)
+			continue;
+		ret = dummy_spi_send_command(flash, JEDEC_RDSR_OUTSIZE, JEDEC_RDSR_INSIZE, &rdsr, &status);
+#if EMULATE_SPI_CHIP
+		emu_pipelined = false;
+#endif
+		if (!ret && (status & ops[i].mask) != ops[i].value) {
+			msg_perr("%s: status register is 0x%02x, expected 0x%02x in mask 0x%02x\n",
+				 __func__, status, ops[i].value, ops[i].mask);
+			ret = 1;
+		}
+	}
+#if EMULATE_SPI_CHIP
+	emu_pipelined = false;
+#endif
+	return ret;
+}
+
+/* Data lines are not emulated, so this is just a normal command. */
+static int dummy_spi_multi_io_read(struct flashctx *flash, enum spi_io_mode mode, unsigned int writecnt,
+				   unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr)
+{
+	return dummy_spi_send_command(flash, writecnt, readcnt, writearr, readarr);
+}
+
 static int dummy_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
 {
 	return spi_write_chunked(flash, buf, start, len,
 				 spi_write_256_chunksize);
 }
+
+#if EMULATE_SPI_CHIP
+static int dummy_spi_checksum(struct flashctx *flash, unsigned int start, unsigned int len, uint32_t *crc)
+{
+	if (emu_chip == EMULATE_NONE || start + len > emu_chip_size)
+		return 1;
+	emu_charge(JEDEC_READ, 0);
+	*crc = crc32_update(0, flashchip_contents + start, len);
+	return 0;
+}
+#endif
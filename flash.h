@@ -27,6 +27,7 @@
 #include "platform.h"
 
 #include <inttypes.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
@@ -39,6 +40,13 @@
 
 #define ERROR_PTR ((void*)-1)
 
+/* State of code which can run on several threads at once, like probing independent masters. */
+#if CONFIG_THREADS == 1
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
 /* Error codes */
 #define ERROR_OOM	-100
 #define TIMEOUT_ERROR	-101
@@ -123,6 +131,18 @@ enum write_granularity {
 #define FEATURE_WRSR_EITHER	(FEATURE_WRSR_EWSR | FEATURE_WRSR_WREN)
 #define FEATURE_OTP		(1 << 8)
 #define FEATURE_QPI		(1 << 9)
+/* Dual output and dual I/O reads (JEDEC_DOR and JEDEC_DIOR) */
+#define FEATURE_DUAL_READ	(1 << 10)
+/* Quad output and quad I/O reads (JEDEC_QOR and JEDEC_QIOR) work without setting a Quad Enable bit first */
+#define FEATURE_QUAD_READ	(1 << 11)
+/* Chips bigger than 16 MiB: 4-byte address mode can be entered with JEDEC_ENTER_4_BYTE_ADDR_MODE */
+#define FEATURE_4BA_ENTER	(1 << 12)
+/* Chips bigger than 16 MiB: the 4-byte address variants of the commands in .native_4ba exist */
+#define FEATURE_4BA_NATIVE	(1 << 13)
+/* JEDEC_EWSR followed by WRSR writes the status register bits volatile, without a non-volatile write cycle */
+#define FEATURE_WRSR_VOLATILE	(1 << 14)
+/* JEDEC_RDUID returns a 64-bit ID unique to every chip */
+#define FEATURE_UNIQUE_ID	(1 << 15)
 
 enum test_state {
 	OK = 0,
@@ -145,8 +165,23 @@ enum test_state {
 #define TEST_BAD_PREW	(struct tested){ .probe = BAD, .read = BAD, .erase = BAD, .write = BAD }
 
 struct flashctx;
+enum progress_stage {
+	PROGRESS_READ,
+	PROGRESS_WRITE,		/* Erasing and writing */
+	PROGRESS_VERIFY,
+};
 typedef int (erasefunc_t)(struct flashctx *flash, unsigned int addr, unsigned int blocklen);
 
+#define NATIVE_4BA_READ		(1 << 0)	/* 0x13 */
+#define NATIVE_4BA_DOR		(1 << 1)	/* 0x3c */
+#define NATIVE_4BA_DIOR		(1 << 2)	/* 0xbc */
+#define NATIVE_4BA_QOR		(1 << 3)	/* 0x6c */
+#define NATIVE_4BA_QIOR		(1 << 4)	/* 0xec */
+#define NATIVE_4BA_PP		(1 << 5)	/* 0x12 */
+#define NATIVE_4BA_SE		(1 << 6)	/* 0x21 */
+#define NATIVE_4BA_BE_52	(1 << 7)	/* 0x5c */
+#define NATIVE_4BA_BE_D8	(1 << 8)	/* 0xdc */
+
 struct flashchip {
 	const char *vendor;
 	const char *name;
@@ -166,6 +201,8 @@ struct flashchip {
 	/* Chip page size in bytes */
 	unsigned int page_size;
 	int feature_bits;
+	/* The commands of FEATURE_4BA_NATIVE chips which have a 4-byte address variant, NATIVE_4BA_* bits. */
+	unsigned int native_4ba;
 
 	/* Indicate how well flashrom supports different operations of this flash chip. */
 	struct tested {
@@ -197,12 +234,19 @@ struct flashchip {
 		/* a block_erase function should try to erase one block of size
 		 * 'blocklen' at address 'blockaddr' and return 0 on success. */
 		int (*block_erase) (struct flashctx *flash, unsigned int blockaddr, unsigned int blocklen);
+		/* Typical time to erase one block in ms according to the data sheet, 0 if unknown. */
+		unsigned int typical_ms;
 	} block_erasers[NUM_ERASEFUNCTIONS];
 
 	int (*printlock) (struct flashctx *flash);
 	int (*unlock) (struct flashctx *flash);
 	int (*write) (struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 	int (*read) (struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
+	/* Typical time to program one page (or byte/word for chips without page program) in us according to
+	 * the data sheet, 0 if unknown. */
+	unsigned int typical_program_us;
+	/* Typical time of a non-volatile status register write in us, 0 if unknown. */
+	unsigned int typical_wrsr_us;
 	struct voltage {
 		uint16_t min;
 		uint16_t max;
@@ -210,6 +254,12 @@ struct flashchip {
 	enum write_granularity gran;
 };
 
+/* How long a WIP-setting SPI command took the last time (see spi25.c). */
+struct wip_estimate {
+	bool valid;
+	unsigned int us;
+};
+
 struct flashctx {
 	struct flashchip *chip;
 	/* FIXME: The memory mappings should be saved in a more structured way. */
@@ -222,6 +272,16 @@ struct flashctx {
 	uintptr_t physical_registers;
 	chipaddr virtual_registers;
 	struct registered_master *mst;
+	/* The chip was switched to 4-byte addresses (see FEATURE_4BA_ENTER). */
+	bool in_4ba_mode;
+	/* Timing measured with --benchmark, NULL if there is none. */
+	const struct timing_profile *profile;
+	/* By opcode, separate for every chip so they can be probed and written concurrently. */
+	struct wip_estimate wip_estimate[256];
+	/* Called with the progress of reads, erases/writes and verifies (see update_progress()), may be NULL. */
+	void (*progress_callback)(struct flashctx *flash, enum progress_stage stage, unsigned int current,
+				  unsigned int total);
+	void *progress_data;
 };
 
 /* Timing used in probe routines. ZERO is -2 to differentiate between an unset
@@ -237,6 +297,13 @@ struct flashctx {
 extern const struct flashchip flashchips[];
 extern const unsigned int flashchips_size;
 
+/* chipdb.c */
+const struct flashchip *find_chip_by_name(const char *name, unsigned int from);
+void probe_report_ids(const struct flashctx *flash, uint32_t id1, uint32_t id2);
+void probe_forget_ids(void);
+void probe_prepare(void);
+bool probe_ruled_out(const struct registered_master *mst, const struct flashchip *chip);
+
 void chip_writeb(const struct flashctx *flash, uint8_t val, chipaddr addr);
 void chip_writew(const struct flashctx *flash, uint16_t val, chipaddr addr);
 void chip_writel(const struct flashctx *flash, uint32_t val, chipaddr addr);
@@ -245,6 +312,91 @@ uint8_t chip_readb(const struct flashctx *flash, const chipaddr addr);
 uint16_t chip_readw(const struct flashctx *flash, const chipaddr addr);
 uint32_t chip_readl(const struct flashctx *flash, const chipaddr addr);
 void chip_readn(const struct flashctx *flash, uint8_t *buf, const chipaddr addr, size_t len);
+int chip_wait_toggle(const struct flashctx *flash, chipaddr addr, unsigned int delay, uint8_t *val);
+
+/* bufcmp.c */
+unsigned int buf_find_nonblank(const uint8_t *buf, unsigned int len);
+unsigned int buf_find_difference(const uint8_t *a, const uint8_t *b, unsigned int len);
+unsigned int buf_find_unprogrammable_bits(const uint8_t *have, const uint8_t *want, unsigned int len);
+unsigned int buf_find_unprogrammable_bytes(const uint8_t *have, const uint8_t *want, unsigned int len);
+
+/* compression.c */
+enum image_compression {
+	IMAGE_RAW = 0,
+	IMAGE_ZSTD,
+	IMAGE_LZ4,
+	IMAGE_XZ,
+};
+struct image_codec;
+enum image_compression image_compression_from_magic(const uint8_t *buf, size_t len);
+enum image_compression image_compression_from_name(const char *filename);
+int decompress_image(FILE *in, const char *filename, enum image_compression type, const uint8_t *head,
+		     size_t headlen, uint8_t *buf, unsigned long size, bool partial);
+struct image_codec *image_compressor_start(enum image_compression type, FILE *out, const char *filename);
+int image_compressor_write(struct image_codec *c, const uint8_t *buf, size_t len);
+int image_compressor_finish(struct image_codec *c, int ret);
+
+/* pipeline.c */
+typedef int (*chunk_consumer_t)(void *ctx, const uint8_t *buf, unsigned int start, unsigned int len);
+int read_flash_pipelined(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len,
+			 chunk_consumer_t consume, void *ctx);
+int read_flash_streamed(struct flashctx *flash, unsigned int start, unsigned int len,
+			chunk_consumer_t consume, void *ctx);
+
+/* stats.c */
+enum stats_phase {
+	STATS_PHASE_OTHER = 0,
+	STATS_PHASE_PROBE,
+	STATS_PHASE_READ,
+	STATS_PHASE_ERASE,
+	STATS_PHASE_WRITE,
+	STATS_PHASE_VERIFY,
+	NUM_STATS_PHASES
+};
+struct op_stats {
+	uint64_t wall_us;
+	uint64_t transactions;		/* SPI commands or parallel bus cycles */
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	uint64_t rdsr_polls;
+	uint64_t delays;		/* calls of programmer_delay() */
+	uint64_t delay_us;		/* time actually spent in programmer_delay() */
+	uint64_t delay_requested_us;
+};
+extern bool stats_enabled;
+extern bool stats_histograms;
+/* Latency histogram key of spi_queue_flush() calls, the others are keyed by SPI opcode. */
+#define STATS_OPCODE_QUEUE	0x100
+enum stats_phase stats_set_phase(enum stats_phase phase);
+void stats_reset(void);
+unsigned int stats_enter(void);
+void stats_leave(unsigned int prev_depth, unsigned int transactions, unsigned long out, unsigned long in,
+		 unsigned int rdsr_polls);
+void stats_delay(void (*delay)(unsigned int usecs), unsigned int usecs);
+uint64_t stats_latency_begin(void);
+void stats_latency_end(uint64_t start, unsigned int master, unsigned int opcode);
+void stats_get(enum stats_phase phase, struct op_stats *s);
+void stats_capture(struct op_stats *s);
+void stats_add(const struct op_stats *s);
+void stats_print(void);
+void stats_print_json(FILE *f);
+
+/* spi_trace.c */
+enum spi_trace_call {
+	SPI_TRACE_COMMAND,
+	SPI_TRACE_MULTICOMMAND,
+	SPI_TRACE_MULTI_IO,
+	SPI_TRACE_QUEUE,
+};
+struct spi_command;
+struct spi_queued_op;
+extern bool spi_trace_enabled;
+int spi_trace_start(const char *filename);
+int spi_trace_stop(void);
+uint64_t spi_trace_begin(void);
+void spi_trace_end(uint64_t start, enum spi_trace_call call, unsigned int mode, const struct spi_command *cmds,
+		   const struct spi_queued_op *ops, unsigned int count, int ret);
+int spi_trace_replay(struct flashctx *flash, const char *filename);
 
 /* print.c */
 int print_supported(void);
@@ -256,7 +408,28 @@ int bitcount(unsigned long a);
 int max(int a, int b);
 int min(int a, int b);
 char *strcat_realloc(char *dest, const char *src);
+char *flashbuses_to_text(enum chipbustype bustype);
 void tolower_string(char *str);
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, unsigned int len);
+/* A sorted list of non-overlapping, non-adjacent address ranges. */
+struct range_list {
+	unsigned int count;
+	unsigned int capacity;
+	struct range {
+		unsigned int start;
+		unsigned int len;
+	} *ranges;
+};
+int range_list_add(struct range_list *list, unsigned int start, unsigned int len);
+int range_list_remove(struct range_list *list, unsigned int start, unsigned int len);
+bool range_list_contains(const struct range_list *list, unsigned int start, unsigned int len);
+bool range_list_overlaps(const struct range_list *list, unsigned int start, unsigned int len);
+void range_list_free(struct range_list *list);
+FILE *open_cache_file(const char *name, const char *mode);
+bool cache_file_trusted(FILE *f);
+FILE *create_cache_file(const char *name);
+int commit_cache_file(FILE *f, const char *name, bool ok);
+void remove_cache_file(const char *name);
 #ifdef __MINGW32__
 char* strtok_r(char *str, const char *delim, char **nextp);
 #endif
@@ -264,6 +437,39 @@ char* strtok_r(char *str, const char *delim, char **nextp);
 size_t strnlen(const char *str, size_t n);
 #endif
 
+/* journal.c */
+extern const char *journal_path;
+int journal_start(struct flashctx *flash, const uint8_t *image, struct range_list *done);
+void journal_block(struct flashctx *flash, unsigned int start, unsigned int len, const uint8_t *contents,
+		   bool written);
+void journal_erasing(unsigned int start, unsigned int len);
+void journal_forget(void);
+void journal_finish(bool success);
+
+/* content_cache.c */
+extern bool content_cache;
+int content_cache_load(struct flashctx *flash, uint8_t *contents);
+void content_cache_store(struct flashctx *flash, const uint8_t *contents);
+void content_cache_invalidate(struct flashctx *flash);
+
+/* benchmark.c */
+#define PROFILE_MAX_CLOCKS	16
+/* What --benchmark measured for the programmer and chip, fields are 0 if they weren't measured. */
+struct timing_profile {
+	unsigned int rdsr_ns;				/* Round trip of a status register read */
+	unsigned int read_bps;				/* Reading with the normal read function */
+	unsigned int erase_len[NUM_ERASEFUNCTIONS];	/* Size of the block erased with each eraser */
+	unsigned int erase_us[NUM_ERASEFUNCTIONS];
+	unsigned int program_ns;			/* Per byte, including the transfer */
+	unsigned int clocks;				/* Read rates at the SPI clocks that worked */
+	struct {
+		unsigned int khz;
+		unsigned int read_bps;
+	} clock[PROFILE_MAX_CLOCKS];
+};
+const struct timing_profile *timing_profile_load(struct flashctx *flash);
+int benchmark_flash(struct flashctx *flash, int force);
+
 /* flashrom.c */
 extern const char flashrom_version[];
 extern const char *chip_to_probe;
@@ -272,17 +478,42 @@ void unmap_flash(struct flashctx *flash);
 int read_memmapped(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
 int erase_flash(struct flashctx *flash);
 int probe_flash(struct registered_master *mst, int startchip, struct flashctx *fill_flash, int force);
+int probe_masters(struct flashctx *flashes, int max);
 int read_flash_to_file(struct flashctx *flash, const char *filename);
 char *extract_param(const char *const *haystack, const char *needle, const char *delim);
 int verify_range(struct flashctx *flash, const uint8_t *cmpbuf, unsigned int start, unsigned int len);
+int check_erased_range(struct flashctx *flash, unsigned int start, unsigned int len);
+int find_unerased_ranges(struct flashctx *flash, unsigned int start, unsigned int len,
+			 struct range_list *failed);
 int need_erase(const uint8_t *have, const uint8_t *want, unsigned int len, enum write_granularity gran);
+unsigned int get_next_write(const uint8_t *have, const uint8_t *want, unsigned int len, unsigned int *first_start,
+			    enum write_granularity gran);
+int compare_range(const uint8_t *wantbuf, const uint8_t *havebuf, unsigned int start, unsigned int len);
+int generate_testpattern(uint8_t *buf, uint32_t size, int variant);
 void print_version(void);
 void print_buildinfo(void);
 void print_banner(void);
 void list_programmers_linebreak(int startcol, int cols, int paren);
 int selfcheck(void);
 int doit(struct flashctx *flash, int force, const char *filename, int read_it, int write_it, int erase_it, int verify_it);
+int doit_buffer(struct flashctx *flash, int force, uint8_t *buf, int read_it, int write_it, int erase_it,
+		int verify_it);
+int prepare_operation(struct flashctx *flash, int force, int read_it, int write_it, int erase_it, int verify_it);
+int check_block_eraser(const struct flashctx *flash, int k, int log);
+void update_progress(struct flashctx *flash, enum progress_stage stage, unsigned int current, unsigned int total);
+enum verify_mode {
+	VERIFY_FULL = 0,	/* Compare everything that was read before writing. */
+	VERIFY_WRITTEN,		/* Compare only erased/written ranges plus a guard band. */
+	VERIFY_SAMPLE,		/* Compare changed pages and random pages of every touched eraseblock. */
+	VERIFY_INLINE,		/* Compare pages while writing, afterwards only what the write didn't. */
+};
+extern enum verify_mode verify_mode;
+extern unsigned int verify_guard;
+extern unsigned int verify_samples;
+extern unsigned int verified_inline;
+extern bool erase_skip_blank;
 int read_buf_from_file(unsigned char *buf, unsigned long size, const char *filename);
+int read_buf_head_from_file(unsigned char *buf, unsigned long size, const char *filename);
 int write_buf_to_file(const unsigned char *buf, unsigned long size, const char *filename);
 
 /* Something happened that shouldn't happen, but we can go on. */
@@ -297,14 +528,35 @@ int write_buf_to_file(const unsigned char *buf, unsigned long size, const char *
  * Note: If this warning is triggered, check first for runaway registrations.
  */
 #define ERROR_FLASHROM_LIMIT -201
+/* A write read back wrong and can only be done again after erasing the block. */
+#define ERROR_NEEDS_ERASE -202
 
 /* cli_common.c */
-char *flashbuses_to_text(enum chipbustype bustype);
 void print_chip_support_status(const struct flashchip *chip);
 
+/* cli_daemon.c */
+struct daemon_request {
+	const char *op;		/* "probe", "read", "write", "verify", "erase" or "shutdown" */
+	const char *filename;
+	const char *layoutfile;
+	bool ifd;
+	bool force;
+	bool noverify;
+	char *const *images;	/* -i arguments */
+	unsigned int num_images;
+};
+int daemon_serve(struct flashctx *flash, const char *path);
+int daemon_submit(const char *path, const struct daemon_request *req);
+
 /* cli_output.c */
 extern int verbose_screen;
 extern int verbose_logfile;
+void update_print_level(void);
+void reserve_stdout_for_data(void);
+void set_output_prefix(const char *prefix);
+int progress_setup(const char *format);
+int progress_finish(void);
+void progress_attach(struct flashctx *flash, int target);
 #ifndef STANDALONE
 int open_logfile(const char * const filename);
 int close_logfile(void);
@@ -325,31 +577,55 @@ __attribute__((format(gnu_printf, 2, 3)));
 #else
 __attribute__((format(printf, 2, 3)));
 #endif
-#define msg_gerr(...)	print(MSG_ERROR, __VA_ARGS__)	/* general errors */
-#define msg_perr(...)	print(MSG_ERROR, __VA_ARGS__)	/* programmer errors */
-#define msg_cerr(...)	print(MSG_ERROR, __VA_ARGS__)	/* chip errors */
-#define msg_gwarn(...)	print(MSG_WARN, __VA_ARGS__)	/* general warnings */
-#define msg_pwarn(...)	print(MSG_WARN, __VA_ARGS__)	/* programmer warnings */
-#define msg_cwarn(...)	print(MSG_WARN, __VA_ARGS__)	/* chip warnings */
-#define msg_ginfo(...)	print(MSG_INFO, __VA_ARGS__)	/* general info */
-#define msg_pinfo(...)	print(MSG_INFO, __VA_ARGS__)	/* programmer info */
-#define msg_cinfo(...)	print(MSG_INFO, __VA_ARGS__)	/* chip info */
-#define msg_gdbg(...)	print(MSG_DEBUG, __VA_ARGS__)	/* general debug */
-#define msg_pdbg(...)	print(MSG_DEBUG, __VA_ARGS__)	/* programmer debug */
-#define msg_cdbg(...)	print(MSG_DEBUG, __VA_ARGS__)	/* chip debug */
-#define msg_gdbg2(...)	print(MSG_DEBUG2, __VA_ARGS__)	/* general debug2 */
-#define msg_pdbg2(...)	print(MSG_DEBUG2, __VA_ARGS__)	/* programmer debug2 */
-#define msg_cdbg2(...)	print(MSG_DEBUG2, __VA_ARGS__)	/* chip debug2 */
-#define msg_gspew(...)	print(MSG_SPEW, __VA_ARGS__)	/* general debug spew  */
-#define msg_pspew(...)	print(MSG_SPEW, __VA_ARGS__)	/* programmer debug spew  */
-#define msg_cspew(...)	print(MSG_SPEW, __VA_ARGS__)	/* chip debug spew  */
+/* To be called first by print(): keeps the message for later and returns its length if this thread's
+ * messages are being held back (see probe_masters()), otherwise returns -1. */
+int print_captured(enum msglevel level, const char *fmt, va_list ap);
+/* Messages above this level are compiled out. */
+#ifndef CONFIG_MAX_MSG_LEVEL
+#define CONFIG_MAX_MSG_LEVEL MSG_SPEW
+#endif
+/* The highest level print() currently outputs anywhere (kept up to date by its implementation). */
+extern int print_level_max;
+/* Check the level before evaluating the arguments, so a suppressed message costs one comparison. */
+#define msg_enabled(level) ((level) <= CONFIG_MAX_MSG_LEVEL && (level) <= print_level_max)
+#define msg_print(level, ...) ((void)(msg_enabled(level) && print(level, __VA_ARGS__)))
+#define msg_gerr(...)	msg_print(MSG_ERROR, __VA_ARGS__)	/* general errors */
+#define msg_perr(...)	msg_print(MSG_ERROR, __VA_ARGS__)	/* programmer errors */
+#define msg_cerr(...)	msg_print(MSG_ERROR, __VA_ARGS__)	/* chip errors */
+#define msg_gwarn(...)	msg_print(MSG_WARN, __VA_ARGS__)	/* general warnings */
+#define msg_pwarn(...)	msg_print(MSG_WARN, __VA_ARGS__)	/* programmer warnings */
+#define msg_cwarn(...)	msg_print(MSG_WARN, __VA_ARGS__)	/* chip warnings */
+#define msg_ginfo(...)	msg_print(MSG_INFO, __VA_ARGS__)	/* general info */
+#define msg_pinfo(...)	msg_print(MSG_INFO, __VA_ARGS__)	/* programmer info */
+#define msg_cinfo(...)	msg_print(MSG_INFO, __VA_ARGS__)	/* chip info */
+#define msg_gdbg(...)	msg_print(MSG_DEBUG, __VA_ARGS__)	/* general debug */
+#define msg_pdbg(...)	msg_print(MSG_DEBUG, __VA_ARGS__)	/* programmer debug */
+#define msg_cdbg(...)	msg_print(MSG_DEBUG, __VA_ARGS__)	/* chip debug */
+#define msg_gdbg2(...)	msg_print(MSG_DEBUG2, __VA_ARGS__)	/* general debug2 */
+#define msg_pdbg2(...)	msg_print(MSG_DEBUG2, __VA_ARGS__)	/* programmer debug2 */
+#define msg_cdbg2(...)	msg_print(MSG_DEBUG2, __VA_ARGS__)	/* chip debug2 */
+#define msg_gspew(...)	msg_print(MSG_SPEW, __VA_ARGS__)	/* general debug spew  */
+#define msg_pspew(...)	msg_print(MSG_SPEW, __VA_ARGS__)	/* programmer debug spew  */
+#define msg_cspew(...)	msg_print(MSG_SPEW, __VA_ARGS__)	/* chip debug spew  */
+/* Print @len bytes as " 0x.." each, a line's worth at a time instead of one print() per byte. */
+void print_hex(enum msglevel level, const uint8_t *buf, unsigned int len);
+#define msg_hexdump(level, buf, len)			\
+	do {						\
+		if (msg_enabled(level))			\
+			print_hex(level, buf, len);	\
+	} while (0)
 
 /* layout.c */
 int register_include_arg(char *name);
 int process_include_args(void);
 int read_romlayout(const char *name);
+int read_romlayout_ifd(const char *name);
 int normalize_romentries(const struct flashctx *flash);
-int build_new_image(struct flashctx *flash, bool oldcontents_valid, uint8_t *oldcontents, uint8_t *newcontents);
+int build_new_image(struct flashctx *flash, bool oldcontents_valid, uint8_t *oldcontents, uint8_t *newcontents,
+		    const struct range_list *touched);
+bool layout_has_included_regions(void);
+bool included_regions_overlap(unsigned int start, unsigned int len);
+int get_included_ranges(struct range_list *ranges);
 void layout_cleanup(void);
 
 /* spi.c */
@@ -358,10 +634,25 @@ struct spi_command {
 	unsigned int readcnt;
 	const unsigned char *writearr;
 	unsigned char *readarr;
+	/* Optional: @datacnt bytes of @data are written right after @writearr, so e.g. the data of a page
+	 * program doesn't have to be copied behind its opcode and address first. */
+	unsigned int datacnt;
+	const unsigned char *data;
 };
 int spi_send_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr);
 int spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds);
+int spi_queue_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
+		      const unsigned char *writearr, unsigned char *readarr);
+int spi_queue_write(struct flashctx *flash, unsigned int writecnt, const unsigned char *writearr,
+		    unsigned int datacnt, const unsigned char *data);
+int spi_queue_poll(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int expected_us,
+		   unsigned int max_step_us);
+int spi_queue_delay(struct flashctx *flash, unsigned int usecs);
+int spi_queue_flush(struct flashctx *flash);
 uint32_t spi_get_valid_read_addr(struct flashctx *flash);
+void probe_cache_start(void);
+void probe_cache_stop(void);
+void probe_cache_invalidate(void);
 
 enum chipbustype get_buses_supported(void);
 #endif				/* !__FLASH_H__ */
@@ -33,19 +33,33 @@
 #include <errno.h>
 #include <ctype.h>
 #include <getopt.h>
+#if CONFIG_THREADS == 1
+#include <pthread.h>
+#endif
 #if HAVE_UTSNAME == 1
 #include <sys/utsname.h>
 #endif
+#ifdef _WIN32
+#include <io.h>
+#endif
+#if !IS_WINDOWS && !defined(__DJGPP__) && !defined(__LIBPAYLOAD__)
+#include <sys/mman.h>
+#define HAVE_MMAP 1
+#endif
 #include "flash.h"
 #include "flashchips.h"
 #include "programmer.h"
 #include "hwaccess.h"
+#include "chipdrivers.h"
+#include "probes.h"
 
 const char flashrom_version[] = FLASHROM_VERSION;
 const char *chip_to_probe = NULL;
 
 static enum programmer programmer = PROGRAMMER_INVALID;
 static const char *programmer_param = NULL;
+/* All of the parameters passed to programmer_init(), programmer_param is what the driver didn't use. */
+static char *programmer_setup = NULL;
 
 /*
  * Programmers supporting multiple buses can have differing size limits on
@@ -81,7 +95,7 @@ const struct programmer_entry programmer_table[] = {
 		.init			= dummy_init,
 		.map_flash_region	= dummy_map,
 		.unmap_flash_region	= dummy_unmap,
-		.delay			= internal_delay,
+		.delay			= dummy_delay,
 	},
 #endif
 
@@ -397,7 +411,46 @@ static int may_register_shutdown = 0;
 /* Did we change something or was every erase/write skipped (if any)? */
 static bool all_skipped = true;
 
-static int check_block_eraser(const struct flashctx *flash, int k, int log);
+/* If set, only these parts of the chip contents were read. Anything else is neither compared nor written,
+ * unless an eraseblock straddles a known and an unknown part. Then the unknown part is read on demand. */
+static struct range_list *known_ranges = NULL;
+
+/* Everything erased or written by erase_and_write_flash() since the last reset_dirty_ranges(). */
+static struct range_list dirty_ranges = { 0 };
+/* Cleared if recording a dirty range failed, i.e. dirty_ranges can not be trusted. */
+static bool dirty_ranges_complete = true;
+/* The part of dirty_ranges touched since the contents erase_and_write_flash() keeps track of were last known
+ * to match the chip. After a failure only these have to be read back. */
+static struct range_list stale_ranges = { 0 };
+
+/* CRC-32 of the contents of every range in dirty_ranges from before it was first touched. This is all
+ * that is left of the old contents after a failed write, since erase_and_write_flash() works in place. */
+struct original_crc {
+	unsigned int start;
+	unsigned int len;
+	uint32_t crc;
+};
+static struct original_crc *original_crcs = NULL;
+static unsigned int original_crcs_count = 0, original_crcs_capacity = 0;
+static bool original_crcs_complete = true;
+
+/* What to verify after a write, see enum verify_mode. */
+enum verify_mode verify_mode = VERIFY_FULL;
+/* Number of bytes around each dirty range which are verified as well with VERIFY_WRITTEN. */
+unsigned int verify_guard = 0;
+/* Number of pages of every erased or written eraseblock which are verified with VERIFY_SAMPLE. */
+unsigned int verify_samples = 1;
+/* The pages to verify with VERIFY_SAMPLE, see sample_block(). */
+static struct range_list sample_ranges = { 0 };
+static bool sample_ranges_complete = true;
+static unsigned int sampled_blocks = 0;
+/* Bytes the chip's write function read back and compared itself since it was called, with VERIFY_INLINE. */
+unsigned int verified_inline = 0;
+/* The writes with VERIFY_INLINE which were not compared that way, they are left for verify_after_write(). */
+static struct range_list unverified_ranges = { 0 };
+static bool unverified_ranges_complete = true;
+/* Read the chip before erasing it and leave blank blocks alone (--skip-blank). */
+bool erase_skip_blank = false;
 
 int shutdown_free(void *data)
 {
@@ -457,6 +510,8 @@ int programmer_init(enum programmer prog, const char *param)
 	programmer_may_write = 1;
 
 	programmer_param = param;
+	free(programmer_setup);
+	programmer_setup = strdup(param ? param : "");
 	msg_pdbg("Initializing %s programmer\n", programmer_table[programmer].name);
 	ret = programmer_table[programmer].init();
 	if (programmer_param && strlen(programmer_param)) {
@@ -478,6 +533,18 @@ int programmer_init(enum programmer prog, const char *param)
 	return ret;
 }
 
+/* The name of the programmer last passed to programmer_init(). */
+const char *programmer_name(void)
+{
+	return programmer_table[programmer].name;
+}
+
+/* The parameters last passed to programmer_init(), e.g. to tell setups of the same programmer apart. */
+const char *programmer_params(void)
+{
+	return programmer_setup ? programmer_setup : "";
+}
+
 /** Calls registered shutdown functions and resets internal programmer-related variables.
  * Calling it is safe even without previous initialization, but further interactions with programmer support
  * require a call to programmer_init() (afterwards).
@@ -495,6 +562,8 @@ int programmer_shutdown(void)
 	}
 
 	programmer_param = NULL;
+	free(programmer_setup);
+	programmer_setup = NULL;
 	registered_master_count = 0;
 
 	return ret;
@@ -516,49 +585,124 @@ void programmer_unmap_flash_region(void *virt_addr, size_t len)
 
 void chip_writeb(const struct flashctx *flash, uint8_t val, chipaddr addr)
 {
+	unsigned int depth;
+
+	FLASHROM_PROBE2(chip_write_start, addr, 1);
+	depth = stats_enter();
 	flash->mst->par.chip_writeb(flash, val, addr);
+	stats_leave(depth, 1, 1, 0, 0);
+	FLASHROM_PROBE2(chip_write_done, addr, 1);
 }
 
 void chip_writew(const struct flashctx *flash, uint16_t val, chipaddr addr)
 {
+	unsigned int depth;
+
+	FLASHROM_PROBE2(chip_write_start, addr, 2);
+	depth = stats_enter();
 	flash->mst->par.chip_writew(flash, val, addr);
+	stats_leave(depth, 1, 2, 0, 0);
+	FLASHROM_PROBE2(chip_write_done, addr, 2);
 }
 
 void chip_writel(const struct flashctx *flash, uint32_t val, chipaddr addr)
 {
+	unsigned int depth;
+
+	FLASHROM_PROBE2(chip_write_start, addr, 4);
+	depth = stats_enter();
 	flash->mst->par.chip_writel(flash, val, addr);
+	stats_leave(depth, 1, 4, 0, 0);
+	FLASHROM_PROBE2(chip_write_done, addr, 4);
 }
 
 void chip_writen(const struct flashctx *flash, const uint8_t *buf, chipaddr addr, size_t len)
 {
+	unsigned int depth;
+
+	FLASHROM_PROBE2(chip_write_start, addr, len);
+	depth = stats_enter();
 	flash->mst->par.chip_writen(flash, buf, addr, len);
+	stats_leave(depth, 1, len, 0, 0);
+	FLASHROM_PROBE2(chip_write_done, addr, len);
 }
 
 uint8_t chip_readb(const struct flashctx *flash, const chipaddr addr)
 {
-	return flash->mst->par.chip_readb(flash, addr);
+	unsigned int depth;
+	uint8_t val;
+
+	FLASHROM_PROBE2(chip_read_start, addr, 1);
+	depth = stats_enter();
+	val = flash->mst->par.chip_readb(flash, addr);
+	stats_leave(depth, 1, 0, 1, 0);
+	FLASHROM_PROBE2(chip_read_done, addr, 1);
+	return val;
 }
 
 uint16_t chip_readw(const struct flashctx *flash, const chipaddr addr)
 {
-	return flash->mst->par.chip_readw(flash, addr);
+	unsigned int depth;
+	uint16_t val;
+
+	FLASHROM_PROBE2(chip_read_start, addr, 2);
+	depth = stats_enter();
+	val = flash->mst->par.chip_readw(flash, addr);
+	stats_leave(depth, 1, 0, 2, 0);
+	FLASHROM_PROBE2(chip_read_done, addr, 2);
+	return val;
 }
 
 uint32_t chip_readl(const struct flashctx *flash, const chipaddr addr)
 {
-	return flash->mst->par.chip_readl(flash, addr);
+	unsigned int depth;
+	uint32_t val;
+
+	FLASHROM_PROBE2(chip_read_start, addr, 4);
+	depth = stats_enter();
+	val = flash->mst->par.chip_readl(flash, addr);
+	stats_leave(depth, 1, 0, 4, 0);
+	FLASHROM_PROBE2(chip_read_done, addr, 4);
+	return val;
 }
 
 void chip_readn(const struct flashctx *flash, uint8_t *buf, chipaddr addr,
 		size_t len)
 {
+	unsigned int depth;
+
+	FLASHROM_PROBE2(chip_read_start, addr, len);
+	depth = stats_enter();
 	flash->mst->par.chip_readn(flash, buf, addr, len);
+	stats_leave(depth, 1, 0, len, 0);
+	FLASHROM_PROBE2(chip_read_done, addr, len);
+}
+
+/*
+ * Let the master read @addr (waiting @delay us between the reads) until bit 6 stops toggling, without a
+ * round trip per read. The last value read is stored in @val. Returns 0 on success, 1 if the master can't do
+ * this or gave up; the caller has to poll on its own then.
+ */
+int chip_wait_toggle(const struct flashctx *flash, chipaddr addr, unsigned int delay, uint8_t *val)
+{
+	unsigned int depth;
+	int ret;
+
+	if (!flash->mst->par.wait_toggle)
+		return 1;
+	depth = stats_enter();
+	ret = flash->mst->par.wait_toggle(flash, addr, delay, val);
+	stats_leave(depth, 1, 0, 1, 0);
+	return ret;
 }
 
 void programmer_delay(unsigned int usecs)
 {
-	if (usecs > 0)
-		programmer_table[programmer].delay(usecs);
+	if (usecs > 0) {
+		FLASHROM_PROBE1(delay_start, usecs);
+		stats_delay(programmer_table[programmer].delay, usecs);
+		FLASHROM_PROBE1(delay_done, usecs);
+	}
 }
 
 int read_memmapped(struct flashctx *flash, uint8_t *buf, unsigned int start,
@@ -648,23 +792,122 @@ static unsigned int count_usable_erasers(const struct flashctx *flash)
 	return usable_erasefunctions;
 }
 
-static int compare_range(const uint8_t *wantbuf, const uint8_t *havebuf, unsigned int start, unsigned int len)
+/* Returns the number of bytes which differ and sets @first to the offset of the first one (if any). */
+static unsigned int count_differences(const uint8_t *wantbuf, const uint8_t *havebuf, unsigned int len,
+				      unsigned int *first)
 {
-	int ret = 0, failcount = 0;
-	unsigned int i;
-	for (i = 0; i < len; i++) {
-		if (wantbuf[i] != havebuf[i]) {
-			/* Only print the first failure. */
-			if (!failcount++)
-				msg_cerr("FAILED at 0x%08x! Expected=0x%02x, Found=0x%02x,",
-					 start + i, wantbuf[i], havebuf[i]);
+	unsigned int i, failcount = 0;
+
+	for (i = buf_find_difference(wantbuf, havebuf, len); i < len;
+	     i += 1 + buf_find_difference(wantbuf + i + 1, havebuf + i + 1, len - i - 1)) {
+		if (!failcount++)
+			*first = i;
+	}
+	return failcount;
+}
+
+static int report_differences(const uint8_t *wantbuf, uint8_t found, unsigned int start,
+			      unsigned int len, unsigned int failcount, unsigned int first)
+{
+	if (!failcount)
+		return 0;
+	/* Only print the first failure. */
+	msg_cerr("FAILED at 0x%08x! Expected=0x%02x, Found=0x%02x,",
+		 start + first, wantbuf[first], found);
+	msg_cerr(" failed byte count from 0x%08x-0x%08x: 0x%x\n",
+		 start, start + len - 1, failcount);
+	return -1;
+}
+
+int compare_range(const uint8_t *wantbuf, const uint8_t *havebuf, unsigned int start, unsigned int len)
+{
+	unsigned int first = 0;
+	unsigned int failcount = count_differences(wantbuf, havebuf, len, &first);
+
+	return report_differences(wantbuf, havebuf[first], start, len, failcount, first);
+}
+
+/* Upper limit for the buffer used by the streaming blank check. */
+#define BLANK_CHECK_CHUNK	(64 * 1024)
+
+/* Returns a read length which is a multiple of what the master can read in
+ * one transaction, so reading in chunks doesn't add extra transactions.
+ */
+static unsigned int get_blank_check_chunk(const struct flashctx *flash, unsigned int len)
+{
+	unsigned int native = 0, chunk = BLANK_CHECK_CHUNK;
+
+	if (flash->mst->buses_supported & BUS_SPI)
+		native = flash->mst->spi.max_data_read;
+	else if (flash->mst->buses_supported & BUS_PROG)
+		native = flash->mst->opaque.max_data_read;
+	if (native > 0 && native < chunk)
+		chunk -= chunk % native;
+	return min(chunk, len);
+}
+
+/*
+ * Read the range in small chunks and check that it is erased. If @failed is
+ * NULL, stop at the first byte which is not 0xff. Otherwise add every
+ * non-erased run to @failed and continue to the end.
+ *
+ * @start	offset to the base address of the flash chip
+ * @return	0 if the whole range is erased, -1 otherwise or on error
+ */
+static int blank_check_range(struct flashctx *flash, unsigned int start, unsigned int len,
+			     struct range_list *failed)
+{
+	unsigned int chunk, pos, n, i, end;
+	uint8_t *readbuf;
+	int ret = 0;
+
+	if (!len)
+		return -1;
+	if (!flash->chip->read) {
+		msg_cerr("ERROR: flashrom has no read function for this flash chip.\n");
+		return -1;
+	}
+	if (start + len > flash->chip->total_size * 1024) {
+		msg_gerr("Error: %s called with start 0x%x + len 0x%x >"
+			" total_size 0x%x\n", __func__, start, len,
+			flash->chip->total_size * 1024);
+		return -1;
+	}
+	chunk = get_blank_check_chunk(flash, len);
+	readbuf = malloc(chunk);
+	if (!readbuf) {
+		msg_gerr("Could not allocate memory!\n");
+		return -1;
+	}
+	for (pos = 0; pos < len; pos += n) {
+		n = min(chunk, len - pos);
+		if (flash->chip->read(flash, readbuf, start + pos, n)) {
+			msg_gerr("Verification impossible because read failed "
+				 "at 0x%x (len 0x%x)\n", start + pos, n);
+			ret = -1;
+			break;
+		}
+		for (i = buf_find_nonblank(readbuf, n); i < n;
+		     i = end + buf_find_nonblank(readbuf + end, n - end)) {
+			if (!failed) {
+				msg_cerr("FAILED at 0x%08x! Expected=0xff, Found=0x%02x\n",
+					 start + pos + i, readbuf[i]);
+				ret = -1;
+				goto out_free;
+			}
+			for (end = i + 1; end < n && readbuf[end] != 0xff; end++)
+				;
+			if (range_list_add(failed, start + pos + i, end - i)) {
+				msg_gerr("Out of memory!\n");
+				ret = -1;
+				goto out_free;
+			}
 		}
 	}
-	if (failcount) {
-		msg_cerr(" failed byte count from 0x%08x-0x%08x: 0x%x\n",
-			 start, start + len - 1, failcount);
+	if (failed && failed->count)
 		ret = -1;
-	}
+out_free:
+	free(readbuf);
 	return ret;
 }
 
@@ -672,16 +915,127 @@ static int compare_range(const uint8_t *wantbuf, const uint8_t *havebuf, unsigne
 int check_erased_range(struct flashctx *flash, unsigned int start,
 		       unsigned int len)
 {
-	int ret;
-	uint8_t *cmpbuf = malloc(len);
+	return blank_check_range(flash, start, len, NULL);
+}
 
-	if (!cmpbuf) {
-		msg_gerr("Could not allocate memory!\n");
-		exit(1);
+/*
+ * Like check_erased_range(), but collect all non-erased ranges in @failed
+ * instead of stopping at the first one.
+ */
+int find_unerased_ranges(struct flashctx *flash, unsigned int start, unsigned int len,
+			 struct range_list *failed)
+{
+	return blank_check_range(flash, start, len, failed);
+}
+
+/* Block size for checksum based verification. Mismatching blocks are read back completely. */
+#define CHECKSUM_VERIFY_BLOCK	(64 * 1024)
+
+/* Returns true if the master can checksum the flash contents on its own. */
+static bool master_has_checksum(const struct flashctx *flash)
+{
+	if (flash->chip->bustype == BUS_SPI && (flash->mst->buses_supported & BUS_SPI))
+		return flash->mst->spi.checksum != NULL;
+	if (flash->chip->bustype == BUS_PROG && (flash->mst->buses_supported & BUS_PROG))
+		return flash->mst->opaque.checksum != NULL;
+	return false;
+}
+
+/* Let the master compute the CRC-32 of a flash range. Returns 0 on success. */
+static int master_checksum(struct flashctx *flash, unsigned int start, unsigned int len, uint32_t *crc)
+{
+	if (!master_has_checksum(flash))
+		return 1;
+	if (flash->chip->bustype == BUS_SPI)
+		return flash->mst->spi.checksum(flash, start, len, crc);
+	return flash->mst->opaque.checksum(flash, start, len, crc);
+}
+
+/* Tell the progress callback of @flash (if any) that @current of @total bytes of the chip were handled. */
+void update_progress(struct flashctx *flash, enum progress_stage stage, unsigned int current, unsigned int total)
+{
+	if (flash->progress_callback)
+		flash->progress_callback(flash, stage, current, total);
+}
+
+/* Chunk size for reads whose progress is reported. */
+#define PROGRESS_READ_CHUNK	(256 * 1024)
+
+/* Read a range of the chip, in chunks if somebody follows the progress. */
+static int read_flash_with_progress(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int pos, n;
+
+	if (!flash->progress_callback)
+		return flash->chip->read(flash, buf, start, len);
+	for (pos = 0; pos < len; pos += n) {
+		n = min(PROGRESS_READ_CHUNK, len - pos);
+		if (flash->chip->read(flash, buf + pos, start + pos, n))
+			return 1;
+		update_progress(flash, PROGRESS_READ, start + pos + n, size);
+	}
+	return 0;
+}
+
+struct compare_ctx {
+	struct flashctx *flash;
+	const uint8_t *wantbuf;
+	unsigned int start;
+	unsigned int failcount;
+	unsigned int first;
+	uint8_t found;		/* Flash contents at first. */
+};
+
+static int compare_chunk(void *arg, const uint8_t *buf, unsigned int start, unsigned int len)
+{
+	struct compare_ctx *c = arg;
+	unsigned int off = start - c->start, first = 0, failcount;
+
+	failcount = count_differences(c->wantbuf + off, buf, len, &first);
+	if (failcount && !c->failcount) {
+		c->first = off + first;
+		c->found = buf[first];
+	}
+	c->failcount += failcount;
+	update_progress(c->flash, PROGRESS_VERIFY, start + len, c->flash->chip->total_size * 1024);
+	return 0;
+}
+
+/* Read the range back and compare it while the next part is being read. */
+static int read_and_compare_range(struct flashctx *flash, const uint8_t *cmpbuf, unsigned int start,
+				  unsigned int len)
+{
+	struct compare_ctx c = { .flash = flash, .wantbuf = cmpbuf, .start = start };
+
+	if (read_flash_streamed(flash, start, len, compare_chunk, &c)) {
+		msg_gerr("Verification impossible because read failed "
+			 "at 0x%x (len 0x%x)\n", start, len);
+		return -1;
+	}
+	return report_differences(cmpbuf, c.found, start, len, c.failcount, c.first);
+}
+
+/*
+ * Compare the checksums of each block calculated by the master with the ones of @cmpbuf and only read
+ * back the blocks which don't match (or which the master failed to checksum).
+ */
+static int verify_range_by_checksum(struct flashctx *flash, const uint8_t *cmpbuf, unsigned int start,
+				    unsigned int len)
+{
+	unsigned int pos, n;
+	uint32_t crc;
+	int ret = 0;
+
+	for (pos = 0; pos < len; pos += n) {
+		n = min(CHECKSUM_VERIFY_BLOCK - (start + pos) % CHECKSUM_VERIFY_BLOCK, len - pos);
+		if (!master_checksum(flash, start + pos, n, &crc) && crc == crc32_update(0, cmpbuf + pos, n))
+			continue;
+		msg_cdbg2("Checksum mismatch at 0x%06x-0x%06x, comparing bytes.\n",
+			  start + pos, start + pos + n - 1);
+		if (read_and_compare_range(flash, cmpbuf + pos, start + pos, n))
+			ret = -1;
 	}
-	memset(cmpbuf, 0xff, len);
-	ret = verify_range(flash, cmpbuf, start, len);
-	free(cmpbuf);
 	return ret;
 }
 
@@ -702,48 +1056,30 @@ int verify_range(struct flashctx *flash, const uint8_t *cmpbuf, unsigned int sta
 		return -1;
 	}
 
-	uint8_t *readbuf = malloc(len);
-	if (!readbuf) {
-		msg_gerr("Could not allocate memory!\n");
-		return -1;
-	}
-	int ret = 0;
-
 	if (start + len > flash->chip->total_size * 1024) {
 		msg_gerr("Error: %s called with start 0x%x + len 0x%x >"
 			" total_size 0x%x\n", __func__, start, len,
 			flash->chip->total_size * 1024);
-		ret = -1;
-		goto out_free;
-	}
-
-	ret = flash->chip->read(flash, readbuf, start, len);
-	if (ret) {
-		msg_gerr("Verification impossible because read failed "
-			 "at 0x%x (len 0x%x)\n", start, len);
-		ret = -1;
-		goto out_free;
+		return -1;
 	}
 
-	ret = compare_range(cmpbuf, readbuf, start, len);
-out_free:
-	free(readbuf);
-	return ret;
+	if (master_has_checksum(flash))
+		return verify_range_by_checksum(flash, cmpbuf, start, len);
+	return read_and_compare_range(flash, cmpbuf, start, len);
 }
 
 /* Helper function for need_erase() that focuses on granularities of gran bytes. */
 static int need_erase_gran_bytes(const uint8_t *have, const uint8_t *want, unsigned int len, unsigned int gran)
 {
-	unsigned int i, j, limit;
+	unsigned int j, limit;
 	for (j = 0; j < len / gran; j++) {
 		limit = min (gran, len - j * gran);
 		/* Are 'have' and 'want' identical? */
 		if (!memcmp(have + j * gran, want + j * gran, limit))
 			continue;
 		/* have needs to be in erased state. */
-		for (i = 0; i < limit; i++)
-			if (have[j * gran + i] != 0xff)
-				return 1;
+		if (buf_find_nonblank(have + j * gran, limit) < limit)
+			return 1;
 	}
 	return 0;
 }
@@ -765,22 +1101,13 @@ static int need_erase_gran_bytes(const uint8_t *have, const uint8_t *want, unsig
 int need_erase(const uint8_t *have, const uint8_t *want, unsigned int len, enum write_granularity gran)
 {
 	int result = 0;
-	unsigned int i;
 
 	switch (gran) {
 	case write_gran_1bit:
-		for (i = 0; i < len; i++)
-			if ((have[i] & want[i]) != want[i]) {
-				result = 1;
-				break;
-			}
+		result = buf_find_unprogrammable_bits(have, want, len) < len;
 		break;
 	case write_gran_1byte:
-		for (i = 0; i < len; i++)
-			if ((have[i] != want[i]) && (have[i] != 0xff)) {
-				result = 1;
-				break;
-			}
+		result = buf_find_unprogrammable_bytes(have, want, len) < len;
 		break;
 	case write_gran_128bytes:
 		result = need_erase_gran_bytes(have, want, len, 128);
@@ -833,13 +1160,11 @@ int need_erase(const uint8_t *have, const uint8_t *want, unsigned int len, enum
  * @return	length of the first contiguous area which needs to be written
  *		0 if no write is needed
  *
- * FIXME: This function needs a parameter which tells it about coalescing
- * in relation to the max write length of the programmer and the max write
- * length of the chip.
+ * Coalescing of neighbouring writes with respect to the write limits of the
+ * programmer and the chip is done by coalesce_next_write().
  */
-static unsigned int get_next_write(const uint8_t *have, const uint8_t *want, unsigned int len,
-			  unsigned int *first_start,
-			  enum write_granularity gran)
+unsigned int get_next_write(const uint8_t *have, const uint8_t *want, unsigned int len, unsigned int *first_start,
+			    enum write_granularity gran)
 {
 	int need_write = 0;
 	unsigned int rel_start = 0, first_len = 0;
@@ -904,6 +1229,147 @@ static unsigned int get_next_write(const uint8_t *have, const uint8_t *want, uns
 	return first_len;
 }
 
+/* Number of program transactions needed for len bytes within one page. */
+static unsigned int count_write_chunks(unsigned int len, unsigned int chunk_size)
+{
+	return (len + chunk_size - 1) / chunk_size;
+}
+
+/* Number of pages touched by @len bytes at chip address @addr. */
+static unsigned int count_pages(unsigned int addr, unsigned int len, unsigned int page_size)
+{
+	return (addr + len - 1) / page_size - addr / page_size + 1;
+}
+
+/**
+ * Find the page and transaction size used by the chip write function, so
+ * neighbouring writes can be coalesced. Returns 0 if writes should not be
+ * coalesced, e.g. because the chip is programmed byte by byte and rewriting
+ * unchanged bytes would only cost time. @bulk_size is set to the longest
+ * write the master programs page by page on its own (see max_bulk_write in
+ * struct spi_master), 0 if it has to be split at pages.
+ */
+static int get_write_coalescing(const struct flashctx *flash, unsigned int *page_size,
+				unsigned int *chunk_size, unsigned int *bulk_size)
+{
+	if (!flash->chip->page_size)
+		return 0;
+	*bulk_size = 0;
+	/* Opaque masters split writes like spi_chip_write_256(): at pages and their max_data_write. */
+	if (flash->chip->write == spi_chip_write_256 && (flash->mst->buses_supported & BUS_SPI)) {
+		*chunk_size = flash->mst->spi.max_data_write;
+		if (flash->mst->spi.max_bulk_write > flash->chip->page_size)
+			*bulk_size = flash->mst->spi.max_bulk_write;
+	} else if (flash->chip->write == write_opaque && (flash->mst->buses_supported & BUS_PROG)) {
+		*chunk_size = flash->mst->opaque.max_data_write;
+	} else {
+		return 0;
+	}
+	*page_size = flash->chip->page_size;
+	if (*chunk_size == MAX_DATA_UNSPECIFIED || *chunk_size > *page_size)
+		*chunk_size = *page_size;
+	return 1;
+}
+
+/* Can the unchanged bytes in @have be written again without erasing them? */
+static bool rewrite_harmless(const uint8_t *have, unsigned int len, enum write_granularity gran)
+{
+	return gran == write_gran_1bit || gran == write_gran_1byte_implicit_erase ||
+	       buf_find_nonblank(have, len) == len;
+}
+
+/*
+ * Masters doing bulk programs get one write for everything up to @bulk_size bytes that doesn't cover a page
+ * none of the writes touched, extended to whole pages where possible: they usually take a lot longer for
+ * partial pages. The extension never goes below @done, what was written before.
+ */
+static unsigned int coalesce_bulk_write(const uint8_t *have, const uint8_t *want, unsigned int addr,
+					unsigned int *start, unsigned int len, unsigned int total,
+					unsigned int done, unsigned int page_size, unsigned int bulk_size,
+					enum write_granularity gran)
+{
+	unsigned int end, next_start, next_len, head, tail;
+
+	while (*start + len < total) {
+		end = *start + len;
+		next_start = end;
+		next_len = get_next_write(have + end, want + end, total - end, &next_start, gran);
+		if (!next_len || next_start + next_len - *start > bulk_size)
+			break;
+		if (count_pages(addr + *start, next_start + next_len - *start, page_size) >
+		    count_pages(addr + *start, len, page_size) + count_pages(addr + next_start, next_len, page_size))
+			break;
+		if (!rewrite_harmless(have + end, next_start - end, gran))
+			break;
+		len = next_start + next_len - *start;
+	}
+
+	head = (addr + *start) % page_size;
+	if (head && head <= *start - done && len + head <= bulk_size &&
+	    rewrite_harmless(have + *start - head, head, gran)) {
+		*start -= head;
+		len += head;
+	}
+	tail = (page_size - (addr + *start + len) % page_size) % page_size;
+	if (tail && tail <= total - *start - len && len + tail <= bulk_size &&
+	    rewrite_harmless(have + *start + len, tail, gran))
+		len += tail;
+	return len;
+}
+
+/**
+ * Extend the write found by get_next_write() with the following writes in
+ * the same block as long as rewriting the unchanged bytes in between saves
+ * at least one program transaction. Each transaction costs a WREN, the
+ * program command and a number of RDSR polls, which is a lot more than a
+ * few bytes of payload, especially on USB and serial programmers.
+ *
+ * Merged writes never cross a page boundary because the chip write function
+ * splits at page boundaries anyway, unless the master does bulk programs.
+ * The unchanged bytes in between are only rewritten if that is harmless:
+ * either the chip allows clearing bits of already written bytes, erases
+ * every byte it writes (EEPROMs), or the bytes are still erased.
+ *
+ * @addr	chip address of have[0] and want[0]
+ * @start	offset of the write found by get_next_write(), may be moved
+ *		back to a page boundary for bulk programs
+ * @len		length of that write
+ * @total	length of have and want
+ * @done	offset up to which have was written already
+ * @return	length of the coalesced write starting at @start
+ */
+static unsigned int coalesce_next_write(const struct flashctx *flash, const uint8_t *have,
+					const uint8_t *want, unsigned int addr,
+					unsigned int *start, unsigned int len,
+					unsigned int total, unsigned int done,
+					enum write_granularity gran)
+{
+	unsigned int page_size, chunk_size, bulk_size, page_end, next_start, next_len, end;
+
+	if (!get_write_coalescing(flash, &page_size, &chunk_size, &bulk_size))
+		return len;
+	if (bulk_size)
+		return coalesce_bulk_write(have, want, addr, start, len, total, done, page_size, bulk_size,
+					   gran);
+
+	page_end = ((addr + *start) / page_size + 1) * page_size - addr;
+	while (*start + len < min(page_end, total)) {
+		end = *start + len;
+		next_start = end;
+		next_len = get_next_write(have + end, want + end, min(page_end, total) - end,
+					  &next_start, gran);
+		if (!next_len)
+			break;
+		if (count_write_chunks(next_start + next_len - *start, chunk_size) >=
+		    count_write_chunks(len, chunk_size) + count_write_chunks(next_len, chunk_size))
+			break;
+		if (!rewrite_harmless(have + end, next_start - end, gran))
+			break;
+		len = next_start + next_len - *start;
+	}
+	return len;
+}
+
 /* This function generates various test patterns useful for testing controller
  * and chip communication as well as chip behaviour.
  *
@@ -1083,16 +1549,77 @@ unsigned int count_max_decode_exceedings(const struct flashctx *flash)
 	return limitexceeded;
 }
 
+/* While probing, most chip definitions share a handful of windows (one per chip size), so mappings are kept
+ * until probing is done instead of being established and torn down again for every candidate chip.
+ */
+#define MAP_CACHE_SIZE	16
+
+/* Per thread, as independent masters are probed concurrently. */
+static THREAD_LOCAL struct {
+	uintptr_t base;
+	size_t len;
+	void *addr;
+} map_cache[MAP_CACHE_SIZE];
+static THREAD_LOCAL unsigned int map_cache_used;
+static THREAD_LOCAL bool map_cache_active;
+
+static void map_cache_start(void)
+{
+	map_cache_used = 0;
+	map_cache_active = true;
+}
+
+/* Release all cached mappings. */
+static void map_cache_stop(void)
+{
+	while (map_cache_used > 0) {
+		map_cache_used--;
+		programmer_unmap_flash_region(map_cache[map_cache_used].addr, map_cache[map_cache_used].len);
+	}
+	map_cache_active = false;
+}
+
+static void *map_flash_region(const char *descr, uintptr_t base, size_t len)
+{
+	unsigned int i;
+	void *addr;
+
+	if (!map_cache_active)
+		return programmer_map_flash_region(descr, base, len);
+	for (i = 0; i < map_cache_used; i++)
+		if (map_cache[i].base == base && map_cache[i].len == len)
+			return map_cache[i].addr;
+	addr = programmer_map_flash_region(descr, base, len);
+	if (addr != ERROR_PTR && map_cache_used < MAP_CACHE_SIZE) {
+		map_cache[map_cache_used].base = base;
+		map_cache[map_cache_used].len = len;
+		map_cache[map_cache_used].addr = addr;
+		map_cache_used++;
+	}
+	return addr;
+}
+
+static void unmap_flash_region(void *addr, size_t len)
+{
+	unsigned int i;
+
+	/* Cached mappings are released by map_cache_stop(). */
+	for (i = 0; i < map_cache_used; i++)
+		if (map_cache[i].addr == addr && map_cache[i].len == len)
+			return;
+	programmer_unmap_flash_region(addr, len);
+}
+
 void unmap_flash(struct flashctx *flash)
 {
 	if (flash->virtual_registers != (chipaddr)ERROR_PTR) {
-		programmer_unmap_flash_region((void *)flash->virtual_registers, flash->chip->total_size * 1024);
+		unmap_flash_region((void *)flash->virtual_registers, flash->chip->total_size * 1024);
 		flash->physical_registers = 0;
 		flash->virtual_registers = (chipaddr)ERROR_PTR;
 	}
 
 	if (flash->virtual_memory != (chipaddr)ERROR_PTR) {
-		programmer_unmap_flash_region((void *)flash->virtual_memory, flash->chip->total_size * 1024);
+		unmap_flash_region((void *)flash->virtual_memory, flash->chip->total_size * 1024);
 		flash->physical_memory = 0;
 		flash->virtual_memory = (chipaddr)ERROR_PTR;
 	}
@@ -1112,7 +1639,7 @@ int map_flash(struct flashctx *flash)
 
 	const chipsize_t size = flash->chip->total_size * 1024;
 	uintptr_t base = flashbase ? flashbase : (0xffffffff - size + 1);
-	void *addr = programmer_map_flash_region(flash->chip->name, base, size);
+	void *addr = map_flash_region(flash->chip->name, base, size);
 	if (addr == ERROR_PTR) {
 		msg_perr("Could not map flash chip %s at 0x%0*" PRIxPTR ".\n",
 			 flash->chip->name, PRIxPTR_WIDTH, base);
@@ -1126,7 +1653,7 @@ int map_flash(struct flashctx *flash)
 	 * Ignore these problems for now and always report success. */
 	if (flash->chip->feature_bits & FEATURE_REGISTERMAP) {
 		base = 0xffffffff - size - 0x400000 + 1;
-		addr = programmer_map_flash_region("flash chip registers", base, size);
+		addr = map_flash_region("flash chip registers", base, size);
 		if (addr == ERROR_PTR) {
 			msg_pdbg2("Could not map flash chip registers %s at 0x%0*" PRIxPTR ".\n",
 				 flash->chip->name, PRIxPTR_WIDTH, base);
@@ -1138,18 +1665,39 @@ int map_flash(struct flashctx *flash)
 	return 0;
 }
 
+/* The first chip to probe at or after @chip: the chip itself, or the next one with the name given by -c. */
+static const struct flashchip *next_probe_candidate(const struct flashchip *chip)
+{
+	if (!chip_to_probe)
+		return chip;
+	return find_chip_by_name(chip_to_probe, chip - flashchips);
+}
+
 int probe_flash(struct registered_master *mst, int startchip, struct flashctx *flash, int force)
 {
 	const struct flashchip *chip;
+	struct flashchip *scratch;
 	enum chipbustype buses_common;
 	char *tmp;
 
-	for (chip = flashchips + startchip; chip && chip->name; chip++) {
-		if (chip_to_probe && strcmp(chip->name, chip_to_probe) != 0)
-			continue;
+	/* Answer repeated identification commands from memory and skip chips whose IDs were already
+	 * ruled out by an earlier probe with the same function. */
+	probe_cache_start();
+	probe_forget_ids();
+	map_cache_start();
+	/* One copy of the chip definition is reused for all candidates and kept for the one found. */
+	scratch = malloc(sizeof(struct flashchip));
+	if (!scratch) {
+		msg_gerr("Out of memory!\n");
+		exit(1);
+	}
+	for (chip = next_probe_candidate(flashchips + startchip); chip && chip->name;
+	     chip = next_probe_candidate(chip + 1)) {
 		buses_common = mst->buses_supported & chip->bustype;
 		if (!buses_common)
 			continue;
+		if (!force && probe_ruled_out(mst, chip))
+			continue;
 		msg_gdbg("Probing for %s %s, %d kB: ", chip->vendor, chip->name, chip->total_size);
 		if (!chip->probe && !force) {
 			msg_gdbg("failed! flashrom has no probe function for this flash chip.\n");
@@ -1157,16 +1705,17 @@ int probe_flash(struct registered_master *mst, int startchip, struct flashctx *f
 		}
 
 		/* Start filling in the dynamic data. */
-		flash->chip = calloc(1, sizeof(struct flashchip));
-		if (!flash->chip) {
-			msg_gerr("Out of memory!\n");
-			exit(1);
-		}
-		memcpy(flash->chip, chip, sizeof(struct flashchip));
+		memcpy(scratch, chip, sizeof(struct flashchip));
+		flash->chip = scratch;
 		flash->mst = mst;
 
-		if (map_flash(flash) != 0)
+		if (map_flash(flash) != 0) {
+			flash->chip = NULL;
+			free(scratch);
+			map_cache_stop();
+			probe_cache_stop();
 			return -1;
+		}
 
 		/* We handle a forced match like a real match, we just avoid probing. Note that probe_flash()
 		 * is only called with force=1 after normal probing failed.
@@ -1216,13 +1765,19 @@ int probe_flash(struct registered_master *mst, int startchip, struct flashctx *f
 		/* Not the first flash chip detected on this bus, and it's just a generic match. Ignore it. */
 notfound:
 		unmap_flash(flash);
-		free(flash->chip);
 		flash->chip = NULL;
 	}
+	probe_cache_stop();
 
-	if (!flash->chip)
+	if (!flash->chip) {
+		free(scratch);
+		map_cache_stop();
 		return -1;
+	}
 
+	/* Natively supported SPI chips may describe faster ways to access them than their entry lists. */
+	if (!force && flash->chip->bustype == BUS_SPI && flash->chip->probe != probe_spi_sfdp)
+		spi_sfdp_tune(flash);
 
 	tmp = flashbuses_to_text(flash->chip->bustype);
 	msg_cinfo("%s %s flash chip \"%s\" (%d kB, %s) ", force ? "Assuming" : "Found",
@@ -1244,75 +1799,434 @@ notfound:
 
 	/* Get out of the way for later runs. */
 	unmap_flash(flash);
+	map_cache_stop();
 
 	/* Return position of matching chip. */
 	return chip - flashchips;
 }
 
-int read_buf_from_file(unsigned char *buf, unsigned long size,
-		       const char *filename)
+/* Probe @mst for up to @max chips, see probe_masters(). Returns the number found. */
+static int probe_master(struct registered_master *mst, struct flashctx *flashes, int max)
 {
-#ifdef __LIBPAYLOAD__
-	msg_gerr("Error: No file I/O support in libpayload\n");
-	return 1;
-#else
-	int ret = 0;
-
-	FILE *image;
-	if ((image = fopen(filename, "rb")) == NULL) {
-		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
-		return 1;
-	}
-
-	struct stat image_stat;
-	if (fstat(fileno(image), &image_stat) != 0) {
-		msg_gerr("Error: getting metadata of file \"%s\" failed: %s\n", filename, strerror(errno));
-		ret = 1;
-		goto out;
-	}
-	if (image_stat.st_size != size) {
-		msg_gerr("Error: Image size (%jd B) doesn't match the flash chip's size (%lu B)!\n",
-			 (intmax_t)image_stat.st_size, size);
-		ret = 1;
-		goto out;
-	}
+	int startchip = 0, count = 0;
 
-	unsigned long numbytes = fread(buf, 1, size, image);
-	if (numbytes != size) {
-		msg_gerr("Error: Failed to read complete file. Got %ld bytes, "
-			 "wanted %ld!\n", numbytes, size);
-		ret = 1;
+	while (count < max) {
+		startchip = probe_flash(mst, startchip, &flashes[count], 0);
+		if (startchip == -1)
+			break;
+		count++;
+		startchip++;
 	}
-out:
-	(void)fclose(image);
-	return ret;
-#endif
+	return count;
 }
 
-int write_buf_to_file(const unsigned char *buf, unsigned long size, const char *filename)
-{
+/*
+ * Messages of a thread probing masters, held back until all masters are done so that the output comes in
+ * master order instead of interleaved.
+ */
+struct held_message {
+	enum msglevel level;
+	char *text;
+};
+
+struct message_log {
+	struct held_message *msgs;
+	unsigned int count;
+	unsigned int capacity;
+};
+
+static THREAD_LOCAL struct message_log *held_log;
+
+int print_captured(enum msglevel level, const char *fmt, va_list ap)
+{
+	struct held_message *tmp;
+	unsigned int capacity;
+	va_list aq;
+	char *text;
+	int len;
+
+	if (!held_log)
+		return -1;
+	va_copy(aq, ap);
+	len = vsnprintf(NULL, 0, fmt, aq);
+	va_end(aq);
+	if (len < 0)
+		return len;
+	text = malloc(len + 1);
+	if (!text)
+		return 0;
+	vsnprintf(text, len + 1, fmt, ap);
+	if (held_log->count == held_log->capacity) {
+		capacity = held_log->capacity ? held_log->capacity * 2 : 64;
+		tmp = realloc(held_log->msgs, capacity * sizeof(*tmp));
+		if (!tmp) {
+			free(text);
+			return 0;
+		}
+		held_log->msgs = tmp;
+		held_log->capacity = capacity;
+	}
+	held_log->msgs[held_log->count].level = level;
+	held_log->msgs[held_log->count].text = text;
+	held_log->count++;
+	return len;
+}
+
+#if CONFIG_THREADS == 1
+/* Print the held back messages in the order they came and free them. */
+static void release_messages(struct message_log *log)
+{
+	unsigned int i;
+
+	for (i = 0; i < log->count; i++) {
+		print(log->msgs[i].level, "%s", log->msgs[i].text);
+		free(log->msgs[i].text);
+	}
+	free(log->msgs);
+}
+
+struct probe_job {
+	struct registered_master *mst;
+	struct flashctx *flashes;	/* Room for max chips. */
+	int max;
+	int found;
+	struct message_log log;
+	struct op_stats stats;
+	bool threaded;
+	pthread_t thread;
+};
+
+static void run_probe_job(struct probe_job *job)
+{
+	held_log = &job->log;
+	stats_capture(&job->stats);
+	job->found = probe_master(job->mst, job->flashes, job->max);
+	stats_capture(NULL);
+	held_log = NULL;
+	/* The IDs are remembered per thread. */
+	probe_forget_ids();
+}
+
+static void *probe_thread(void *arg)
+{
+	run_probe_job(arg);
+	return NULL;
+}
+
+/* Are there at least two groups of masters which can be probed concurrently? */
+static bool can_probe_concurrently(void)
+{
+	int i, groups = 0;
+	bool shared = false;
+
+	/* A trace has to record the commands in the order a sequential probe sends them. */
+	if (spi_trace_enabled)
+		return false;
+	for (i = 0; i < registered_master_count; i++) {
+		if (registered_masters[i].independent)
+			groups++;
+		else
+			shared = true;
+	}
+	return groups + shared >= 2;
+}
+
+/*
+ * Each independent master is probed on its own thread, the others one after another on this one. Returns
+ * the number of chips found, or -1 if the threads couldn't be set up.
+ */
+static int probe_masters_concurrently(struct flashctx *flashes, int max)
+{
+	struct probe_job *jobs;
+	int i, j, count = 0;
+
+	jobs = calloc(registered_master_count, sizeof(*jobs));
+	if (!jobs)
+		return -1;
+	for (i = 0; i < registered_master_count; i++) {
+		jobs[i].mst = &registered_masters[i];
+		jobs[i].max = max;
+		jobs[i].flashes = calloc(max, sizeof(*jobs[i].flashes));
+		if (!jobs[i].flashes) {
+			while (i--)
+				free(jobs[i].flashes);
+			free(jobs);
+			return -1;
+		}
+	}
+
+	probe_prepare();
+	for (i = 0; i < registered_master_count; i++)
+		if (jobs[i].mst->independent)
+			jobs[i].threaded = !pthread_create(&jobs[i].thread, NULL, probe_thread, &jobs[i]);
+	for (i = 0; i < registered_master_count; i++)
+		if (!jobs[i].threaded)
+			run_probe_job(&jobs[i]);
+
+	/* Put the results together as if the masters had been probed in order. */
+	for (i = 0; i < registered_master_count; i++) {
+		if (jobs[i].threaded)
+			pthread_join(jobs[i].thread, NULL);
+		release_messages(&jobs[i].log);
+		stats_add(&jobs[i].stats);
+		for (j = 0; j < jobs[i].found; j++) {
+			if (count < max)
+				flashes[count++] = jobs[i].flashes[j];
+			else
+				free(jobs[i].flashes[j].chip);
+		}
+		free(jobs[i].flashes);
+	}
+	free(jobs);
+	return count;
+}
+#endif
+
+/*
+ * Probe all registered masters for up to @max chips in total and fill @flashes with them, in the order of
+ * the masters. Masters which share nothing with the others are probed concurrently if possible.
+ */
+int probe_masters(struct flashctx *flashes, int max)
+{
+	int i, count = 0;
+
+#if CONFIG_THREADS == 1
+	if (can_probe_concurrently()) {
+		count = probe_masters_concurrently(flashes, max);
+		if (count >= 0)
+			return count;
+		count = 0;
+	}
+#endif
+	for (i = 0; i < registered_master_count && count < max; i++)
+		count += probe_master(&registered_masters[i], flashes + count, max - count);
+	return count;
+}
+
+/* Images at least this big are kept in an unlinked temporary file rather than in anonymous memory. The kernel
+ * can then write them back and drop them from memory when it runs short, instead of keeping them resident. */
+#define FILE_BACKED_IMAGE_MIN	(32 * 1024 * 1024)
+
+struct image_buffer {
+	uint8_t *data;
+	size_t size;
+	bool mapped;
+};
+
+#if HAVE_MMAP == 1
+/* Map a zero-filled, already unlinked temporary file of @size bytes. */
+static uint8_t *map_temporary_file(size_t size)
+{
+	const char *dir = getenv("TMPDIR");
+	char *template;
+	void *data;
+	int fd;
+
+	if (!dir || !*dir)
+		dir = "/tmp";
+	template = malloc(strlen(dir) + strlen("/flashrom.XXXXXX") + 1);
+	if (!template)
+		return NULL;
+	sprintf(template, "%s/flashrom.XXXXXX", dir);
+	fd = mkstemp(template);
+	if (fd < 0) {
+		free(template);
+		return NULL;
+	}
+	unlink(template);
+	free(template);
+	if (ftruncate(fd, size)) {
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return data == MAP_FAILED ? NULL : data;
+}
+#endif
+
+/* Allocate a buffer for a chip image. The contents are undefined unless img->mapped is set (zero-filled). */
+static int alloc_image_buffer(struct image_buffer *img, size_t size)
+{
+	img->size = size;
+	img->mapped = false;
+#if HAVE_MMAP == 1
+	if (size >= FILE_BACKED_IMAGE_MIN) {
+		img->data = map_temporary_file(size);
+		if (img->data) {
+			img->mapped = true;
+			return 0;
+		}
+		msg_gdbg("Could not create a file backed buffer, using memory instead.\n");
+	}
+#endif
+	img->data = malloc(size);
+	if (!img->data) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	return 0;
+}
+
+static void free_image_buffer(struct image_buffer *img)
+{
+#if HAVE_MMAP == 1
+	if (img->mapped) {
+		munmap(img->data, img->size);
+		img->data = NULL;
+		return;
+	}
+#endif
+	free(img->data);
+	img->data = NULL;
+}
+
+#if HAVE_MMAP == 1
+/*
+ * Map the image file copy-on-write, so it is paged in (and prefetched) by the kernel as the engine works
+ * through it and only pages modified by building the new image are copied. Fails silently for anything
+ * but regular files of the right size, read_buf_from_file() reports the details then.
+ */
+static int map_image_file(struct image_buffer *img, unsigned long size, const char *filename)
+{
+	struct stat image_stat;
+	void *data;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &image_stat) || !S_ISREG(image_stat.st_mode) || image_stat.st_size != size) {
+		close(fd);
+		return 1;
+	}
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 1;
+	posix_madvise(data, size, POSIX_MADV_WILLNEED);
+	img->data = data;
+	img->size = size;
+	img->mapped = true;
+	return 0;
+}
+#endif
+
+/*
+ * Set up @img for the contents of the image file, mapping it if possible. Otherwise the buffer is only
+ * allocated and *@pending set, the caller still has to read the file with read_buf_from_file().
+ */
+static int load_image_file(struct image_buffer *img, unsigned long size, const char *filename, bool *pending)
+{
+	*pending = false;
+#if HAVE_MMAP == 1
+	if (!map_image_file(img, size, filename))
+		return 0;
+#endif
+	/* Fail early rather than after reading the chip if the file isn't even there. */
+	if (access(filename, R_OK)) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	if (alloc_image_buffer(img, size))
+		return 1;
+	*pending = true;
+	return 0;
+}
+
+/* Read the image file @filename to @buf. If @partial, only its first @size bytes are wanted. */
+static int read_image(unsigned char *buf, unsigned long size, const char *filename, bool partial)
+{
 #ifdef __LIBPAYLOAD__
 	msg_gerr("Error: No file I/O support in libpayload\n");
 	return 1;
 #else
-	FILE *image;
 	int ret = 0;
 
+	FILE *image;
+	if ((image = fopen(filename, "rb")) == NULL) {
+		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+
+	struct stat image_stat;
+	if (fstat(fileno(image), &image_stat) != 0) {
+		msg_gerr("Error: getting metadata of file \"%s\" failed: %s\n", filename, strerror(errno));
+		ret = 1;
+		goto out;
+	}
+	/* A file of the right size is always a plain image. Anything else may be compressed. */
+	unsigned long numbytes = 0;
+	if (!S_ISREG(image_stat.st_mode) || image_stat.st_size != size || partial) {
+		uint8_t head[8];
+		size_t headlen = fread(head, 1, sizeof(head), image);
+		enum image_compression type = image_compression_from_magic(head, headlen);
+		if (type != IMAGE_RAW) {
+			ret = decompress_image(image, filename, type, head, headlen, buf, size, partial);
+			goto out;
+		}
+		if (S_ISREG(image_stat.st_mode) && partial && image_stat.st_size < size) {
+			msg_gerr("Error: Image is too short (%jd B), wanted at least %lu B!\n",
+				 (intmax_t)image_stat.st_size, size);
+			ret = 1;
+			goto out;
+		} else if (S_ISREG(image_stat.st_mode) && !partial) {
+			msg_gerr("Error: Image size (%jd B) doesn't match the flash chip's size (%lu B)!\n",
+				 (intmax_t)image_stat.st_size, size);
+			ret = 1;
+			goto out;
+		}
+		numbytes = min(headlen, size);
+		memcpy(buf, head, numbytes);
+	}
+
+	numbytes += fread(buf + numbytes, 1, size - numbytes, image);
+	if (numbytes != size) {
+		msg_gerr("Error: Failed to read complete file. Got %ld bytes, "
+			 "wanted %ld!\n", numbytes, size);
+		ret = 1;
+	} else if (!S_ISREG(image_stat.st_mode) && !partial && fgetc(image) != EOF) {
+		msg_gerr("Error: Image is larger than the flash chip (%lu B)!\n", size);
+		ret = 1;
+	}
+out:
+	(void)fclose(image);
+	return ret;
+#endif
+}
+
+int read_buf_from_file(unsigned char *buf, unsigned long size, const char *filename)
+{
+	return read_image(buf, size, filename, false);
+}
+
+/* Read the first @size bytes of the image file @filename, which may be larger, to @buf. */
+int read_buf_head_from_file(unsigned char *buf, unsigned long size, const char *filename)
+{
+	return read_image(buf, size, filename, true);
+}
+
+#ifndef __LIBPAYLOAD__
+static FILE *open_image_file(const char *filename)
+{
+	FILE *image;
+
 	if (!filename) {
 		msg_gerr("No filename specified.\n");
-		return 1;
+		return NULL;
 	}
 	if ((image = fopen(filename, "wb")) == NULL) {
 		msg_gerr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
-		return 1;
+		return NULL;
 	}
+	return image;
+}
 
-	unsigned long numbytes = fwrite(buf, 1, size, image);
-	if (numbytes != size) {
-		msg_gerr("Error: file %s could not be written completely.\n", filename);
-		ret = 1;
+/* Flush, sync and close @image. @ret is the result so far and is passed through if it signals an error. */
+static int close_image_file(FILE *image, const char *filename, int ret)
+{
+	if (ret)
 		goto out;
-	}
 	if (fflush(image)) {
 		msg_gerr("Error: flushing file \"%s\" failed: %s\n", filename, strerror(errno));
 		ret = 1;
@@ -1330,44 +2244,258 @@ int write_buf_to_file(const unsigned char *buf, unsigned long size, const char *
 			msg_gerr("Error: fsyncing file \"%s\" failed: %s\n", filename, strerror(errno));
 			ret = 1;
 		}
-	}
+	}
+#endif
+out:
+	if (fclose(image)) {
+		msg_gerr("Error: closing file \"%s\" failed: %s\n", filename, strerror(errno));
+		ret = 1;
+	}
+	return ret;
+}
+#endif
+
+int write_buf_to_file(const unsigned char *buf, unsigned long size, const char *filename)
+{
+#ifdef __LIBPAYLOAD__
+	msg_gerr("Error: No file I/O support in libpayload\n");
+	return 1;
+#else
+	FILE *image;
+	int ret = 0;
+
+	if ((image = open_image_file(filename)) == NULL)
+		return 1;
+
+	enum image_compression type = image_compression_from_name(filename);
+	if (type != IMAGE_RAW) {
+		struct image_codec *c = image_compressor_start(type, image, filename);
+		if (!c)
+			ret = 1;
+		else
+			ret = image_compressor_finish(c, image_compressor_write(c, buf, size));
+		return close_image_file(image, filename, ret);
+	}
+
+	unsigned long numbytes = fwrite(buf, 1, size, image);
+	if (numbytes != size) {
+		msg_gerr("Error: file %s could not be written completely.\n", filename);
+		ret = 1;
+	}
+	return close_image_file(image, filename, ret);
+#endif
+}
+
+#ifndef __LIBPAYLOAD__
+struct file_output_ctx {
+	struct flashctx *flash;
+	FILE *image;
+	const char *filename;
+	struct image_codec *compressor;	/* NULL for plain images */
+};
+
+static int write_chunk_to_file(void *arg, const uint8_t *buf, unsigned int start, unsigned int len)
+{
+	struct file_output_ctx *f = arg;
+
+	update_progress(f->flash, PROGRESS_READ, start + len, f->flash->chip->total_size * 1024);
+	if (f->compressor)
+		return image_compressor_write(f->compressor, buf, len);
+	if (fwrite(buf, 1, len, f->image) != len) {
+		msg_gerr("Error: file %s could not be written completely.\n", f->filename);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Write regular files under a temporary name first and only rename them at the end. That way a failed
+ * read can't leave an incomplete image behind (or destroy an existing one with the same name).
+ */
+static char *get_temporary_filename(const char *filename)
+{
+	struct stat st;
+	char *tmpname;
+
+	if (!stat(filename, &st) && !S_ISREG(st.st_mode))
+		return NULL;
+	tmpname = malloc(strlen(filename) + strlen(".tmp") + 1);
+	if (tmpname) {
+		strcpy(tmpname, filename);
+		strcat(tmpname, ".tmp");
+	}
+	return tmpname;
+}
+#endif
+
+#if HAVE_MMAP == 1
+/*
+ * Read the whole chip directly into the page cache of the (regular) output file. Sets @mapped if that
+ * was possible, otherwise nothing was done and the caller has to write the file in another way.
+ *
+ * @return	0 on success, -1 if reading failed, 1 on file errors
+ */
+static int read_flash_to_mapping(struct flashctx *flash, FILE *image, const char *filename,
+				 unsigned long size, bool *mapped)
+{
+	struct stat image_stat;
+	void *data;
+	int ret = 0;
+
+	*mapped = false;
+	if (fstat(fileno(image), &image_stat) || !S_ISREG(image_stat.st_mode))
+		return 0;
+	if (ftruncate(fileno(image), size))
+		return 0;
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(image), 0);
+	if (data == MAP_FAILED)
+		return 0;
+	*mapped = true;
+
+	if (read_flash_with_progress(flash, data, 0, size))
+		ret = -1;
+	else if (msync(data, size, MS_SYNC)) {
+		msg_gerr("Error: file %s could not be written completely.\n", filename);
+		ret = 1;
+	}
+	munmap(data, size);
+	return ret;
+}
+#endif
+
+#ifndef __LIBPAYLOAD__
+/* Stream the chip contents to stdout ("-r -"), e.g. into a pipe. */
+static int read_flash_to_stdout(struct flashctx *flash, unsigned long size)
+{
+	struct file_output_ctx f = { .flash = flash, .image = stdout, .filename = "(stdout)" };
+	int ret;
+
+#ifdef _WIN32
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	ret = read_flash_streamed(flash, 0, size, write_chunk_to_file, &f);
+	if (ret == -1)
+		msg_cerr("Read operation failed!\n");
+	if (fflush(stdout)) {
+		msg_gerr("Error: writing to stdout failed: %s\n", strerror(errno));
+		ret = 1;
+	}
+	return ret ? 1 : 0;
+}
+#endif
+
+int read_flash_to_file(struct flashctx *flash, const char *filename)
+{
+	unsigned long size = flash->chip->total_size * 1024;
+	unsigned char *buf = NULL;
+	int ret = 0;
+
+	enum stats_phase prev_phase = stats_set_phase(STATS_PHASE_READ);
+
+	msg_cinfo("Reading flash... ");
+	if (!flash->chip->read) {
+		msg_cerr("No read function available for this flash chip.\n");
+		ret = 1;
+		goto out_free;
+	}
+#ifdef __LIBPAYLOAD__
+	buf = calloc(size, sizeof(char));
+	if (!buf) {
+		msg_gerr("Memory allocation failed!\n");
+		ret = 1;
+		goto out_free;
+	}
+	if (flash->chip->read(flash, buf, 0, size)) {
+		msg_cerr("Read operation failed!\n");
+		ret = 1;
+		goto out_free;
+	}
+
+	ret = write_buf_to_file(buf, size, filename);
+#else
+	/* Write the file while the chip is still being read. */
+	if (!filename) {
+		msg_gerr("No filename specified.\n");
+		ret = 1;
+		goto out_free;
+	}
+	if (!strcmp(filename, "-")) {
+		ret = read_flash_to_stdout(flash, size);
+		goto out_free;
+	}
+	char *tmpname = get_temporary_filename(filename);
+	struct file_output_ctx f = { .flash = flash, .filename = tmpname ? tmpname : filename };
+	bool mapped = false;
+
+	/* The name of the final file decides about compression, not the one of the temporary file. */
+	enum image_compression type = image_compression_from_name(filename);
+
+	f.image = open_image_file(f.filename);
+	if (!f.image) {
+		ret = 1;
+	} else {
+		if (type != IMAGE_RAW) {
+			f.compressor = image_compressor_start(type, f.image, f.filename);
+			if (!f.compressor)
+				ret = 1;
+		}
+#if HAVE_MMAP == 1
+		if (!ret && !f.compressor)
+			ret = read_flash_to_mapping(flash, f.image, f.filename, size, &mapped);
 #endif
-out:
-	if (fclose(image)) {
-		msg_gerr("Error: closing file \"%s\" failed: %s\n", filename, strerror(errno));
-		ret = 1;
+		if (!ret && !mapped)
+			ret = read_flash_streamed(flash, 0, size, write_chunk_to_file, &f);
+		if (ret == -1)
+			msg_cerr("Read operation failed!\n");
+		if (f.compressor)
+			ret = image_compressor_finish(f.compressor, ret ? 1 : 0);
+		ret = close_image_file(f.image, f.filename, ret ? 1 : 0);
+		if (tmpname) {
+#ifdef _WIN32
+			/* rename() doesn't replace existing files on Windows. */
+			if (!ret)
+				remove(filename);
+#endif
+			if (ret)
+				remove(tmpname);
+			else if (rename(tmpname, filename)) {
+				msg_gerr("Error: renaming \"%s\" to \"%s\" failed: %s\n", tmpname,
+					 filename, strerror(errno));
+				remove(tmpname);
+				ret = 1;
+			}
+		}
 	}
-	return ret;
+	free(tmpname);
 #endif
+out_free:
+	free(buf);
+	msg_cinfo("%s.\n", ret ? "FAILED" : "done");
+	stats_set_phase(prev_phase);
+	return ret;
 }
 
-int read_flash_to_file(struct flashctx *flash, const char *filename)
+/* Read the whole chip into @buf. */
+static int read_flash_to_buffer(struct flashctx *flash, uint8_t *buf)
 {
-	unsigned long size = flash->chip->total_size * 1024;
-	unsigned char *buf = calloc(size, sizeof(char));
+	unsigned int size = flash->chip->total_size * 1024;
 	int ret = 0;
 
+	enum stats_phase prev_phase = stats_set_phase(STATS_PHASE_READ);
+
 	msg_cinfo("Reading flash... ");
-	if (!buf) {
-		msg_gerr("Memory allocation failed!\n");
-		msg_cinfo("FAILED.\n");
-		return 1;
-	}
 	if (!flash->chip->read) {
 		msg_cerr("No read function available for this flash chip.\n");
 		ret = 1;
-		goto out_free;
+		goto out;
 	}
-	if (flash->chip->read(flash, buf, 0, size)) {
+	if (read_flash_with_progress(flash, buf, 0, size)) {
 		msg_cerr("Read operation failed!\n");
 		ret = 1;
-		goto out_free;
 	}
-
-	ret = write_buf_to_file(buf, size, filename);
-out_free:
-	free(buf);
+out:
 	msg_cinfo("%s.\n", ret ? "FAILED" : "done");
+	stats_set_phase(prev_phase);
 	return ret;
 }
 
@@ -1437,6 +2565,218 @@ static int selfcheck_eraseblocks(const struct flashchip *chip)
 	return ret;
 }
 
+/* Read @len bytes starting at @start from the chip into @buf, or only the parts listed in @ranges if it is
+ * not NULL. */
+static int read_flash_ranges(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len,
+			     const struct range_list *ranges)
+{
+	unsigned int i;
+
+	if (!ranges)
+		return flash->chip->read(flash, buf + start, start, len);
+	for (i = 0; i < ranges->count; i++) {
+		unsigned int rstart = max(ranges->ranges[i].start, start);
+		unsigned int rend = min(ranges->ranges[i].start + ranges->ranges[i].len, start + len);
+		if (rstart >= rend)
+			continue;
+		if (flash->chip->read(flash, buf + rstart, rstart, rend - rstart))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Read those parts of start..start+len-1 that are not in known_ranges yet. They are not included in any
+ * layout region, hence they have to be preserved, i.e. their new contents are the current ones.
+ */
+static int fill_unknown_contents(struct flashctx *flash, unsigned int start, unsigned int len,
+				 uint8_t *curcontents, uint8_t *newcontents)
+{
+	unsigned int pos = start, end = start + len, i = 0;
+
+	while (pos < end) {
+		unsigned int gap_end = end;
+		/* Skip known ranges ending before pos and known contents at pos. */
+		if (i < known_ranges->count) {
+			const struct range *r = &known_ranges->ranges[i];
+			if (r->start + r->len <= pos) {
+				i++;
+				continue;
+			}
+			if (r->start <= pos) {
+				pos = r->start + r->len;
+				i++;
+				continue;
+			}
+			gap_end = min(r->start, end);
+		}
+		msg_cdbg2("Reading preserved contents at 0x%06x-0x%06x. ", pos, gap_end - 1);
+		if (flash->chip->read(flash, curcontents + pos, pos, gap_end - pos)) {
+			msg_cerr("Reading preserved contents at 0x%06x failed!\n", pos);
+			return 1;
+		}
+		memcpy(newcontents + pos, curcontents + pos, gap_end - pos);
+		pos = gap_end;
+	}
+	return range_list_add(known_ranges, start, len);
+}
+
+static void reset_dirty_ranges(void)
+{
+	range_list_free(&dirty_ranges);
+	range_list_free(&stale_ranges);
+	dirty_ranges_complete = true;
+	range_list_free(&sample_ranges);
+	sample_ranges_complete = true;
+	sampled_blocks = 0;
+	range_list_free(&unverified_ranges);
+	unverified_ranges_complete = true;
+	free(original_crcs);
+	original_crcs = NULL;
+	original_crcs_count = original_crcs_capacity = 0;
+	original_crcs_complete = true;
+}
+
+static void add_original_crc(const uint8_t *contents, unsigned int start, unsigned int len)
+{
+	if (original_crcs_count == original_crcs_capacity) {
+		unsigned int capacity = original_crcs_capacity ? original_crcs_capacity * 2 : 64;
+		struct original_crc *tmp = realloc(original_crcs, capacity * sizeof(*tmp));
+		if (!tmp) {
+			original_crcs_complete = false;
+			return;
+		}
+		original_crcs = tmp;
+		original_crcs_capacity = capacity;
+	}
+	original_crcs[original_crcs_count].start = start;
+	original_crcs[original_crcs_count].len = len;
+	original_crcs[original_crcs_count].crc = crc32_update(0, contents, len);
+	original_crcs_count++;
+}
+
+/*
+ * Remember the checksum of the parts of start..start+len-1 which were not touched so far. Their contents
+ * (at @contents) still are the original ones. Must be called before the block is erased or written.
+ */
+static void remember_original_contents(const uint8_t *contents, unsigned int start, unsigned int len)
+{
+	unsigned int pos = start, end = start + len, i;
+
+	for (i = 0; i < dirty_ranges.count && pos < end; i++) {
+		const struct range *r = &dirty_ranges.ranges[i];
+		if (r->start + r->len <= pos)
+			continue;
+		if (r->start >= end)
+			break;
+		if (r->start > pos)
+			add_original_crc(contents + pos - start, pos, r->start - pos);
+		pos = r->start + r->len;
+	}
+	if (pos < end)
+		add_original_crc(contents + pos - start, pos, end - pos);
+}
+
+static int crc_chunk(void *arg, const uint8_t *buf, unsigned int start, unsigned int len)
+{
+	uint32_t *crc = arg;
+
+	*crc = crc32_update(*crc, buf, len);
+	return 0;
+}
+
+/*
+ * Check whether anything erased or written since the last reset_dirty_ranges() differs from the contents
+ * before. Returns 0 if not, 1 if it does (or if that can't be determined) and -1 if reading failed.
+ */
+static int original_contents_changed(struct flashctx *flash)
+{
+	unsigned int i;
+	uint32_t crc;
+
+	if (!dirty_ranges_complete || !original_crcs_complete)
+		return 1;
+	for (i = 0; i < original_crcs_count; i++) {
+		crc = 0;
+		if (read_flash_streamed(flash, original_crcs[i].start, original_crcs[i].len, crc_chunk, &crc))
+			return -1;
+		if (crc != original_crcs[i].crc)
+			return 1;
+	}
+	return 0;
+}
+
+static void mark_dirty(unsigned int start, unsigned int len)
+{
+	if (range_list_add(&dirty_ranges, start, len) || range_list_add(&stale_ranges, start, len))
+		dirty_ranges_complete = false;
+}
+
+/*
+ * Bring @curcontents up to date after a failed erase or write. Only what was touched since it last matched
+ * the chip is read back, unless the dirty ranges are incomplete.
+ */
+static int reread_touched_contents(struct flashctx *flash, uint8_t *curcontents)
+{
+	const unsigned int size = flash->chip->total_size * 1024;
+	unsigned int i, bytes = 0;
+	int ret;
+
+	if (dirty_ranges_complete) {
+		for (i = 0; i < stale_ranges.count; i++)
+			bytes += stale_ranges.ranges[i].len;
+		msg_cinfo("Reading back %u touched bytes of the flash chip... ", bytes);
+		ret = read_flash_ranges(flash, curcontents, 0, size, &stale_ranges);
+	} else {
+		msg_cinfo("Reading current flash chip contents... ");
+		ret = read_flash_ranges(flash, curcontents, 0, size, known_ranges);
+	}
+	if (!ret)
+		range_list_free(&stale_ranges);
+	return ret;
+}
+
+/* Diagnostics after a failed erase: list everything which is not erased. */
+static void print_unerased_ranges(struct flashctx *flash, unsigned int start, unsigned int len)
+{
+	struct range_list failed = { 0 };
+	unsigned int i;
+
+	find_unerased_ranges(flash, start, len, &failed);
+	for (i = 0; i < failed.count; i++)
+		msg_cdbg("Not erased: 0x%06x-0x%06x\n", failed.ranges[i].start,
+			 failed.ranges[i].start + failed.ranges[i].len - 1);
+	range_list_free(&failed);
+}
+
+/*
+ * Pick what VERIFY_SAMPLE reads back of the eraseblock at @start/@len before it is touched: every page whose
+ * contents change and verify_samples random pages, one from each of as many equal slices of the block. Pages
+ * which are only rewritten with the same data after an erase are covered by the latter.
+ */
+static void sample_block(const struct flashctx *flash, unsigned int start, unsigned int len,
+			 const uint8_t *curcontents, const uint8_t *newcontents)
+{
+	const unsigned int page = flash->chip->page_size ? min(flash->chip->page_size, len) : min(256, len);
+	const unsigned int pages = len / page, slices = min(verify_samples, pages);
+	unsigned int i;
+
+	if (!memcmp(curcontents, newcontents, len))
+		return;
+	sampled_blocks++;
+	for (i = 0; i < len; i += page) {
+		if (memcmp(curcontents + i, newcontents + i, min(page, len - i)) &&
+		    range_list_add(&sample_ranges, start + i, min(page, len - i)))
+			sample_ranges_complete = false;
+	}
+	for (i = 0; i < slices; i++) {
+		unsigned int first = i * pages / slices, count = (i + 1) * pages / slices - first;
+		unsigned int pick = first + rand() % count;
+		if (range_list_add(&sample_ranges, start + pick * page, page))
+			sample_ranges_complete = false;
+	}
+}
+
 static int erase_and_write_block_helper(struct flashctx *flash,
 					unsigned int start, unsigned int len,
 					uint8_t *curcontents,
@@ -1445,9 +2785,21 @@ static int erase_and_write_block_helper(struct flashctx *flash,
 							unsigned int addr,
 							unsigned int len))
 {
-	unsigned int starthere = 0, lenhere = 0;
+	unsigned int starthere = 0, lenhere = 0, written = 0;
 	int ret = 0, skip = 1, writecount = 0;
 	enum write_granularity gran = flash->chip->gran;
+	/* Set once a write failed its inline verify and the block is erased and written again. */
+	bool rewrite = false;
+
+	if (known_ranges && !range_list_contains(known_ranges, start, len)) {
+		if (!range_list_overlaps(known_ranges, start, len)) {
+			/* Not part of any included region, leave it alone. */
+			msg_cdbg(":S");
+			return 0;
+		}
+		if (fill_unknown_contents(flash, start, len, curcontents, newcontents))
+			return -1;
+	}
 
 	/* curcontents and newcontents are opaque to walk_eraseregions, and
 	 * need to be adjusted here to keep the impression of proper abstraction
@@ -1455,37 +2807,67 @@ static int erase_and_write_block_helper(struct flashctx *flash,
 	curcontents += start;
 	newcontents += start;
 	msg_cdbg(":");
-	if (need_erase(curcontents, newcontents, len, gran)) {
+	if (verify_mode == VERIFY_SAMPLE)
+		sample_block(flash, start, len, curcontents, newcontents);
+erase_block:
+	if (rewrite || need_erase(curcontents, newcontents, len, gran)) {
 		msg_cdbg("E");
+		remember_original_contents(curcontents, start, len);
+		stats_set_phase(STATS_PHASE_ERASE);
+		/* Even a failed erase may have changed something. */
+		mark_dirty(start, len);
+		journal_erasing(start, len);
 		ret = erasefn(flash, start, len);
 		if (ret)
 			return ret;
 		if (check_erased_range(flash, start, len)) {
 			msg_cerr("ERASE FAILED!\n");
+			print_unerased_ranges(flash, start, len);
 			return -1;
 		}
 		/* Erase was successful. Adjust curcontents. */
 		memset(curcontents, 0xff, len);
 		skip = 0;
+		stats_set_phase(STATS_PHASE_WRITE);
 	}
 	/* get_next_write() sets starthere to a new value after the call. */
 	while ((lenhere = get_next_write(curcontents + starthere,
 					 newcontents + starthere,
 					 len - starthere, &starthere, gran))) {
-		if (!writecount++)
+		lenhere = coalesce_next_write(flash, curcontents, newcontents, start,
+					      &starthere, lenhere, len, written, gran);
+		if (!writecount++) {
 			msg_cdbg("W");
+			if (skip)
+				remember_original_contents(curcontents, start, len);
+		}
 		/* Needs the partial write function signature. */
+		mark_dirty(start + starthere, lenhere);
+		verified_inline = 0;
 		ret = flash->chip->write(flash, newcontents + starthere,
 				   start + starthere, lenhere);
+		if (ret == ERROR_NEEDS_ERASE && !rewrite) {
+			rewrite = true;
+			starthere = written = writecount = 0;
+			goto erase_block;
+		}
 		if (ret)
 			return ret;
+		/* Erased ranges were checked already, only writes can be left to verify. */
+		if (verify_mode == VERIFY_INLINE && verified_inline < lenhere &&
+		    range_list_add(&unverified_ranges, start + starthere, lenhere))
+			unverified_ranges_complete = false;
+		/* Keep track of the chip contents. */
+		memcpy(curcontents + starthere, newcontents + starthere, lenhere);
 		starthere += lenhere;
+		written = starthere;
 		skip = 0;
 	}
 	if (skip)
 		msg_cdbg("S");
 	else
 		all_skipped = false;
+	journal_block(flash, start, len, newcontents - start, !skip);
 	return ret;
 }
 
@@ -1506,68 +2888,424 @@ static int walk_eraseregions(struct flashctx *flash, int erasefunction,
 	unsigned int len;
 	struct block_eraser eraser = flash->chip->block_erasers[erasefunction];
 
-	for (i = 0; i < NUM_ERASEREGIONS; i++) {
-		/* count==0 for all automatically initialized array
-		 * members so the loop below won't be executed for them.
-		 */
-		len = eraser.eraseblocks[i].size;
-		for (j = 0; j < eraser.eraseblocks[i].count; j++) {
-			/* Print this for every block except the first one. */
-			if (i || j)
-				msg_cdbg(", ");
-			msg_cdbg("0x%06x-0x%06x", start,
-				     start + len - 1);
-			if (do_something(flash, start, len, param1, param2,
-					 eraser.block_erase)) {
-				return 1;
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		/* count==0 for all automatically initialized array
+		 * members so the loop below won't be executed for them.
+		 */
+		len = eraser.eraseblocks[i].size;
+		for (j = 0; j < eraser.eraseblocks[i].count; j++) {
+			/* Print this for every block except the first one. */
+			if (i || j)
+				msg_cdbg(", ");
+			msg_cdbg("0x%06x-0x%06x", start,
+				     start + len - 1);
+			if (do_something(flash, start, len, param1, param2,
+					 eraser.block_erase)) {
+				return 1;
+			}
+			start += len;
+			update_progress(flash, PROGRESS_WRITE, start, flash->chip->total_size * 1024);
+		}
+	}
+	msg_cdbg("\n");
+	return 0;
+}
+
+int check_block_eraser(const struct flashctx *flash, int k, int log)
+{
+	struct block_eraser eraser = flash->chip->block_erasers[k];
+
+	if (!eraser.block_erase && !eraser.eraseblocks[0].count) {
+		if (log)
+			msg_cdbg("not defined. ");
+		return 1;
+	}
+	if (!eraser.block_erase && eraser.eraseblocks[0].count) {
+		if (log)
+			msg_cdbg("eraseblock layout is known, but matching "
+				 "block erase function is not implemented. ");
+		return 1;
+	}
+	if (eraser.block_erase && !eraser.eraseblocks[0].count) {
+		if (log)
+			msg_cdbg("block erase function found, but "
+				 "eraseblock layout is not defined. ");
+		return 1;
+	}
+	// TODO: Once erase functions are annotated with allowed buses, check that as well.
+	return 0;
+}
+
+static unsigned int count_eraseblocks(const struct block_eraser *eraser)
+{
+	unsigned int i, count = 0;
+
+	for (i = 0; i < NUM_ERASEREGIONS; i++)
+		count += eraser->eraseblocks[i].count;
+	return count;
+}
+
+/* Returns the usable eraser with the most (i.e. smallest on average) blocks or -1 if there is none. */
+static int find_finest_eraser(const struct flashctx *flash)
+{
+	unsigned int blocks, maxblocks = 0;
+	int k, finest = -1;
+
+	for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
+		if (check_block_eraser(flash, k, 0))
+			continue;
+		blocks = count_eraseblocks(&flash->chip->block_erasers[k]);
+		if (blocks > maxblocks) {
+			maxblocks = blocks;
+			finest = k;
+		}
+	}
+	return finest;
+}
+
+/*
+ * Read all blocks of the finest usable eraser which overlap with included layout regions and record them in
+ * @ranges. The rest of @buf is left untouched.
+ */
+static int read_included_blocks(struct flashctx *flash, uint8_t *buf, struct range_list *ranges)
+{
+	unsigned int size = flash->chip->total_size * 1024;
+	unsigned int i, j, start = 0;
+	int k = find_finest_eraser(flash);
+
+	if (k < 0) {
+		if (range_list_add(ranges, 0, size))
+			return 1;
+	} else {
+		for (i = 0; i < NUM_ERASEREGIONS; i++) {
+			const struct eraseblock *eb = &flash->chip->block_erasers[k].eraseblocks[i];
+			for (j = 0; j < eb->count; j++, start += eb->size) {
+				if (included_regions_overlap(start, eb->size) &&
+				    range_list_add(ranges, start, eb->size))
+					return 1;
+			}
+		}
+	}
+	return read_flash_ranges(flash, buf, 0, size, ranges);
+}
+
+/* Rough cost estimates (in nanoseconds) used by the erase planner for operations without better data. */
+#define PLAN_WRITE_NSEC_PER_BYTE	3000	/* 256 B page program in ~0.75 ms */
+#define PLAN_READ_NSEC_PER_BYTE		100	/* Blank check after erase */
+#define PLAN_COMMAND_NSEC		100000	/* Sending an erase command and polling for its completion */
+
+/* One step of an erase plan: erase (if needed) and write the block at start/len with eraser k. */
+struct erase_plan_step {
+	unsigned int start;
+	unsigned int len;
+	int eraser;
+	uint64_t cost;
+};
+
+/* Sending a command and polling for its completion, about two status register reads if those were measured. */
+static uint64_t plan_command_nsec(const struct flashctx *flash)
+{
+	if (flash->profile && flash->profile->rdsr_ns)
+		return 2 * (uint64_t)flash->profile->rdsr_ns;
+	return PLAN_COMMAND_NSEC;
+}
+
+static uint64_t estimate_erase_time(const struct flashctx *flash, int k, unsigned int len)
+{
+	const struct timing_profile *profile = flash->profile;
+	erasefunc_t *fn = flash->chip->block_erasers[k].block_erase;
+	uint64_t usecs = (uint64_t)flash->chip->block_erasers[k].typical_ms * 1000;
+
+	/* A measured erase includes sending the command and polling already. */
+	if (profile && profile->erase_len[k])
+		return (uint64_t)profile->erase_us[k] * 1000 * len / profile->erase_len[k];
+	if (!usecs && flash->chip->bustype == BUS_SPI)
+		usecs = spi_erase_time_estimate(fn, len);
+	/* Unknown erase function: assume a fixed overhead plus a size dependent part. */
+	if (!usecs)
+		usecs = 10 * 1000 + (len / 1024) * 2500;
+	return usecs * 1000 + plan_command_nsec(flash);
+}
+
+/* What the erase planner needs to know about the block at start/len. */
+struct block_diff {
+	unsigned int start;
+	unsigned int len;
+	unsigned int changed;	/* Bytes which differ between the old and the new contents */
+	unsigned int nonblank;	/* Bytes of the new contents which are not 0xff */
+	bool need_erase;
+};
+
+/*
+ * The blocks of the finest eraser, compared by diff_block() while the old contents were still being read
+ * (see prepare_chunk()). Only valid for the first erase plan after that read, build_erase_plan() drops them.
+ */
+static struct block_diff *block_diffs = NULL;
+static unsigned int block_diff_count = 0;
+
+static void diff_block(const struct flashctx *flash, unsigned int start, unsigned int len,
+		       const uint8_t *curcontents, const uint8_t *newcontents, struct block_diff *d)
+{
+	unsigned int i, changed = 0, nonblank = 0;
+
+	curcontents += start;
+	newcontents += start;
+	for (i = 0; i < len; i++) {
+		changed += curcontents[i] != newcontents[i];
+		nonblank += newcontents[i] != 0xff;
+	}
+	d->start = start;
+	d->len = len;
+	d->changed = changed;
+	d->nonblank = nonblank;
+	d->need_erase = changed && need_erase(curcontents, newcontents, len, flash->chip->gran);
+}
+
+/* Set up block_diffs for the blocks of the finest eraser. Returns 0 on success. */
+static int alloc_block_diffs(const struct flashctx *flash)
+{
+	unsigned int i, j, start = 0, n = 0;
+	int k = find_finest_eraser(flash);
+
+	if (k < 0)
+		return 1;
+	block_diffs = malloc(count_eraseblocks(&flash->chip->block_erasers[k]) * sizeof(*block_diffs));
+	if (!block_diffs)
+		return 1;
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		const struct eraseblock *eb = &flash->chip->block_erasers[k].eraseblocks[i];
+		for (j = 0; j < eb->count; j++, start += eb->size, n++) {
+			block_diffs[n].start = start;
+			block_diffs[n].len = eb->size;
+		}
+	}
+	block_diff_count = n;
+	return 0;
+}
+
+static void free_block_diffs(void)
+{
+	free(block_diffs);
+	block_diffs = NULL;
+	block_diff_count = 0;
+}
+
+/* Combine the precomputed diffs of the blocks making up start/len into @sum. Returns false if there are none. */
+static bool sum_block_diffs(unsigned int start, unsigned int len, struct block_diff *sum)
+{
+	unsigned int lo = 0, hi = block_diff_count, i;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (block_diffs[mid].start < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo >= block_diff_count || block_diffs[lo].start != start)
+		return false;
+	sum->start = start;
+	sum->len = 0;
+	sum->changed = sum->nonblank = 0;
+	sum->need_erase = false;
+	for (i = lo; i < block_diff_count && sum->len < len; i++) {
+		sum->len += block_diffs[i].len;
+		sum->changed += block_diffs[i].changed;
+		sum->nonblank += block_diffs[i].nonblank;
+		sum->need_erase |= block_diffs[i].need_erase;
+	}
+	return sum->len == len;
+}
+
+/* Estimate the time needed to bring the block at start/len from curcontents to newcontents with eraser k. */
+static uint64_t estimate_block_cost(const struct flashctx *flash, int k, unsigned int start, unsigned int len,
+				    const uint8_t *curcontents, const uint8_t *newcontents)
+{
+	struct block_diff d;
+	unsigned int towrite;
+	uint64_t cost = 0;
+
+	/* Blocks outside the included regions are skipped without looking at their contents. */
+	if (known_ranges && !range_list_overlaps(known_ranges, start, len))
+		return 0;
+	if (!block_diffs || !sum_block_diffs(start, len, &d))
+		diff_block(flash, start, len, curcontents, newcontents, &d);
+	if (d.need_erase) {
+		cost += estimate_erase_time(flash, k, len);
+		if (flash->profile && flash->profile->read_bps)
+			cost += (uint64_t)len * 1000000000 / flash->profile->read_bps;
+		else
+			cost += (uint64_t)len * PLAN_READ_NSEC_PER_BYTE;
+		/* Everything that is not 0xff has to be rewritten after the erase. */
+		towrite = d.nonblank;
+	} else {
+		towrite = d.changed;
+	}
+	if (flash->profile && flash->profile->program_ns)
+		cost += (uint64_t)towrite * flash->profile->program_ns;
+	else if (flash->chip->typical_program_us && flash->chip->page_size)
+		cost += (uint64_t)towrite * flash->chip->typical_program_us * 1000 / flash->chip->page_size;
+	else
+		cost += (uint64_t)towrite * PLAN_WRITE_NSEC_PER_BYTE;
+	return cost;
+}
+
+/*
+ * Build a plan which covers the whole chip with blocks of possibly different erasers.
+ * The plan starts with the blocks of the finest usable eraser. Every block of a coarser eraser that covers a
+ * run of plan steps exactly replaces that run if it is estimated to be cheaper. This way sparse changes use
+ * small blocks while densely changed areas are erased with big blocks or even a chip erase.
+ * Returns 0 on success, the caller has to free *plan_out.
+ */
+static int build_erase_plan(const struct flashctx *flash, const uint8_t *curcontents, const uint8_t *newcontents,
+			    struct erase_plan_step **plan_out, unsigned int *steps_out)
+{
+	const struct flashchip *chip = flash->chip;
+	struct erase_plan_step *plan;
+	unsigned int steps = 0, maxblocks, blocks, i, j;
+	bool done[NUM_ERASEFUNCTIONS] = { false };
+	int k, base = find_finest_eraser(flash);
+
+	if (base < 0)
+		return 1;
+	maxblocks = count_eraseblocks(&chip->block_erasers[base]);
+
+	plan = malloc(maxblocks * sizeof(*plan));
+	if (!plan) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	unsigned int start = 0;
+	for (i = 0; i < NUM_ERASEREGIONS; i++) {
+		const struct eraseblock *eb = &chip->block_erasers[base].eraseblocks[i];
+		for (j = 0; j < eb->count; j++) {
+			plan[steps].start = start;
+			plan[steps].len = eb->size;
+			plan[steps].eraser = base;
+			plan[steps].cost = estimate_block_cost(flash, base, start, eb->size, curcontents,
+							       newcontents);
+			start += eb->size;
+			steps++;
+		}
+	}
+	done[base] = true;
+
+	/* Merge coarser erasers in the order of decreasing block count, i.e. from fine to coarse. */
+	while (1) {
+		int next = -1;
+		maxblocks = 0;
+		for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
+			if (done[k] || check_block_eraser(flash, k, 0))
+				continue;
+			blocks = count_eraseblocks(&chip->block_erasers[k]);
+			if (next < 0 || blocks > maxblocks) {
+				maxblocks = blocks;
+				next = k;
+			}
+		}
+		if (next < 0)
+			break;
+		done[next] = true;
+
+		unsigned int pos = 0;
+		start = 0;
+		for (i = 0; i < NUM_ERASEREGIONS; i++) {
+			const struct eraseblock *eb = &chip->block_erasers[next].eraseblocks[i];
+			for (j = 0; j < eb->count; j++, start += eb->size) {
+				unsigned int end = start + eb->size, last;
+				uint64_t sum = 0, cost;
+
+				while (pos < steps && plan[pos].start < start)
+					pos++;
+				if (pos >= steps || plan[pos].start != start)
+					continue;
+				/* Find the run of steps ending exactly at the end of this block. */
+				for (last = pos; last < steps && plan[last].start + plan[last].len < end; last++)
+					sum += plan[last].cost;
+				if (last >= steps || plan[last].start + plan[last].len != end)
+					continue;
+				/* Never erase contents which have not been read. */
+				if (known_ranges && !range_list_contains(known_ranges, start, eb->size) &&
+				    range_list_overlaps(known_ranges, start, eb->size))
+					continue;
+				sum += plan[last].cost;
+				cost = estimate_block_cost(flash, next, start, eb->size, curcontents, newcontents);
+				if (cost > sum)
+					continue;
+				plan[pos].len = eb->size;
+				plan[pos].eraser = next;
+				plan[pos].cost = cost;
+				memmove(&plan[pos + 1], &plan[last + 1], (steps - last - 1) * sizeof(*plan));
+				steps -= last - pos;
 			}
-			start += len;
 		}
 	}
-	msg_cdbg("\n");
+
+	/* The plan is about to change the contents. */
+	free_block_diffs();
+	*plan_out = plan;
+	*steps_out = steps;
 	return 0;
 }
 
-static int check_block_eraser(const struct flashctx *flash, int k, int log)
+static int walk_erase_plan(struct flashctx *flash, const struct erase_plan_step *plan, unsigned int steps,
+			   uint8_t *curcontents, uint8_t *newcontents)
 {
-	struct block_eraser eraser = flash->chip->block_erasers[k];
+	unsigned int i;
 
-	if (!eraser.block_erase && !eraser.eraseblocks[0].count) {
-		if (log)
-			msg_cdbg("not defined. ");
-		return 1;
-	}
-	if (!eraser.block_erase && eraser.eraseblocks[0].count) {
-		if (log)
-			msg_cdbg("eraseblock layout is known, but matching "
-				 "block erase function is not implemented. ");
-		return 1;
-	}
-	if (eraser.block_erase && !eraser.eraseblocks[0].count) {
-		if (log)
-			msg_cdbg("block erase function found, but "
-				 "eraseblock layout is not defined. ");
-		return 1;
+	for (i = 0; i < steps; i++) {
+		if (i)
+			msg_cdbg(", ");
+		msg_cdbg("0x%06x-0x%06x", plan[i].start, plan[i].start + plan[i].len - 1);
+		if (erase_and_write_block_helper(flash, plan[i].start, plan[i].len, curcontents, newcontents,
+						 flash->chip->block_erasers[plan[i].eraser].block_erase))
+			return 1;
+		update_progress(flash, PROGRESS_WRITE, plan[i].start + plan[i].len, flash->chip->total_size * 1024);
 	}
-	// TODO: Once erase functions are annotated with allowed buses, check that as well.
+	msg_cdbg("\n");
 	return 0;
 }
 
-int erase_and_write_flash(struct flashctx *flash, uint8_t *oldcontents, uint8_t *newcontents)
+/*
+ * Bring the chip from @curcontents to @newcontents. @curcontents is updated in place to track what is on
+ * the chip, so no copy of the chip contents is needed. Use original_contents_changed() to find out whether
+ * a failed attempt changed anything.
+ */
+int erase_and_write_flash(struct flashctx *flash, uint8_t *curcontents, uint8_t *newcontents)
 {
 	int k, ret = 1;
-	uint8_t *curcontents;
-	unsigned long size = flash->chip->total_size * 1024;
 	unsigned int usable_erasefunctions = count_usable_erasers(flash);
+	struct erase_plan_step *plan;
+	unsigned int steps;
 
 	msg_cinfo("Erasing and writing flash chip... ");
-	curcontents = malloc(size);
-	if (!curcontents) {
-		msg_gerr("Out of memory!\n");
-		exit(1);
+
+	/* With more than one eraser available, try to mix them to minimize the time spent. */
+	if (usable_erasefunctions > 1 && !build_erase_plan(flash, curcontents, newcontents, &plan, &steps)) {
+		unsigned int used[NUM_ERASEFUNCTIONS] = { 0 };
+		uint64_t total = 0;
+		unsigned int i;
+		for (i = 0; i < steps; i++) {
+			total += plan[i].cost;
+			used[plan[i].eraser]++;
+		}
+		msg_cdbg("Using erase plan with %u steps (estimated %llu ms", steps,
+			 (unsigned long long)(total / 1000000));
+		for (k = 0; k < NUM_ERASEFUNCTIONS; k++)
+			if (used[k])
+				msg_cdbg(", %u with eraser %i", used[k], k);
+		msg_cdbg(")... ");
+		ret = walk_erase_plan(flash, plan, steps, curcontents, newcontents);
+		free(plan);
+		if (!ret)
+			goto out;
+		if (reread_touched_contents(flash, curcontents)) {
+			msg_cerr("Can't read anymore! Aborting.\n");
+			goto out;
+		}
+		journal_forget();
+		msg_cinfo("done. Falling back to a single erase function.\n");
 	}
-	/* Copy oldcontents to curcontents to avoid clobbering oldcontents. */
-	memcpy(curcontents, oldcontents, size);
 
 	for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
 		if (k != 0)
@@ -1594,8 +3332,7 @@ int erase_and_write_flash(struct flashctx *flash, uint8_t *oldcontents, uint8_t
 		/* Reading the whole chip may take a while, inform the user even
 		 * in non-verbose mode.
 		 */
-		msg_cinfo("Reading current flash chip contents... ");
-		if (flash->chip->read(flash, curcontents, 0, size)) {
+		if (reread_touched_contents(flash, curcontents)) {
 			/* Now we are truly screwed. Read failed as well. */
 			msg_cerr("Can't read anymore! Aborting.\n");
 			/* We have no idea about the flash chip contents, so
@@ -1603,11 +3340,10 @@ int erase_and_write_flash(struct flashctx *flash, uint8_t *oldcontents, uint8_t
 			 */
 			break;
 		}
+		journal_forget();
 		msg_cinfo("done. ");
 	}
-	/* Free the scratchpad. */
-	free(curcontents);
-
+out:
 	if (ret) {
 		msg_cerr("FAILED!\n");
 	} else {
@@ -1950,24 +3686,130 @@ int chip_safety_check(const struct flashctx *flash, int force, int read_it, int
 	return 0;
 }
 
-/* This function signature is horrible. We need to design a better interface,
- * but right now it allows us to split off the CLI code.
- * Besides that, the function itself is a textbook example of abysmal code flow.
+/*
+ * Collect the dirty ranges widened by verify_guard bytes on each side in @ranges. Parts of the chip which were
+ * not read before writing can't be compared, hence the result is clipped to known_ranges.
+ * Returns 0 on success, 1 if the dirty ranges are unusable or memory allocation failed.
  */
-int doit(struct flashctx *flash, int force, const char *filename, int read_it,
-	 int write_it, int erase_it, int verify_it)
+static int get_verify_ranges(unsigned int size, struct range_list *ranges)
 {
-	uint8_t *oldcontents;
-	uint8_t *newcontents;
+	unsigned int i, j;
+
+	if (!dirty_ranges_complete)
+		return 1;
+	for (i = 0; i < dirty_ranges.count; i++) {
+		const struct range *r = &dirty_ranges.ranges[i];
+		unsigned int start = r->start > verify_guard ? r->start - verify_guard : 0;
+		unsigned int end = min(size - r->start - r->len, verify_guard) + r->start + r->len;
+
+		if (!known_ranges) {
+			if (range_list_add(ranges, start, end - start))
+				goto fail;
+			continue;
+		}
+		for (j = 0; j < known_ranges->count; j++) {
+			const struct range *k = &known_ranges->ranges[j];
+			unsigned int kstart = max(k->start, start);
+			unsigned int kend = min(k->start + k->len, end);
+			if (kstart < kend && range_list_add(ranges, kstart, kend - kstart))
+				goto fail;
+		}
+	}
+	return 0;
+fail:
+	range_list_free(ranges);
+	return 1;
+}
+
+/*
+ * Verify the chip against @newcontents after a write.
+ * Depending on verify_mode either all known contents (the whole chip unless only some layout regions were read),
+ * only the dirty ranges plus a guard band, the pages picked by sample_block() or the writes which weren't
+ * compared while writing are compared.
+ */
+static int verify_after_write(struct flashctx *flash, const uint8_t *newcontents)
+{
+	unsigned int size = flash->chip->total_size * 1024;
+	struct range_list ranges = { 0 };
+	const struct range_list *list = known_ranges;
+	unsigned int i;
 	int ret = 0;
-	unsigned long size = flash->chip->total_size * 1024;
-	int read_all_first = 1; /* FIXME: Make this configurable. */
 
+	if (verify_mode == VERIFY_WRITTEN) {
+		if (get_verify_ranges(size, &ranges)) {
+			msg_cwarn("List of written ranges is unusable, verifying everything. ");
+		} else {
+			msg_cdbg("Verifying %u written range%s. ", ranges.count, ranges.count == 1 ? "" : "s");
+			list = &ranges;
+		}
+	} else if (verify_mode == VERIFY_SAMPLE) {
+		if (!dirty_ranges_complete || !sample_ranges_complete) {
+			msg_cwarn("List of sampled pages is unusable, verifying everything. ");
+		} else {
+			unsigned int sampled = 0, written = 0;
+			for (i = 0; i < sample_ranges.count; i++)
+				sampled += sample_ranges.ranges[i].len;
+			for (i = 0; i < dirty_ranges.count; i++)
+				written += dirty_ranges.ranges[i].len;
+			msg_cinfo("Verifying %u bytes sampled from %u touched eraseblock%s (%u%% of %u bytes). ",
+				  sampled, sampled_blocks, sampled_blocks == 1 ? "" : "s",
+				  written ? (unsigned int)(100ULL * sampled / written) : 100, written);
+			list = &sample_ranges;
+		}
+	} else if (verify_mode == VERIFY_INLINE) {
+		if (!dirty_ranges_complete || !unverified_ranges_complete) {
+			msg_cwarn("List of unverified writes is unusable, verifying everything. ");
+		} else {
+			msg_cdbg("Verifying %u range%s not compared while writing. ", unverified_ranges.count,
+				 unverified_ranges.count == 1 ? "" : "s");
+			list = &unverified_ranges;
+		}
+	}
+	if (!list)
+		return verify_range(flash, newcontents, 0, size);
+
+	for (i = 0; i < list->count && !ret; i++) {
+		const struct range *r = &list->ranges[i];
+		ret = verify_range(flash, newcontents + r->start, r->start, r->len);
+	}
+	range_list_free(&ranges);
+	return ret;
+}
+
+/* Verify the included regions (or the whole chip) against @newcontents. */
+static int verify_included_ranges(struct flashctx *flash, const uint8_t *newcontents)
+{
+	struct range_list ranges = { 0 };
+	unsigned int i;
+	int ret = 0;
+
+	if (!layout_has_included_regions())
+		return verify_range(flash, newcontents, 0, flash->chip->total_size * 1024);
+
+	if (get_included_ranges(&ranges)) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	for (i = 0; i < ranges.count; i++) {
+		if (verify_range(flash, newcontents + ranges.ranges[i].start,
+				 ranges.ranges[i].start, ranges.ranges[i].len))
+			ret = 1;
+	}
+	range_list_free(&ranges);
+	return ret;
+}
+
+/* Checks and preparations common to all operations of doit(), doit_buffer() and benchmark_flash(). */
+int prepare_operation(struct flashctx *flash, int force, int read_it, int write_it, int erase_it, int verify_it)
+{
 	if (chip_safety_check(flash, force, read_it, write_it, erase_it, verify_it)) {
 		msg_cerr("Aborting.\n");
 		return 1;
 	}
 
+	reset_dirty_ranges();
+	all_skipped = true;
+
 	if (normalize_romentries(flash)) {
 		msg_cerr("Requested regions can not be handled. Aborting.\n");
 		return 1;
@@ -1978,30 +3820,135 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 	 */
 	if (flash->chip->unlock)
 		flash->chip->unlock(flash);
+	return 0;
+}
 
-	if (read_it) {
-		return read_flash_to_file(flash, filename);
-	}
+/* Read everything not in @resumed into @oldcontents. The resumed ranges are taken from @newcontents. */
+static int read_unresumed(struct flashctx *flash, uint8_t *oldcontents, const uint8_t *newcontents,
+			  const struct range_list *resumed)
+{
+	const unsigned int size = flash->chip->total_size * 1024;
+	unsigned int i, pos = 0;
 
-	oldcontents = malloc(size);
-	if (!oldcontents) {
-		msg_gerr("Out of memory!\n");
-		exit(1);
-	}
-	/* Assume worst case: All bits are 0. */
-	memset(oldcontents, 0x00, size);
-	newcontents = malloc(size);
-	if (!newcontents) {
-		msg_gerr("Out of memory!\n");
-		exit(1);
+	for (i = 0; i <= resumed->count; i++) {
+		unsigned int end = i < resumed->count ? resumed->ranges[i].start : size;
+		if (end > pos && flash->chip->read(flash, oldcontents + pos, pos, end - pos))
+			return 1;
+		if (i == resumed->count)
+			break;
+		memcpy(oldcontents + end, newcontents + end, resumed->ranges[i].len);
+		pos = end + resumed->ranges[i].len;
 	}
+	return 0;
+}
+
+/* Fill @newbuf with what an erase is supposed to leave behind. */
+static int erased_image_buffer(struct image_buffer *newbuf, unsigned long size)
+{
+	if (alloc_image_buffer(newbuf, size))
+		return 1;
 	/* Assume best case: All bits should be 1. */
-	memset(newcontents, 0xff, size);
+	memset(newbuf->data, 0xff, size);
 	/* Side effect of the assumptions above: Default write action is erase
 	 * because newcontents looks like a completely erased chip, and
 	 * oldcontents being completely 0x00 means we have to erase everything
 	 * before we can write.
 	 */
+	return 0;
+}
+
+/* Host-side preparation of a write, done while the old contents are being read. */
+struct prepare_ctx {
+	struct flashctx *flash;
+	const char *filename;		/* Image still to be loaded into newcontents, NULL if it is there */
+	const uint8_t *oldcontents;
+	uint8_t *newcontents;
+	unsigned int next;		/* First entry of block_diffs not compared yet */
+};
+
+static int prepare_chunk(void *arg, const uint8_t *buf, unsigned int start, unsigned int len)
+{
+	struct prepare_ctx *c = arg;
+	const unsigned int size = c->flash->chip->total_size * 1024;
+
+	/* Loading (and possibly decompressing) the image overlaps with reading the rest of the chip. */
+	if (c->filename) {
+		if (read_buf_from_file(c->newcontents, size, c->filename))
+			return 1;
+		c->filename = NULL;
+	}
+	for (; c->next < block_diff_count; c->next++) {
+		struct block_diff *d = &block_diffs[c->next];
+		if (d->start + d->len > start + len)
+			break;
+		diff_block(c->flash, d->start, d->len, c->oldcontents, c->newcontents, d);
+	}
+	update_progress(c->flash, PROGRESS_READ, start + len, size);
+	return 0;
+}
+
+/*
+ * Read the whole chip into @oldcontents. Meanwhile the image is loaded from @filename (unless NULL) on the
+ * pipeline's consumer thread and, if @diff, the blocks of the finest eraser are compared for the erase
+ * planner as soon as their old contents arrived.
+ */
+static int read_and_prepare(struct flashctx *flash, uint8_t *oldcontents, uint8_t *newcontents,
+			    const char *filename, bool diff)
+{
+	struct prepare_ctx c = {
+		.flash		= flash,
+		.filename	= filename,
+		.oldcontents	= oldcontents,
+		.newcontents	= newcontents,
+	};
+
+	if (diff && alloc_block_diffs(flash))
+		msg_gdbg2("Comparing the blocks later.\n");
+	if (read_flash_pipelined(flash, oldcontents, 0, flash->chip->total_size * 1024, prepare_chunk, &c)) {
+		free_block_diffs();
+		return 1;
+	}
+	return 0;
+}
+
+#if CONFIG_INTERNAL == 1
+/* Check that the image is for this board, unless overridden by the user. Returns 0 if it may be used. */
+static int check_board_image(uint8_t *newcontents, unsigned long size)
+{
+	if (programmer != PROGRAMMER_INTERNAL || cb_check_image(newcontents, size) >= 0)
+		return 0;
+	if (force_boardmismatch) {
+		msg_pinfo("Proceeding anyway because user forced us to.\n");
+		return 0;
+	}
+	msg_perr("Aborting. You can override this with -p internal:boardmismatch=force.\n");
+	return 1;
+}
+#endif
+
+/*
+ * Erase, write and/or verify the chip according to @newcontents, which has the size of the chip and is
+ * modified to also hold the contents outside of the included layout regions. If @pending_file is not NULL,
+ * @newcontents still has to be loaded from it; that is done while reading the chip if possible.
+ */
+static int do_write_verify(struct flashctx *flash, uint8_t *newcontents, const char *pending_file,
+			   int write_it, int erase_it, int verify_it)
+{
+	struct image_buffer oldbuf = { 0 };
+	uint8_t *oldcontents;
+	int ret = 0, changed;
+	unsigned long size = flash->chip->total_size * 1024;
+	/* If only some layout regions are to be written, there is no need to read anything else. */
+	int read_all_first = !layout_has_included_regions();
+	struct range_list included = { 0 }, resumed = { 0 };
+	bool cached = false;
+
+	if (alloc_image_buffer(&oldbuf, size))
+		return 1;
+	oldcontents = oldbuf.data;
+	/* Assume worst case: All bits are 0. A fresh mapping is zero-filled already. */
+	if (!oldbuf.mapped)
+		memset(oldcontents, 0x00, size);
 
 	if (erase_it) {
 		/* FIXME: Do we really want the scary warning if erase failed?
@@ -2010,6 +3957,24 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 		 * so if the user wanted erase and reboots afterwards, the user
 		 * knows very well that booting won't work.
 		 */
+		if (erase_skip_blank) {
+			/* With the real contents, blocks which are blank already don't need an erase. */
+			stats_set_phase(STATS_PHASE_READ);
+			msg_cinfo("Reading flash chip contents to find blank blocks... ");
+			if (read_flash_with_progress(flash, oldcontents, 0, size)) {
+				msg_cinfo("FAILED.\n");
+				ret = 1;
+				goto out;
+			}
+			if (buf_find_nonblank(oldcontents, size) == size) {
+				msg_cinfo("the chip is blank already.\n");
+				goto out;
+			}
+			msg_cinfo("done.\n");
+		}
+		stats_set_phase(STATS_PHASE_ERASE);
+		if (content_cache)
+			content_cache_invalidate(flash);
 		if (erase_and_write_flash(flash, oldcontents, newcontents)) {
 			emergency_help_message();
 			ret = 1;
@@ -2017,44 +3982,93 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 		goto out;
 	}
 
-	if (write_it || verify_it) {
-		if (read_buf_from_file(newcontents, size, filename)) {
+	/* Cached contents of the whole chip replace reading it. */
+	if (content_cache && write_it && read_all_first && !journal_path) {
+		stats_set_phase(STATS_PHASE_READ);
+		cached = !content_cache_load(flash, oldcontents);
+	}
+
+	/* Only a plain read of the whole chip can overlap with loading the image. */
+	if (pending_file && (cached || !read_all_first || journal_path ||
+			     (verify_it && !write_it && master_has_checksum(flash)))) {
+		if (read_buf_from_file(newcontents, size, pending_file)) {
 			ret = 1;
 			goto out;
 		}
-
+		pending_file = NULL;
+	}
 #if CONFIG_INTERNAL == 1
-		if (programmer == PROGRAMMER_INTERNAL && cb_check_image(newcontents, size) < 0) {
-			if (force_boardmismatch) {
-				msg_pinfo("Proceeding anyway because user forced us to.\n");
-			} else {
-				msg_perr("Aborting. You can override this with "
-					 "-p internal:boardmismatch=force.\n");
-				ret = 1;
-				goto out;
-			}
-		}
+	if (!pending_file && check_board_image(newcontents, size)) {
+		ret = 1;
+		goto out;
+	}
 #endif
+
+	/* If the master can checksum the flash contents itself, a plain verify
+	 * doesn't need to read anything up front.
+	 */
+	if (verify_it && !write_it && master_has_checksum(flash)) {
+		stats_set_phase(STATS_PHASE_VERIFY);
+		msg_cinfo("Verifying flash using checksums... ");
+		ret = verify_included_ranges(flash, newcontents);
+		if (!ret)
+			msg_cinfo("VERIFIED.\n");
+		goto out;
 	}
 
 	/* Read the whole chip to be able to check whether regions need to be
 	 * erased and to give better diagnostics in case write fails.
-	 * The alternative is to read only the regions which are to be
-	 * preserved, but in that case we might perform unneeded erase which
-	 * takes time as well.
+	 * If only some regions are included, read just the eraseblocks
+	 * touching them. Blocks outside are left alone by the erase/write code.
 	 */
-	if (read_all_first) {
+	stats_set_phase(STATS_PHASE_READ);
+	if (journal_path && !write_it) {
+		msg_cwarn("The journal is only used when writing.\n");
+	} else if (journal_path && !read_all_first) {
+		msg_cwarn("The journal can't be used when writing layout regions, ignoring it.\n");
+	} else if (journal_path && journal_start(flash, newcontents, &resumed)) {
+		ret = 1;
+		goto out;
+	}
+	if (cached) {
+		msg_cinfo("Using the cached old flash chip contents... ");
+	} else if (read_all_first && resumed.count) {
+		/* The resumed blocks already hold the new contents, only the rest has to be read. */
+		msg_cinfo("Reading the rest of the old flash chip contents... ");
+		if (read_unresumed(flash, oldcontents, newcontents, &resumed)) {
+			ret = 1;
+			msg_cinfo("FAILED.\n");
+			goto out;
+		}
+		/* The verify below must not be skipped even if nothing is left to write. */
+		all_skipped = false;
+	} else if (read_all_first) {
 		msg_cinfo("Reading old flash chip contents... ");
-		if (flash->chip->read(flash, oldcontents, 0, size)) {
+		if (read_and_prepare(flash, oldcontents, newcontents, pending_file,
+				     write_it && count_usable_erasers(flash) > 1)) {
+			ret = 1;
+			msg_cinfo("FAILED.\n");
+			goto out;
+		}
+	} else {
+		msg_cinfo("Reading old contents of the included regions... ");
+		if (read_included_blocks(flash, oldcontents, &included)) {
 			ret = 1;
 			msg_cinfo("FAILED.\n");
 			goto out;
 		}
+		known_ranges = &included;
 	}
 	msg_cinfo("done.\n");
+#if CONFIG_INTERNAL == 1
+	if (pending_file && check_board_image(newcontents, size)) {
+		ret = 1;
+		goto out;
+	}
+#endif
 
 	/* Build a new image taking the given layout into account. */
-	if (build_new_image(flash, read_all_first, oldcontents, newcontents)) {
+	if (build_new_image(flash, true, oldcontents, newcontents, known_ranges)) {
 		msg_gerr("Could not prepare the data to be written, aborting.\n");
 		ret = 1;
 		goto out;
@@ -2062,26 +4076,25 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 
 	// ////////////////////////////////////////////////////////////
 
+	if (write_it)
+		stats_set_phase(STATS_PHASE_WRITE);
+	if (write_it && content_cache)
+		content_cache_invalidate(flash);
 	if (write_it && erase_and_write_flash(flash, oldcontents, newcontents)) {
-		msg_cerr("Uh oh. Erase/write failed. ");
-		if (read_all_first) {
-			msg_cerr("Checking if anything has changed.\n");
-			msg_cinfo("Reading current flash chip contents... ");
-			if (!flash->chip->read(flash, newcontents, 0, size)) {
-				msg_cinfo("done.\n");
-				if (!memcmp(oldcontents, newcontents, size)) {
-					nonfatal_help_message();
-					ret = 1;
-					goto out;
-				}
-				msg_cerr("Apparently at least some data has changed.\n");
-			} else
-				msg_cerr("Can't even read anymore!\n");
-			emergency_help_message();
-			ret = 1;
-			goto out;
+		msg_cerr("Uh oh. Erase/write failed. Checking if anything has changed.\n");
+		msg_cinfo("Reading current flash chip contents... ");
+		/* Only the parts which were erased or written can have changed. */
+		changed = original_contents_changed(flash);
+		if (changed >= 0) {
+			msg_cinfo("done.\n");
+			if (!changed) {
+				nonfatal_help_message();
+				ret = 1;
+				goto out;
+			}
+			msg_cerr("Apparently at least some data has changed.\n");
 		} else
-			msg_cerr("\n");
+			msg_cerr("Can't even read anymore!\n");
 		emergency_help_message();
 		ret = 1;
 		goto out;
@@ -2089,12 +4102,16 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 
 	/* Verify only if we either did not try to write (verify operation) or actually changed something. */
 	if (verify_it && (!write_it || !all_skipped)) {
+		stats_set_phase(STATS_PHASE_VERIFY);
 		msg_cinfo("Verifying flash... ");
 
 		if (write_it) {
-			/* Work around chips which need some time to calm down. */
-			programmer_delay(1000*1000);
-			ret = verify_range(flash, newcontents, 0, size);
+			/* Work around chips which need some time to calm down. Pages compared while
+			 * writing were read long after that already. */
+			if (verify_mode != VERIFY_INLINE || unverified_ranges.count || !unverified_ranges_complete ||
+			    !dirty_ranges_complete)
+				programmer_delay(1000*1000);
+			ret = verify_after_write(flash, newcontents);
 			/* If we tried to write, and verification now fails, we
 			 * might have an emergency situation.
 			 */
@@ -2106,9 +4123,87 @@ int doit(struct flashctx *flash, int force, const char *filename, int read_it,
 		if (!ret)
 			msg_cinfo("VERIFIED.\n");
 	}
+	/* Only keep contents which were verified as a whole or left alone, other verifies skip parts. */
+	if (!ret && write_it && content_cache && read_all_first &&
+	    ((verify_it && verify_mode == VERIFY_FULL) || all_skipped))
+		content_cache_store(flash, newcontents);
 
 out:
-	free(oldcontents);
-	free(newcontents);
+	stats_set_phase(STATS_PHASE_OTHER);
+	journal_finish(!ret);
+	known_ranges = NULL;
+	range_list_free(&included);
+	range_list_free(&resumed);
+	free_block_diffs();
+	reset_dirty_ranges();
+	free_image_buffer(&oldbuf);
+	return ret;
+}
+
+/* This function signature is horrible. We need to design a better interface,
+ * but right now it allows us to split off the CLI code.
+ * Besides that, the function itself is a textbook example of abysmal code flow.
+ */
+int doit(struct flashctx *flash, int force, const char *filename, int read_it,
+	 int write_it, int erase_it, int verify_it)
+{
+	struct image_buffer newbuf = { 0 };
+	unsigned long size = flash->chip->total_size * 1024;
+	bool pending;
+	int ret;
+
+	if (prepare_operation(flash, force, read_it, write_it, erase_it, verify_it))
+		return 1;
+
+	if (read_it) {
+		return read_flash_to_file(flash, filename);
+	}
+
+	if (write_it || verify_it) {
+		/* A mapped image is paged in on demand anyway, anything else is loaded while reading the chip. */
+		if (load_image_file(&newbuf, size, filename, &pending)) {
+			free_image_buffer(&newbuf);
+			return 1;
+		}
+		if (!pending)
+			filename = NULL;
+	} else {
+		if (erased_image_buffer(&newbuf, size))
+			return 1;
+		filename = NULL;
+	}
+	ret = do_write_verify(flash, newbuf.data, filename, write_it, erase_it, verify_it);
+	free_image_buffer(&newbuf);
+	return ret;
+}
+
+/*
+ * Like doit(), but with the image in memory: read the chip into @buf or erase, write and/or verify it
+ * according to @buf, which has to be as big as the chip. @buf is not modified by writes and verifies and
+ * ignored (may be NULL) for erases.
+ */
+int doit_buffer(struct flashctx *flash, int force, uint8_t *buf, int read_it, int write_it, int erase_it,
+		int verify_it)
+{
+	struct image_buffer newbuf = { 0 };
+	unsigned long size = flash->chip->total_size * 1024;
+	int ret;
+
+	if (prepare_operation(flash, force, read_it, write_it, erase_it, verify_it))
+		return 1;
+
+	if (read_it)
+		return read_flash_to_buffer(flash, buf);
+
+	if (write_it || verify_it) {
+		/* The image is completed with the preserved chip contents, so work on a copy. */
+		if (alloc_image_buffer(&newbuf, size))
+			return 1;
+		memcpy(newbuf.data, buf, size);
+	} else if (erased_image_buffer(&newbuf, size)) {
+		return 1;
+	}
+	ret = do_write_verify(flash, newbuf.data, NULL, write_it, erase_it, verify_it);
+	free_image_buffer(&newbuf);
 	return ret;
 }
@@ -27,7 +27,9 @@
 #include <ctype.h>
 #include "flash.h"
 #include "programmer.h"
+#include "chipdrivers.h"
 #include "spi.h"
+#include "probes.h"
 #include <ftdi.h>
 
 /* This is not defined in libftdi.h <0.20 (c7e4c09e68cfa6f5e112334aa1b3bb23401c8dc7 to be exact).
@@ -93,7 +95,35 @@ const struct dev_entry devs_ft2232spi[] = {
  */
 static uint8_t cs_bits = 0x08;
 static uint8_t pindir = 0x0b;
-static struct ftdi_context ftdic_context;
+/* SPI clock in kHz, 0 if the chip can't clock the bus without transferring data. */
+static unsigned int clocked_delay_khz;
+/* MPSSE clock in kHz, the SPI clock is this divided by the divisor. */
+static unsigned int mpsse_khz;
+/* Divisors tried by divisor=auto and the resulting SPI clocks, filled in by ft2232_spi_init(). */
+static const uint32_t auto_divisors[] = { 120, 60, 30, 20, 12, 10, 8, 6, 4, 2 };
+static unsigned int ft2232_speeds_khz[ARRAY_SIZE(auto_divisors) + 1];
+
+/* Not defined in older libftdi versions. */
+#ifndef CLK_BYTES
+#define CLK_BYTES	0x8f
+#endif
+
+/* Longest MPSSE transfer (in bytes) of a single read or write command. */
+#define MPSSE_MAX_LEN	65536
+/* Longest delay spent clocking the bus inside a command buffer instead of on the host. */
+#define MAX_CLOCKED_DELAY_US	10000
+/* Status register reads appended to a command buffer for each queued poll. */
+#define POLLS_PER_BUFFER	4
+/*
+ * Most data read from the chip in one transfer. Without asynchronous transfers everything is written before
+ * anything is read, so the responses have to fit into the smallest FIFO of all supported chips (FT2232D: 384 B),
+ * else the MPSSE engine stalls and the write never completes.
+ */
+#if defined(HAVE_FTDI_ASYNC)
+#define MAX_BATCH_READ	(256 * 1024)
+#else
+#define MAX_BATCH_READ	256
+#endif
 
 static const char *get_ft2232_devicename(int ft2232_vid, int ft2232_type)
 {
@@ -127,6 +157,7 @@ static int send_buf(struct ftdi_context *ftdic, const unsigned char *buf,
 	return 0;
 }
 
+#if !defined(HAVE_FTDI_ASYNC)
 static int get_buf(struct ftdi_context *ftdic, const unsigned char *buf,
 		   int size)
 {
@@ -143,33 +174,417 @@ static int get_buf(struct ftdi_context *ftdic, const unsigned char *buf,
 	}
 	return 0;
 }
+#endif
+
+/*
+ * Write @wlen bytes of MPSSE commands and read the @rlen bytes of data they return. With asynchronous transfers
+ * the read is already pending while the commands are written, so the responses are collected as they arrive
+ * and the amount of data doesn't depend on the FIFO sizes of the chip.
+ */
+static int ft2232_do_transfer(struct ftdi_context *ftdic, const unsigned char *wbuf, unsigned int wlen,
+			      unsigned char *rbuf, unsigned int rlen)
+{
+#if defined(HAVE_FTDI_ASYNC)
+	struct ftdi_transfer_control *rtc = NULL, *wtc;
+	int ret = 0;
+
+	if (rlen) {
+		rtc = ftdi_read_data_submit(ftdic, rbuf, rlen);
+		if (!rtc) {
+			msg_perr("ftdi_read_data_submit failed: %s\n", ftdi_get_error_string(ftdic));
+			return 1;
+		}
+	}
+	wtc = ftdi_write_data_submit(ftdic, (unsigned char *)wbuf, wlen);
+	if (!wtc || ftdi_transfer_data_done(wtc) < 0) {
+		msg_perr("ftdi_write_data_submit failed: %s\n", ftdi_get_error_string(ftdic));
+		ret = 1;
+	}
+	/* The read has to be completed (or cancelled) in any case. */
+	if (rtc && ftdi_transfer_data_done(rtc) != (int)rlen && !ret) {
+		msg_perr("ftdi_read_data_submit failed: %s\n", ftdi_get_error_string(ftdic));
+		ret = 1;
+	}
+	return ret;
+#else
+	if (send_buf(ftdic, wbuf, wlen))
+		return 1;
+	if (rlen && get_buf(ftdic, rbuf, rlen))
+		return 1;
+	return 0;
+#endif
+}
+
+static int ft2232_transfer(struct ftdi_context *ftdic, const unsigned char *wbuf, unsigned int wlen,
+			   unsigned char *rbuf, unsigned int rlen)
+{
+	int ret;
+
+	FLASHROM_PROBE2(ftdi_transfer_start, wlen, rlen);
+	ret = ft2232_do_transfer(ftdic, wbuf, wlen, rbuf, rlen);
+	FLASHROM_PROBE3(ftdi_transfer_done, wlen, rlen, ret);
+	return ret;
+}
+
+/*
+ * Every channel (port) of the device is registered as a master of its own. The channels have their own USB
+ * endpoints and MPSSE engines, nothing but the clock setup is shared, so they are probed concurrently.
+ */
+struct ft2232_channel {
+	struct ftdi_context ftdic;
+	const struct registered_master *mst;
+	/* The command and read buffers, grown as needed. Never shrink, realloc() calls are expensive. */
+	unsigned char *cmdbuf;
+	unsigned int cmdbuf_size;
+	unsigned char *rbuf;
+	unsigned int rbuf_size;
+};
+
+static struct ft2232_channel channels[4];
+static unsigned int channels_open;
+
+static struct ft2232_channel *get_channel(const struct flashctx *flash)
+{
+	unsigned int i;
+
+	for (i = 1; i < channels_open; i++)
+		if (channels[i].mst == flash->mst)
+			return &channels[i];
+	return &channels[0];
+}
+
+static int grow_buf(unsigned char **buf, unsigned int *buf_size, unsigned int size)
+{
+	unsigned char *tmp;
+
+	if (size <= *buf_size)
+		return 0;
+	tmp = realloc(*buf, size);
+	if (!tmp) {
+		msg_perr("Out of memory!\n");
+		return 1;
+	}
+	*buf = tmp;
+	*buf_size = size;
+	return 0;
+}
+
+/* Space in the command buffer needed by put_command(). */
+static unsigned int command_len(unsigned int writecnt, unsigned int readcnt)
+{
+	return 3 + (writecnt ? 3 + writecnt : 0) + (readcnt + MPSSE_MAX_LEN - 1) / MPSSE_MAX_LEN * 3 + 3;
+}
+
+/* Append a complete SPI command (assert CS#, write, read, deassert CS#) at @buf, return its length. */
+static unsigned int put_command(unsigned char *buf, const struct spi_command *cmd)
+{
+	const unsigned int writecnt = cmd->writecnt + cmd->datacnt;
+	unsigned int i = 0, n, readcnt;
+
+	buf[i++] = SET_BITS_LOW;
+	buf[i++] = 0 & ~cs_bits; /* assertive */
+	buf[i++] = pindir;
+	if (writecnt) {
+		buf[i++] = MPSSE_DO_WRITE | MPSSE_WRITE_NEG;
+		buf[i++] = (writecnt - 1) & 0xff;
+		buf[i++] = ((writecnt - 1) >> 8) & 0xff;
+		memcpy(buf + i, cmd->writearr, cmd->writecnt);
+		i += cmd->writecnt;
+		if (cmd->datacnt)
+			memcpy(buf + i, cmd->data, cmd->datacnt);
+		i += cmd->datacnt;
+	}
+	readcnt = cmd->readcnt;
+	for (; readcnt; readcnt -= n) {
+		n = min(readcnt, MPSSE_MAX_LEN);
+		buf[i++] = MPSSE_DO_READ;
+		buf[i++] = (n - 1) & 0xff;
+		buf[i++] = ((n - 1) >> 8) & 0xff;
+	}
+	buf[i++] = SET_BITS_LOW;
+	buf[i++] = cs_bits;
+	buf[i++] = pindir;
+	return i;
+}
+
+/* Space in the command buffer needed by put_delay() at most. */
+#define DELAY_LEN	(3 * 8)
+
+/* Append clocking the bus with CS# deasserted for about @usecs, if the chip can do that. */
+static unsigned int put_delay(unsigned char *buf, unsigned int usecs)
+{
+	unsigned int i = 0, n, bytes;
+
+	bytes = (min(usecs, MAX_CLOCKED_DELAY_US) * clocked_delay_khz + 7999) / 8000;
+	for (; bytes; bytes -= n) {
+		n = min(bytes, MPSSE_MAX_LEN);
+		buf[i++] = CLK_BYTES;
+		buf[i++] = (n - 1) & 0xff;
+		buf[i++] = ((n - 1) >> 8) & 0xff;
+	}
+	return i;
+}
+
+/* Can the plain delay @op be clocked inside a command buffer? */
+static bool clocked_delay(const struct spi_queued_op *op)
+{
+	return clocked_delay_khz && op->expected_us <= MAX_CLOCKED_DELAY_US;
+}
 
+/* Returns 0 upon success, a negative number upon errors. */
 static int ft2232_spi_send_command(struct flashctx *flash,
 				   unsigned int writecnt, unsigned int readcnt,
 				   const unsigned char *writearr,
-				   unsigned char *readarr);
+				   unsigned char *readarr)
+{
+	const struct spi_command cmd = { writecnt, readcnt, writearr, readarr };
+	struct ft2232_channel *ch = get_channel(flash);
+	unsigned int i;
+
+	if (writecnt > MPSSE_MAX_LEN || readcnt > MPSSE_MAX_LEN)
+		return SPI_INVALID_LENGTH;
+	if (grow_buf(&ch->cmdbuf, &ch->cmdbuf_size, command_len(writecnt, readcnt) + 1))
+		return SPI_GENERIC_ERROR;
+
+	/* Everything goes into one buffer. The chip sends the response as soon as the read is done. */
+	i = put_command(ch->cmdbuf, &cmd);
+	if (readcnt)
+		ch->cmdbuf[i++] = SEND_IMMEDIATE;
+	if (ft2232_transfer(&ch->ftdic, ch->cmdbuf, i, readarr, readcnt))
+		return -1;
+	return 0;
+}
+
+/*
+ * Run the queued commands in as few transfers as possible. Reads are collected in a bounce buffer and copied
+ * to their destinations afterwards. A transfer ends after each poll: the commands are followed by clocking the
+ * bus for the expected time and a few status register reads. Only if none of them shows the chip ready, the
+ * poll continues from the host. Everything after a poll has to wait for its outcome. Plain delays (polls with
+ * a mask of 0) are clocked inside the transfer if they are short enough, else they end it as well.
+ */
+static int ft2232_spi_queue(struct flashctx *flash, const struct spi_queued_op *ops, unsigned int count)
+{
+	static const unsigned char rdsr_op[] = { JEDEC_RDSR };
+	static const struct spi_command rdsr = { JEDEC_RDSR_OUTSIZE, 1, rdsr_op, NULL };
+	struct ft2232_channel *ch = get_channel(flash);
+	unsigned char *cmdbuf, *rbuf;
+	unsigned int first, last, i, j, len, rlen, step, expected;
+
+	for (first = 0; first < count; first = last) {
+		/* Find out how much fits into one transfer. */
+		len = 1;
+		rlen = 0;
+		for (last = first; last < count; last++) {
+			const struct spi_queued_op *op = &ops[last];
+			if (op->poll && !op->mask) {
+				len += DELAY_LEN;
+				if (!clocked_delay(op)) {
+					last++;
+					break;
+				}
+				continue;
+			}
+			if (op->poll) {
+				len += POLLS_PER_BUFFER * (DELAY_LEN + command_len(JEDEC_RDSR_OUTSIZE, 1));
+				rlen += POLLS_PER_BUFFER;
+				last++;
+				break;
+			}
+			if (op->cmd.writecnt + op->cmd.datacnt > MPSSE_MAX_LEN)
+				return SPI_INVALID_LENGTH;
+			if (last > first && rlen + op->cmd.readcnt > MAX_BATCH_READ)
+				break;
+			len += command_len(op->cmd.writecnt + op->cmd.datacnt, op->cmd.readcnt);
+			rlen += op->cmd.readcnt;
+		}
+		if (grow_buf(&ch->cmdbuf, &ch->cmdbuf_size, len) || grow_buf(&ch->rbuf, &ch->rbuf_size, rlen))
+			return SPI_GENERIC_ERROR;
+		cmdbuf = ch->cmdbuf;
+		rbuf = ch->rbuf;
+
+		len = 0;
+		for (i = first; i < last; i++) {
+			const struct spi_queued_op *op = &ops[i];
+			if (!op->poll) {
+				len += put_command(cmdbuf + len, &op->cmd);
+				continue;
+			}
+			if (!op->mask) {
+				if (clocked_delay(op))
+					len += put_delay(cmdbuf + len, op->expected_us);
+				continue;
+			}
+			step = max(op->expected_us / 8, 10);
+			for (j = 0; j < POLLS_PER_BUFFER; j++) {
+				len += put_delay(cmdbuf + len, j ? step : op->expected_us);
+				len += put_command(cmdbuf + len, &rdsr);
+				if (j)
+					step = min(step * 2, op->max_step_us);
+			}
+		}
+		if (rlen)
+			cmdbuf[len++] = SEND_IMMEDIATE;
+		if (ft2232_transfer(&ch->ftdic, cmdbuf, len, rbuf, rlen))
+			return -1;
+
+		rlen = 0;
+		for (i = first; i < last; i++) {
+			const struct spi_queued_op *op = &ops[i];
+			if (!op->poll) {
+				if (op->cmd.readcnt)
+					memcpy(op->cmd.readarr, rbuf + rlen, op->cmd.readcnt);
+				rlen += op->cmd.readcnt;
+				continue;
+			}
+			if (!op->mask) {
+				if (!clocked_delay(op))
+					programmer_delay(op->expected_us);
+				continue;
+			}
+			for (j = 0; j < POLLS_PER_BUFFER; j++)
+				if ((rbuf[rlen + j] & op->mask) == op->value)
+					break;
+			rlen += POLLS_PER_BUFFER;
+			if (j == POLLS_PER_BUFFER) {
+				/* Still busy, keep polling from here. */
+				expected = clocked_delay_khz ? op->max_step_us : op->expected_us;
+				spi_poll_status_register(flash, op->mask, op->value, expected, op->max_step_us);
+			}
+		}
+	}
+	return 0;
+}
+
+static int ft2232_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds)
+{
+	struct spi_queued_op ops[8];
+	unsigned int n;
+
+	/* Short sequences (like WREN and a write) become a single transfer. */
+	while (cmds->writecnt || cmds->readcnt) {
+		memset(ops, 0, sizeof(ops));
+		for (n = 0; n < ARRAY_SIZE(ops) && (cmds->writecnt || cmds->readcnt); n++)
+			ops[n].cmd = *cmds++;
+		if (ft2232_spi_queue(flash, ops, n))
+			return -1;
+	}
+	return 0;
+}
+
+/* The SPI clock is the same on all channels. */
+static int ft2232_set_divisor(uint32_t divisor)
+{
+	unsigned char buf[3];
+	unsigned int i;
+
+	msg_pdbg("Set clock divisor\n");
+	buf[0] = TCK_DIVISOR;
+	buf[1] = (divisor / 2 - 1) & 0xff;
+	buf[2] = ((divisor / 2 - 1) >> 8) & 0xff;
+	for (i = 0; i < channels_open; i++)
+		if (send_buf(&channels[i].ftdic, buf, 3))
+			return 1;
+	if (clocked_delay_khz)
+		clocked_delay_khz = mpsse_khz / divisor;
+	return 0;
+}
+
+static int ft2232_set_spi_speed(unsigned int khz)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(auto_divisors); i++)
+		if (ft2232_speeds_khz[i] == khz)
+			return ft2232_set_divisor(auto_divisors[i]);
+	return 1;
+}
 
 static const struct spi_master spi_master_ft2232 = {
 	.type		= SPI_CONTROLLER_FT2232,
 	.max_data_read	= 64 * 1024,
 	.max_data_write	= 256,
 	.command	= ft2232_spi_send_command,
-	.multicommand	= default_spi_send_multicommand,
+	.multicommand	= ft2232_spi_send_multicommand,
+	.gather		= true,
 	.read		= default_spi_read,
 	.write_256	= default_spi_write_256,
 	.write_aai	= default_spi_write_aai,
+	.queue		= ft2232_spi_queue,
+	.speeds_khz	= ft2232_speeds_khz,
+	.set_speed	= ft2232_set_spi_speed,
 };
 
+static void ft2232_close_channels(void)
+{
+	int f;
+
+	while (channels_open) {
+		struct ft2232_channel *ch = &channels[--channels_open];
+		if ((f = ftdi_usb_close(&ch->ftdic)) < 0)
+			msg_perr("Unable to close FTDI device: %d (%s)\n", f, ftdi_get_error_string(&ch->ftdic));
+		ftdi_deinit(&ch->ftdic);
+		free(ch->cmdbuf);
+		free(ch->rbuf);
+		memset(ch, 0, sizeof(*ch));
+	}
+}
+
+static int ft2232_spi_shutdown(void *data)
+{
+	ft2232_close_channels();
+	return 0;
+}
+
+/* Open channel @port ('A' to 'D') of the device, returns 0 upon success, a negative number upon errors. */
+static int ft2232_open_channel(struct ft2232_channel *ch, char port, int vid, int type, const char *serial)
+{
+	struct ftdi_context *ftdic = &ch->ftdic;
+	int f;
+
+	if (ftdi_init(ftdic) < 0) {
+		msg_perr("ftdi_init failed.\n");
+		return -3;
+	}
+
+	if (ftdi_set_interface(ftdic, INTERFACE_A + port - 'A') < 0) {
+		msg_perr("Unable to select channel %c (%s).\n", port, ftdi_get_error_string(ftdic));
+	}
+
+	f = ftdi_usb_open_desc(ftdic, vid, type, NULL, serial);
+	if (f < 0 && f != -5) {
+		msg_perr("Unable to open FTDI device: %d (%s).\n", f, ftdi_get_error_string(ftdic));
+		ftdi_deinit(ftdic);
+		return -4;
+	}
+
+	if (ftdi_usb_reset(ftdic) < 0) {
+		msg_perr("Unable to reset FTDI device (%s).\n", ftdi_get_error_string(ftdic));
+	}
+
+	if (ftdi_set_latency_timer(ftdic, 2) < 0) {
+		msg_perr("Unable to set latency timer (%s).\n", ftdi_get_error_string(ftdic));
+	}
+
+	if (ftdi_write_data_set_chunksize(ftdic, 256)) {
+		msg_perr("Unable to set chunk size (%s).\n", ftdi_get_error_string(ftdic));
+	}
+
+	if (ftdi_set_bitmode(ftdic, 0x00, BITMODE_BITBANG_SPI) < 0) {
+		msg_perr("Unable to set bitmode to SPI (%s).\n", ftdi_get_error_string(ftdic));
+	}
+	return 0;
+}
+
 /* Returns 0 upon success, a negative number upon errors. */
 int ft2232_spi_init(void)
 {
 	int ret = 0;
-	struct ftdi_context *ftdic = &ftdic_context;
 	unsigned char buf[512];
 	int ft2232_vid = FTDI_VID;
 	int ft2232_type = FTDI_FT4232H_PID;
 	int channel_count = 4; /* Stores the number of channels of the device. */
-	enum ftdi_interface ft2232_interface = INTERFACE_A;
+	char ports[ARRAY_SIZE(channels)];
+	unsigned int nports = 0;
 	/*
 	 * The 'H' chips can run with an internal clock of either 12 MHz or 60 MHz,
 	 * but the non-H chips can only run at 12 MHz. We enable the divide-by-5
@@ -185,8 +600,10 @@ int ft2232_spi_init(void)
 	 * 92 Hz for 12 MHz inputs.
 	 */
 	uint32_t divisor = DEFAULT_DIVISOR;
-	int f;
-	char *arg;
+	bool autospeed = false;
+	unsigned int i;
+	int c;
+	char *arg, *serial;
 	double mpsse_clk;
 
 	arg = extract_programmer_param("type");
@@ -264,39 +681,26 @@ int ft2232_spi_init(void)
 
 	arg = extract_programmer_param("port");
 	if (arg) {
-		switch (toupper((unsigned char)*arg)) {
-		case 'A':
-			ft2232_interface = INTERFACE_A;
-			break;
-		case 'B':
-			ft2232_interface = INTERFACE_B;
-			if (channel_count < 2)
-				channel_count = -1;
-			break;
-		case 'C':
-			ft2232_interface = INTERFACE_C;
-			if (channel_count < 3)
-				channel_count = -1;
-			break;
-		case 'D':
-			ft2232_interface = INTERFACE_D;
-			if (channel_count < 4)
-				channel_count = -1;
-			break;
-		default:
-			channel_count = -1;
-			break;
+		for (i = 0; arg[i]; i++) {
+			c = toupper((unsigned char)arg[i]);
+			if (c < 'A' || c >= 'A' + channel_count || memchr(ports, c, nports))
+				break;
+			ports[nports++] = c;
 		}
-		if (channel_count < 0 || strlen(arg) != 1) {
+		if (!nports || arg[i]) {
 			msg_perr("Error: Invalid channel/port/interface specified: \"%s\".\n", arg);
 			free(arg);
 			return -2;
 		}
+	} else {
+		ports[nports++] = 'A';
 	}
 	free(arg);
 
 	arg = extract_programmer_param("divisor");
-	if (arg && strlen(arg)) {
+	if (arg && !strcasecmp(arg, "auto")) {
+		autospeed = true;
+	} else if (arg && strlen(arg)) {
 		unsigned int temp = 0;
 		char *endptr;
 		temp = strtoul(arg, &endptr, 10);
@@ -310,192 +714,111 @@ int ft2232_spi_init(void)
 		}
 	}
 	free(arg);
+	/* The clock is checked on one chip only, but the divisor applies to every channel. */
+	if (autospeed && nports > 1) {
+		msg_perr("Error: divisor=auto can only be used with a single port.\n");
+		return -2;
+	}
 
 	msg_pdbg("Using device type %s %s ",
 		 get_ft2232_vendorname(ft2232_vid, ft2232_type),
 		 get_ft2232_devicename(ft2232_vid, ft2232_type));
-	msg_pdbg("channel %s.\n",
-		 (ft2232_interface == INTERFACE_A) ? "A" :
-		 (ft2232_interface == INTERFACE_B) ? "B" :
-		 (ft2232_interface == INTERFACE_C) ? "C" : "D");
-
-	if (ftdi_init(ftdic) < 0) {
-		msg_perr("ftdi_init failed.\n");
-		return -3;
-	}
-
-	if (ftdi_set_interface(ftdic, ft2232_interface) < 0) {
-		msg_perr("Unable to select channel (%s).\n", ftdi_get_error_string(ftdic));
+	msg_pdbg("channel %.*s.\n", (int)nports, ports);
+
+	serial = extract_programmer_param("serial");
+	if (autospeed) {
+		char instance[128];
+		if (serial)
+			snprintf(instance, sizeof(instance), "ft2232_spi:%s:%.*s", serial, (int)nports, ports);
+		else
+			snprintf(instance, sizeof(instance), "ft2232_spi:%04x:%04x:%.*s", ft2232_vid, ft2232_type,
+				 (int)nports, ports);
+		if (spi_request_autospeed(instance)) {
+			free(serial);
+			return -3;
+		}
 	}
-
-	arg = extract_programmer_param("serial");
-	f = ftdi_usb_open_desc(ftdic, ft2232_vid, ft2232_type, NULL, arg);
-	free(arg);
-
-	if (f < 0 && f != -5) {
-		msg_perr("Unable to open FTDI device: %d (%s).\n", f, ftdi_get_error_string(ftdic));
-		return -4;
+	for (i = 0; i < nports; i++) {
+		ret = ft2232_open_channel(&channels[i], ports[i], ft2232_vid, ft2232_type, serial);
+		if (ret)
+			break;
+		channels_open++;
 	}
+	free(serial);
+	if (ret)
+		goto ftdi_err;
 
-	if (ftdic->type != TYPE_2232H && ftdic->type != TYPE_4232H && ftdic->type != TYPE_232H) {
-		msg_pdbg("FTDI chip type %d is not high-speed.\n", ftdic->type);
+	if (channels[0].ftdic.type != TYPE_2232H && channels[0].ftdic.type != TYPE_4232H &&
+	    channels[0].ftdic.type != TYPE_232H) {
+		msg_pdbg("FTDI chip type %d is not high-speed.\n", channels[0].ftdic.type);
 		clock_5x = 0;
 	}
 
-	if (ftdi_usb_reset(ftdic) < 0) {
-		msg_perr("Unable to reset FTDI device (%s).\n", ftdi_get_error_string(ftdic));
-	}
-
-	if (ftdi_set_latency_timer(ftdic, 2) < 0) {
-		msg_perr("Unable to set latency timer (%s).\n", ftdi_get_error_string(ftdic));
-	}
-
-	if (ftdi_write_data_set_chunksize(ftdic, 256)) {
-		msg_perr("Unable to set chunk size (%s).\n", ftdi_get_error_string(ftdic));
-	}
-
-	if (ftdi_set_bitmode(ftdic, 0x00, BITMODE_BITBANG_SPI) < 0) {
-		msg_perr("Unable to set bitmode to SPI (%s).\n", ftdi_get_error_string(ftdic));
-	}
-
 	if (clock_5x) {
 		msg_pdbg("Disable divide-by-5 front stage\n");
 		buf[0] = 0x8a; /* Disable divide-by-5. DIS_DIV_5 in newer libftdi */
-		if (send_buf(ftdic, buf, 1)) {
-			ret = -5;
-			goto ftdi_err;
+		for (i = 0; i < channels_open; i++) {
+			if (send_buf(&channels[i].ftdic, buf, 1)) {
+				ret = -5;
+				goto ftdi_err;
+			}
 		}
 		mpsse_clk = 60.0;
 	} else {
 		mpsse_clk = 12.0;
 	}
 
-	msg_pdbg("Set clock divisor\n");
-	buf[0] = TCK_DIVISOR;
-	buf[1] = (divisor / 2 - 1) & 0xff;
-	buf[2] = ((divisor / 2 - 1) >> 8) & 0xff;
-	if (send_buf(ftdic, buf, 3)) {
+	mpsse_khz = mpsse_clk * 1000;
+	for (i = 0; i < ARRAY_SIZE(auto_divisors); i++)
+		ft2232_speeds_khz[i] = mpsse_khz / auto_divisors[i];
+	if (ft2232_set_divisor(divisor)) {
 		ret = -6;
 		goto ftdi_err;
 	}
 
 	msg_pdbg("MPSSE clock: %f MHz, divisor: %u, SPI clock: %f MHz\n",
 		 mpsse_clk, divisor, (double)(mpsse_clk / divisor));
+	/* Only the high-speed chips can clock the bus without transferring data. */
+	if (clock_5x)
+		clocked_delay_khz = mpsse_clk * 1000 / divisor;
+
+	for (i = 0; i < channels_open; i++) {
+		/* Disconnect TDI/DO to TDO/DI for loopback. */
+		msg_pdbg("No loopback of TDI/DO TDO/DI\n");
+		buf[0] = LOOPBACK_END;
+		if (send_buf(&channels[i].ftdic, buf, 1)) {
+			ret = -7;
+			goto ftdi_err;
+		}
 
-	/* Disconnect TDI/DO to TDO/DI for loopback. */
-	msg_pdbg("No loopback of TDI/DO TDO/DI\n");
-	buf[0] = LOOPBACK_END;
-	if (send_buf(ftdic, buf, 1)) {
-		ret = -7;
-		goto ftdi_err;
+		msg_pdbg("Set data bits\n");
+		buf[0] = SET_BITS_LOW;
+		buf[1] = cs_bits;
+		buf[2] = pindir;
+		if (send_buf(&channels[i].ftdic, buf, 3)) {
+			ret = -8;
+			goto ftdi_err;
+		}
 	}
 
-	msg_pdbg("Set data bits\n");
-	buf[0] = SET_BITS_LOW;
-	buf[1] = cs_bits;
-	buf[2] = pindir;
-	if (send_buf(ftdic, buf, 3)) {
-		ret = -8;
+	if (register_shutdown(ft2232_spi_shutdown, NULL)) {
+		ret = -9;
 		goto ftdi_err;
 	}
-
-	register_spi_master(&spi_master_ft2232);
+	/* From here on the channels are closed on shutdown. */
+	for (i = 0; i < channels_open; i++) {
+		if (register_spi_master(&spi_master_ft2232))
+			return -10;
+		channels[i].mst = &registered_masters[registered_master_count - 1];
+		if (channels_open > 1)
+			declare_master_independent();
+	}
 
 	return 0;
 
 ftdi_err:
-	if ((f = ftdi_usb_close(ftdic)) < 0) {
-		msg_perr("Unable to close FTDI device: %d (%s)\n", f, ftdi_get_error_string(ftdic));
-	}
+	ft2232_close_channels();
 	return ret;
 }
 
-/* Returns 0 upon success, a negative number upon errors. */
-static int ft2232_spi_send_command(struct flashctx *flash,
-				   unsigned int writecnt, unsigned int readcnt,
-				   const unsigned char *writearr,
-				   unsigned char *readarr)
-{
-	struct ftdi_context *ftdic = &ftdic_context;
-	static unsigned char *buf = NULL;
-	/* failed is special. We use bitwise ops, but it is essentially bool. */
-	int i = 0, ret = 0, failed = 0;
-	int bufsize;
-	static int oldbufsize = 0;
-
-	if (writecnt > 65536 || readcnt > 65536)
-		return SPI_INVALID_LENGTH;
-
-	/* buf is not used for the response from the chip. */
-	bufsize = max(writecnt + 9, 260 + 9);
-	/* Never shrink. realloc() calls are expensive. */
-	if (bufsize > oldbufsize) {
-		buf = realloc(buf, bufsize);
-		if (!buf) {
-			msg_perr("Out of memory!\n");
-			/* TODO: What to do with buf? */
-			return SPI_GENERIC_ERROR;
-		}
-		oldbufsize = bufsize;
-	}
-
-	/*
-	 * Minimize USB transfers by packing as many commands as possible
-	 * together. If we're not expecting to read, we can assert CS#, write,
-	 * and deassert CS# all in one shot. If reading, we do three separate
-	 * operations.
-	 */
-	msg_pspew("Assert CS#\n");
-	buf[i++] = SET_BITS_LOW;
-	buf[i++] = 0 & ~cs_bits; /* assertive */
-	buf[i++] = pindir;
-
-	if (writecnt) {
-		buf[i++] = MPSSE_DO_WRITE | MPSSE_WRITE_NEG;
-		buf[i++] = (writecnt - 1) & 0xff;
-		buf[i++] = ((writecnt - 1) >> 8) & 0xff;
-		memcpy(buf + i, writearr, writecnt);
-		i += writecnt;
-	}
-
-	/*
-	 * Optionally terminate this batch of commands with a
-	 * read command, then do the fetch of the results.
-	 */
-	if (readcnt) {
-		buf[i++] = MPSSE_DO_READ;
-		buf[i++] = (readcnt - 1) & 0xff;
-		buf[i++] = ((readcnt - 1) >> 8) & 0xff;
-		ret = send_buf(ftdic, buf, i);
-		failed = ret;
-		/* We can't abort here, we still have to deassert CS#. */
-		if (ret)
-			msg_perr("send_buf failed before read: %i\n", ret);
-		i = 0;
-		if (ret == 0) {
-			/*
-			 * FIXME: This is unreliable. There's no guarantee that
-			 * we read the response directly after sending the read
-			 * command. We may be scheduled out etc.
-			 */
-			ret = get_buf(ftdic, readarr, readcnt);
-			failed |= ret;
-			/* We can't abort here either. */
-			if (ret)
-				msg_perr("get_buf failed: %i\n", ret);
-		}
-	}
-
-	msg_pspew("De-assert CS#\n");
-	buf[i++] = SET_BITS_LOW;
-	buf[i++] = cs_bits;
-	buf[i++] = pindir;
-	ret = send_buf(ftdic, buf, i);
-	failed |= ret;
-	if (ret)
-		msg_perr("send_buf failed at end: %i\n", ret);
-
-	return failed ? -1 : 0;
-}
-
 #endif
@@ -66,11 +66,12 @@ static void gfxnvidia_chip_writeb(const struct flashctx *flash, uint8_t val,
 				  chipaddr addr);
 static uint8_t gfxnvidia_chip_readb(const struct flashctx *flash,
 				    const chipaddr addr);
+static void gfxnvidia_chip_readn(const struct flashctx *flash, uint8_t *buf, const chipaddr addr, size_t len);
 static const struct par_master par_master_gfxnvidia = {
 		.chip_readb		= gfxnvidia_chip_readb,
 		.chip_readw		= fallback_chip_readw,
 		.chip_readl		= fallback_chip_readl,
-		.chip_readn		= fallback_chip_readn,
+		.chip_readn		= gfxnvidia_chip_readn,
 		.chip_writeb		= gfxnvidia_chip_writeb,
 		.chip_writew		= fallback_chip_writew,
 		.chip_writel		= fallback_chip_writel,
@@ -123,3 +124,15 @@ static uint8_t gfxnvidia_chip_readb(const struct flashctx *flash,
 {
 	return pci_mmio_readb(nvidia_bar + (addr & GFXNVIDIA_MEMMAP_MASK));
 }
+
+/* The flash is mapped into the BAR, so read it with wide loads. The window repeats every 128 kB. */
+static void gfxnvidia_chip_readn(const struct flashctx *flash, uint8_t *buf, const chipaddr addr, size_t len)
+{
+	chipaddr a = addr;
+	size_t n;
+
+	for (; len; len -= n, buf += n, a += n) {
+		n = min(len, GFXNVIDIA_MEMMAP_MASK + 1 - (a & GFXNVIDIA_MEMMAP_MASK));
+		mmio_readn(nvidia_bar + (a & GFXNVIDIA_MEMMAP_MASK), buf, n);
+	}
+}
@@ -20,9 +20,15 @@
  */
 
 #include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "flash.h"
+#if !IS_WINDOWS && !defined(__DJGPP__) && !defined(__LIBPAYLOAD__)
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 /* Returns the minimum number of bits needed to represent the given address.
  * FIXME: use mind-blowing implementation. */
@@ -64,12 +70,293 @@ char *strcat_realloc(char *dest, const char *src)
 	return dest;
 }
 
+/*
+ * Return a string corresponding to the bustype parameter.
+ * Memory is obtained with malloc() and must be freed with free() by the caller.
+ */
+char *flashbuses_to_text(enum chipbustype bustype)
+{
+	char *ret = calloc(1, 1);
+	/*
+	 * FIXME: Once all chipsets and flash chips have been updated, NONSPI
+	 * will cease to exist and should be eliminated here as well.
+	 */
+	if (bustype == BUS_NONSPI) {
+		ret = strcat_realloc(ret, "Non-SPI, ");
+	} else {
+		if (bustype & BUS_PARALLEL)
+			ret = strcat_realloc(ret, "Parallel, ");
+		if (bustype & BUS_LPC)
+			ret = strcat_realloc(ret, "LPC, ");
+		if (bustype & BUS_FWH)
+			ret = strcat_realloc(ret, "FWH, ");
+		if (bustype & BUS_SPI)
+			ret = strcat_realloc(ret, "SPI, ");
+		if (bustype & BUS_PROG)
+			ret = strcat_realloc(ret, "Programmer-specific, ");
+		if (bustype == BUS_NONE)
+			ret = strcat_realloc(ret, "None, ");
+	}
+	/* Kill last comma. */
+	ret[strlen(ret) - 2] = '\0';
+	ret = realloc(ret, strlen(ret) + 1);
+	return ret;
+}
+
+void print_hex(enum msglevel level, const uint8_t *buf, unsigned int len)
+{
+	char line[16 * 5 + 1];
+	unsigned int i, n;
+
+	while (len) {
+		n = min(len, 16);
+		for (i = 0; i < n; i++)
+			snprintf(line + i * 5, 6, " 0x%02x", buf[i]);
+		print(level, "%s", line);
+		buf += n;
+		len -= n;
+	}
+}
+
 void tolower_string(char *str)
 {
 	for (; *str != '\0'; str++)
 		*str = (char)tolower((unsigned char)*str);
 }
 
+/* Update a CRC-32 (IEEE 802.3, as used by zlib) with len bytes of buf. Start with crc = 0. */
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, unsigned int len)
+{
+	static uint32_t table[256];
+	uint32_t c;
+	unsigned int i, j;
+
+	if (!table[1]) {
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (j = 0; j < 8; j++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+	crc = ~crc;
+	for (i = 0; i < len; i++)
+		crc = table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* Add the range start..start+len-1 to @list, merging it with overlapping or adjacent ranges.
+ * Returns 0 on success, 1 if memory allocation failed. */
+int range_list_add(struct range_list *list, unsigned int start, unsigned int len)
+{
+	unsigned int i, j, end = start + len;
+
+	if (!len)
+		return 0;
+	/* Skip all ranges ending before the new one starts. */
+	for (i = 0; i < list->count && list->ranges[i].start + list->ranges[i].len < start; i++)
+		;
+	/* Find all ranges overlapping or touching the new one. */
+	for (j = i; j < list->count && list->ranges[j].start <= end; j++) {
+		if (list->ranges[j].start < start)
+			start = list->ranges[j].start;
+		if (list->ranges[j].start + list->ranges[j].len > end)
+			end = list->ranges[j].start + list->ranges[j].len;
+	}
+	if (i == j) {
+		/* Nothing to merge with, insert a new range at position i. */
+		if (list->count == list->capacity) {
+			unsigned int capacity = list->capacity ? list->capacity * 2 : 16;
+			struct range *tmp = realloc(list->ranges, capacity * sizeof(*tmp));
+			if (!tmp) {
+				msg_gerr("Out of memory!\n");
+				return 1;
+			}
+			list->ranges = tmp;
+			list->capacity = capacity;
+		}
+		memmove(&list->ranges[i + 1], &list->ranges[i], (list->count - i) * sizeof(*list->ranges));
+		list->count++;
+	} else {
+		/* Ranges i..j-1 are replaced by a single one. */
+		memmove(&list->ranges[i + 1], &list->ranges[j], (list->count - j) * sizeof(*list->ranges));
+		list->count -= j - i - 1;
+	}
+	list->ranges[i].start = start;
+	list->ranges[i].len = end - start;
+	return 0;
+}
+
+/* Remove start..start+len-1 from @list, splitting a range around it if needed.
+ * Returns 0 on success, 1 if memory allocation failed. */
+int range_list_remove(struct range_list *list, unsigned int start, unsigned int len)
+{
+	struct range_list rest = { 0 };
+	unsigned int i, end = start + len;
+
+	for (i = 0; i < list->count; i++) {
+		const struct range *r = &list->ranges[i];
+		const unsigned int r_end = r->start + r->len;
+		if (r_end <= start || r->start >= end) {
+			if (range_list_add(&rest, r->start, r->len))
+				goto oom;
+			continue;
+		}
+		if (r->start < start && range_list_add(&rest, r->start, start - r->start))
+			goto oom;
+		if (r_end > end && range_list_add(&rest, end, r_end - end))
+			goto oom;
+	}
+	range_list_free(list);
+	*list = rest;
+	return 0;
+oom:
+	range_list_free(&rest);
+	return 1;
+}
+
+/* Returns true if start..start+len-1 lies completely within one range of @list. */
+bool range_list_contains(const struct range_list *list, unsigned int start, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < list->count; i++) {
+		if (list->ranges[i].start > start)
+			break;
+		if (list->ranges[i].start + list->ranges[i].len >= start + len)
+			return true;
+	}
+	return false;
+}
+
+/* Returns true if start..start+len-1 overlaps with any range of @list. */
+bool range_list_overlaps(const struct range_list *list, unsigned int start, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < list->count; i++) {
+		if (list->ranges[i].start >= start + len)
+			break;
+		if (list->ranges[i].start + list->ranges[i].len > start)
+			return true;
+	}
+	return false;
+}
+
+void range_list_free(struct range_list *list)
+{
+	free(list->ranges);
+	list->ranges = NULL;
+	list->count = 0;
+	list->capacity = 0;
+}
+
+#if !IS_WINDOWS && !defined(__DJGPP__) && !defined(__LIBPAYLOAD__)
+/* Path of the file @name below $XDG_CACHE_HOME (or ~/.cache), with @suffix appended. */
+static bool cache_file_path(char *path, size_t len, const char *name, const char *suffix)
+{
+	const char *dir = getenv("XDG_CACHE_HOME");
+
+	if (dir && *dir)
+		snprintf(path, len, "%s/%s%s", dir, name, suffix);
+	else if ((dir = getenv("HOME")) && *dir)
+		snprintf(path, len, "%s/.cache/%s%s", dir, name, suffix);
+	else
+		return false;
+	return true;
+}
+#endif
+
+/* Open the file @name below $XDG_CACHE_HOME (or ~/.cache). Returns NULL if there is no such directory. */
+FILE *open_cache_file(const char *name, const char *mode)
+{
+#if !IS_WINDOWS && !defined(__DJGPP__) && !defined(__LIBPAYLOAD__)
+	char path[PATH_MAX];
+
+	if (!cache_file_path(path, sizeof(path), name, ""))
+		return NULL;
+	return fopen(path, mode);
+#else
+	return NULL;
+#endif
+}
+
+/* Whether the cache file @f can have been written by nobody else but us, i.e. a previous run. */
+bool cache_file_trusted(FILE *f)
+{
+#if !IS_WINDOWS && !defined(__DJGPP__) && !defined(__LIBPAYLOAD__)
+	struct stat st;
+
+	if (fstat(fileno(f), &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)) || st.st_nlink != 1)
+		return false;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Start replacing the cache file @name: the contents go to a temporary file next to it, which
+ * commit_cache_file() renames over @name. Readers thus see either the old or the new file, never a partial one.
+ */
+FILE *create_cache_file(const char *name)
+{
+#if !IS_WINDOWS && !defined(__DJGPP__) && !defined(__LIBPAYLOAD__)
+	char path[PATH_MAX], suffix[32];
+	FILE *f;
+
+	snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long)getpid());
+	if (!cache_file_path(path, sizeof(path), name, suffix))
+		return NULL;
+	f = fopen(path, "wb");
+	if (f && fchmod(fileno(f), 0600)) {
+		fclose(f);
+		remove(path);
+		return NULL;
+	}
+	return f;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * Finish create_cache_file(): close @f and, if @ok and everything was written, move it over @name.
+ * Otherwise the temporary file is removed and @name is left alone. Returns 0 on success.
+ */
+int commit_cache_file(FILE *f, const char *name, bool ok)
+{
+#if !IS_WINDOWS && !defined(__DJGPP__) && !defined(__LIBPAYLOAD__)
+	char path[PATH_MAX], tmp[PATH_MAX], suffix[32];
+
+	ok = !ferror(f) && ok;
+	if (fclose(f))
+		ok = false;
+	snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long)getpid());
+	if (!cache_file_path(tmp, sizeof(tmp), name, suffix) || !cache_file_path(path, sizeof(path), name, ""))
+		return 1;
+	if (ok && !rename(tmp, path))
+		return 0;
+	remove(tmp);
+	return 1;
+#else
+	fclose(f);
+	return 1;
+#endif
+}
+
+/* Delete the cache file @name, if there is one. */
+void remove_cache_file(const char *name)
+{
+#if !IS_WINDOWS && !defined(__DJGPP__) && !defined(__LIBPAYLOAD__)
+	char path[PATH_MAX];
+
+	if (cache_file_path(path, sizeof(path), name, ""))
+		remove(path);
+#endif
+}
+
 /* FIXME: Find a better solution for MinGW. Maybe wrap strtok_s (C11) if it becomes available */
 #ifdef __MINGW32__
 char* strtok_r(char *str, const char *delim, char **nextp)
@@ -153,10 +153,26 @@ uint32_t mmio_readl(void *addr)
 	return *(volatile uint32_t *) addr;
 }
 
+/* Every load from a flash window is a separate (slow) bus transaction, so use the widest aligned loads the
+ * CPU has. Unlike memcpy() this never reads a byte twice, e.g. with overlapping loads at the tail. */
 void mmio_readn(void *addr, uint8_t *buf, size_t len)
 {
-	memcpy(buf, addr, len);
-	return;
+	const volatile uint8_t *src = addr;
+	uintptr_t word;
+
+	while (len && ((uintptr_t)src % sizeof(word))) {
+		*buf++ = *src++;
+		len--;
+	}
+	while (len >= sizeof(word)) {
+		word = *(const volatile uintptr_t *)src;
+		memcpy(buf, &word, sizeof(word));
+		src += sizeof(word);
+		buf += sizeof(word);
+		len -= sizeof(word);
+	}
+	while (len--)
+		*buf++ = *src++;
 }
 
 void mmio_le_writeb(uint8_t val, void *addr)
@@ -224,6 +224,41 @@ static uint16_t REGREAD8(int X)
 #define REGWRITE16(off, val) mmio_writew(val, ich_spibar+(off))
 #define REGWRITE8(off, val)  mmio_writeb(val, ich_spibar+(off))
 
+/* Number of status register reads before polling falls back to sleeping. Most cycles (status reads, short
+ * data transfers) complete within a few microseconds, well before the first programmer_delay() would
+ * return. */
+#define ICH_POLL_SPINS		256
+#define ICH_POLL_DELAY_US	10
+
+/* Wait for any of the bits in @mask of the @width bytes wide register at @reg to become @set (1) or
+ * clear (0). It is read back to back first, then every ICH_POLL_DELAY_US until @timeout_us is over.
+ * Returns 0 if the condition was met, 1 on timeout.
+ */
+static int ich_poll_reg(int reg, int width, uint32_t mask, int set, unsigned int timeout_us)
+{
+	unsigned int spins = ICH_POLL_SPINS;
+	unsigned int polls = timeout_us / ICH_POLL_DELAY_US;
+	uint32_t val;
+
+	while (1) {
+		if (width == 4)
+			val = REGREAD32(reg);
+		else if (width == 2)
+			val = REGREAD16(reg);
+		else
+			val = REGREAD8(reg);
+		if (!(val & mask) == !set)
+			return 0;
+		if (spins) {
+			spins--;
+			continue;
+		}
+		if (!polls--)
+			return 1;
+		programmer_delay(ICH_POLL_DELAY_US);
+	}
+}
+
 /* Common SPI functions */
 static int find_opcode(OPCODES *op, uint8_t opcode);
 static int find_preop(OPCODES *op, uint8_t preop);
@@ -409,9 +444,15 @@ static int reprogram_opcode_on_the_fly(uint8_t opcode, unsigned int writecnt, un
 		else // we have an invalid case
 			return SPI_INVALID_LENGTH;
 	}
-	int oppos = 2;	// use original JEDEC_BE_D8 offset
+	/* Take turns on the slots of erase opcodes and REMS (used for probing only), so a chip alternating
+	 * between a few unlisted opcodes doesn't need the menu to be rewritten for every single command. */
+	static const int slots[] = { 2, 7, 4 };	// JEDEC_BE_D8, JEDEC_CE_C7, JEDEC_REMS offsets
+	static unsigned int next_slot = 0;
+	int oppos = slots[next_slot];
+	next_slot = (next_slot + 1) % ARRAY_SIZE(slots);
 	curopcodes->opcode[oppos].opcode = opcode;
 	curopcodes->opcode[oppos].spi_type = spi_type;
+	curopcodes->opcode[oppos].atomic = 0;
 	program_opcodes(curopcodes, 0);
 	oppos = find_opcode(curopcodes, opcode);
 	msg_pdbg2("on-the-fly OPCODE (0x%02X) re-programmed, op-pos=%d\n", opcode, oppos);
@@ -507,6 +548,20 @@ static int generate_opcodes(OPCODES * op)
 	return 0;
 }
 
+/* What was last written to the PREOP, OPTYPE and OPMENU registers, so rewriting them can be skipped. */
+static struct {
+	int valid;
+	uint16_t preop, optype;
+	uint32_t opmenu[2];
+} opcode_regs;
+
+/* Runs after the shutdown restored the registers, which then hold something else. */
+static int ich_forget_opcode_regs(void *data)
+{
+	opcode_regs.valid = 0;
+	return 0;
+}
+
 static int program_opcodes(OPCODES *op, int enable_undo)
 {
 	uint8_t a;
@@ -537,6 +592,18 @@ static int program_opcodes(OPCODES *op, int enable_undo)
 		opmenu[1] |= ((uint32_t) op->opcode[a].opcode) << ((a - 4) * 8);
 	}
 
+	if (!enable_undo && opcode_regs.valid && opcode_regs.preop == preop && opcode_regs.optype == optype &&
+	    opcode_regs.opmenu[0] == opmenu[0] && opcode_regs.opmenu[1] == opmenu[1])
+		return 0;
+	/* Shutdown functions run in reverse order, so this one comes after the undo functions below. */
+	if (enable_undo && register_shutdown(ich_forget_opcode_regs, NULL))
+		return 1;
+	opcode_regs.valid = 1;
+	opcode_regs.preop = preop;
+	opcode_regs.optype = optype;
+	opcode_regs.opmenu[0] = opmenu[0];
+	opcode_regs.opmenu[1] = opmenu[1];
+
 	msg_pdbg2("\n%s: preop=%04x optype=%04x opmenu=%08x%08x\n", __func__, preop, optype, opmenu[0], opmenu[1]);
 	switch (ich_generation) {
 	case CHIPSET_ICH7:
@@ -735,11 +802,8 @@ static int ich7_run_opcode(OPCODE op, uint32_t offset,
 		write_cmd = 1;
 	}
 
-	timeout = 100 * 60;	/* 60 ms are 9.6 million cycles at 16 MHz. */
-	while ((REGREAD16(ICH7_REG_SPIS) & SPIS_SCIP) && --timeout) {
-		programmer_delay(10);
-	}
-	if (!timeout) {
+	/* 60 ms are 9.6 million cycles at 16 MHz. */
+	if (ich_poll_reg(ICH7_REG_SPIS, 2, SPIS_SCIP, 0, 60 * 1000)) {
 		msg_perr("Error: SCIP never cleared!\n");
 		return 1;
 	}
@@ -784,7 +848,7 @@ static int ich7_run_opcode(OPCODE op, uint32_t offset,
 	}
 	temp16 |= ((uint16_t) (opcode_index & 0x07)) << 4;
 
-	timeout = 100 * 60;	/* 60 ms are 9.6 million cycles at 16 MHz. */
+	timeout = 60 * 1000;	/* 60 ms are 9.6 million cycles at 16 MHz. */
 	/* Handle Atomic. Atomic commands include three steps:
 	    - sending the preop (mainly EWSR or WREN)
 	    - sending the main command
@@ -800,7 +864,7 @@ static int ich7_run_opcode(OPCODE op, uint32_t offset,
 	case 1:
 		/* Atomic command (preop+op) */
 		temp16 |= SPIC_ACS;
-		timeout = 100 * 1000 * 60;	/* 60 seconds */
+		timeout = 60 * 1000 * 1000;	/* 60 seconds */
 		break;
 	}
 
@@ -811,11 +875,7 @@ static int ich7_run_opcode(OPCODE op, uint32_t offset,
 	REGWRITE16(ICH7_REG_SPIC, temp16);
 
 	/* Wait for Cycle Done Status or Flash Cycle Error. */
-	while (((REGREAD16(ICH7_REG_SPIS) & (SPIS_CDS | SPIS_FCERR)) == 0) &&
-	       --timeout) {
-		programmer_delay(10);
-	}
-	if (!timeout) {
+	if (ich_poll_reg(ICH7_REG_SPIS, 2, SPIS_CDS | SPIS_FCERR, 1, timeout)) {
 		msg_perr("timeout, ICH7_REG_SPIS=0x%04x\n",
 			 REGREAD16(ICH7_REG_SPIS));
 		return 1;
@@ -852,11 +912,8 @@ static int ich9_run_opcode(OPCODE op, uint32_t offset,
 		write_cmd = 1;
 	}
 
-	timeout = 100 * 60;	/* 60 ms are 9.6 million cycles at 16 MHz. */
-	while ((REGREAD8(ICH9_REG_SSFS) & SSFS_SCIP) && --timeout) {
-		programmer_delay(10);
-	}
-	if (!timeout) {
+	/* 60 ms are 9.6 million cycles at 16 MHz. */
+	if (ich_poll_reg(ICH9_REG_SSFS, 1, SSFS_SCIP, 0, 60 * 1000)) {
 		msg_perr("Error: SCIP never cleared!\n");
 		return 1;
 	}
@@ -906,7 +963,7 @@ static int ich9_run_opcode(OPCODE op, uint32_t offset,
 	}
 	temp32 |= ((uint32_t) (opcode_index & 0x07)) << (8 + 4);
 
-	timeout = 100 * 60;	/* 60 ms are 9.6 million cycles at 16 MHz. */
+	timeout = 60 * 1000;	/* 60 ms are 9.6 million cycles at 16 MHz. */
 	/* Handle Atomic. Atomic commands include three steps:
 	    - sending the preop (mainly EWSR or WREN)
 	    - sending the main command
@@ -922,7 +979,7 @@ static int ich9_run_opcode(OPCODE op, uint32_t offset,
 	case 1:
 		/* Atomic command (preop+op) */
 		temp32 |= SSFC_ACS;
-		timeout = 100 * 1000 * 60;	/* 60 seconds */
+		timeout = 60 * 1000 * 1000;	/* 60 seconds */
 		break;
 	}
 
@@ -933,11 +990,7 @@ static int ich9_run_opcode(OPCODE op, uint32_t offset,
 	REGWRITE32(ICH9_REG_SSFS, temp32);
 
 	/* Wait for Cycle Done Status or Flash Cycle Error. */
-	while (((REGREAD32(ICH9_REG_SSFS) & (SSFS_FDONE | SSFS_FCERR)) == 0) &&
-	       --timeout) {
-		programmer_delay(10);
-	}
-	if (!timeout) {
+	if (ich_poll_reg(ICH9_REG_SSFS, 4, SSFS_FDONE | SSFS_FCERR, 1, timeout)) {
 		msg_perr("timeout, ICH9_REG_SSFS=0x%08x\n",
 			 REGREAD32(ICH9_REG_SSFS));
 		return 1;
@@ -1114,6 +1167,52 @@ static int ich_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 	return result;
 }
 
+/* The part of the BIOS region the chipset maps right below 4 GiB. Reading it there is a plain memory copy
+ * instead of a sequencing cycle with a register poll per 64 bytes. */
+static struct {
+	uint32_t start;		/* Flash address of the first mapped byte. */
+	uint32_t len;		/* 0 if nothing is mapped. */
+	uint8_t *virt;
+	int checked;		/* Compared with what the sequencer reads? */
+} ich_bios_window;
+
+#define ICH_BIOS_WINDOW_MAX	(16 * 1024 * 1024)
+/* Read the part of @start..@start+@len in the BIOS window from memory and the rest with @read_cycles. */
+static int ich_read_mapped(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len,
+			   int (*read_cycles)(struct flashctx *flash, uint8_t *buf,
+					      unsigned int start, unsigned int len))
+{
+	const unsigned int wstart = ich_bios_window.start;
+	const unsigned int wend = wstart + ich_bios_window.len;
+	const unsigned int from = max(start, wstart);
+	const unsigned int to = min(start + len, wend);
+	int ret;
+
+	/* With software sequencing only the first chip is accessed, it may not cover the BIOS region. */
+	if (!ich_bios_window.len || from >= to || wend > flash->chip->total_size * 1024)
+		return read_cycles(flash, buf, start, len);
+
+	if (!ich_bios_window.checked) {
+		ich_bios_window.checked = 1;
+		if (check_mapped_window(flash, ich_bios_window.virt, wstart, ich_bios_window.len, read_cycles)) {
+			msg_pdbg("Not reading the BIOS region from memory.\n");
+			ich_bios_window.len = 0;
+			return read_cycles(flash, buf, start, len);
+		}
+		msg_pdbg("Reading 0x%06x-0x%06x through the memory-mapped BIOS region.\n", wstart, wend - 1);
+	}
+
+	if (from > start) {
+		ret = read_cycles(flash, buf, start, from - start);
+		if (ret)
+			return ret;
+	}
+	mmio_readn(ich_bios_window.virt + (from - wstart), buf + (from - start), to - from);
+	if (start + len > to)
+		return read_cycles(flash, buf + (to - start), to, start + len - to);
+	return 0;
+}
+
 static struct hwseq_data {
 	uint32_t size_comp0;
 	uint32_t size_comp1;
@@ -1158,15 +1257,12 @@ static int ich_hwseq_wait_for_cycle_complete(unsigned int timeout,
 {
 	uint16_t hsfs;
 	uint32_t addr;
+	int timed_out;
 
-	timeout /= 8; /* scale timeout duration to counter */
-	while ((((hsfs = REGREAD16(ICH9_REG_HSFS)) &
-		 (HSFS_FDONE | HSFS_FCERR)) == 0) &&
-	       --timeout) {
-		programmer_delay(8);
-	}
-	REGWRITE16(ICH9_REG_HSFS, REGREAD16(ICH9_REG_HSFS));
-	if (!timeout) {
+	timed_out = ich_poll_reg(ICH9_REG_HSFS, 2, HSFS_FDONE | HSFS_FCERR, 1, timeout);
+	hsfs = REGREAD16(ICH9_REG_HSFS);
+	REGWRITE16(ICH9_REG_HSFS, hsfs);
+	if (timed_out) {
 		addr = REGREAD32(ICH9_REG_FADDR) & 0x01FFFFFF;
 		msg_perr("Timeout error between offset 0x%08x and "
 			 "0x%08x (= 0x%08x + %d)!\n",
@@ -1291,8 +1387,8 @@ static int ich_hwseq_block_erase(struct flashctx *flash, unsigned int addr,
 	return 0;
 }
 
-static int ich_hwseq_read(struct flashctx *flash, uint8_t *buf,
-			  unsigned int addr, unsigned int len)
+static int ich_hwseq_read_cycles(struct flashctx *flash, uint8_t *buf,
+				 unsigned int addr, unsigned int len)
 {
 	uint16_t hsfc;
 	uint16_t timeout = 100 * 60;
@@ -1333,6 +1429,11 @@ static int ich_hwseq_read(struct flashctx *flash, uint8_t *buf,
 	return 0;
 }
 
+static int ich_hwseq_read(struct flashctx *flash, uint8_t *buf, unsigned int addr, unsigned int len)
+{
+	return ich_read_mapped(flash, buf, addr, len, ich_hwseq_read_cycles);
+}
+
 static int ich_hwseq_write(struct flashctx *flash, const uint8_t *buf, unsigned int addr, unsigned int len)
 {
 	uint16_t hsfc;
@@ -1541,13 +1642,52 @@ static const struct spi_master spi_master_ich7 = {
 	.write_aai = default_spi_write_aai,
 };
 
+/* Map the BIOS region (or its top 16 MB) if the host may read it and no protected range hides parts of it.
+ * Has to run after the PR registers were set up. */
+static void ich_map_bios_region(uint32_t frap)
+{
+	const uint32_t freg = mmio_readl(ich_spibar + ICH9_REG_FREG0 + 1 * 4);
+	const uint32_t base = ICH_FREG_BASE(freg);
+	const uint32_t end = (ICH_FREG_LIMIT(freg) | 0x0fff) + 1;
+	uint32_t start, len, pr;
+	void *virt;
+	int i;
+
+	if (base >= end || !((ICH_BRRA(frap) >> 1) & 1))
+		return;
+	len = min(end - base, ICH_BIOS_WINDOW_MAX);
+	start = end - len;
+
+	for (i = 0; i < 5; i++) {
+		pr = mmio_readl(ich_spibar + ICH9_REG_PR0 + (i * 4));
+		if (((pr >> PR_RP_OFF) & 1) && ICH_FREG_BASE(pr) < end &&
+		    (ICH_FREG_LIMIT(pr) | 0x0fff) >= start) {
+			msg_pdbg("PR%u read-protects parts of the BIOS region, not reading it from memory.\n", i);
+			return;
+		}
+	}
+
+	virt = rphysmap("ICH BIOS region", (uintptr_t)(0x100000000ULL - len), len);
+	if (virt == ERROR_PTR)
+		return;
+	ich_bios_window.start = start;
+	ich_bios_window.len = len;
+	ich_bios_window.virt = virt;
+	ich_bios_window.checked = 0;
+}
+
+static int ich_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	return ich_read_mapped(flash, buf, start, len, default_spi_read);
+}
+
 static const struct spi_master spi_master_ich9 = {
 	.type = SPI_CONTROLLER_ICH9,
 	.max_data_read = 64,
 	.max_data_write = 64,
 	.command = ich_spi_send_command,
 	.multicommand = ich_spi_send_multicommand,
-	.read = default_spi_read,
+	.read = ich_spi_read,
 	.write_256 = default_spi_write_256,
 	.write_aai = default_spi_write_aai,
 };
@@ -1579,6 +1719,9 @@ int ich_init_spi(struct pci_dev *dev, void *spibar, enum ich_chipset ich_gen)
 
 	ich_generation = ich_gen;
 	ich_spibar = spibar;
+	/* The mapping and the opcode registers of an earlier run were undone by its shutdown. */
+	memset(&ich_bios_window, 0, sizeof(ich_bios_window));
+	opcode_regs.valid = 0;
 
 	switch (ich_generation) {
 	case CHIPSET_ICH7:
@@ -1716,6 +1859,9 @@ int ich_init_spi(struct pci_dev *dev, void *spibar, enum ich_chipset ich_gen)
 				msg_pinfo("Continuing with write support because the user forced us to!\n");
 		}
 
+		if (desc_valid)
+			ich_map_bios_region(mmio_readl(ich_spibar + ICH9_REG_FRAP));
+
 		tmp = mmio_readl(ich_spibar + ICH9_REG_SSFS);
 		msg_pdbg("0x90: 0x%02x (SSFS)\n", tmp & 0xff);
 		prettyprint_ich9_reg_ssfs(tmp);
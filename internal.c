@@ -36,64 +36,6 @@ struct pci_dev *pci_dev_find_filter(struct pci_filter filter)
 
 	return NULL;
 }
-
-struct pci_dev *pci_dev_find_vendorclass(uint16_t vendor, uint16_t devclass)
-{
-	struct pci_dev *temp;
-	struct pci_filter filter;
-	uint16_t tmp2;
-
-	pci_filter_init(NULL, &filter);
-	filter.vendor = vendor;
-
-	for (temp = pacc->devices; temp; temp = temp->next)
-		if (pci_filter_match(&filter, temp)) {
-			/* Read PCI class */
-			tmp2 = pci_read_word(temp, 0x0a);
-			if (tmp2 == devclass)
-				return temp;
-		}
-
-	return NULL;
-}
-
-struct pci_dev *pci_dev_find(uint16_t vendor, uint16_t device)
-{
-	struct pci_dev *temp;
-	struct pci_filter filter;
-
-	pci_filter_init(NULL, &filter);
-	filter.vendor = vendor;
-	filter.device = device;
-
-	for (temp = pacc->devices; temp; temp = temp->next)
-		if (pci_filter_match(&filter, temp))
-			return temp;
-
-	return NULL;
-}
-
-struct pci_dev *pci_card_find(uint16_t vendor, uint16_t device,
-			      uint16_t card_vendor, uint16_t card_device)
-{
-	struct pci_dev *temp;
-	struct pci_filter filter;
-
-	pci_filter_init(NULL, &filter);
-	filter.vendor = vendor;
-	filter.device = device;
-
-	for (temp = pacc->devices; temp; temp = temp->next)
-		if (pci_filter_match(&filter, temp)) {
-			if ((card_vendor ==
-			     pci_read_word(temp, PCI_SUBSYSTEM_VENDOR_ID))
-			    && (card_device ==
-				pci_read_word(temp, PCI_SUBSYSTEM_ID)))
-				return temp;
-		}
-
-	return NULL;
-}
 #endif
 
 #if CONFIG_INTERNAL == 1
@@ -158,6 +100,157 @@ static const struct par_master par_master_internal = {
 
 enum chipbustype internal_buses_supported = BUS_NONE;
 
+#if IS_X86
+/*
+ * With internal:platform_cache=yes, what was found by probing the Super I/O chips and scanning for the
+ * coreboot table is remembered below $XDG_CACHE_HOME and used by later runs on the same machine instead of
+ * probing again. The machine is recognized by the IDs of the host bridge and some of the DMI IDs Linux
+ * exports, the BIOS version among them, so an update of the firmware starts over. Chipset and board enables
+ * still run every time, they don't only detect but set things up.
+ * The cached Super I/O chips are written to without being probed again, so the cache is only used if it
+ * belongs to the user flashrom runs as and nobody else can have changed it.
+ */
+#define PLATFORM_CACHE_FILE	"flashrom-platform"
+#define PLATFORM_CACHE_MAGIC	"flashrom platform 1"
+
+static struct {
+	bool loaded;	/* The cache matched, nothing has to be probed. */
+	bool coreboot;	/* A coreboot table with mainboard IDs was found. */
+	char cb_vendor[64];
+	char cb_model[64];
+} platform_cache;
+
+#if defined(__linux__)
+/* Read the DMI ID @name from sysfs into @buf. Returns 0 on success. */
+static int read_dmi_id(const char *name, char *buf, size_t len)
+{
+	char path[64];
+	FILE *f;
+	int ret = 1;
+
+	snprintf(path, sizeof(path), "/sys/class/dmi/id/%s", name);
+	f = fopen(path, "r");
+	if (!f)
+		return 1;
+	if (fgets(buf, len, f)) {
+		buf[strcspn(buf, "\n")] = '\0';
+		ret = 0;
+	}
+	fclose(f);
+	return ret;
+}
+#endif
+
+/* Describe this machine in @buf. Returns 0 on success, 1 if it can't be told apart from others. */
+static int platform_fingerprint(char *buf, size_t len)
+{
+#if defined(__linux__)
+	char uuid[64], vendor[128], board[128], bios[128];
+	struct pci_dev *dev;
+
+	for (dev = pacc->devices; dev; dev = dev->next)
+		if (!dev->domain && !dev->bus && !dev->dev && !dev->func)
+			break;
+	/* The UUID is only readable by root, which is fine for the internal programmer. */
+	if (!dev || read_dmi_id("product_uuid", uuid, sizeof(uuid)) ||
+	    read_dmi_id("board_vendor", vendor, sizeof(vendor)) || read_dmi_id("board_name", board, sizeof(board)) ||
+	    read_dmi_id("bios_version", bios, sizeof(bios)))
+		return 1;
+	snprintf(buf, len, "%04x:%04x:%04x:%04x %s %s|%s|%s", dev->vendor_id, dev->device_id,
+		 pci_read_word(dev, PCI_SUBSYSTEM_VENDOR_ID), pci_read_word(dev, PCI_SUBSYSTEM_ID), uuid, vendor,
+		 board, bios);
+	return 0;
+#else
+	return 1;
+#endif
+}
+
+/* Load the cached platform for @fingerprint, registering the Super I/O chips found before. */
+static void platform_cache_load(const char *fingerprint)
+{
+	char line[512];
+	char *tab;
+	struct superio s;
+	unsigned int vendor, port, model;
+	FILE *f = open_cache_file(PLATFORM_CACHE_FILE, "r");
+
+	if (!f)
+		return;
+	if (!cache_file_trusted(f)) {
+		msg_pwarn("Ignoring the platform cache, it is not owned by this user or writable by others.\n");
+		fclose(f);
+		return;
+	}
+	if (!fgets(line, sizeof(line), f) || strcmp(line, PLATFORM_CACHE_MAGIC "\n") ||
+	    !fgets(line, sizeof(line), f) || strncmp(line, fingerprint, strlen(fingerprint)) ||
+	    line[strlen(fingerprint)] != '\n') {
+		msg_pdbg("The platform cache is for another machine.\n");
+		fclose(f);
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "superio %x %x %x", &vendor, &port, &model) == 3) {
+			s.vendor = vendor;
+			s.port = port;
+			s.model = model;
+			register_superio(s);
+		} else if (!strncmp(line, "coreboot ", 9) && (tab = strchr(line, '\t'))) {
+			*tab++ = '\0';
+			/* The IDs were stored by us, anything else means the file is broken. */
+			if (strlen(line + 9) >= sizeof(platform_cache.cb_vendor) ||
+			    strlen(tab) >= sizeof(platform_cache.cb_model)) {
+				msg_pdbg("The platform cache is broken.\n");
+				fclose(f);
+				memset(&platform_cache, 0, sizeof(platform_cache));
+				superio_count = 0;
+				return;
+			}
+			strcpy(platform_cache.cb_vendor, line + 9);
+			strcpy(platform_cache.cb_model, tab);
+			platform_cache.coreboot = true;
+		}
+	}
+	fclose(f);
+	platform_cache.loaded = true;
+	msg_pdbg("Using the cached platform, %d Super I/O chip(s)%s.\n", superio_count,
+		 platform_cache.coreboot ? " and coreboot" : "");
+}
+
+static void platform_cache_store(const char *fingerprint, const char *cb_vendor, const char *cb_model)
+{
+	FILE *f = open_cache_file(PLATFORM_CACHE_FILE, "w");
+	int i;
+
+	if (!f)
+		return;
+	fprintf(f, PLATFORM_CACHE_MAGIC "\n%s\n", fingerprint);
+	for (i = 0; i < superio_count; i++)
+		fprintf(f, "superio %x %x %x\n", superios[i].vendor, superios[i].port, superios[i].model);
+	if (cb_vendor && cb_model && !strpbrk(cb_vendor, "\t\n") && !strpbrk(cb_model, "\t\n") &&
+	    strlen(cb_vendor) < sizeof(platform_cache.cb_vendor) && strlen(cb_model) < sizeof(platform_cache.cb_model))
+		fprintf(f, "coreboot %s\t%s\n", cb_vendor, cb_model);
+	fclose(f);
+}
+#endif
+
+#if IS_X86 || IS_ARM
+/* cb_parse_table(), unless the platform cache has the answer. */
+static int find_coreboot_ids(const char **vendor, const char **model)
+{
+#if IS_X86
+	if (platform_cache.loaded) {
+		if (!platform_cache.coreboot)
+			return -1;
+		*vendor = platform_cache.cb_vendor;
+		*model = platform_cache.cb_model;
+		return 0;
+	}
+#endif
+	return cb_parse_table(vendor, model);
+}
+#endif
+
 int internal_init(void)
 {
 #if defined __FLASHROM_LITTLE_ENDIAN__
@@ -170,6 +263,10 @@ int internal_init(void)
 #if IS_X86 || IS_ARM
 	const char *cb_vendor = NULL;
 	const char *cb_model = NULL;
+#endif
+#if IS_X86
+	char fingerprint[512];
+	bool cache_platform = false;
 #endif
 	char *arg;
 
@@ -230,6 +327,24 @@ int internal_init(void)
 	}
 	free(arg);
 
+	arg = extract_programmer_param("platform_cache");
+	if (arg && !strcmp(arg, "yes")) {
+#if IS_X86
+		cache_platform = true;
+#else
+		msg_pinfo("The platform cache is not available on this platform.\n");
+#endif
+	} else if (arg && !strlen(arg)) {
+		msg_perr("Missing argument for platform_cache.\n");
+		free(arg);
+		return 1;
+	} else if (arg) {
+		msg_perr("Unknown argument for platform_cache: %s\n", arg);
+		free(arg);
+		return 1;
+	}
+	free(arg);
+
 	if (rget_io_perms())
 		return 1;
 
@@ -249,8 +364,18 @@ int internal_init(void)
 		return 1;
 	}
 
+#if IS_X86
+	memset(&platform_cache, 0, sizeof(platform_cache));
+	if (cache_platform && platform_fingerprint(fingerprint, sizeof(fingerprint))) {
+		msg_pinfo("This machine can't be identified, not using the platform cache.\n");
+		cache_platform = false;
+	}
+	if (cache_platform)
+		platform_cache_load(fingerprint);
+#endif
+
 #if IS_X86 || IS_ARM
-	if ((cb_parse_table(&cb_vendor, &cb_model) == 0) && (board_vendor != NULL) && (board_model != NULL)) {
+	if ((find_coreboot_ids(&cb_vendor, &cb_model) == 0) && (board_vendor != NULL) && (board_model != NULL)) {
 		if (strcasecmp(board_vendor, cb_vendor) || strcasecmp(board_model, cb_model)) {
 			msg_pwarn("Warning: The mainboard IDs set by -p internal:mainboard (%s:%s) do not\n"
 				  "         match the current coreboot IDs of the mainboard (%s:%s).\n",
@@ -269,7 +394,8 @@ int internal_init(void)
 	board_handle_before_superio();
 
 	/* Probe for the Super I/O chip and fill global struct superio. */
-	probe_superio();
+	if (!platform_cache.loaded)
+		probe_superio();
 #else
 	/* FIXME: Enable cbtable searching on all non-x86 platforms supported
 	 *        by coreboot.
@@ -332,6 +458,9 @@ int internal_init(void)
 		msg_perr("Aborting to be safe.\n");
 		return 1;
 	}
+
+	if (cache_platform && !platform_cache.loaded)
+		platform_cache_store(fingerprint, cb_vendor, cb_model);
 #endif
 
 #if IS_X86 || IS_MIPS
@@ -400,3 +529,40 @@ static void internal_chip_readn(const struct flashctx *flash, uint8_t *buf,
 	mmio_readn((void *)addr, buf, len);
 	return;
 }
+
+#define MAPPED_WINDOW_SPOTS	16
+#define MAPPED_WINDOW_SPOT_LEN	64
+
+/*
+ * Compare @virt, the memory mapping of @len bytes of the chip starting at @start, with what @read returns at
+ * spots all over it. The host may decode only part of the mapping, and an undecoded part reads as all 0xff
+ * (or 0x00). So every spot has to match and at least one of them has to hold some other data, blank spots
+ * alone don't prove anything. Returns 0 if the mapping can be used.
+ */
+int check_mapped_window(struct flashctx *flash, uint8_t *virt, unsigned int start, unsigned int len,
+			int (*read)(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len))
+{
+	uint8_t want[MAPPED_WINDOW_SPOT_LEN], have[MAPPED_WINDOW_SPOT_LEN];
+	unsigned int i, offs;
+	bool data = false;
+
+	if (len < MAPPED_WINDOW_SPOT_LEN)
+		return 1;
+	for (i = 0; i <= MAPPED_WINDOW_SPOTS; i++) {
+		/* The last spot is the end of the mapping, where the reset vector lives. */
+		offs = min(len / MAPPED_WINDOW_SPOTS * i, len - MAPPED_WINDOW_SPOT_LEN);
+		if (read(flash, want, start + offs, sizeof(want)))
+			return 1;
+		mmio_readn(virt + offs, have, sizeof(have));
+		if (memcmp(want, have, sizeof(want))) {
+			msg_pdbg("The memory mapping differs from the flash contents at 0x%06x.\n", start + offs);
+			return 1;
+		}
+		if (memcmp(want, want + 1, sizeof(want) - 1))
+			data = true;
+	}
+	if (!data)
+		msg_pdbg("The flash contents checked are blank, the memory mapping can't be told apart from an "
+			 "undecoded range.\n");
+	return !data;
+}
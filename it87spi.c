@@ -346,8 +346,22 @@ static int it8716f_spi_send_command(struct flashctx *flash,
 	return 0;
 }
 
-/* Page size is usually 256 bytes */
-static int it8716f_spi_page_program(struct flashctx *flash, const uint8_t *buf, unsigned int start)
+/* The command engine can't shift more than 1+3+1 bytes out and 3 bytes in per command. */
+#define IT87_MAX_READ		3
+/* Memory mapped programs can do up to 256 bytes at once. */
+#define IT87_MAX_MMIO_WRITE	256
+/* Only 512 kB of the chip are mapped to LPC memory cycles. */
+#define IT87_MAX_MMIO_SIZE	(512 * 1024)
+
+/* Wait until the Write-In-Progress bit is cleared, polling from the start: programs are short. */
+static void it8716f_spi_wait_wip(struct flashctx *flash)
+{
+	spi_poll_status_register(flash, SPI_SR_WIP, 0, 0, 100);
+}
+
+/* Program @len bytes (at most 256, not crossing a page) through the memory mapped window. */
+static int it8716f_spi_page_program(struct flashctx *flash, const uint8_t *buf, unsigned int start,
+				    unsigned int len)
 {
 	unsigned int i;
 	int result;
@@ -359,32 +373,68 @@ static int it8716f_spi_page_program(struct flashctx *flash, const uint8_t *buf,
 	/* FIXME: The command below seems to be redundant or wrong. */
 	OUTB(0x06, it8716f_flashport + 1);
 	OUTB(((2 + (fast_spi ? 1 : 0)) << 4), it8716f_flashport);
-	for (i = 0; i < flash->chip->page_size; i++)
+	for (i = 0; i < len; i++)
 		mmio_writeb(buf[i], (void *)(bios + start + i));
 	OUTB(0, it8716f_flashport);
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 1-10 ms, so wait in 1 ms steps.
-	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1000);
+	it8716f_spi_wait_wip(flash);
+	return 0;
+}
+
+/*
+ * Program @len bytes one at a time for the part of a chip that isn't mapped. Commands and status reads go
+ * straight to the command engine, that is all the IT87 can do here.
+ */
+static int it8716f_spi_byte_program(struct flashctx *flash, const uint8_t *buf, unsigned int start,
+				    unsigned int len)
+{
+	static const unsigned char wren = JEDEC_WREN;
+	static const unsigned char rdsr = JEDEC_RDSR;
+	unsigned char cmd[JEDEC_BYTE_PROGRAM_OUTSIZE] = { JEDEC_BYTE_PROGRAM };
+	unsigned char status;
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		cmd[1] = ((start + i) >> 16) & 0xff;
+		cmd[2] = ((start + i) >> 8) & 0xff;
+		cmd[3] = (start + i) & 0xff;
+		cmd[4] = buf[i];
+		if (it8716f_spi_send_command(flash, JEDEC_WREN_OUTSIZE, 0, &wren, NULL) ||
+		    it8716f_spi_send_command(flash, sizeof(cmd), 0, cmd, NULL))
+			return 1;
+		do {
+			if (it8716f_spi_send_command(flash, JEDEC_RDSR_OUTSIZE, JEDEC_RDSR_INSIZE, &rdsr, &status))
+				return 1;
+		} while (status & SPI_SR_WIP);
+	}
 	return 0;
 }
 
 /*
  * IT8716F only allows maximum of 512 kb SPI mapped to LPC memory cycles
  * Need to read this big flash using firmware cycles 3 byte at a time.
+ * Those are sent to the command engine directly, without splitting at page boundaries.
  */
 static int it8716f_spi_chip_read(struct flashctx *flash, uint8_t *buf,
 				 unsigned int start, unsigned int len)
 {
+	unsigned char cmd[JEDEC_READ_OUTSIZE] = { JEDEC_READ };
+	unsigned int i, n;
+
 	fast_spi = 0;
 
 	/* FIXME: Check if someone explicitly requested to use IT87 SPI although
 	 * the mainboard does not use IT87 SPI translation. This should be done
 	 * via a programmer parameter for the internal programmer.
 	 */
-	if ((flash->chip->total_size * 1024 > 512 * 1024)) {
-		spi_read_chunked(flash, buf, start, len, 3);
+	if ((flash->chip->total_size * 1024 > IT87_MAX_MMIO_SIZE)) {
+		for (i = 0; i < len; i += n) {
+			n = min(IT87_MAX_READ, len - i);
+			cmd[1] = ((start + i) >> 16) & 0xff;
+			cmd[2] = ((start + i) >> 8) & 0xff;
+			cmd[3] = (start + i) & 0xff;
+			if (it8716f_spi_send_command(flash, sizeof(cmd), n, cmd, buf + i))
+				return 1;
+		}
 	} else {
 		mmio_readn((void *)(flash->virtual_memory + start), buf, len);
 	}
@@ -396,40 +446,28 @@ static int it8716f_spi_chip_write_256(struct flashctx *flash, const uint8_t *buf
 				      unsigned int start, unsigned int len)
 {
 	const struct flashchip *chip = flash->chip;
+	unsigned int lenhere;
+
 	/*
 	 * IT8716F only allows maximum of 512 kb SPI chip size for memory
-	 * mapped access. It also can't write more than 1+3+256 bytes at once,
-	 * so page_size > 256 bytes needs a fallback.
-	 * FIXME: Split too big page writes into chunks IT87* can handle instead
-	 * of degrading to single-byte program.
+	 * mapped access, bigger chips are programmed byte by byte.
 	 * FIXME: Check if someone explicitly requested to use IT87 SPI although
 	 * the mainboard does not use IT87 SPI translation. This should be done
 	 * via a programmer parameter for the internal programmer.
 	 */
-	if ((chip->total_size * 1024 > 512 * 1024) || (chip->page_size > 256)) {
-		spi_chip_write_1(flash, buf, start, len);
-	} else {
-		unsigned int lenhere;
-
-		if (start % chip->page_size) {
-			/* start to the end of the page or to start + len,
-			 * whichever is smaller.
-			 */
-			lenhere = min(len, chip->page_size - start % chip->page_size);
-			spi_chip_write_1(flash, buf, start, lenhere);
-			start += lenhere;
-			len -= lenhere;
-			buf += lenhere;
-		}
-
-		while (len >= chip->page_size) {
-			it8716f_spi_page_program(flash, buf, start);
-			start += chip->page_size;
-			len -= chip->page_size;
-			buf += chip->page_size;
-		}
-		if (len)
-			spi_chip_write_1(flash, buf, start, len);
+	if (chip->total_size * 1024 > IT87_MAX_MMIO_SIZE)
+		return it8716f_spi_byte_program(flash, buf, start, len);
+
+	/* It also can't write more than 1+3+256 bytes at once, so bigger pages are split into chunks.
+	 * Partial pages at either end are programmed the same way. */
+	while (len) {
+		lenhere = min(len, chip->page_size - start % chip->page_size);
+		lenhere = min(lenhere, IT87_MAX_MMIO_WRITE);
+		if (it8716f_spi_page_program(flash, buf, start, lenhere))
+			return 1;
+		start += lenhere;
+		len -= lenhere;
+		buf += lenhere;
 	}
 
 	return 0;
@@ -44,6 +44,8 @@ static void toggle_ready_jedec_common(const struct flashctx *flash, chipaddr dst
 	unsigned int i = 0;
 	uint8_t tmp1, tmp2;
 
+	if (!chip_wait_toggle(flash, dst, delay, &tmp1))
+		return;
 	tmp1 = chip_readb(flash, dst) & 0x40;
 
 	while (i++ < 0xFFFFFFF) {
@@ -76,6 +78,30 @@ static void toggle_ready_jedec_slow(const struct flashctx *flash, chipaddr dst)
 	toggle_ready_jedec_common(flash, dst, 8 * 1000);
 }
 
+/*
+ * Like toggle_ready_jedec(), but watching @dst itself. The read that ends the wait already returns the
+ * contents of @dst, so it is handed back and callers can check what was programmed without another read.
+ */
+static uint8_t toggle_ready_jedec_read(const struct flashctx *flash, chipaddr dst)
+{
+	unsigned int i = 0;
+	uint8_t tmp1, tmp2;
+
+	if (!chip_wait_toggle(flash, dst, 0, &tmp2))
+		return tmp2;
+	tmp1 = tmp2 = chip_readb(flash, dst);
+
+	while (i++ < 0xFFFFFFF) {
+		tmp2 = chip_readb(flash, dst);
+		if (((tmp1 ^ tmp2) & 0x40) == 0)
+			break;
+		tmp1 = tmp2;
+	}
+	if (i > 0x100000)
+		msg_cdbg("%s: excessive loops, i=0x%x\n", __func__, i);
+	return tmp2;
+}
+
 void data_polling_jedec(const struct flashctx *flash, chipaddr dst,
 			uint8_t data)
 {
@@ -132,6 +158,8 @@ int probe_jedec_29gl(struct flashctx *flash)
 	/* Reset chip to a clean slate */
 	chip_writeb(flash, 0xF0, bios + (0x5555 & mask));
 
+	/* The chip leaves normal operation, earlier probe responses may not apply anymore. */
+	probe_cache_invalidate();
 	/* Issue JEDEC Product ID Entry command */
 	chip_writeb(flash, 0xAA, bios + (0x5555 & mask));
 	chip_writeb(flash, 0x55, bios + (0x2AAA & mask));
@@ -214,6 +242,8 @@ static int probe_jedec_common(struct flashctx *flash, unsigned int mask)
 	if (probe_timing_exit)
 		programmer_delay(probe_timing_exit);
 
+	/* The chip leaves normal operation, earlier probe responses may not apply anymore. */
+	probe_cache_invalidate();
 	/* Issue JEDEC Product ID Entry command */
 	chip_writeb(flash, 0xAA, bios + ((shifted ? 0x2AAA : 0x5555) & mask));
 	if (probe_timing_enter)
@@ -385,7 +415,7 @@ static int write_byte_program_jedec_common(const struct flashctx *flash, const u
 					   chipaddr dst, unsigned int mask)
 {
 	int tried = 0, failed = 0;
-	chipaddr bios = flash->virtual_memory;
+	uint8_t tmp;
 
 	/* If the data is 0xFF, don't program it and don't complain. */
 	if (*src == 0xFF) {
@@ -398,9 +428,13 @@ retry:
 
 	/* transfer data from source to destination */
 	chip_writeb(flash, *src, dst);
-	toggle_ready_jedec(flash, bios);
 
-	if (chip_readb(flash, dst) != *src && tried++ < MAX_REFLASH_TRIES) {
+	/* While the program is in progress DQ7 reads as the complement of the data, so reading back the data
+	 * already means it is done. This saves a round trip on external programmers. */
+	tmp = chip_readb(flash, dst);
+	if (tmp != *src)
+		tmp = toggle_ready_jedec_read(flash, dst);
+	if (tmp != *src && tried++ < MAX_REFLASH_TRIES) {
 		goto retry;
 	}
 
@@ -436,11 +470,10 @@ int write_jedec_1(struct flashctx *flash, const uint8_t *src, unsigned int start
 static int write_page_write_jedec_common(struct flashctx *flash, const uint8_t *src,
 					 unsigned int start, unsigned int page_size)
 {
-	int i, tried = 0, failed;
-	const uint8_t *s = src;
+	unsigned int i, n;
+	int tried = 0, failed;
 	chipaddr bios = flash->virtual_memory;
 	chipaddr dst = bios + start;
-	chipaddr d = dst;
 	unsigned int mask;
 
 	mask = getaddrmask(flash->chip);
@@ -449,19 +482,19 @@ retry:
 	/* Issue JEDEC Start Program command */
 	start_program_jedec_common(flash, mask);
 
-	/* transfer data from source to destination */
-	for (i = 0; i < page_size; i++) {
-		/* If the data is 0xFF, don't program it */
-		if (*src != 0xFF)
-			chip_writeb(flash, *src, dst);
-		dst++;
-		src++;
+	/* Transfer data from source to destination, each run of bytes in one go. If the data is 0xFF,
+	 * don't program it. */
+	for (i = 0; i < page_size; i += n) {
+		for (n = 0; i + n < page_size && src[i + n] != 0xFF; n++)
+			;
+		if (n)
+			chip_writen(flash, src + i, dst + i, n);
+		else
+			n = 1;
 	}
 
-	toggle_ready_jedec(flash, dst - 1);
+	toggle_ready_jedec(flash, dst + page_size - 1);
 
-	dst = d;
-	src = s;
 	failed = verify_range(flash, src, start, page_size);
 
 	if (failed && tried++ < MAX_REFLASH_TRIES) {
@@ -469,7 +502,7 @@ retry:
 		goto retry;
 	}
 	if (failed) {
-		msg_cerr(" page 0x%" PRIxPTR " failed!\n", (d - bios) / page_size);
+		msg_cerr(" page 0x%" PRIxPTR " failed!\n", (dst - bios) / page_size);
 	}
 	return failed;
 }
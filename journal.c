@@ -0,0 +1,248 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Progress journal for resumable writes (--journal). The file starts with lines identifying the chip and the
+ * image, followed by one line for every eraseblock that was written and read back successfully:
+ *
+ *	flashrom journal 1
+ *	chip <vendor> <name> <size> <manufacturer id> <model id>
+ *	image <CRC-32 of the image>
+ *	block <start> <length> <CRC-32 of the block>
+ *
+ * If a write of the same image to the same chip was interrupted, the blocks listed are neither read nor
+ * written again after a few of them were checked against the chip. The journal is removed once the write
+ * was verified.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "flash.h"
+
+#define JOURNAL_MAGIC		"flashrom journal 1"
+/* Blocks of an old journal read back before trusting it. */
+#define JOURNAL_SPOT_CHECKS	4
+/* Bytes compared at the start and end of each of them. */
+#define JOURNAL_CHECK_LEN	(64 * 1024)
+
+const char *journal_path = NULL;
+
+static FILE *journal;
+/* Ranges recorded so far, there is no need to list them twice. */
+static struct range_list journal_done = { 0 };
+/* The image being written and the header lines identifying it, to write the journal once more. */
+static const uint8_t *journal_image;
+static char journal_chip[256], journal_img[32];
+
+static void journal_header(const struct flashctx *flash, const uint8_t *image, char *chip, size_t chiplen,
+			   char *img, size_t imglen)
+{
+	const unsigned int size = flash->chip->total_size * 1024;
+
+	snprintf(chip, chiplen, "chip %s %s %u %04x %04x", flash->chip->vendor, flash->chip->name, size,
+		 flash->chip->manufacture_id, flash->chip->model_id);
+	snprintf(img, imglen, "image %08x", crc32_update(0, image, size));
+}
+
+/* Compare @len bytes at @start of the chip with @image. */
+static bool journal_matches(struct flashctx *flash, const uint8_t *image, unsigned int start, unsigned int len)
+{
+	uint8_t *buf = malloc(len);
+	bool ok;
+
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		return false;
+	}
+	ok = !flash->chip->read(flash, buf, start, len) && !memcmp(buf, image + start, len);
+	free(buf);
+	return ok;
+}
+
+/*
+ * Check the start and end of some of the @claimed ranges against the chip, including the first and the last
+ * one. Adjacent blocks are merged in @claimed, so looking at everything could take as long as the write.
+ */
+static bool journal_spot_check(struct flashctx *flash, const uint8_t *image, const struct range_list *claimed)
+{
+	unsigned int i, n = min(claimed->count, JOURNAL_SPOT_CHECKS);
+
+	for (i = 0; i < n; i++) {
+		const struct range *r = &claimed->ranges[n > 1 ? i * (claimed->count - 1) / (n - 1) : 0];
+		unsigned int len = min(r->len, JOURNAL_CHECK_LEN);
+		if (!journal_matches(flash, image, r->start, len) ||
+		    !journal_matches(flash, image, r->start + r->len - len, len))
+			return false;
+	}
+	return true;
+}
+
+/* Load the blocks an earlier run completed for @chip and @img into @done. */
+static void journal_load(struct flashctx *flash, const uint8_t *image, const char *chip, const char *img,
+			 struct range_list *done)
+{
+	const unsigned int size = flash->chip->total_size * 1024;
+	struct range_list claimed = { 0 };
+	unsigned int start, len, crc;
+	char line[512];
+	FILE *f = fopen(journal_path, "r");
+
+	if (!f)
+		return;
+	if (!fgets(line, sizeof(line), f) || strcmp(line, JOURNAL_MAGIC "\n") ||
+	    !fgets(line, sizeof(line), f) || strncmp(line, chip, strlen(chip)) || line[strlen(chip)] != '\n' ||
+	    !fgets(line, sizeof(line), f) || strncmp(line, img, strlen(img)) || line[strlen(img)] != '\n') {
+		msg_cinfo("Journal %s is for another chip or image, starting over.\n", journal_path);
+		fclose(f);
+		return;
+	}
+	/* A line cut short by the interruption fails to parse and ends the list. */
+	while (fgets(line, sizeof(line), f) && strchr(line, '\n') &&
+	       sscanf(line, "block %x %x %x", &start, &len, &crc) == 3) {
+		if (!len || start >= size || len > size - start || crc32_update(0, image + start, len) != crc)
+			continue;
+		if (range_list_add(&claimed, start, len))
+			break;
+	}
+	fclose(f);
+
+	if (!journal_spot_check(flash, image, &claimed)) {
+		msg_cinfo("The chip doesn't match journal %s, starting over.\n", journal_path);
+	} else if (claimed.count) {
+		unsigned int i, bytes = 0;
+		for (i = 0; i < claimed.count; i++) {
+			bytes += claimed.ranges[i].len;
+			if (range_list_add(done, claimed.ranges[i].start, claimed.ranges[i].len))
+				break;
+		}
+		msg_cinfo("Resuming from journal %s, %u bytes were already written.\n", journal_path, bytes);
+	}
+	range_list_free(&claimed);
+}
+
+/* Write the header and all blocks recorded so far to the (empty) journal. Returns 0 on success. */
+static int journal_write(void)
+{
+	unsigned int i;
+
+	fprintf(journal, JOURNAL_MAGIC "\n%s\n%s\n", journal_chip, journal_img);
+	for (i = 0; i < journal_done.count; i++) {
+		const struct range *r = &journal_done.ranges[i];
+		fprintf(journal, "block %x %x %08x\n", r->start, r->len,
+			crc32_update(0, journal_image + r->start, r->len));
+	}
+	return fflush(journal) || ferror(journal);
+}
+
+/* Replace the journal by what journal_done holds now. A journal that can't be written is removed. */
+static void journal_rewrite(void)
+{
+	journal = freopen(journal_path, "w", journal);
+	if (!journal || journal_write()) {
+		msg_gerr("Error: Can't write journal %s, removing it.\n", journal_path);
+		if (journal)
+			fclose(journal);
+		journal = NULL;
+		unlink(journal_path);
+	}
+}
+
+/*
+ * Start journaling a write of @image (as big as the chip). Blocks a previous, interrupted write of the same
+ * image completed are added to @done, they already hold the new contents. Returns 0 on success.
+ */
+int journal_start(struct flashctx *flash, const uint8_t *image, struct range_list *done)
+{
+	unsigned int i;
+
+	journal_header(flash, image, journal_chip, sizeof(journal_chip), journal_img, sizeof(journal_img));
+	journal_load(flash, image, journal_chip, journal_img, done);
+	journal_image = image;
+
+	journal = fopen(journal_path, "w");
+	if (!journal) {
+		msg_gerr("Error: Can't open journal %s.\n", journal_path);
+		return 1;
+	}
+	/* Keep what was resumed, the next run may need it just as well. */
+	for (i = 0; i < done->count; i++)
+		range_list_add(&journal_done, done->ranges[i].start, done->ranges[i].len);
+	if (journal_write()) {
+		msg_gerr("Error: Can't write journal %s.\n", journal_path);
+		fclose(journal);
+		journal = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Record that the block at @start/@len now holds @contents (the whole new image). If @written, it is read
+ * back first. Failures are not fatal, the block just has to be written again when resuming.
+ */
+void journal_block(struct flashctx *flash, unsigned int start, unsigned int len, const uint8_t *contents,
+		   bool written)
+{
+	if (!journal || range_list_contains(&journal_done, start, len))
+		return;
+	if (written && !journal_matches(flash, contents, start, len))
+		return;
+	fprintf(journal, "block %x %x %08x\n", start, len, crc32_update(0, contents + start, len));
+	fflush(journal);
+	range_list_add(&journal_done, start, len);
+}
+
+/*
+ * Drop the recorded blocks overlapping start..start+len-1 before it is erased, e.g. by an eraser with bigger
+ * blocks than those resumed. They must be written again when resuming after that erase.
+ */
+void journal_erasing(unsigned int start, unsigned int len)
+{
+	if (!journal || !range_list_overlaps(&journal_done, start, len))
+		return;
+	if (range_list_remove(&journal_done, start, len))
+		range_list_free(&journal_done);
+	journal_rewrite();
+}
+
+/*
+ * Forget the blocks recorded so far, before a failed write is retried with another eraser. It may erase
+ * them once more, e.g. as part of bigger blocks, so they must not be skipped when resuming.
+ */
+void journal_forget(void)
+{
+	if (!journal)
+		return;
+	range_list_free(&journal_done);
+	journal_rewrite();
+}
+
+/* Stop journaling. After a successful write the journal is not needed anymore. */
+void journal_finish(bool success)
+{
+	if (!journal)
+		return;
+	fclose(journal);
+	journal = NULL;
+	journal_image = NULL;
+	range_list_free(&journal_done);
+	if (success)
+		unlink(journal_path);
+}
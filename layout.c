@@ -26,8 +26,6 @@
 #include "flash.h"
 #include "programmer.h"
 
-#define MAX_ROMLAYOUT	32
-
 typedef struct {
 	chipoff_t start;
 	chipoff_t end;
@@ -36,13 +34,134 @@ typedef struct {
 } romentry_t;
 
 /* rom_entries store the entries specified in a layout file and associated run-time data */
-static romentry_t rom_entries[MAX_ROMLAYOUT];
+static romentry_t *rom_entries = NULL;
 static int num_rom_entries = 0; /* the number of successfully parsed rom_entries */
+static int rom_entries_size = 0; /* the number of rom_entries allocated */
 
 /* include_args holds the arguments specified at the command line with -i. They must be processed at some point
  * so that desired regions are marked as "included" in the rom_entries list. */
-static char *include_args[MAX_ROMLAYOUT];
+static char **include_args = NULL;
 static int num_include_args = 0; /* the number of valid include_args. */
+static int include_args_size = 0;
+
+/*
+ * Hash tables (open addressing, linear probing) of the indices of rom_entries and include_args by name, so
+ * looking up a name doesn't scan the whole list. Of several layout entries with the same name, only the first
+ * one can be found, like before.
+ */
+struct name_hash {
+	int *slots;		/* Index + 1, 0 marks an empty slot. */
+	unsigned int size;	/* Power of two, at least twice the number of names. */
+	unsigned int count;
+};
+static struct name_hash entry_names;
+static struct name_hash include_names;
+
+/* The union of all included regions, sorted by address, with overlapping and adjacent regions merged. Built on
+ * first use once the -i arguments were processed. */
+struct interval {
+	chipoff_t start;
+	chipoff_t end;
+};
+static struct interval *included_intervals = NULL;
+static unsigned int num_included_intervals = 0;
+static bool included_intervals_valid = false;
+
+static const char *entry_name(int i)
+{
+	return rom_entries[i].name;
+}
+
+static const char *include_arg_name(int i)
+{
+	return include_args[i];
+}
+
+static unsigned int hash_name(const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; *name; name++)
+		hash = (hash ^ (unsigned char)*name) * 16777619U;
+	return hash;
+}
+
+/* Returns the index @name has in @hash (or a negative value if it is not found). */
+static int name_hash_find(const struct name_hash *hash, const char *name, const char *(*name_of)(int i))
+{
+	unsigned int slot;
+
+	if (!hash->size)
+		return -1;
+	for (slot = hash_name(name) & (hash->size - 1); hash->slots[slot]; slot = (slot + 1) & (hash->size - 1)) {
+		if (!strcmp(name_of(hash->slots[slot] - 1), name))
+			return hash->slots[slot] - 1;
+	}
+	return -1;
+}
+
+static void name_hash_insert(struct name_hash *hash, int i, const char *(*name_of)(int i))
+{
+	unsigned int slot = hash_name(name_of(i)) & (hash->size - 1);
+
+	while (hash->slots[slot])
+		slot = (slot + 1) & (hash->size - 1);
+	hash->slots[slot] = i + 1;
+	hash->count++;
+}
+
+/* Add index @i to @hash. Returns 0 on success, 1 if memory allocation failed. */
+static int name_hash_add(struct name_hash *hash, int i, const char *(*name_of)(int i))
+{
+	struct name_hash bigger;
+	unsigned int j;
+
+	if (2 * (hash->count + 1) > hash->size) {
+		bigger.size = hash->size ? 2 * hash->size : 64;
+		bigger.count = 0;
+		bigger.slots = calloc(bigger.size, sizeof(*bigger.slots));
+		if (!bigger.slots) {
+			msg_gerr("Out of memory!\n");
+			return 1;
+		}
+		for (j = 0; j < hash->size; j++) {
+			if (hash->slots[j])
+				name_hash_insert(&bigger, hash->slots[j] - 1, name_of);
+		}
+		free(hash->slots);
+		*hash = bigger;
+	}
+	name_hash_insert(hash, i, name_of);
+	return 0;
+}
+
+static void name_hash_clear(struct name_hash *hash)
+{
+	free(hash->slots);
+	hash->slots = NULL;
+	hash->size = 0;
+	hash->count = 0;
+}
+
+/* Make room for @count elements of @elem_size bytes in the array at @array with @size allocated. Returns 0 on
+ * success, 1 if memory allocation failed. */
+static int grow_array(void **array, int *size, int count, size_t elem_size)
+{
+	int new_size;
+	void *tmp;
+
+	if (count <= *size)
+		return 0;
+	new_size = *size ? 2 * *size : 32;
+	tmp = realloc(*array, new_size * elem_size);
+	if (!tmp) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	*array = tmp;
+	*size = new_size;
+	return 0;
+}
 
 #ifndef __LIBPAYLOAD__
 int read_romlayout(const char *name)
@@ -62,9 +181,8 @@ int read_romlayout(const char *name)
 	while (!feof(romlayout)) {
 		char *tstr1, *tstr2;
 
-		if (num_rom_entries >= MAX_ROMLAYOUT) {
-			msg_gerr("Maximum number of ROM images (%i) in layout "
-				 "file reached.\n", MAX_ROMLAYOUT);
+		if (grow_array((void **)&rom_entries, &rom_entries_size, num_rom_entries + 1,
+			       sizeof(*rom_entries))) {
 			(void)fclose(romlayout);
 			return 1;
 		}
@@ -86,6 +204,11 @@ int read_romlayout(const char *name)
 		rom_entries[num_rom_entries].start = strtol(tstr1, (char **)NULL, 16);
 		rom_entries[num_rom_entries].end = strtol(tstr2, (char **)NULL, 16);
 		rom_entries[num_rom_entries].included = 0;
+		if (name_hash_find(&entry_names, rom_entries[num_rom_entries].name, entry_name) < 0 &&
+		    name_hash_add(&entry_names, num_rom_entries, entry_name)) {
+			(void)fclose(romlayout);
+			return 1;
+		}
 		num_rom_entries++;
 	}
 
@@ -101,36 +224,146 @@ int read_romlayout(const char *name)
 }
 #endif
 
-/* returns the index of the entry (or a negative value if it is not found) */
-static int find_include_arg(const char *const name)
+/* Add a layout entry. Returns 0 on success, 1 if memory allocation failed. */
+static int add_romentry(chipoff_t start, chipoff_t end, const char *name)
 {
-	unsigned int i;
-	for (i = 0; i < num_include_args; i++) {
-		if (!strcmp(include_args[i], name))
-			return i;
-	}
-	return -1;
+	romentry_t *entry;
+
+	if (grow_array((void **)&rom_entries, &rom_entries_size, num_rom_entries + 1, sizeof(*rom_entries)))
+		return 1;
+	entry = &rom_entries[num_rom_entries];
+	entry->start = start;
+	entry->end = end;
+	entry->included = 0;
+	snprintf(entry->name, sizeof(entry->name), "%s", name);
+	if (name_hash_find(&entry_names, entry->name, entry_name) < 0 &&
+	    name_hash_add(&entry_names, num_rom_entries, entry_name))
+		return 1;
+	num_rom_entries++;
+	included_intervals_valid = false;
+	return 0;
 }
 
-/* register an include argument (-i) for later processing */
-int register_include_arg(char *name)
+#define IFD_SIGNATURE		0x0ff0a55a
+#define IFD_MAX_REGIONS		5
+#define IFD_SIZE		0x1000
+
+static uint32_t ifd_read32(const uint8_t *buf, unsigned int off)
+{
+	return buf[off] | buf[off + 1] << 8 | buf[off + 2] << 16 | (uint32_t)buf[off + 3] << 24;
+}
+
+/*
+ * Create layout entries for the regions of the Intel flash descriptor in @desc. The region and master sections
+ * are decoded like in ich_descriptors.c, but without its platform dependencies. If no -i arguments were given,
+ * all regions the host (BIOS master) may write according to the descriptor are selected.
+ * Returns 0 on success, 1 on error.
+ */
+static int layout_from_ifd(const uint8_t *desc, unsigned int len)
 {
-	if (num_include_args >= MAX_ROMLAYOUT) {
-		msg_gerr("Too many regions included (%i).\n", num_include_args);
+	static const char *const region_names[IFD_MAX_REGIONS] = { "fd", "bios", "me", "gbe", "pd" };
+	unsigned int sig_off, frba, fmba, i;
+	uint32_t flmap0, flmap1, flmstr1, freg, base, limit;
+
+	if (len >= 4 && ifd_read32(desc, 0) == IFD_SIGNATURE)
+		sig_off = 0;
+	else if (len >= 0x14 && ifd_read32(desc, 0x10) == IFD_SIGNATURE)
+		sig_off = 0x10;
+	else {
+		msg_gerr("No Intel flash descriptor found.\n");
+		return 1;
+	}
+	if (len < sig_off + 12) {
+		msg_gerr("Intel flash descriptor is truncated.\n");
+		return 1;
+	}
+	flmap0 = ifd_read32(desc, sig_off + 4);
+	flmap1 = ifd_read32(desc, sig_off + 8);
+	frba = (flmap0 >> 12) & 0xff0;
+	fmba = (flmap1 << 4) & 0xff0;
+	if (len < frba + IFD_MAX_REGIONS * 4 || len < fmba + 4) {
+		msg_gerr("Intel flash descriptor is truncated.\n");
+		return 1;
+	}
+	flmstr1 = ifd_read32(desc, fmba);
+
+	for (i = 0; i < IFD_MAX_REGIONS; i++) {
+		freg = ifd_read32(desc, frba + i * 4);
+		base = (freg << 12) & 0x01fff000;
+		limit = ((freg >> 4) & 0x01fff000) | 0xfff;
+		if (base > limit) {
+			msg_gdbg("Descriptor region \"%s\" is unused.\n", region_names[i]);
+			continue;
+		}
+		msg_gdbg("Descriptor region \"%s\": 0x%08x - 0x%08x, host access %s%s.\n", region_names[i],
+			 base, limit, flmstr1 & (1 << (16 + i)) ? "r" : "-", flmstr1 & (1 << (24 + i)) ? "w" : "-");
+		if (add_romentry(base, limit, region_names[i]))
+			return 1;
+	}
+	if (!num_rom_entries) {
+		msg_gerr("The Intel flash descriptor does not define any regions.\n");
+		return 1;
+	}
+
+	if (num_include_args)
+		return 0;
+	for (i = 0; i < num_rom_entries; i++) {
+		unsigned int region = 0;
+		char *name;
+
+		while (strcmp(region_names[region], rom_entries[i].name))
+			region++;
+		if (!(flmstr1 & (1 << (24 + region))))
+			continue;
+		name = strdup(rom_entries[i].name);
+		if (!name) {
+			msg_gerr("Out of memory!\n");
+			return 1;
+		}
+		if (register_include_arg(name)) {
+			free(name);
+			return 1;
+		}
+	}
+	if (!num_include_args) {
+		msg_gerr("The Intel flash descriptor does not allow the host to write any region.\n");
 		return 1;
 	}
+	return 0;
+}
 
+#ifndef __LIBPAYLOAD__
+/* Build the layout from the Intel flash descriptor at the start of the image file @name. */
+int read_romlayout_ifd(const char *name)
+{
+	uint8_t desc[IFD_SIZE];
+
+	/* The image may be compressed like any other. */
+	if (read_buf_head_from_file(desc, sizeof(desc), name))
+		return 1;
+	msg_gdbg("Reading layout from the flash descriptor of \"%s\".\n", name);
+	return layout_from_ifd(desc, sizeof(desc));
+}
+#endif
+
+/* register an include argument (-i) for later processing */
+int register_include_arg(char *name)
+{
 	if (name == NULL) {
 		msg_gerr("<NULL> is a bad region name.\n");
 		return 1;
 	}
 
-	if (find_include_arg(name) != -1) {
+	if (name_hash_find(&include_names, name, include_arg_name) != -1) {
 		msg_gerr("Duplicate region name: \"%s\".\n", name);
 		return 1;
 	}
 
+	if (grow_array((void **)&include_args, &include_args_size, num_include_args + 1, sizeof(*include_args)))
+		return 1;
 	include_args[num_include_args] = name;
+	if (name_hash_add(&include_names, num_include_args, include_arg_name))
+		return 1;
 	num_include_args++;
 	return 0;
 }
@@ -144,15 +377,15 @@ static int find_romentry(char *name)
 		return -1;
 
 	msg_gspew("Looking for region \"%s\"... ", name);
-	for (i = 0; i < num_rom_entries; i++) {
-		if (!strcmp(rom_entries[i].name, name)) {
-			rom_entries[i].included = 1;
-			msg_gspew("found.\n");
-			return i;
-		}
+	i = name_hash_find(&entry_names, name, entry_name);
+	if (i < 0) {
+		msg_gspew("not found.\n");
+		return -1;
 	}
-	msg_gspew("not found.\n");
-	return -1;
+	rom_entries[i].included = 1;
+	included_intervals_valid = false;
+	msg_gspew("found.\n");
+	return i;
 }
 
 /* process -i arguments
@@ -198,45 +431,136 @@ void layout_cleanup(void)
 		free(include_args[i]);
 		include_args[i] = NULL;
 	}
+	free(include_args);
+	include_args = NULL;
+	include_args_size = 0;
 	num_include_args = 0;
+	name_hash_clear(&include_names);
 
-	for (i = 0; i < num_rom_entries; i++) {
-		rom_entries[i].included = 0;
-	}
+	free(rom_entries);
+	rom_entries = NULL;
+	rom_entries_size = 0;
 	num_rom_entries = 0;
+	name_hash_clear(&entry_names);
+
+	free(included_intervals);
+	included_intervals = NULL;
+	num_included_intervals = 0;
+	included_intervals_valid = false;
 }
 
-romentry_t *get_next_included_romentry(unsigned int start)
+static int compare_interval(const void *a, const void *b)
 {
-	int i;
-	unsigned int best_start = UINT_MAX;
-	romentry_t *best_entry = NULL;
-	romentry_t *cur;
+	const struct interval *x = a, *y = b;
+
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	if (x->end != y->end)
+		return x->end < y->end ? -1 : 1;
+	return 0;
+}
+
+/* Build included_intervals if needed. Returns 0 on success, 1 if memory allocation failed. */
+static int build_included_intervals(void)
+{
+	struct interval *iv;
+	unsigned int i, n = 0;
 
-	/* First come, first serve for overlapping regions. */
+	if (included_intervals_valid)
+		return 0;
+	free(included_intervals);
+	included_intervals = NULL;
+	num_included_intervals = 0;
+	if (!num_rom_entries) {
+		included_intervals_valid = true;
+		return 0;
+	}
+
+	iv = malloc(num_rom_entries * sizeof(*iv));
+	if (!iv) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
 	for (i = 0; i < num_rom_entries; i++) {
-		cur = &rom_entries[i];
-		if (!cur->included)
+		/* Regions with negative size are rejected by normalize_romentries(). */
+		if (!rom_entries[i].included || rom_entries[i].start > rom_entries[i].end)
 			continue;
-		/* Already past the current entry? */
-		if (start > cur->end)
+		iv[n].start = rom_entries[i].start;
+		iv[n].end = rom_entries[i].end;
+		n++;
+	}
+	qsort(iv, n, sizeof(*iv), compare_interval);
+	num_included_intervals = 0;
+	for (i = 0; i < n; i++) {
+		struct interval *last = num_included_intervals ? &iv[num_included_intervals - 1] : NULL;
+		/* iv[i].start > last->end implies iv[i].start > 0, so the subtraction can't wrap. */
+		if (last && (iv[i].start <= last->end || iv[i].start - 1 == last->end)) {
+			if (iv[i].end > last->end)
+				last->end = iv[i].end;
 			continue;
-		/* Inside the current entry? */
-		if (start >= cur->start)
-			return cur;
-		/* Entry begins after start. */
-		if (best_start > cur->start) {
-			best_start = cur->start;
-			best_entry = cur;
 		}
+		iv[num_included_intervals++] = iv[i];
+	}
+	included_intervals = iv;
+	included_intervals_valid = true;
+	return 0;
+}
+
+/* Returns true if the user requested only parts of the chip to be written. */
+bool layout_has_included_regions(void)
+{
+	return num_include_args != 0;
+}
+
+/* Returns true if any included region overlaps with the range start..start+len-1. */
+bool included_regions_overlap(unsigned int start, unsigned int len)
+{
+	unsigned int lo = 0, hi, mid;
+
+	/* Without the index, better assume the range is needed. */
+	if (build_included_intervals())
+		return true;
+	/* Find the first interval not ending before start. */
+	hi = num_included_intervals;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (included_intervals[mid].end < start)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	return best_entry;
+	return lo < num_included_intervals && included_intervals[lo].start <= start + len - 1;
+}
+
+/* Add all included regions to @ranges. Returns 0 on success, 1 if memory allocation failed. */
+int get_included_ranges(struct range_list *ranges)
+{
+	unsigned int i;
+
+	if (build_included_intervals())
+		return 1;
+	for (i = 0; i < num_included_intervals; i++) {
+		if (range_list_add(ranges, included_intervals[i].start,
+				   included_intervals[i].end - included_intervals[i].start + 1))
+			return 1;
+	}
+	return 0;
+}
+
+static int compare_entry_start(const void *a, const void *b)
+{
+	const romentry_t *x = &rom_entries[*(const int *)a], *y = &rom_entries[*(const int *)b];
+
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	return *(const int *)a - *(const int *)b;
 }
 
 /* Validate and - if needed - normalize layout entries. */
 int normalize_romentries(const struct flashctx *flash)
 {
 	chipsize_t total_size = flash->chip->total_size * 1024;
+	int *sorted;
 	int ret = 0;
 
 	int i;
@@ -254,6 +578,29 @@ int normalize_romentries(const struct flashctx *flash)
 		}
 	}
 
+	/* Overlapping regions are fine (the union of the included ones is used), but worth a note. One pass
+	 * over the entries sorted by start address finds them: every entry is checked against the one reaching
+	 * furthest among those before it. */
+	sorted = malloc(num_rom_entries * sizeof(*sorted));
+	if (num_rom_entries > 1 && sorted) {
+		int furthest;
+
+		for (i = 0; i < num_rom_entries; i++)
+			sorted[i] = i;
+		qsort(sorted, num_rom_entries, sizeof(*sorted), compare_entry_start);
+		furthest = sorted[0];
+		for (i = 1; i < num_rom_entries; i++) {
+			const romentry_t *cur = &rom_entries[sorted[i]];
+
+			if (cur->start <= rom_entries[furthest].end)
+				msg_gdbg("Regions \"%s\" and \"%s\" overlap.\n", rom_entries[furthest].name,
+					 cur->name);
+			if (cur->end > rom_entries[furthest].end)
+				furthest = sorted[i];
+		}
+	}
+	free(sorted);
+
 	return ret;
 }
 
@@ -273,15 +620,49 @@ static int copy_old_content(struct flashctx *flash, int oldcontents_valid, uint8
 	return 0;
 }
 
+/*
+ * Copy the old content of start..start+size-1 to @newcontents, but only where it lies within @touched (if that
+ * is not NULL). @cursor is the index of the first range of @touched which may still matter, the calls have to
+ * be made in the order of increasing addresses.
+ */
+static int copy_preserved_content(struct flashctx *flash, int oldcontents_valid, uint8_t *oldcontents,
+				  uint8_t *newcontents, unsigned int start, unsigned int size,
+				  const struct range_list *touched, unsigned int *cursor)
+{
+	unsigned int end = start + size;
+
+	if (!touched)
+		return copy_old_content(flash, oldcontents_valid, oldcontents, newcontents, start, size);
+	for (; *cursor < touched->count; (*cursor)++) {
+		const struct range *r = &touched->ranges[*cursor];
+		unsigned int rstart = max(r->start, start);
+		unsigned int rend = min(r->start + r->len, end);
+
+		if (r->start >= end)
+			break;
+		if (rstart < rend &&
+		    copy_old_content(flash, oldcontents_valid, oldcontents, newcontents, rstart, rend - rstart))
+			return 1;
+		/* The range may reach into the next gap as well. */
+		if (r->start + r->len > end)
+			break;
+	}
+	return 0;
+}
+
 /**
  * Modify @newcontents so that it contains the data that should be on the chip eventually. In the case the user
  * wants to update only parts of it, copy the chunks to be preserved from @oldcontents to @newcontents. If
  * @oldcontents is not valid, we need to fetch the current data from the chip first.
+ *
+ * If @touched is not NULL, only the preserved parts within it are copied. It lists the parts of the chip the
+ * erase/write code may touch (i.e. the eraseblocks overlapping included regions); newcontents is not looked at
+ * anywhere else, so copying the rest of the chip would be wasted work.
  */
-int build_new_image(struct flashctx *flash, bool oldcontents_valid, uint8_t *oldcontents, uint8_t *newcontents)
+int build_new_image(struct flashctx *flash, bool oldcontents_valid, uint8_t *oldcontents, uint8_t *newcontents,
+		    const struct range_list *touched)
 {
-	unsigned int start = 0;
-	romentry_t *entry;
+	unsigned int start = 0, i, cursor = 0;
 	unsigned int size = flash->chip->total_size * 1024;
 
 	/* If no regions were specified for inclusion, assume
@@ -290,26 +671,27 @@ int build_new_image(struct flashctx *flash, bool oldcontents_valid, uint8_t *old
 	if (num_include_args == 0)
 		return 0;
 
+	if (build_included_intervals())
+		return 1;
+
 	/* Non-included romentries are ignored.
-	 * The union of all included romentries is used from the new image.
+	 * The union of all included romentries is used from the new image, everything in between comes
+	 * from the old content.
 	 */
-	while (start < size) {
-		entry = get_next_included_romentry(start);
-		/* No more romentries for remaining region? */
-		if (!entry) {
-			copy_old_content(flash, oldcontents_valid, oldcontents, newcontents, start,
-					 size - start);
-			break;
-		}
-		/* For non-included region, copy from old content. */
-		if (entry->start > start)
-			copy_old_content(flash, oldcontents_valid, oldcontents, newcontents, start,
-					 entry->start - start);
-		/* Skip to location after current romentry. */
-		start = entry->end + 1;
+	for (i = 0; i < num_included_intervals && start < size; i++) {
+		if (included_intervals[i].start > start &&
+		    copy_preserved_content(flash, oldcontents_valid, oldcontents, newcontents, start,
+					   min(included_intervals[i].start, size) - start, touched, &cursor))
+			return 1;
+		/* Skip to location after the current interval. */
+		start = included_intervals[i].end + 1;
 		/* Catch overflow. */
 		if (!start)
-			break;
+			return 0;
 	}
+	if (start < size &&
+	    copy_preserved_content(flash, oldcontents_valid, oldcontents, newcontents, start, size - start,
+				   touched, &cursor))
+		return 1;
 	return 0;
 }
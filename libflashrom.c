@@ -0,0 +1,312 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * The libflashrom API (see libflashrom.h) on top of the same core the command line tools use. This file
+ * also provides print() for library users, so it is only linked into libflashrom.a.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flash.h"
+#include "programmer.h"
+#include "libflashrom.h"
+
+/* Probe for up to eight flash chips, like the CLI. */
+#define MAX_PROBED_CHIPS	8
+
+struct flashrom_ctx {
+	struct flashctx flash;
+	char *prog_params;	/* programmer_init() keeps pointing into it. */
+	bool force;
+	bool verify_after_write;
+	flashrom_progress_callback *progress_cb;
+	void *progress_data;
+};
+
+static flashrom_log_callback *log_callback;
+static int log_level = FLASHROM_MSG_SPEW;
+int print_level_max = -1;
+/* The programmer drivers keep their state in globals, so there can only be one context. */
+static bool ctx_active;
+
+void flashrom_set_log_callback(flashrom_log_callback *callback)
+{
+	log_callback = callback;
+	print_level_max = callback ? log_level : -1;
+}
+
+void flashrom_set_log_level(enum flashrom_log_level level)
+{
+	log_level = level;
+	if (log_callback)
+		print_level_max = level;
+}
+
+int print(enum msglevel level, const char *fmt, ...)
+{
+	va_list ap;
+	int ret = 0;
+
+	va_start(ap, fmt);
+	ret = print_captured(level, fmt, ap);
+	va_end(ap);
+	if (ret >= 0)
+		return ret;
+	ret = 0;
+	if (log_callback && level <= log_level) {
+		va_start(ap, fmt);
+		ret = log_callback((enum flashrom_log_level)level, fmt, ap);
+		va_end(ap);
+	}
+	return ret;
+}
+
+int flashrom_init(struct flashrom_ctx **ctx, const char *prog_name, const char *prog_params)
+{
+	static bool delay_calibrated;
+	enum programmer prog;
+
+	*ctx = NULL;
+	if (ctx_active) {
+		msg_gerr("Error: Only one libflashrom context can be used at a time.\n");
+		return 1;
+	}
+	for (prog = 0; prog < PROGRAMMER_INVALID; prog++) {
+		if (!strcmp(programmer_table[prog].name, prog_name))
+			break;
+	}
+	if (prog == PROGRAMMER_INVALID) {
+		msg_gerr("Error: Unknown programmer \"%s\".\n", prog_name);
+		return 1;
+	}
+
+	*ctx = calloc(1, sizeof(**ctx));
+	if (!*ctx) {
+		msg_gerr("Out of memory!\n");
+		return 1;
+	}
+	(*ctx)->verify_after_write = true;
+	if (prog_params) {
+		(*ctx)->prog_params = strdup(prog_params);
+		if (!(*ctx)->prog_params) {
+			msg_gerr("Out of memory!\n");
+			goto err_free;
+		}
+	}
+
+	/* FIXME: Delay calibration should happen in programmer code. */
+	if (!delay_calibrated) {
+		myusec_calibrate_delay();
+		delay_calibrated = true;
+	}
+	if (programmer_init(prog, (*ctx)->prog_params)) {
+		msg_perr("Error: Programmer initialization failed.\n");
+		programmer_shutdown();
+		goto err_free;
+	}
+	ctx_active = true;
+	return 0;
+
+err_free:
+	free((*ctx)->prog_params);
+	free(*ctx);
+	*ctx = NULL;
+	return 1;
+}
+
+static void release_chip(struct flashrom_ctx *ctx)
+{
+	if (!ctx->flash.chip)
+		return;
+	unmap_flash(&ctx->flash);
+	free(ctx->flash.chip);
+	memset(&ctx->flash, 0, sizeof(ctx->flash));
+}
+
+int flashrom_probe(struct flashrom_ctx *ctx, const char *chip_name)
+{
+	struct flashctx flashes[MAX_PROBED_CHIPS] = {{0}};
+	int chipcount, ret = 0;
+	int i;
+
+	release_chip(ctx);
+
+	/* probe_flash() takes the chip name from the global -c setting. */
+	chip_to_probe = chip_name;
+	chipcount = probe_masters(flashes, ARRAY_SIZE(flashes));
+	chip_to_probe = NULL;
+
+	if (chipcount > 1) {
+		msg_cinfo("Multiple flash chip definitions match the detected chip(s): \"%s\"",
+			  flashes[0].chip->name);
+		for (i = 1; i < chipcount; i++)
+			msg_cinfo(", \"%s\"", flashes[i].chip->name);
+		msg_cinfo("\n");
+		ret = 3;
+	} else if (!chipcount) {
+		msg_cinfo("No EEPROM/flash device found.\n");
+		ret = 2;
+	} else if (count_max_decode_exceedings(&flashes[0]) && !ctx->force) {
+		msg_cerr("This flash chip is too big for this programmer.\n");
+		ret = 1;
+	} else if (map_flash(&flashes[0])) {
+		ret = 1;
+	} else {
+		flashes[0].profile = timing_profile_load(&flashes[0]);
+		if (spi_autospeed(&flashes[0])) {
+			unmap_flash(&flashes[0]);
+			ret = 1;
+		}
+	}
+
+	if (!ret) {
+		ctx->flash = flashes[0];
+		/* Give the chip time to settle. */
+		programmer_delay(100000);
+		i = 1;
+	} else {
+		i = 0;
+	}
+	for (; i < chipcount; i++)
+		free(flashes[i].chip);
+	return ret;
+}
+
+int flashrom_shutdown(struct flashrom_ctx *ctx)
+{
+	int ret;
+
+	if (!ctx)
+		return 0;
+	release_chip(ctx);
+	layout_cleanup();
+	ret = programmer_shutdown();
+	free(ctx->prog_params);
+	free(ctx);
+	ctx_active = false;
+	return ret;
+}
+
+size_t flashrom_flash_size(const struct flashrom_ctx *ctx)
+{
+	return ctx->flash.chip ? ctx->flash.chip->total_size * 1024 : 0;
+}
+
+const char *flashrom_flash_vendor(const struct flashrom_ctx *ctx)
+{
+	return ctx->flash.chip ? ctx->flash.chip->vendor : NULL;
+}
+
+const char *flashrom_flash_name(const struct flashrom_ctx *ctx)
+{
+	return ctx->flash.chip ? ctx->flash.chip->name : NULL;
+}
+
+void flashrom_set_force(struct flashrom_ctx *ctx, bool force)
+{
+	ctx->force = force;
+}
+
+void flashrom_set_verify_after_write(struct flashrom_ctx *ctx, bool verify)
+{
+	ctx->verify_after_write = verify;
+}
+
+void flashrom_set_progress_callback(struct flashrom_ctx *ctx, flashrom_progress_callback *callback,
+				    void *user_data)
+{
+	ctx->progress_cb = callback;
+	ctx->progress_data = user_data;
+}
+
+int flashrom_layout_load(struct flashrom_ctx *ctx, const char *filename)
+{
+	return read_romlayout(filename);
+}
+
+int flashrom_layout_include(struct flashrom_ctx *ctx, const char *region)
+{
+	char *name = strdup(region);
+
+	if (!name || register_include_arg(name)) {
+		free(name);
+		return 1;
+	}
+	return 0;
+}
+
+void flashrom_layout_clear(struct flashrom_ctx *ctx)
+{
+	layout_cleanup();
+}
+
+static void report_progress(struct flashctx *flash, enum progress_stage stage, unsigned int current,
+			    unsigned int total)
+{
+	struct flashrom_ctx *ctx = flash->progress_data;
+
+	ctx->progress_cb((enum flashrom_progress_stage)stage, current, total, ctx->progress_data);
+}
+
+/* Run one operation through doit_buffer(). */
+static int run_operation(struct flashrom_ctx *ctx, void *buf, size_t len, int read_it, int write_it,
+			 int erase_it, int verify_it)
+{
+	int ret;
+
+	if (!ctx->flash.chip) {
+		msg_gerr("Error: No flash chip was probed.\n");
+		return 1;
+	}
+	if (buf && len != flashrom_flash_size(ctx)) {
+		msg_gerr("Error: The buffer has %zu bytes, but the chip %u.\n", len,
+			 ctx->flash.chip->total_size * 1024);
+		return 1;
+	}
+	if ((write_it || verify_it) && process_include_args())
+		return 1;
+
+	ctx->flash.progress_callback = ctx->progress_cb ? report_progress : NULL;
+	ctx->flash.progress_data = ctx;
+	ret = doit_buffer(&ctx->flash, ctx->force, buf, read_it, write_it, erase_it, verify_it);
+	ctx->flash.progress_callback = NULL;
+	return ret;
+}
+
+int flashrom_read(struct flashrom_ctx *ctx, void *buf, size_t len)
+{
+	return run_operation(ctx, buf, len, 1, 0, 0, 0);
+}
+
+int flashrom_write(struct flashrom_ctx *ctx, const void *buf, size_t len)
+{
+	/* doit_buffer() doesn't modify the image it is given. */
+	return run_operation(ctx, (void *)buf, len, 0, 1, 0, ctx->verify_after_write);
+}
+
+int flashrom_verify(struct flashrom_ctx *ctx, const void *buf, size_t len)
+{
+	return run_operation(ctx, (void *)buf, len, 0, 0, 0, 1);
+}
+
+int flashrom_erase(struct flashrom_ctx *ctx)
+{
+	return run_operation(ctx, NULL, 0, 0, 0, 1, 0);
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * libflashrom: programmer and chip access for other programs, without spawning flashrom for every
+ * operation. Link with libflashrom.a (and the libraries the enabled programmers need).
+ *
+ * A context is one initialized programmer with (after flashrom_probe()) one chip. Image data is passed in
+ * caller-provided buffers of exactly the chip size. The programmer drivers keep their state in globals, so
+ * only one context can exist at a time; flashrom_init() fails while another one is active. Functions return
+ * 0 on success.
+ */
+
+#ifndef __LIBFLASHROM_H__
+#define __LIBFLASHROM_H__ 1
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct flashrom_ctx;
+
+enum flashrom_log_level {
+	FLASHROM_MSG_ERROR	= 0,
+	FLASHROM_MSG_WARN	= 1,
+	FLASHROM_MSG_INFO	= 2,
+	FLASHROM_MSG_DEBUG	= 3,
+	FLASHROM_MSG_DEBUG2	= 4,
+	FLASHROM_MSG_SPEW	= 5,
+};
+typedef int (flashrom_log_callback)(enum flashrom_log_level level, const char *format, va_list args);
+/* All messages are passed to @callback, nothing is printed without one. */
+void flashrom_set_log_callback(flashrom_log_callback *callback);
+/* Drop messages above @level (default FLASHROM_MSG_SPEW) before they are even formatted. */
+void flashrom_set_log_level(enum flashrom_log_level level);
+
+enum flashrom_progress_stage {
+	FLASHROM_PROGRESS_READ,
+	FLASHROM_PROGRESS_WRITE,	/* Erasing and writing */
+	FLASHROM_PROGRESS_VERIFY,
+};
+/* @current is the offset up to which the chip was handled, @total the chip size. */
+typedef void (flashrom_progress_callback)(enum flashrom_progress_stage stage, size_t current, size_t total,
+					  void *user_data);
+
+/* Initialize programmer @prog_name with the parameters @prog_params (as given to -p after the colon). */
+int flashrom_init(struct flashrom_ctx **ctx, const char *prog_name, const char *prog_params);
+/*
+ * Look for the flash chip, with the definition named @chip_name only if not NULL. Returns 0 if exactly one
+ * chip was found, 2 if none, 3 if several definitions match (then select one with @chip_name) and 1 on
+ * other errors.
+ */
+int flashrom_probe(struct flashrom_ctx *ctx, const char *chip_name);
+/* Shut the programmer down and free @ctx. */
+int flashrom_shutdown(struct flashrom_ctx *ctx);
+
+/* Information about the probed chip. */
+size_t flashrom_flash_size(const struct flashrom_ctx *ctx);
+const char *flashrom_flash_vendor(const struct flashrom_ctx *ctx);
+const char *flashrom_flash_name(const struct flashrom_ctx *ctx);
+
+/* Override safety checks (like -f). Off by default. */
+void flashrom_set_force(struct flashrom_ctx *ctx, bool force);
+/* Verify the chip after writing it. On by default. */
+void flashrom_set_verify_after_write(struct flashrom_ctx *ctx, bool verify);
+void flashrom_set_progress_callback(struct flashrom_ctx *ctx, flashrom_progress_callback *callback,
+				    void *user_data);
+
+/*
+ * Restrict writes to regions of a layout (like -l and -i). Regions are included one by one after loading
+ * the layout file; flashrom_layout_clear() forgets both.
+ */
+int flashrom_layout_load(struct flashrom_ctx *ctx, const char *filename);
+int flashrom_layout_include(struct flashrom_ctx *ctx, const char *region);
+void flashrom_layout_clear(struct flashrom_ctx *ctx);
+
+/* @buf has to hold flashrom_flash_size() bytes. */
+int flashrom_read(struct flashrom_ctx *ctx, void *buf, size_t len);
+int flashrom_write(struct flashrom_ctx *ctx, const void *buf, size_t len);
+int flashrom_verify(struct flashrom_ctx *ctx, const void *buf, size_t len);
+int flashrom_erase(struct flashrom_ctx *ctx);
+
+#endif /* !__LIBFLASHROM_H__ */
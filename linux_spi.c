@@ -36,42 +36,186 @@
 #include "spi.h"
 
 static int fd = -1;
+/* The most spidev moves in one ioctl (all transfers together), see its bufsiz module parameter. */
+#define BUF_SIZE_FROM_SYSFS	"/sys/module/spidev/parameters/bufsiz"
+static size_t max_kernel_buf_size;
+/* Transfers per ioctl, every command takes up to two. */
+#define LINUX_SPI_MAX_TRANSFERS	64
+/* Room left in reads and writes for the opcode, address and dummy bytes. */
+#define LINUX_SPI_CMD_OVERHEAD	16
+/* Clock for reads of the array and for everything else, 0 for the device's default. */
+static uint32_t read_speed_hz;
+static uint32_t cmd_speed_hz;
 
 static int linux_spi_shutdown(void *data);
 static int linux_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 				  unsigned int readcnt,
 				  const unsigned char *txbuf,
 				  unsigned char *rxbuf);
+static int linux_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds);
 static int linux_spi_read(struct flashctx *flash, uint8_t *buf,
 			  unsigned int start, unsigned int len);
 static int linux_spi_write_256(struct flashctx *flash, const uint8_t *buf,
 			       unsigned int start, unsigned int len);
+#ifdef SPI_IOC_WR_MODE32
+static int linux_spi_multi_io_read(struct flashctx *flash, enum spi_io_mode mode, unsigned int writecnt,
+				   unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr);
+#endif
+static int linux_spi_set_speed(unsigned int khz);
 
-static const struct spi_master spi_master_linux = {
+/* Clock rates tried by spispeed=auto. */
+static const unsigned int linux_spi_speeds_khz[] = {
+	500, 1000, 2000, 4000, 8000, 12000, 16000, 20000, 25000, 33000, 40000, 50000, 0
+};
+
+static struct spi_master spi_master_linux = {
 	.type		= SPI_CONTROLLER_LINUX,
 	.max_data_read	= MAX_DATA_UNSPECIFIED, /* TODO? */
 	.max_data_write	= MAX_DATA_UNSPECIFIED, /* TODO? */
 	.command	= linux_spi_send_command,
-	.multicommand	= default_spi_send_multicommand,
+	.multicommand	= linux_spi_send_multicommand,
+	.gather		= true,
 	.read		= linux_spi_read,
 	.write_256	= linux_spi_write_256,
 	.write_aai	= default_spi_write_aai,
+#ifdef SPI_IOC_WR_MODE32
+	.multi_io_read	= linux_spi_multi_io_read,
+#endif
+	.speeds_khz	= linux_spi_speeds_khz,
+	.set_speed	= linux_spi_set_speed,
 };
 
+#ifdef SPI_IOC_WR_MODE32
+/* Try to enable reads with up to @lines data lines. */
+static void linux_spi_setup_multi_io(uint8_t mode, unsigned int lines)
+{
+	uint32_t mode32 = mode | SPI_TX_DUAL | SPI_RX_DUAL;
+
+	if (lines == 4)
+		mode32 = mode | SPI_TX_QUAD | SPI_RX_QUAD;
+	/* The kernel silently drops what the controller can't do, so read back what is left. */
+	if (ioctl(fd, SPI_IOC_WR_MODE32, &mode32) == -1 || ioctl(fd, SPI_IOC_RD_MODE32, &mode32) == -1) {
+		msg_pdbg("Multi-I/O reads are not supported: %s\n", strerror(errno));
+		return;
+	}
+	if (mode32 & (SPI_RX_DUAL | SPI_RX_QUAD))
+		spi_master_linux.io_modes |= SPI_IO_MODE(SPI_IO_1_1_2);
+	if ((mode32 & (SPI_RX_DUAL | SPI_RX_QUAD)) && (mode32 & (SPI_TX_DUAL | SPI_TX_QUAD)))
+		spi_master_linux.io_modes |= SPI_IO_MODE(SPI_IO_1_2_2);
+	if (mode32 & SPI_RX_QUAD)
+		spi_master_linux.io_modes |= SPI_IO_MODE(SPI_IO_1_1_4);
+	if ((mode32 & SPI_RX_QUAD) && (mode32 & SPI_TX_QUAD))
+		spi_master_linux.io_modes |= SPI_IO_MODE(SPI_IO_1_4_4);
+	msg_pdbg("Multi-I/O read modes: 0x%x\n", spi_master_linux.io_modes);
+}
+#endif
+
+/* Find out how much data the kernel takes per ioctl. It defaults to a page and can be raised when loading
+ * the module, so it is worth asking. */
+static void linux_spi_get_bufsiz(void)
+{
+	char buf[16];
+	FILE *fp;
+
+	max_kernel_buf_size = 0;
+	fp = fopen(BUF_SIZE_FROM_SYSFS, "r");
+	if (!fp) {
+		msg_pdbg("Cannot open %s: %s\n", BUF_SIZE_FROM_SYSFS, strerror(errno));
+	} else {
+		if (fgets(buf, sizeof(buf), fp))
+			max_kernel_buf_size = strtoul(buf, NULL, 10);
+		else
+			msg_pdbg("Cannot read %s\n", BUF_SIZE_FROM_SYSFS);
+		fclose(fp);
+	}
+	/* Anything smaller than that is unlikely and would leave no room for data. */
+	if (max_kernel_buf_size < 2 * LINUX_SPI_CMD_OVERHEAD)
+		max_kernel_buf_size = getpagesize();
+	msg_pdbg("Using up to %zu bytes per transaction\n", max_kernel_buf_size);
+}
+
+/* Parse the clock in kHz given as programmer parameter @name into @speed_hz (left alone if not given).
+ * If @autospeed is not NULL, "auto" is accepted as well and sets it. */
+static int linux_spi_get_speed(const char *name, uint32_t *speed_hz, bool *autospeed)
+{
+	char *p, *endp;
+
+	p = extract_programmer_param(name);
+	if (p && autospeed && !strcmp(p, "auto")) {
+		*autospeed = true;
+	} else if (p && strlen(p)) {
+		*speed_hz = (uint32_t)strtoul(p, &endp, 10) * 1000;
+		if (p == endp || *endp) {
+			msg_perr("%s: invalid %s: %s kHz\n", __func__, name, p);
+			free(p);
+			return 1;
+		}
+	}
+	free(p);
+	return 0;
+}
+
+/* Use @khz for all transfers. */
+static int linux_spi_set_speed(unsigned int khz)
+{
+	uint32_t speed_hz = khz * 1000;
+
+	if (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) == -1) {
+		msg_perr("%s: failed to set speed to %u Hz: %s\n", __func__, speed_hz, strerror(errno));
+		return 1;
+	}
+	cmd_speed_hz = read_speed_hz = speed_hz;
+	return 0;
+}
+
+/* Clock for a command starting with @writearr. Reads of the array may be clocked differently, e.g. much
+ * faster than the probing and status commands. */
+static uint32_t linux_spi_speed(const unsigned char *writearr, unsigned int readcnt)
+{
+	if (readcnt && (writearr[0] == JEDEC_READ || writearr[0] == JEDEC_READ_4BA))
+		return read_speed_hz;
+	return cmd_speed_hz;
+}
+
 int linux_spi_init(void)
 {
 	char *p, *endp, *dev;
 	uint32_t speed_hz = 0;
-	/* FIXME: make the following configurable by CLI options. */
-	/* SPI mode 0 (beware this also includes: MSB first, CS active low and others */
-	const uint8_t mode = SPI_MODE_0;
+	unsigned int io_lines = 2;
+	/* SPI mode 0 by default (beware this also includes: MSB first, CS active low and others */
+	uint8_t mode = SPI_MODE_0;
 	const uint8_t bits = 8;
+	bool autospeed = false;
+
+	if (linux_spi_get_speed("spispeed", &speed_hz, &autospeed))
+		return 1;
+	cmd_speed_hz = read_speed_hz = speed_hz;
+	if (linux_spi_get_speed("readspeed", &read_speed_hz, NULL))
+		return 1;
 
-	p = extract_programmer_param("spispeed");
+	p = extract_programmer_param("mode");
 	if (p && strlen(p)) {
-		speed_hz = (uint32_t)strtoul(p, &endp, 10) * 1000;
-		if (p == endp) {
-			msg_perr("%s: invalid clock: %s kHz\n", __func__, p);
+		unsigned long m = strtoul(p, &endp, 10);
+		if (p == endp || *endp || m > 3) {
+			msg_perr("%s: invalid SPI mode: %s (use 0, 1, 2 or 3)\n", __func__, p);
+			free(p);
+			return 1;
+		}
+		mode = m;
+	}
+	free(p);
+
+	/* Dual reads only use MOSI and MISO, quad reads also need IO2 and IO3 wired up. */
+	p = extract_programmer_param("io");
+	if (p && strlen(p)) {
+		if (!strcmp(p, "single")) {
+			io_lines = 1;
+		} else if (!strcmp(p, "dual")) {
+			io_lines = 2;
+		} else if (!strcmp(p, "quad")) {
+			io_lines = 4;
+		} else {
+			msg_perr("%s: invalid io mode: %s (use single, dual or quad)\n", __func__, p);
 			free(p);
 			return 1;
 		}
@@ -93,20 +237,44 @@ int linux_spi_init(void)
 		free(dev);
 		return 1;
 	}
+	if (autospeed) {
+		char instance[256];
+		snprintf(instance, sizeof(instance), "linux_spi:%s", dev);
+		if (spi_request_autospeed(instance)) {
+			free(dev);
+			close(fd);
+			fd = -1;
+			return 1;
+		}
+	}
 	free(dev);
 
 	if (register_shutdown(linux_spi_shutdown, NULL))
 		return 1;
 	/* We rely on the shutdown function for cleanup from here on. */
 
+	/* With just readspeed given, commands keep the clock the device was set up with. */
+	if (read_speed_hz && !cmd_speed_hz && ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &cmd_speed_hz) == -1) {
+		msg_perr("%s: failed to read the SPI speed: %s\n", __func__, strerror(errno));
+		return 1;
+	}
+
+	/* The device limit has to allow the faster clock, every transfer asks for the one it needs. */
+	speed_hz = max(cmd_speed_hz, read_speed_hz);
 	if (speed_hz > 0) {
 		if (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) == -1) {
 			msg_perr("%s: failed to set speed to %d Hz: %s\n",
 				 __func__, speed_hz, strerror(errno));
 			return 1;
 		}
+		/* The default for transfers which don't ask for a clock. */
+		if (!cmd_speed_hz)
+			cmd_speed_hz = speed_hz;
+		if (!read_speed_hz)
+			read_speed_hz = speed_hz;
 
-		msg_pdbg("Using %d kHz clock\n", speed_hz/1000);
+		msg_pdbg("Using %d kHz clock for commands and %d kHz for reads\n", cmd_speed_hz / 1000,
+			 read_speed_hz / 1000);
 	}
 
 	if (ioctl(fd, SPI_IOC_WR_MODE, &mode) == -1) {
@@ -121,6 +289,15 @@ int linux_spi_init(void)
 		return 1;
 	}
 
+#ifdef SPI_IOC_WR_MODE32
+	if (io_lines > 1)
+		linux_spi_setup_multi_io(mode, io_lines);
+#endif
+
+	linux_spi_get_bufsiz();
+	spi_master_linux.max_data_read = max_kernel_buf_size - LINUX_SPI_CMD_OVERHEAD;
+	spi_master_linux.max_data_write = max_kernel_buf_size - LINUX_SPI_CMD_OVERHEAD;
+
 	register_spi_master(&spi_master_linux);
 
 	return 0;
@@ -158,6 +335,7 @@ static int linux_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 	   don't start with sending a command. */
 	if (writecnt == 0)
 		return SPI_INVALID_LENGTH;
+	msg[0].speed_hz = msg[1].speed_hz = linux_spi_speed(txbuf, readcnt);
 
 	/* Just submit the first (write) request in case there is nothing
 	   to read. Otherwise submit both requests. */
@@ -173,17 +351,122 @@ static int linux_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 	return 0;
 }
 
+/* Send the @n transfers in @msg as one message. CS is released after the last one. */
+static int linux_spi_submit(struct spi_ioc_transfer *msg, unsigned int n)
+{
+	msg[n - 1].cs_change = 0;
+	if (ioctl(fd, SPI_IOC_MESSAGE(n), msg) == -1) {
+		msg_cerr("%s: ioctl: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Send as many commands per message as the kernel takes, CS is toggled between them (cs_change). Sequences
+ * like WREN and page program then take one system call. */
+static int linux_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds)
+{
+	struct spi_ioc_transfer msg[LINUX_SPI_MAX_TRANSFERS];
+	unsigned int n = 0;
+	size_t total = 0;
+
+	if (fd == -1)
+		return -1;
+	for (; cmds->writecnt || cmds->readcnt; cmds++) {
+		/* Same as for single commands. */
+		if (cmds->writecnt == 0)
+			return SPI_INVALID_LENGTH;
+		if (n && (n + 3 > LINUX_SPI_MAX_TRANSFERS ||
+			  total + cmds->writecnt + cmds->datacnt + cmds->readcnt > max_kernel_buf_size)) {
+			if (linux_spi_submit(msg, n))
+				return -1;
+			n = 0;
+			total = 0;
+		}
+		memset(&msg[n], 0, sizeof(msg[n]));
+		msg[n].tx_buf = (uint64_t)(uintptr_t)cmds->writearr;
+		msg[n].len = cmds->writecnt;
+		msg[n].speed_hz = linux_spi_speed(cmds->writearr, cmds->readcnt);
+		n++;
+		/* The data goes straight from the caller's buffer. */
+		if (cmds->datacnt) {
+			memset(&msg[n], 0, sizeof(msg[n]));
+			msg[n].tx_buf = (uint64_t)(uintptr_t)cmds->data;
+			msg[n].len = cmds->datacnt;
+			msg[n].speed_hz = msg[n - 1].speed_hz;
+			n++;
+		}
+		if (cmds->readcnt) {
+			memset(&msg[n], 0, sizeof(msg[n]));
+			msg[n].rx_buf = (uint64_t)(uintptr_t)cmds->readarr;
+			msg[n].len = cmds->readcnt;
+			msg[n].speed_hz = msg[n - 1].speed_hz;
+			n++;
+		}
+		msg[n - 1].cs_change = 1;
+		total += cmds->writecnt + cmds->datacnt + cmds->readcnt;
+	}
+	if (n)
+		return linux_spi_submit(msg, n);
+	return 0;
+}
+
+#ifdef SPI_IOC_WR_MODE32
+static int linux_spi_multi_io_read(struct flashctx *flash, enum spi_io_mode mode, unsigned int writecnt,
+				   unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr)
+{
+	static const struct {
+		uint8_t addr;
+		uint8_t data;
+	} nbits[] = {
+		[SPI_IO_1_1_1] = { 1, 1 },
+		[SPI_IO_1_1_2] = { 1, 2 },
+		[SPI_IO_1_2_2] = { 2, 2 },
+		[SPI_IO_1_1_4] = { 1, 4 },
+		[SPI_IO_1_4_4] = { 4, 4 },
+	};
+	struct spi_ioc_transfer msg[3] = {
+		{
+			.tx_buf = (uint64_t)(uintptr_t)writearr,
+			.len = 1,
+			.speed_hz = read_speed_hz,
+		},
+		{
+			.tx_buf = (uint64_t)(uintptr_t)(writearr + 1),
+			.len = writecnt - 1,
+			.speed_hz = read_speed_hz,
+			.tx_nbits = nbits[mode].addr,
+		},
+		{
+			.rx_buf = (uint64_t)(uintptr_t)readarr,
+			.len = readcnt,
+			.speed_hz = read_speed_hz,
+			.rx_nbits = nbits[mode].data,
+		},
+	};
+
+	if (fd == -1)
+		return -1;
+	if (writecnt < 2 || readcnt == 0)
+		return SPI_INVALID_LENGTH;
+
+	if (ioctl(fd, SPI_IOC_MESSAGE(3), msg) == -1) {
+		msg_cerr("%s: ioctl: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+#endif
+
 static int linux_spi_read(struct flashctx *flash, uint8_t *buf,
 			  unsigned int start, unsigned int len)
 {
-	return spi_read_chunked(flash, buf, start, len,
-				(unsigned int)getpagesize());
+	return spi_read_chunked(flash, buf, start, len, max_kernel_buf_size - LINUX_SPI_CMD_OVERHEAD);
 }
 
 static int linux_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
 {
-	return spi_write_chunked(flash, buf, start, len,
-				((unsigned int)getpagesize()) - 4);
+	return spi_write_chunked(flash, buf, start, len, max_kernel_buf_size - LINUX_SPI_CMD_OVERHEAD);
 }
 
 #endif // CONFIG_LINUX_SPI == 1
@@ -91,6 +91,33 @@ static int mcp6x_bitbang_get_miso(void)
 	return (mcp_gpiostate >> MCP6X_SPI_MISO) & 0x1;
 }
 
+/* Like the functions above, but only the MISO bit is taken from the register when reading it back. */
+static void mcp6x_bitbang_transfer(const uint8_t *out, uint8_t *in, unsigned int len)
+{
+	const uint8_t sck = 1 << MCP6X_SPI_SCK;
+	const uint8_t base = mcp_gpiostate & ~(sck | (1 << MCP6X_SPI_MOSI));
+	const uint8_t lines[2] = { base, base | (1 << MCP6X_SPI_MOSI) };
+	unsigned int i;
+	uint8_t val = 0, ret, b;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		val = out ? out[i] : 0;
+		ret = 0;
+		for (bit = 7; bit >= 0; bit--) {
+			b = lines[(val >> bit) & 1];
+			mmio_writeb(b, mcp6x_spibar + 0x530);
+			mmio_writeb(b | sck, mcp6x_spibar + 0x530);
+			if (in)
+				ret = (ret << 1) | ((mmio_readb(mcp6x_spibar + 0x530) >> MCP6X_SPI_MISO) & 0x1);
+		}
+		if (in)
+			in[i] = ret;
+	}
+	mcp_gpiostate = lines[val & 1];
+	mmio_writeb(mcp_gpiostate, mcp6x_spibar + 0x530);
+}
+
 static const struct bitbang_spi_master bitbang_spi_master_mcp6x = {
 	.type = BITBANG_SPI_MASTER_MCP,
 	.set_cs = mcp6x_bitbang_set_cs,
@@ -99,6 +126,7 @@ static const struct bitbang_spi_master bitbang_spi_master_mcp6x = {
 	.get_miso = mcp6x_bitbang_get_miso,
 	.request_bus = mcp6x_request_spibus,
 	.release_bus = mcp6x_release_spibus,
+	.transfer = mcp6x_bitbang_transfer,
 	.half_period = 0,
 };
 
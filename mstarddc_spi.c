@@ -156,79 +156,156 @@ out:
 	return ret;
 }
 
-/* Returns 0 upon success, a negative number upon errors. */
-static int mstarddc_spi_send_command(struct flashctx *flash,
-				     unsigned int writecnt,
-				     unsigned int readcnt,
-				     const unsigned char *writearr,
-				     unsigned char *readarr)
+/* The kernel refuses I2C_RDWR transfers with more messages (I2C_RDWR_IOCTL_MAX_MSGS). */
+#define MSTARDDC_MAX_MSGS	42
+/* Messages needed per SPI command: write, read command, read data and end. */
+#define MSTARDDC_MSGS_PER_CMD	4
+/* Bytes read from the SPI chip per command. The I2C messages could be longer, but not every DDC adapter
+ * handles that. */
+#define MSTARDDC_MAX_READ	4096
+
+/* Holds the write messages (command byte and data) of one ioctl, grown as needed and kept until shutdown. */
+static uint8_t *mstarddc_buf;
+static size_t mstarddc_buflen;
+static uint8_t mstarddc_read_cmd = MSTARDDC_SPI_READ;
+static uint8_t mstarddc_end_cmd = MSTARDDC_SPI_END;
+
+static int mstarddc_spi_free_buf(void *data)
 {
-	int ret = 0;
-	uint8_t *cmd = malloc((writecnt + 1) * sizeof(uint8_t));
-	if (cmd == NULL) {
-		msg_perr("Error allocating memory: errno %d.\n", errno);
-		ret = -1;
-	}
+	free(mstarddc_buf);
+	mstarddc_buf = NULL;
+	mstarddc_buflen = 0;
+	return 0;
+}
 
-	if (!ret && writecnt) {
-		cmd[0] = MSTARDDC_SPI_WRITE;
-		memcpy(cmd + 1, writearr, writecnt);
-		if (write(mstarddc_fd, cmd, writecnt + 1) < 0) {
-			msg_perr("Error sending write command: errno %d.\n",
-				 errno);
-			ret = -1;
+/*
+ * Sends @count SPI commands of @cmds (at most MSTARDDC_MAX_MSGS / MSTARDDC_MSGS_PER_CMD) in one I2C_RDWR
+ * ioctl, so all of them go out in a single I2C transfer with repeated starts in between.
+ * Returns 0 upon success, a negative number upon errors.
+ */
+static int mstarddc_spi_transfer(const struct spi_command *cmds, unsigned int count)
+{
+	struct i2c_msg msg[MSTARDDC_MAX_MSGS];
+	struct i2c_rdwr_ioctl_data i2c_data = { .msgs = msg, .nmsgs = 0 };
+	size_t need = 0, pos = 0;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		need += cmds[i].writecnt ? cmds[i].writecnt + cmds[i].datacnt + 1 : 0;
+	if (need > mstarddc_buflen) {
+		uint8_t *tmp = realloc(mstarddc_buf, need);
+		if (tmp == NULL) {
+			msg_perr("Error allocating memory: errno %d.\n", errno);
+			return -1;
+		}
+		if (!mstarddc_buf && register_shutdown(mstarddc_spi_free_buf, NULL)) {
+			free(tmp);
+			return -1;
 		}
+		mstarddc_buf = tmp;
+		mstarddc_buflen = need;
 	}
 
-	if (!ret && readcnt) {
-		struct i2c_rdwr_ioctl_data i2c_data;
-		struct i2c_msg msg[2];
-
-		cmd[0] = MSTARDDC_SPI_READ;
-		i2c_data.nmsgs = 2;
-		i2c_data.msgs = msg;
-		i2c_data.msgs[0].addr = mstarddc_addr;
-		i2c_data.msgs[0].len = 1;
-		i2c_data.msgs[0].flags = 0;
-		i2c_data.msgs[0].buf = cmd;
-		i2c_data.msgs[1].addr = mstarddc_addr;
-		i2c_data.msgs[1].len = readcnt;
-		i2c_data.msgs[1].flags = I2C_M_RD;
-		i2c_data.msgs[1].buf = readarr;
-
-		if (ioctl(mstarddc_fd, I2C_RDWR, &i2c_data) < 0) {
-			msg_perr("Error sending read command: errno %d.\n",
-				 errno);
-			ret = -1;
+	for (i = 0; i < count; i++) {
+		const struct spi_command *c = &cmds[i];
+		if (c->writecnt) {
+			mstarddc_buf[pos] = MSTARDDC_SPI_WRITE;
+			memcpy(mstarddc_buf + pos + 1, c->writearr, c->writecnt);
+			if (c->datacnt)
+				memcpy(mstarddc_buf + pos + 1 + c->writecnt, c->data, c->datacnt);
+			msg[i2c_data.nmsgs++] = (struct i2c_msg){ .addr = mstarddc_addr, .flags = 0,
+							      .len = c->writecnt + c->datacnt + 1,
+							      .buf = mstarddc_buf + pos };
+			pos += c->writecnt + c->datacnt + 1;
 		}
+		if (c->readcnt) {
+			msg[i2c_data.nmsgs++] = (struct i2c_msg){ .addr = mstarddc_addr, .flags = 0,
+							      .len = 1, .buf = &mstarddc_read_cmd };
+			msg[i2c_data.nmsgs++] = (struct i2c_msg){ .addr = mstarddc_addr, .flags = I2C_M_RD,
+							      .len = c->readcnt, .buf = c->readarr };
+		}
+		msg[i2c_data.nmsgs++] = (struct i2c_msg){ .addr = mstarddc_addr, .flags = 0,
+						      .len = 1, .buf = &mstarddc_end_cmd };
 	}
 
-	if (!ret && (writecnt || readcnt)) {
-		cmd[0] = MSTARDDC_SPI_END;
-		if (write(mstarddc_fd, cmd, 1) < 0) {
-			msg_perr("Error sending end command: errno %d.\n",
-				 errno);
-			ret = -1;
-		}
+	if (ioctl(mstarddc_fd, I2C_RDWR, &i2c_data) < 0) {
+		msg_perr("Error sending command: errno %d.\n", errno);
+		return -1;
 	}
+	return 0;
+}
+
+static int mstarddc_spi_check(unsigned int writecnt, unsigned int readcnt)
+{
+	/* The message lengths are 16 bit. */
+	if (writecnt >= 0xffff || readcnt > 0xffff) {
+		msg_perr("%s: Unsupported command length %u/%u.\n", __func__, writecnt, readcnt);
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns 0 upon success, a negative number upon errors. */
+static int mstarddc_spi_send_command(struct flashctx *flash,
+				     unsigned int writecnt,
+				     unsigned int readcnt,
+				     const unsigned char *writearr,
+				     unsigned char *readarr)
+{
+	const struct spi_command cmd = {
+		.writecnt = writecnt,
+		.readcnt = readcnt,
+		.writearr = writearr,
+		.readarr = readarr,
+	};
+	int ret;
+
+	if (!writecnt && !readcnt)
+		return 0;
+	ret = mstarddc_spi_check(writecnt, readcnt);
+	if (!ret)
+		ret = mstarddc_spi_transfer(&cmd, 1);
 
 	/* Do not reset if something went wrong, as it might prevent from
 	 * retrying flashing. */
 	if (ret != 0)
 		mstarddc_doreset = 0;
 
-	if (cmd)
-		free(cmd);
+	return ret;
+}
+
+/* Sends as many commands as fit into one ioctl at a time. Returns 0 upon success, a negative number upon errors. */
+static int mstarddc_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds)
+{
+	unsigned int n;
+	int ret = 0;
+
+	while (!ret && (cmds->writecnt || cmds->readcnt)) {
+		for (n = 0; n < MSTARDDC_MAX_MSGS / MSTARDDC_MSGS_PER_CMD; n++) {
+			if (!cmds[n].writecnt && !cmds[n].readcnt)
+				break;
+			ret = mstarddc_spi_check(cmds[n].writecnt + cmds[n].datacnt, cmds[n].readcnt);
+			if (ret)
+				break;
+		}
+		if (!ret)
+			ret = mstarddc_spi_transfer(cmds, n);
+		cmds += n;
+	}
+
+	if (ret != 0)
+		mstarddc_doreset = 0;
 
 	return ret;
 }
 
 static const struct spi_master spi_master_mstarddc = {
 	.type = SPI_CONTROLLER_MSTARDDC,
-	.max_data_read = 256,
+	.max_data_read = MSTARDDC_MAX_READ,
 	.max_data_write = 256,
 	.command = mstarddc_spi_send_command,
-	.multicommand = default_spi_send_multicommand,
+	.multicommand = mstarddc_spi_send_multicommand,
+	.gather = true,
 	.read = default_spi_read,
 	.write_256 = default_spi_write_256,
 	.write_aai = default_spi_write_aai,
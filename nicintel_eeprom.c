@@ -27,6 +27,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "flash.h"
 #include "spi.h"
@@ -103,21 +104,30 @@ static int nicintel_ee_probe(struct flashctx *flash)
 	return 1;
 }
 
+/* Reads of EERD which usually suffice for a word, before waiting between the polls. */
+#define EERD_FAST_POLLS		100
+/* Give up on a word after this many microseconds. */
+#define EERD_TIMEOUT_US		10000
+
 static int nicintel_ee_read_word(unsigned int addr, uint16_t *data)
 {
 	uint32_t tmp = BIT(EERD_START) | (addr << EERD_ADDR);
+	unsigned int i;
+
 	pci_mmio_writel(tmp, nicintel_eebar + EERD);
 
-	/* Poll done flag. 10.000.000 cycles seem to be enough. */
-	uint32_t i;
-	for (i = 0; i < 10000000; i++) {
+	/* A word takes a few microseconds, so spinning is cheapest. Then wait in bounded steps. */
+	for (i = 0; i < EERD_FAST_POLLS + EERD_TIMEOUT_US; i++) {
 		tmp = pci_mmio_readl(nicintel_eebar + EERD);
 		if (tmp & BIT(EERD_DONE)) {
 			*data = (tmp >> EERD_DATA) & 0xffff;
 			return 0;
 		}
+		if (i >= EERD_FAST_POLLS)
+			programmer_delay(1);
 	}
 
+	msg_perr("Timeout reading EEPROM word 0x%04x.\n", addr);
 	return -1;
 }
 
@@ -130,80 +140,96 @@ static int nicintel_ee_read(struct flashctx *flash, uint8_t *buf, unsigned int a
 	if (addr & 1) {
 		if (nicintel_ee_read_word(addr / 2, &data))
 			return -1;
-		*buf++ = data & 0xff;
+		*buf++ = (data >> 8) & 0xff;
 		addr++;
 		len--;
 	}
 
-	while (len > 0) {
+	/* The next request is started as soon as a word is in, the EERD interface handles one at a time. */
+	for (; len >= 2; len -= 2, addr += 2) {
 		if (nicintel_ee_read_word(addr / 2, &data))
 			return -1;
 		*buf++ = data & 0xff;
-		addr++;
-		len--;
-		if (len > 0) {
-			*buf++ = (data >> 8) & 0xff;
-			addr++;
-			len--;
-		}
+		*buf++ = (data >> 8) & 0xff;
+	}
+	if (len) {
+		if (nicintel_ee_read_word(addr / 2, &data))
+			return -1;
+		*buf = data & 0xff;
 	}
 
 	return 0;
 }
 
-static int nicintel_ee_bitset(int reg, int bit, bool val)
-{
-	uint32_t tmp;
+/*
+ * What was last written to EEC while we have direct access. Bitbanging changes only the bits below, so there
+ * is no need to read the register back before every change.
+ */
+static uint32_t nicintel_eec;
 
-	tmp = pci_mmio_readl(nicintel_eebar + reg);
+static void nicintel_ee_bitset(int bit, bool val)
+{
 	if (val)
-		tmp |= BIT(bit);
+		nicintel_eec |= BIT(bit);
 	else
-		tmp &= ~BIT(bit);
-	pci_mmio_writel(tmp, nicintel_eebar + reg);
-
-	return -1;
+		nicintel_eec &= ~BIT(bit);
+	pci_mmio_writel(nicintel_eec, nicintel_eebar + EEC);
 }
 
-/* Shifts one byte out while receiving another one by bitbanging (denoted "direct access" in the datasheet). */
-static int nicintel_ee_bitbang(uint8_t mosi, uint8_t *miso)
+/*
+ * Shifts one byte out while receiving another one by bitbanging (denoted "direct access" in the datasheet).
+ * SI changes together with the falling edge of SCK, the EEPROM samples it on the rising edge. Each of the two
+ * register writes per bit is followed by a read of EEC: it samples SO and makes sure the previous write
+ * reached the NIC, which keeps SCK within the timing of slow EEPROMs.
+ */
+static void nicintel_ee_bitbang(uint8_t mosi, uint8_t *miso)
 {
 	uint8_t out = 0x0;
-
 	int i;
+
 	for (i = 7; i >= 0; i--) {
-		nicintel_ee_bitset(EEC, EE_SI, mosi & BIT(i));
-		nicintel_ee_bitset(EEC, EE_SCK, 1);
-		if (miso != NULL) {
-			uint32_t tmp = pci_mmio_readl(nicintel_eebar + EEC);
-			if (tmp & BIT(EE_SO))
-				out |= BIT(i);
-		}
-		nicintel_ee_bitset(EEC, EE_SCK, 0);
+		nicintel_eec &= ~(BIT(EE_SCK) | BIT(EE_SI));
+		if (mosi & BIT(i))
+			nicintel_eec |= BIT(EE_SI);
+		pci_mmio_writel(nicintel_eec, nicintel_eebar + EEC);
+		pci_mmio_readl(nicintel_eebar + EEC);
+		nicintel_ee_bitset(EE_SCK, 1);
+		if (pci_mmio_readl(nicintel_eebar + EEC) & BIT(EE_SO))
+			out |= BIT(i);
 	}
+	nicintel_ee_bitset(EE_SCK, 0);
 
 	if (miso != NULL)
 		*miso = out;
+}
 
-	return 0;
+/*
+ * Runs one complete SPI command: selects the EEPROM, shifts out @writecnt bytes of @writearr (0xff if NULL)
+ * and then reads @readcnt bytes into @readarr.
+ */
+static void nicintel_ee_command(const uint8_t *writearr, unsigned int writecnt, uint8_t *readarr,
+				unsigned int readcnt)
+{
+	nicintel_ee_bitset(EE_CS, 0);
+	for (; writecnt > 0; writecnt--)
+		nicintel_ee_bitbang(writearr ? *writearr++ : 0xff, NULL);
+	for (; readcnt > 0; readcnt--)
+		nicintel_ee_bitbang(0x00, readarr++);
+	nicintel_ee_bitset(EE_CS, 1);
 }
 
 /* Polls the WIP bit of the status register of the attached EEPROM via bitbanging. */
 static int nicintel_ee_ready(void)
 {
+	static const uint8_t rdsr = JEDEC_RDSR;
 	unsigned int i;
-	for (i = 0; i < 1000; i++) {
-		nicintel_ee_bitset(EEC, EE_CS, 0);
+	uint8_t sr;
 
-		nicintel_ee_bitbang(JEDEC_RDSR, NULL);
-		uint8_t rdsr;
-		nicintel_ee_bitbang(0x00, &rdsr);
-
-		nicintel_ee_bitset(EEC, EE_CS, 1);
+	for (i = 0; i < 1000; i++) {
+		nicintel_ee_command(&rdsr, 1, &sr, 1);
 		programmer_delay(1);
-		if (!(rdsr & SPI_SR_WIP)) {
+		if (!(sr & SPI_SR_WIP))
 			return 0;
-		}
 	}
 	return -1;
 }
@@ -211,21 +237,25 @@ static int nicintel_ee_ready(void)
 /* Requests direct access to the SPI pins. */
 static int nicintel_ee_req(void)
 {
-	uint32_t tmp;
-	nicintel_ee_bitset(EEC, EE_REQ, 1);
+	nicintel_eec = pci_mmio_readl(nicintel_eebar + EEC);
+	nicintel_ee_bitset(EE_REQ, 1);
 
-	tmp = pci_mmio_readl(nicintel_eebar + EEC);
-	if (!(tmp & BIT(EE_GNT))) {
+	nicintel_eec = pci_mmio_readl(nicintel_eebar + EEC);
+	if (!(nicintel_eec & BIT(EE_GNT))) {
 		msg_perr("Enabling eeprom access failed.\n");
 		return 1;
 	}
 
-	nicintel_ee_bitset(EEC, EE_SCK, 0);
+	nicintel_ee_bitset(EE_SCK, 0);
 	return 0;
 }
 
 static int nicintel_ee_write(struct flashctx *flash, const uint8_t *buf, unsigned int addr, unsigned int len)
 {
+	static const uint8_t wren = JEDEC_WREN;
+	uint8_t cmd[3 + EE_PAGE_MASK + 1];
+	unsigned int n;
+
 	if (nicintel_ee_req())
 		return -1;
 
@@ -233,33 +263,31 @@ static int nicintel_ee_write(struct flashctx *flash, const uint8_t *buf, unsigne
 	if (nicintel_ee_ready())
 		goto out;
 
+	/* One WREN and one write command per page, each built completely before it is shifted out. */
 	while (len > 0) {
-		/* WREN */
-		nicintel_ee_bitset(EEC, EE_CS, 0);
-		nicintel_ee_bitbang(JEDEC_WREN, NULL);
-		nicintel_ee_bitset(EEC, EE_CS, 1);
-		programmer_delay(1);
-
-		/* data */
-		nicintel_ee_bitset(EEC, EE_CS, 0);
-		nicintel_ee_bitbang(JEDEC_BYTE_PROGRAM, NULL);
-		nicintel_ee_bitbang((addr >> 8) & 0xff, NULL);
-		nicintel_ee_bitbang(addr & 0xff, NULL);
-		while (len > 0) {
-			nicintel_ee_bitbang((buf) ? *buf++ : 0xff, NULL);
-			len--;
-			addr++;
-			if (!(addr & EE_PAGE_MASK))
-				break;
+		n = min(len, EE_PAGE_MASK + 1 - (addr & EE_PAGE_MASK));
+		cmd[0] = JEDEC_BYTE_PROGRAM;
+		cmd[1] = (addr >> 8) & 0xff;
+		cmd[2] = addr & 0xff;
+		if (buf) {
+			memcpy(cmd + 3, buf, n);
+			buf += n;
+		} else {
+			memset(cmd + 3, 0xff, n);
 		}
-		nicintel_ee_bitset(EEC, EE_CS, 1);
+
+		nicintel_ee_command(&wren, 1, NULL, 0);
 		programmer_delay(1);
+		nicintel_ee_command(cmd, 3 + n, NULL, 0);
+		programmer_delay(1);
+		addr += n;
+		len -= n;
 		if (nicintel_ee_ready())
 			goto out;
 	}
 	ret = 0;
 out:
-	nicintel_ee_bitset(EEC, EE_REQ, 0); /* Give up direct access. */
+	nicintel_ee_bitset(EE_REQ, 0); /* Give up direct access. */
 	return ret;
 }
 
@@ -279,18 +307,21 @@ static int nicintel_ee_shutdown(void *eecp)
 {
 	uint32_t old_eec = *(uint32_t *)eecp;
 	/* Request bitbanging and unselect the chip first to be safe. */
-	if (nicintel_ee_req() || nicintel_ee_bitset(EEC, EE_CS, 1))
+	if (nicintel_ee_req()) {
+		free(eecp);
 		return -1;
+	}
+	nicintel_ee_bitset(EE_CS, 1);
 
 	/* Try to restore individual bits we care about. */
-	int ret = nicintel_ee_bitset(EEC, EE_SCK, old_eec & BIT(EE_SCK));
-	ret |= nicintel_ee_bitset(EEC, EE_SI, old_eec & BIT(EE_SI));
-	ret |= nicintel_ee_bitset(EEC, EE_CS, old_eec & BIT(EE_CS));
+	nicintel_ee_bitset(EE_SCK, old_eec & BIT(EE_SCK));
+	nicintel_ee_bitset(EE_SI, old_eec & BIT(EE_SI));
+	nicintel_ee_bitset(EE_CS, old_eec & BIT(EE_CS));
 	/* REQ will be cleared by hardware anyway after 2 seconds of inactivity on the SPI pins (3.3.2.1). */
-	ret |= nicintel_ee_bitset(EEC, EE_REQ, old_eec & BIT(EE_REQ));
+	nicintel_ee_bitset(EE_REQ, old_eec & BIT(EE_REQ));
 
 	free(eecp);
-	return ret;
+	return 0;
 }
 
 int nicintel_ee_init(void)
@@ -52,7 +52,7 @@ int erase_opaque(struct flashctx *flash, unsigned int blockaddr, unsigned int bl
 
 int register_opaque_master(const struct opaque_master *mst)
 {
-	struct registered_master rmst;
+	struct registered_master rmst = { 0 };
 
 	if (!mst->probe || !mst->read || !mst->write || !mst->erase) {
 		msg_perr("%s called with incomplete master definition. "
@@ -27,6 +27,29 @@
 
 struct pci_access *pacc;
 
+/*
+ * Index of the scanned devices by vendor and device ID. The chipset and board enable tables look up hundreds
+ * of IDs, which would otherwise walk the whole device list for each entry. Entries are kept in device list
+ * order, so lookups return the same device as a list walk would. Class and subsystem IDs are read from config
+ * space the first time they are needed and kept.
+ */
+struct pci_index_entry {
+	struct pci_dev *dev;
+	uint16_t vendor;
+	uint16_t device;
+	bool class_valid;
+	uint16_t devclass;
+	bool subsystem_valid;
+	uint16_t subsystem_vendor;
+	uint16_t subsystem_device;
+	int next;	/* Next entry in the same bucket, -1 if none. */
+};
+
+static struct pci_index_entry *pci_index;
+static int pci_index_count;
+static int *pci_index_buckets;
+static unsigned int pci_index_mask;
+
 enum pci_bartype {
 	TYPE_MEMBAR,
 	TYPE_IOBAR,
@@ -152,6 +175,151 @@ uintptr_t pcidev_readbar(struct pci_dev *dev, int bar)
 	return (uintptr_t)addr;
 }
 
+static unsigned int pci_index_hash(uint16_t vendor, uint16_t device)
+{
+	return (((uint32_t)vendor << 16 | device) * 2654435761U) >> 8 & pci_index_mask;
+}
+
+static void pci_index_free(void)
+{
+	free(pci_index);
+	free(pci_index_buckets);
+	pci_index = NULL;
+	pci_index_buckets = NULL;
+	pci_index_count = 0;
+	pci_index_mask = 0;
+}
+
+/* The index is optional, lookups fall back to walking the list if it can't be built. */
+static void pci_index_build(void)
+{
+	struct pci_dev *dev;
+	unsigned int buckets = 16;
+	unsigned int h;
+	int i, count = 0;
+
+	for (dev = pacc->devices; dev; dev = dev->next)
+		count++;
+	while (buckets < 2 * count)
+		buckets *= 2;
+
+	pci_index = calloc(count ? count : 1, sizeof(*pci_index));
+	pci_index_buckets = malloc(buckets * sizeof(*pci_index_buckets));
+	if (!pci_index || !pci_index_buckets) {
+		pci_index_free();
+		return;
+	}
+	pci_index_mask = buckets - 1;
+	for (h = 0; h < buckets; h++)
+		pci_index_buckets[h] = -1;
+
+	for (dev = pacc->devices, i = 0; dev; dev = dev->next, i++) {
+		pci_fill_info(dev, PCI_FILL_IDENT);
+		pci_index[i].dev = dev;
+		pci_index[i].vendor = dev->vendor_id;
+		pci_index[i].device = dev->device_id;
+	}
+	pci_index_count = count;
+	/* Insert back to front so that each bucket lists its devices in list order. */
+	for (i = count - 1; i >= 0; i--) {
+		h = pci_index_hash(pci_index[i].vendor, pci_index[i].device);
+		pci_index[i].next = pci_index_buckets[h];
+		pci_index_buckets[h] = i;
+	}
+	msg_pspew("Indexed %i PCI devices.\n", count);
+}
+
+static uint16_t pci_index_class(struct pci_index_entry *entry)
+{
+	if (!entry->class_valid) {
+		entry->devclass = pci_read_word(entry->dev, 0x0a);
+		entry->class_valid = true;
+	}
+	return entry->devclass;
+}
+
+static bool pci_index_card_match(struct pci_index_entry *entry, uint16_t card_vendor, uint16_t card_device)
+{
+	if (!entry->subsystem_valid) {
+		entry->subsystem_vendor = pci_read_word(entry->dev, PCI_SUBSYSTEM_VENDOR_ID);
+		entry->subsystem_device = pci_read_word(entry->dev, PCI_SUBSYSTEM_ID);
+		entry->subsystem_valid = true;
+	}
+	return entry->subsystem_vendor == card_vendor && entry->subsystem_device == card_device;
+}
+
+/* Find the first device with the given IDs, and subsystem IDs too if @match_card is set. */
+static struct pci_dev *pci_index_find(uint16_t vendor, uint16_t device, bool match_card, uint16_t card_vendor,
+				      uint16_t card_device)
+{
+	struct pci_dev *temp;
+	struct pci_filter filter;
+	int i;
+
+	if (pci_index) {
+		for (i = pci_index_buckets[pci_index_hash(vendor, device)]; i >= 0; i = pci_index[i].next) {
+			if (pci_index[i].vendor != vendor || pci_index[i].device != device)
+				continue;
+			if (!match_card || pci_index_card_match(&pci_index[i], card_vendor, card_device))
+				return pci_index[i].dev;
+		}
+		return NULL;
+	}
+
+	pci_filter_init(NULL, &filter);
+	filter.vendor = vendor;
+	filter.device = device;
+
+	for (temp = pacc->devices; temp; temp = temp->next)
+		if (pci_filter_match(&filter, temp)) {
+			if (!match_card ||
+			    ((card_vendor == pci_read_word(temp, PCI_SUBSYSTEM_VENDOR_ID)) &&
+			     (card_device == pci_read_word(temp, PCI_SUBSYSTEM_ID))))
+				return temp;
+		}
+
+	return NULL;
+}
+
+struct pci_dev *pci_dev_find_vendorclass(uint16_t vendor, uint16_t devclass)
+{
+	struct pci_dev *temp;
+	struct pci_filter filter;
+	uint16_t tmp2;
+	int i;
+
+	if (pci_index) {
+		for (i = 0; i < pci_index_count; i++)
+			if (pci_index[i].vendor == vendor && pci_index_class(&pci_index[i]) == devclass)
+				return pci_index[i].dev;
+		return NULL;
+	}
+
+	pci_filter_init(NULL, &filter);
+	filter.vendor = vendor;
+
+	for (temp = pacc->devices; temp; temp = temp->next)
+		if (pci_filter_match(&filter, temp)) {
+			/* Read PCI class */
+			tmp2 = pci_read_word(temp, 0x0a);
+			if (tmp2 == devclass)
+				return temp;
+		}
+
+	return NULL;
+}
+
+struct pci_dev *pci_dev_find(uint16_t vendor, uint16_t device)
+{
+	return pci_index_find(vendor, device, false, 0, 0);
+}
+
+struct pci_dev *pci_card_find(uint16_t vendor, uint16_t device,
+			      uint16_t card_vendor, uint16_t card_device)
+{
+	return pci_index_find(vendor, device, true, card_vendor, card_device);
+}
+
 static int pcidev_shutdown(void *data)
 {
 	if (pacc == NULL) {
@@ -159,6 +327,7 @@ static int pcidev_shutdown(void *data)
 			 "Please report a bug at flashrom@flashrom.org\n", __func__);
 		return 1;
 	}
+	pci_index_free();
 	pci_cleanup(pacc);
 	return 0;
 }
@@ -175,6 +344,7 @@ int pci_init_common(void)
 	if (register_shutdown(pcidev_shutdown, NULL))
 		return 1;
 	pci_scan_bus(pacc);     /* We want to get the list of devices */
+	pci_index_build();
 	return 0;
 }
 
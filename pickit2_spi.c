@@ -76,11 +76,13 @@ static usb_dev_handle *pickit2_handle;
 #define CMD_DOWNLOAD_DATA       0xA8
 #define CMD_CLR_ULOAD_BUFF      0xA9
 #define CMD_UPLOAD_DATA         0xAA
+#define CMD_UPLOAD_DATA_NOLEN   0xAC
 #define CMD_END_OF_BUFFER       0xAD
 
 #define SCR_SPI_READ_BUF        0xC5
 #define SCR_SPI_WRITE_BUF       0xC6
 #define SCR_SET_AUX             0xCF
+#define SCR_DELAY_SHORT         0xE7
 #define SCR_LOOP                0xE9
 #define SCR_SET_ICSP_CLK_PERIOD 0xEA
 #define SCR_SET_PINS            0xF3
@@ -95,6 +97,11 @@ static usb_dev_handle *pickit2_handle;
 #define SCR_VDD_OFF             0xFE
 #define SCR_VDD_ON              0xFF
 
+/* Size of the buffer on the PICkit2 that SCR_SPI_READ_BUF fills */
+#define UPLOAD_BUFFER_SIZE      128
+/* Unit of SCR_DELAY_SHORT in ns */
+#define DELAY_SHORT_NS          21333
+
 /* Copied from dediprog.c */
 /* Might be useful for other USB devices as well. static for now. */
 /* device parameter allows user to specify one device of multiple installed */
@@ -213,6 +220,19 @@ static int pickit2_set_spi_speed(unsigned int spispeed_idx)
 	return 0;
 }
 
+/* The rates of spispeeds[] in kHz for spispeed=auto, in reverse order. */
+static const unsigned int pickit2_speeds_khz[] = { 250, 333, 500, 1000, 0 };
+
+static int pickit2_set_autospeed(unsigned int khz)
+{
+	int i;
+
+	for (i = 0; pickit2_speeds_khz[i]; i++)
+		if (pickit2_speeds_khz[i] == khz)
+			return pickit2_set_spi_speed(ARRAY_SIZE(spispeeds) - 2 - i);
+	return 1;
+}
+
 static int pickit2_spi_send_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 				     const unsigned char *writearr, unsigned char *readarr)
 {
@@ -301,6 +321,255 @@ static int pickit2_spi_send_command(struct flashctx *flash, unsigned int writecn
 	return 0;
 }
 
+/*
+ * Bulk transfers are assembled in a command packet of their own: data for the download buffer and scripts
+ * shifting it out are appended piece by piece, a packet is sent once the next piece doesn't fit. CS# stays
+ * asserted between scripts, so one SPI transaction can span as many packets as needed.
+ */
+static uint8_t pickit2_packet[CMD_LENGTH];
+static unsigned int pickit2_packet_len;
+
+static int pickit2_flush_packet(void)
+{
+	int ret;
+
+	if (!pickit2_packet_len)
+		return 0;
+	memset(pickit2_packet + pickit2_packet_len, CMD_END_OF_BUFFER, CMD_LENGTH - pickit2_packet_len);
+	pickit2_packet_len = 0;
+	ret = usb_interrupt_write(pickit2_handle, ENDPOINT_OUT, (char *)pickit2_packet, CMD_LENGTH, DFLT_TIMEOUT);
+	if (ret != CMD_LENGTH) {
+		msg_perr("Sending command packet failed (%s)!\n", usb_strerror());
+		return 1;
+	}
+	return 0;
+}
+
+/* Make room for @len more bytes in the packet, sending it if needed. */
+static int pickit2_packet_room(unsigned int len)
+{
+	if (pickit2_packet_len + len > CMD_LENGTH)
+		return pickit2_flush_packet();
+	return 0;
+}
+
+/* Append a script of @len bytes, prefixed with CMD_EXEC_SCRIPT. */
+static int pickit2_append_script(const uint8_t *script, unsigned int len)
+{
+	if (pickit2_packet_room(2 + len))
+		return 1;
+	pickit2_packet[pickit2_packet_len++] = CMD_EXEC_SCRIPT;
+	pickit2_packet[pickit2_packet_len++] = len;
+	memcpy(pickit2_packet + pickit2_packet_len, script, len);
+	pickit2_packet_len += len;
+	return 0;
+}
+
+/* Script bytes running @op @count times. */
+static unsigned int pickit2_repeat(uint8_t *script, uint8_t op, unsigned int count)
+{
+	script[0] = op;
+	if (count == 1)
+		return 1;
+	script[1] = SCR_LOOP;
+	script[2] = 1; /* Loop back one instruction */
+	script[3] = count - 1; /* Number of times to loop */
+	return 4;
+}
+
+static unsigned int pickit2_assert_cs(uint8_t *script)
+{
+	script[0] = SCR_VPP_OFF;
+	script[1] = SCR_MCLR_GND_ON;
+	return 2;
+}
+
+static unsigned int pickit2_deassert_cs(uint8_t *script)
+{
+	script[0] = SCR_MCLR_GND_OFF;
+	script[1] = SCR_VPP_PWM_ON;
+	script[2] = SCR_VPP_ON;
+	return 3;
+}
+
+/*
+ * Shift out @len bytes from @data, asserting CS# first if @start is set and deasserting it at the end if
+ * @end is set. Each piece goes through the download buffer, which is cleared before so it never holds
+ * more than one piece.
+ */
+static int pickit2_queue_write(const uint8_t *data, unsigned int len, bool start, bool end)
+{
+	/* CMD_CLR_DLOAD_BUFF, CMD_DOWNLOAD_DATA and its length, CMD_EXEC_SCRIPT and its length,
+	 * SCR_SPI_WRITE_BUF with a loop and changing CS#. */
+	const unsigned int overhead = 5 + 4 + 2 + 3;
+	uint8_t script[2 + 4 + 3];
+	unsigned int n, i;
+
+	while (len) {
+		/* Don't bother with tiny pieces at the end of a packet. */
+		if (CMD_LENGTH - pickit2_packet_len < overhead + min(len, 8) && pickit2_flush_packet())
+			return 1;
+		n = min(len, CMD_LENGTH - pickit2_packet_len - overhead);
+		pickit2_packet[pickit2_packet_len++] = CMD_CLR_DLOAD_BUFF;
+		pickit2_packet[pickit2_packet_len++] = CMD_DOWNLOAD_DATA;
+		pickit2_packet[pickit2_packet_len++] = n;
+		memcpy(pickit2_packet + pickit2_packet_len, data, n);
+		pickit2_packet_len += n;
+
+		i = 0;
+		if (start)
+			i += pickit2_assert_cs(script);
+		i += pickit2_repeat(script + i, SCR_SPI_WRITE_BUF, n);
+		if (end && n == len)
+			i += pickit2_deassert_cs(script + i);
+		if (pickit2_append_script(script, i))
+			return 1;
+		data += n;
+		len -= n;
+		start = false;
+	}
+	return 0;
+}
+
+/*
+ * Read @len bytes into @buf while CS# is asserted, deasserting it at the end. Each script fills the upload
+ * buffer, which is fetched in 64-byte reports from the same packet.
+ */
+static int pickit2_stream_read(uint8_t *buf, unsigned int len)
+{
+	uint8_t script[4 + 3];
+	uint8_t report[CMD_LENGTH];
+	unsigned int n, i, reports;
+	int ret;
+
+	while (len) {
+		n = min(len, UPLOAD_BUFFER_SIZE);
+		reports = (n + CMD_LENGTH - 1) / CMD_LENGTH;
+		i = pickit2_repeat(script, SCR_SPI_READ_BUF, n);
+		if (n == len)
+			i += pickit2_deassert_cs(script + i);
+		if (pickit2_packet_room(1 + 2 + i + reports))
+			return 1;
+		pickit2_packet[pickit2_packet_len++] = CMD_CLR_ULOAD_BUFF;
+		if (pickit2_append_script(script, i))
+			return 1;
+		memset(pickit2_packet + pickit2_packet_len, CMD_UPLOAD_DATA_NOLEN, reports);
+		pickit2_packet_len += reports;
+		if (pickit2_flush_packet())
+			return 1;
+
+		for (i = 0; i < reports; i++) {
+			ret = usb_interrupt_read(pickit2_handle, ENDPOINT_IN, (char *)report, CMD_LENGTH,
+						 DFLT_TIMEOUT);
+			if (ret != CMD_LENGTH) {
+				msg_perr("Receive SPI failed, expected %i, got %i %s!\n", CMD_LENGTH, ret,
+					 usb_strerror());
+				return 1;
+			}
+			memcpy(buf + i * CMD_LENGTH, report, min(CMD_LENGTH, n - i * CMD_LENGTH));
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Read the range with one read command, streaming the data from as many scripts as it takes. */
+static int pickit2_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	const uint8_t cmd[JEDEC_READ_OUTSIZE] = {
+		JEDEC_READ, (start >> 16) & 0xff, (start >> 8) & 0xff, start & 0xff
+	};
+
+	/* Chips that need 4-byte addresses or are in 4-byte mode are left to the generic code. */
+	if (start + len > (1 << 24) || flash->in_4ba_mode)
+		return default_spi_read(flash, buf, start, len);
+	if (pickit2_queue_write(cmd, sizeof(cmd), true, false) ||
+	    pickit2_stream_read(buf, len))
+		return 1;
+	return 0;
+}
+
+/* Wait for a page program to finish, letting the PICkit2 sleep @delay_us before each status read. */
+static int pickit2_wait_wip(unsigned int delay_us)
+{
+	static const uint8_t rdsr = JEDEC_RDSR;
+	uint8_t script[3 + 6];
+	uint8_t report[CMD_LENGTH];
+	unsigned int i, delay;
+	int ret;
+
+	do {
+		i = 0;
+		/* At most 255 units. */
+		delay = min(delay_us, 5000) * 1000 / DELAY_SHORT_NS;
+		if (delay) {
+			script[i++] = SCR_DELAY_SHORT;
+			script[i++] = delay;
+		}
+		/* Polls after the first are spaced by the round trips already. */
+		delay_us = 0;
+		if (pickit2_packet_room(5 + 2 + i + 7 + 1))
+			return 1;
+		pickit2_packet[pickit2_packet_len++] = CMD_CLR_ULOAD_BUFF;
+		pickit2_packet[pickit2_packet_len++] = CMD_CLR_DLOAD_BUFF;
+		pickit2_packet[pickit2_packet_len++] = CMD_DOWNLOAD_DATA;
+		pickit2_packet[pickit2_packet_len++] = 1;
+		pickit2_packet[pickit2_packet_len++] = rdsr;
+		i += pickit2_assert_cs(script + i);
+		script[i++] = SCR_SPI_WRITE_BUF;
+		script[i++] = SCR_SPI_READ_BUF;
+		i += pickit2_deassert_cs(script + i);
+		if (pickit2_append_script(script, i))
+			return 1;
+		pickit2_packet[pickit2_packet_len++] = CMD_UPLOAD_DATA;
+		if (pickit2_flush_packet())
+			return 1;
+
+		ret = usb_interrupt_read(pickit2_handle, ENDPOINT_IN, (char *)report, CMD_LENGTH, DFLT_TIMEOUT);
+		if (ret != CMD_LENGTH || report[0] != 1) {
+			msg_perr("Reading the status register failed (%s)!\n", usb_strerror());
+			return 1;
+		}
+	} while (report[1] & SPI_SR_WIP);
+	return 0;
+}
+
+/*
+ * Program the range page by page. WREN, the page program and the first status read are sent back to back
+ * and the PICkit2 itself waits for the typical program time, so a page takes one round trip plus the
+ * packets needed for its data.
+ */
+static int pickit2_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start,
+				 unsigned int len)
+{
+	static const uint8_t wren = JEDEC_WREN;
+	const unsigned int page_size = flash->chip->page_size;
+	uint8_t cmd[1 + 3 + 256] = { JEDEC_BYTE_PROGRAM };
+	unsigned int n;
+
+	if (!page_size) {
+		msg_perr("%s: the page size of the chip is unknown.\n", __func__);
+		return 1;
+	}
+	/* Just like reads, 4-byte addresses are left to the generic code. */
+	if (start + len > (1 << 24) || flash->in_4ba_mode || page_size > 256)
+		return default_spi_write_256(flash, buf, start, len);
+
+	for (; len; start += n, buf += n, len -= n) {
+		n = min(len, page_size - start % page_size);
+		cmd[1] = (start >> 16) & 0xff;
+		cmd[2] = (start >> 8) & 0xff;
+		cmd[3] = start & 0xff;
+		memcpy(cmd + 1 + 3, buf, n);
+		if (pickit2_queue_write(&wren, JEDEC_WREN_OUTSIZE, true, true) ||
+		    pickit2_queue_write(cmd, 1 + 3 + n, true, true) ||
+		    pickit2_wait_wip(flash->chip->typical_program_us))
+			return 1;
+	}
+	return 0;
+}
+
 /* Copied from dediprog.c */
 /* Might be useful for other USB devices as well. static for now. */
 static int parse_voltage(char *voltage)
@@ -357,9 +626,11 @@ static const struct spi_master spi_master_pickit2 = {
 	.max_data_write	= 40,
 	.command	= pickit2_spi_send_command,
 	.multicommand	= default_spi_send_multicommand,
-	.read		= default_spi_read,
-	.write_256	= default_spi_write_256,
+	.read		= pickit2_spi_read,
+	.write_256	= pickit2_spi_write_256,
 	.write_aai	= default_spi_write_aai,
+	.speeds_khz	= pickit2_speeds_khz,
+	.set_speed	= pickit2_set_autospeed,
 };
 
 static int pickit2_shutdown(void *data)
@@ -420,7 +691,11 @@ int pickit2_spi_init(void)
 
 	int spispeed_idx = 0;
 	char *spispeed = extract_programmer_param("spispeed");
-	if (spispeed != NULL) {
+	if (spispeed != NULL && strcasecmp(spispeed, "auto") == 0) {
+		free(spispeed);
+		if (spi_request_autospeed("pickit2_spi"))
+			return 1;
+	} else if (spispeed != NULL) {
 		int i = 0;
 		for (; spispeeds[i].name; i++) {
 			if (strcasecmp(spispeeds[i].name, spispeed) == 0) {
@@ -0,0 +1,230 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Read the flash chip in chunks and hand every chunk to a consumer (compare, checksum, file output...)
+ * while the next one is being read.
+ *
+ * All bus I/O stays on the calling thread because none of the programmer drivers are prepared to be
+ * called from another thread. The consumer runs on a helper thread instead, so host-side work overlaps
+ * with the (usually much slower) transfers. Without thread support the chunks are simply consumed
+ * one after the other.
+ *
+ * read_flash_pipelined() reads into a caller supplied buffer holding the whole range, while
+ * read_flash_streamed() cycles through a few chunk sized buffers, so memory use doesn't depend on the
+ * size of the range.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "flash.h"
+
+#if CONFIG_THREADS == 1
+#include <pthread.h>
+#endif
+
+/* Size of the chunks passed to the chip read function. */
+#define PIPELINE_CHUNK	(64 * 1024)
+/* Number of chunk buffers used by read_flash_streamed(). */
+#define PIPELINE_SLOTS	4
+
+/* Offset in the buffer of the data at @pos (relative to the start of the read). */
+static unsigned int chunk_offset(unsigned int slots, unsigned int pos)
+{
+	if (!slots)
+		return pos;
+	return (pos / PIPELINE_CHUNK) % slots * PIPELINE_CHUNK + pos % PIPELINE_CHUNK;
+}
+
+#if CONFIG_THREADS == 1
+struct pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const uint8_t *buf;
+	unsigned int slots;	/* buf is a ring of this many chunks, 0 if it holds the whole range. */
+	unsigned int start;
+	unsigned int ready;	/* Bytes read so far. */
+	unsigned int consumed;	/* Bytes passed to the consumer so far. */
+	int done;		/* No more data will follow. */
+	int consumer_ret;
+	chunk_consumer_t consume;
+	void *ctx;
+};
+
+static void *pipeline_consumer(void *arg)
+{
+	struct pipeline *p = arg;
+	unsigned int from, to;
+	int ret;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->consumed == p->ready && !p->done)
+			pthread_cond_wait(&p->cond, &p->lock);
+		if (p->consumed == p->ready)
+			break;
+		from = p->consumed;
+		to = p->ready;
+		/* Ring slots are handed out one at a time. */
+		if (p->slots)
+			to = min(to, from - from % PIPELINE_CHUNK + PIPELINE_CHUNK);
+		pthread_mutex_unlock(&p->lock);
+
+		ret = p->consume(p->ctx, p->buf + chunk_offset(p->slots, from), p->start + from, to - from);
+
+		pthread_mutex_lock(&p->lock);
+		p->consumed = to;
+		/* The reader may be waiting for a free slot. */
+		pthread_cond_broadcast(&p->cond);
+		if (ret) {
+			p->consumer_ret = ret;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+#endif
+
+/* Without threads (or for tiny reads): read a chunk, consume it, repeat. */
+static int read_and_consume_sequential(struct flashctx *flash, uint8_t *buf, unsigned int slots,
+				       unsigned int start, unsigned int len, chunk_consumer_t consume, void *ctx)
+{
+	unsigned int pos, n;
+	uint8_t *chunk;
+	int ret;
+
+	for (pos = 0; pos < len; pos += n) {
+		n = min(PIPELINE_CHUNK, len - pos);
+		chunk = buf + chunk_offset(slots, pos);
+		if (flash->chip->read(flash, chunk, start + pos, n))
+			return -1;
+		ret = consume(ctx, chunk, start + pos, n);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int read_and_consume(struct flashctx *flash, uint8_t *buf, unsigned int slots, unsigned int start,
+			    unsigned int len, chunk_consumer_t consume, void *ctx)
+{
+#if CONFIG_THREADS == 1
+	struct pipeline p = {
+		.buf		= buf,
+		.slots		= slots,
+		.start		= start,
+		.consume	= consume,
+		.ctx		= ctx,
+	};
+	pthread_t thread;
+	unsigned int pos, n;
+	int ret = 0, stop;
+
+	if (len <= PIPELINE_CHUNK)
+		return read_and_consume_sequential(flash, buf, slots, start, len, consume, ctx);
+
+	if (pthread_mutex_init(&p.lock, NULL))
+		return read_and_consume_sequential(flash, buf, slots, start, len, consume, ctx);
+	if (pthread_cond_init(&p.cond, NULL)) {
+		pthread_mutex_destroy(&p.lock);
+		return read_and_consume_sequential(flash, buf, slots, start, len, consume, ctx);
+	}
+	if (pthread_create(&thread, NULL, pipeline_consumer, &p)) {
+		msg_gdbg("Could not start consumer thread, reading sequentially.\n");
+		pthread_cond_destroy(&p.cond);
+		pthread_mutex_destroy(&p.lock);
+		return read_and_consume_sequential(flash, buf, slots, start, len, consume, ctx);
+	}
+
+	for (pos = 0; pos < len; pos += n) {
+		n = min(PIPELINE_CHUNK, len - pos);
+		if (slots) {
+			/* Wait until the slot is free again. */
+			pthread_mutex_lock(&p.lock);
+			while (pos - p.consumed >= slots * PIPELINE_CHUNK && !p.consumer_ret)
+				pthread_cond_wait(&p.cond, &p.lock);
+			stop = p.consumer_ret != 0;
+			pthread_mutex_unlock(&p.lock);
+			if (stop)
+				break;
+		}
+		if (flash->chip->read(flash, buf + chunk_offset(slots, pos), start + pos, n)) {
+			ret = -1;
+			break;
+		}
+		pthread_mutex_lock(&p.lock);
+		p.ready = pos + n;
+		pthread_cond_broadcast(&p.cond);
+		/* Stop reading if the consumer gave up. */
+		stop = p.consumer_ret != 0;
+		pthread_mutex_unlock(&p.lock);
+		if (stop)
+			break;
+	}
+
+	pthread_mutex_lock(&p.lock);
+	p.done = 1;
+	pthread_cond_broadcast(&p.cond);
+	pthread_mutex_unlock(&p.lock);
+	pthread_join(thread, NULL);
+	pthread_cond_destroy(&p.cond);
+	pthread_mutex_destroy(&p.lock);
+
+	if (p.consumer_ret)
+		return p.consumer_ret;
+	return ret;
+#else
+	return read_and_consume_sequential(flash, buf, slots, start, len, consume, ctx);
+#endif
+}
+
+/*
+ * Read @len bytes starting at @start into @buf and call @consume for each part as soon as it has been read.
+ * The consumer sees the data in order, but possibly in pieces of a different size than read.
+ *
+ * @return	0 on success, -1 if reading failed, the consumer's return value if that failed
+ */
+int read_flash_pipelined(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len,
+			 chunk_consumer_t consume, void *ctx)
+{
+	return read_and_consume(flash, buf, 0, start, len, consume, ctx);
+}
+
+/*
+ * Like read_flash_pipelined(), but the data is only available to the consumer during the call, so no
+ * buffer for the whole range is needed.
+ */
+int read_flash_streamed(struct flashctx *flash, unsigned int start, unsigned int len,
+			chunk_consumer_t consume, void *ctx)
+{
+	unsigned int slots = min(PIPELINE_SLOTS, (len + PIPELINE_CHUNK - 1) / PIPELINE_CHUNK);
+	uint8_t *buf;
+	int ret;
+
+	if (!len)
+		return 0;
+	buf = malloc(slots == 1 ? len : slots * PIPELINE_CHUNK);
+	if (!buf) {
+		msg_gerr("Out of memory!\n");
+		return -1;
+	}
+	ret = read_and_consume(flash, buf, slots, start, len, consume, ctx);
+	free(buf);
+	return ret;
+}
@@ -94,12 +94,35 @@ static int pony_bitbang_get_miso(void)
 	return tmp;
 }
 
+/* MOSI is changed along with SCK going low, which saves a modem control update per bit. */
+static void pony_bitbang_transfer(const uint8_t *out, uint8_t *in, unsigned int len)
+{
+	unsigned int i;
+	uint8_t val, ret;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		val = out ? out[i] : 0;
+		ret = 0;
+		for (bit = 7; bit >= 0; bit--) {
+			sp_set_pins(((val >> bit) & 1) ^ pony_negate_mosi, pony_negate_sck);
+			sp_set_pin(PIN_RTS, 1 ^ pony_negate_sck);
+			if (in)
+				ret = (ret << 1) | (sp_get_pin(PIN_CTS) ^ pony_negate_miso);
+		}
+		if (in)
+			in[i] = ret;
+	}
+	sp_set_pin(PIN_RTS, pony_negate_sck);
+}
+
 static const struct bitbang_spi_master bitbang_spi_master_pony = {
 	.type = BITBANG_SPI_MASTER_PONY,
 	.set_cs = pony_bitbang_set_cs,
 	.set_sck = pony_bitbang_set_sck,
 	.set_mosi = pony_bitbang_set_mosi,
 	.get_miso = pony_bitbang_get_miso,
+	.transfer = pony_bitbang_transfer,
 	.half_period = 0,
 };
 
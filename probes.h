@@ -0,0 +1,58 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Static tracepoints (USDT) of the "flashrom" provider at the bus access choke points and in the transports
+ * of the USB and serial programmers. With CONFIG_USDT=yes every probe is a single nop plus a note for
+ * bpftrace, SystemTap or DTrace until a tracer attaches, e.g.
+ *
+ *	bpftrace -e 'usdt:./flashrom:spi_command_start { @t[tid] = nsecs; }
+ *		     usdt:./flashrom:spi_command_done /@t[tid]/ { @us[arg0] = hist((nsecs - @t[tid]) / 1000); }'
+ *
+ * Without it they compile to nothing, so the arguments must not have side effects. The probes come in
+ * _start/_done pairs:
+ *
+ *	spi_command		opcode, bytes out, bytes in (, return value)
+ *	spi_multicommand	number of commands, bytes out, bytes in (, return value)
+ *	spi_queue		number of entries (, return value)
+ *	chip_read, chip_write	address, length
+ *	delay			microseconds
+ *	serial_read, serial_write	length (, return value)
+ *	ftdi_transfer		bytes out, bytes in (, return value)
+ *	usb_bulk		endpoint, length (, return value)
+ */
+
+#ifndef __PROBES_H__
+#define __PROBES_H__ 1
+
+#if CONFIG_USDT == 1
+#include <sys/sdt.h>
+
+#define FLASHROM_PROBE1(name, a)		DTRACE_PROBE1(flashrom, name, a)
+#define FLASHROM_PROBE2(name, a, b)		DTRACE_PROBE2(flashrom, name, a, b)
+#define FLASHROM_PROBE3(name, a, b, c)		DTRACE_PROBE3(flashrom, name, a, b, c)
+#define FLASHROM_PROBE4(name, a, b, c, d)	DTRACE_PROBE4(flashrom, name, a, b, c, d)
+#else
+/* The arguments are only used by the probes, keep the compiler from warning about them. */
+#define FLASHROM_PROBE1(name, a)		do { (void)(a); } while (0)
+#define FLASHROM_PROBE2(name, a, b)		do { (void)(a); (void)(b); } while (0)
+#define FLASHROM_PROBE3(name, a, b, c)		do { (void)(a); (void)(b); (void)(c); } while (0)
+#define FLASHROM_PROBE4(name, a, b, c, d)	do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
+
+#endif /* !__PROBES_H__ */
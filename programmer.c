@@ -98,7 +98,7 @@ void fallback_chip_readn(const struct flashctx *flash, uint8_t *buf,
 int register_par_master(const struct par_master *mst,
 			    const enum chipbustype buses)
 {
-	struct registered_master rmst;
+	struct registered_master rmst = { 0 };
 	if (!mst->chip_writeb || !mst->chip_writew || !mst->chip_writel ||
 	    !mst->chip_writen || !mst->chip_readb || !mst->chip_readw ||
 	    !mst->chip_readl || !mst->chip_readn) {
@@ -132,6 +132,13 @@ int register_master(const struct registered_master *mst)
 	return 0;
 }
 
+/* Mark the master registered last as independent of all others, see struct registered_master. */
+void declare_master_independent(void)
+{
+	if (registered_master_count)
+		registered_masters[registered_master_count - 1].independent = true;
+}
+
 enum chipbustype get_buses_supported(void)
 {
 	int i;
@@ -142,6 +142,8 @@ extern const struct programmer_entry programmer_table[];
 
 int programmer_init(enum programmer prog, const char *param);
 int programmer_shutdown(void);
+const char *programmer_name(void);
+const char *programmer_params(void);
 
 enum bitbang_spi_master_type {
 	BITBANG_SPI_INVALID	= 0, /* This must always be the first entry. */
@@ -174,6 +176,11 @@ struct bitbang_spi_master {
 	int (*get_miso) (void);
 	void (*request_bus) (void);
 	void (*release_bus) (void);
+	/* Optional: Shift out @len bytes from @out (zeroes if NULL) MSB first with CS# already asserted and
+	 * store the bytes shifted in to @in (unless NULL). Has to leave SCK low. Drivers can do this much
+	 * faster than a bit at a time through the functions above. Only used if half_period is 0.
+	 */
+	void (*transfer) (const uint8_t *out, uint8_t *in, unsigned int len);
 	/* Length of half a clock period in usecs. */
 	unsigned int half_period;
 };
@@ -339,6 +346,8 @@ void probe_superio(void);
 int register_superio(struct superio s);
 extern enum chipbustype internal_buses_supported;
 int internal_init(void);
+int check_mapped_window(struct flashctx *flash, uint8_t *virt, unsigned int start, unsigned int len,
+			int (*read)(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len));
 #endif
 
 /* hwaccess.c */
@@ -379,6 +388,7 @@ void rmmio_vall(void *addr);
 int dummy_init(void);
 void *dummy_map(const char *descr, uintptr_t phys_addr, size_t len);
 void dummy_unmap(void *virt_addr, size_t len);
+void dummy_delay(unsigned int usecs);
 #endif
 
 /* nic3com.c */
@@ -580,6 +590,30 @@ enum spi_controller {
 #define MAX_DATA_UNSPECIFIED 0
 #define MAX_DATA_READ_UNLIMITED 64 * 1024
 #define MAX_DATA_WRITE_UNLIMITED 256
+/* Number of data lines used for the opcode, address (and dummy) and data phases of a read command. */
+enum spi_io_mode {
+	SPI_IO_1_1_1 = 0,
+	SPI_IO_1_1_2,
+	SPI_IO_1_2_2,
+	SPI_IO_1_1_4,
+	SPI_IO_1_4_4,
+};
+#define SPI_IO_MODE(mode)	(1 << (mode))
+
+/* One step of a queued SPI transaction, see spi_queue_flush(). */
+struct spi_queued_op {
+	/* Poll the status register instead of sending cmd. */
+	bool poll;
+	struct spi_command cmd;
+	/* Polls end once (status & mask) == value. The first poll is due after about expected_us, later ones
+	 * should be at most max_step_us apart. A poll with a mask of 0 only waits for (at least) expected_us
+	 * and doesn't read the status register at all. */
+	uint8_t mask;
+	uint8_t value;
+	unsigned int expected_us;
+	unsigned int max_step_us;
+};
+
 struct spi_master {
 	enum spi_controller type;
 	unsigned int max_data_read;
@@ -587,22 +621,53 @@ struct spi_master {
 	int (*command)(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 		   const unsigned char *writearr, unsigned char *readarr);
 	int (*multicommand)(struct flashctx *flash, struct spi_command *cmds);
+	/* Whether multicommand handles commands with data (see struct spi_command). For other masters,
+	 * spi_send_multicommand() copies the data behind writearr first. */
+	bool gather;
 
 	/* Optimized functions for this master */
 	int (*read)(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
 	int (*write_256)(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 	int (*write_aai)(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
+	/* Optional: write_256 programs up to this many bytes spanning several pages at once, paging and
+	 * polling on the programmer. Writes are then merged across pages and extended to whole pages
+	 * where that is harmless. 0 if every page is a transaction of its own anyway. */
+	unsigned int max_bulk_write;
+	/* Optional: let the master compute the CRC-32 (see crc32_update()) of the flash contents
+	 * without transferring them. Returns 0 on success, anything else means "not available". */
+	int (*checksum)(struct flashctx *flash, unsigned int start, unsigned int len, uint32_t *crc);
+	/* Optional: read commands using several data lines. io_modes has SPI_IO_MODE() set for every mode
+	 * besides SPI_IO_1_1_1 the master (as wired) can do. The opcode in writearr[0] is sent on one line,
+	 * the rest of writearr (address, mode and dummy bytes) and the data as given by @mode. */
+	unsigned int io_modes;
+	int (*multi_io_read)(struct flashctx *flash, enum spi_io_mode mode, unsigned int writecnt,
+			     unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr);
+	/* Optional: run @count queued commands and status polls in order, stopping at the first failure.
+	 * Masters that can do several of them in one round trip implement this, otherwise the queue is
+	 * run through multicommand and status polls from the host. */
+	int (*queue)(struct flashctx *flash, const struct spi_queued_op *ops, unsigned int count);
+	/* Optional, for spispeed=auto: the clock rates in kHz set_speed() can select, ascending and terminated
+	 * by 0. */
+	const unsigned int *speeds_khz;
+	int (*set_speed)(unsigned int khz);
 	const void *data;
 };
 
 int default_spi_send_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 			     const unsigned char *writearr, unsigned char *readarr);
 int default_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds);
+int spi_send_multi_io_read(struct flashctx *flash, enum spi_io_mode mode, unsigned int writecnt,
+			   unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr);
 int default_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
 int default_spi_write_256(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 int default_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 int register_spi_master(const struct spi_master *mst);
 
+/* spi_autospeed.c */
+int spi_request_autospeed(const char *instance);
+int spi_autospeed(struct flashctx *flash);
+unsigned int spi_autospeed_khz(void);
+
 /* The following enum is needed by ich_descriptor_tool and ich* code as well as in chipset_enable.c. */
 enum ich_chipset {
 	CHIPSET_ICH_UNKNOWN,
@@ -663,6 +728,8 @@ struct opaque_master {
 	int (*read) (struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
 	int (*write) (struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len);
 	int (*erase) (struct flashctx *flash, unsigned int blockaddr, unsigned int blocklen);
+	/* Optional, see struct spi_master. */
+	int (*checksum) (struct flashctx *flash, unsigned int start, unsigned int len, uint32_t *crc);
 	const void *data;
 };
 int register_opaque_master(const struct opaque_master *mst);
@@ -687,11 +754,15 @@ struct par_master {
 	uint16_t (*chip_readw) (const struct flashctx *flash, const chipaddr addr);
 	uint32_t (*chip_readl) (const struct flashctx *flash, const chipaddr addr);
 	void (*chip_readn) (const struct flashctx *flash, uint8_t *buf, const chipaddr addr, size_t len);
+	/* Optional, see chip_wait_toggle(). */
+	int (*wait_toggle) (const struct flashctx *flash, chipaddr addr, unsigned int delay, uint8_t *val);
 	const void *data;
 };
 int register_par_master(const struct par_master *mst, const enum chipbustype buses);
 struct registered_master {
 	enum chipbustype buses_supported;
+	/* Shares no hardware or driver state with the other masters, so it may be probed concurrently. */
+	bool independent;
 	union {
 		struct par_master par;
 		struct spi_master spi;
@@ -701,6 +772,7 @@ struct registered_master {
 extern struct registered_master registered_masters[];
 extern int registered_master_count;
 int register_master(const struct registered_master *mst);
+void declare_master_independent(void);
 
 /* serprog.c */
 #if CONFIG_SERPROG == 1
@@ -720,6 +792,8 @@ typedef int fdtype;
 
 void sp_flush_incoming(void);
 fdtype sp_openserport(char *dev, int baud);
+bool serialport_baud_supported(unsigned int baud);
+int serialport_config(fdtype fd, int baud);
 extern fdtype sp_fd;
 int serialport_shutdown(void *data);
 int serialport_write(const unsigned char *buf, unsigned int writecnt);
@@ -752,6 +826,7 @@ enum SP_PIN {
 };
 
 void sp_set_pin(enum SP_PIN pin, int val);
+void sp_set_pins(int dtr, int rts);
 int sp_get_pin(enum SP_PIN pin);
 
 #endif				/* !__PROGRAMMER_H__ */
@@ -152,12 +152,40 @@ static int rayer_bitbang_get_miso(void)
 	return tmp;
 }
 
+/* Two port writes per bit: MOSI along with SCK low (which ends the previous bit), then SCK high. */
+static void rayer_bitbang_transfer(const uint8_t *out, uint8_t *in, unsigned int len)
+{
+	const uint8_t sck = 1 << pinout->sck_bit;
+	const uint8_t base = lpt_outbyte & ~(sck | (1 << pinout->mosi_bit));
+	const uint8_t lines[2] = { base, base | (1 << pinout->mosi_bit) };
+	unsigned int i;
+	uint8_t val = 0, ret, b;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		val = out ? out[i] : 0;
+		ret = 0;
+		for (bit = 7; bit >= 0; bit--) {
+			b = lines[(val >> bit) & 1];
+			OUTB(b, lpt_iobase);
+			OUTB(b | sck, lpt_iobase);
+			if (in)
+				ret = (ret << 1) | (((INB(lpt_iobase + 1) ^ 0x80) >> pinout->miso_bit) & 0x1);
+		}
+		if (in)
+			in[i] = ret;
+	}
+	lpt_outbyte = lines[val & 1];
+	OUTB(lpt_outbyte, lpt_iobase);
+}
+
 static const struct bitbang_spi_master bitbang_spi_master_rayer = {
 	.type = BITBANG_SPI_MASTER_RAYER,
 	.set_cs = rayer_bitbang_set_cs,
 	.set_sck = rayer_bitbang_set_sck,
 	.set_mosi = rayer_bitbang_set_mosi,
 	.get_miso = rayer_bitbang_get_miso,
+	.transfer = rayer_bitbang_transfer,
 	.half_period = 0,
 };
 
@@ -63,6 +63,7 @@ static int sb600_spi_send_command(struct flashctx *flash, unsigned int writecnt,
 				  const unsigned char *writearr, unsigned char *readarr);
 static int spi100_spi_send_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 				  const unsigned char *writearr, unsigned char *readarr);
+static int sb600_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len);
 
 static struct spi_master spi_master_sb600 = {
 	.type = SPI_CONTROLLER_SB600,
@@ -70,7 +71,7 @@ static struct spi_master spi_master_sb600 = {
 	.max_data_write = FIFO_SIZE_OLD - 3,
 	.command = sb600_spi_send_command,
 	.multicommand = default_spi_send_multicommand,
-	.read = default_spi_read,
+	.read = sb600_spi_read,
 	.write_256 = default_spi_write_256,
 	.write_aai = default_spi_write_aai,
 };
@@ -81,7 +82,7 @@ static struct spi_master spi_master_yangtze = {
 	.max_data_write = FIFO_SIZE_YANGTZE - 3,
 	.command = spi100_spi_send_command,
 	.multicommand = default_spi_send_multicommand,
-	.read = default_spi_read,
+	.read = sb600_spi_read,
 	.write_256 = default_spi_write_256,
 	.write_aai = default_spi_write_aai,
 };
@@ -334,6 +335,60 @@ static int spi100_spi_send_command(struct flashctx *flash, unsigned int writecnt
 	return 0;
 }
 
+/* The flash chip as the host sees it right below 4 GiB, read with the mode and speed configured in
+ * handle_speed() instead of through the FIFO, which holds at most 8 (or 71) bytes per command. */
+#define ROM_WINDOW_MAX		(16 * 1024 * 1024)
+
+static struct pci_dev *sb600_lpc_dev = NULL;
+static uint8_t *rom_window = NULL;
+static int rom_window_tried = 0;
+
+/* Map the chip once its size is known. The mapping is compared with what the FIFO returns, in case the LPC
+ * bridge doesn't decode all of it. */
+static void map_rom_window(struct flashctx *flash)
+{
+	const unsigned int size = flash->chip->total_size * 1024;
+	uint8_t *virt;
+	uint8_t reg;
+
+	rom_window_tried = 1;
+	/* Nothing is known about the host prefetching on SB6xx, see below. */
+	if (amd_gen < CHIPSET_SB7XX || size > ROM_WINDOW_MAX)
+		return;
+
+	/* Host reads served from the prefetch buffer could return contents from before an erase or write
+	 * done through the FIFO. */
+	reg = pci_read_byte(sb600_lpc_dev, 0xbb);
+	if (reg & 0x1) {
+		rpci_write_byte(sb600_lpc_dev, 0xbb, reg & ~0x1);
+		if (pci_read_byte(sb600_lpc_dev, 0xbb) & 0x1) {
+			msg_pdbg("Disabling PrefetchEnSPIFromHost failed, not reading the chip from memory.\n");
+			return;
+		}
+	}
+
+	virt = rphysmap("SB600 SPI ROM", (uintptr_t)(0x100000000ULL - size), size);
+	if (virt == ERROR_PTR)
+		return;
+	if (check_mapped_window(flash, virt, 0, size, default_spi_read)) {
+		msg_pdbg("Not reading the chip from memory.\n");
+		return;
+	}
+	msg_pdbg("Reading the chip through its memory mapping.\n");
+	rom_window = virt;
+}
+
+static int sb600_spi_read(struct flashctx *flash, uint8_t *buf, unsigned int start, unsigned int len)
+{
+	if (!rom_window_tried)
+		map_rom_window(flash);
+	if (!rom_window)
+		return default_spi_read(flash, buf, start, len);
+
+	mmio_readn(rom_window + start, buf, len);
+	return 0;
+}
+
 struct spispeed {
 	const char *const name;
 	const uint8_t speed;
@@ -685,6 +740,10 @@ int sb600_probe_spi(struct pci_dev *dev)
 	if (handle_speed(dev) != 0)
 		return ERROR_FATAL;
 
+	sb600_lpc_dev = dev;
+	rom_window = NULL;
+	rom_window_tried = 0;
+
 	if (handle_imc(dev) != 0)
 		return ERROR_FATAL;
 
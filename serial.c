@@ -35,14 +35,33 @@
 #else
 #include <termios.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #endif
+#if defined(__linux__)
+#include <linux/serial.h>
+#endif
 #include "flash.h"
 #include "programmer.h"
+#include "probes.h"
 
 fdtype sp_fd = SER_INV_FD;
 
+/* Everything received is read ahead into this buffer, so replies trickling in don't take a system call per
+ * piece and callers get the bytes they wait for as soon as they have arrived. */
+#define SP_RXBUF_SIZE (64 * 1024)
+static unsigned char sp_rxbuf[SP_RXBUF_SIZE];
+static unsigned int sp_rxbuf_pos = 0;
+static unsigned int sp_rxbuf_len = 0;
+
+#if IS_WINDOWS
+/* The port is opened for overlapped I/O, reads and writes wait on these events. */
+static OVERLAPPED sp_rx_overlapped;
+static OVERLAPPED sp_tx_overlapped;
+#endif
+
 /* There is no way defined by POSIX to use arbitrary baud rates. It only defines some macros that can be used to
  * specify respective baud rates and many implementations extend this list with further macros, cf. TERMIOS(3)
  * and http://git.kernel.org/?p=linux/kernel/git/torvalds/linux.git;a=blob;f=include/uapi/asm-generic/termbits.h
@@ -138,6 +157,22 @@ static const struct baudentry *round_baud(unsigned int baud)
 }
 #endif
 
+/* Can the port be set to exactly @baud? */
+bool serialport_baud_supported(unsigned int baud)
+{
+#if IS_WINDOWS
+	/* Windows takes any rate and lets the driver decide. */
+	return true;
+#else
+	int i;
+
+	for (i = 0; sp_baudtable[i].baud; i++)
+		if (sp_baudtable[i].baud == baud)
+			return true;
+	return false;
+#endif
+}
+
 /* Uses msg_perr to print the last system error.
  * Prints "Error: " followed first by \c msg and then by the description of the last error retrieved via
  * strerror() or FormatMessage() and ending with a linebreak. */
@@ -236,6 +271,17 @@ int serialport_config(fdtype fd, int baud)
 		msg_pdbg("Actual baud flags are: ispeed: 0x%08lX, ospeed: 0x%08lX\n",
 			  (long)cfgetispeed(&observed), (long)cfgetospeed(&observed));
 	}
+#if defined(__linux__)
+	/* USB serial converters like the FTDI chips on many programmers hold back received data for up to 16 ms
+	 * by default. Every command waits for its reply, so ask for the data right away. Not all ports know
+	 * about this, so failures don't matter. */
+	struct serial_struct serinfo;
+	if (!ioctl(fd, TIOCGSERIAL, &serinfo) && !(serinfo.flags & ASYNC_LOW_LATENCY)) {
+		serinfo.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(fd, TIOCSSERIAL, &serinfo))
+			msg_pdbg("Could not enable low latency mode: %s\n", strerror(errno));
+	}
+#endif
 	// FIXME: display actual baud rate - at least if none was specified by the user.
 #endif
 	return 0;
@@ -259,7 +305,7 @@ fdtype sp_openserport(char *dev, int baud)
 		strcpy(dev2 + 4, dev);
 	}
 	fd = CreateFile(dev2, GENERIC_READ | GENERIC_WRITE, 0, NULL,
-			OPEN_EXISTING, 0, NULL);
+			OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
 	if (dev2 != dev)
 		free(dev2);
 	if (fd == INVALID_HANDLE_VALUE) {
@@ -270,6 +316,32 @@ fdtype sp_openserport(char *dev, int baud)
 		CloseHandle(fd);
 		return SER_INV_FD;
 	}
+	/* Reads complete as soon as at least one byte is there, writes once everything is sent. */
+	COMMTIMEOUTS timeouts = {
+		.ReadIntervalTimeout = MAXDWORD,
+		.ReadTotalTimeoutMultiplier = MAXDWORD,
+		.ReadTotalTimeoutConstant = MAXDWORD - 1,
+		.WriteTotalTimeoutMultiplier = 0,
+		.WriteTotalTimeoutConstant = 0
+	};
+	if (!SetCommTimeouts(fd, &timeouts)) {
+		msg_perr_strerror("Could not set serial port timeout settings: ");
+		CloseHandle(fd);
+		return SER_INV_FD;
+	}
+	sp_rx_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	sp_tx_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!sp_rx_overlapped.hEvent || !sp_tx_overlapped.hEvent) {
+		msg_perr_strerror("Could not create serial port events: ");
+		if (sp_rx_overlapped.hEvent)
+			CloseHandle(sp_rx_overlapped.hEvent);
+		if (sp_tx_overlapped.hEvent)
+			CloseHandle(sp_tx_overlapped.hEvent);
+		sp_rx_overlapped.hEvent = sp_tx_overlapped.hEvent = NULL;
+		CloseHandle(fd);
+		return SER_INV_FD;
+	}
+	sp_rxbuf_pos = sp_rxbuf_len = 0;
 	return fd;
 #else
 	fd = open(dev, O_RDWR | O_NOCTTY | O_NDELAY); // Use O_NDELAY to ignore DCD state
@@ -293,6 +365,7 @@ fdtype sp_openserport(char *dev, int baud)
 		close(fd);
 		return SER_INV_FD;
 	}
+	sp_rxbuf_pos = sp_rxbuf_len = 0;
 	return fd;
 #endif
 }
@@ -312,26 +385,35 @@ void sp_set_pin(enum SP_PIN pin, int val) {
 	}
 	EscapeCommFunction(sp_fd, ctl);
 #else
-	int ctl, s;
+	int s;
 
 	if(pin == PIN_TXD) {
 		ioctl(sp_fd, val ? TIOCSBRK : TIOCCBRK, 0);
 	}
 	else {
 		s = (pin == PIN_DTR) ? TIOCM_DTR : TIOCM_RTS;
-		ioctl(sp_fd, TIOCMGET, &ctl);
-
-		if (val) {
-			ctl |= s;
-		}
-		else {
-			ctl &= ~s;
-		}
-		ioctl(sp_fd, TIOCMSET, &ctl);
+		ioctl(sp_fd, val ? TIOCMBIS : TIOCMBIC, &s);
 	}
 #endif
 }
 
+/* Set DTR and RTS with as few modem control updates as possible. */
+void sp_set_pins(int dtr, int rts)
+{
+#if IS_WINDOWS
+	EscapeCommFunction(sp_fd, dtr ? SETDTR : CLRDTR);
+	EscapeCommFunction(sp_fd, rts ? SETRTS : CLRRTS);
+#else
+	int set = (dtr ? TIOCM_DTR : 0) | (rts ? TIOCM_RTS : 0);
+	int clear = (dtr ? 0 : TIOCM_DTR) | (rts ? 0 : TIOCM_RTS);
+
+	if (set)
+		ioctl(sp_fd, TIOCMBIS, &set);
+	if (clear)
+		ioctl(sp_fd, TIOCMBIC, &clear);
+#endif
+}
+
 int sp_get_pin(enum SP_PIN pin) {
 	int s;
 #if IS_WINDOWS
@@ -351,6 +433,7 @@ int sp_get_pin(enum SP_PIN pin) {
 
 void sp_flush_incoming(void)
 {
+	sp_rxbuf_pos = sp_rxbuf_len = 0;
 #if IS_WINDOWS
 	PurgeComm(sp_fd, PURGE_RXCLEAR);
 #else
@@ -362,32 +445,174 @@ void sp_flush_incoming(void)
 
 int serialport_shutdown(void *data)
 {
+	sp_rxbuf_pos = sp_rxbuf_len = 0;
 #if IS_WINDOWS
 	CloseHandle(sp_fd);
+	CloseHandle(sp_rx_overlapped.hEvent);
+	CloseHandle(sp_tx_overlapped.hEvent);
+	sp_rx_overlapped.hEvent = sp_tx_overlapped.hEvent = NULL;
 #else
 	close(sp_fd);
 #endif
 	return 0;
 }
 
+/* Milliseconds on some monotonic-enough clock, for the timeouts below. */
+static unsigned long sp_now_ms(void)
+{
+#if IS_WINDOWS
+	return GetTickCount();
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+#endif
+}
+
+/* Remaining milliseconds until @deadline, -1 (forever) if @timeout is negative. */
+static int sp_ms_left(int timeout, unsigned long deadline)
+{
+	long left;
+
+	if (timeout < 0)
+		return -1;
+	left = (long)(deadline - sp_now_ms());
+	return left > 0 ? left : 0;
+}
+
+#if IS_WINDOWS
+/* Start an overlapped read or write of up to @len bytes and wait at most @timeout ms (forever if negative)
+ * for it. Returns the number of bytes transferred, which may be 0 on timeout, or -1 on errors. */
+static int sp_overlapped_io(int write, unsigned char *buf, unsigned int len, int timeout)
+{
+	OVERLAPPED *ov = write ? &sp_tx_overlapped : &sp_rx_overlapped;
+	DWORD rv = 0;
+	BOOL ok;
+
+	ResetEvent(ov->hEvent);
+	if (write)
+		ok = WriteFile(sp_fd, buf, len, &rv, ov);
+	else
+		ok = ReadFile(sp_fd, buf, len, &rv, ov);
+	if (ok)
+		return rv;
+	if (GetLastError() != ERROR_IO_PENDING) {
+		msg_perr_strerror(write ? "Serial port write error: " : "Serial port read error: ");
+		return -1;
+	}
+	if (WaitForSingleObject(ov->hEvent, timeout < 0 ? INFINITE : (DWORD)timeout) != WAIT_OBJECT_0)
+		CancelIo(sp_fd);
+	/* Whatever was transferred before a cancellation still counts. */
+	if (!GetOverlappedResult(sp_fd, ov, &rv, TRUE) && GetLastError() != ERROR_OPERATION_ABORTED) {
+		msg_perr_strerror(write ? "Serial port write error: " : "Serial port read error: ");
+		return -1;
+	}
+	return rv;
+}
+#endif
+
+/* Wait at most @timeout ms (forever if negative) for data and read up to @len bytes of it into @buf.
+ * Returns the number of bytes read, 0 if nothing arrived in time and -1 on errors. */
+static int sp_read_available(unsigned char *buf, unsigned int len, int timeout)
+{
+#if IS_WINDOWS
+	return sp_overlapped_io(0, buf, len, timeout);
+#else
+	struct pollfd pfd = { .fd = sp_fd, .events = POLLIN };
+	ssize_t rv;
+	int ret;
+
+	ret = poll(&pfd, 1, timeout);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
+		msg_perr_strerror("Serial port poll error: ");
+		return -1;
+	}
+	if (!ret)
+		return 0;
+	rv = read(sp_fd, buf, len);
+	if (rv < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		msg_perr_strerror("Serial port read error: ");
+		return -1;
+	}
+	if (!rv) {
+		/* Readable but nothing to read: the other end hung up. */
+		msg_perr("Error: Serial port closed by the other side.\n");
+		return -1;
+	}
+	return rv;
+#endif
+}
+
+/* Copy @readcnt bytes to @buf, out of the read-ahead buffer as far as possible. Waits at most @timeout ms in
+ * total (forever if negative). Returns 0 on success, 1 on timeout and -1 on errors; if really_read is not
+ * NULL, its contents are set to the number of bytes copied. */
+static int sp_read_buffered(unsigned char *buf, unsigned int readcnt, int timeout, unsigned int *really_read)
+{
+	const unsigned long deadline = sp_now_ms() + (timeout > 0 ? timeout : 0);
+	unsigned int done = 0, n;
+	int rv, direct, ret = 0;
+
+	while (done < readcnt) {
+		if (sp_rxbuf_pos < sp_rxbuf_len) {
+			n = min(readcnt - done, sp_rxbuf_len - sp_rxbuf_pos);
+			memcpy(buf + done, sp_rxbuf + sp_rxbuf_pos, n);
+			sp_rxbuf_pos += n;
+			done += n;
+			continue;
+		}
+		sp_rxbuf_pos = sp_rxbuf_len = 0;
+		/* Large reads go straight to the caller's buffer, there is nothing to gain from copying. */
+		direct = readcnt - done >= SP_RXBUF_SIZE;
+		if (direct)
+			rv = sp_read_available(buf + done, readcnt - done, sp_ms_left(timeout, deadline));
+		else
+			rv = sp_read_available(sp_rxbuf, SP_RXBUF_SIZE, sp_ms_left(timeout, deadline));
+		if (rv < 0) {
+			ret = -1;
+			break;
+		}
+		msg_pspew("read %d bytes\n", rv);
+		if (direct)
+			done += rv;
+		else
+			sp_rxbuf_len = rv;
+		if (!rv && timeout >= 0 && !sp_ms_left(timeout, deadline)) {
+			ret = 1;
+			break;
+		}
+	}
+	if (really_read != NULL)
+		*really_read = done;
+	return ret;
+}
+
 int serialport_write(const unsigned char *buf, unsigned int writecnt)
 {
 #if IS_WINDOWS
-	DWORD tmp = 0;
+	int tmp = 0;
 #else
 	ssize_t tmp = 0;
 #endif
 	unsigned int empty_writes = 250; /* results in a ca. 125ms timeout */
+	const unsigned int len = writecnt;
+	int ret = 0;
 
+	FLASHROM_PROBE1(serial_write_start, len);
 	while (writecnt > 0) {
 #if IS_WINDOWS
-		WriteFile(sp_fd, buf, writecnt, &tmp, NULL);
+		tmp = sp_overlapped_io(1, (unsigned char *)buf, writecnt, -1);
 #else
 		tmp = write(sp_fd, buf, writecnt);
 #endif
 		if (tmp == -1) {
 			msg_perr("Serial port write error!\n");
-			return 1;
+			ret = 1;
+			break;
 		}
 		if (!tmp) {
 			msg_pdbg2("Empty write\n");
@@ -395,41 +620,29 @@ int serialport_write(const unsigned char *buf, unsigned int writecnt)
 			internal_delay(500);
 			if (empty_writes == 0) {
 				msg_perr("Serial port is unresponsive!\n");
-				return 1;
+				ret = 1;
+				break;
 			}
 		}
 		writecnt -= tmp;
 		buf += tmp;
 	}
+	FLASHROM_PROBE2(serial_write_done, len, ret);
 
-	return 0;
+	return ret;
 }
 
 int serialport_read(unsigned char *buf, unsigned int readcnt)
 {
-#if IS_WINDOWS
-	DWORD tmp = 0;
-#else
-	ssize_t tmp = 0;
-#endif
+	int ret = 0;
 
-	while (readcnt > 0) {
-#if IS_WINDOWS
-		ReadFile(sp_fd, buf, readcnt, &tmp, NULL);
-#else
-		tmp = read(sp_fd, buf, readcnt);
-#endif
-		if (tmp == -1) {
-			msg_perr("Serial port read error!\n");
-			return 1;
-		}
-		if (!tmp)
-			msg_pdbg2("Empty read\n");
-		readcnt -= tmp;
-		buf += tmp;
+	FLASHROM_PROBE1(serial_read_start, readcnt);
+	if (sp_read_buffered(buf, readcnt, -1, NULL) != 0) {
+		msg_perr("Serial port read error!\n");
+		ret = 1;
 	}
-
-	return 0;
+	FLASHROM_PROBE2(serial_read_done, readcnt, ret);
+	return ret;
 }
 
 /* Tries up to timeout ms to read readcnt characters and places them into the array starting at c. Returns
@@ -437,79 +650,8 @@ int serialport_read(unsigned char *buf, unsigned int readcnt)
  * If really_read is not NULL, this function sets its contents to the number of bytes read successfully. */
 int serialport_read_nonblock(unsigned char *c, unsigned int readcnt, unsigned int timeout, unsigned int *really_read)
 {
-	int ret = 1;
-	/* disable blocked i/o and declare platform-specific variables */
-#if IS_WINDOWS
-	DWORD rv;
-	COMMTIMEOUTS oldTimeout;
-	COMMTIMEOUTS newTimeout = {
-		.ReadIntervalTimeout = MAXDWORD,
-		.ReadTotalTimeoutMultiplier = 0,
-		.ReadTotalTimeoutConstant = 0,
-		.WriteTotalTimeoutMultiplier = 0,
-		.WriteTotalTimeoutConstant = 0
-	};
-	if(!GetCommTimeouts(sp_fd, &oldTimeout)) {
-		msg_perr_strerror("Could not get serial port timeout settings: ");
-		return -1;
-	}
-	if(!SetCommTimeouts(sp_fd, &newTimeout)) {
-		msg_perr_strerror("Could not set serial port timeout settings: ");
-		return -1;
-	}
-#else
-	ssize_t rv;
-	const int flags = fcntl(sp_fd, F_GETFL);
-	if (flags == -1) {
-		msg_perr_strerror("Could not get serial port mode: ");
-		return -1;
-	}
-	if (fcntl(sp_fd, F_SETFL, flags | O_NONBLOCK) != 0) {
-		msg_perr_strerror("Could not set serial port mode to non-blocking: ");
-		return -1;
-	}
-#endif
-
-	int i;
-	int rd_bytes = 0;
-	for (i = 0; i < timeout; i++) {
-		msg_pspew("readcnt %d rd_bytes %d\n", readcnt, rd_bytes);
-#if IS_WINDOWS
-		ReadFile(sp_fd, c + rd_bytes, readcnt - rd_bytes, &rv, NULL);
-		msg_pspew("read %lu bytes\n", rv);
-#else
-		rv = read(sp_fd, c + rd_bytes, readcnt - rd_bytes);
-		msg_pspew("read %zd bytes\n", rv);
-#endif
-		if ((rv == -1) && (errno != EAGAIN)) {
-			msg_perr_strerror("Serial port read error: ");
-			ret = -1;
-			break;
-		}
-		if (rv > 0)
-			rd_bytes += rv;
-		if (rd_bytes == readcnt) {
-			ret = 0;
-			break;
-		}
-		internal_delay(1000);	/* 1ms units */
-	}
-	if (really_read != NULL)
-		*really_read = rd_bytes;
-
-	/* restore original blocking behavior */
-#if IS_WINDOWS
-	if (!SetCommTimeouts(sp_fd, &oldTimeout)) {
-		msg_perr_strerror("Could not restore serial port timeout settings: ");
-		ret = -1;
-	}
-#else
-	if (fcntl(sp_fd, F_SETFL, flags) != 0) {
-		msg_perr_strerror("Could not restore serial port mode to blocking: ");
-		ret = -1;
-	}
-#endif
-	return ret;
+	msg_pspew("%s: readcnt %u timeout %u\n", __func__, readcnt, timeout);
+	return sp_read_buffered(c, readcnt, timeout, really_read);
 }
 
 /* Tries up to timeout ms to write writecnt characters from the array starting at buf. Returns
@@ -518,25 +660,27 @@ int serialport_read_nonblock(unsigned char *c, unsigned int readcnt, unsigned in
 int serialport_write_nonblock(const unsigned char *buf, unsigned int writecnt, unsigned int timeout, unsigned int *really_wrote)
 {
 	int ret = 1;
-	/* disable blocked i/o and declare platform-specific variables */
 #if IS_WINDOWS
-	DWORD rv;
-	COMMTIMEOUTS oldTimeout;
-	COMMTIMEOUTS newTimeout = {
-		.ReadIntervalTimeout = MAXDWORD,
-		.ReadTotalTimeoutMultiplier = 0,
-		.ReadTotalTimeoutConstant = 0,
-		.WriteTotalTimeoutMultiplier = 0,
-		.WriteTotalTimeoutConstant = 0
-	};
-	if(!GetCommTimeouts(sp_fd, &oldTimeout)) {
-		msg_perr_strerror("Could not get serial port timeout settings: ");
-		return -1;
+	const unsigned long deadline = sp_now_ms() + timeout;
+	unsigned int wr_bytes = 0;
+	int rv;
+
+	while (wr_bytes < writecnt) {
+		rv = sp_overlapped_io(1, (unsigned char *)buf + wr_bytes, writecnt - wr_bytes,
+				      sp_ms_left(timeout, deadline));
+		if (rv < 0)
+			return -1;
+		wr_bytes += rv;
+		if (!rv && !sp_ms_left(timeout, deadline))
+			break;
 	}
-	if(!SetCommTimeouts(sp_fd, &newTimeout)) {
-		msg_perr_strerror("Could not set serial port timeout settings: ");
-		return -1;
+	if (wr_bytes == writecnt) {
+		msg_pspew("write successful\n");
+		ret = 0;
 	}
+	if (really_wrote != NULL)
+		*really_wrote = wr_bytes;
+	return ret;
 #else
 	ssize_t rv;
 	const int flags = fcntl(sp_fd, F_GETFL);
@@ -548,19 +692,13 @@ int serialport_write_nonblock(const unsigned char *buf, unsigned int writecnt, u
 		msg_perr_strerror("Could not set serial port mode to non-blocking: ");
 		return -1;
 	}
-#endif
 
 	int i;
 	int wr_bytes = 0;
 	for (i = 0; i < timeout; i++) {
 		msg_pspew("writecnt %d wr_bytes %d\n", writecnt, wr_bytes);
-#if IS_WINDOWS
-		WriteFile(sp_fd, buf + wr_bytes, writecnt - wr_bytes, &rv, NULL);
-		msg_pspew("wrote %lu bytes\n", rv);
-#else
 		rv = write(sp_fd, buf + wr_bytes, writecnt - wr_bytes);
 		msg_pspew("wrote %zd bytes\n", rv);
-#endif
 		if ((rv == -1) && (errno != EAGAIN)) {
 			msg_perr_strerror("Serial port write error: ");
 			ret = -1;
@@ -580,16 +718,10 @@ int serialport_write_nonblock(const unsigned char *buf, unsigned int writecnt, u
 		*really_wrote = wr_bytes;
 
 	/* restore original blocking behavior */
-#if IS_WINDOWS
-	if (!SetCommTimeouts(sp_fd, &oldTimeout)) {
-		msg_perr_strerror("Could not restore serial port timeout settings: ");
-		return -1;
-	}
-#else
 	if (fcntl(sp_fd, F_SETFL, flags) != 0) {
 		msg_perr_strerror("Could not restore serial port blocking behavior: ");
 		return -1;
 	}
-#endif
 	return ret;
+#endif
 }
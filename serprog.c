@@ -42,6 +42,7 @@
 #include "flash.h"
 #include "programmer.h"
 #include "chipdrivers.h"
+#include "spi.h"
 #include "serprog.h"
 
 #define MSGHEADER "serprog: "
@@ -84,11 +85,25 @@ static int sp_opbuf_usage = 0;
 /* if true causes sp_docommand to automatically check
 	whether the command is supported before doing it */
 static int sp_check_avail_automatic = 0;
+/* The programmer can poll toggle bits itself (S_CMD_R_TOGGLE), see serprog_wait_toggle(). */
+static bool sp_toggle_poll = false;
+
+/* Commands are framed into this buffer and written out in one go when a
+	reply is needed or the buffer is full. */
+#define SP_SENDBUF_SIZE 4096
+static unsigned char sp_sendbuf[SP_SENDBUF_SIZE];
+static unsigned int sp_sendbuf_len = 0;
+
+#if ! IS_WINDOWS
+/* Socket buffer size asked for, large enough to keep a network link busy with many requests in flight. */
+#define SP_SOCKET_BUFSIZE (256 * 1024)
+#endif
 
 #if ! IS_WINDOWS
 static int sp_opensocket(char *ip, unsigned int port)
 {
 	int flag = 1;
+	int bufsize = SP_SOCKET_BUFSIZE;
 	struct hostent *hostPtr = NULL;
 	union { struct sockaddr_in si; struct sockaddr s; } sp = {};
 	int sock;
@@ -110,6 +125,11 @@ static int sp_opensocket(char *ip, unsigned int port)
 	sp.si.sin_family = AF_INET;
 	sp.si.sin_port = htons(port);
 	(void)memcpy(&sp.si.sin_addr, hostPtr->h_addr_list[0], hostPtr->h_length);
+	/* Replies to pipelined reads pile up while we are still sending, so ask for large buffers. This has to
+	 * be done before connecting for the receive window to be scaled accordingly. Not fatal if it fails. */
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)) ||
+	    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)))
+		msg_pdbg(MSGHEADER "Could not set socket buffer sizes: %s\n", strerror(errno));
 	if (connect(sock, &sp.s, sizeof(sp.si)) < 0) {
 		close(sock);
 		msg_perr("Error: serprog cannot connect: %s\n", strerror(errno));
@@ -122,10 +142,66 @@ static int sp_opensocket(char *ip, unsigned int port)
 		msg_perr("Error: serprog cannot set socket options: %s\n", strerror(errno));
 		return -1;
 	}
+	/* Notice a station that went away instead of waiting for its reply forever. */
+	if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(int)))
+		msg_pdbg(MSGHEADER "Could not enable keepalive: %s\n", strerror(errno));
 	return sock;
 }
 #endif
 
+/* Write out everything framed so far. */
+static int sp_send_flush(void)
+{
+	unsigned int len = sp_sendbuf_len;
+
+	if (!len)
+		return 0;
+	sp_sendbuf_len = 0;
+	return serialport_write(sp_sendbuf, len);
+}
+
+/* Append @len bytes to the send buffer. Data that doesn't fit is written out directly. */
+static int sp_send(const unsigned char *buf, unsigned int len)
+{
+	if (sp_sendbuf_len + len > SP_SENDBUF_SIZE) {
+		if (sp_send_flush() != 0)
+			return 1;
+		if (len > SP_SENDBUF_SIZE)
+			return serialport_write(buf, len);
+	}
+	memcpy(sp_sendbuf + sp_sendbuf_len, buf, len);
+	sp_sendbuf_len += len;
+	return 0;
+}
+
+/* Read the reply to a command (written out first if needed): ACK and @retlen bytes of return parameters. */
+static int sp_read_reply(uint32_t retlen, void *retparms)
+{
+	unsigned char c;
+
+	if (sp_send_flush() != 0) {
+		msg_perr("Error: cannot write command: %s\n", strerror(errno));
+		return 1;
+	}
+	if (serialport_read(&c, 1) != 0) {
+		msg_perr("Error: cannot read from device: %s\n", strerror(errno));
+		return 1;
+	}
+	if (c == S_NAK)
+		return 1;
+	if (c != S_ACK) {
+		msg_perr("Error: invalid response 0x%02X from device\n", c);
+		return 1;
+	}
+	if (retlen) {
+		if (serialport_read(retparms, retlen) != 0) {
+			msg_perr("Error: cannot read return parameters: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+	return 0;
+}
+
 /* Synchronize: a bit tricky algorithm that tries to (and in my tests has *
  * always succeeded in) bring the serial protocol to known waiting-for-   *
  * command state - uses nonblocking I/O - rest of the driver uses         *
@@ -214,88 +290,61 @@ static int sp_automatic_cmdcheck(uint8_t cmd)
 static int sp_docommand(uint8_t command, uint32_t parmlen,
 			uint8_t *params, uint32_t retlen, void *retparms)
 {
-	unsigned char c;
 	if (sp_automatic_cmdcheck(command))
 		return 1;
-	if (serialport_write(&command, 1) != 0) {
+	if (sp_send(&command, 1) != 0) {
 		msg_perr("Error: cannot write op code: %s\n", strerror(errno));
 		return 1;
 	}
-	if (serialport_write(params, parmlen) != 0) {
+	if (sp_send(params, parmlen) != 0) {
 		msg_perr("Error: cannot write parameters: %s\n", strerror(errno));
 		return 1;
 	}
-	if (serialport_read(&c, 1) != 0) {
-		msg_perr("Error: cannot read from device: %s\n", strerror(errno));
-		return 1;
-	}
-	if (c == S_NAK)
-		return 1;
-	if (c != S_ACK) {
-		msg_perr("Error: invalid response 0x%02X from device\n", c);
-		return 1;
-	}
-	if (retlen) {
-		if (serialport_read(retparms, retlen) != 0) {
-			msg_perr("Error: cannot read return parameters: %s\n", strerror(errno));
-			return 1;
-		}
-	}
-	return 0;
+	return sp_read_reply(retlen, retparms);
 }
 
+/* The stream is over afterwards even if it failed, the caller may go on without it. */
 static int sp_flush_stream(void)
 {
-	if (sp_streamed_transmit_ops)
-		do {
-			unsigned char c;
-			if (serialport_read(&c, 1) != 0) {
-				msg_perr("Error: cannot read from device (flushing stream)");
-				return 1;
-			}
-			if (c == S_NAK) {
-				msg_perr("Error: NAK to a stream buffer operation\n");
-				return 1;
-			}
-			if (c != S_ACK) {
-				msg_perr("Error: Invalid reply 0x%02X from device\n", c);
-				return 1;
-			}
-		} while (--sp_streamed_transmit_ops);
+	int ret = 0;
+
+	if (sp_send_flush() != 0) {
+		msg_perr("Error: cannot write command stream\n");
+		ret = 1;
+	}
+	for (; !ret && sp_streamed_transmit_ops; sp_streamed_transmit_ops--) {
+		unsigned char c;
+		if (serialport_read(&c, 1) != 0) {
+			msg_perr("Error: cannot read from device (flushing stream)");
+			ret = 1;
+		} else if (c == S_NAK) {
+			msg_perr("Error: NAK to a stream buffer operation\n");
+			ret = 1;
+		} else if (c != S_ACK) {
+			msg_perr("Error: Invalid reply 0x%02X from device\n", c);
+			ret = 1;
+		}
+	}
 	sp_streamed_transmit_ops = 0;
 	sp_streamed_transmit_bytes = 0;
-	return 0;
+	return ret;
 }
 
 static int sp_stream_buffer_op(uint8_t cmd, uint32_t parmlen, uint8_t *parms)
 {
-	uint8_t *sp;
 	if (sp_automatic_cmdcheck(cmd))
 		return 1;
 
-	sp = malloc(1 + parmlen);
-	if (!sp) {
-		msg_perr("Error: cannot malloc command buffer\n");
-		return 1;
-	}
-	sp[0] = cmd;
-	memcpy(&(sp[1]), parms, parmlen);
-
 	if (sp_streamed_transmit_bytes >= (1 + parmlen + sp_device_serbuf_size)) {
-		if (sp_flush_stream() != 0) {
-			free(sp);
+		if (sp_flush_stream() != 0)
 			return 1;
-		}
 	}
-	if (serialport_write(sp, 1 + parmlen) != 0) {
+	if (sp_send(&cmd, 1) != 0 || sp_send(parms, parmlen) != 0) {
 		msg_perr("Error: cannot write command\n");
-		free(sp);
 		return 1;
 	}
 	sp_streamed_transmit_ops += 1;
 	sp_streamed_transmit_bytes += 1 + parmlen;
-
-	free(sp);
 	return 0;
 }
 
@@ -303,25 +352,32 @@ static int serprog_spi_send_command(struct flashctx *flash,
 				    unsigned int writecnt, unsigned int readcnt,
 				    const unsigned char *writearr,
 				    unsigned char *readarr);
-static int serprog_spi_read(struct flashctx *flash, uint8_t *buf,
-			    unsigned int start, unsigned int len);
+static int serprog_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds);
+static int serprog_spi_checksum(struct flashctx *flash, unsigned int start,
+				unsigned int len, uint32_t *crc);
+static int serprog_spi_queue(struct flashctx *flash, const struct spi_queued_op *ops, unsigned int count);
 static struct spi_master spi_master_serprog = {
 	.type		= SPI_CONTROLLER_SERPROG,
 	.max_data_read	= MAX_DATA_READ_UNLIMITED,
 	.max_data_write	= MAX_DATA_WRITE_UNLIMITED,
 	.command	= serprog_spi_send_command,
-	.multicommand	= default_spi_send_multicommand,
-	.read		= serprog_spi_read,
+	.multicommand	= serprog_spi_send_multicommand,
+	.gather		= true,
+	.read		= default_spi_read,
 	.write_256	= default_spi_write_256,
 	.write_aai	= default_spi_write_aai,
+	.queue		= serprog_spi_queue,
 };
 
 static void serprog_chip_writeb(const struct flashctx *flash, uint8_t val,
 				chipaddr addr);
+static void serprog_chip_writen(const struct flashctx *flash, const uint8_t *buf,
+				chipaddr addr, size_t len);
 static uint8_t serprog_chip_readb(const struct flashctx *flash,
 				  const chipaddr addr);
 static void serprog_chip_readn(const struct flashctx *flash, uint8_t *buf,
 			       const chipaddr addr, size_t len);
+static int serprog_wait_toggle(const struct flashctx *flash, chipaddr addr, unsigned int delay, uint8_t *val);
 static const struct par_master par_master_serprog = {
 		.chip_readb		= serprog_chip_readb,
 		.chip_readw		= fallback_chip_readw,
@@ -330,11 +386,46 @@ static const struct par_master par_master_serprog = {
 		.chip_writeb		= serprog_chip_writeb,
 		.chip_writew		= fallback_chip_writew,
 		.chip_writel		= fallback_chip_writel,
-		.chip_writen		= fallback_chip_writen,
+		.chip_writen		= serprog_chip_writen,
+		.wait_toggle		= serprog_wait_toggle,
 };
 
 static enum chipbustype serprog_buses_supported = BUS_NONE;
 
+/* Ask for an SPI clock of @f_spi_req Hz. Returns 0 if the programmer took it. */
+static int sp_set_spi_freq(uint32_t f_spi_req)
+{
+	uint32_t f_spi;
+	uint8_t buf[4];
+
+	buf[0] = (f_spi_req >> (0 * 8)) & 0xFF;
+	buf[1] = (f_spi_req >> (1 * 8)) & 0xFF;
+	buf[2] = (f_spi_req >> (2 * 8)) & 0xFF;
+	buf[3] = (f_spi_req >> (3 * 8)) & 0xFF;
+
+	if (sp_docommand(S_CMD_S_SPI_FREQ, 4, buf, 4, buf)) {
+		msg_pwarn(MSGHEADER "Setting SPI clock rate to %u Hz failed!\n", f_spi_req);
+		return 1;
+	}
+	f_spi = buf[0];
+	f_spi |= buf[1] << (1 * 8);
+	f_spi |= buf[2] << (2 * 8);
+	f_spi |= buf[3] << (3 * 8);
+	msg_pdbg(MSGHEADER "Requested to set SPI clock frequency to %u Hz. "
+		 "It was actually set to %u Hz\n", f_spi_req, f_spi);
+	return 0;
+}
+
+/* Clock rates tried by spispeed=auto. The programmer picks the closest one it can do. */
+static const unsigned int serprog_speeds_khz[] = {
+	100, 250, 500, 1000, 2000, 4000, 8000, 12000, 16000, 24000, 32000, 0
+};
+
+static int serprog_set_spi_speed(unsigned int khz)
+{
+	return sp_set_spi_freq(khz * 1000);
+}
+
 int serprog_init(void)
 {
 	uint16_t iface;
@@ -342,6 +433,9 @@ int serprog_init(void)
 	unsigned char rbuf[3];
 	unsigned char c;
 	char *device;
+	/* The device path or host and port, for the spispeed=auto cache. */
+	char devid[200] = "";
+	bool autospeed = false;
 	int have_device = 0;
 
 	/* the parameter is either of format "dev=/dev/device[:baud]" or "ip=ip:port" */
@@ -368,6 +462,7 @@ int serprog_init(void)
 				free(device);
 				return 1;
 			}
+			snprintf(devid, sizeof(devid), "%s", device);
 			have_device++;
 		}
 	}
@@ -407,6 +502,7 @@ int serprog_init(void)
 				free(device);
 				return 1;
 			}
+			snprintf(devid, sizeof(devid), "%s:%s", device, port);
 			have_device++;
 		}
 	}
@@ -512,10 +608,26 @@ int serprog_init(void)
 			spi_master_serprog.max_data_read = v;
 			msg_pdbg(MSGHEADER "Maximum read-n length is %d\n", v);
 		}
+		if (sp_check_commandavail(S_CMD_O_SPI_PROGRAM)) {
+			/* sp_offload() merges page programs up to max_data_write. */
+			spi_master_serprog.max_bulk_write = spi_master_serprog.max_data_write;
+			msg_pdbg(MSGHEADER "Programmer can program several pages at once\n");
+		}
+		if (sp_check_commandavail(S_CMD_R_CRC32)) {
+			spi_master_serprog.checksum = serprog_spi_checksum;
+			msg_pdbg(MSGHEADER "Programmer can calculate checksums\n");
+		}
 		spispeed = extract_programmer_param("spispeed");
-		if (spispeed && strlen(spispeed)) {
-			uint32_t f_spi_req, f_spi;
-			uint8_t buf[4];
+		if (spispeed && !strcmp(spispeed, "auto")) {
+			if (sp_check_commandavail(S_CMD_S_SPI_FREQ) == 0) {
+				msg_pwarn(MSGHEADER "Warning: Setting the SPI clock rate is not supported!\n");
+			} else {
+				spi_master_serprog.speeds_khz = serprog_speeds_khz;
+				spi_master_serprog.set_speed = serprog_set_spi_speed;
+				autospeed = true;
+			}
+		} else if (spispeed && strlen(spispeed)) {
+			uint32_t f_spi_req;
 			char *f_spi_suffix;
 
 			errno = 0;
@@ -541,22 +653,10 @@ int serprog_init(void)
 				return 1;
 			}
 
-			buf[0] = (f_spi_req >> (0 * 8)) & 0xFF;
-			buf[1] = (f_spi_req >> (1 * 8)) & 0xFF;
-			buf[2] = (f_spi_req >> (2 * 8)) & 0xFF;
-			buf[3] = (f_spi_req >> (3 * 8)) & 0xFF;
-
 			if (sp_check_commandavail(S_CMD_S_SPI_FREQ) == 0)
 				msg_pwarn(MSGHEADER "Warning: Setting the SPI clock rate is not supported!\n");
-			else if (sp_docommand(S_CMD_S_SPI_FREQ, 4, buf, 4, buf) == 0) {
-				f_spi = buf[0];
-				f_spi |= buf[1] << (1 * 8);
-				f_spi |= buf[2] << (2 * 8);
-				f_spi |= buf[3] << (3 * 8);
-				msg_pdbg(MSGHEADER "Requested to set SPI clock frequency to %u Hz. "
-					 "It was actually set to %u Hz\n", f_spi_req, f_spi);
-			} else
-				msg_pwarn(MSGHEADER "Setting SPI clock rate to %u Hz failed!\n", f_spi_req);
+			else
+				sp_set_spi_freq(f_spi_req);
 		}
 		free(spispeed);
 		bt = serprog_buses_supported;
@@ -594,6 +694,8 @@ int serprog_init(void)
 				 "write byte not supported\n");
 			return 1;
 		}
+		sp_toggle_poll = sp_check_commandavail(S_CMD_R_TOGGLE);
+		msg_pdbg(MSGHEADER "Toggle bit polling %s\n", sp_toggle_poll ? "on the programmer" : "by the host");
 
 		if (sp_docommand(S_CMD_Q_WRNMAXLEN, 0, NULL, 3, rbuf)) {
 			msg_pdbg(MSGHEADER "Write-n not supported");
@@ -637,6 +739,12 @@ int serprog_init(void)
 	}
 	pgmname[16] = 0;
 	msg_pinfo(MSGHEADER "Programmer name is \"%s\"\n", pgmname);
+	if (autospeed) {
+		char instance[256];
+		snprintf(instance, sizeof(instance), "serprog:%s:%s", pgmname, devid);
+		if (spi_request_autospeed(instance))
+			return 1;
+	}
 
 	if (sp_docommand(S_CMD_Q_SERBUF, 0, NULL, 2, &sp_device_serbuf_size)) {
 		msg_pwarn("Warning: NAK to query serial buffer size\n");
@@ -678,6 +786,8 @@ int serprog_init(void)
 	sp_streamed_transmit_ops = 0;
 	sp_streamed_transmit_bytes = 0;
 	sp_opbuf_usage = 0;
+	if (sp_send_flush() != 0)
+		return 1;
 	if (serprog_buses_supported & BUS_SPI)
 		register_spi_master(&spi_master_serprog);
 	if (serprog_buses_supported & BUS_NONSPI)
@@ -714,11 +824,11 @@ static int sp_pass_writen(void)
 	header[4] = (sp_write_n_addr >> 0) & 0xFF;
 	header[5] = (sp_write_n_addr >> 8) & 0xFF;
 	header[6] = (sp_write_n_addr >> 16) & 0xFF;
-	if (serialport_write(header, 7) != 0) {
+	if (sp_send(header, 7) != 0) {
 		msg_perr(MSGHEADER "Error: cannot write write-n command\n");
 		return 1;
 	}
-	if (serialport_write(sp_write_n_buf, sp_write_n_bytes) != 0) {
+	if (sp_send(sp_write_n_buf, sp_write_n_bytes) != 0) {
 		msg_perr(MSGHEADER "Error: cannot write write-n data");
 		return 1;
 	}
@@ -770,6 +880,8 @@ static int serprog_shutdown(void *data)
 		else
 			msg_pwarn(MSGHEADER "%s: Warning: could not disable output buffers\n", __func__);
 	}
+	if (sp_send_flush() != 0)
+		msg_pwarn(MSGHEADER "%s: Warning: could not write the remaining commands\n", __func__);
 	/* FIXME: fix sockets on windows(?), especially closing */
 	serialport_shutdown(&sp_fd);
 	if (sp_max_write_n)
@@ -820,6 +932,37 @@ static void serprog_chip_writeb(const struct flashctx *flash, uint8_t val,
 	}
 }
 
+/* Append consecutive bytes to the write-n buffer in one go instead of byte by byte. */
+static void serprog_chip_writen(const struct flashctx *flash, const uint8_t *buf,
+				chipaddr addr, size_t len)
+{
+	size_t n;
+
+	msg_pspew("%s: addr=0x%" PRIxPTR " len=%zu\n", __func__, addr, len);
+	if (!sp_max_write_n) {
+		fallback_chip_writen(flash, buf, addr, len);
+		return;
+	}
+	while (len) {
+		if (!sp_prev_was_write || addr != sp_write_n_addr + sp_write_n_bytes) {
+			if (sp_prev_was_write && sp_write_n_bytes)
+				sp_pass_writen();
+			sp_prev_was_write = 1;
+			sp_write_n_addr = addr;
+			sp_write_n_bytes = 0;
+		}
+		n = min(len, sp_max_write_n - sp_write_n_bytes);
+		memcpy(sp_write_n_buf + sp_write_n_bytes, buf, n);
+		sp_write_n_bytes += n;
+		sp_check_opbuf_usage(7 + sp_write_n_bytes);
+		if (sp_write_n_bytes >= sp_max_write_n)
+			sp_pass_writen();
+		buf += n;
+		addr += n;
+		len -= n;
+	}
+}
+
 static uint8_t serprog_chip_readb(const struct flashctx *flash,
 				  const chipaddr addr)
 {
@@ -840,43 +983,96 @@ static uint8_t serprog_chip_readb(const struct flashctx *flash,
 	return c;
 }
 
-/* Local version that really does the job, doesn't care of max_read_n. */
-static int sp_do_read_n(uint8_t * buf, const chipaddr addr, size_t len)
+/*
+ * Toggle bit polling after a program or erase, done by the programmer. The operation buffer is executed
+ * in the same stream, so waiting for a write takes a single round trip instead of one per read.
+ */
+static int serprog_wait_toggle(const struct flashctx *flash, chipaddr addr, unsigned int delay, uint8_t *val)
 {
-	unsigned char sbuf[6];
-	msg_pspew("%s: addr=0x%" PRIxPTR " len=%zu\n", __func__, addr, len);
-	/* Stream the read-n -- as above. */
+	unsigned char buf[6];
+
+	if (!sp_toggle_poll || delay > 0xffffff)
+		return 1;
 	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes))
 		sp_execute_opbuf_noflush();
-	sbuf[0] = ((addr >> 0) & 0xFF);
-	sbuf[1] = ((addr >> 8) & 0xFF);
-	sbuf[2] = ((addr >> 16) & 0xFF);
-	sbuf[3] = ((len >> 0) & 0xFF);
-	sbuf[4] = ((len >> 8) & 0xFF);
-	sbuf[5] = ((len >> 16) & 0xFF);
-	sp_stream_buffer_op(S_CMD_R_NBYTES, 6, sbuf);
-	if (sp_flush_stream() != 0)
+	buf[0] = ((addr >> 0) & 0xFF);
+	buf[1] = ((addr >> 8) & 0xFF);
+	buf[2] = ((addr >> 16) & 0xFF);
+	buf[3] = ((delay >> 0) & 0xFF);
+	buf[4] = ((delay >> 8) & 0xFF);
+	buf[5] = ((delay >> 16) & 0xFF);
+	if (sp_stream_buffer_op(S_CMD_R_TOGGLE, 6, buf) != 0 || sp_flush_stream() != 0) {
+		/* The host polls from now on, jedec.c falls back to that right away. */
+		sp_toggle_poll = false;
 		return 1;
-	if (serialport_read(buf, len) != 0) {
-		msg_perr(MSGHEADER "Error: cannot read read-n data");
+	}
+	if (serialport_read(val, 1) != 0) {
+		msg_perr(MSGHEADER "Error: cannot read toggle poll result\n");
 		return 1;
 	}
+	msg_pspew("%s addr=0x%" PRIxPTR " returning 0x%02X\n", __func__, addr, *val);
 	return 0;
 }
 
-/* The externally called version that makes sure that max_read_n is obeyed. */
+/* Frame an S_CMD_R_NBYTES into the send buffer. Its reply is ACK + @len bytes. */
+static int sp_send_read_n(const chipaddr addr, size_t len)
+{
+	unsigned char sbuf[7];
+
+	sbuf[0] = S_CMD_R_NBYTES;
+	sbuf[1] = ((addr >> 0) & 0xFF);
+	sbuf[2] = ((addr >> 8) & 0xFF);
+	sbuf[3] = ((addr >> 16) & 0xFF);
+	sbuf[4] = ((len >> 0) & 0xFF);
+	sbuf[5] = ((len >> 8) & 0xFF);
+	sbuf[6] = ((len >> 16) & 0xFF);
+	if (sp_send(sbuf, sizeof(sbuf)) != 0) {
+		msg_perr(MSGHEADER "Error: cannot write read-n command: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/* The externally called version that makes sure that max_read_n is obeyed. The read is split into read-n
+ * requests and as many of them as fit into the device's serial buffer are kept in flight, so a large read
+ * isn't limited to one request per round trip. */
 static void serprog_chip_readn(const struct flashctx *flash, uint8_t * buf,
 			       const chipaddr addr, size_t len)
 {
-	size_t lenm = len;
-	chipaddr addrm = addr;
-	while ((sp_max_read_n != 0) && (lenm > sp_max_read_n)) {
-		sp_do_read_n(&(buf[addrm-addr]), addrm, sp_max_read_n); // FIXME: return error
-		addrm += sp_max_read_n;
-		lenm -= sp_max_read_n;
+	const size_t max_read = sp_max_read_n ? sp_max_read_n : (1 << 24) - 1;
+	size_t sent = 0, done = 0, n;
+	unsigned int outstanding = 0;
+	int failed = 0;
+
+	msg_pspew("%s: addr=0x%" PRIxPTR " len=%zu\n", __func__, addr, len);
+	if (sp_automatic_cmdcheck(S_CMD_R_NBYTES))
+		return;
+	/* Operations still in the buffer are acked before any read data arrives. */
+	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes))
+		sp_execute_opbuf_noflush(); // FIXME: return error
+	if (sp_flush_stream() != 0)
+		return;
+	while (done < len) {
+		while (!failed && sent < len && (!outstanding || outstanding + 7 <= sp_device_serbuf_size)) {
+			n = min(max_read, len - sent);
+			if (sp_send_read_n(addr + sent, n) != 0) {
+				failed = 1;
+				break;
+			}
+			outstanding += 7;
+			sent += n;
+		}
+		if (done == sent)
+			break;
+		n = min(max_read, len - done);
+		/* Keep reading the replies after an error, so the stream stays in sync. */
+		if (sp_read_reply(n, buf + done) != 0) {
+			msg_perr(MSGHEADER "Error: cannot read read-n data\n"); // FIXME: return error
+			failed = 1;
+		}
+		outstanding -= 7;
+		done += n;
 	}
-	if (lenm)
-		sp_do_read_n(&(buf[addrm-addr]), addrm, lenm); // FIXME: return error
 }
 
 void serprog_delay(unsigned int usecs)
@@ -900,58 +1096,304 @@ void serprog_delay(unsigned int usecs)
 	sp_prev_was_write = 0;
 }
 
+/* Send what @cmd writes, skipping the first @skip bytes. */
+static int sp_send_cmd_bytes(const struct spi_command *cmd, unsigned int skip)
+{
+	if (skip < cmd->writecnt && sp_send(cmd->writearr + skip, cmd->writecnt - skip) != 0)
+		return 1;
+	skip = skip > cmd->writecnt ? skip - cmd->writecnt : 0;
+	if (skip < cmd->datacnt && sp_send(cmd->data + skip, cmd->datacnt - skip) != 0)
+		return 1;
+	return 0;
+}
+
+/* Frame an S_CMD_O_SPIOP into the send buffer. Its reply is ACK + readcnt bytes. */
+static int sp_send_spiop(const struct spi_command *cmd)
+{
+	const unsigned int writecnt = cmd->writecnt + cmd->datacnt, readcnt = cmd->readcnt;
+	unsigned char header[7];
+
+	header[0] = S_CMD_O_SPIOP;
+	header[1] = (writecnt >> 0) & 0xFF;
+	header[2] = (writecnt >> 8) & 0xFF;
+	header[3] = (writecnt >> 16) & 0xFF;
+	header[4] = (readcnt >> 0) & 0xFF;
+	header[5] = (readcnt >> 8) & 0xFF;
+	header[6] = (readcnt >> 16) & 0xFF;
+	if (sp_send(header, sizeof(header)) != 0 || sp_send_cmd_bytes(cmd, 0) != 0) {
+		msg_perr("Error: cannot write SPI operation: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/* Execute a pending parallel operation buffer before SPI commands are sent. */
+static int sp_prepare_spiop(void)
+{
+	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes)) {
+		if (sp_execute_opbuf() != 0) {
+			msg_perr("Error: could not execute command buffer before sending SPI commands.\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
 static int serprog_spi_send_command(struct flashctx *flash,
 				    unsigned int writecnt, unsigned int readcnt,
 				    const unsigned char *writearr,
 				    unsigned char *readarr)
 {
-	unsigned char *parmbuf;
-	int ret;
+	const struct spi_command cmd = { writecnt, readcnt, writearr, readarr };
+
 	msg_pspew("%s, writecnt=%i, readcnt=%i\n", __func__, writecnt, readcnt);
-	if ((sp_opbuf_usage) || (sp_max_write_n && sp_write_n_bytes)) {
-		if (sp_execute_opbuf() != 0) {
-			msg_perr("Error: could not execute command buffer before sending SPI commands.\n");
-			return 1;
+	if (sp_prepare_spiop() != 0)
+		return 1;
+	if (sp_automatic_cmdcheck(S_CMD_O_SPIOP))
+		return 1;
+	if (sp_send_spiop(&cmd) != 0)
+		return 1;
+	return sp_read_reply(readcnt, readarr);
+}
+
+/* Bytes an S_CMD_O_SPIOP request for @op occupies in the device's serial buffer. */
+static unsigned int sp_spiop_len(const struct spi_queued_op *op)
+{
+	return 7 + op->cmd.writecnt + op->cmd.datacnt;
+}
+
+/* Does @ops start with WREN, a write-only command and a poll for the status register bits in mask to clear?
+ * Returns the length of the command in the middle, 0 if there is no such sequence.
+ */
+static unsigned int sp_wren_cmd_poll(const struct spi_queued_op *ops, unsigned int count)
+{
+	if (count < 3 || ops[0].poll || ops[1].poll || !ops[2].poll || ops[2].value)
+		return 0;
+	if (ops[0].cmd.writecnt != JEDEC_WREN_OUTSIZE || ops[0].cmd.readcnt || ops[0].cmd.writearr[0] != JEDEC_WREN)
+		return 0;
+	if (!ops[1].cmd.writecnt || ops[1].cmd.readcnt)
+		return 0;
+	return ops[1].cmd.writecnt + ops[1].cmd.datacnt;
+}
+
+/* Address length of the page program in @ops, 0 if it isn't one. */
+static unsigned int sp_program_addrlen(struct flashctx *flash, const struct spi_queued_op *ops, unsigned int count)
+{
+	unsigned int len = sp_wren_cmd_poll(ops, count);
+	unsigned int addrlen;
+
+	if (!len || !sp_check_commandavail(S_CMD_O_SPI_PROGRAM))
+		return 0;
+	if (ops[1].cmd.writearr[0] == JEDEC_BYTE_PROGRAM_4BA)
+		addrlen = 4;
+	else if (ops[1].cmd.writearr[0] == JEDEC_BYTE_PROGRAM)
+		addrlen = flash->in_4ba_mode ? 4 : 3;
+	else
+		return 0;
+	/* The address has to be in writearr, the data may follow separately. */
+	return len > 1 + addrlen && ops[1].cmd.writecnt >= 1 + addrlen ? addrlen : 0;
+}
+
+static uint32_t sp_program_addr(const struct spi_queued_op *op, unsigned int addrlen)
+{
+	uint32_t addr = 0;
+	unsigned int i;
+
+	for (i = 0; i < addrlen; i++)
+		addr = addr << 8 | op->cmd.writearr[1 + i];
+	return addr;
+}
+
+/* Length of the erase command in @ops, 0 if it isn't one. Erase commands come with no, a 3 byte or a 4 byte
+ * address. */
+static unsigned int sp_erase_len(const struct spi_queued_op *ops, unsigned int count)
+{
+	unsigned int len = sp_wren_cmd_poll(ops, count);
+
+	if ((len != 1 && len != 4 && len != 5) || ops[1].cmd.datacnt)
+		return 0;
+	return sp_check_commandavail(S_CMD_O_SPI_ERASE) ? len : 0;
+}
+
+static bool sp_can_offload(struct flashctx *flash, const struct spi_queued_op *ops, unsigned int count)
+{
+	return sp_program_addrlen(flash, ops, count) || sp_erase_len(ops, count);
+}
+
+/*
+ * Hand a sequence of queued page programs (or a single erase) with their status polls to the programmer with
+ * S_CMD_O_SPI_PROGRAM (S_CMD_O_SPI_ERASE), so they take a single round trip instead of one per page.
+ * Returns the number of ops done, 0 if @ops doesn't start with something the programmer can do, -1 on errors.
+ */
+/*
+ * Longest header sp_offload() builds: S_CMD_O_SPI_PROGRAM, the address length, the opcode with a 4-byte
+ * address, 3 bytes of data length, 2 bytes of page size and the WIP mask. Erase headers are shorter.
+ */
+#define SP_OFFLOAD_HEADER_MAX	(1 + 1 + 1 + 4 + 3 + 2 + 1)
+
+static int sp_offload(struct flashctx *flash, const struct spi_queued_op *ops, unsigned int count)
+{
+	const unsigned int page_size = flash->chip->page_size;
+	unsigned char header[SP_OFFLOAD_HEADER_MAX];
+	unsigned int addrlen, datalen, total, n, i;
+	uint32_t addr;
+
+	addrlen = sp_program_addrlen(flash, ops, count);
+	if (addrlen) {
+		/* Merge contiguous pages written with the same opcode, as long as every one but the last ends
+		 * on a page boundary, so the programmer splits the data exactly like we did. */
+		addr = sp_program_addr(&ops[0], addrlen);
+		total = ops[1].cmd.writecnt + ops[1].cmd.datacnt - 1 - addrlen;
+		n = 3;
+		if (page_size && page_size <= 0x8000 && !(page_size & (page_size - 1))) {
+			while (sp_program_addrlen(flash, &ops[n], count - n) == addrlen &&
+			       ops[n + 1].cmd.writearr[0] == ops[1].cmd.writearr[0] &&
+			       ops[n + 2].mask == ops[2].mask &&
+			       sp_program_addr(&ops[n], addrlen) == addr + total &&
+			       (addr + total) % page_size == 0) {
+				datalen = ops[n + 1].cmd.writecnt + ops[n + 1].cmd.datacnt - 1 - addrlen;
+				if (total + datalen > spi_master_serprog.max_data_write)
+					break;
+				total += datalen;
+				n += 3;
+			}
 		}
+		msg_pspew("%s: programming %u bytes at 0x%06x\n", __func__, total, addr);
+		i = 0;
+		header[i++] = S_CMD_O_SPI_PROGRAM;
+		header[i++] = addrlen;
+		memcpy(&header[i], ops[1].cmd.writearr, 1 + addrlen);
+		i += 1 + addrlen;
+		header[i++] = (total >> 0) & 0xFF;
+		header[i++] = (total >> 8) & 0xFF;
+		header[i++] = (total >> 16) & 0xFF;
+		/* A page size of 0 asks for a single page program. */
+		header[i++] = (n > 3 ? page_size >> 0 : 0) & 0xFF;
+		header[i++] = (n > 3 ? page_size >> 8 : 0) & 0xFF;
+		header[i++] = ops[2].mask;
+		if (sp_send(header, i) != 0)
+			goto write_error;
+		for (i = 0; i < n; i += 3) {
+			if (sp_send_cmd_bytes(&ops[i + 1].cmd, 1 + addrlen) != 0)
+				goto write_error;
+		}
+	} else {
+		datalen = sp_erase_len(ops, count);
+		if (!datalen)
+			return 0;
+		msg_pspew("%s: erase command 0x%02x\n", __func__, ops[1].cmd.writearr[0]);
+		n = 3;
+		header[0] = S_CMD_O_SPI_ERASE;
+		header[1] = datalen - 1;
+		memcpy(&header[2], ops[1].cmd.writearr, datalen);
+		header[2 + datalen] = ops[2].mask;
+		if (sp_send(header, 3 + datalen) != 0)
+			goto write_error;
 	}
+	if (sp_read_reply(0, NULL) != 0)
+		return -1;
+	return n;
 
-	parmbuf = malloc(writecnt + 6);
-	if (!parmbuf) {
-		msg_perr("Error: could not allocate SPI send param buffer.\n");
+write_error:
+	msg_perr("Error: cannot write SPI operation: %s\n", strerror(errno));
+	return -1;
+}
+
+/*
+ * Send a batch of SPI commands. The requests are framed into a few large writes and several of them are kept
+ * outstanding (as many as fit into the device's serial buffer), their replies are read as the window moves
+ * on. Status polls (and plain delays) have to see the commands before them done, so they are run (from the
+ * host) once all replies up to them have been read. Programmers that can program and erase on their own get
+ * those sequences (polls included) in one go instead, see sp_offload().
+ */
+static int serprog_spi_queue(struct flashctx *flash, const struct spi_queued_op *ops, unsigned int count)
+{
+	unsigned int sent = 0, done = 0, outstanding = 0;
+	int ret = 0, n;
+
+	if (sp_prepare_spiop() != 0)
 		return 1;
+	if (sp_automatic_cmdcheck(S_CMD_O_SPIOP))
+		return 1;
+
+	while (done < count) {
+		/* Always allow one request, even if it is bigger than the serial buffer. */
+		while (!ret && sent < count && !ops[sent].poll && !sp_can_offload(flash, &ops[sent], count - sent) &&
+		       (!outstanding || outstanding + sp_spiop_len(&ops[sent]) <= sp_device_serbuf_size)) {
+			if (sp_send_spiop(&ops[sent].cmd)) {
+				ret = 1;
+				break;
+			}
+			outstanding += sp_spiop_len(&ops[sent]);
+			sent++;
+		}
+		if (done < sent) {
+			/* Read all replies even after an error, so the stream stays in sync. */
+			if (sp_read_reply(ops[done].cmd.readcnt, ops[done].cmd.readarr) != 0)
+				ret = 1;
+			outstanding -= sp_spiop_len(&ops[done]);
+			done++;
+			continue;
+		}
+		if (ret)
+			break;
+		if (!ops[done].poll) {
+			n = sp_offload(flash, &ops[done], count - done);
+			if (n <= 0)
+				return 1;
+			sent += n;
+			done += n;
+			continue;
+		}
+		if (ops[done].mask)
+			spi_poll_status_register(flash, ops[done].mask, ops[done].value, ops[done].expected_us,
+						 ops[done].max_step_us);
+		else
+			programmer_delay(ops[done].expected_us);
+		sent++;
+		done++;
 	}
-	parmbuf[0] = (writecnt >> 0) & 0xFF;
-	parmbuf[1] = (writecnt >> 8) & 0xFF;
-	parmbuf[2] = (writecnt >> 16) & 0xFF;
-	parmbuf[3] = (readcnt >> 0) & 0xFF;
-	parmbuf[4] = (readcnt >> 8) & 0xFF;
-	parmbuf[5] = (readcnt >> 16) & 0xFF;
-	memcpy(parmbuf + 6, writearr, writecnt);
-	ret = sp_docommand(S_CMD_O_SPIOP, writecnt + 6, parmbuf, readcnt,
-			   readarr);
-	free(parmbuf);
 	return ret;
 }
 
-/* FIXME: This function is optimized so that it does not split each transaction
- * into chip page_size long blocks unnecessarily like spi_read_chunked. This has
- * the advantage that it is much faster for most chips, but breaks those with
- * non-continuous reads. When spi_read_chunked is fixed this method can be removed. */
-static int serprog_spi_read(struct flashctx *flash, uint8_t *buf,
-			    unsigned int start, unsigned int len)
+static int serprog_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds)
 {
-	unsigned int i, cur_len;
-	const unsigned int max_read = spi_master_serprog.max_data_read;
-	for (i = 0; i < len; i += cur_len) {
-		int ret;
-		cur_len = min(max_read, (len - i));
-		ret = spi_nbyte_read(flash, start + i, buf + i, cur_len);
-		if (ret)
-			return ret;
+	struct spi_queued_op ops[8];
+	unsigned int n;
+
+	/* Short sequences (like WREN and a write) are sent back to back. */
+	while (cmds->writecnt || cmds->readcnt) {
+		memset(ops, 0, sizeof(ops));
+		for (n = 0; n < ARRAY_SIZE(ops) && (cmds->writecnt || cmds->readcnt); n++)
+			ops[n].cmd = *cmds++;
+		if (serprog_spi_queue(flash, ops, n))
+			return 1;
 	}
 	return 0;
 }
 
+/* Let the programmer read the range and return its CRC-32 instead of the data. */
+static int serprog_spi_checksum(struct flashctx *flash, unsigned int start,
+				unsigned int len, uint32_t *crc)
+{
+	unsigned char buf[6];
+	unsigned char rbuf[4];
+
+	if (sp_prepare_spiop() != 0)
+		return 1;
+
+	buf[0] = (start >> 0) & 0xFF;
+	buf[1] = (start >> 8) & 0xFF;
+	buf[2] = (start >> 16) & 0xFF;
+	buf[3] = (len >> 0) & 0xFF;
+	buf[4] = (len >> 8) & 0xFF;
+	buf[5] = (len >> 16) & 0xFF;
+	if (sp_docommand(S_CMD_R_CRC32, 6, buf, 4, rbuf))
+		return 1;
+	*crc = rbuf[0] | rbuf[1] << 8 | rbuf[2] << 16 | (uint32_t)rbuf[3] << 24;
+	return 0;
+}
+
 void *serprog_map(const char *descr, uintptr_t phys_addr, size_t len)
 {
 	/* Serprog transmits 24 bits only and assumes the underlying implementation handles any remaining bits
@@ -23,3 +23,7 @@
 #define S_CMD_O_SPIOP		0x13	/* Perform SPI operation.			*/
 #define S_CMD_S_SPI_FREQ	0x14	/* Set SPI clock frequency			*/
 #define S_CMD_S_PIN_STATE	0x15	/* Enable/disable output drivers		*/
+#define S_CMD_R_CRC32		0x16	/* Calculate CRC-32 of n bytes			*/
+#define S_CMD_O_SPI_PROGRAM	0x17	/* Program SPI pages and wait for completion	*/
+#define S_CMD_O_SPI_ERASE	0x18	/* Erase SPI block and wait for completion	*/
+#define S_CMD_R_TOGGLE		0x19	/* Read a byte until its toggle bit is stable	*/
@@ -26,7 +26,7 @@
 
 static int spi_sfdp_read_sfdp_chunk(struct flashctx *flash, uint32_t address, uint8_t *buf, int len)
 {
-	int i, ret;
+	int ret;
 	uint8_t *newbuf;
 	const unsigned char cmd[JEDEC_SFDP_OUTSIZE] = {
 		JEDEC_SFDP,
@@ -48,8 +48,7 @@ static int spi_sfdp_read_sfdp_chunk(struct flashctx *flash, uint32_t address, ui
 	free(newbuf);
 	if (ret)
 		return ret;
-	for (i = 0; i < len; i++)
-		msg_cspew(" 0x%02x", buf[i]);
+	msg_hexdump(MSG_SPEW, buf, len);
 	msg_cspew("\n");
 	return 0;
 }
@@ -135,7 +134,7 @@ static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
 	int j;
 
 	msg_cdbg("Parsing JEDEC flash parameter table... ");
-	if (len != 9 * 4 && len != 4 * 4) {
+	if (len < 9 * 4 && len != 4 * 4) {
 		msg_cdbg("%s: len out of spec\n", __func__);
 		return 1;
 	}
@@ -214,11 +213,8 @@ static int sfdp_fill_flash(struct flashchip *chip, uint8_t *buf, uint16_t len)
 	total_size = ((tmp32 & 0x7FFFFFFF) + 1) / 8;
 	chip->total_size = total_size / 1024;
 	msg_cdbg2("  Flash chip size is %d kB.\n", chip->total_size);
-	if (total_size > (1 << 24)) {
-		msg_cdbg("Flash chip size is bigger than what 3-Byte addressing "
-			 "can access.\n");
-		return 1;
-	}
+	/* Whether chips bigger than what 3-Byte addressing can access are usable is decided once the
+	 * 4-Byte address support is known, see sfdp_tune_chip(). */
 
 	if (opcode_4k_erase != 0xFF)
 		sfdp_add_uniform_eraser(chip, opcode_4k_erase, 4 * 1024);
@@ -260,7 +256,173 @@ done:
 	return 0;
 }
 
-int probe_spi_sfdp(struct flashctx *flash)
+static uint32_t sfdp_dword(const uint8_t *buf, unsigned int n)
+{
+	return buf[4 * n] | buf[4 * n + 1] << 8 | buf[4 * n + 2] << 16 | (uint32_t)buf[4 * n + 3] << 24;
+}
+
+/* Does the fast read description at bit @shift of @dw use @opcode with @clocks mode and wait clocks? */
+static bool sfdp_read_mode_matches(uint32_t dw, unsigned int shift, uint8_t opcode, unsigned int clocks)
+{
+	return ((dw >> (shift + 8)) & 0xff) == opcode &&
+	       ((dw >> shift) & 0x1f) + ((dw >> (shift + 5)) & 0x7) == clocks;
+}
+
+/*
+ * Enable the multi-I/O reads the chip describes, if they are the ones spi_nbyte_read() knows about
+ * (same opcodes and number of mode and dummy clocks). Quad reads are only used if the chip has no
+ * Quad Enable bit that would have to be set first, which only JESD216B and later tables tell.
+ */
+static void sfdp_fill_read_modes(struct flashchip *chip, const uint8_t *buf, uint16_t len)
+{
+	const uint32_t dw1 = sfdp_dword(buf, 0);
+
+	if ((dw1 & (1 << 16)) && (dw1 & (1 << 20)) &&
+	    sfdp_read_mode_matches(sfdp_dword(buf, 3), 0, JEDEC_DOR, 8) &&
+	    sfdp_read_mode_matches(sfdp_dword(buf, 3), 16, JEDEC_DIOR, 4)) {
+		msg_cdbg2("  Dual output and dual I/O reads are supported.\n");
+		chip->feature_bits |= FEATURE_DUAL_READ;
+	}
+	if ((dw1 & (1 << 22)) && (dw1 & (1 << 21)) && len >= 15 * 4 &&
+	    ((sfdp_dword(buf, 14) >> 20) & 0x7) == 0 &&
+	    sfdp_read_mode_matches(sfdp_dword(buf, 2), 16, JEDEC_QOR, 8) &&
+	    sfdp_read_mode_matches(sfdp_dword(buf, 2), 0, JEDEC_QIOR, 6)) {
+		msg_cdbg2("  Quad output and quad I/O reads are supported.\n");
+		chip->feature_bits |= FEATURE_QUAD_READ;
+	}
+}
+
+/* Set the typical time of the eraser using @fn on blocks of @block_size, unless it is known already. */
+static void sfdp_set_erase_time(struct flashchip *chip, erasefunc_t *fn, uint32_t block_size, unsigned int ms)
+{
+	int k;
+
+	if (!fn)
+		return;
+	for (k = 0; k < NUM_ERASEFUNCTIONS; k++) {
+		struct block_eraser *eraser = &chip->block_erasers[k];
+		if (eraser->block_erase != fn || eraser->eraseblocks[0].size != block_size ||
+		    eraser->eraseblocks[1].size)
+			continue;
+		if (!eraser->typical_ms) {
+			msg_cdbg2("  Typical time of block eraser %d is %u ms.\n", k, ms);
+			eraser->typical_ms = ms;
+		}
+	}
+}
+
+/* Fill in the typical erase and program times JESD216A and later tables list, unless they are known. */
+static void sfdp_fill_timings(struct flashchip *chip, const uint8_t *buf, uint16_t len)
+{
+	static const unsigned int erase_units_ms[] = { 1, 16, 128, 1000 };
+	static const unsigned int chip_erase_units_ms[] = { 16, 256, 4000, 64000 };
+	uint32_t dw10, dw11, field;
+	uint8_t size;
+	int j;
+
+	if (len < 11 * 4)
+		return;
+	dw10 = sfdp_dword(buf, 9);
+	dw11 = sfdp_dword(buf, 10);
+
+	for (j = 0; j < 4; j++) {
+		size = buf[(4 * 7) + (j * 2)];
+		if (size == 0 || size >= 31)
+			continue;
+		field = (dw10 >> (4 + 7 * j)) & 0x7f;
+		sfdp_set_erase_time(chip, spi_get_erasefn_from_opcode(buf[(4 * 7) + (j * 2) + 1]), 1 << size,
+				    ((field & 0x1f) + 1) * erase_units_ms[field >> 5]);
+	}
+
+	field = (dw11 >> 24) & 0x7f;
+	sfdp_set_erase_time(chip, &spi_block_erase_60, chip->total_size * 1024,
+			    ((field & 0x1f) + 1) * chip_erase_units_ms[field >> 5]);
+	sfdp_set_erase_time(chip, &spi_block_erase_c7, chip->total_size * 1024,
+			    ((field & 0x1f) + 1) * chip_erase_units_ms[field >> 5]);
+
+	if (!chip->typical_program_us) {
+		field = (dw11 >> 8) & 0x3f;
+		chip->typical_program_us = ((field & 0x1f) + 1) * (field & 0x20 ? 64 : 8);
+		msg_cdbg2("  Typical page program time is %u us.\n", chip->typical_program_us);
+	}
+}
+
+/*
+ * Tell which 4-Byte address commands chips bigger than 16 MB support: EN4B from the BFPT of JESD216B and
+ * later, the native 4-Byte address commands from the 4-Byte Address Instruction Table @bait (NULL if the
+ * chip has none). Commands without a native variant need 4-Byte address mode.
+ */
+static void sfdp_fill_4ba(struct flashchip *chip, const uint8_t *buf, uint16_t len, const uint8_t *bait)
+{
+	/* Bits of the first DWORD of the 4BAIT. */
+	static const unsigned int native_cmds[][2] = {
+		{ 0, NATIVE_4BA_READ },
+		{ 2, NATIVE_4BA_DOR },
+		{ 3, NATIVE_4BA_DIOR },
+		{ 4, NATIVE_4BA_QOR },
+		{ 5, NATIVE_4BA_QIOR },
+		{ 6, NATIVE_4BA_PP },
+	};
+	static const struct {
+		uint8_t opcode;
+		uint8_t native;
+		unsigned int bit;
+	} native_erase[] = {
+		{ JEDEC_SE, JEDEC_SE_4BA, NATIVE_4BA_SE },
+		{ JEDEC_BE_52, JEDEC_BE_52_4BA, NATIVE_4BA_BE_52 },
+		{ JEDEC_BE_D8, JEDEC_BE_D8_4BA, NATIVE_4BA_BE_D8 },
+	};
+	unsigned int native = 0;
+	uint32_t bait_dw1;
+	unsigned int i;
+	int j;
+
+	if (chip->total_size * 1024 <= (1 << 24))
+		return;
+	if (len >= 16 * 4 && (sfdp_dword(buf, 15) & (1 << 24))) {
+		msg_cdbg2("  4-Byte address mode can be entered with 0x%02x.\n", JEDEC_ENTER_4_BYTE_ADDR_MODE);
+		chip->feature_bits |= FEATURE_4BA_ENTER;
+	}
+	if (!bait)
+		return;
+
+	bait_dw1 = sfdp_dword(bait, 0);
+	for (i = 0; i < ARRAY_SIZE(native_cmds); i++)
+		if (bait_dw1 & (1 << native_cmds[i][0]))
+			native |= native_cmds[i][1];
+	for (j = 0; j < 4; j++) {
+		const uint8_t opcode = buf[(4 * 7) + (j * 2) + 1];
+		if (buf[(4 * 7) + (j * 2)] == 0 || !(bait_dw1 & (1 << (9 + j))))
+			continue;
+		for (i = 0; i < ARRAY_SIZE(native_erase); i++)
+			if (opcode == native_erase[i].opcode && bait[4 + j] == native_erase[i].native)
+				native |= native_erase[i].bit;
+	}
+	if (!native)
+		return;
+	msg_cdbg2("  Native 4-Byte address commands are supported (0x%03x).\n", native);
+	chip->native_4ba |= native;
+	chip->feature_bits |= FEATURE_4BA_NATIVE;
+}
+
+/* Use what the JEDEC flash parameter table @buf (and the 4-Byte address instruction table @bait) tell
+ * about fast operation of the chip.
+ */
+static void sfdp_tune_chip(struct flashchip *chip, const uint8_t *buf, uint16_t len, const uint8_t *bait)
+{
+	if (len < 9 * 4)
+		return;
+	sfdp_fill_read_modes(chip, buf, len);
+	sfdp_fill_timings(chip, buf, len);
+	sfdp_fill_4ba(chip, buf, len, bait);
+}
+
+/*
+ * Read the SFDP tables of the chip. With @generic set the chip definition is built from them (probe_spi_sfdp()),
+ * otherwise they only complete the definition of a natively supported chip (spi_sfdp_tune()).
+ * Returns 1 if the chip definition is usable.
+ */
+static int sfdp_parse(struct flashctx *flash, bool generic)
 {
 	int ret = 0;
 	uint8_t buf[8];
@@ -271,6 +433,10 @@ int probe_spi_sfdp(struct flashctx *flash)
 	struct sfdp_tbl_hdr *hdrs;
 	uint8_t *hbuf;
 	uint8_t *tbuf;
+	uint8_t *bfpt = NULL;
+	uint16_t bfpt_len = 0;
+	uint8_t bait[8];
+	bool have_bait = false;
 
 	if (spi_sfdp_read_sfdp(flash, 0x00, buf, 4)) {
 		msg_cdbg("Receiving SFDP signature failed.\n");
@@ -377,18 +543,57 @@ int probe_spi_sfdp(struct flashctx *flash)
 				msg_cdbg("The chip contains an unknown "
 					  "version of the JEDEC flash "
 					  "parameters table, skipping it.\n");
-			} else if (len != 9 * 4 && len != 4 * 4) {
+			} else if (len < 9 * 4 && len != 4 * 4) {
 				msg_cdbg("Length of the mandatory JEDEC SFDP "
 					 "parameter table is wrong (%d B), "
 					 "skipping it.\n", len);
-			} else if (sfdp_fill_flash(flash->chip, tbuf, len) == 0)
+			} else if (!generic || sfdp_fill_flash(flash->chip, tbuf, len) == 0) {
 				ret = 1;
+				/* Kept for tuning once all tables are known, the newest one wins. */
+				free(bfpt);
+				bfpt = tbuf;
+				bfpt_len = len;
+				continue;
+			}
+		} else if (hdrs[i].id == 0x84 && hbuf[(8 * i) + 7] == 0xff && len >= 8) {
+			/* 4-Byte Address Instruction Table */
+			memcpy(bait, tbuf, sizeof(bait));
+			have_bait = true;
 		}
 		free(tbuf);
 	}
 
+	if (ret) {
+		sfdp_tune_chip(flash->chip, bfpt, bfpt_len, have_bait ? bait : NULL);
+		if (generic && flash->chip->total_size * 1024 > (1 << 24) &&
+		    !(flash->chip->feature_bits & (FEATURE_4BA_ENTER | FEATURE_4BA_NATIVE))) {
+			msg_cdbg("Flash chip size is bigger than what 3-Byte addressing "
+				 "can access.\n");
+			ret = 0;
+		}
+	}
+
 cleanup_hdrs:
+	free(bfpt);
 	free(hdrs);
 	free(hbuf);
 	return ret;
 }
+
+int probe_spi_sfdp(struct flashctx *flash)
+{
+	return sfdp_parse(flash, true);
+}
+
+/*
+ * Complete the definition of a natively supported chip with what its SFDP tables tell: faster read modes,
+ * typical erase and program times (unless listed) and 4-Byte address support.
+ */
+void spi_sfdp_tune(struct flashctx *flash)
+{
+	const uint32_t features = flash->chip->feature_bits;
+
+	msg_cdbg("Looking for SFDP data to tune the access to the chip.\n");
+	if (sfdp_parse(flash, false) && flash->chip->feature_bits != features)
+		msg_cdbg("SFDP enabled features 0x%x.\n", flash->chip->feature_bits & ~features);
+}
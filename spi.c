@@ -22,6 +22,7 @@
  * Contains the generic SPI framework
  */
 
+#include <stdlib.h>
 #include <strings.h>
 #include <string.h>
 #include "flash.h"
@@ -29,18 +30,419 @@
 #include "chipdrivers.h"
 #include "programmer.h"
 #include "spi.h"
+#include "probes.h"
+
+/*
+ * While probing, the same identification commands are sent for every candidate chip. Their responses are
+ * remembered here, so only the first one goes to the bus. Anything which may change the state of the chip
+ * (i.e. any other command, and the first RES) invalidates the cache.
+ */
+#define PROBE_CACHE_ENTRIES	16
+#define PROBE_CACHE_MAX_WRITE	8
+#define PROBE_CACHE_MAX_READ	16
+
+struct probe_cache_entry {
+	const struct registered_master *mst;
+	unsigned int writecnt;
+	unsigned int readcnt;
+	unsigned char writearr[PROBE_CACHE_MAX_WRITE];
+	unsigned char readarr[PROBE_CACHE_MAX_READ];
+	int ret;
+};
+
+/* Per thread, as independent masters are probed concurrently. */
+static THREAD_LOCAL struct probe_cache_entry probe_cache[PROBE_CACHE_ENTRIES];
+static THREAD_LOCAL unsigned int probe_cache_count = 0;
+static THREAD_LOCAL bool probe_cache_enabled = false;
+
+/* Only commands which don't change anything may be answered from the cache. */
+static bool is_probe_command(unsigned int writecnt, const unsigned char *writearr)
+{
+	if (!writecnt)
+		return false;
+	switch (writearr[0]) {
+	case JEDEC_RDID:
+	case JEDEC_REMS:
+	case JEDEC_RES:
+	case JEDEC_RDSR:
+	case JEDEC_READ:
+	case JEDEC_SFDP:
+	case AT25F_RDID:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void probe_cache_start(void)
+{
+	probe_cache_count = 0;
+	probe_cache_enabled = true;
+}
+
+void probe_cache_stop(void)
+{
+	probe_cache_count = 0;
+	probe_cache_enabled = false;
+}
+
+/* Forget all responses, to be called by probe functions which change the state of the chip. */
+void probe_cache_invalidate(void)
+{
+	probe_cache_count = 0;
+}
+
+static struct probe_cache_entry *probe_cache_find(const struct flashctx *flash, unsigned int writecnt,
+						  unsigned int readcnt, const unsigned char *writearr)
+{
+	unsigned int i;
+
+	for (i = 0; i < probe_cache_count; i++) {
+		struct probe_cache_entry *e = &probe_cache[i];
+		if (e->mst == flash->mst && e->writecnt == writecnt && e->readcnt == readcnt &&
+		    !memcmp(e->writearr, writearr, writecnt))
+			return e;
+	}
+	return NULL;
+}
+
+static void probe_cache_add(const struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
+			    const unsigned char *writearr, const unsigned char *readarr, int ret)
+{
+	struct probe_cache_entry *e;
+
+	if (probe_cache_count == PROBE_CACHE_ENTRIES)
+		return;
+	e = &probe_cache[probe_cache_count++];
+	e->mst = flash->mst;
+	e->writecnt = writecnt;
+	e->readcnt = readcnt;
+	memcpy(e->writearr, writearr, writecnt);
+	if (readcnt)
+		memcpy(e->readarr, readarr, readcnt);
+	e->ret = ret;
+}
+
+/* Index of the master of @flash in registered_masters, for the latency histograms. */
+static unsigned int master_index(const struct flashctx *flash)
+{
+	return flash->mst - registered_masters;
+}
 
 int spi_send_command(struct flashctx *flash, unsigned int writecnt,
 		     unsigned int readcnt, const unsigned char *writearr,
 		     unsigned char *readarr)
 {
-	return flash->mst->spi.command(flash, writecnt, readcnt, writearr,
-				       readarr);
+	const unsigned int opcode = writecnt ? writearr[0] : 0;
+	struct probe_cache_entry *cached;
+	bool cacheable = false;
+	unsigned int depth;
+	uint64_t trace_start, latency_start;
+	int ret;
+
+	if (probe_cache_enabled) {
+		if (!is_probe_command(writecnt, writearr)) {
+			probe_cache_invalidate();
+		} else if (writecnt <= PROBE_CACHE_MAX_WRITE && readcnt <= PROBE_CACHE_MAX_READ) {
+			cached = probe_cache_find(flash, writecnt, readcnt, writearr);
+			if (cached) {
+				if (readcnt)
+					memcpy(readarr, cached->readarr, readcnt);
+				return cached->ret;
+			}
+			/* RES wakes a chip up from deep power-down, it may answer everything else now. */
+			if (writearr[0] == JEDEC_RES)
+				probe_cache_invalidate();
+			cacheable = true;
+		}
+	}
+
+	/* Queued commands go first. */
+	if (spi_queue_flush(flash))
+		return SPI_GENERIC_ERROR;
+
+	FLASHROM_PROBE3(spi_command_start, opcode, writecnt, readcnt);
+	latency_start = stats_latency_begin();
+	depth = stats_enter();
+	trace_start = spi_trace_begin();
+	ret = flash->mst->spi.command(flash, writecnt, readcnt, writearr, readarr);
+	if (trace_start) {
+		const struct spi_command cmd = { writecnt, readcnt, writearr, readarr };
+		spi_trace_end(trace_start, SPI_TRACE_COMMAND, 0, &cmd, NULL, 1, ret);
+	}
+	stats_leave(depth, 1, writecnt, readcnt, opcode == JEDEC_RDSR);
+	stats_latency_end(latency_start, master_index(flash), opcode);
+	FLASHROM_PROBE4(spi_command_done, opcode, writecnt, readcnt, ret);
+	if (cacheable)
+		probe_cache_add(flash, writecnt, readcnt, writearr, readarr, ret);
+	return ret;
+}
+
+/*
+ * Copy the @n commands in @cmds into one allocation, with the data of every command right behind its
+ * writearr, for masters that don't take the data separately. @gathered is the number of bytes those
+ * commands write in total. The result has to be freed by the caller, it is NULL if there is no memory.
+ */
+static struct spi_command *spi_flatten_commands(const struct spi_command *cmds, unsigned int n,
+						unsigned long gathered)
+{
+	struct spi_command *flat = malloc((n + 1) * sizeof(*flat) + gathered);
+	unsigned char *buf = (unsigned char *)(flat + n + 1);
+	unsigned int i;
+
+	if (!flat) {
+		msg_perr("Out of memory!\n");
+		return NULL;
+	}
+	for (i = 0; i <= n; i++) {
+		flat[i] = cmds[i];
+		if (!cmds[i].datacnt)
+			continue;
+		memcpy(buf, cmds[i].writearr, cmds[i].writecnt);
+		memcpy(buf + cmds[i].writecnt, cmds[i].data, cmds[i].datacnt);
+		flat[i].writearr = buf;
+		flat[i].writecnt += cmds[i].datacnt;
+		flat[i].data = NULL;
+		flat[i].datacnt = 0;
+		buf += flat[i].writecnt;
+	}
+	return flat;
 }
 
 int spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds)
 {
-	return flash->mst->spi.multicommand(flash, cmds);
+	unsigned int depth, n = 0, rdsr = 0, opcode = 0;
+	unsigned long out = 0, in = 0, gathered = 0;
+	struct spi_command *cmd, *flat = NULL;
+	uint64_t trace_start, latency_start;
+	int ret;
+
+	/* Queued commands go first. */
+	if (spi_queue_flush(flash))
+		return SPI_GENERIC_ERROR;
+	latency_start = stats_latency_begin();
+	depth = stats_enter();
+	for (cmd = cmds; cmd->writecnt || cmd->readcnt; cmd++) {
+		if (probe_cache_enabled && !is_probe_command(cmd->writecnt, cmd->writearr))
+			probe_cache_invalidate();
+		/* Most multicommands start with WREN, the command after it tells more about them. */
+		if (!opcode && cmd->writecnt && cmd->writearr[0] != JEDEC_WREN)
+			opcode = cmd->writearr[0];
+		n++;
+		out += cmd->writecnt + cmd->datacnt;
+		in += cmd->readcnt;
+		if (cmd->datacnt)
+			gathered += cmd->writecnt + cmd->datacnt;
+		if (cmd->writecnt && cmd->writearr[0] == JEDEC_RDSR)
+			rdsr++;
+	}
+	if (gathered && !flash->mst->spi.gather) {
+		flat = spi_flatten_commands(cmds, n, gathered);
+		if (!flat) {
+			stats_leave(depth, 0, 0, 0, 0);
+			return SPI_GENERIC_ERROR;
+		}
+		cmds = flat;
+	}
+	FLASHROM_PROBE3(spi_multicommand_start, n, out, in);
+	trace_start = spi_trace_begin();
+	ret = flash->mst->spi.multicommand(flash, cmds);
+	if (trace_start)
+		spi_trace_end(trace_start, SPI_TRACE_MULTICOMMAND, 0, cmds, NULL, n, ret);
+	stats_leave(depth, n, out, in, rdsr);
+	stats_latency_end(latency_start, master_index(flash), opcode);
+	FLASHROM_PROBE4(spi_multicommand_done, n, out, in, ret);
+	free(flat);
+	return ret;
+}
+
+int spi_send_multi_io_read(struct flashctx *flash, enum spi_io_mode mode, unsigned int writecnt,
+			   unsigned int readcnt, const unsigned char *writearr, unsigned char *readarr)
+{
+	uint64_t trace_start, latency_start;
+	unsigned int depth;
+	int ret;
+
+	if (spi_queue_flush(flash))
+		return SPI_GENERIC_ERROR;
+	FLASHROM_PROBE3(spi_command_start, writearr[0], writecnt, readcnt);
+	latency_start = stats_latency_begin();
+	depth = stats_enter();
+
+	trace_start = spi_trace_begin();
+	ret = flash->mst->spi.multi_io_read(flash, mode, writecnt, readcnt, writearr, readarr);
+	if (trace_start) {
+		const struct spi_command cmd = { writecnt, readcnt, writearr, readarr };
+		spi_trace_end(trace_start, SPI_TRACE_MULTI_IO, mode, &cmd, NULL, 1, ret);
+	}
+	stats_leave(depth, 1, writecnt, readcnt, 0);
+	stats_latency_end(latency_start, master_index(flash), writearr[0]);
+	FLASHROM_PROBE4(spi_command_done, writearr[0], writecnt, readcnt, ret);
+	return ret;
+}
+
+/*
+ * Commands and status polls can be queued and are then sent together by spi_queue_flush(), so masters
+ * implementing the queue hook can do e.g. WREN, page program and waiting for WIP to clear for several pages
+ * in one round trip. Write data is copied into the queue, read buffers have to stay valid until the queue
+ * has been flushed. Any other command sent to the master flushes the queue first, so the order is kept.
+ */
+#define SPI_QUEUE_MAX_OPS	256
+#define SPI_QUEUE_MAX_DATA	(8 * 1024)
+
+static struct spi_queued_op spi_queue[SPI_QUEUE_MAX_OPS];
+static unsigned int spi_queue_len;
+static uint8_t spi_queue_data[SPI_QUEUE_MAX_DATA];
+static unsigned int spi_queue_data_len;
+static struct flashctx *spi_queue_flash;
+
+/* Make room for an op with @writecnt bytes to write, flushing the queue if needed. */
+static struct spi_queued_op *spi_queue_add(struct flashctx *flash, unsigned int writecnt)
+{
+	struct spi_queued_op *op;
+
+	if (writecnt > SPI_QUEUE_MAX_DATA) {
+		msg_perr("%s: command too long (%u B)\n", __func__, writecnt);
+		return NULL;
+	}
+	if ((spi_queue_flash && spi_queue_flash != flash) || spi_queue_len == SPI_QUEUE_MAX_OPS ||
+	    spi_queue_data_len + writecnt > SPI_QUEUE_MAX_DATA) {
+		if (spi_queue_flush(spi_queue_flash))
+			return NULL;
+	}
+	spi_queue_flash = flash;
+	op = &spi_queue[spi_queue_len++];
+	memset(op, 0, sizeof(*op));
+	return op;
+}
+
+int spi_queue_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
+		      const unsigned char *writearr, unsigned char *readarr)
+{
+	struct spi_queued_op *op = spi_queue_add(flash, writecnt);
+
+	if (!op)
+		return SPI_GENERIC_ERROR;
+	memcpy(spi_queue_data + spi_queue_data_len, writearr, writecnt);
+	op->cmd.writecnt = writecnt;
+	op->cmd.writearr = spi_queue_data + spi_queue_data_len;
+	op->cmd.readcnt = readcnt;
+	op->cmd.readarr = readarr;
+	spi_queue_data_len += writecnt;
+	return 0;
+}
+
+/* Queue a command writing @writearr followed by @datacnt bytes of @data. Both are copied into the queue. */
+int spi_queue_write(struct flashctx *flash, unsigned int writecnt, const unsigned char *writearr,
+		    unsigned int datacnt, const unsigned char *data)
+{
+	struct spi_queued_op *op = spi_queue_add(flash, writecnt + datacnt);
+	uint8_t *dst;
+
+	if (!op)
+		return SPI_GENERIC_ERROR;
+	dst = spi_queue_data + spi_queue_data_len;
+	memcpy(dst, writearr, writecnt);
+	memcpy(dst + writecnt, data, datacnt);
+	op->cmd.writecnt = writecnt + datacnt;
+	op->cmd.writearr = dst;
+	spi_queue_data_len += writecnt + datacnt;
+	return 0;
+}
+
+/* Queue polling the status register until (status & @mask) == @value. */
+int spi_queue_poll(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int expected_us,
+		   unsigned int max_step_us)
+{
+	struct spi_queued_op *op = spi_queue_add(flash, 0);
+
+	if (!op)
+		return SPI_GENERIC_ERROR;
+	op->poll = true;
+	op->mask = mask;
+	op->value = value;
+	op->expected_us = expected_us;
+	op->max_step_us = max_step_us;
+	return 0;
+}
+
+/* Queue waiting for @usecs without looking at the status register, for commands that don't report progress
+ * there (e.g. AAI word programs on most SST chips). */
+int spi_queue_delay(struct flashctx *flash, unsigned int usecs)
+{
+	return spi_queue_poll(flash, 0, 0, usecs, 0);
+}
+
+/* Without a queue hook: consecutive commands as one multicommand, polls from the host. */
+static int default_spi_queue(struct flashctx *flash, const struct spi_queued_op *ops, unsigned int count)
+{
+	struct spi_command cmds[SPI_QUEUE_MAX_OPS + 1];
+	unsigned int i = 0, n;
+	int ret;
+
+	while (i < count) {
+		if (ops[i].poll) {
+			if (ops[i].mask)
+				spi_poll_status_register(flash, ops[i].mask, ops[i].value, ops[i].expected_us,
+							 ops[i].max_step_us);
+			else
+				programmer_delay(ops[i].expected_us);
+			i++;
+			continue;
+		}
+		for (n = 0; i < count && !ops[i].poll; i++)
+			cmds[n++] = ops[i].cmd;
+		memset(&cmds[n], 0, sizeof(cmds[n]));
+		ret = spi_send_multicommand(flash, cmds);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Send everything queued for @flash (if anything). */
+int spi_queue_flush(struct flashctx *flash)
+{
+	const unsigned int count = spi_queue_len;
+	unsigned int i, depth, n = 0, polls = 0;
+	unsigned long out = 0, in = 0;
+	uint64_t trace_start, latency_start;
+	int ret;
+
+	if (!count || flash != spi_queue_flash)
+		return 0;
+	/* The commands sent below must not see the queue again. */
+	spi_queue_len = 0;
+	spi_queue_flash = NULL;
+
+	if (!flash->mst->spi.queue) {
+		ret = default_spi_queue(flash, spi_queue, count);
+	} else {
+		if (probe_cache_enabled)
+			probe_cache_invalidate();
+		for (i = 0; i < count; i++) {
+			if (spi_queue[i].poll) {
+				if (spi_queue[i].mask)
+					polls++;
+				continue;
+			}
+			n++;
+			out += spi_queue[i].cmd.writecnt;
+			in += spi_queue[i].cmd.readcnt;
+		}
+		FLASHROM_PROBE1(spi_queue_start, count);
+		latency_start = stats_latency_begin();
+		depth = stats_enter();
+		trace_start = spi_trace_begin();
+		ret = flash->mst->spi.queue(flash, spi_queue, count);
+		if (trace_start)
+			spi_trace_end(trace_start, SPI_TRACE_QUEUE, 0, NULL, spi_queue, count, ret);
+		stats_leave(depth, n, out, in, polls);
+		stats_latency_end(latency_start, master_index(flash), STATS_OPCODE_QUEUE);
+		FLASHROM_PROBE2(spi_queue_done, count, ret);
+	}
+	spi_queue_data_len = 0;
+	return ret;
 }
 
 int default_spi_send_command(struct flashctx *flash, unsigned int writecnt,
@@ -106,11 +508,14 @@ int spi_chip_read(struct flashctx *flash, uint8_t *buf, unsigned int start,
 	unsigned int addrbase = 0;
 
 	/* Check if the chip fits between lowest valid and highest possible
-	 * address. Highest possible address with the current SPI implementation
-	 * means 0xffffff, the highest unsigned 24bit number.
+	 * address. Highest possible address with 3-byte addresses means
+	 * 0xffffff, the highest unsigned 24bit number. Chips supporting 4-byte
+	 * addresses are read with those beyond that.
 	 */
 	addrbase = spi_get_valid_read_addr(flash);
-	if (addrbase + flash->chip->total_size * 1024 > (1 << 24)) {
+	if (!addrbase && (flash->chip->feature_bits & (FEATURE_4BA_ENTER | FEATURE_4BA_NATIVE))) {
+		/* Fine. */
+	} else if (addrbase + flash->chip->total_size * 1024 > (1 << 24)) {
 		msg_perr("Flash chip size exceeds the allowed access window. ");
 		msg_perr("Read will probably fail.\n");
 		/* Try to get the best alignment subject to constraints. */
@@ -167,12 +572,13 @@ int spi_aai_write(struct flashctx *flash, const uint8_t *buf, unsigned int start
 
 int register_spi_master(const struct spi_master *mst)
 {
-	struct registered_master rmst;
+	struct registered_master rmst = { 0 };
 
 	if (!mst->write_aai || !mst->write_256 || !mst->read || !mst->command ||
 	    !mst->multicommand ||
 	    ((mst->command == default_spi_send_command) &&
-	     (mst->multicommand == default_spi_send_multicommand))) {
+	     (mst->multicommand == default_spi_send_multicommand)) ||
+	    (mst->io_modes && !mst->multi_io_read)) {
 		msg_perr("%s called with incomplete master definition. "
 			 "Please report a bug at flashrom@flashrom.org\n",
 			 __func__);
@@ -45,6 +45,12 @@
 #define JEDEC_SFDP_OUTSIZE	0x05	/* 8b op, 24b addr, 8b dummy */
 /*      JEDEC_SFDP_INSIZE : any length */
 
+/* Read Unique ID */
+#define JEDEC_RDUID		0x4b
+#define JEDEC_RDUID_OUTSIZE	0x05	/* 8b op, 32b dummy */
+#define JEDEC_RDUID_4BA_OUTSIZE	0x06	/* 8b op, 40b dummy in 4-byte address mode */
+#define JEDEC_RDUID_INSIZE	0x08
+
 /* Read Electronic Signature */
 #define JEDEC_RES		0xab
 #define JEDEC_RES_OUTSIZE	0x04
@@ -141,6 +147,29 @@
 #define JEDEC_READ_OUTSIZE	0x04
 /*      JEDEC_READ_INSIZE : any length */
 
+/* Read the memory with several data lines: the number of lines used for opcode, address and data is
+ * given in brackets. The address is followed by 8 dummy clocks for the output modes, by a mode byte for
+ * dual I/O and by a mode byte plus 4 dummy clocks for quad I/O. */
+#define JEDEC_DOR		0x3b	/* 1-1-2 */
+#define JEDEC_DIOR		0xbb	/* 1-2-2 */
+#define JEDEC_QOR		0x6b	/* 1-1-4 */
+#define JEDEC_QIOR		0xeb	/* 1-4-4 */
+
+/* Variants of the commands above and of page program and block erase taking a 4-byte address */
+#define JEDEC_READ_4BA		0x13
+#define JEDEC_DOR_4BA		0x3c
+#define JEDEC_DIOR_4BA		0xbc
+#define JEDEC_QOR_4BA		0x6c
+#define JEDEC_QIOR_4BA		0xec
+#define JEDEC_BYTE_PROGRAM_4BA	0x12
+#define JEDEC_SE_4BA		0x21
+#define JEDEC_BE_52_4BA		0x5c
+#define JEDEC_BE_D8_4BA		0xdc
+
+/* Enter/exit 4-byte address mode: all commands taking an address then take a 4-byte one */
+#define JEDEC_ENTER_4_BYTE_ADDR_MODE	0xb7
+#define JEDEC_EXIT_4_BYTE_ADDR_MODE	0xe9
+
 /* Write memory byte */
 #define JEDEC_BYTE_PROGRAM		0x02
 #define JEDEC_BYTE_PROGRAM_OUTSIZE	0x05
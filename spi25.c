@@ -22,6 +22,7 @@
  * Contains the common SPI chip driver functions
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include "flash.h"
 #include "flashchips.h"
@@ -33,14 +34,12 @@ static int spi_rdid(struct flashctx *flash, unsigned char *readarr, int bytes)
 {
 	static const unsigned char cmd[JEDEC_RDID_OUTSIZE] = { JEDEC_RDID };
 	int ret;
-	int i;
 
 	ret = spi_send_command(flash, sizeof(cmd), bytes, cmd, readarr);
 	if (ret)
 		return ret;
 	msg_cspew("RDID returned");
-	for (i = 0; i < bytes; i++)
-		msg_cspew(" 0x%02x", readarr[i]);
+	msg_hexdump(MSG_SPEW, readarr, bytes);
 	msg_cspew(". ");
 	return 0;
 }
@@ -73,7 +72,6 @@ static int spi_res(struct flashctx *flash, unsigned char *readarr, int bytes)
 	unsigned char cmd[JEDEC_RES_OUTSIZE] = { JEDEC_RES, 0, 0, 0 };
 	uint32_t readaddr;
 	int ret;
-	int i;
 
 	ret = spi_send_command(flash, sizeof(cmd), bytes, cmd, readarr);
 	if (ret == SPI_INVALID_ADDRESS) {
@@ -87,8 +85,7 @@ static int spi_res(struct flashctx *flash, unsigned char *readarr, int bytes)
 	if (ret)
 		return ret;
 	msg_cspew("RES returned");
-	for (i = 0; i < bytes; i++)
-		msg_cspew(" 0x%02x", readarr[i]);
+	msg_hexdump(MSG_SPEW, readarr, bytes);
 	msg_cspew(". ");
 	return 0;
 }
@@ -107,6 +104,20 @@ int spi_write_enable(struct flashctx *flash)
 	return result;
 }
 
+/*
+ * Read the 64-bit unique ID of chips with FEATURE_UNIQUE_ID into @id.
+ * The dummy address grows by a byte in 4-byte address mode.
+ */
+int spi_read_unique_id(struct flashctx *flash, uint8_t *id)
+{
+	static const unsigned char cmd[JEDEC_RDUID_4BA_OUTSIZE] = { JEDEC_RDUID };
+
+	if (!(flash->chip->feature_bits & FEATURE_UNIQUE_ID))
+		return 1;
+	return spi_send_command(flash, flash->in_4ba_mode ? JEDEC_RDUID_4BA_OUTSIZE : JEDEC_RDUID_OUTSIZE,
+				JEDEC_RDUID_INSIZE, cmd, id);
+}
+
 int spi_write_disable(struct flashctx *flash)
 {
 	static const unsigned char cmd[JEDEC_WRDI_OUTSIZE] = { JEDEC_WRDI };
@@ -147,6 +158,7 @@ static int probe_spi_rdid_generic(struct flashctx *flash, int bytes)
 	}
 
 	msg_cdbg("%s: id1 0x%02x, id2 0x%02x\n", __func__, id1, id2);
+	probe_report_ids(flash, id1, id2);
 
 	if (id1 == chip->manufacture_id && id2 == chip->model_id)
 		return 1;
@@ -203,6 +215,7 @@ int probe_spi_rems(struct flashctx *flash)
 	id2 = readarr[1];
 
 	msg_cdbg("%s: id1 0x%x, id2 0x%x\n", __func__, id1, id2);
+	probe_report_ids(flash, id1, id2);
 
 	if (id1 == chip->manufacture_id && id2 == chip->model_id)
 		return 1;
@@ -314,6 +327,7 @@ int probe_spi_at25f(struct flashctx *flash)
 	id2 = readarr[1];
 
 	msg_cdbg("%s: id1 0x%02x, id2 0x%02x\n", __func__, id1, id2);
+	probe_report_ids(flash, id1, id2);
 
 	if (id1 == flash->chip->manufacture_id && id2 == flash->chip->model_id)
 		return 1;
@@ -321,6 +335,195 @@ int probe_spi_at25f(struct flashctx *flash)
 	return 0;
 }
 
+/* The opcode taking a 4-byte address for commands with a 3-byte address, for chips with FEATURE_4BA_NATIVE.
+ * 0 if the chip has none, its .native_4ba tells which exist. */
+static uint8_t native_4ba_opcode(const struct flashchip *chip, uint8_t opcode)
+{
+	static const struct {
+		uint8_t opcode;
+		uint8_t native;
+		unsigned int bit;
+	} natives[] = {
+		{ JEDEC_READ,		JEDEC_READ_4BA,		NATIVE_4BA_READ },
+		{ JEDEC_DOR,		JEDEC_DOR_4BA,		NATIVE_4BA_DOR },
+		{ JEDEC_DIOR,		JEDEC_DIOR_4BA,		NATIVE_4BA_DIOR },
+		{ JEDEC_QOR,		JEDEC_QOR_4BA,		NATIVE_4BA_QOR },
+		{ JEDEC_QIOR,		JEDEC_QIOR_4BA,		NATIVE_4BA_QIOR },
+		{ JEDEC_BYTE_PROGRAM,	JEDEC_BYTE_PROGRAM_4BA,	NATIVE_4BA_PP },
+		{ JEDEC_SE,		JEDEC_SE_4BA,		NATIVE_4BA_SE },
+		{ JEDEC_BE_52,		JEDEC_BE_52_4BA,	NATIVE_4BA_BE_52 },
+		{ JEDEC_BE_D8,		JEDEC_BE_D8_4BA,	NATIVE_4BA_BE_D8 },
+	};
+	unsigned int i;
+
+	if (!(chip->feature_bits & FEATURE_4BA_NATIVE))
+		return 0;
+	for (i = 0; i < ARRAY_SIZE(natives); i++)
+		if (natives[i].opcode == opcode)
+			return (chip->native_4ba & natives[i].bit) ? natives[i].native : 0;
+	return 0;
+}
+
+static int spi_exit_4ba_shutdown(void *data)
+{
+	struct flashctx *flash = data;
+	static const unsigned char cmd[] = { JEDEC_EXIT_4_BYTE_ADDR_MODE };
+
+	if (!flash->in_4ba_mode)
+		return 0;
+	flash->in_4ba_mode = false;
+	return spi_send_command(flash, sizeof(cmd), 0, cmd, NULL);
+}
+
+/* Switch the chip to 4-byte addresses until the programmer is shut down. */
+static int spi_enter_4ba(struct flashctx *flash)
+{
+	static const unsigned char cmd[] = { JEDEC_ENTER_4_BYTE_ADDR_MODE };
+
+	if (flash->in_4ba_mode)
+		return 0;
+	if (spi_send_command(flash, sizeof(cmd), 0, cmd, NULL)) {
+		msg_cerr("%s: could not enter 4-byte address mode\n", __func__);
+		return 1;
+	}
+	flash->in_4ba_mode = true;
+	/* Boot code expects the chip in 3-byte address mode, so switch back at the end. Only the shutdown
+	 * function leaves the mode again, so it is registered once. */
+	if (register_shutdown(spi_exit_4ba_shutdown, flash)) {
+		spi_exit_4ba_shutdown(flash);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Fill in the address @addr of the command at @cmd, whose first byte is its usual (3-byte address) opcode.
+ * Chips bigger than 16 MiB get a 4-byte address: with the native 4-byte address opcode if they have one
+ * for this command, else after switching them to 4-byte address mode. Others can only be accessed up to
+ * 16 MiB with 3-byte addresses.
+ * Returns the length of the address, or -1 if @addr can't be reached.
+ */
+static int spi_prepare_address(struct flashctx *flash, unsigned char *cmd, unsigned int addr)
+{
+	const uint32_t features = flash->chip->feature_bits;
+	uint8_t native;
+
+	if (flash->chip->total_size * 1024 > (1 << 24)) {
+		native = native_4ba_opcode(flash->chip, cmd[0]);
+		if (native || (features & FEATURE_4BA_ENTER)) {
+			if (native)
+				cmd[0] = native;
+			else if (spi_enter_4ba(flash))
+				return -1;
+			cmd[1] = (addr >> 24) & 0xff;
+			cmd[2] = (addr >> 16) & 0xff;
+			cmd[3] = (addr >> 8) & 0xff;
+			cmd[4] = (addr >> 0) & 0xff;
+			return 4;
+		}
+	}
+	if (addr > 0xffffff) {
+		msg_cerr("%s: address 0x%x needs 4-byte addressing, which this chip doesn't support\n",
+			 __func__, addr);
+		return -1;
+	}
+	cmd[1] = (addr >> 16) & 0xff;
+	cmd[2] = (addr >> 8) & 0xff;
+	cmd[3] = (addr >> 0) & 0xff;
+	return 3;
+}
+
+/* Shortest and (for program commands) longest interval between two status register polls. */
+#define WIP_MIN_STEP_US		10
+#define WIP_MAX_PROGRAM_STEP_US	1000
+
+/* Typical time the eraser using @fn takes for one block as listed for the chip, 0 if unknown. */
+static unsigned int eraser_typical_us(const struct flashctx *flash,
+				      int (*fn)(struct flashctx *flash, unsigned int addr, unsigned int blocklen))
+{
+	int k;
+
+	for (k = 0; k < NUM_ERASEFUNCTIONS; k++)
+		if (flash->chip->block_erasers[k].block_erase == fn)
+			return flash->chip->block_erasers[k].typical_ms * 1000;
+	return 0;
+}
+
+/* What a command with @opcode took the last time, for the timing profile. Returns false if it never ran. */
+bool spi_get_wip_estimate(const struct flashctx *flash, uint8_t opcode, unsigned int *us)
+{
+	*us = flash->wip_estimate[opcode].us;
+	return flash->wip_estimate[opcode].valid;
+}
+
+/* Start from @us (e.g. from the timing profile) for commands with @opcode, unless one of them already ran. */
+void spi_seed_wip_estimate(struct flashctx *flash, uint8_t opcode, unsigned int us)
+{
+	struct wip_estimate *est = &flash->wip_estimate[opcode];
+
+	if (est->valid)
+		return;
+	est->us = us;
+	est->valid = true;
+}
+
+/* When a command with @opcode is expected to be done. */
+static unsigned int wip_expected_us(const struct flashctx *flash, uint8_t opcode, unsigned int typical_us)
+{
+	const struct wip_estimate *est = &flash->wip_estimate[opcode];
+
+	return est->valid ? est->us : typical_us;
+}
+
+/*
+ * Poll the status register until (status & @mask) == @value, starting after @expected_us with an interval of an
+ * eighth of that which doubles up to @max_step_us. Returns the time waited in microseconds.
+ */
+unsigned int spi_poll_status_register(struct flashctx *flash, uint8_t mask, uint8_t value, unsigned int expected_us,
+				      unsigned int max_step_us)
+{
+	unsigned int waited = 0, step;
+
+	if (expected_us) {
+		programmer_delay(expected_us);
+		waited = expected_us;
+	}
+	step = max(expected_us / 8, WIP_MIN_STEP_US);
+	/* FIXME: We assume spi_read_status_register will never fail. */
+	while ((spi_read_status_register(flash) & mask) != value) {
+		step = min(step, max_step_us);
+		programmer_delay(step);
+		waited += step;
+		step *= 2;
+	}
+	return waited;
+}
+
+/*
+ * Wait until the Write-In-Progress bit is cleared after a command with @opcode.
+ * Polling starts once the expected time has passed: what the previous command with this opcode took, else
+ * the @typical_us given by the data sheet (if known, otherwise poll right away). From then on the interval
+ * starts at an eighth of that and doubles up to @max_step_us.
+ * A command that was already done at the first poll may well be faster than expected, so the next one
+ * is polled a little earlier. Without an estimate from an earlier command the status is also checked once
+ * right away, so emulated or otherwise instant chips don't have to wait for the data sheet time.
+ */
+static void spi_wait_wip(struct flashctx *flash, uint8_t opcode, unsigned int typical_us, unsigned int max_step_us)
+{
+	const unsigned int expected = wip_expected_us(flash, opcode, typical_us);
+	struct wip_estimate *est = &flash->wip_estimate[opcode];
+	unsigned int waited;
+
+	if (!est->valid && typical_us && !(spi_read_status_register(flash) & SPI_SR_WIP)) {
+		est->us = 0;
+		est->valid = true;
+		return;
+	}
+	waited = spi_poll_status_register(flash, SPI_SR_WIP, 0, expected, max_step_us);
+	est->us = waited == expected ? expected - expected / 8 : waited;
+	est->valid = true;
+}
+
 int spi_chip_erase_60(struct flashctx *flash)
 {
 	int result;
@@ -349,11 +552,9 @@ int spi_chip_erase_60(struct flashctx *flash)
 		return result;
 	}
 	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 1-85 s, so wait in 1 s steps.
+	 * This usually takes 1-85 s, so poll at least once a second.
 	 */
-	/* FIXME: We assume spi_read_status_register will never fail. */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1000 * 1000);
+	spi_wait_wip(flash, JEDEC_CE_60, eraser_typical_us(flash, &spi_block_erase_60), 1000 * 1000);
 	/* FIXME: Check the status register for errors. */
 	return 0;
 }
@@ -386,11 +587,9 @@ int spi_chip_erase_62(struct flashctx *flash)
 		return result;
 	}
 	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 2-5 s, so wait in 100 ms steps.
+	 * This usually takes 2-5 s, so poll at least every 100 ms.
 	 */
-	/* FIXME: We assume spi_read_status_register will never fail. */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(100 * 1000);
+	spi_wait_wip(flash, JEDEC_CE_62, eraser_typical_us(flash, &spi_block_erase_62), 100 * 1000);
 	/* FIXME: Check the status register for errors. */
 	return 0;
 }
@@ -422,18 +621,27 @@ int spi_chip_erase_c7(struct flashctx *flash)
 		return result;
 	}
 	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 1-85 s, so wait in 1 s steps.
+	 * This usually takes 1-85 s, so poll at least once a second.
 	 */
-	/* FIXME: We assume spi_read_status_register will never fail. */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1000 * 1000);
+	spi_wait_wip(flash, JEDEC_CE_C7, eraser_typical_us(flash, &spi_block_erase_c7), 1000 * 1000);
 	/* FIXME: Check the status register for errors. */
 	return 0;
 }
 
-int spi_block_erase_52(struct flashctx *flash, unsigned int addr,
-		       unsigned int blocklen)
+/* The block erase opcodes of the AT26DF041 (the only chip using them) don't take WREN first. */
+static bool erase_needs_wren(uint8_t opcode)
 {
+	return opcode != JEDEC_BE_50 && opcode != JEDEC_BE_81;
+}
+
+/* Send the erase command @opcode for the block at @addr and wait until it is done, see spi_wait_wip().
+ * Masters that can queue commands get the status polls too, so they can do the whole erase in one go. */
+static int spi_erase_block(struct flashctx *flash, uint8_t opcode, unsigned int addr, unsigned int typical_us,
+			   unsigned int max_step_us)
+{
+	unsigned char cmd[1 + 4] = { opcode };
+	const bool wren = erase_needs_wren(opcode);
+	int addrlen = spi_prepare_address(flash, cmd, addr);
 	int result;
 	struct spi_command cmds[] = {
 	{
@@ -442,13 +650,8 @@ int spi_block_erase_52(struct flashctx *flash, unsigned int addr,
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
-		.writecnt	= JEDEC_BE_52_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BE_52,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
+		.writecnt	= 1 + addrlen,
+		.writearr	= cmd,
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
@@ -458,62 +661,41 @@ int spi_block_erase_52(struct flashctx *flash, unsigned int addr,
 		.readarr	= NULL,
 	}};
 
-	result = spi_send_multicommand(flash, cmds);
+	if (addrlen < 0)
+		return SPI_INVALID_ADDRESS;
+	if (flash->mst->spi.queue) {
+		if ((wren && spi_queue_command(flash, JEDEC_WREN_OUTSIZE, 0, cmds[0].writearr, NULL)) ||
+		    spi_queue_command(flash, 1 + addrlen, 0, cmd, NULL) ||
+		    spi_queue_poll(flash, SPI_SR_WIP, 0, wip_expected_us(flash, opcode, typical_us), max_step_us))
+			return 1;
+		result = spi_queue_flush(flash);
+	} else {
+		result = spi_send_multicommand(flash, wren ? cmds : cmds + 1);
+	}
 	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n",
-			__func__, addr);
+		msg_cerr("%s failed during command execution of 0x%02x at address 0x%x\n",
+			 __func__, cmd[0], addr);
 		return result;
 	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 100-4000 ms, so wait in 100 ms steps.
-	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(100 * 1000);
+	if (!flash->mst->spi.queue)
+		spi_wait_wip(flash, opcode, typical_us, max_step_us);
 	/* FIXME: Check the status register for errors. */
 	return 0;
 }
 
+int spi_block_erase_52(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
+{
+	/* This usually takes 100-4000 ms, so poll at least every 100 ms. */
+	return spi_erase_block(flash, JEDEC_BE_52, addr, eraser_typical_us(flash, &spi_block_erase_52), 100 * 1000);
+}
+
 /* Block size is usually
  * 32M (one die) for Micron
  */
 int spi_block_erase_c4(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= JEDEC_BE_C4_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BE_C4,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}};
-
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n", __func__, addr);
-		return result;
-	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 240-480 s, so wait in 500 ms steps.
-	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(500 * 1000 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	/* This usually takes 240-480 s, so poll at least every 500 ms. */
+	return spi_erase_block(flash, JEDEC_BE_C4, addr, eraser_typical_us(flash, &spi_block_erase_c4), 500 * 1000);
 }
 
 /* Block size is usually
@@ -521,255 +703,46 @@ int spi_block_erase_c4(struct flashctx *flash, unsigned int addr, unsigned int b
  * 32k for SST
  * 4-32k non-uniform for EON
  */
-int spi_block_erase_d8(struct flashctx *flash, unsigned int addr,
-		       unsigned int blocklen)
+int spi_block_erase_d8(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= JEDEC_BE_D8_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BE_D8,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}};
-
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n",
-			__func__, addr);
-		return result;
-	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 100-4000 ms, so wait in 100 ms steps.
-	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(100 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	/* This usually takes 100-4000 ms, so poll at least every 100 ms. */
+	return spi_erase_block(flash, JEDEC_BE_D8, addr, eraser_typical_us(flash, &spi_block_erase_d8), 100 * 1000);
 }
 
 /* Block size is usually
  * 4k for PMC
  */
-int spi_block_erase_d7(struct flashctx *flash, unsigned int addr,
-		       unsigned int blocklen)
+int spi_block_erase_d7(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= JEDEC_BE_D7_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BE_D7,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}};
-
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n",
-			__func__, addr);
-		return result;
-	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 100-4000 ms, so wait in 100 ms steps.
-	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(100 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	/* This usually takes 100-4000 ms, so poll at least every 100 ms. */
+	return spi_erase_block(flash, JEDEC_BE_D7, addr, eraser_typical_us(flash, &spi_block_erase_d7), 100 * 1000);
 }
 
 /* Page erase (usually 256B blocks) */
 int spi_block_erase_db(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= JEDEC_PE_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_PE,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	} };
-
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n", __func__, addr);
-		return result;
-	}
-
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This takes up to 20 ms usually (on worn out devices up to the 0.5s range), so wait in 1 ms steps. */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	/* This takes up to 20 ms usually (on worn out devices up to the 0.5s range), so poll at
+	 * least every ms. */
+	return spi_erase_block(flash, JEDEC_PE, addr, eraser_typical_us(flash, &spi_block_erase_db), 1 * 1000);
 }
 
 /* Sector size is usually 4k, though Macronix eliteflash has 64k */
-int spi_block_erase_20(struct flashctx *flash, unsigned int addr,
-		       unsigned int blocklen)
+int spi_block_erase_20(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= JEDEC_SE_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_SE,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}};
-
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n",
-			__func__, addr);
-		return result;
-	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 15-800 ms, so wait in 10 ms steps.
-	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(10 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	/* This usually takes 15-800 ms, so poll at least every 10 ms. */
+	return spi_erase_block(flash, JEDEC_SE, addr, eraser_typical_us(flash, &spi_block_erase_20), 10 * 1000);
 }
 
 int spi_block_erase_50(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-/*		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, { */
-		.writecnt	= JEDEC_BE_50_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BE_50,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}};
-
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n", __func__, addr);
-		return result;
-	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 10 ms, so wait in 1 ms steps.
-	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	/* This usually takes 10 ms, so poll at least every ms. */
+	return spi_erase_block(flash, JEDEC_BE_50, addr, eraser_typical_us(flash, &spi_block_erase_50), 1 * 1000);
 }
 
 int spi_block_erase_81(struct flashctx *flash, unsigned int addr, unsigned int blocklen)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-/*		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, { */
-		.writecnt	= JEDEC_BE_81_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BE_81,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff)
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}};
-
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n", __func__, addr);
-		return result;
-	}
-	/* Wait until the Write-In-Progress bit is cleared.
-	 * This usually takes 8 ms, so wait in 1 ms steps.
-	 */
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(1 * 1000);
-	/* FIXME: Check the status register for errors. */
-	return 0;
+	/* This usually takes 8 ms, so poll at least every ms. */
+	return spi_erase_block(flash, JEDEC_BE_81, addr, eraser_typical_us(flash, &spi_block_erase_81), 1 * 1000);
 }
 
 int spi_block_erase_60(struct flashctx *flash, unsigned int addr,
@@ -840,51 +813,42 @@ erasefunc_t *spi_get_erasefn_from_opcode(uint8_t opcode)
 	}
 }
 
+/*
+ * Estimate how long an erase operation with the given function typically takes.
+ * The numbers are typical (not maximum) values found in datasheets of common chips and are only meant to
+ * compare the cost of different erase functions, never to be used as timeouts.
+ * Returns the estimated time in microseconds or 0 if the function is unknown.
+ */
+unsigned int spi_erase_time_estimate(erasefunc_t *fn, unsigned int blocklen)
+{
+	if (fn == &spi_block_erase_20 || fn == &spi_block_erase_d7)
+		return 45 * 1000;
+	if (fn == &spi_block_erase_52)
+		return 120 * 1000;
+	if (fn == &spi_block_erase_d8)
+		return 150 * 1000;
+	if (fn == &spi_block_erase_db)
+		return 10 * 1000;
+	if (fn == &spi_block_erase_50 || fn == &spi_block_erase_81)
+		return 10 * 1000;
+	/* Chip and die erase times scale with the size, about 2.5 ms per kB is typical. */
+	if (fn == &spi_block_erase_60 || fn == &spi_block_erase_62 || fn == &spi_block_erase_c7 ||
+	    fn == &spi_block_erase_c4)
+		return (blocklen / 1024) * 2500;
+	return 0;
+}
+
 int spi_byte_program(struct flashctx *flash, unsigned int addr,
 		     uint8_t databyte)
 {
-	int result;
-	struct spi_command cmds[] = {
-	{
-		.writecnt	= JEDEC_WREN_OUTSIZE,
-		.writearr	= (const unsigned char[]){ JEDEC_WREN },
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= JEDEC_BYTE_PROGRAM_OUTSIZE,
-		.writearr	= (const unsigned char[]){
-					JEDEC_BYTE_PROGRAM,
-					(addr >> 16) & 0xff,
-					(addr >> 8) & 0xff,
-					(addr & 0xff),
-					databyte
-				},
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}, {
-		.writecnt	= 0,
-		.writearr	= NULL,
-		.readcnt	= 0,
-		.readarr	= NULL,
-	}};
-
-	result = spi_send_multicommand(flash, cmds);
-	if (result) {
-		msg_cerr("%s failed during command execution at address 0x%x\n",
-			__func__, addr);
-	}
-	return result;
+	return spi_nbyte_program(flash, addr, &databyte, 1);
 }
 
 int spi_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *bytes, unsigned int len)
 {
-	int result;
-	/* FIXME: Switch to malloc based on len unless that kills speed. */
-	unsigned char cmd[JEDEC_BYTE_PROGRAM_OUTSIZE - 1 + 256] = {
+	int result, addrlen;
+	unsigned char cmd[1 + 4] = {
 		JEDEC_BYTE_PROGRAM,
-		(addr >> 16) & 0xff,
-		(addr >> 8) & 0xff,
-		(addr >> 0) & 0xff,
 	};
 	struct spi_command cmds[] = {
 	{
@@ -893,10 +857,12 @@ int spi_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *
 		.readcnt	= 0,
 		.readarr	= NULL,
 	}, {
-		.writecnt	= JEDEC_BYTE_PROGRAM_OUTSIZE - 1 + len,
+		.writecnt	= 0,
 		.writearr	= cmd,
 		.readcnt	= 0,
 		.readarr	= NULL,
+		.datacnt	= len,
+		.data		= bytes,
 	}, {
 		.writecnt	= 0,
 		.writearr	= NULL,
@@ -908,12 +874,10 @@ int spi_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *
 		msg_cerr("%s called for zero-length write\n", __func__);
 		return 1;
 	}
-	if (len > 256) {
-		msg_cerr("%s called for too long a write\n", __func__);
-		return 1;
-	}
-
-	memcpy(&cmd[4], bytes, len);
+	addrlen = spi_prepare_address(flash, cmd, addr);
+	if (addrlen < 0)
+		return SPI_INVALID_ADDRESS;
+	cmds[1].writecnt = 1 + addrlen;
 
 	result = spi_send_multicommand(flash, cmds);
 	if (result) {
@@ -923,70 +887,244 @@ int spi_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *
 	return result;
 }
 
+/* Reads using several data lines, fastest first. */
+static const struct spi_read_op {
+	uint8_t opcode;
+	enum spi_io_mode mode;
+	unsigned int dummy_bytes;	/* Mode and dummy bytes after the address, as sent in @mode. */
+	uint32_t feature;		/* Chip feature needed. */
+} multi_io_reads[] = {
+	{ JEDEC_QIOR,	SPI_IO_1_4_4,	3, FEATURE_QUAD_READ },
+	{ JEDEC_QOR,	SPI_IO_1_1_4,	1, FEATURE_QUAD_READ },
+	{ JEDEC_DIOR,	SPI_IO_1_2_2,	1, FEATURE_DUAL_READ },
+	{ JEDEC_DOR,	SPI_IO_1_1_2,	1, FEATURE_DUAL_READ },
+};
+
+/* Index into multi_io_reads set by spi_force_read_op(), ARRAY_SIZE() for JEDEC_READ and -1 for the fastest. */
+static int forced_read_op = -1;
+
+static bool read_op_usable(const struct flashctx *flash, const struct spi_read_op *op)
+{
+	return (flash->chip->feature_bits & op->feature) && (flash->mst->spi.io_modes & SPI_IO_MODE(op->mode));
+}
+
+/* The fastest read both the chip and the master can do, NULL for a plain JEDEC_READ. */
+static const struct spi_read_op *multi_io_read_op(const struct flashctx *flash)
+{
+	unsigned int i;
+
+	if (forced_read_op >= 0)
+		return forced_read_op < (int)ARRAY_SIZE(multi_io_reads) ? &multi_io_reads[forced_read_op] : NULL;
+	for (i = 0; i < ARRAY_SIZE(multi_io_reads); i++) {
+		if (read_op_usable(flash, &multi_io_reads[i]))
+			return &multi_io_reads[i];
+	}
+	return NULL;
+}
+
+/*
+ * For the benchmark: read with the @n-th read command, counting the multi-I/O reads fastest first and
+ * JEDEC_READ last, or with -1 choose the fastest one again. Returns the opcode, -1 if chip or master can't
+ * do that read or SPI_READ_OP_END if there are less than @n + 1 read commands.
+ */
+int spi_force_read_op(const struct flashctx *flash, int n)
+{
+	forced_read_op = -1;
+	if (n < 0)
+		return -1;
+	if (n == (int)ARRAY_SIZE(multi_io_reads)) {
+		forced_read_op = n;
+		return JEDEC_READ;
+	}
+	if (n > (int)ARRAY_SIZE(multi_io_reads))
+		return SPI_READ_OP_END;
+	if (!read_op_usable(flash, &multi_io_reads[n]))
+		return -1;
+	forced_read_op = n;
+	return multi_io_reads[n].opcode;
+}
+
 int spi_nbyte_read(struct flashctx *flash, unsigned int address, uint8_t *bytes,
 		   unsigned int len)
 {
-	const unsigned char cmd[JEDEC_READ_OUTSIZE] = {
-		JEDEC_READ,
-		(address >> 16) & 0xff,
-		(address >> 8) & 0xff,
-		(address >> 0) & 0xff,
-	};
+	const struct spi_read_op *op = multi_io_read_op(flash);
+	/* The mode bytes of multi-I/O reads must not enter continuous read mode, 0xff is safe for all
+	 * known chips. */
+	unsigned char cmd[1 + 4 + 3] = { JEDEC_READ, 0, 0, 0, 0, 0xff, 0xff, 0xff };
+	int addrlen;
+
+	if (op)
+		cmd[0] = op->opcode;
+	addrlen = spi_prepare_address(flash, cmd, address);
+	if (addrlen < 0)
+		return SPI_INVALID_ADDRESS;
+	if (op) {
+		/* Mode and dummy bytes follow the address. */
+		if (addrlen == 3)
+			cmd[4] = 0xff;
+		return spi_send_multi_io_read(flash, op->mode, 1 + addrlen + op->dummy_bytes, len, cmd, bytes);
+	}
 
 	/* Send Read */
-	return spi_send_command(flash, sizeof(cmd), len, cmd, bytes);
+	return spi_send_command(flash, 1 + addrlen, len, cmd, bytes);
+}
+
+/* Queue reading @len bytes at @address into @bytes, see spi_queue_flush(). Multi-I/O reads can't be queued. */
+int spi_queue_nbyte_read(struct flashctx *flash, unsigned int address, uint8_t *bytes, unsigned int len)
+{
+	unsigned char cmd[1 + 4] = { JEDEC_READ };
+	int addrlen;
+
+	if (multi_io_read_op(flash))
+		return spi_nbyte_read(flash, address, bytes, len);
+	addrlen = spi_prepare_address(flash, cmd, address);
+	if (addrlen < 0)
+		return SPI_INVALID_ADDRESS;
+	return spi_queue_command(flash, 1 + addrlen, len, cmd, bytes);
 }
 
+/* With 3-byte addresses a read wraps around at the end of this window. */
+#define SPI_3BA_WINDOW	(1 << 24)
+
 /*
- * Read a part of the flash chip.
- * FIXME: Use the chunk code from Michael Karcher instead.
- * Each page is read separately in chunks with a maximum size of chunksize.
+ * Read a part of the flash chip in chunks with a maximum size of chunksize.
+ * SPI reads continue across page boundaries, so they are only split at 16 MiB boundaries, where reads
+ * with 3-byte addresses would wrap around.
+ * Masters that can queue commands get many of those reads in one round trip.
  */
 int spi_read_chunked(struct flashctx *flash, uint8_t *buf, unsigned int start,
 		     unsigned int len, unsigned int chunksize)
 {
+	unsigned int toread;
 	int rc = 0;
-	unsigned int i, j, starthere, lenhere, toread;
-	unsigned int page_size = flash->chip->page_size;
 
-	/* Warning: This loop has a very unusual condition and body.
-	 * The loop needs to go through each page with at least one affected
-	 * byte. The lowest page number is (start / page_size) since that
-	 * division rounds down. The highest page number we want is the page
-	 * where the last byte of the range lives. That last byte has the
-	 * address (start + len - 1), thus the highest page number is
-	 * (start + len - 1) / page_size. Since we want to include that last
-	 * page as well, the loop condition uses <=.
-	 */
-	for (i = start / page_size; i <= (start + len - 1) / page_size; i++) {
-		/* Byte position of the first byte in the range in this page. */
-		/* starthere is an offset to the base address of the chip. */
-		starthere = max(start, i * page_size);
-		/* Length of bytes in the range in this page. */
-		lenhere = min(start + len, (i + 1) * page_size) - starthere;
-		for (j = 0; j < lenhere; j += chunksize) {
-			toread = min(chunksize, lenhere - j);
-			rc = spi_nbyte_read(flash, starthere + j, buf + starthere - start + j, toread);
-			if (rc)
-				break;
-		}
-		if (rc)
-			break;
+	for (; len > 0 && !rc; start += toread, buf += toread, len -= toread) {
+		toread = min(chunksize, len);
+		toread = min(toread, SPI_3BA_WINDOW - start % SPI_3BA_WINDOW);
+		if (flash->mst->spi.queue)
+			rc = spi_queue_nbyte_read(flash, start, buf, toread);
+		else
+			rc = spi_nbyte_read(flash, start, buf, toread);
 	}
 
+	if (spi_queue_flush(flash))
+		rc = 1;
 	return rc;
 }
 
+/* Queue WREN, page program of @len bytes at @addr and waiting for it to finish, see spi_queue_flush(). */
+static int spi_queue_nbyte_program(struct flashctx *flash, unsigned int addr, const uint8_t *bytes,
+				   unsigned int len)
+{
+	static const unsigned char wren = JEDEC_WREN;
+	unsigned char cmd[1 + 4] = { JEDEC_BYTE_PROGRAM };
+	int addrlen;
+
+	if (!len) {
+		msg_cerr("%s called for zero-length write\n", __func__);
+		return 1;
+	}
+	addrlen = spi_prepare_address(flash, cmd, addr);
+	if (addrlen < 0)
+		return SPI_INVALID_ADDRESS;
+
+	if (spi_queue_command(flash, JEDEC_WREN_OUTSIZE, 0, &wren, NULL) ||
+	    spi_queue_write(flash, 1 + addrlen, cmd, len, bytes) ||
+	    spi_queue_poll(flash, SPI_SR_WIP, 0,
+			   wip_expected_us(flash, JEDEC_BYTE_PROGRAM, flash->chip->typical_program_us),
+			   WIP_MAX_PROGRAM_STEP_US))
+		return 1;
+	return 0;
+}
+
+/* How often a page which reads back wrong with VERIFY_INLINE is programmed again. */
+#define INLINE_VERIFY_RETRIES	2
+
+/*
+ * Queue programming @len bytes at @start in chunks of at most @chunksize, none crossing a page boundary. With
+ * @readback, the whole range is read back into it after the last program, in the same batch. Keeping the reads
+ * out of the programs lets masters merge those into bulk programs.
+ */
+static int spi_queue_chunks(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len,
+			    unsigned int chunksize, uint8_t *readback)
+{
+	const unsigned int page_size = flash->chip->page_size;
+	unsigned int readsize = flash->mst->spi.max_data_read;
+	unsigned int pos, towrite, toread;
+	int rc;
+
+	for (pos = 0; pos < len; pos += towrite) {
+		towrite = min(min(chunksize, len - pos), page_size - (start + pos) % page_size);
+		rc = spi_queue_nbyte_program(flash, start + pos, buf + pos, towrite);
+		if (rc)
+			return rc;
+	}
+	if (!readback)
+		return 0;
+
+	if (readsize == MAX_DATA_UNSPECIFIED)
+		readsize = chunksize;
+	for (pos = 0; pos < len; pos += toread) {
+		toread = min(min(readsize, len - pos), SPI_3BA_WINDOW - (start + pos) % SPI_3BA_WINDOW);
+		rc = spi_queue_nbyte_read(flash, start + pos, readback + pos, toread);
+		if (rc)
+			return rc;
+	}
+	return 0;
+}
+
+/*
+ * Compare what spi_queue_chunks() read back, program the pages which differ again up to
+ * INLINE_VERIFY_RETRIES times. Reprogramming a page with the same data only clears bits which didn't make it,
+ * which is only harmless on chips that allow clearing single bits. All others may corrupt the page beyond
+ * their limit of partial programs (e.g. chips with ECC), so they return ERROR_NEEDS_ERASE on the first page
+ * which differs to get the block erased and written again.
+ */
+static int spi_check_chunks(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len,
+			    unsigned int chunksize, uint8_t *readback)
+{
+	const unsigned int page_size = flash->chip->page_size;
+	const bool reprogram = flash->chip->gran == write_gran_1bit ||
+			       flash->chip->gran == write_gran_1byte_implicit_erase;
+	unsigned int pos, n;
+	int retries;
+
+	for (pos = 0; pos < len; pos += n) {
+		n = min(len - pos, page_size - (start + pos) % page_size);
+		for (retries = 0; memcmp(buf + pos, readback + pos, n); retries++) {
+			if (!reprogram) {
+				msg_cdbg("Page at 0x%06x reads back wrong, the block has to be erased again.\n",
+					 start + pos);
+				return ERROR_NEEDS_ERASE;
+			}
+			if (retries == INLINE_VERIFY_RETRIES) {
+				msg_cerr("Page at 0x%06x still reads back wrong after %d retries.\n",
+					 start + pos, retries);
+				return 1;
+			}
+			msg_cdbg("Page at 0x%06x reads back wrong, programming it again.\n", start + pos);
+			if (spi_queue_chunks(flash, buf + pos, start + pos, n, chunksize, readback + pos) ||
+			    spi_queue_flush(flash))
+				return 1;
+		}
+	}
+	verified_inline += len;
+	return 0;
+}
+
 /*
  * Write a part of the flash chip.
  * FIXME: Use the chunk code from Michael Karcher instead.
  * Each page is written separately in chunks with a maximum size of chunksize.
+ * Masters that can queue commands get all page programs and status polls in as few round trips as possible.
+ * With VERIFY_INLINE they read everything back right after programming it as well.
  */
 int spi_write_chunked(struct flashctx *flash, const uint8_t *buf, unsigned int start,
 		      unsigned int len, unsigned int chunksize)
 {
 	int rc = 0;
 	unsigned int i, j, starthere, lenhere, towrite;
+	uint8_t *readback;
 	/* FIXME: page_size is the wrong variable. We need max_writechunk_size
 	 * in struct flashctx to do this properly. All chips using
 	 * spi_chip_write_256 have page_size set to max_writechunk_size, so
@@ -994,6 +1132,18 @@ int spi_write_chunked(struct flashctx *flash, const uint8_t *buf, unsigned int s
 	 */
 	unsigned int page_size = flash->chip->page_size;
 
+	if (flash->mst->spi.queue) {
+		/* Without memory for the read-back, the separate verify pass takes care of it. */
+		readback = verify_mode == VERIFY_INLINE ? malloc(len) : NULL;
+		rc = spi_queue_chunks(flash, buf, start, len, chunksize, readback);
+		if (spi_queue_flush(flash))
+			rc = 1;
+		if (!rc && readback)
+			rc = spi_check_chunks(flash, buf, start, len, chunksize, readback);
+		free(readback);
+		return rc;
+	}
+
 	/* Warning: This loop has a very unusual condition and body.
 	 * The loop needs to go through each page with at least one affected
 	 * byte. The lowest page number is (start / page_size) since that
@@ -1014,8 +1164,7 @@ int spi_write_chunked(struct flashctx *flash, const uint8_t *buf, unsigned int s
 			rc = spi_nbyte_program(flash, starthere + j, buf + starthere - start + j, towrite);
 			if (rc)
 				break;
-			while (spi_read_status_register(flash) & SPI_SR_WIP)
-				programmer_delay(10);
+			spi_wait_wip(flash, JEDEC_BYTE_PROGRAM, flash->chip->typical_program_us, WIP_MAX_PROGRAM_STEP_US);
 		}
 		if (rc)
 			break;
@@ -1040,13 +1189,15 @@ int spi_chip_write_1(struct flashctx *flash, const uint8_t *buf, unsigned int st
 		result = spi_byte_program(flash, i, buf[i - start]);
 		if (result)
 			return 1;
-		while (spi_read_status_register(flash) & SPI_SR_WIP)
-			programmer_delay(10);
+		spi_wait_wip(flash, JEDEC_BYTE_PROGRAM, flash->chip->typical_program_us, WIP_MAX_PROGRAM_STEP_US);
 	}
 
 	return 0;
 }
 
+/* Longest time an AAI word program takes according to the data sheets. */
+#define AAI_WORD_PROGRAM_MAX_US	10
+
 int default_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned int start, unsigned int len)
 {
 	uint32_t pos = start;
@@ -1125,28 +1276,33 @@ int default_spi_write_aai(struct flashctx *flash, const uint8_t *buf, unsigned i
 	}
 
 
-	result = spi_send_multicommand(flash, cmds);
-	if (result != 0) {
-		msg_cerr("%s failed during start command execution: %d\n", __func__, result);
+	/* A word takes at most AAI_WORD_PROGRAM_MAX_US, while a status register poll after each of them costs a
+	 * round trip on most masters. So the words are queued with fixed waits in between and the status is only
+	 * polled once before leaving AAI mode, everything goes out in a few transfers. */
+	if (spi_queue_command(flash, cmds[0].writecnt, 0, cmds[0].writearr, NULL) ||
+	    spi_queue_command(flash, cmds[1].writecnt, 0, cmds[1].writearr, NULL) ||
+	    spi_queue_delay(flash, AAI_WORD_PROGRAM_MAX_US)) {
+		msg_cerr("%s failed during start command execution\n", __func__);
 		goto bailout;
 	}
-	while (spi_read_status_register(flash) & SPI_SR_WIP)
-		programmer_delay(10);
 
-	/* We already wrote 2 bytes in the multicommand step. */
+	/* We already wrote 2 bytes in the start command. */
 	pos += 2;
 
 	/* Are there at least two more bytes to write? */
 	while (pos < start + len - 1) {
 		cmd[1] = buf[pos++ - start];
 		cmd[2] = buf[pos++ - start];
-		result = spi_send_command(flash, JEDEC_AAI_WORD_PROGRAM_CONT_OUTSIZE, 0, cmd, NULL);
-		if (result != 0) {
-			msg_cerr("%s failed during followup AAI command execution: %d\n", __func__, result);
+		if (spi_queue_command(flash, JEDEC_AAI_WORD_PROGRAM_CONT_OUTSIZE, 0, cmd, NULL) ||
+		    spi_queue_delay(flash, AAI_WORD_PROGRAM_MAX_US)) {
+			msg_cerr("%s failed during followup AAI command execution\n", __func__);
 			goto bailout;
 		}
-		while (spi_read_status_register(flash) & SPI_SR_WIP)
-			programmer_delay(10);
+	}
+
+	if (spi_queue_poll(flash, SPI_SR_WIP, 0, 0, WIP_MAX_PROGRAM_STEP_US) || spi_queue_flush(flash)) {
+		msg_cerr("%s failed during followup AAI command execution\n", __func__);
+		goto bailout;
 	}
 
 	/* Use WRDI to exit AAI mode. This needs to be done before issuing any other non-AAI command. */
@@ -40,10 +40,38 @@ int spi_write_status_enable(struct flashctx *flash)
 	return result;
 }
 
-static int spi_write_status_register_flag(struct flashctx *flash, int status, const unsigned char enable_opcode)
+/* Without timing data, allow as much as most chips take for the self-timed erase of a non-volatile WRSR. */
+#define WRSR_DEFAULT_US		(100 * 1000)
+#define WRSR_MAX_STEP_US	(10 * 1000)
+#define WRSR_TIMEOUT_US		(5 * 1000 * 1000)
+
+/*
+ * Wait for WIP to clear after a WRSR. Polling starts after @expected_us, some chips apparently allow running
+ * RDSR only once while the write is in progress. From there the interval doubles up to WRSR_MAX_STEP_US.
+ */
+static int spi_wait_wrsr(struct flashctx *flash, unsigned int expected_us)
+{
+	unsigned int waited = expected_us, step = max(expected_us / 8, 100);
+
+	if (expected_us)
+		programmer_delay(expected_us);
+	while (spi_read_status_register(flash) & SPI_SR_WIP) {
+		if (waited > WRSR_TIMEOUT_US) {
+			msg_cerr("Error: WIP bit after WRSR never cleared\n");
+			return TIMEOUT_ERROR;
+		}
+		step = min(step, WRSR_MAX_STEP_US);
+		programmer_delay(step);
+		waited += step;
+		step *= 2;
+	}
+	return 0;
+}
+
+static int spi_write_status_register_flag(struct flashctx *flash, int status, const unsigned char enable_opcode,
+					  unsigned int expected_us)
 {
 	int result;
-	int i = 0;
 	/*
 	 * WRSR requires either EWSR or WREN depending on chip type.
 	 * The code below relies on the fact hat EWSR and WREN have the same
@@ -75,54 +103,65 @@ static int spi_write_status_register_flag(struct flashctx *flash, int status, co
 		 */
 		return result;
 	}
-	/* WRSR performs a self-timed erase before the changes take effect.
-	 * This may take 50-85 ms in most cases, and some chips apparently
-	 * allow running RDSR only once. Therefore pick an initial delay of
-	 * 100 ms, then wait in 10 ms steps until a total of 5 s have elapsed.
-	 */
-	programmer_delay(100 * 1000);
-	while (spi_read_status_register(flash) & SPI_SR_WIP) {
-		if (++i > 490) {
-			msg_cerr("Error: WIP bit after WRSR never cleared\n");
-			return TIMEOUT_ERROR;
-		}
-		programmer_delay(10 * 1000);
-	}
-	return 0;
+	return spi_wait_wrsr(flash, expected_us);
+}
+
+/* Read the status register to @status. Returns 0 on success. */
+static int spi_read_status_register_checked(struct flashctx *flash, uint8_t *status)
+{
+	static const unsigned char cmd[JEDEC_RDSR_OUTSIZE] = { JEDEC_RDSR };
+	/* FIXME: No workarounds for driver/hardware bugs in generic code. */
+	unsigned char readarr[2] = { 0 }; /* JEDEC_RDSR_INSIZE=1 but wbsio needs 2 */
+	int ret;
+
+	/* Read Status Register */
+	ret = spi_send_command(flash, sizeof(cmd), sizeof(readarr), cmd, readarr);
+	if (ret)
+		msg_cerr("RDSR failed!\n");
+
+	*status = readarr[0];
+	return ret;
+}
+
+uint8_t spi_read_status_register(struct flashctx *flash)
+{
+	uint8_t status;
+
+	spi_read_status_register_checked(flash, &status);
+	return status;
 }
 
+/*
+ * Write @status to the status register, unless it holds that value already. All callers only want to
+ * unprotect the chip, so chips that can do it use a volatile write. That takes no time at all and leaves
+ * the non-volatile bits alone, the protection is back after a power cycle just like a hardware default.
+ */
 int spi_write_status_register(struct flashctx *flash, int status)
 {
 	int feature_bits = flash->chip->feature_bits;
+	const unsigned int nv_us = flash->chip->typical_wrsr_us ? flash->chip->typical_wrsr_us : WRSR_DEFAULT_US;
+	uint8_t old;
 	int ret = 1;
 
+	/* WIP and WEL are read-only. A failed read tells nothing, write the register then. */
+	if (!spi_read_status_register_checked(flash, &old) && !((old ^ status) & ~(SPI_SR_WIP | SPI_SR_WEL))) {
+		msg_cdbg2("Status register is 0x%02x already.\n", old);
+		return 0;
+	}
 	if (!(feature_bits & (FEATURE_WRSR_WREN | FEATURE_WRSR_EWSR))) {
 		msg_cdbg("Missing status register write definition, assuming "
 			 "EWSR is needed\n");
 		feature_bits |= FEATURE_WRSR_EWSR;
 	}
-	if (feature_bits & FEATURE_WRSR_WREN)
-		ret = spi_write_status_register_flag(flash, status, JEDEC_WREN);
+	if (feature_bits & FEATURE_WRSR_VOLATILE)
+		ret = spi_write_status_register_flag(flash, status, JEDEC_EWSR, 0);
+	if (ret && (feature_bits & FEATURE_WRSR_WREN))
+		ret = spi_write_status_register_flag(flash, status, JEDEC_WREN, nv_us);
 	if (ret && (feature_bits & FEATURE_WRSR_EWSR))
-		ret = spi_write_status_register_flag(flash, status, JEDEC_EWSR);
+		ret = spi_write_status_register_flag(flash, status, JEDEC_EWSR, nv_us);
 	return ret;
 }
 
-uint8_t spi_read_status_register(struct flashctx *flash)
-{
-	static const unsigned char cmd[JEDEC_RDSR_OUTSIZE] = { JEDEC_RDSR };
-	/* FIXME: No workarounds for driver/hardware bugs in generic code. */
-	unsigned char readarr[2]; /* JEDEC_RDSR_INSIZE=1 but wbsio needs 2 */
-	int ret;
-
-	/* Read Status Register */
-	ret = spi_send_command(flash, sizeof(cmd), sizeof(readarr), cmd, readarr);
-	if (ret)
-		msg_cerr("RDSR failed!\n");
-
-	return readarr[0];
-}
-
 /* A generic block protection disable.
  * Tests if a protection is enabled with the block protection mask (bp_mask) and returns success otherwise.
  * Tests if the register bits are locked with the lock_mask (lock_mask).
@@ -0,0 +1,282 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * spispeed=auto: once a chip was found, step the SPI clock of the master up from its slowest rate and keep
+ * the fastest one that still returns the same RDID and sampled contents as the slowest, minus one step as a
+ * safety margin. The result is remembered per programmer instance and chip below $XDG_CACHE_HOME, so later
+ * runs only have to check it. If the timing profile (see benchmark.c) shows that reads stop getting faster
+ * above some rate, e.g. because the USB or serial link is the bottleneck, the clock isn't raised beyond it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "flash.h"
+#include "chipdrivers.h"
+#include "programmer.h"
+#include "spi.h"
+
+#define AUTOSPEED_CACHE_FILE	"flashrom-spispeed"
+/* Rates reading at least this share (in percent) of the fastest measured rate are as good as that. */
+#define AUTOSPEED_PROFILE_PERCENT	95
+/* How often every clock rate has to pass the checks. */
+#define AUTOSPEED_ROUNDS	8
+/* Blocks of the chip compared at every rate, spread over (at most) the first 16 MiB. */
+#define AUTOSPEED_SAMPLES	4
+#define AUTOSPEED_SAMPLE_LEN	256
+
+/* What the programmer asked to be tuned, NULL unless spispeed=auto was given. */
+static char *autospeed_instance;
+/* The rate spi_autospeed() chose. */
+static unsigned int autospeed_khz;
+
+struct autospeed_ref {
+	unsigned char id[3];
+	uint8_t data[AUTOSPEED_SAMPLES][AUTOSPEED_SAMPLE_LEN];
+};
+
+static int autospeed_shutdown(void *data)
+{
+	free(autospeed_instance);
+	autospeed_instance = NULL;
+	autospeed_khz = 0;
+	return 0;
+}
+
+/* The SPI clock spispeed=auto settled on, 0 if it wasn't requested or didn't run yet. */
+unsigned int spi_autospeed_khz(void)
+{
+	return autospeed_khz;
+}
+
+/*
+ * Called by programmers whose spispeed parameter is "auto". @instance identifies the programmer (e.g. its
+ * name and serial number or device path) for the cache. Returns 0 on success.
+ */
+int spi_request_autospeed(const char *instance)
+{
+	char *copy = strdup(instance);
+
+	if (!copy) {
+		msg_perr("Out of memory!\n");
+		return 1;
+	}
+	if (!autospeed_instance && register_shutdown(autospeed_shutdown, NULL)) {
+		free(copy);
+		return 1;
+	}
+	free(autospeed_instance);
+	autospeed_instance = copy;
+	return 0;
+}
+
+static int autospeed_sample(struct flashctx *flash, struct autospeed_ref *ref)
+{
+	static const unsigned char cmd[JEDEC_RDID_OUTSIZE] = { JEDEC_RDID };
+	unsigned int size = min(flash->chip->total_size * 1024, 16 * 1024 * 1024);
+	unsigned int i;
+
+	if (spi_send_command(flash, sizeof(cmd), sizeof(ref->id), cmd, ref->id))
+		return 1;
+	for (i = 0; i < AUTOSPEED_SAMPLES; i++) {
+		unsigned int addr = (size / AUTOSPEED_SAMPLES) * i;
+		if (flash->chip->read(flash, ref->data[i], addr, min(AUTOSPEED_SAMPLE_LEN, size - addr)))
+			return 1;
+	}
+	return 0;
+}
+
+/* Whether the current clock gives the same results as @ref, @rounds times in a row. */
+static bool autospeed_check(struct flashctx *flash, const struct autospeed_ref *ref, unsigned int rounds)
+{
+	struct autospeed_ref now;
+
+	while (rounds--) {
+		if (autospeed_sample(flash, &now) || memcmp(&now, ref, sizeof(now)))
+			return false;
+	}
+	return true;
+}
+
+static void autospeed_key(const struct flashctx *flash, char *key, size_t len)
+{
+	snprintf(key, len, "%s:%s", autospeed_instance, flash->chip->name);
+	/* One line per key in the cache. */
+	key[strcspn(key, "\n")] = '\0';
+}
+
+/* The clock rate stored for @key, 0 if there is none. */
+static unsigned int load_autospeed(const char *key)
+{
+	char line[300];
+	unsigned int khz = 0, stored;
+	size_t len = strlen(key);
+	FILE *f = open_cache_file(AUTOSPEED_CACHE_FILE, "r");
+
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "%u ", &stored) == 1 && strchr(line, ' ') &&
+		    !strncmp(strchr(line, ' ') + 1, key, len + 1)) {
+			khz = stored;
+			break;
+		}
+	}
+	fclose(f);
+	return khz;
+}
+
+/* Replace the entry for @key in the cache. The other entries are kept. */
+static void store_autospeed(const char *key, unsigned int khz)
+{
+	char line[300], *kept = NULL;
+	size_t keptlen = 0, len = strlen(key);
+	FILE *f = open_cache_file(AUTOSPEED_CACHE_FILE, "r");
+
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			const char *sp = strchr(line, ' ');
+			char *tmp;
+			if (!sp || (!strncmp(sp + 1, key, len) && sp[len + 1] == '\n'))
+				continue;
+			tmp = realloc(kept, keptlen + strlen(line) + 1);
+			if (!tmp)
+				break;
+			kept = tmp;
+			strcpy(kept + keptlen, line);
+			keptlen += strlen(line);
+		}
+		fclose(f);
+	}
+	f = create_cache_file(AUTOSPEED_CACHE_FILE);
+	if (f && commit_cache_file(f, AUTOSPEED_CACHE_FILE, (!kept || fputs(kept, f) != EOF) &&
+				   fprintf(f, "%u %s\n", khz, key) > 0))
+		msg_pdbg("Can't write the SPI clock cache.\n");
+	free(kept);
+}
+
+/* Index of @khz in the master's speed table, -1 if it is not in there. */
+static int autospeed_index(const unsigned int *speeds, unsigned int khz)
+{
+	int i;
+
+	for (i = 0; speeds[i]; i++)
+		if (speeds[i] == khz)
+			return i;
+	return -1;
+}
+
+/*
+ * The index of the fastest rate worth trying according to the timing profile: the slowest one that reads
+ * about as fast as the fastest measured one. INT_MAX if the profile doesn't tell.
+ */
+static int autospeed_limit(const struct flashctx *flash)
+{
+	const struct timing_profile *p = flash->profile;
+	unsigned int i, best_bps = 0;
+	int limit;
+
+	if (!p || p->clocks < 2)
+		return INT_MAX;
+	for (i = 0; i < p->clocks; i++)
+		if (p->clock[i].read_bps > best_bps)
+			best_bps = p->clock[i].read_bps;
+	for (i = 0; i < p->clocks; i++) {
+		if ((uint64_t)p->clock[i].read_bps * 100 >= (uint64_t)best_bps * AUTOSPEED_PROFILE_PERCENT) {
+			limit = autospeed_index(flash->mst->spi.speeds_khz, p->clock[i].khz);
+			if (limit >= 0)
+				return limit;
+		}
+	}
+	return INT_MAX;
+}
+
+static int autospeed_set(const struct spi_master *mst, unsigned int khz)
+{
+	autospeed_khz = khz;
+	return mst->set_speed(khz);
+}
+
+/*
+ * Tune the SPI clock of the master @flash was found on if spispeed=auto was requested. Returns 0 if the
+ * clock was set (or nothing had to be done), 1 if even the slowest rate doesn't work.
+ */
+int spi_autospeed(struct flashctx *flash)
+{
+	const struct spi_master *mst = &flash->mst->spi;
+	struct autospeed_ref ref;
+	char key[256];
+	unsigned int cached;
+	int i, best = 0, limit;
+
+	if (!autospeed_instance)
+		return 0;
+	if (!(flash->mst->buses_supported & BUS_SPI) || !mst->set_speed || !mst->speeds_khz ||
+	    !mst->speeds_khz[0]) {
+		msg_pwarn("This programmer can't tune its SPI clock, ignoring spispeed=auto.\n");
+		return 0;
+	}
+	autospeed_key(flash, key, sizeof(key));
+
+	/* The slowest rate is the reference the faster ones have to match. */
+	if (mst->set_speed(mst->speeds_khz[0]) || autospeed_sample(flash, &ref) ||
+	    !autospeed_check(flash, &ref, 1)) {
+		msg_perr("Reading the chip at %u kHz doesn't give consistent results.\n", mst->speeds_khz[0]);
+		return 1;
+	}
+
+	limit = autospeed_limit(flash);
+	cached = load_autospeed(key);
+	i = cached ? autospeed_index(mst->speeds_khz, cached) : -1;
+	if (i > limit) {
+		msg_pdbg("The timing profile shows no gain above %u kHz.\n", mst->speeds_khz[limit]);
+	} else if (i > 0) {
+		if (!autospeed_set(mst, cached) && autospeed_check(flash, &ref, AUTOSPEED_ROUNDS)) {
+			msg_pinfo("Using the SPI clock of %u kHz found earlier.\n", cached);
+			return 0;
+		}
+		msg_pinfo("The SPI clock of %u kHz found earlier doesn't work anymore, tuning again.\n",
+			  cached);
+	}
+
+	msg_pinfo("Tuning the SPI clock... ");
+	for (i = 1; mst->speeds_khz[i] && i <= limit; i++) {
+		msg_pdbg("%u kHz ", mst->speeds_khz[i]);
+		if (mst->set_speed(mst->speeds_khz[i]) || !autospeed_check(flash, &ref, AUTOSPEED_ROUNDS))
+			break;
+		best = i;
+	}
+	/*
+	 * Keep a step of margin below the fastest rate that worked, whether the next one failed or there is
+	 * none. Only a rate capped by the timing profile is used as it is, faster ones were measured already.
+	 */
+	if (mst->speeds_khz[i] && i <= limit)
+		msg_pdbg("failed, ");
+	if ((!mst->speeds_khz[i] || i <= limit) && best > 0)
+		best--;
+	if (autospeed_set(mst, mst->speeds_khz[best]) || !autospeed_check(flash, &ref, AUTOSPEED_ROUNDS)) {
+		msg_pinfo("unreliable, using %u kHz.\n", mst->speeds_khz[0]);
+		return autospeed_set(mst, mst->speeds_khz[0]);
+	}
+	msg_pinfo("using %u kHz.\n", mst->speeds_khz[best]);
+	store_autospeed(key, mst->speeds_khz[best]);
+	return 0;
+}
@@ -0,0 +1,380 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Capture of everything sent to the SPI master (see spi_send_command() and friends) into a trace file, and
+ * replay of such a trace through any master.
+ *
+ * A trace starts with the 8 byte magic "FRSPITR1", followed by one record per call into the master. All
+ * numbers are little endian. A record is:
+ *	u8 type (TRACE_*), u8 I/O mode (multi-I/O reads only), u16 number of entries,
+ *	u64 start (us since the trace started), u32 duration (us), s32 return value,
+ * followed by its entries. A command entry is u8 0, u32 writecnt, u32 readcnt and the bytes written (data
+ * read is not kept), a status poll entry u8 1, u8 mask, u8 value, u32 expected_us and u32 max_step_us.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "flash.h"
+#include "programmer.h"
+
+#define TRACE_MAGIC	"FRSPITR1"
+
+enum trace_type {
+	TRACE_COMMAND = 1,
+	TRACE_MULTICOMMAND,
+	TRACE_MULTI_IO,
+	TRACE_QUEUE,
+};
+
+#define TRACE_ENTRY_COMMAND	0
+#define TRACE_ENTRY_POLL	1
+
+/* Larger commands are taken as a sign of a corrupt trace. */
+#define TRACE_MAX_COMMAND	(64 * 1024 * 1024)
+
+bool spi_trace_enabled = false;
+
+static FILE *trace_file;
+static const char *trace_name;
+static uint64_t trace_start_us;
+/* Nesting depth of traced calls, only the outermost one is recorded. */
+static unsigned int trace_depth;
+static bool trace_error;
+
+static uint64_t now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void put_le(uint64_t val, unsigned int len)
+{
+	unsigned char buf[8];
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = val >> (8 * i);
+	if (fwrite(buf, 1, len, trace_file) != len)
+		trace_error = true;
+}
+
+static void put_bytes(const unsigned char *bytes, unsigned int len)
+{
+	if (len && fwrite(bytes, 1, len, trace_file) != len)
+		trace_error = true;
+}
+
+/* Record everything sent to the SPI master from now on in @filename. */
+int spi_trace_start(const char *filename)
+{
+	trace_file = fopen(filename, "wb");
+	if (!trace_file) {
+		msg_gerr("Error: opening trace file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	trace_name = filename;
+	trace_error = false;
+	trace_depth = 0;
+	put_bytes((const unsigned char *)TRACE_MAGIC, strlen(TRACE_MAGIC));
+	trace_start_us = now_us();
+	spi_trace_enabled = true;
+	return 0;
+}
+
+int spi_trace_stop(void)
+{
+	int ret = 0;
+
+	if (!trace_file)
+		return 0;
+	spi_trace_enabled = false;
+	if (fclose(trace_file) || trace_error) {
+		msg_gerr("Error: writing trace file \"%s\" failed.\n", trace_name);
+		ret = 1;
+	}
+	trace_file = NULL;
+	return ret;
+}
+
+/* Called before a call into the master. Returns the start time to pass to spi_trace_end(), 0 if the call isn't
+ * traced. */
+uint64_t spi_trace_begin(void)
+{
+	if (!spi_trace_enabled)
+		return 0;
+	trace_depth++;
+	return now_us();
+}
+
+/*
+ * Called after a call into the master that took @count commands (with @cmds) or queued ops (with @ops) and
+ * returned @ret.
+ */
+void spi_trace_end(uint64_t start, enum spi_trace_call call, unsigned int mode, const struct spi_command *cmds,
+		   const struct spi_queued_op *ops, unsigned int count, int ret)
+{
+	static const uint8_t types[] = {
+		[SPI_TRACE_COMMAND]	= TRACE_COMMAND,
+		[SPI_TRACE_MULTICOMMAND] = TRACE_MULTICOMMAND,
+		[SPI_TRACE_MULTI_IO]	= TRACE_MULTI_IO,
+		[SPI_TRACE_QUEUE]	= TRACE_QUEUE,
+	};
+	const struct spi_command *cmd;
+	uint64_t end = now_us();
+	unsigned int i;
+
+	if (!start || --trace_depth || !trace_file)
+		return;
+	put_le(types[call], 1);
+	put_le(mode, 1);
+	put_le(count, 2);
+	put_le(start - trace_start_us, 8);
+	put_le(end - start, 4);
+	put_le((uint32_t)ret, 4);
+	for (i = 0; i < count; i++) {
+		if (ops && ops[i].poll) {
+			put_le(TRACE_ENTRY_POLL, 1);
+			put_le(ops[i].mask, 1);
+			put_le(ops[i].value, 1);
+			put_le(ops[i].expected_us, 4);
+			put_le(ops[i].max_step_us, 4);
+			continue;
+		}
+		cmd = ops ? &ops[i].cmd : &cmds[i];
+		put_le(TRACE_ENTRY_COMMAND, 1);
+		put_le(cmd->writecnt + cmd->datacnt, 4);
+		put_le(cmd->readcnt, 4);
+		put_bytes(cmd->writearr, cmd->writecnt);
+		put_bytes(cmd->data, cmd->datacnt);
+	}
+}
+
+static int get_le(FILE *f, unsigned int len, uint64_t *val)
+{
+	unsigned char buf[8];
+	unsigned int i;
+
+	if (fread(buf, 1, len, f) != len)
+		return 1;
+	*val = 0;
+	for (i = 0; i < len; i++)
+		*val |= (uint64_t)buf[i] << (8 * i);
+	return 0;
+}
+
+/* A replayed record, with room for its commands and their data. */
+struct replay_record {
+	uint64_t type, mode, count, start, duration, ret;
+	struct spi_queued_op *ops;
+	unsigned int ops_size;
+	unsigned char *data;
+	size_t data_size;
+};
+
+/* Read the next record from @f. Returns 0 on success, 1 at the end of the trace and -1 on errors. */
+static int read_record(FILE *f, struct replay_record *r)
+{
+	uint64_t kind, val, writecnt, readcnt;
+	size_t data_len = 0;
+	unsigned int i;
+	void *tmp;
+
+	if (get_le(f, 1, &r->type))
+		return 1;
+	if (r->type < TRACE_COMMAND || r->type > TRACE_QUEUE || get_le(f, 1, &r->mode) ||
+	    get_le(f, 2, &r->count) || get_le(f, 8, &r->start) || get_le(f, 4, &r->duration) ||
+	    get_le(f, 4, &r->ret) || !r->count)
+		return -1;
+	if (r->count > r->ops_size) {
+		/* One more for the terminating command of a multicommand. */
+		tmp = realloc(r->ops, (r->count + 1) * sizeof(*r->ops));
+		if (!tmp)
+			return -1;
+		r->ops = tmp;
+		r->ops_size = r->count;
+	}
+	memset(r->ops, 0, (r->count + 1) * sizeof(*r->ops));
+	for (i = 0; i < r->count; i++) {
+		if (get_le(f, 1, &kind))
+			return -1;
+		if (kind == TRACE_ENTRY_POLL) {
+			if (r->type != TRACE_QUEUE)
+				return -1;
+			r->ops[i].poll = true;
+			if (get_le(f, 1, &val))
+				return -1;
+			r->ops[i].mask = val;
+			if (get_le(f, 1, &val))
+				return -1;
+			r->ops[i].value = val;
+			if (get_le(f, 4, &val))
+				return -1;
+			r->ops[i].expected_us = val;
+			if (get_le(f, 4, &val))
+				return -1;
+			r->ops[i].max_step_us = val;
+			continue;
+		}
+		if (kind != TRACE_ENTRY_COMMAND || get_le(f, 4, &writecnt) || get_le(f, 4, &readcnt) ||
+		    writecnt + readcnt > TRACE_MAX_COMMAND)
+			return -1;
+		if (data_len + writecnt + readcnt > r->data_size) {
+			tmp = realloc(r->data, data_len + writecnt + readcnt);
+			if (!tmp)
+				return -1;
+			r->data = tmp;
+			r->data_size = data_len + writecnt + readcnt;
+		}
+		if (writecnt && fread(r->data + data_len, 1, writecnt, f) != writecnt)
+			return -1;
+		r->ops[i].cmd.writecnt = writecnt;
+		r->ops[i].cmd.readcnt = readcnt;
+		/* Offsets for now, the buffer may still move. */
+		r->ops[i].cmd.writearr = (const unsigned char *)(uintptr_t)data_len;
+		r->ops[i].cmd.readarr = (unsigned char *)(uintptr_t)(data_len + writecnt);
+		data_len += writecnt + readcnt;
+	}
+	for (i = 0; i < r->count; i++) {
+		if (r->ops[i].poll)
+			continue;
+		r->ops[i].cmd.writearr = r->data + (uintptr_t)r->ops[i].cmd.writearr;
+		r->ops[i].cmd.readarr = r->data + (uintptr_t)r->ops[i].cmd.readarr;
+	}
+	return 0;
+}
+
+static int replay_record(struct flashctx *flash, const struct replay_record *r)
+{
+	struct spi_command *multi;
+	const struct spi_command *cmd = &r->ops[0].cmd;
+	unsigned int i;
+	int ret;
+
+	switch (r->type) {
+	case TRACE_COMMAND:
+		return spi_send_command(flash, cmd->writecnt, cmd->readcnt, cmd->writearr, cmd->readarr);
+	case TRACE_MULTI_IO:
+		if (flash->mst->spi.multi_io_read && (flash->mst->spi.io_modes & SPI_IO_MODE(r->mode)))
+			return spi_send_multi_io_read(flash, r->mode, cmd->writecnt, cmd->readcnt, cmd->writearr,
+						      cmd->readarr);
+		/* The data lines don't matter for the bus traffic. */
+		return spi_send_command(flash, cmd->writecnt, cmd->readcnt, cmd->writearr, cmd->readarr);
+	case TRACE_MULTICOMMAND:
+		/* Terminated by an empty command. */
+		multi = calloc(r->count + 1, sizeof(*multi));
+		if (!multi) {
+			msg_gerr("Out of memory!\n");
+			return 1;
+		}
+		for (i = 0; i < r->count; i++)
+			multi[i] = r->ops[i].cmd;
+		ret = spi_send_multicommand(flash, multi);
+		free(multi);
+		return ret;
+	default:
+		for (i = 0; i < r->count; i++) {
+			if (r->ops[i].poll)
+				ret = spi_queue_poll(flash, r->ops[i].mask, r->ops[i].value, r->ops[i].expected_us,
+						     r->ops[i].max_step_us);
+			else
+				ret = spi_queue_command(flash, r->ops[i].cmd.writecnt, r->ops[i].cmd.readcnt,
+							r->ops[i].cmd.writearr, r->ops[i].cmd.readarr);
+			if (ret)
+				return ret;
+		}
+		return spi_queue_flush(flash);
+	}
+}
+
+/*
+ * Send everything recorded in the trace @filename through the master of @flash, as fast as possible, and
+ * compare the time it takes with the time it took when the trace was captured.
+ */
+int spi_trace_replay(struct flashctx *flash, const char *filename)
+{
+	struct replay_record r = { 0 };
+	unsigned long records = 0, commands = 0, polls = 0, mismatches = 0;
+	uint64_t recorded_us = 0, first = 0, last = 0, start, replay_us;
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	unsigned int i;
+	int ret = 0, rc;
+	FILE *f;
+
+	if (!(flash->mst->buses_supported & BUS_SPI)) {
+		msg_gerr("Error: Replaying a trace needs an SPI master.\n");
+		return 1;
+	}
+	f = fopen(filename, "rb");
+	if (!f) {
+		msg_gerr("Error: opening trace file \"%s\" failed: %s\n", filename, strerror(errno));
+		return 1;
+	}
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+		msg_gerr("Error: \"%s\" is not a flashrom SPI trace.\n", filename);
+		fclose(f);
+		return 1;
+	}
+
+	msg_ginfo("Replaying %s... ", filename);
+	start = now_us();
+	while ((rc = read_record(f, &r)) == 0) {
+		if (!records)
+			first = r.start;
+		last = r.start + r.duration;
+		recorded_us += r.duration;
+		records++;
+		for (i = 0; i < r.count; i++) {
+			if (r.ops[i].poll)
+				polls++;
+			else
+				commands++;
+		}
+		/* Commands failing (or not) like they did when captured is fine. */
+		if ((replay_record(flash, &r) != 0) != ((int32_t)r.ret != 0)) {
+			msg_gdbg("Record %lu returned differently than when captured.\n", records);
+			mismatches++;
+		}
+	}
+	replay_us = now_us() - start;
+	if (rc < 0) {
+		msg_ginfo("\n");
+		msg_gerr("Error: trace file \"%s\" is corrupt after %lu records.\n", filename, records);
+		ret = 1;
+	} else {
+		msg_ginfo("done.\n");
+	}
+	msg_ginfo("%lu calls into the master with %lu commands and %lu status polls.\n", records, commands, polls);
+	msg_ginfo("Captured: %llu.%06llu s in the master, %llu.%06llu s from first to last call.\n",
+		  (unsigned long long)recorded_us / 1000000, (unsigned long long)recorded_us % 1000000,
+		  (unsigned long long)(last - first) / 1000000, (unsigned long long)(last - first) % 1000000);
+	msg_ginfo("Replayed: %llu.%06llu s.\n", (unsigned long long)replay_us / 1000000,
+		  (unsigned long long)replay_us % 1000000);
+	if (mismatches)
+		msg_gwarn("%lu calls failed where they succeeded when captured or vice versa.\n", mismatches);
+
+	free(r.ops);
+	free(r.data);
+	fclose(f);
+	return ret;
+}
@@ -0,0 +1,355 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Performance counters collected at the bus access choke points (spi_send_command() and friends,
+ * chip_read*()/chip_write*() and programmer_delay()), broken down by operation phase. Optionally also
+ * latency histograms of the SPI master calls per master and opcode.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "flash.h"
+
+#if !IS_WINDOWS && !defined(__DJGPP__) && !defined(__LIBPAYLOAD__)
+#include <sys/resource.h>
+#define HAVE_GETRUSAGE 1
+#endif
+
+bool stats_enabled = false;
+bool stats_histograms = false;
+
+/* Bucket 0 counts calls of less than 1 us, bucket n those of 2^(n-1) to 2^n - 1 us, the last one the rest. */
+#define LATENCY_BUCKETS		26
+/* Enough for every opcode a chip driver sends on a few masters, later combinations are dropped. */
+#define MAX_LATENCY_HISTS	64
+
+struct latency_hist {
+	unsigned int master;
+	unsigned int opcode;		/* or STATS_OPCODE_QUEUE */
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t buckets[LATENCY_BUCKETS];
+};
+static struct latency_hist latency_hists[MAX_LATENCY_HISTS];
+static unsigned int latency_hist_count;
+
+static const char *const phase_names[NUM_STATS_PHASES] = {
+	[STATS_PHASE_OTHER]	= "other",
+	[STATS_PHASE_PROBE]	= "probe",
+	[STATS_PHASE_READ]	= "read",
+	[STATS_PHASE_ERASE]	= "erase",
+	[STATS_PHASE_WRITE]	= "write",
+	[STATS_PHASE_VERIFY]	= "verify",
+};
+
+static struct op_stats phase_stats[NUM_STATS_PHASES];
+static enum stats_phase cur_phase = STATS_PHASE_OTHER;
+static uint64_t phase_start_us;
+/* Nesting depth of bus accesses, so accesses implemented on top of others are counted only once. */
+static THREAD_LOCAL unsigned int depth;
+/* Where this thread's accesses are counted if not NULL, see stats_capture(). */
+static THREAD_LOCAL struct op_stats *sink;
+
+static uint64_t now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Account the time since the last phase change to the current phase and switch to @phase.
+ * Returns the previous phase, so callers can restore it.
+ */
+enum stats_phase stats_set_phase(enum stats_phase phase)
+{
+	enum stats_phase prev = cur_phase;
+	uint64_t now;
+
+	if (!stats_enabled)
+		return prev;
+	now = now_us();
+	if (phase_start_us)
+		phase_stats[cur_phase].wall_us += now - phase_start_us;
+	phase_start_us = now;
+	cur_phase = phase;
+	return prev;
+}
+
+/* Start over, e.g. for the next target. */
+void stats_reset(void)
+{
+	memset(phase_stats, 0, sizeof(phase_stats));
+	cur_phase = STATS_PHASE_OTHER;
+	phase_start_us = 0;
+	latency_hist_count = 0;
+}
+
+unsigned int stats_enter(void)
+{
+	return depth++;
+}
+
+void stats_leave(unsigned int prev_depth, unsigned int transactions, unsigned long out, unsigned long in,
+		 unsigned int rdsr_polls)
+{
+	struct op_stats *s = sink ? sink : &phase_stats[cur_phase];
+
+	depth--;
+	if (prev_depth)
+		return;
+	s->transactions += transactions;
+	s->bytes_out += out;
+	s->bytes_in += in;
+	s->rdsr_polls += rdsr_polls;
+}
+
+/*
+ * Start timing a call into a master for the latency histograms. Returns 0 if it isn't timed: if histograms
+ * are off, for calls made on behalf of another one and for the accesses of concurrently flashed targets.
+ */
+uint64_t stats_latency_begin(void)
+{
+	if (!stats_histograms || depth || sink)
+		return 0;
+	return now_us();
+}
+
+/* Count the call timed since @start (unless 0) for @master (an index into registered_masters) and @opcode. */
+void stats_latency_end(uint64_t start, unsigned int master, unsigned int opcode)
+{
+	struct latency_hist *h;
+	uint64_t us;
+	unsigned int i;
+
+	if (!start)
+		return;
+	us = now_us() - start;
+	for (i = 0; i < latency_hist_count; i++) {
+		if (latency_hists[i].master == master && latency_hists[i].opcode == opcode)
+			break;
+	}
+	if (i == latency_hist_count) {
+		if (i == MAX_LATENCY_HISTS)
+			return;
+		latency_hist_count++;
+		memset(&latency_hists[i], 0, sizeof(latency_hists[i]));
+		latency_hists[i].master = master;
+		latency_hists[i].opcode = opcode;
+	}
+	h = &latency_hists[i];
+	h->count++;
+	h->total_us += us;
+	if (us > h->max_us)
+		h->max_us = us;
+	for (i = 0; i < LATENCY_BUCKETS - 1 && us >> i; i++)
+		;
+	h->buckets[i]++;
+}
+
+/* Wrap a programmer delay of @usecs. */
+void stats_delay(void (*delay)(unsigned int usecs), unsigned int usecs)
+{
+	struct op_stats *s = sink ? sink : &phase_stats[cur_phase];
+	uint64_t start;
+
+	if (!stats_enabled) {
+		delay(usecs);
+		return;
+	}
+	start = now_us();
+	delay(usecs);
+	s->delays++;
+	s->delay_requested_us += usecs;
+	s->delay_us += now_us() - start;
+}
+
+void stats_get(enum stats_phase phase, struct op_stats *s)
+{
+	*s = phase_stats[phase];
+}
+
+/* Count the accesses of the calling thread in @sink instead (until called with NULL), so threads don't
+ * update the counters concurrently. stats_add() the sink afterwards. */
+void stats_capture(struct op_stats *s)
+{
+	sink = s;
+}
+
+/* Add the counters of @s (but not its wall time) to the current phase. */
+void stats_add(const struct op_stats *s)
+{
+	struct op_stats *cur = &phase_stats[cur_phase];
+
+	cur->transactions += s->transactions;
+	cur->bytes_out += s->bytes_out;
+	cur->bytes_in += s->bytes_in;
+	cur->rdsr_polls += s->rdsr_polls;
+	cur->delays += s->delays;
+	cur->delay_us += s->delay_us;
+	cur->delay_requested_us += s->delay_requested_us;
+}
+
+/* Peak resident set size of the process in KiB, 0 if unknown. */
+static unsigned long peak_memory_kb(void)
+{
+#ifdef HAVE_GETRUSAGE
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1024;
+#else
+	return ru.ru_maxrss;
+#endif
+#else
+	return 0;
+#endif
+}
+
+static void sum_stats(struct op_stats *total)
+{
+	int i;
+
+	memset(total, 0, sizeof(*total));
+	for (i = 0; i < NUM_STATS_PHASES; i++) {
+		total->wall_us += phase_stats[i].wall_us;
+		total->transactions += phase_stats[i].transactions;
+		total->bytes_out += phase_stats[i].bytes_out;
+		total->bytes_in += phase_stats[i].bytes_in;
+		total->rdsr_polls += phase_stats[i].rdsr_polls;
+		total->delays += phase_stats[i].delays;
+		total->delay_us += phase_stats[i].delay_us;
+		total->delay_requested_us += phase_stats[i].delay_requested_us;
+	}
+}
+
+static void print_stats_line(const char *name, const struct op_stats *s)
+{
+	msg_ginfo("%-7s %10.1f %12llu %12llu %12llu %10llu %10llu %10.1f\n", name, s->wall_us / 1000.0,
+		  (unsigned long long)s->transactions, (unsigned long long)s->bytes_out,
+		  (unsigned long long)s->bytes_in, (unsigned long long)s->rdsr_polls,
+		  (unsigned long long)s->delays, s->delay_us / 1000.0);
+}
+
+static void print_latency_hists(void)
+{
+	unsigned int i, b;
+
+	msg_ginfo("\nLatency of the master calls [us]:\n");
+	msg_ginfo("%-6s %-6s %10s %10s %10s  %s\n", "master", "opcode", "calls", "average", "max",
+		  "histogram (bucket: calls)");
+	for (i = 0; i < latency_hist_count; i++) {
+		const struct latency_hist *h = &latency_hists[i];
+		if (h->opcode == STATS_OPCODE_QUEUE)
+			msg_ginfo("%-6u %-6s", h->master, "queue");
+		else
+			msg_ginfo("%-6u 0x%02x  ", h->master, h->opcode);
+		msg_ginfo(" %10llu %10.1f %10llu ", (unsigned long long)h->count, (double)h->total_us / h->count,
+			  (unsigned long long)h->max_us);
+		for (b = 0; b < LATENCY_BUCKETS; b++) {
+			if (!h->buckets[b])
+				continue;
+			if (!b)
+				msg_ginfo(" <1: ");
+			else if (b == LATENCY_BUCKETS - 1)
+				msg_ginfo(" >=%llu: ", 1ULL << (b - 1));
+			else
+				msg_ginfo(" %llu-%llu: ", 1ULL << (b - 1), (1ULL << b) - 1);
+			msg_ginfo("%llu", (unsigned long long)h->buckets[b]);
+		}
+		msg_ginfo("\n");
+	}
+}
+
+static void print_latency_hists_json(FILE *f)
+{
+	unsigned int i, b;
+
+	fprintf(f, ", \"latency\": [");
+	for (i = 0; i < latency_hist_count; i++) {
+		const struct latency_hist *h = &latency_hists[i];
+		fprintf(f, "%s{\"master\": %u, \"opcode\": ", i ? ", " : "", h->master);
+		if (h->opcode == STATS_OPCODE_QUEUE)
+			fprintf(f, "\"queue\"");
+		else
+			fprintf(f, "%u", h->opcode);
+		fprintf(f, ", \"calls\": %llu, \"total_us\": %llu, \"max_us\": %llu, \"buckets\": [",
+			(unsigned long long)h->count, (unsigned long long)h->total_us,
+			(unsigned long long)h->max_us);
+		for (b = 0; b < LATENCY_BUCKETS; b++)
+			fprintf(f, "%s%llu", b ? ", " : "", (unsigned long long)h->buckets[b]);
+		fprintf(f, "]}");
+	}
+	fprintf(f, "]");
+}
+
+void stats_print(void)
+{
+	struct op_stats total;
+	int i;
+
+	stats_set_phase(cur_phase);
+	msg_ginfo("\nStatistics:\n");
+	msg_ginfo("%-7s %10s %12s %12s %12s %10s %10s %10s\n", "phase", "time [ms]", "transactions",
+		  "bytes out", "bytes in", "RDSR polls", "delays", "delay [ms]");
+	for (i = 0; i < NUM_STATS_PHASES; i++) {
+		if (phase_stats[i].wall_us || phase_stats[i].transactions || phase_stats[i].delays)
+			print_stats_line(phase_names[i], &phase_stats[i]);
+	}
+	sum_stats(&total);
+	print_stats_line("total", &total);
+	if (peak_memory_kb())
+		msg_ginfo("Peak memory usage: %lu kB\n", peak_memory_kb());
+	if (stats_histograms)
+		print_latency_hists();
+}
+
+static void print_stats_json_object(FILE *f, const struct op_stats *s)
+{
+	fprintf(f, "{\"wall_us\": %llu, \"transactions\": %llu, \"bytes_out\": %llu, \"bytes_in\": %llu, "
+		"\"rdsr_polls\": %llu, \"delays\": %llu, \"delay_us\": %llu, \"delay_requested_us\": %llu}",
+		(unsigned long long)s->wall_us, (unsigned long long)s->transactions,
+		(unsigned long long)s->bytes_out, (unsigned long long)s->bytes_in,
+		(unsigned long long)s->rdsr_polls, (unsigned long long)s->delays,
+		(unsigned long long)s->delay_us, (unsigned long long)s->delay_requested_us);
+}
+
+void stats_print_json(FILE *f)
+{
+	struct op_stats total;
+	int i;
+
+	stats_set_phase(cur_phase);
+	fprintf(f, "{\"phases\": {");
+	for (i = 0; i < NUM_STATS_PHASES; i++) {
+		fprintf(f, "%s\"%s\": ", i ? ", " : "", phase_names[i]);
+		print_stats_json_object(f, &phase_stats[i]);
+	}
+	fprintf(f, "}, \"total\": ");
+	sum_stats(&total);
+	print_stats_json_object(f, &total);
+	fprintf(f, ", \"peak_memory_kb\": %lu", peak_memory_kb());
+	if (stats_histograms)
+		print_latency_hists_json(f);
+	fprintf(f, "}\n");
+}
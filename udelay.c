@@ -26,11 +26,78 @@
 #include <sys/time.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <stdio.h>
+#include <string.h>
 #include "flash.h"
+#include "programmer.h"
+
+#if !IS_WINDOWS && !defined(__DJGPP__)
+#if defined(CLOCK_MONOTONIC)
+#define HAVE_MONOTONIC_CLOCK 1
+#endif
+/* The delay loop calibration is remembered per host and CPU frequency in this file below $XDG_CACHE_HOME
+ * (or ~/.cache), so it doesn't have to be repeated on every run. */
+#define DELAY_CACHE_FILE "flashrom-delay"
+#define HAVE_DELAY_CACHE 1
+#endif
 
 /* loops per microsecond */
 static unsigned long micro = 1;
 
+#ifdef HAVE_MONOTONIC_CLOCK
+/* Wait on the monotonic clock instead of counting loops. */
+static bool use_clock = false;
+/* How much later than requested the OS may wake us up. Delays sleep until this long before their end and
+ * busy-wait for the rest, so they neither pin the CPU nor end late. */
+static unsigned int sleep_slack_us;
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* A clock good enough for delays has microsecond resolution and doesn't go backwards. */
+static bool monotonic_clock_usable(void)
+{
+	struct timespec res, a, b;
+
+	if (clock_getres(CLOCK_MONOTONIC, &res) || res.tv_sec || res.tv_nsec > 1000)
+		return false;
+	if (clock_gettime(CLOCK_MONOTONIC, &a) || clock_gettime(CLOCK_MONOTONIC, &b))
+		return false;
+	return b.tv_sec > a.tv_sec || (b.tv_sec == a.tv_sec && b.tv_nsec >= a.tv_nsec);
+}
+
+static void clock_delay(unsigned int usecs)
+{
+	const uint64_t end = monotonic_ns() + (uint64_t)usecs * 1000;
+
+	if (usecs > sleep_slack_us)
+		internal_sleep(usecs - sleep_slack_us);
+	while (monotonic_ns() < end)
+		;
+}
+
+/* Sleep a few times for a short while and take the worst wakeup latency (with some margin) as slack. */
+static void measure_sleep_slack(void)
+{
+	uint64_t start, took_us, late_us = 0;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		start = monotonic_ns();
+		internal_sleep(100);
+		took_us = (monotonic_ns() - start) / 1000;
+		if (took_us > 100)
+			late_us = max(late_us, took_us - 100);
+	}
+	sleep_slack_us = min(late_us * 2 + 10, 10000);
+}
+#endif
+
 __attribute__ ((noinline)) void myusec_delay(unsigned int usecs)
 {
 	unsigned long i;
@@ -85,6 +152,55 @@ static unsigned long measure_delay(unsigned int usecs)
 	return timeusec;
 }
 
+#ifdef HAVE_DELAY_CACHE
+/* Identify the host and CPU speed the calibration is valid for. */
+static void delay_cache_key(char *key, size_t len)
+{
+	char host[64] = "unknown";
+	char freq[32] = "unknown";
+	FILE *f;
+
+	gethostname(host, sizeof(host) - 1);
+	host[strcspn(host, " \n")] = '\0';
+	f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq", "r");
+	if (f) {
+		if (!fgets(freq, sizeof(freq), f))
+			strcpy(freq, "unknown");
+		freq[strcspn(freq, " \n")] = '\0';
+		fclose(f);
+	}
+	snprintf(key, len, "%s@%s", host, freq);
+}
+
+/* Load the calibration stored for this host, 0 if there is none. */
+static unsigned long load_delay_calibration(void)
+{
+	char key[128], stored[128];
+	unsigned long loops = 0;
+	FILE *f = open_cache_file(DELAY_CACHE_FILE, "r");
+
+	if (!f)
+		return 0;
+	delay_cache_key(key, sizeof(key));
+	if (fscanf(f, "%127s %lu", stored, &loops) != 2 || strcmp(key, stored))
+		loops = 0;
+	fclose(f);
+	return loops;
+}
+
+static void store_delay_calibration(void)
+{
+	char key[128];
+	FILE *f = open_cache_file(DELAY_CACHE_FILE, "w");
+
+	if (!f)
+		return;
+	delay_cache_key(key, sizeof(key));
+	fprintf(f, "%s %lu\n", key, micro);
+	fclose(f);
+}
+#endif
+
 void myusec_calibrate_delay(void)
 {
 	unsigned long count = 1000;
@@ -92,6 +208,15 @@ void myusec_calibrate_delay(void)
 	int i, tries = 0;
 
 	msg_pinfo("Calibrating delay loop... ");
+#ifdef HAVE_MONOTONIC_CLOCK
+	if (monotonic_clock_usable()) {
+		use_clock = true;
+		measure_sleep_slack();
+		msg_pdbg("using the monotonic clock, sleep slack is %u us, ", sleep_slack_us);
+		msg_pinfo("OK.\n");
+		return;
+	}
+#endif
 	resolution = measure_os_delay_resolution();
 	if (resolution) {
 		msg_pdbg("OS timer resolution is %lu usecs, ", resolution);
@@ -99,6 +224,21 @@ void myusec_calibrate_delay(void)
 		msg_pinfo("OS timer resolution is unusable. ");
 	}
 
+#ifdef HAVE_DELAY_CACHE
+	micro = load_delay_calibration();
+	if (micro) {
+		/* Quick sanity check: a cached value that is off means the machine changed. */
+		timeusec = measure_delay(10000);
+		if (timeusec >= 9000 && timeusec <= 20000) {
+			msg_pdbg("using cached %luM loops per second, ", micro);
+			msg_pinfo("OK.\n");
+			return;
+		}
+		msg_pdbg("cached calibration is off (10000 myus = %ld us), ", timeusec);
+	}
+	micro = 1;
+#endif
+
 recalibrate:
 	count = 1000;
 	while (1) {
@@ -167,6 +307,10 @@ recalibrate:
 	timeusec = measure_delay(resolution * 4);
 	msg_pdbg("%ld myus = %ld us, ", resolution * 4, timeusec);
 
+#ifdef HAVE_DELAY_CACHE
+	if (tries < 5)
+		store_delay_calibration();
+#endif
 	msg_pinfo("OK.\n");
 }
 
@@ -189,6 +333,10 @@ void internal_delay(unsigned int usecs)
 	/* If the delay is >1 s, use internal_sleep because timing does not need to be so precise. */
 	if (usecs > 1000000) {
 		internal_sleep(usecs);
+#ifdef HAVE_MONOTONIC_CLOCK
+	} else if (use_clock) {
+		clock_delay(usecs);
+#endif
 	} else {
 		myusec_delay(usecs);
 	}
@@ -121,64 +121,134 @@ int usbblaster_spi_init(void)
 	return 0;
 }
 
-static int send_write(unsigned int writecnt, const unsigned char *writearr)
+/* Commands are queued and sent with a single ftdi_write_data() when they don't fit anymore, when the data
+ * shifted in is needed or when more of it would be pending than the FT245 buffers for the host (384 bytes)
+ * while we are still writing. CS# changes are queued like everything else. */
+#define QUEUE_SIZE		4096
+#define MAX_PENDING_READ	256
+#define MAX_PENDING_DESTS	64
+
+static uint8_t queue[QUEUE_SIZE];
+static unsigned int queued;
+static unsigned int pending_read;
+/* Where the bytes shifted in go once they are read back. */
+static struct {
+	unsigned char *buf;
+	unsigned int len;
+} dests[MAX_PENDING_DESTS];
+static unsigned int num_dests;
+
+/* Queue space needed to shift @len bytes. */
+static unsigned int shift_size(unsigned int len)
 {
-	int i;
-	uint8_t buf[BUF_SIZE];
+	return len + (len + BUF_SIZE - 2) / (BUF_SIZE - 1);
+}
+
+static void queue_write(unsigned int writecnt, const unsigned char *writearr)
+{
+	unsigned int i, n;
 
-	memset(buf, 0, sizeof(buf));
 	while (writecnt) {
-		unsigned int n_write = min(writecnt, BUF_SIZE - 1);
-		msg_pspew("writing %d-byte packet\n", n_write);
+		n = min(writecnt, BUF_SIZE - 1);
+		queue[queued++] = BIT_BYTE | (uint8_t)n;
+		for (i = 0; i < n; i++)
+			queue[queued++] = reverse(writearr[i]);
+		writearr += n;
+		writecnt -= n;
+	}
+}
 
-		buf[0] = BIT_BYTE | (uint8_t)n_write;
-		for (i = 0; i < n_write; i++) {
-			buf[i+1] = reverse(writearr[i]);
-		}
-		if (ftdi_write_data(&ftdic, buf, n_write + 1) < 0) {
-			msg_perr("USB-Blaster write failed\n");
-			return -1;
-		}
+static void queue_read(unsigned int readcnt, unsigned char *readarr)
+{
+	unsigned int n;
+
+	dests[num_dests].buf = readarr;
+	dests[num_dests].len = readcnt;
+	num_dests++;
+	pending_read += readcnt;
+	while (readcnt) {
+		n = min(readcnt, BUF_SIZE - 1);
+		queue[queued++] = BIT_BYTE | BIT_READ | (uint8_t)n;
+		memset(queue + queued, 0, n);
+		queued += n;
+		readcnt -= n;
+	}
+}
 
-		writearr += n_write;
-		writecnt -= n_write;
+static int flush_queue(void)
+{
+	unsigned int i, j;
+	int ret;
+
+	if (queued && ftdi_write_data(&ftdic, queue, queued) < 0) {
+		msg_perr("USB-Blaster write failed\n");
+		queued = pending_read = num_dests = 0;
+		return -1;
 	}
+	queued = 0;
+
+	for (i = 0; i < num_dests; i++) {
+		unsigned char *buf = dests[i].buf;
+		unsigned int len = dests[i].len;
+
+		while (len) {
+			ret = ftdi_read_data(&ftdic, buf, len);
+			if (ret < 0) {
+				msg_perr("USB-Blaster read failed\n");
+				pending_read = num_dests = 0;
+				return -1;
+			}
+			for (j = 0; j < ret; j++)
+				buf[j] = reverse(buf[j]);
+			buf += ret;
+			len -= ret;
+		}
+	}
+	pending_read = num_dests = 0;
 	return 0;
 }
 
-static int send_read(unsigned int readcnt, unsigned char *readarr)
+/* Reads longer than MAX_PENDING_READ keep CS# asserted and are fetched a window at a time. */
+static int stream_command(unsigned int writecnt, unsigned int readcnt, const unsigned char *writearr,
+			  unsigned char *readarr)
 {
-	int i;
-	unsigned int n_read;
-	uint8_t buf[BUF_SIZE];
-	memset(buf, 0, sizeof(buf));
-
-	n_read = readcnt;
-	while (n_read) {
-		unsigned int payload_size = min(n_read, BUF_SIZE - 1);
-		msg_pspew("reading %d-byte packet\n", payload_size);
+	unsigned int n;
 
-		buf[0] = BIT_BYTE | BIT_READ | (uint8_t)payload_size;
-		if (ftdi_write_data(&ftdic, buf, payload_size + 1) < 0) {
-			msg_perr("USB-Blaster write failed\n");
-			return -1;
-		}
-		n_read -= payload_size;
-	};
-
-	n_read = readcnt;
-	while (n_read) {
-		int ret = ftdi_read_data(&ftdic, readarr, n_read);
-		if (ret < 0) {
-			msg_perr("USB-Blaster read failed\n");
+	if (flush_queue())
+		return -1;
+	queue[queued++] = BIT_LED; // asserts /CS
+	queue_write(writecnt, writearr);
+	while (readcnt) {
+		n = min(readcnt, MAX_PENDING_READ);
+		queue_read(n, readarr);
+		if (flush_queue())
 			return -1;
-		}
-		for (i = 0; i < ret; i++) {
-			readarr[i] = reverse(readarr[i]);
-		}
-		n_read -= ret;
-		readarr += ret;
+		readarr += n;
+		readcnt -= n;
 	}
+	queue[queued++] = BIT_CS;
+	return 0;
+}
+
+/* Queue a complete command including asserting and deasserting CS#, flushing first if it doesn't fit. */
+static int queue_command(unsigned int writecnt, unsigned int readcnt, const unsigned char *writearr,
+			 unsigned char *readarr)
+{
+	const unsigned int size = 2 + shift_size(writecnt) + shift_size(min(readcnt, MAX_PENDING_READ));
+
+	if (size > QUEUE_SIZE)
+		return SPI_INVALID_LENGTH;
+	if (readcnt > MAX_PENDING_READ)
+		return stream_command(writecnt, readcnt, writearr, readarr);
+	if ((queued + size > QUEUE_SIZE || pending_read + readcnt > MAX_PENDING_READ ||
+	     num_dests == MAX_PENDING_DESTS) && flush_queue())
+		return -1;
+
+	queue[queued++] = BIT_LED; // asserts /CS
+	queue_write(writecnt, writearr);
+	if (readcnt)
+		queue_read(readcnt, readarr);
+	queue[queued++] = BIT_CS;
 	return 0;
 }
 
@@ -186,37 +256,33 @@ static int send_read(unsigned int readcnt, unsigned char *readarr)
 static int usbblaster_spi_send_command(struct flashctx *flash, unsigned int writecnt, unsigned int readcnt,
 				       const unsigned char *writearr, unsigned char *readarr)
 {
-	uint8_t cmd;
-	int ret = 0;
+	int ret = queue_command(writecnt, readcnt, writearr, readarr);
 
-	cmd = BIT_LED; // asserts /CS
-	if (ftdi_write_data(&ftdic, &cmd, 1) < 0) {
-		msg_perr("USB-Blaster enable chip select failed\n");
-		ret = -1;
-	}
-
-	if (!ret && writecnt)
-		ret = send_write(writecnt, writearr);
+	if (ret)
+		return ret;
+	return flush_queue();
+}
 
-	if (!ret && readcnt)
-		ret = send_read(readcnt, readarr);
+/* All commands go out in as few USB transfers as possible, only read back data forces a round trip. */
+static int usbblaster_spi_send_multicommand(struct flashctx *flash, struct spi_command *cmds)
+{
+	int ret = 0;
 
-	cmd = BIT_CS;
-	if (ftdi_write_data(&ftdic, &cmd, 1) < 0) {
-		msg_perr("USB-Blaster disable chip select failed\n");
-		ret = -1;
+	for (; !ret && (cmds->writecnt || cmds->readcnt); cmds++)
+		ret = queue_command(cmds->writecnt, cmds->readcnt, cmds->writearr, cmds->readarr);
+	if (ret) {
+		queued = pending_read = num_dests = 0;
+		return ret;
 	}
-
-	return ret;
+	return flush_queue();
 }
 
-
 static const struct spi_master spi_master_usbblaster = {
 	.type		= SPI_CONTROLLER_USBBLASTER,
-	.max_data_read	= 256,
+	.max_data_read	= MAX_DATA_READ_UNLIMITED,
 	.max_data_write	= 256,
 	.command	= usbblaster_spi_send_command,
-	.multicommand	= default_spi_send_multicommand,
+	.multicommand	= usbblaster_spi_send_multicommand,
 	.read		= default_spi_read,
 	.write_256	= default_spi_write_256,
 	.write_aai	= default_spi_write_aai,
@@ -0,0 +1,140 @@
+#!/bin/sh
+#
+# This file is part of the flashrom project.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+#
+# This script measures the throughput of the read/erase/write/verify engine
+# without hardware by writing images to chips emulated by the dummy programmer.
+# For every chip it writes three kinds of updates on top of a random image:
+#
+#   full	a completely different image
+#   scatter	every 100th page (1% of the chip) changed
+#   region	a single 64 kB region changed
+#
+# and reports the time taken, the resulting throughput relative to the chip
+# size, the number of bus transactions and the peak memory usage, as collected
+# by flashrom --stats.
+#
+# Usage: flashrom_benchmark.sh [chip...]
+
+EXIT_SUCCESS=0
+EXIT_FAILURE=1
+
+# The copy of flashrom to benchmark. If unset, we'll assume the user wants to
+# test a newly built flashrom binary in the parent directory (this script
+# should reside in flashrom/util).
+if [ -z "$FLASHROM" ] ; then
+	FLASHROM="../flashrom"
+fi
+
+# Emulated chip and the flashrom chip name to pass to -c (some IDs are shared
+# by several chips).
+ALL_CHIPS="MX25L6436:MX25L6436E/MX25L6445E/MX25L6465E/MX25L6473E W25Q128FV:W25Q128.V SST25VF032B:SST25VF032B"
+CHIPS="$ALL_CHIPS"
+if [ $# -gt 0 ] ; then
+	CHIPS=""
+	for emu in "$@" ; do
+		for c in $ALL_CHIPS ; do
+			[ "${c%%:*}" = "$emu" ] && CHIPS="$CHIPS $c"
+		done
+	done
+	if [ -z "$CHIPS" ] ; then
+		echo "No supported chip given (supported: MX25L6436 W25Q128FV SST25VF032B)"
+		exit $EXIT_FAILURE
+	fi
+fi
+
+TMPDIR=$(mktemp -d -t flashrom_benchmark.XXXXXXXXXX)
+if [ "$?" != "0" ] ; then
+	echo "Could not create temporary directory"
+	exit $EXIT_FAILURE
+fi
+trap 'rm -rf "$TMPDIR"' EXIT
+
+# chip_size <emulated chip>
+chip_size()
+{
+	case "$1" in
+	MX25L6436)	echo 8192 ;;
+	W25Q128FV)	echo 16384 ;;
+	SST25VF032B)	echo 4096 ;;
+	esac
+}
+
+# json_field <file> <field>: extract a numeric field of the "total" object
+# (or the top level one) from a --stats=json report.
+json_field()
+{
+	sed -e 's/.*"total": //' "$1" | sed -n -e "s/.*\"$2\": \([0-9]*\).*/\1/p"
+}
+
+# make_image <pattern> <old image> <new image> <size in kB>
+make_image()
+{
+	case "$1" in
+	full)
+		dd if=/dev/urandom of="$3" bs=1024 count="$4" 2>/dev/null
+		;;
+	scatter)
+		cp "$2" "$3"
+		page=0
+		while [ $page -lt $(($4 * 4)) ] ; do
+			dd if=/dev/urandom of="$3" bs=256 count=1 seek=$page conv=notrunc 2>/dev/null
+			page=$((page + 100))
+		done
+		;;
+	region)
+		cp "$2" "$3"
+		dd if=/dev/urandom of="$3" bs=65536 count=1 seek=$(($4 / 128)) conv=notrunc 2>/dev/null
+		;;
+	esac
+}
+
+printf "%-12s %-8s %10s %10s %14s %12s\n" "chip" "pattern" "time [s]" "MB/s" "transactions" "peak [kB]"
+RC=$EXIT_SUCCESS
+for c in $CHIPS ; do
+	emu="${c%%:*}"
+	name="${c#*:}"
+	size=$(chip_size "$emu")
+	dd if=/dev/urandom of="$TMPDIR/base.bin" bs=1024 count="$size" 2>/dev/null
+	for pattern in full scatter region ; do
+		make_image $pattern "$TMPDIR/base.bin" "$TMPDIR/new.bin" "$size"
+		cp "$TMPDIR/base.bin" "$TMPDIR/chip.bin"
+		if ! "$FLASHROM" -p "dummy:emulate=$emu,image=$TMPDIR/chip.bin" -c "$name" \
+				-w "$TMPDIR/new.bin" --stats="json:$TMPDIR/stats.json" \
+				>"$TMPDIR/log.txt" 2>&1 ; then
+			echo "$emu $pattern: flashrom failed, log:"
+			cat "$TMPDIR/log.txt"
+			RC=$EXIT_FAILURE
+			continue
+		fi
+		if ! cmp -s "$TMPDIR/chip.bin" "$TMPDIR/new.bin" ; then
+			echo "$emu $pattern: emulated chip contents do not match the image"
+			RC=$EXIT_FAILURE
+			continue
+		fi
+		wall_us=$(json_field "$TMPDIR/stats.json" wall_us)
+		transactions=$(json_field "$TMPDIR/stats.json" transactions)
+		peak_kb=$(json_field "$TMPDIR/stats.json" peak_memory_kb)
+		awk -v emu="$emu" -v p="$pattern" -v us="$wall_us" -v kb="$size" \
+			-v t="$transactions" -v m="$peak_kb" 'BEGIN {
+			mbs = us ? (kb / 1024) / (us / 1000000) : 0;
+			printf "%-12s %-8s %10.2f %10.2f %14d %12d\n", emu, p, us / 1000000, mbs, t, m
+		}'
+	done
+done
+
+exit $RC
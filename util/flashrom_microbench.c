@@ -0,0 +1,215 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Microbenchmarks for the loops flashrom runs over whole images on the host, independent of any programmer:
+ *
+ *	need_erase/<gran>	blank contents against a test pattern, for every write granularity
+ *	next_write/<gran>/<d>	all writes get_next_write() finds with byte and page granularity, for a sparse
+ *				(one changed byte every 64 kB) or dense (one every 512 bytes) difference
+ *	compare_range		equal buffers, as when verifying
+ *	blank_check		buf_find_nonblank() on erased contents
+ *	testpattern/<n>		generate_testpattern() variant n
+ *
+ * for buffer sizes from 64 kB up to 256 MB (or the size in kB given on the command line). Every kernel is run
+ * for at least 100 ms, the time per byte and the allocations per run are printed.
+ *
+ * Build and run it with "make microbenchmark". Counting allocations needs a linker supporting --wrap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "flash.h"
+
+#define MIN_SIZE	(64 * 1024)
+#define MAX_SIZE	(256 * 1024 * 1024)
+#define MIN_NSEC	(100 * 1000 * 1000ULL)
+
+static unsigned long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+static const struct {
+	enum write_granularity gran;
+	const char *name;
+} grans[] = {
+	{ write_gran_1bit,			"1bit" },
+	{ write_gran_1byte,			"1byte" },
+	{ write_gran_1byte_implicit_erase,	"1byte_ie" },
+	{ write_gran_128bytes,			"128bytes" },
+	{ write_gran_256bytes,			"256bytes" },
+	{ write_gran_264bytes,			"264bytes" },
+	{ write_gran_512bytes,			"512bytes" },
+	{ write_gran_528bytes,			"528bytes" },
+	{ write_gran_1024bytes,			"1024bytes" },
+	{ write_gran_1056bytes,			"1056bytes" },
+};
+
+struct bench {
+	uint8_t *have;
+	uint8_t *want;
+	unsigned int len;
+	enum write_granularity gran;
+	int variant;
+};
+
+/* The result of every run goes here, so the compiler can't drop the calls. */
+static volatile unsigned long sink;
+
+static void run_need_erase(const struct bench *b)
+{
+	sink += need_erase(b->have, b->want, b->len, b->gran);
+}
+
+static void run_next_write(const struct bench *b)
+{
+	unsigned int pos = 0, n;
+
+	while ((n = get_next_write(b->have + pos, b->want + pos, b->len - pos, &pos, b->gran)))
+		pos += n;
+	sink += pos;
+}
+
+static void run_compare_range(const struct bench *b)
+{
+	sink += compare_range(b->want, b->have, 0, b->len);
+}
+
+static void run_blank_check(const struct bench *b)
+{
+	sink += buf_find_nonblank(b->have, b->len);
+}
+
+static void run_testpattern(const struct bench *b)
+{
+	sink += generate_testpattern(b->have, b->len, b->variant);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void measure(const char *name, void (*run)(const struct bench *b), const struct bench *b)
+{
+	unsigned long runs = 0, allocs = allocations;
+	uint64_t start = now_ns(), elapsed;
+
+	do {
+		run(b);
+		runs++;
+		elapsed = now_ns() - start;
+	} while (elapsed < MIN_NSEC);
+	allocs = allocations - allocs;
+
+	printf("%-28s %7u kB %10.4f ns/byte %8.2f allocs/run\n", name, b->len / 1024,
+	       (double)elapsed / runs / b->len, (double)allocs / runs);
+}
+
+/* @want with every @step-th byte of @have flipped. */
+static void make_diff(uint8_t *want, const uint8_t *have, unsigned int len, unsigned int step)
+{
+	unsigned int i;
+
+	memcpy(want, have, len);
+	for (i = step / 2; i < len; i += step)
+		want[i] = ~have[i];
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long max_size = MAX_SIZE;
+	struct bench b = { 0 };
+	char name[64];
+	unsigned int i;
+
+	if (argc > 2 || (argc == 2 && (!(max_size = strtoul(argv[1], NULL, 0) * 1024) || max_size > MAX_SIZE))) {
+		fprintf(stderr, "Usage: %s [maximum size in kB, up to %u]\n", argv[0], MAX_SIZE / 1024);
+		return 1;
+	}
+	b.have = malloc(max_size);
+	b.want = malloc(max_size);
+	if (!b.have || !b.want) {
+		fprintf(stderr, "Out of memory!\n");
+		return 1;
+	}
+
+	for (b.len = MIN_SIZE; b.len <= max_size; b.len *= 16) {
+		for (i = 0; i < ARRAY_SIZE(grans); i++) {
+			/* Programming a blank chip, nothing stops the loops early. */
+			memset(b.have, 0xff, b.len);
+			generate_testpattern(b.want, b.len, 8);
+			b.gran = grans[i].gran;
+			snprintf(name, sizeof(name), "need_erase/%s", grans[i].name);
+			measure(name, run_need_erase, &b);
+		}
+		for (i = 0; i < ARRAY_SIZE(grans); i++) {
+			if (grans[i].gran != write_gran_1byte && grans[i].gran != write_gran_256bytes)
+				continue;
+			b.gran = grans[i].gran;
+			generate_testpattern(b.have, b.len, 8);
+			make_diff(b.want, b.have, b.len, 64 * 1024);
+			snprintf(name, sizeof(name), "next_write/%s/sparse", grans[i].name);
+			measure(name, run_next_write, &b);
+			make_diff(b.want, b.have, b.len, 512);
+			snprintf(name, sizeof(name), "next_write/%s/dense", grans[i].name);
+			measure(name, run_next_write, &b);
+		}
+		generate_testpattern(b.have, b.len, 8);
+		memcpy(b.want, b.have, b.len);
+		measure("compare_range", run_compare_range, &b);
+		memset(b.have, 0xff, b.len);
+		measure("blank_check", run_blank_check, &b);
+		for (b.variant = 0; b.variant <= 13; b.variant++) {
+			snprintf(name, sizeof(name), "testpattern/%d", b.variant);
+			measure(name, run_testpattern, &b);
+		}
+		/* Don't let the size wrap around. */
+		if (b.len > max_size / 16)
+			break;
+	}
+
+	free(b.have);
+	free(b.want);
+	return 0;
+}
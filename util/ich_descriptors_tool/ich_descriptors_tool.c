@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <dirent.h>
 #include "ich_descriptors.h"
 /* Some DJGPP builds define __unix__ although they don't support mmap().
  * Cygwin defines __unix__ and supports mmap(), but it does not work well.
@@ -38,33 +39,48 @@
 #if !defined(__MSDOS__) && !IS_WINDOWS && (defined(unix) || defined(__unix__) || defined(__unix)) || (defined(__MACH__) && defined(__APPLE__))
 #define HAVE_MMAP 1
 #include <sys/mman.h>
+/* Several images are processed by a pool of worker processes. */
+#define HAVE_WORKERS 1
+#include <poll.h>
+#include <sys/wait.h>
 #endif
 
-static void dump_file(const char *prefix, const uint32_t *dump, unsigned int len, struct ich_desc_region *reg, unsigned int i)
+static const char *const region_names[5] = {
+	"Descriptor", "BIOS", "ME", "GbE", "Platform"
+};
+
+struct options {
+	int dump;
+	int json;	/* One JSON object per image and line instead of the pretty printed text. */
+	int header;	/* Name each image in the text output. */
+	enum ich_chipset cs;
+};
+
+/* Returns 0 on success, 1 if the region couldn't be dumped. Progress goes to @msgs. */
+static int dump_file(FILE *msgs, const char *prefix, const uint32_t *dump, unsigned int len,
+		     struct ich_desc_region *reg, unsigned int i)
 {
-	int ret;
+	ssize_t ret;
 	char *fn;
 	const char *reg_name;
+	const uint8_t *data;
 	uint32_t file_len;
-	const char *const region_names[5] = {
-		"Descriptor", "BIOS", "ME", "GbE", "Platform"
-	};
 	uint32_t base = ICH_FREG_BASE(reg->FLREGs[i]);
 	uint32_t limit = ICH_FREG_LIMIT(reg->FLREGs[i]);
 
 	reg_name = region_names[i];
 	if (base > limit) {
-		printf("The %s region is unused and thus not dumped.\n", reg_name);
-		return;
+		fprintf(msgs, "The %s region is unused and thus not dumped.\n", reg_name);
+		return 0;
 	}
 
 	limit = limit | 0x0fff;
 	file_len = limit + 1 - base;
 	if (base + file_len > len) {
-		printf("The %s region is spanning 0x%08x-0x%08x, but it is "
+		fprintf(msgs, "The %s region is spanning 0x%08x-0x%08x, but it is "
 		       "not (fully) included in the image (0-0x%08x), thus not "
 		       "dumped.\n", reg_name, base, limit, len - 1);
-		return;
+		return 0;
 	}
 
 	fn = malloc(strlen(prefix) + strlen(reg_name) + strlen(".bin") + 2);
@@ -74,42 +90,424 @@ static void dump_file(const char *prefix, const uint32_t *dump, unsigned int len
 	}
 	snprintf(fn, strlen(prefix) + strlen(reg_name) + strlen(".bin") + 2,
 		 "%s.%s.bin", prefix, reg_name);
-	printf("Dumping %u bytes of the %s region from 0x%08x-0x%08x to %s... ",
-	       file_len, region_names[i], base, limit, fn);
-	int fh = open(fn, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+	fprintf(msgs, "Dumping %u bytes of the %s region from 0x%08x-0x%08x to %s... ",
+		file_len, region_names[i], base, limit, fn);
+	int fh = open(fn, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
 	if (fh < 0) {
 		fprintf(stderr,
 			"ERROR: couldn't open(%s): %s\n", fn, strerror(errno));
 		free(fn);
-		exit(1);
+		return 1;
 	}
 	free(fn);
 
-	ret = write(fh, &dump[base >> 2], file_len);
-	if (ret != file_len) {
-		fprintf(stderr, "FAILED.\n");
-		exit(1);
+	/* Straight from the mapping of the image, there is no need for a copy. */
+	data = (const uint8_t *)dump + base;
+	while (file_len) {
+		ret = write(fh, data, file_len);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			fprintf(msgs, "FAILED.\n");
+			close(fh);
+			return 1;
+		}
+		data += ret;
+		file_len -= ret;
 	}
 
-	printf("done.\n");
+	fprintf(msgs, "done.\n");
 	close(fh);
+	return 0;
 }
 
-void dump_files(const char *name, const uint32_t *buf, unsigned int len, struct ich_desc_region *reg)
+static int dump_files(FILE *msgs, const char *name, const uint32_t *buf, unsigned int len,
+		      struct ich_desc_region *reg)
 {
 	unsigned int i;
-	printf("=== Dumping region files ===\n");
+	int ret = 0;
+	fprintf(msgs, "=== Dumping region files ===\n");
 	for (i = 0; i < 5; i++)
-		dump_file(name, buf, len, reg, i);
-	printf("\n");
+		ret |= dump_file(msgs, name, buf, len, reg, i);
+	fprintf(msgs, "\n");
+	return ret;
+}
+
+static void print_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+static void print_json_straps(const char *name, const uint32_t *straps, unsigned int count)
+{
+	unsigned int i;
+
+	printf(",\"%s\":[", name);
+	for (i = 0; i < count; i++)
+		printf("%s%u", i ? "," : "", straps[i]);
+	printf("]");
+}
+
+/* The information the pretty printer shows for an image, as an object on a line of its own. */
+static void print_json(const char *fn, int len, const char *status, const struct ich_descriptors *desc,
+		       const uint8_t *mac)
+{
+	const uint32_t masters[3] = { desc->master.FLMSTR1, desc->master.FLMSTR2, desc->master.FLMSTR3 };
+	unsigned int i, count;
+
+	printf("{\"file\":");
+	print_json_string(fn);
+	printf(",\"size\":%d,\"status\":\"%s\"", len, status);
+	if (strcmp(status, "ok")) {
+		printf("}\n");
+		return;
+	}
+
+	printf(",\"regions\":[");
+	for (i = 0; i < 5; i++) {
+		uint32_t base = ICH_FREG_BASE(desc->region.FLREGs[i]);
+		uint32_t limit = ICH_FREG_LIMIT(desc->region.FLREGs[i]);
+
+		printf("%s{\"name\":\"%s\",\"used\":%s", i ? "," : "", region_names[i],
+		       base > limit ? "false" : "true");
+		if (base <= limit)
+			printf(",\"base\":%u,\"limit\":%u", base, limit | 0x0fff);
+		printf("}");
+	}
+	printf("],\"masters\":[");
+	for (i = 0; i < 3; i++)
+		printf("%s{\"requester_id\":%u,\"read\":%u,\"write\":%u}", i ? "," : "",
+		       masters[i] & 0xffff, (masters[i] >> 16) & 0x1f, (masters[i] >> 24) & 0x1f);
+	printf("]");
+
+	count = sizeof(desc->north.STRPs) / 4;
+	print_json_straps("north_straps", desc->north.STRPs,
+			  desc->content.MSL < count ? desc->content.MSL : count);
+	count = sizeof(desc->south.STRPs) / 4;
+	print_json_straps("south_straps", desc->south.STRPs,
+			  desc->content.ISL < count ? desc->content.ISL : count);
+	if (mac)
+		printf(",\"mac\":\"%02x:%02x:%02x:%02x:%02x:%02x\"",
+		       mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+	printf("}\n");
+}
+
+/* Print (and dump) what image @fn contains. Returns 0 on success. */
+static int process_image(const char *fn, const struct options *opts)
+{
+	int fd;			/* file descriptor to flash file */
+	int len;		/* file/buffer size in bytes */
+	uint32_t *buf;		/* mmap'd file */
+	uint8_t *pMAC;
+	int mapped = 0;
+	int ret;
+	struct ich_descriptors desc = {{ 0 }};
+
+	if (opts->header)
+		printf("=== %s ===\n", fn);
+	fd = open(fn, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", fn, strerror(errno));
+		return 1;
+	}
+	len = lseek(fd, 0, SEEK_END);
+	if (len < 0) {
+		fprintf(stderr, "Seeking to the end of %s failed\n", fn);
+		close(fd);
+		return 1;
+	}
+
+#ifdef HAVE_MMAP
+	buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf != (void *) -1)
+		mapped = 1;
+	else
+#endif
+	{
+		/* fallback for stupid OSes like cygwin */
+		buf = malloc(len);
+		if (!buf) {
+			fprintf(stderr, "Could not allocate memory\n");
+			close(fd);
+			return 1;
+		}
+		lseek(fd, 0, SEEK_SET);
+		if (len != read(fd, buf, len)) {
+			fprintf(stderr, "Reading %s failed\n", fn);
+			free(buf);
+			close(fd);
+			return 1;
+		}
+	}
+	close(fd);
+	if (!opts->json)
+		printf("The flash image has a size of %d [0x%x] bytes.\n", len, len);
+
+	ret = read_ich_descriptors_from_dump(buf, len, &desc);
+	switch (ret) {
+	case ICH_RET_OK:
+		break;
+	case ICH_RET_ERR:
+		if (opts->json)
+			print_json(fn, len, "not in descriptor mode", &desc, NULL);
+		else
+			printf("Image not in descriptor mode.\n");
+		ret = 1;
+		goto out;
+	case ICH_RET_OOB:
+		if (opts->json)
+			print_json(fn, len, "out of bounds", &desc, NULL);
+		else
+			printf("Tried to access a location out of bounds of the image. - Corrupt image?\n");
+		ret = 1;
+		goto out;
+	default:
+		/* Not part of the output, that stays valid JSON. */
+		fprintf(stderr, "Unhandled return value at %s:%u, please report this.\n",
+			__FILE__, __LINE__);
+		if (opts->json)
+			print_json(fn, len, "error", &desc, NULL);
+		ret = 1;
+		goto out;
+	}
+
+	pMAC = (uint8_t *) &buf[ICH_FREG_BASE(desc.region.reg3_base) >> 2];
+	if (len < ICH_FREG_BASE(desc.region.reg3_base) + 5 || pMAC[0] == 0xff)
+		pMAC = NULL;
+
+	if (opts->json) {
+		print_json(fn, len, "ok", &desc, pMAC);
+	} else {
+		prettyprint_ich_descriptors(opts->cs, &desc);
+		if (pMAC)
+			printf("The MAC address might be at offset 0x%x: "
+			       "%02x:%02x:%02x:%02x:%02x:%02x\n",
+			       ICH_FREG_BASE(desc.region.reg3_base),
+			       pMAC[0], pMAC[1], pMAC[2], pMAC[3], pMAC[4], pMAC[5]);
+	}
+
+	ret = 0;
+	/* Keep the progress messages out of machine-readable output. */
+	if (opts->dump == 1)
+		ret = dump_files(opts->json ? stderr : stdout, fn, buf, len, &desc.region);
+out:
+#ifdef HAVE_MMAP
+	if (mapped)
+		munmap(buf, len);
+	else
+#endif
+		free(buf);
+	return ret;
+}
+
+struct image_list {
+	char **names;
+	unsigned int count;
+	unsigned int capacity;
+};
+
+static void add_image(struct image_list *list, const char *name)
+{
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->names = realloc(list->names, list->capacity * sizeof(*list->names));
+		if (!list->names) {
+			fprintf(stderr, "Out of memory!\n");
+			exit(1);
+		}
+	}
+	list->names[list->count] = strdup(name);
+	if (!list->names[list->count]) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(1);
+	}
+	list->count++;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Add @path, or all regular files in it (in alphabetical order) if it is a directory. */
+static int add_path(struct image_list *list, const char *path)
+{
+	struct stat st;
+	struct dirent *entry;
+	unsigned int first = list->count;
+	char *name;
+	DIR *dir;
+
+	if (stat(path, &st) || !S_ISDIR(st.st_mode)) {
+		add_image(list, path);
+		return 0;
+	}
+	dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "Can't open directory %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	while ((entry = readdir(dir))) {
+		name = malloc(strlen(path) + strlen(entry->d_name) + 2);
+		if (!name) {
+			fprintf(stderr, "Out of memory!\n");
+			exit(1);
+		}
+		sprintf(name, "%s/%s", path, entry->d_name);
+		if (!stat(name, &st) && S_ISREG(st.st_mode))
+			add_image(list, name);
+		free(name);
+	}
+	closedir(dir);
+	qsort(list->names + first, list->count - first, sizeof(*list->names), compare_names);
+	return 0;
+}
+
+#ifdef HAVE_WORKERS
+/* Output of a worker, which ends each image's output with a NUL byte. */
+struct worker {
+	pid_t pid;
+	int fd;
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+/* Write out the output of all images the worker has finished, so the output of two images never mixes. */
+static void flush_worker_output(struct worker *w)
+{
+	char *end;
+	size_t n;
+
+	while ((end = memchr(w->buf, '\0', w->len))) {
+		n = end - w->buf;
+		fwrite(w->buf, 1, n, stdout);
+		memmove(w->buf, end + 1, w->len - n - 1);
+		w->len -= n + 1;
+	}
+	fflush(stdout);
+}
+
+/*
+ * Process the images with @jobs worker processes. They take the next image from a shared counter, so
+ * the images are spread evenly however long each takes. Returns 0 if all images were processed fine.
+ */
+static int process_images_parallel(const struct image_list *list, const struct options *opts, int jobs)
+{
+	struct worker *workers;
+	struct pollfd *fds;
+	unsigned int *next;
+	unsigned int i;
+	int j, open_fds, status, ret = 0;
+	ssize_t n;
+
+	next = mmap(NULL, sizeof(*next), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	workers = calloc(jobs, sizeof(*workers));
+	fds = calloc(jobs, sizeof(*fds));
+	if (next == (void *) -1 || !workers || !fds) {
+		fprintf(stderr, "Could not allocate memory\n");
+		exit(1);
+	}
+	*next = 0;
+	fflush(stdout);
+
+	for (j = 0; j < jobs; j++) {
+		int pipefd[2];
+
+		if (pipe(pipefd)) {
+			fprintf(stderr, "Can't create a pipe: %s\n", strerror(errno));
+			exit(1);
+		}
+		workers[j].pid = fork();
+		if (workers[j].pid < 0) {
+			fprintf(stderr, "Can't start a worker: %s\n", strerror(errno));
+			exit(1);
+		}
+		if (workers[j].pid == 0) {
+			close(pipefd[0]);
+			dup2(pipefd[1], STDOUT_FILENO);
+			close(pipefd[1]);
+			while ((i = __sync_fetch_and_add(next, 1)) < list->count) {
+				ret |= process_image(list->names[i], opts);
+				if (opts->header)
+					printf("\n");
+				putchar('\0');
+				fflush(stdout);
+			}
+			exit(ret);
+		}
+		close(pipefd[1]);
+		workers[j].fd = pipefd[0];
+	}
+
+	open_fds = jobs;
+	while (open_fds) {
+		for (j = 0; j < jobs; j++) {
+			fds[j].fd = workers[j].fd;
+			fds[j].events = POLLIN;
+		}
+		if (poll(fds, jobs, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		for (j = 0; j < jobs; j++) {
+			struct worker *w = &workers[j];
+
+			if (w->fd < 0 || !(fds[j].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			if (w->size - w->len < 4096) {
+				w->size = w->size ? w->size * 2 : 65536;
+				w->buf = realloc(w->buf, w->size);
+				if (!w->buf) {
+					fprintf(stderr, "Out of memory!\n");
+					exit(1);
+				}
+			}
+			n = read(w->fd, w->buf + w->len, w->size - w->len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				/* Whatever a crashed worker left without a terminator. */
+				fwrite(w->buf, 1, w->len, stdout);
+				close(w->fd);
+				w->fd = -1;
+				open_fds--;
+				continue;
+			}
+			w->len += n;
+			flush_worker_output(w);
+		}
+	}
+
+	for (j = 0; j < jobs; j++) {
+		if (waitpid(workers[j].pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+		free(workers[j].buf);
+	}
+	free(workers);
+	free(fds);
+	munmap(next, sizeof(*next));
+	return ret;
 }
+#endif
 
 static void usage(char *argv[], char *error)
 {
 	if (error != NULL) {
 		fprintf(stderr, "%s\n", error);
 	}
-	printf("usage: '%s -f <image file name> [-c <chipset name>] [-d]'\n\n"
+	printf("usage: '%s [-f <image file name>]... [-c <chipset name>] [-d] [-m] [-j <jobs>] [<image or directory>]...'\n\n"
 "where <image file name> points to an image of the contents of the SPI flash.\n"
 "In case the image is really in descriptor mode %s\n"
 "will pretty print some of the contained information.\n"
@@ -125,119 +523,101 @@ static void usage(char *argv[], char *error)
 "\t- \"8\" or \"lynx\" for Intel's 8 series chipsets.\n"
 "\t- \"9\" or \"wildcat\" for Intel's 9 series chipsets.\n"
 "If '-d' is specified some regions such as the BIOS image as seen by the CPU or\n"
-"the GbE blob that is required to initialize the GbE are also dumped to files.\n",
+"the GbE blob that is required to initialize the GbE are also dumped to files.\n"
+"Several images can be given, with '-f' or as further arguments. A directory\n"
+"stands for all files in it. '-j' processes them with that many worker\n"
+"processes. With '-m' the regions, masters and straps of each image are printed\n"
+"as a JSON object on a line of its own instead.\n",
 	argv[0], argv[0]);
 	exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-	int fd;			/* file descriptor to flash file */
-	int len;		/* file/buffer size in bytes */
-	uint32_t *buf;		/* mmap'd file */
-	uint8_t *pMAC;
-	int opt, ret;
+	int opt, ret = 0;
+	int jobs = 1;
+	unsigned int i;
+	char *endptr;
 
-	int dump = 0;
-	const char *fn = NULL;
 	const char *csn = NULL;
-	enum ich_chipset cs = CHIPSET_ICH_UNKNOWN;
-	struct ich_descriptors desc = {{ 0 }};
+	struct options opts = { 0 };
+	struct image_list images = { 0 };
 
-	while ((opt = getopt(argc, argv, "df:c:")) != -1) {
+	opts.cs = CHIPSET_ICH_UNKNOWN;
+	while ((opt = getopt(argc, argv, "df:c:mj:")) != -1) {
 		switch (opt) {
 		case 'd':
-			dump = 1;
+			opts.dump = 1;
 			break;
 		case 'f':
-			fn = optarg;
+			if (add_path(&images, optarg))
+				ret = 1;
 			break;
 		case 'c':
 			csn = optarg;
 			break;
+		case 'm':
+			opts.json = 1;
+			break;
+		case 'j':
+			jobs = strtol(optarg, &endptr, 10);
+			if (*endptr || jobs < 1)
+				usage(argv, "The number of jobs has to be a positive number.");
+			break;
 		default: /* '?' */
 			usage(argv, NULL);
 		}
 	}
-	if (fn == NULL)
+	for (; optind < argc; optind++)
+		if (add_path(&images, argv[optind]))
+			ret = 1;
+	if (images.count == 0)
 		usage(argv, "Need the file name of a descriptor image to read from.");
 
-	fd = open(fn, O_RDONLY);
-	if (fd < 0)
-		usage(argv, "No such file");
-	len = lseek(fd, 0, SEEK_END);
-	if (len < 0)
-		usage(argv, "Seeking to the end of the file failed");
-
-#ifdef HAVE_MMAP
-	buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (buf == (void *) -1)
-#endif
-	{
-		/* fallback for stupid OSes like cygwin */
-		buf = malloc(len);
-		if (!buf)
-			usage(argv, "Could not allocate memory");
-		lseek(fd, 0, SEEK_SET);
-		if (len != read(fd, buf, len))
-			usage(argv, "Seeking to the end of the file failed");
-	}
-	printf("The flash image has a size of %d [0x%x] bytes.\n", len, len);
-	close(fd);
-
 	if (csn != NULL) {
 		if (strcmp(csn, "ich8") == 0)
-			cs = CHIPSET_ICH8;
+			opts.cs = CHIPSET_ICH8;
 		else if (strcmp(csn, "ich9") == 0)
-			cs = CHIPSET_ICH9;
+			opts.cs = CHIPSET_ICH9;
 		else if (strcmp(csn, "ich10") == 0)
-			cs = CHIPSET_ICH10;
+			opts.cs = CHIPSET_ICH10;
 		else if ((strcmp(csn, "5") == 0) ||
 			 (strcmp(csn, "ibex") == 0))
-			cs = CHIPSET_5_SERIES_IBEX_PEAK;
+			opts.cs = CHIPSET_5_SERIES_IBEX_PEAK;
 		else if ((strcmp(csn, "6") == 0) ||
 			 (strcmp(csn, "cougar") == 0))
-			cs = CHIPSET_6_SERIES_COUGAR_POINT;
+			opts.cs = CHIPSET_6_SERIES_COUGAR_POINT;
 		else if ((strcmp(csn, "7") == 0) ||
 			 (strcmp(csn, "panther") == 0))
-			cs = CHIPSET_7_SERIES_PANTHER_POINT;
+			opts.cs = CHIPSET_7_SERIES_PANTHER_POINT;
 		else if ((strcmp(csn, "8") == 0) ||
 			 (strcmp(csn, "lynx") == 0))
-			cs = CHIPSET_8_SERIES_LYNX_POINT;
+			opts.cs = CHIPSET_8_SERIES_LYNX_POINT;
 		else if ((strcmp(csn, "silvermont") == 0))
-			cs = CHIPSET_BAYTRAIL;
+			opts.cs = CHIPSET_BAYTRAIL;
 		else if ((strcmp(csn, "9") == 0) ||
 			 (strcmp(csn, "wildcat") == 0))
-			cs = CHIPSET_9_SERIES_WILDCAT_POINT;
+			opts.cs = CHIPSET_9_SERIES_WILDCAT_POINT;
 	}
+	opts.header = images.count > 1 && !opts.json;
 
-	ret = read_ich_descriptors_from_dump(buf, len, &desc);
-	switch (ret) {
-	case ICH_RET_OK:
-		break;
-	case ICH_RET_ERR:
-		printf("Image not in descriptor mode.\n");
-		exit(1);
-	case ICH_RET_OOB:
-		printf("Tried to access a location out of bounds of the image. - Corrupt image?\n");
-		exit(1);
-	default:
-		printf("Unhandled return value at %s:%u, please report this.\n",
-		       __FILE__, __LINE__);
-		exit(1);
+#ifdef HAVE_WORKERS
+	if (jobs > 1 && images.count > 1) {
+		if (jobs > images.count)
+			jobs = images.count;
+		ret |= process_images_parallel(&images, &opts, jobs);
+	} else
+#endif
+	{
+		for (i = 0; i < images.count; i++) {
+			ret |= process_image(images.names[i], &opts);
+			if (opts.header)
+				printf("\n");
+		}
 	}
 
-	prettyprint_ich_descriptors(cs, &desc);
-
-	pMAC = (uint8_t *) &buf[ICH_FREG_BASE(desc.region.reg3_base) >> 2];
-	if (len >= ICH_FREG_BASE(desc.region.reg3_base) + 5 && pMAC[0] != 0xff)
-		printf("The MAC address might be at offset 0x%x: "
-		       "%02x:%02x:%02x:%02x:%02x:%02x\n",
-		       ICH_FREG_BASE(desc.region.reg3_base),
-		       pMAC[0], pMAC[1], pMAC[2], pMAC[3], pMAC[4], pMAC[5]);
-
-	if (dump == 1)
-		dump_files(fn, buf, len, &desc.region);
-
-	return 0;
+	for (i = 0; i < images.count; i++)
+		free(images.names[i]);
+	free(images.names);
+	return ret;
 }